@@ -23,12 +23,6 @@ namespace eval twapi {
         11 logonsession
     }
 
-    # Cache mapping account names to SIDs. Dict keyed by system and name
-    variable _name_to_sid_cache {}
-
-    # Cache mapping SIDs to account names. Dict keyed by system and SID
-    variable _sid_to_name_cache {}
-
     # Dictionary of FFI libraries to handles and back
     variable _ffi_paths {}
     variable _ffi_handles {}
@@ -820,13 +814,6 @@ proc twapi::_make_secattr {secd inherit} {
 
 # Returns the sid, domain and type for an account
 proc twapi::lookup_account_name {name args} {
-    variable _name_to_sid_cache
-
-    # Fast path - no options specified and cached
-    if {[llength $args] == 0 && [dict exists $_name_to_sid_cache "" $name]} {
-        return [lindex [dict get $_name_to_sid_cache "" $name] 0]
-    }
-
     array set opts [parseargs args \
                         [list all \
                              sid \
@@ -835,23 +822,22 @@ proc twapi::lookup_account_name {name args} {
                              [list system.arg ""]\
                             ]]
 
-    if {! [dict exists $_name_to_sid_cache $opts(system) $name]} {
-        dict set _name_to_sid_cache $opts(system) $name [LookupAccountName $opts(system) $name]
-    }    
-    lassign [dict get $_name_to_sid_cache $opts(system) $name] sid domain type
+    # Lookups go through the resolver which caches results
+    lassign [Twapi_AccountResolve 1 $opts(system) [list $name]] status data
+    if {$status != 0} {
+        if {$name eq ""} {
+            win32_error $status "Empty string passed for account name."
+        }
+        win32_error $status "Error looking up account name: "
+    }
+    lassign $data sid domain type
 
     set result [list ]
     if {$opts(all) || $opts(domain)} {
         lappend result -domain $domain
     }
     if {$opts(all) || $opts(type)} {
-        variable sid_type_names
-        if {[info exists sid_type_names($type)]} {
-            lappend result -type $sid_type_names($type)
-        } else {
-            # Could be the "logonid" dummy type we added above
-            lappend result -type $type
-        }
+        lappend result -type [_account_type_name $type]
     }
 
     if {$opts(all) || $opts(sid)} {
@@ -869,13 +855,6 @@ proc twapi::lookup_account_name {name args} {
 
 # Returns the name, domain and type for an account
 proc twapi::lookup_account_sid {sid args} {
-    variable _sid_to_name_cache
-
-    # Fast path - no options specified and cached
-    if {[llength $args] == 0 && [dict exists $_sid_to_name_cache "" $sid]} {
-        return [lindex [dict get $_sid_to_name_cache "" $sid] 0]
-    }
-
     array set opts [parseargs args \
                         [list all \
                              name \
@@ -884,40 +863,20 @@ proc twapi::lookup_account_sid {sid args} {
                              [list system.arg ""]\
                             ]]
 
-    if {[dict exists $_sid_to_name_cache $opts(system) $sid]} {
-        lassign [dict get $_sid_to_name_cache $opts(system) $sid] name domain type
-    } else {
-        # Not in cache. Need to look up
-
-        trap {
-            set data [LookupAccountSid $opts(system) $sid]
-            lassign $data name domain type
-        } onerror {TWAPI_WIN32 1332} {
-            # Win10 resolves this, Win7 does not. Emulate Win10
-            if {![string match -nocase "S-1-5-5-*" $sid]} {
-                rethrow
-            }
-            # Name is formed similar to how Win10 does it
-            set name "LogonSessionId_[string map {- _} [string range $sid 8 end]]"
-            set domain "NT AUTHORITY"
-            set type 11
-            set data [list $name $domain $type]
-        }
-        dict set _sid_to_name_cache $opts(system) $sid $data
+    # Lookups go through the resolver which caches results
+    lassign [Twapi_AccountResolve 0 $opts(system) [list $sid]] status data
+    set data [_account_data 0 $sid $status $data]
+    if {[llength $data] == 0} {
+        win32_error $status "Error looking up account SID: "
     }
-
+    lassign $data name domain type
 
     set result [list ]
     if {$opts(all) || $opts(domain)} {
         lappend result -domain $domain
     }
     if {$opts(all) || $opts(type)} {
-        variable sid_type_names
-        if {[info exists sid_type_names($type)]} {
-            lappend result -type $sid_type_names($type)
-        } else {
-            lappend result -type $type
-        }
+        lappend result -type [_account_type_name $type]
     }
 
     if {$opts(all) || $opts(name)} {
@@ -932,6 +891,123 @@ proc twapi::lookup_account_sid {sid args} {
     return $result
 }
 
+# Returns a dictionary mapping each SID in $sids to its account name.
+# SIDs that cannot be resolved are left out. All SIDs not in the cache
+# are translated together in as few calls as possible.
+proc twapi::lookup_account_sids {sids args} {
+    array set opts [parseargs args {
+        all
+        flushcache
+        {system.arg ""}
+        async.arg
+    } -maxleftover 0]
+
+    return [_lookup_accounts 0 $sids [array get opts]]
+}
+
+# Returns a dictionary mapping each name in $names to its SID. Names
+# that cannot be resolved are left out.
+proc twapi::lookup_account_names {names args} {
+    array set opts [parseargs args {
+        all
+        flushcache
+        {system.arg ""}
+        async.arg
+    } -maxleftover 0]
+
+    return [_lookup_accounts 1 $names [array get opts]]
+}
+
+proc twapi::_lookup_accounts {kind accounts optlist} {
+    array set opts $optlist
+
+    if {$opts(flushcache)} {
+        Twapi_AccountResolverForget $kind $opts(system) $accounts
+    }
+
+    if {[info exists opts(async)]} {
+        if {[llength $accounts] == 0} {
+            return
+        }
+        variable _account_resolve_scripts
+        set id [Twapi_AccountResolveAsync $kind $opts(system) $accounts]
+        set _account_resolve_scripts($id) \
+            [list $kind $opts(all) $opts(async) [llength $accounts]]
+        return
+    }
+
+    set result [dict create]
+    foreach account $accounts {status data} [Twapi_AccountResolve $kind $opts(system) $accounts] {
+        set data [_account_data $kind $account $status $data]
+        if {[llength $data]} {
+            dict set result $account [_account_value $kind $data $opts(all)]
+        }
+    }
+    return $result
+}
+
+# Called from the resolver with the result for each account of an
+# asynchronous lookup_account_sids or lookup_account_names
+proc twapi::_account_resolve_handler {id account status result} {
+    variable _account_resolve_scripts
+
+    if {![info exists _account_resolve_scripts($id)]} {
+        # Batch failed to be submitted completely. Ignore
+        return
+    }
+    lassign $_account_resolve_scripts($id) kind all script remaining
+    if {[incr remaining -1] == 0} {
+        unset _account_resolve_scripts($id)
+    } else {
+        lset _account_resolve_scripts($id) 3 $remaining
+    }
+
+    if {$status eq "success"} {
+        set data [_account_data $kind $account 0 $result]
+    } else {
+        set data [_account_data $kind $account $result {}]
+    }
+    if {[llength $data]} {
+        set status success
+        set result [_account_value $kind $data $all]
+    }
+    uplevel #0 [linsert $script end $account $status $result]
+}
+
+# Returns the {NAME|SID DOMAIN TYPE} data for a resolver result or an
+# empty list if the account could not be resolved
+proc twapi::_account_data {kind account status data} {
+    if {$status == 0} {
+        return $data
+    }
+    if {$kind == 0 && $status == 1332 &&
+        [string match -nocase "S-1-5-5-*" $account]} {
+        # Win10 resolves logon session SIDs, Win7 does not. Emulate Win10.
+        # Name is formed similar to how Win10 does it
+        return [list \
+                    "LogonSessionId_[string map {- _} [string range $account 8 end]]" \
+                    "NT AUTHORITY" 11]
+    }
+    return {}
+}
+
+proc twapi::_account_value {kind data all} {
+    if {! $all} {
+        return [lindex $data 0]
+    }
+    lassign $data value domain type
+    return [list [expr {$kind == 0 ? "-name" : "-sid"}] $value \
+                -domain $domain -type [_account_type_name $type]]
+}
+
+proc twapi::_account_type_name {type} {
+    variable sid_type_names
+    if {[info exists sid_type_names($type)]} {
+        return $sid_type_names($type)
+    }
+    return $type
+}
+
 # Returns the sid for a account - may be given as a SID or name
 proc twapi::map_account_to_sid {account args} {
     array set opts [parseargs args {system.arg} -nulldefault]
@@ -1688,8 +1764,25 @@ proc twapi::_parse_ctype {def parse_mode} {
         {^LPCWSTR$} -
         {^LPWSTR$} -
         {^WCHAR\s*\*$} {set type lpwstr}
-        {^HANDLE$} {set type handle}
+        {^HANDLE$} -
+        {^FARPROC$} -
+        {^LPVOID$} -
+        {^PVOID$} -
+        {^void\s*\*$} {set type handle}
         {^PSID$} {set type psid}
+        {^struct\s+([[:alnum:]_]+)\s*\*$} {
+            # Pointer to struct. Only supported for parameters where
+            # the struct value is marshalled into temporary storage.
+            if {$parse_mode ne "param"} {
+                error "Structure pointers only allowed for parameters."
+            }
+            set child_name [lindex $matchvar 1]
+            if {![info exists _struct_defs($child_name)]} {
+                error "Unknown struct $child_name"
+            }
+            set child $_struct_defs($child_name)
+            set type struct
+        }
         {^struct\s+([[:alnum:]_]+)$} {
             if {$parse_mode ne "struct"} {
                 error "Structure types not allowed for parameters and return values."
@@ -1788,10 +1881,34 @@ proc twapi::struct {struct_name s} {
         }
     } [list $l]]
     uplevel 1 [list proc $struct_name args $proc_body]
+    # Drop the compiled layout of a definition being replaced
+    if {[info exists _struct_defs($struct_name)] &&
+        $_struct_defs($struct_name) ne $l} {
+        cstruct_forget $_struct_defs($struct_name)
+    }
     set _struct_defs($struct_name) $l
     return
 }
 
+# Returns a command that gives access to fields of an array of C structs
+# held in a binary string, or with -pointer, at a memory address.
+# Fields are only decoded when accessed.
+proc twapi::cstruct_view {struct data args} {
+    variable _cstruct_view_counter
+
+    array set opts [parseargs args {
+        {offset.int 0}
+        {count.int -1}
+        {stride.int 0}
+        {pointer.bool 0}
+    } -maxleftover 0]
+
+    set cmd [namespace current]::cview#[incr _cstruct_view_counter]
+    cstruct_view_create $cmd $struct $data \
+        $opts(offset) $opts(count) $opts(stride) $opts(pointer)
+    return $cmd
+}
+
 
 proc twapi::ffi_load {path} {
     variable _ffi_paths
@@ -1832,6 +1949,12 @@ proc twapi::ffi_unload {h} {
 
     dict with _ffi_handles $h {
         if {[incr NRefs -1] <= 0} {
+            # Delete the callables bound to functions in the library
+            if {[info exists Callables]} {
+                foreach cmd $Callables {
+                    catch {rename $cmd {}}
+                }
+            }
             dict unset _ffi_paths $Path
             dict unset _ffi_handles $h
         }
@@ -1855,55 +1978,47 @@ proc twapi::ffi_cfuncs {dllh cprotos {ns ::}} {
     }
     set cprotos $l
 
-    set def {
-        proc %NAME% {%PARAMNAMES%} {
-            if {![dict exists $%TWAPINS%::_ffi_handles %DLLH%]} {
-                error "Attempt to call function in unloaded library."
-            }
-            %TWAPINS%::%CALL% %FNADDR% %FNTYPE% %PARAMS% [list %PARAMREFS%]
-        }
-    }
-
-    if {$::tcl_platform(pointerSize) == 8} {
-        # Win64 has single calling convention
-        set callmap {"" ffi_call _cdecl ffi_call _stdcall ffi_call}
-    } else {
-        set callmap {"" ffi_call _cdecl ffi_call _stdcall ffi_stdcall}
-    } 
+    # Win64 has single calling convention which ffi_callable
+    # maps _stdcall to as well
+    set callmap {"" cdecl _cdecl cdecl _stdcall stdcall}
 
     foreach cproto $cprotos {
         lassign $cproto callconv fntype fnname params
-        set call [dict get $callmap $callconv]
-            
         set fnaddr [GetProcAddress $dllh $fnname]
         if {[pointer_null? $fnaddr]} {
             error "Entry point $fnname not found in shared library."
         }
-        set paramnames {}
-        set paramrefs {}
-        foreach arg $params {
-            set name [lindex $arg 0]
-            lappend paramnames $name
-            lappend paramrefs \$$name
-        }
 
-        # Note that fntype is doubly listified because the C ffi expects
-        # it in same format as params, ie. a list of type definitions
-        # _parse_cproto however returns it as a single type definition
-        append defs [string map [list \
-                                     %CALL%    $call \
-                                     %DLLH%    [list $dllh] \
-                                     %NAME%    ${ns}::$fnname \
-                                     %PARAMNAMES% [join $paramnames { }] \
-                                     %PARAMREFS% [join $paramrefs { }] \
-                                     %TWAPINS% [namespace current] \
-                                     %FNADDR%  [list $fnaddr] \
-                                     %FNTYPE%  [list [list $fntype]] \
-                                     %PARAMS%  [list $params]] \
-                         $def] \n
+        # Each function is bound to a callable command that precomputes
+        # the argument marshalling. Note that fntype is listified because
+        # the C ffi expects it in same format as params, ie. a list of
+        # type definitions.
+        uplevel 1 [list [namespace current]::ffi_callable ${ns}::$fnname \
+                       $fnaddr [list $fntype] $params \
+                       [dict get $callmap $callconv]]
+        if {[dict exists $_ffi_handles $dllh]} {
+            dict update _ffi_handles $dllh dllinfo {
+                dict lappend dllinfo Callables \
+                    [uplevel 1 [list namespace which -command ${ns}::$fnname]]
+            }
+        }
     }
-    
-    uplevel 1 $defs 
+    return
+}
+
+# Returns a C function pointer that invokes $script when called. cproto
+# is a C prototype as accepted by ffi_cfuncs. The function name is ignored.
+# The parameters are appended to $script as arguments and the script
+# result is returned as the function's return value.
+proc twapi::ffi_callback {cproto script args} {
+    array set opts [parseargs args {
+        {timeout.int -1}
+    } -maxleftover 0]
+
+    lassign [_parse_cproto $cproto] callconv fntype fnname params
+    return [ffi_callback_create [list $fntype] $params $script \
+                [dict get {"" cdecl _cdecl cdecl _stdcall stdcall} $callconv] \
+                $opts(timeout)]
 }
 
 
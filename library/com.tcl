@@ -644,6 +644,93 @@ proc twapi::generate_code_from_typelib {path args} {
 
 
 
+# Writes the dispatch prototypes from a type library to a cache file
+# that can later be loaded with typelib_cache_load
+proc twapi::typelib_cache_write {path cachefile} {
+    set tl [ITypeLibProxy_from_path $path -registration none]
+    trap {
+        set libattr [$tl @GetLibAttr -all]
+        set data [$tl @Read -type dispatch]
+    } finally {
+        $tl Release
+    }
+
+    set entries {}
+    if {[dict exists $data dispatch]} {
+        dict for {guid guiddata} [dict get $data dispatch] {
+            foreach type {methods properties} {
+                if {![dict exists $guiddata -$type]} continue
+                dict for {name namedata} [dict get $guiddata -$type] {
+                    dict for {lcid lciddata} $namedata {
+                        dict for {invkind proto} $lciddata {
+                            lappend entries $guid $name $lcid \
+                                [_string_to_invkind $invkind] $proto
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    Twapi_TypeLibCacheWrite [file nativename $cachefile] \
+        [list [dict get $libattr -guid] \
+             [dict get $libattr -majorversion] \
+             [dict get $libattr -minorversion] \
+             [dict get $libattr -lcid]] \
+        $entries
+    return [expr {[llength $entries] / 5}]
+}
+
+# Maps a cache file written by typelib_cache_write and adds it to
+# the sources consulted for dispatch prototypes.
+proc twapi::typelib_cache_load {cachefile} {
+    variable _typelib_caches
+    lassign [Twapi_TypeLibCacheOpen [file nativename $cachefile]] tlc guid major minor lcid
+    lappend _typelib_caches $tlc
+    return [list $tlc [list -guid $guid -majorversion $major -minorversion $minor -lcid $lcid]]
+}
+
+proc twapi::typelib_cache_unload {tlc} {
+    variable _typelib_caches
+    set pos [lsearch -exact $_typelib_caches $tlc]
+    if {$pos < 0} {
+        error "Type library cache $tlc is not loaded."
+    }
+    set _typelib_caches [lreplace $_typelib_caches $pos $pos]
+    Twapi_TypeLibCacheClose $tlc
+    return
+}
+
+# Loads the prototype cache for a registered type library, building
+# it on first use. Cache files are keyed by the library GUID, version
+# and LCID so a new version of a library gets its own cache.
+proc twapi::typelib_cache_register {guid major minor args} {
+    array set opts [parseargs args {
+        lcid.int
+        cachedir.arg
+        rebuild
+    } -maxleftover 0 -nulldefault]
+
+    if {$opts(cachedir) eq ""} {
+        if {[info exists ::env(LOCALAPPDATA)]} {
+            set opts(cachedir) [file join $::env(LOCALAPPDATA) twapi tlbcache]
+        } else {
+            set opts(cachedir) [file join $::env(TEMP) twapi tlbcache]
+        }
+    }
+    set guid [canonicalize_guid $guid]
+    set cachefile [file join $opts(cachedir) \
+                       "[string trim $guid {{}}]-$major.$minor-$opts(lcid).tlc"]
+
+    if {$opts(rebuild) || ![file exists $cachefile]} {
+        file mkdir $opts(cachedir)
+        typelib_cache_write [get_typelib_path_from_guid $guid $major $minor -lcid $opts(lcid)] $cachefile
+    }
+
+    return [lindex [typelib_cache_load $cachefile] 0]
+}
+
+
 proc twapi::_interface_text {ti} {
     # ti must be TypeInfo for an interface or module (or enum?) - TBD
     set desc ""
@@ -1289,6 +1376,10 @@ namespace eval twapi {
     
     variable _dispatch_prototype_cache
     array set _dispatch_prototype_cache {}
+
+    # List of handles to memory mapped prototype caches built from
+    # type libraries. These are consulted on a miss in the above cache.
+    variable _typelib_caches {}
 }
 
 
@@ -1302,6 +1393,17 @@ proc twapi::dispatch_prototype_get {guid name lcid invkind vproto} {
         set proto $_dispatch_prototype_cache($guid,$name,$lcid,$invkind)
         return 1
     }
+
+    variable _typelib_caches
+    foreach tlc $_typelib_caches {
+        set found [Twapi_TypeLibCacheLookup $tlc $guid $name $lcid $invkind]
+        if {[llength $found]} {
+            upvar 1 $vproto proto
+            set proto [lindex $found 0]
+            set _dispatch_prototype_cache($guid,$name,$lcid,$invkind) $proto
+            return 1
+        }
+    }
     return 0
 }
 
@@ -3707,6 +3809,59 @@ twapi::class create ::twapi::Automation {
         return
     }
 
+    # Like -iterate but VARNAME is set to a recordarray containing
+    # the values of PROPERTIES for a batch of items. Items are
+    # prefetched on a background thread.
+    method -iteraterecords {args} {
+        my variable _lcid
+
+        array set opts [::twapi::parseargs args {
+            {batchsize.int 500}
+            {timeout.int -1}
+        }]
+
+        if {[llength $args] != 3} {
+            error "Syntax: COMOBJ -iteraterecords ?options? PROPERTIES VARNAME SCRIPT"
+        }
+        lassign $args properties varname script
+        upvar 1 $varname var
+
+        set enumerator [my -get _NewEnum]
+        ::twapi::trap {
+            set iter [$enumerator QueryInterface IEnumVARIANT]
+            set henum [::twapi::Twapi_ComEnumOpen $iter $properties $opts(batchsize) $_lcid]
+            # The iterator holds its own marshalled reference
+            ::twapi::IUnknown_Release $iter
+            unset iter
+            set more 1
+            while {$more} {
+                lassign [::twapi::Twapi_ComEnumNext $henum $opts(timeout)] more var
+                if {[::twapi::recordarray size $var] == 0} {
+                    continue
+                }
+                set ret [catch {uplevel 1 $script} msg options]
+                switch -exact -- $ret {
+                    0 -
+                    4 {}
+                    3 { break }
+                    default {
+                        dict incr options -level
+                        return -options $options $msg
+                    }
+                }
+            }
+        } finally {
+            if {[info exists henum]} {
+                ::twapi::Twapi_ComEnumClose $henum
+            }
+            if {[info exists iter]} {
+                ::twapi::IUnknown_Release $iter
+            }
+            $enumerator Release
+        }
+        return
+    }
+
     method -bind {script} {
         my variable   _proxy   _sinks    _connection_pts
 
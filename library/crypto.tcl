@@ -378,6 +378,10 @@ proc twapi::cert_store_enum_contents {hstore {hcert NULL}} {
     return [CertEnumCertificatesInStore $hstore $hcert]
 }
 
+proc twapi::cert_store_records {hstore} {
+    return [Twapi_CertStoreRecords $hstore]
+}
+
 proc twapi::cert_store_add_certificate {hstore hcert args} {
     array set opts [_cert_add_parseargs args]
     return [CertAddCertificateContextToStore $hstore $hcert $opts(disposition)]
@@ -781,11 +785,19 @@ proc twapi::cert_create {subject pubkey cissuer args} {
 
 # TBD - test
 proc twapi::cert_chain_build {hcert args} {
+    lassign [_cert_chain_params $args] engine timestamp hstore chainpara flags
+    return [CertGetCertificateChain \
+                [dict* {user NULL machine {1 HCERTCHAINENGINE}} $engine] \
+                $hcert $timestamp $hstore $chainpara $flags]
+}
+
+# Returns {ENGINE TIMESTAMP HSTORE CHAINPARA FLAGS} for the chain options
+proc twapi::_cert_chain_params {optargs} {
     # -timestamp not documented because not clear exactly how it behaves
     # -disablepass1*, -returnlower* not documented because not clear how
     # useful.
     # TBD - what about CERT_CHAIN_REVOCATION_ACCUMULATIVE_TIMEOUT 
-    parseargs args {
+    parseargs optargs {
         {cacheendcert.bool 0 0x1}
         {disableauthrootautoupdate.bool 0 0x100}
         {disablepass1qualityfiltering.bool 0 0x40}
@@ -816,10 +828,7 @@ proc twapi::cert_chain_build {hcert args} {
         set usage {}
     }
 
-    return [CertGetCertificateChain \
-                [dict* {user NULL machine {1 HCERTCHAINENGINE}} $engine] \
-                $hcert $timestamp $hstore \
-                [list [list $usage_op $usage]] $flags]
+    return [list $engine $timestamp $hstore [list [list $usage_op $usage]] $flags]
 }
 
 proc twapi::cert_ancestors {hcert args} {
@@ -929,12 +938,10 @@ proc twapi::_map_trust_error {errbits} {
     }]
 }
 
-proc twapi::cert_verify {hcert policy args} {
-    # TBD - should we explicitly look for nulls in the subject name?
-    # The Chrome source at
-    # https://src.chromium.org/svn/branches/455/src/net/base/x509_certificate_win.cc
-    # does this though it also uses the same calls as below. See
-    # CertSubjectCommonNameHasNull in that code.
+# Returns {POLICYID VERIFYFLAGS POLICYPARAMS CHAINARGS TRUSTEDROOTS}
+# for the cert_verify options. CHAINARGS are the remaining options to be
+# passed to cert_chain_build.
+proc twapi::_cert_verify_params {policy args} {
     set policy_id [dict! {
         authenticode 2   authenticodets 3   base 1   basicconstraints 5
         extendedvalidation 8   microsoftroot 7   ntauth 6
@@ -1047,6 +1054,21 @@ proc twapi::cert_verify {hcert policy args} {
     if {[info exists ignoreerrors] && "revocation" in $ignoreerrors} {
         lappend args -revocationcheck none
     }
+
+    if {![info exists trustedroots]} {
+        set trustedroots {}
+    }
+    return [list $policy_id $verify_flags $policyparams $args $trustedroots]
+}
+
+proc twapi::cert_verify {hcert policy args} {
+    # TBD - should we explicitly look for nulls in the subject name?
+    # The Chrome source at
+    # https://src.chromium.org/svn/branches/455/src/net/base/x509_certificate_win.cc
+    # does this though it also uses the same calls as below. See
+    # CertSubjectCommonNameHasNull in that code.
+    lassign [_cert_verify_params $policy {*}$args] \
+        policy_id verify_flags policyparams args trustedroots
     set chainh [cert_chain_build $hcert {*}$args]
 
     trap {
@@ -1143,6 +1165,76 @@ proc twapi::cert_verify {hcert policy args} {
     return $status
 }
 
+proc twapi::cert_verify_batch {hcerts policy script args} {
+    variable _cert_verify_batches
+
+    parseargs args {
+        {timeout.int 0}
+        {workers.int 8}
+    } -ignoreunknown -setvars
+
+    lassign [_cert_verify_params $policy {*}$args] \
+        policy_id verify_flags policyparams chainargs trustedroots
+    if {[llength $trustedroots]} {
+        error "Option -trustedroots is not supported for batch verification."
+    }
+    lassign [_cert_chain_params $chainargs] \
+        engine timestamp hstore chainpara chainflags
+
+    set batch [Twapi_CertVerifyBatch $hcerts [dict! {user 0 machine 1} $engine] \
+                   $timestamp $hstore $chainpara $chainflags \
+                   $policy_id [list $verify_flags $policyparams] \
+                   $timeout $workers]
+    set _cert_verify_batches($batch) $script
+    return $batch
+}
+
+proc twapi::cert_verify_batch_cancel {batch} {
+    variable _cert_verify_batches
+    if {[info exists _cert_verify_batches($batch)]} {
+        unset _cert_verify_batches($batch)
+        Twapi_CertVerifyBatchClose $batch
+    }
+    return
+}
+
+# Callback from C code
+proc twapi::_cert_verify_batch_handler {batch event args} {
+    variable _cert_verify_batches
+
+    if {![info exists _cert_verify_batches($batch)]} {
+        return;                 # Callback queued after cancel. Ignore
+    }
+    set script $_cert_verify_batches($batch)
+
+    if {$event eq "done"} {
+        unset _cert_verify_batches($batch)
+        Twapi_CertVerifyBatchClose $batch
+        return [uplevel #0 [linsert $script end $batch done]]
+    }
+
+    lassign $args index winerr trust_errors policy_status
+    # 1223 -> ERROR_CANCELLED, 1460 -> ERROR_TIMEOUT
+    switch -exact -- $winerr {
+        0 {
+            # Same precedence as cert_verify - revocation errors from
+            # the chain override the policy status
+            set chain_errors [_map_trust_error $trust_errors]
+            set status [_map_cert_verify_error $policy_status]
+            foreach err {revoked revocationoffline revocationunknown} {
+                if {$err in $chain_errors} {
+                    set status $err
+                    break
+                }
+            }
+        }
+        1223 { set status cancelled }
+        1460 { set status timeout }
+        default { set status [_map_cert_verify_error $winerr] }
+    }
+    return [uplevel #0 [linsert $script end $batch result $index $status]]
+}
+
 proc twapi::_map_cert_verify_error {err} {
     if {![string is integer -strict $err]} {
         return $err
@@ -8,13 +8,63 @@
 
 proc twapi::namedpipe_server {name args} {
     set name [file nativename $name]
+    lassign [_namedpipe_server_params $args] open_mode pipe_mode optlist
+    array set opts $optlist
 
+    return [twapi::Twapi_NPipeServer $name $open_mode $pipe_mode \
+                $opts(maxinstances) 4000 4000 $opts(timeout) \
+                [_make_secattr $opts(secd) $opts(inherit)]]
+}
+
+# Creates a pool of server instances that hands connected channels
+# to $script
+proc twapi::namedpipe_pool {name script args} {
+    variable _namedpipe_pools
+
+    set name [file nativename $name]
+    lassign [_namedpipe_server_params $args {
+        {instances.int 4}
+        {workers.int 2}
+    }] open_mode pipe_mode optlist
+    array set opts $optlist
+
+    set pool [twapi::Twapi_NPipePool $name $open_mode $pipe_mode \
+                  $opts(maxinstances) 4000 4000 $opts(timeout) \
+                  [_make_secattr $opts(secd) $opts(inherit)] \
+                  $opts(instances) $opts(workers)]
+    set _namedpipe_pools($pool) $script
+    return $pool
+}
+
+proc twapi::namedpipe_pool_close {pool} {
+    variable _namedpipe_pools
+    unset -nocomplain _namedpipe_pools($pool)
+    Twapi_NPipePoolClose $pool
+}
+
+proc twapi::namedpipe_pool_stats {pool} {
+    return [Twapi_NPipePoolStats $pool]
+}
+
+# Called from C when a pool instance is connected
+proc twapi::_namedpipe_pool_handler {pool chan} {
+    variable _namedpipe_pools
+    if {![info exists _namedpipe_pools($pool)]} {
+        close $chan
+        return
+    }
+    uplevel #0 [linsert $_namedpipe_pools($pool) end $chan]
+}
+
+# Parses the options common to namedpipe_server and namedpipe_pool.
+# Returns the open mode, pipe mode and the parsed options as a dictionary.
+proc twapi::_namedpipe_server_params {optargs {extraopts {}}} {
     # Only byte mode currently supported. Message mode does
     # not mesh well with Tcl channel infrastructure.
     # readmode.arg
     # writemode.arg
 
-    array set opts [twapi::parseargs args {
+    array set opts [twapi::parseargs optargs [concat {
         {access.arg {read write}}
         {writedacl    0  0x00040000}
         {writeowner   0  0x00080000}
@@ -25,7 +75,7 @@ proc twapi::namedpipe_server {name args} {
         {maxinstances.int 255}
         {secd.arg {}}
         {inherit.bool 0}
-    } -maxleftover 0]
+    } $extraopts] -maxleftover 0]
 
     # 0x40000000 -> OVERLAPPED I/O
     set open_mode [expr {
@@ -43,9 +93,7 @@ proc twapi::namedpipe_server {name args} {
         set pipe_mode [expr {$pipe_mode | 8}]
     }
 
-    return [twapi::Twapi_NPipeServer $name $open_mode $pipe_mode \
-                $opts(maxinstances) 4000 4000 $opts(timeout) \
-                [_make_secattr $opts(secd) $opts(inherit)]]
+    return [list $open_mode $pipe_mode [array get opts]]
 }
 
 proc twapi::namedpipe_client {name args} {
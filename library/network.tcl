@@ -27,17 +27,18 @@ namespace eval twapi {
     record IP_ADAPTER_DNS_SERVER_ADDRESS [IP_ADAPTER_ANYCAST_ADDRESS]
 }
 
+# Adapter queries are answered from a per-interpreter snapshot of
+# GetAdaptersAddresses that is only refetched when the system reports an
+# interface or address change.
 proc twapi::get_network_adapters {} {
-    # 0x20 -> SKIP_FRIENDLYNAME
-    # 0x0f -> SKIP_DNS_SERVER, SKIP_UNICAST/MULTICAST/ANYCAST
-    return [lpick [GetAdaptersAddresses 0 0x2f] [enum [IP_ADAPTER_ADDRESSES] -adaptername]]
+    return [lpick [Twapi_AdapterCacheList] [enum [IP_ADAPTER_ADDRESSES] -adaptername]]
 }
 
 proc twapi::get_network_adapters_detail {} {
     set recs {}
     # We only return fields common to all platforms
     set fields [IP_ADAPTER_ADDRESSES_XP]
-    foreach rec [GetAdaptersAddresses 0 0] {
+    foreach rec [Twapi_AdapterCacheList] {
         set rec [IP_ADAPTER_ADDRESSES set $rec \
                      -physicaladdress [_hwaddr_binary_to_string [IP_ADAPTER_ADDRESSES -physicaladdress $rec]] \
                      -unicastaddresses [ntwine [IP_ADAPTER_UNICAST_ADDRESS] [IP_ADAPTER_ADDRESSES -unicastaddresses $rec]] \
@@ -58,43 +59,80 @@ proc twapi::get_system_ipaddrs {args} {
         adaptername.arg
     } -maxleftover 0]
 
-    # 0x20 -> SKIP_FRIENDLYNAME
-    # 0x08 -> SKIP_DNS_SERVER
-    set flags 0x2f
     if {"all" in $opts(types)} {
-        set flags 0x20
+        set fields {-unicastaddresses -anycastaddresses -multicastaddresses}
     } else {
-        if {"unicast" in $opts(types)} {incr flags -1}
-        if {"anycast" in $opts(types)} {incr flags -2}
-        if {"multicast" in $opts(types)} {incr flags -4}
+        set fields {}
+        foreach type {unicast anycast multicast} {
+            if {$type in $opts(types)} {
+                lappend fields -${type}addresses
+            }
+        }
     }
 
+    set af [_ipversion_to_af $opts(ipversion)]
     set addrs {}
     trap {
-        set entries [GetAdaptersAddresses [_ipversion_to_af $opts(ipversion)] $flags]
+        if {[info exists opts(adaptername)]} {
+            set entries [Twapi_AdapterCacheLookup $opts(adaptername)]
+            if {[llength $entries]} {
+                set entries [list $entries]
+            }
+        } else {
+            set entries [Twapi_AdapterCacheList]
+        }
     } onerror {TWAPI_WIN32 232} {
         # Not installed, so no addresses
         return {}
     }
 
+    # All address record types have the address in the same position
+    set addrindex [enum [IP_ADAPTER_ANYCAST_ADDRESS] -address]
     foreach entry $entries {
-        if {[info exists opts(adaptername)] &&
-            [string compare -nocase [IP_ADAPTER_ADDRESSES -adaptername $entry] $opts(adaptername)]} {
-            continue
+        if {![_adapter_has_family $af $entry]} continue
+        foreach field $fields {
+            foreach rec [_adapter_addrs_of_family $af [IP_ADAPTER_ADDRESSES $field $entry]] {
+                lappend addrs [lindex $rec $addrindex]
+            }
         }
+    }
 
-        foreach rec [IP_ADAPTER_ADDRESSES -unicastaddresses $entry] {
-            lappend addrs [IP_ADAPTER_UNICAST_ADDRESS -address $rec]
-        }
-        foreach rec [IP_ADAPTER_ADDRESSES -anycastaddresses $entry] {
-            lappend addrs [IP_ADAPTER_ANYCAST_ADDRESS -address $rec]
+    return [lsort -unique $addrs]
+}
+
+# Returns 1 if the adapter has the protocol for address family af
+# (AF_INET or AF_INET6, 0 for either) enabled. The cache is always filled
+# for AF_UNSPEC so this matches what GetAdaptersAddresses would have
+# returned for the specific family.
+proc twapi::_adapter_has_family {af entry} {
+    switch -exact -- $af {
+        2  { set mask 0x80 }
+        23 { set mask 0x100 }
+        default { return 1 }
+    }
+    return [expr {([IP_ADAPTER_ADDRESSES -flags $entry] & $mask) != 0}]
+}
+
+# Returns the address records in recs whose address is of the address
+# family af (AF_INET or AF_INET6, 0 for all). The address is element
+# addrindex of each record or, if addrindex is empty, the -address key.
+proc twapi::_adapter_addrs_of_family {af recs {addrindex 1}} {
+    if {$af == 0} {
+        return $recs
+    }
+    set v6 [expr {$af == 23}]
+    set matches {}
+    foreach rec $recs {
+        if {$addrindex eq ""} {
+            set addr [dict get $rec -address]
+        } else {
+            set addr [lindex $rec $addrindex]
         }
-        foreach rec [IP_ADAPTER_ADDRESSES -multicastaddresses $entry] {
-            lappend addrs [IP_ADAPTER_MULTICAST_ADDRESS -address $rec]
+        if {$v6 == ([string first : $addr] >= 0)} {
+            lappend matches $rec
         }
     }
-
-    return [lsort -unique $addrs]
+    return $matches
 }
 
 # Get network related information
@@ -150,30 +188,20 @@ proc twapi::get_network_adapter_info {interface args} {
         {ipversion.arg 0}
     } -maxleftover 0 -hyphenated]
     
-    set ipversion [_ipversion_to_af $opts(-ipversion)]
+    set af [_ipversion_to_af $opts(-ipversion)]
 
-    set flags 0
-    if {! $opts(-all)} {
-        # If not asked for some fields, don't bother getting them
-        if {! $opts(-unicastaddresses)} { incr flags 0x1 }
-        if {! $opts(-anycastaddresses)} { incr flags 0x2 }
-        if {! $opts(-multicastaddresses)} { incr flags 0x4 }
-        if {! $opts(-dnsservers)} { incr flags 0x8 }
-        if {! $opts(-friendlyname)} { incr flags 0x20 }
-
-        if {$opts(-prefixes)} { incr flags 0x10 }
-    } else {
-        incr flags 0x10;        # Want prefixes also
-    }
-    
-    set entries [GetAdaptersAddresses $ipversion $flags]
-    set nameindex [enum [IP_ADAPTER_ADDRESSES] -adaptername]
-    set entry [lsearch -nocase -exact -inline -index $nameindex $entries $interface]
-    if {[llength $entry] == 0} {
+    set entry [Twapi_AdapterCacheLookup $interface]
+    if {[llength $entry] == 0 || ![_adapter_has_family $af $entry]} {
         error "No interface matching '$interface'."
     }
 
     array set result [IP_ADAPTER_ADDRESSES $entry]
+    if {$af != 0} {
+        foreach opt {-unicastaddresses -anycastaddresses -multicastaddresses -dnsservers} {
+            set result($opt) [_adapter_addrs_of_family $af $result($opt)]
+        }
+        set result(-prefixes) [_adapter_addrs_of_family $af $result(-prefixes) ""]
+    }
     if {$opts(-all) || $opts(-dhcpenabled)} {
         set result(-dhcpenabled) [expr {($result(-flags) & 0x4) != 0}]
     }
@@ -205,6 +233,59 @@ proc twapi::get_network_adapter_info {interface args} {
     return [array get result]
 }
 
+# Invoke a script whenever a network adapter is added, removed or changed.
+proc twapi::start_adapter_monitor {script} {
+    variable _adapter_monitors
+
+    set id "adapter#[TwapiId]"
+    if {![info exists _adapter_monitors] ||
+        [llength $_adapter_monitors] == 0} {
+        Twapi_AdapterCacheSubscribe 1
+    }
+
+    lappend _adapter_monitors $id $script
+    return $id
+}
+
+proc twapi::stop_adapter_monitor {monitorid} {
+    variable _adapter_monitors
+
+    if {![info exists _adapter_monitors]} {
+        return
+    }
+
+    set new_monitors {}
+    foreach {id script} $_adapter_monitors {
+        if {$id ne $monitorid} {
+            lappend new_monitors $id $script
+        }
+    }
+
+    set _adapter_monitors $new_monitors
+    if {[llength $_adapter_monitors] == 0} {
+        Twapi_AdapterCacheSubscribe 0
+    }
+}
+
+# Called from C with a list of alternating event and adapter name elements
+proc twapi::_adapter_change_handler {changes} {
+    variable _adapter_monitors
+
+    if {![info exists _adapter_monitors]} {
+        return;                 # Could have been stopped while queued
+    }
+
+    foreach {event name} $changes {
+        foreach {id script} $_adapter_monitors {
+            set code [catch {uplevel #0 [linsert $script end $event $name]} msg]
+            if {$code == 1} {
+                after 0 [list error $msg $::errorInfo $::errorCode]
+            }
+        }
+    }
+    return
+}
+
 # Get the address->h/w address table
 proc twapi::get_arp_table {args} {
     array set opts [parseargs args {
@@ -340,8 +421,8 @@ proc twapi::flush_arp_tables {args} {
     }
 }
 
-# Return the list of TCP connections
-twapi::proc* twapi::get_tcp_connections {args} {
+# Initializes the TCP state name <-> value maps
+proc twapi::_init_tcp_states {} {
     variable tcp_statenames
     variable tcp_statevalues
 
@@ -362,6 +443,11 @@ twapi::proc* twapi::get_tcp_connections {args} {
     foreach {name val} [array get tcp_statevalues] {
         set tcp_statenames($val) $name
     }
+}
+
+# Return the list of TCP connections
+twapi::proc* twapi::get_tcp_connections {args} {
+    _init_tcp_states
 } {
     variable tcp_statenames
     variable tcp_statevalues
@@ -584,6 +670,104 @@ proc twapi::get_udp_connections {args} {
     return [list $fields $conns]
 }
 
+# Returns a tracker for changes in the TCP connection table. Filtering
+# is done before any connection is converted so trackers are cheap to
+# poll even on systems with very large connection tables.
+twapi::proc* twapi::track_tcp_connections {args} {
+    _init_tcp_states
+} {
+    variable tcp_statevalues
+    variable _conn_trackers
+
+    array set opts [parseargs args {
+        {ipversion.arg 0}
+        {matchpid.int -1}
+        {matchlocalport.int -1}
+        {matchremoteport.int -1}
+        {matchstate.arg {}}
+        {initial.bool 1}
+    } -maxleftover 0]
+
+    set statemask 0
+    foreach state $opts(matchstate) {
+        if {[info exists tcp_statevalues($state)]} {
+            set state $tcp_statevalues($state)
+        } elseif {![string is integer -strict $state] ||
+                  $state < 1 || $state > 12} {
+            error "Unrecognized connection state '$state' specified for option -matchstate"
+        }
+        set statemask [expr {$statemask | (1 << $state)}]
+    }
+
+    set tracker [Twapi_ConnTrackerCreate tcp \
+                     [_ipversion_to_af $opts(ipversion)] $opts(matchpid) \
+                     $opts(matchlocalport) $opts(matchremoteport) $statemask]
+    set _conn_trackers($tracker) tcp
+    if {! $opts(initial)} {
+        # Existing connections are not to be reported
+        Twapi_ConnTrackerPoll $tracker
+    }
+    return $tracker
+}
+
+# Returns a tracker for changes in the UDP endpoint table
+proc twapi::track_udp_connections {args} {
+    variable _conn_trackers
+
+    array set opts [parseargs args {
+        {ipversion.arg 0}
+        {matchpid.int -1}
+        {matchlocalport.int -1}
+        {initial.bool 1}
+    } -maxleftover 0]
+
+    set tracker [Twapi_ConnTrackerCreate udp \
+                     [_ipversion_to_af $opts(ipversion)] $opts(matchpid) \
+                     $opts(matchlocalport) -1 0]
+    set _conn_trackers($tracker) udp
+    if {! $opts(initial)} {
+        Twapi_ConnTrackerPoll $tracker
+    }
+    return $tracker
+}
+
+# Returns a recordarray of the connections opened, closed or changed
+# since the tracker was created or last polled
+proc twapi::connection_tracker_changes {tracker} {
+    variable _conn_trackers
+    variable tcp_statenames
+
+    if {![info exists _conn_trackers($tracker)]} {
+        badargs! "Invalid connection tracker '$tracker'"
+    }
+    set changes [Twapi_ConnTrackerPoll $tracker]
+    if {$_conn_trackers($tracker) eq "udp"} {
+        return [list {-event -localaddr -localport -pid} $changes]
+    }
+
+    set recs {}
+    foreach rec $changes {
+        lassign $rec event state oldstate
+        if {[info exists tcp_statenames($state)]} {
+            lset rec 1 $tcp_statenames($state)
+        }
+        if {[info exists tcp_statenames($oldstate)]} {
+            lset rec 2 $tcp_statenames($oldstate)
+        }
+        lappend recs $rec
+    }
+    return [list {-event -state -oldstate -localaddr -localport -remoteaddr -remoteport -pid} $recs]
+}
+
+proc twapi::connection_tracker_close {tracker} {
+    variable _conn_trackers
+    if {[info exists _conn_trackers($tracker)]} {
+        Twapi_ConnTrackerClose $tracker
+        unset _conn_trackers($tracker)
+    }
+    return
+}
+
 # Terminates a TCP connection. Does not generate an error if connection
 # does not exist
 proc twapi::terminate_tcp_connections {args} {
@@ -657,7 +841,7 @@ proc twapi::flush_network_name_cache {} {}
 # IP addr -> hostname
 proc twapi::resolve_address {addr args} {
 
-    # flushcache is ignored (for backward compatibility only)
+    # flushcache only affects asynchronous lookups, which are cached
     array set opts [parseargs args {
         flushcache
         async.arg
@@ -679,6 +863,9 @@ proc twapi::resolve_address {addr args} {
     # will update the cache and then invoke the caller's script
     if {[info exists opts(async)]} {
         variable _address_handler_scripts
+        if {$opts(flushcache)} {
+            Twapi_ResolverForget 1 $addr
+        }
         set id [Twapi_ResolveAddressAsync $addr]
         set _address_handler_scripts($id) [list $addr $opts(async)]
         return ""
@@ -698,7 +885,7 @@ proc twapi::resolve_address {addr args} {
 proc twapi::resolve_hostname {name args} {
     set name [string tolower $name]
 
-    # -flushcache option ignored (for backward compat only)
+    # -flushcache only affects asynchronous lookups, which are cached
     array set opts [parseargs args {
         flushcache
         async.arg
@@ -724,7 +911,10 @@ proc twapi::resolve_hostname {name args} {
     # will update the cache and then invoke the caller's script
     if {[info exists opts(async)]} {
         variable _hostname_handler_scripts
-        set id [Twapi_ResolveHostnameAsync $name 0 $flags]
+        if {$opts(flushcache)} {
+            Twapi_ResolverForget 0 $name
+        }
+        set id [Twapi_ResolveHostnameAsync $name]
         set _hostname_handler_scripts($id) [list $opts(ipversion) $name $opts(async)]
         return ""
     }
@@ -751,6 +941,56 @@ proc twapi::resolve_hostname {name args} {
     return $addrs
 }
 
+# Resolve a list of IP addresses to host names in the background.
+# $script is invoked as for resolve_address -async, once for each address,
+# as lookups complete. Lookups run in a shared pool of threads and
+# results are cached.
+proc twapi::resolve_addresses {addrs script args} {
+    array set opts [parseargs args {
+        flushcache
+    } -maxleftover 0]
+
+    if {[llength $addrs] == 0} {
+        return
+    }
+    if {$opts(flushcache)} {
+        foreach addr $addrs {
+            Twapi_ResolverForget 1 $addr
+        }
+    }
+    variable _resolve_batch_scripts
+    set id [Twapi_ResolveBatchAsync 1 $addrs]
+    set _resolve_batch_scripts($id) [list address 0 $script [llength $addrs]]
+    return
+}
+
+# Resolve a list of host names to IP addresses in the background.
+# $script is invoked as for resolve_hostname -async, once for each name,
+# as lookups complete.
+proc twapi::resolve_hostnames {names script args} {
+    array set opts [parseargs args {
+        flushcache
+        {ipversion.arg 0}
+    } -maxleftover 0]
+
+    if {[llength $names] == 0} {
+        return
+    }
+    set lnames {}
+    foreach name $names {
+        set name [string tolower $name]
+        if {$opts(flushcache)} {
+            Twapi_ResolverForget 0 $name
+        }
+        lappend lnames $name
+    }
+    set names $lnames
+    variable _resolve_batch_scripts
+    set id [Twapi_ResolveBatchAsync 0 $names]
+    set _resolve_batch_scripts($id) [list hostname [_ipversion_to_af $opts(ipversion)] $script [llength $names]]
+    return
+}
+
 # Look up a port name
 proc twapi::port_to_service {port} {
     set name ""
@@ -966,6 +1206,41 @@ proc twapi::_hostname_resolve_handler {id status addrandports} {
     return
 }
 
+# Callback for batch resolution, called once per name
+proc twapi::_resolve_batch_handler {id name status result} {
+    variable _resolve_batch_scripts
+
+    if {![info exists _resolve_batch_scripts($id)]} {
+        # Not a batch we know of. Ignore
+        return
+    }
+    lassign $_resolve_batch_scripts($id) kind ipver script remaining
+    if {[incr remaining -1] == 0} {
+        unset _resolve_batch_scripts($id)
+    } else {
+        lset _resolve_batch_scripts($id) 3 $remaining
+    }
+
+    if {$kind eq "hostname"} {
+        set addrs {}
+        if {$status eq "success"} {
+            foreach addr $result {
+                lassign $addr ver addr
+                if {$ipver == 0 || $ipver == $ver} {
+                    lappend addrs $addr
+                }
+            }
+        } elseif {$result == 11001 || $result == 11004} {
+            # As for _hostname_resolve_handler
+            set status success
+        }
+        set result $addrs
+    }
+
+    uplevel #0 [linsert $script end $name $status $result]
+    return
+}
+
 # Return list of all TCP connections
 # Uses GetExtendedTcpTable if available, else AllocateAndGetTcpExTableFromStack
 # $level is passed to GetExtendedTcpTable and dtermines format of returned
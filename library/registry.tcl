@@ -488,3 +488,79 @@ proc twapi::reg_tree_values_raw {hkey {subkey {}}} {
     return $tree
 }
 
+
+proc twapi::reg_hive_open {path} {
+    return [Twapi_RegfOpen [file nativename [file normalize $path]]]
+}
+
+proc twapi::reg_hive_close {hive} {
+    Twapi_RegfClose $hive
+}
+
+proc twapi::reg_hive_keys {hive {subkey {}}} {
+    return [Twapi_RegfKeys $hive $subkey 0]
+}
+
+proc twapi::reg_hive_value_names {hive {subkey {}}} {
+    # 0 - value names only
+    return [Twapi_RegfValues $hive $subkey 0]
+}
+
+proc twapi::reg_hive_values {hive {subkey {}}} {
+    #  3 -> 0x1 - return data values, 0x2 - cooked data
+    return [Twapi_RegfValues $hive $subkey 3]
+}
+
+proc twapi::reg_hive_values_raw {hive {subkey {}}} {
+    return [Twapi_RegfValues $hive $subkey 1]
+}
+
+proc twapi::reg_hive_tree {hive {subkey {}} args} {
+    parseargs args {
+        {threads.int 0}
+    } -maxleftover 0 -setvars
+    return [Twapi_RegfWalk $hive $subkey $threads]
+}
+
+proc twapi::reg_hive_tree_values {hive {subkey {}} args} {
+    parseargs args {
+        {threads.int 0}
+    } -maxleftover 0 -setvars
+    return [Twapi_RegfWalk $hive $subkey $threads 3]
+}
+
+proc twapi::reg_hive_tree_values_raw {hive {subkey {}} args} {
+    parseargs args {
+        {threads.int 0}
+    } -maxleftover 0 -setvars
+    return [Twapi_RegfWalk $hive $subkey $threads 1]
+}
+
+proc twapi::reg_snapshot {hkey {subkey {}} args} {
+    # Not documented: -32bit, -64bit
+    parseargs args {
+        previous.arg
+        32bit
+        64bit
+    } -maxleftover 0 -setvars
+
+    set wow 0
+    if {$32bit} {
+        set wow [expr {$wow | 0x200}]
+    }
+    if {$64bit} {
+        set wow [expr {$wow | 0x100}]
+    }
+    if {[info exists previous]} {
+        return [Twapi_RegSnapshot $hkey $subkey $wow $previous]
+    }
+    return [Twapi_RegSnapshot $hkey $subkey $wow]
+}
+
+proc twapi::reg_snapshot_diff {old new} {
+    return [Twapi_RegSnapshotDiff $old $new]
+}
+
+proc twapi::reg_snapshot_info {snapshot} {
+    return [Twapi_RegSnapshotInfo $snapshot]
+}
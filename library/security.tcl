@@ -965,69 +965,15 @@ proc twapi::set_ace_inheritance {ace args} {
 }
 
 
-# Sort ACE's in the standard recommended Win2K order
+# Sort ACE's in the standard recommended Win2K order. All direct
+# (non-inherited) ACEs come before inherited ACEs and within each group
+# the order is deny, deny_object, deny_callback, deny_callback_object,
+# allow, allow_object, allow_compound, allow_callback,
+# allow_callback_object, audit and mandatory label ACEs and lastly alarm
+# ACEs. The sort is stable.
+# TBD - check this ordering against http://msdn.microsoft.com/en-us/library/windows/desktop/aa379298%28v=vs.85%29.aspx
 proc twapi::sort_aces {aces} {
-
-    _init_ace_type_symbol_to_code_map
-
-    foreach type [array names ::twapi::_ace_type_symbol_to_code_map] {
-        set direct_aces($type) [list ]
-        set inherited_aces($type) [list ]
-    }
-    
-    # Sort order is as follows: all direct (non-inherited) ACEs come
-    # before all inherited ACEs. Within these groups, the order should be
-    # access denied ACEs, access denied ACEs for objects/properties,
-    # access allowed ACEs, access allowed ACEs for objects/properties,
-    # TBD - check this ordering against http://msdn.microsoft.com/en-us/library/windows/desktop/aa379298%28v=vs.85%29.aspx
-    foreach ace $aces {
-        set type [get_ace_type $ace]
-        # INHERITED_ACE -> 0x10
-        if {[lindex $ace 1] & 0x10} {
-            lappend inherited_aces($type) $ace
-        } else {
-            lappend direct_aces($type) $ace
-        }
-    }
-
-    # TBD - check this order ACE's, especially audit and mandatory label
-    return [concat \
-                $direct_aces(deny) \
-                $direct_aces(deny_object) \
-                $direct_aces(deny_callback) \
-                $direct_aces(deny_callback_object) \
-                $direct_aces(allow) \
-                $direct_aces(allow_object) \
-                $direct_aces(allow_compound) \
-                $direct_aces(allow_callback) \
-                $direct_aces(allow_callback_object) \
-                $direct_aces(audit) \
-                $direct_aces(audit_object) \
-                $direct_aces(audit_callback) \
-                $direct_aces(audit_callback_object) \
-                $direct_aces(mandatory_label) \
-                $direct_aces(alarm) \
-                $direct_aces(alarm_object) \
-                $direct_aces(alarm_callback) \
-                $direct_aces(alarm_callback_object) \
-                $inherited_aces(deny) \
-                $inherited_aces(deny_object) \
-                $inherited_aces(deny_callback) \
-                $inherited_aces(deny_callback_object) \
-                $inherited_aces(allow) \
-                $inherited_aces(allow_object) \
-                $inherited_aces(allow_compound) \
-                $inherited_aces(allow_callback) \
-                $inherited_aces(allow_callback_object) \
-                $inherited_aces(audit) \
-                $inherited_aces(audit_object) \
-                $inherited_aces(audit_callback) \
-                $inherited_aces(audit_callback_object) \
-                $inherited_aces(mandatory_label) \
-                $inherited_aces(alarm) \
-                $inherited_aces(alarm_object) \
-                $inherited_aces(alarm_callback) \
-                $inherited_aces(alarm_callback_object)]
+    return [Twapi_SortAces $aces]
 }
 
 # Pretty print an ACL
@@ -1343,6 +1289,7 @@ proc twapi::get_resource_security_descriptor {restype name args} {
         mandatory_label
         all
         handle
+        binary
     }]
 
     set wanted 0
@@ -1373,6 +1320,9 @@ proc twapi::get_resource_security_descriptor {restype name args} {
         }
     }
 
+    # -binary returns the self-relative form for get_effective_access_batch
+    set suffix [expr {$opts(binary) ? "Binary" : ""}]
+
     if {$opts(handle)} {
         set restype [_map_resource_symbol_to_type $restype false]
         if {$restype == 5} {
@@ -1381,7 +1331,7 @@ proc twapi::get_resource_security_descriptor {restype name args} {
             # even though the prototype says HANDLE. Protect against this.
             error "Share resource type (share or 5) cannot be used with -handle option"
         }
-        set secd [GetSecurityInfo \
+        set secd [GetSecurityInfo$suffix \
                       [CastToHANDLE $name] \
                       $restype \
                       $wanted]
@@ -1390,7 +1340,7 @@ proc twapi::get_resource_security_descriptor {restype name args} {
         # in progress error under some conditions. If this happens
         # try getting with resource-specific API's if possible.
         trap {
-            set secd [GetNamedSecurityInfo \
+            set secd [GetNamedSecurityInfo$suffix \
                           $name \
                           [_map_resource_symbol_to_type $restype true] \
                           $wanted]
@@ -1398,6 +1348,9 @@ proc twapi::get_resource_security_descriptor {restype name args} {
             # TBD - see what other resource-specific API's there are
             if {$restype eq "share"} {
                 set secd [lindex [get_share_info $name -secd] 1]
+                if {$opts(binary)} {
+                    set secd [encode_security_descriptor $secd]
+                }
             } else {
                 # Throw the same error
                 rethrow
@@ -1409,6 +1362,75 @@ proc twapi::get_resource_security_descriptor {restype name args} {
 }
 
 
+# Returns the access rights granted to a set of accounts by one or more
+# binary security descriptors. Identical descriptors are only evaluated
+# once so this is efficient for large numbers of files etc.
+proc twapi::get_effective_access_batch {bin_secds accounts args} {
+    array set opts [parseargs args {
+        {resourcetype.arg file}
+        mapping.arg
+        {objecttype.arg ""}
+        {denyonly.arg {}}
+    } -maxleftover 0]
+
+    if {![info exists opts(mapping)]} {
+        set opts(mapping) [_generic_mapping $opts(resourcetype)]
+    }
+    return [Twapi_SecdEffectiveAccess $bin_secds \
+                [lmap acct $accounts {map_account_to_sid $acct}] \
+                [lmap acct $opts(denyonly) {map_account_to_sid $acct}] \
+                $opts(mapping) $opts(objecttype)]
+}
+
+# Returns the access rights granted to a set of accounts by a security
+# descriptor
+proc twapi::get_effective_access {secd accounts args} {
+    array set opts [parseargs args {
+        {resourcetype.arg file}
+        raw
+        binary
+    } -ignoreunknown]
+
+    if {! $opts(binary)} {
+        set secd [encode_security_descriptor $secd]
+    }
+    set mask [lindex [get_effective_access_batch [list $secd] $accounts -resourcetype $opts(resourcetype) {*}$args] 0]
+    if {$opts(raw)} {
+        return $mask
+    }
+    return [_access_mask_to_rights $mask $opts(resourcetype)]
+}
+
+# Returns the ACL a new object created under a container inherits from
+# the container's security descriptor
+proc twapi::get_inherited_acl {parent_secd args} {
+    array set opts [parseargs args {
+        {container.bool 0}
+        {owner.arg ""}
+        {group.arg ""}
+        sacl
+        {resourcetype.arg file}
+        mapping.arg
+        {objecttype.arg ""}
+        binary
+    } -maxleftover 0]
+
+    if {! $opts(binary)} {
+        set parent_secd [encode_security_descriptor $parent_secd]
+    }
+    if {![info exists opts(mapping)]} {
+        set opts(mapping) [_generic_mapping $opts(resourcetype)]
+    }
+    foreach opt {owner group} {
+        if {$opts($opt) ne ""} {
+            set opts($opt) [map_account_to_sid $opts($opt)]
+        }
+    }
+    return [Twapi_SecdInheritedAces $parent_secd $opts(sacl) \
+                $opts(container) $opts(owner) $opts(group) \
+                $opts(mapping) $opts(objecttype)]
+}
+
 # Set the specified security information for the given object
 # See http://search.cpan.org/src/TEVERETT/Win32-Security-0.50/README
 # for a good discussion even though that applies to Perl
@@ -1871,6 +1893,18 @@ proc twapi::_map_resource_symbol_to_type {sym {named true}} {
     error "Resource type '$sym' not valid"
 }
 
+# Returns the generic mapping {READ WRITE EXECUTE ALL} for a resource type
+proc twapi::_generic_mapping {restype} {
+    switch -exact -- $restype {
+        file -
+        pipe     { return {0x120089 0x120116 0x1200a0 0x1f01ff} }
+        registry { return {0x20019 0x20006 0x20019 0xf003f} }
+        service  { return {0x2008d 0x20002 0x20170 0xf01ff} }
+        raw      { return {} }
+    }
+    error "No generic mapping known for resource type '$restype'. Use the -mapping option."
+}
+
 # Valid LUID syntax
 proc twapi::_is_valid_luid_syntax luid {
     return [regexp {^[[:xdigit:]]{8}-[[:xdigit:]]{8}$} $luid]
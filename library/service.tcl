@@ -636,30 +636,12 @@ proc twapi::set_service_failure_actions {name args} {
 
 # Get status for the specified service types
 proc twapi::get_multiple_service_status {args} {
-    set service_types [list \
-                           kernel_driver \
-                           file_system_driver \
-                           adapter \
-                           recognizer_driver \
-                           user_own_process \
-                           user_share_process \
-                           win32_own_process \
-                           win32_share_process]
-    set switches [concat $service_types \
-                      [list active inactive] \
+    set switches [concat [_service_type_switches] \
+                      [list active inactive configuration {threads.int 8}] \
                       [list system.arg database.arg]]
     array set opts [parseargs args $switches -nulldefault]
 
-    set servicetype 0
-    foreach type $service_types {
-        if {$opts($type)} {
-            set servicetype [expr { $servicetype | [_map_servicetype_sym $type]}]
-        }
-    }
-    if {$servicetype == 0} {
-        # No type specified, return all
-        set servicetype 0x3f
-    }
+    set servicetype [_service_type_mask opts]
 
     set servicestate 0
     if {$opts(active)} {
@@ -674,18 +656,70 @@ proc twapi::get_multiple_service_status {args} {
     }
 
     # 4 -> SC_MANAGER_ENUMERATE_SERVICE
-    set scm [OpenSCManager $opts(system) $opts(database) 4]
+    # 5 -> SC_MANAGER_ENUMERATE_SERVICE | SC_MANAGER_CONNECT
+    set scm [OpenSCManager $opts(system) $opts(database) [expr {$opts(configuration) ? 5 : 4}]]
     trap {
         set fields {
             servicetype state controls_accepted  exitcode service_code
             checkpoint wait_hint pid serviceflags name displayname interactive 
         }
+        if {$opts(configuration)} {
+            # Configuration of each service is queried in parallel
+            lappend fields starttype errorcontrol tagid command \
+                loadordergroup account dependencies config_error
+            return [list $fields [Twapi_EnumServicesWithConfig $scm $servicetype $servicestate $opts(threads)]]
+        }
         return [list $fields [EnumServicesStatusEx $scm 0 $servicetype $servicestate __null__]]
     } finally {
         CloseServiceHandle $scm
     }
 }
 
+# Calls a script with changes in service status as notified by the SCM
+proc twapi::start_service_notifier {script args} {
+    variable _service_notifiers
+
+    set script [lrange $script 0 end]; # Verify syntactically a list
+
+    array set opts [parseargs args \
+                        [concat [_service_type_switches] \
+                             [list services.arg system.arg database.arg]] \
+                        -nulldefault -maxleftover 0]
+
+    set id [Twapi_ServiceNotifierStart $opts(system) $opts(database) \
+                [_service_type_mask opts] $opts(services)]
+    set idstr "svcnotifier#$id"
+    set _service_notifiers($idstr) [list $id $script]
+    return $idstr
+}
+
+proc twapi::stop_service_notifier {idstr} {
+    variable _service_notifiers
+
+    if {![info exists _service_notifiers($idstr)]} {
+        return
+    }
+
+    Twapi_ServiceNotifierStop [lindex $_service_notifiers($idstr) 0]
+    unset _service_notifiers($idstr)
+}
+
+# Called from C with ID changes RECORDARRAY or ID error WINERROR
+proc twapi::_service_notifier_handler {id event data} {
+    variable _service_notifiers
+
+    set idstr "svcnotifier#$id"
+    if {![info exists _service_notifiers($idstr)]} {
+        return
+    }
+    set script [lindex $_service_notifiers($idstr) 1]
+    if {$event eq "error"} {
+        # The notifier has stopped so release it
+        stop_service_notifier $idstr
+    }
+    uplevel #0 [linsert $script end $idstr $event $data]
+}
+
 
 # Get status for the dependents of the specified service
 proc twapi::get_dependent_service_status {name args} {
@@ -1084,6 +1118,33 @@ proc twapi::_map_servicetype_code {servicetype} {
     return [list $servicetype $interactive]
 }
 
+# Returns the option switches for selecting service types
+proc twapi::_service_type_switches {} {
+    return {
+        kernel_driver file_system_driver adapter recognizer_driver
+        user_own_process user_share_process
+        win32_own_process win32_share_process
+    }
+}
+
+# Returns the service type bitmask for the service type switches set in
+# the options array v_opts. If none are set, returns the mask for the
+# types included by default
+proc twapi::_service_type_mask {v_opts} {
+    upvar 1 $v_opts opts
+    set servicetype 0
+    foreach type [_service_type_switches] {
+        if {$opts($type)} {
+            set servicetype [expr { $servicetype | [_map_servicetype_sym $type]}]
+        }
+    }
+    if {$servicetype == 0} {
+        # No type specified, return all
+        set servicetype 0x3f
+    }
+    return $servicetype
+}
+
 # Map service type sym to int code
 proc twapi::_map_servicetype_sym {sym} {
     return [dict get {kernel_driver 1 file_system_driver 2 adapter 4 recognizer_driver 8 win32_own_process 16 win32_share_process 32 user_own_process 80 user_share_process 96} $sym]
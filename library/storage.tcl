@@ -598,6 +598,138 @@ proc twapi::find_file_next {token varname} {
     }
 }
 
+# Returns the entries below a directory as a recordarray. Directories are
+# read in parallel with large batched reads. With -callback, scans in the
+# background and returns an id instead.
+proc twapi::scan_file_tree {path args} {
+    variable _file_tree_scan_scripts
+
+    parseargs args {
+        {threads.int 0}
+        {batchsize.int 1000}
+        {depth.int 0}
+        {securitydescriptor.bool 0 0x1}
+        callback.arg
+    } -setvars -maxleftover 0
+
+    # Long path form so deep trees are not limited to MAX_PATH
+    set path [file nativename [file normalize $path]]
+    if {![string match {\\\\\?\\*} $path]} {
+        if {[_is_unc $path]} {
+            set path "\\\\?\\UNC\\[string range $path 2 end]"
+        } else {
+            set path "\\\\?\\$path"
+        }
+    }
+
+    if {![info exists callback]} {
+        return [Twapi_FileTreeScan $path $threads $batchsize $depth $securitydescriptor]
+    }
+    set id [Twapi_FileTreeScanAsync $path $threads $batchsize $depth $securitydescriptor]
+    set _file_tree_scan_scripts($id) $callback
+    return $id
+}
+
+# Stops a background scan. The callback is still invoked for batches
+# already read followed by an error.
+proc twapi::cancel_file_tree_scan {id} {
+    Twapi_FileTreeScanCancel $id
+    return
+}
+
+# Callback from C code
+proc twapi::_file_tree_scan_handler {id event data} {
+    variable _file_tree_scan_scripts
+    if {![info exists _file_tree_scan_scripts($id)]} {
+        return
+    }
+    set script $_file_tree_scan_scripts($id)
+    switch -exact -- $event {
+        done {
+            unset _file_tree_scan_scripts($id)
+        }
+        error {
+            unset _file_tree_scan_scripts($id)
+            set data [list $data [map_windows_error $data]]
+        }
+    }
+    return [uplevel #0 [linsert $script end $id $event $data]]
+}
+
+# Converts a drive or volume to the form needed to open the volume
+proc twapi::_usn_volume_path {vol} {
+    if {[regexp {^([a-zA-Z]):?[/\\]?$} $vol -> drive]} {
+        return "\\\\.\\$drive:"
+    }
+    return [string trimright [file nativename $vol] \\]
+}
+
+proc twapi::usn_journal_info {vol} {
+    return [twine {journalid firstusn nextusn lowestvalidusn maxusn maxsize allocationdelta} [Twapi_UsnJournalQuery [_usn_volume_path $vol]]]
+}
+
+# Returns a cursor for reading the change journal of a volume
+proc twapi::usn_journal_open {vol args} {
+    parseargs args {
+        {journalid.arg 0}
+        {startusn.arg -1}
+        {reasonmask.arg 0xffffffff}
+        {closeonly.bool 0}
+        {bufsize.int 1048576}
+    } -setvars -maxleftover 0
+    return [Twapi_UsnCursorOpen [_usn_volume_path $vol] 0 $journalid $startusn $reasonmask $closeonly $bufsize]
+}
+
+# Returns a cursor enumerating the files on a volume
+proc twapi::usn_enum_open {vol args} {
+    parseargs args {
+        {lowusn.arg 0}
+        {bufsize.int 1048576}
+    } -setvars -maxleftover 0
+    return [Twapi_UsnCursorOpen [_usn_volume_path $vol] 1 0 $lowusn 0 0 $bufsize]
+}
+
+proc twapi::usn_cursor_read {cursor} {
+    return [Twapi_UsnCursorRead $cursor]
+}
+
+proc twapi::usn_cursor_position {cursor} {
+    return [Twapi_UsnCursorPosition $cursor]
+}
+
+proc twapi::usn_cursor_close {cursor} {
+    Twapi_UsnCursorClose $cursor
+}
+
+proc twapi::decode_usn_reasons {reasons} {
+    return [_make_symbolic_bitmask $reasons {
+        basic_info_change            0x8000
+        close                        0x80000000
+        compression_change           0x20000
+        data_extend                  0x2
+        data_overwrite               0x1
+        data_truncation              0x4
+        desired_storage_class_change 0x1000000
+        ea_change                    0x400
+        encryption_change            0x40000
+        file_create                  0x100
+        file_delete                  0x200
+        hard_link_change             0x10000
+        indexable_change             0x4000
+        integrity_change             0x800000
+        named_data_extend            0x20
+        named_data_overwrite         0x10
+        named_data_truncation        0x40
+        object_id_change             0x80000
+        rename_new_name              0x2000
+        rename_old_name              0x1000
+        reparse_point_change         0x100000
+        security_change              0x800
+        stream_change                0x200000
+        transacted_change            0x400000
+    }]
+}
+
 # Utility functions
 
 proc twapi::_drive_rootpath {drive} {
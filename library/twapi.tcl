@@ -422,20 +422,6 @@ proc twapi::kl_create {args} {
 # Make a keyed list given fields and values
 interp alias {} twapi::kl_create2 {} twapi::twine
 
-# Set a key value
-proc twapi::kl_set {kl field newval} {
-   set i 0
-   foreach {fld val} $kl {
-        if {[string equal $fld $field]} {
-            incr i
-            return [lreplace $kl $i $i $newval]
-        }
-        incr i 2
-    }
-    lappend kl $field $newval
-    return $kl
-}
-
 # Check if a field exists in the keyed list
 proc twapi::kl_vget {kl field varname} {
     upvar $varname var
@@ -466,28 +452,6 @@ proc twapi::kl_equal {kl_a kl_b} {
     }
 }
 
-# Return the field names in a keyed list in the same order that they
-# occured
-proc twapi::kl_fields {kl} {
-    set fields [list ]
-    foreach {fld val} $kl {
-        lappend fields $fld
-    }
-    return $fields
-}
-
-# Returns a flat list of the $field fields from a list
-# of keyed lists
-proc twapi::kl_flatten {list_of_kl args} {
-    set result {}
-    foreach kl $list_of_kl {
-        foreach field $args {
-            lappend result [kl_get $kl $field]
-        }
-    }
-    return $result
-}
-
 
 # Return an array as a list of -index value pairs
 proc twapi::_get_array_as_options {v_arr} {
@@ -221,3 +221,37 @@ proc twapi::wmi_extract_class {obj} {
 
     return $result
 }
+
+# Runs a WQL query and returns the values of the specified properties
+# of all matching instances as a recordarray. If -command is specified,
+# it is called with each batch as a recordarray instead and an empty
+# result is returned so memory use stays bounded.
+proc twapi::wmi_query_records {swbemservices query properties args} {
+    array set opts [parseargs args {
+        command.arg
+        {batchsize.int 500}
+    } -maxleftover 0]
+
+    # wbemFlagReturnImmediately | wbemFlagForwardOnly
+    set objset [$swbemservices ExecQuery $query WQL 0x30]
+    set batches {}
+    twapi::trap {
+        $objset -iteraterecords -batchsize $opts(batchsize) $properties batch {
+            if {[info exists opts(command)]} {
+                {*}$opts(command) $batch
+            } else {
+                lappend batches $batch
+            }
+        }
+    } finally {
+        $objset destroy
+    }
+
+    if {[info exists opts(command)]} {
+        return
+    }
+    if {[llength $batches] == 0} {
+        return [list $properties {}]
+    }
+    return [recordarray concat {*}$batches]
+}
@@ -0,0 +1,736 @@
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Account name and SID resolution. Requests from all interpreters go
+ * through a single resolver (see nameres.h) so that SIDs and names are
+ * cached, successes and failures alike, concurrent requests for the same
+ * account share one lookup and queued requests are translated with one
+ * LsaLookupSids2 or LsaLookupNames2 call per batch instead of a
+ * LookupAccountSid round trip to the domain controller per account.
+ *
+ * Queries are of the form "SYSTEM\nACCOUNT" where SYSTEM is empty for the
+ * local system. Results are strings holding the list {NAME DOMAIN TYPE}
+ * for SID lookups and {SID DOMAIN TYPE} for name lookups, the same as
+ * LookupAccountSid and LookupAccountName, since Tcl_Objs cannot be passed
+ * between threads.
+ */
+
+#include "twapi.h"
+#include "twapi_base.h"
+#include "nameres.h"
+#include "sidobj.h"
+
+#ifndef STATUS_SOME_NOT_MAPPED
+#define STATUS_SOME_NOT_MAPPED ((NTSTATUS)0x00000107L)
+#endif
+#ifndef STATUS_NONE_MAPPED
+#define STATUS_NONE_MAPPED ((NTSTATUS)0xC0000073L)
+#endif
+
+/* Resolver kinds */
+#define TWAPI_ACCOUNT_SID  0    /* SID -> name */
+#define TWAPI_ACCOUNT_NAME 1    /* Name -> SID */
+
+#define TWAPI_ACCTRES_MAX_WORKERS   4
+#define TWAPI_ACCTRES_POSITIVE_TTL  600000 /* Accounts rarely change */
+#define TWAPI_ACCTRES_NEGATIVE_TTL  30000
+#define TWAPI_ACCTRES_MAX_ENTRIES   8192
+#define TWAPI_ACCTRES_IDLE_TIMEOUT  30000
+#define TWAPI_ACCTRES_MAX_BATCH     1000
+
+static TwapiOneTimeInitState gTwapiAcctResInitialized;
+static NameRes *gTwapiAcctResP;
+
+/*
+ * Context for asynchronous requests. The result is delivered to the
+ * interpreter through the callback queue.
+ */
+typedef struct _TwapiAccountResolveCallback {
+    TwapiCallback cb;           /* Must be first field */
+    TwapiInterpContext *ticP;   /* Held until the callback runs */
+    TwapiId id;
+    int status;                 /* 0 -> success, else Win32 error code */
+    char *result;               /* ckalloc'ed, NULL if empty */
+    char *account;              /* Points into query */
+    char query[1];              /* VARIABLE SIZE, "SYSTEM\nACCOUNT" */
+} TwapiAccountResolveCallback;
+#define SIZE_TwapiAccountResolveCallback(query_len_) \
+    (sizeof(TwapiAccountResolveCallback) + (query_len_))
+
+/* Returns the account part of a query */
+static const char *TwapiAccountQueryAccount(const char *query)
+{
+    const char *p = strchr(query, '\n');
+    return p ? p + 1 : query;
+}
+
+/* Returns nonzero if two queries are for the same system */
+static int TwapiAccountQuerySameSystem(const char *q1, const char *q2)
+{
+    while (*q1 == *q2 && *q1 != '\n' && *q1)
+        ++q1, ++q2;
+    return *q1 == *q2;
+}
+
+/* Converts nbytes of UTF-8 to a ckalloc'ed nul terminated wide string */
+static WCHAR *TwapiAccountUtf8ToWide(const char *s, int nbytes, int *ncharsP)
+{
+    WCHAR *ws;
+    int nchars;
+
+    nchars = nbytes ? MultiByteToWideChar(CP_UTF8, 0, s, nbytes, NULL, 0) : 0;
+    ws = (WCHAR *) ckalloc((nchars + 1) * sizeof(WCHAR));
+    if (nchars)
+        MultiByteToWideChar(CP_UTF8, 0, s, nbytes, ws, nchars);
+    ws[nchars] = 0;
+    if (ncharsP)
+        *ncharsP = nchars;
+    return ws;
+}
+
+static void TwapiAccountAppendElement(Tcl_DString *dsP, const WCHAR *ws,
+                                      int nchars)
+{
+    Tcl_DString ds;
+    int len;
+
+    Tcl_DStringInit(&ds);
+    if (nchars > 0) {
+        len = WideCharToMultiByte(CP_UTF8, 0, ws, nchars, NULL, 0, NULL, NULL);
+        Tcl_DStringSetLength(&ds, len);
+        WideCharToMultiByte(CP_UTF8, 0, ws, nchars, Tcl_DStringValue(&ds),
+                            len, NULL, NULL);
+    }
+    Tcl_DStringAppendElement(dsP, Tcl_DStringValue(&ds));
+    Tcl_DStringFree(&ds);
+}
+
+static void TwapiAccountAppendLsaString(Tcl_DString *dsP,
+                                        const LSA_UNICODE_STRING *ustrP)
+{
+    TwapiAccountAppendElement(dsP, ustrP->Buffer,
+                              ustrP->Length / sizeof(WCHAR));
+}
+
+/* Returns the name of a referenced domain, NULL if none */
+static const LSA_UNICODE_STRING *TwapiAccountDomainName(
+    const LSA_REFERENCED_DOMAIN_LIST *domainsP, LONG index)
+{
+    if (domainsP == NULL || index < 0 || (ULONG) index >= domainsP->Entries)
+        return NULL;
+    return &domainsP->Domains[index].Name;
+}
+
+static char *TwapiAccountResult(Tcl_DString *dsP)
+{
+    char *p = ckalloc(Tcl_DStringLength(dsP) + 1);
+    CopyMemory(p, Tcl_DStringValue(dsP), Tcl_DStringLength(dsP) + 1);
+    Tcl_DStringFree(dsP);
+    return p;
+}
+
+static DWORD TwapiAccountLsaError(NTSTATUS status)
+{
+    if (status == STATUS_NONE_MAPPED)
+        return ERROR_NONE_MAPPED;
+    return LsaNtStatusToWinError(status);
+}
+
+static NTSTATUS TwapiAccountOpenPolicy(const char *query, LSA_HANDLE *policyP)
+{
+    LSA_OBJECT_ATTRIBUTES oattr;
+    LSA_UNICODE_STRING ustr;
+    const char *account = TwapiAccountQueryAccount(query);
+    int syslen = (int) (account - query) - 1;
+    int nchars;
+    NTSTATUS status;
+
+    TwapiZeroMemory(&oattr, sizeof(oattr));
+    if (syslen <= 0)
+        return LsaOpenPolicy(NULL, &oattr, POLICY_LOOKUP_NAMES, policyP);
+    ustr.Buffer = TwapiAccountUtf8ToWide(query, syslen, &nchars);
+    ustr.Length = (USHORT) (nchars * sizeof(WCHAR));
+    ustr.MaximumLength = ustr.Length;
+    status = LsaOpenPolicy(&ustr, &oattr, POLICY_LOOKUP_NAMES, policyP);
+    ckfree((char *) ustr.Buffer);
+    return status;
+}
+
+/*
+ * Parses a SID string into buf which must have room for SIDOBJ_MAX_SIZE
+ * bytes. Well known SID abbreviations like "BA" are accepted as by
+ * ConvertStringSidToSid. Returns 0 if not a valid SID.
+ */
+static int TwapiAccountParseSid(const char *s, unsigned char *buf)
+{
+    WCHAR *ws;
+    PSID sidP;
+    int len;
+
+    len = SidObjParse(s, strlen(s), buf);
+    if (len)
+        return len;
+    ws = TwapiAccountUtf8ToWide(s, (int) strlen(s), NULL);
+    if (ConvertStringSidToSidW(ws, &sidP)) {
+        len = SidObjLength(sidP, SIDOBJ_MAX_SIZE);
+        if (len)
+            CopyMemory(buf, sidP, len);
+        LocalFree(sidP);
+    }
+    ckfree((char *) ws);
+    return len;
+}
+
+/* Translates SIDs on one system. indices[] index the batch arrays. */
+static void TwapiAccountLookupSids(LSA_HANDLE policy, int n, const int *indices,
+                                   const char *const queries[],
+                                   char *results[], int statuses[])
+{
+    unsigned char *sidbufs;
+    PSID *sids;
+    int *map;
+    int i, nsids;
+    NTSTATUS status;
+    PLSA_REFERENCED_DOMAIN_LIST domainsP = NULL;
+    PLSA_TRANSLATED_NAME namesP = NULL;
+
+    sidbufs = (unsigned char *) ckalloc(n * SIDOBJ_MAX_SIZE);
+    sids = (PSID *) ckalloc(n * sizeof(PSID));
+    map = (int *) ckalloc(n * sizeof(int));
+    for (i = 0, nsids = 0; i < n; ++i) {
+        int ix = indices[i];
+        unsigned char *sidP = sidbufs + nsids * SIDOBJ_MAX_SIZE;
+        if (TwapiAccountParseSid(TwapiAccountQueryAccount(queries[ix]), sidP)) {
+            sids[nsids] = sidP;
+            map[nsids++] = ix;
+        } else {
+            statuses[ix] = ERROR_INVALID_SID;
+        }
+    }
+    if (nsids == 0)
+        goto vamoose;
+
+    status = LsaLookupSids2(policy, 0, nsids, sids, &domainsP, &namesP);
+    for (i = 0; i < nsids; ++i) {
+        int ix = map[i];
+        PLSA_TRANSLATED_NAME tnP;
+        const LSA_UNICODE_STRING *domP;
+        Tcl_DString ds;
+        char buf[20];
+
+        if (status != STATUS_SUCCESS && status != STATUS_SOME_NOT_MAPPED) {
+            statuses[ix] = TwapiAccountLsaError(status);
+            continue;
+        }
+        tnP = &namesP[i];
+        if (tnP->Use == SidTypeUnknown || tnP->Use == SidTypeInvalid) {
+            statuses[ix] = ERROR_NONE_MAPPED;
+            continue;
+        }
+        domP = TwapiAccountDomainName(domainsP, tnP->DomainIndex);
+        Tcl_DStringInit(&ds);
+        /* As with LookupAccountSid, domains are named after themselves */
+        if (tnP->Name.Length == 0 && tnP->Use == SidTypeDomain && domP)
+            TwapiAccountAppendLsaString(&ds, domP);
+        else
+            TwapiAccountAppendLsaString(&ds, &tnP->Name);
+        if (domP)
+            TwapiAccountAppendLsaString(&ds, domP);
+        else
+            Tcl_DStringAppendElement(&ds, "");
+        sprintf(buf, "%d", tnP->Use);
+        Tcl_DStringAppendElement(&ds, buf);
+        results[ix] = TwapiAccountResult(&ds);
+        statuses[ix] = 0;
+    }
+
+vamoose:
+    if (domainsP)
+        LsaFreeMemory(domainsP);
+    if (namesP)
+        LsaFreeMemory(namesP);
+    ckfree((char *) map);
+    ckfree((char *) sids);
+    ckfree(sidbufs);
+}
+
+/*
+ * Formats a translated name into *resultP. Returns 0 or
+ * ERROR_NONE_MAPPED.
+ */
+static int TwapiAccountFormatSid(PLSA_TRANSLATED_SID2 tsP,
+                                 PLSA_REFERENCED_DOMAIN_LIST domainsP,
+                                 char **resultP)
+{
+    const LSA_UNICODE_STRING *domP;
+    char buf[SIDOBJ_MAX_STRING];
+    unsigned int sidlen;
+    Tcl_DString ds;
+
+    if (tsP->Use == SidTypeUnknown || tsP->Use == SidTypeInvalid
+        || tsP->Sid == NULL)
+        return ERROR_NONE_MAPPED;
+    sidlen = SidObjLength(tsP->Sid, SIDOBJ_MAX_SIZE);
+    if (sidlen == 0)
+        return ERROR_NONE_MAPPED;
+    Tcl_DStringInit(&ds);
+    SidObjFormat(tsP->Sid, sidlen, buf);
+    Tcl_DStringAppendElement(&ds, buf);
+    domP = TwapiAccountDomainName(domainsP, tsP->DomainIndex);
+    if (domP)
+        TwapiAccountAppendLsaString(&ds, domP);
+    else
+        Tcl_DStringAppendElement(&ds, "");
+    sprintf(buf, "%d", tsP->Use);
+    Tcl_DStringAppendElement(&ds, buf);
+    *resultP = TwapiAccountResult(&ds);
+    return 0;
+}
+
+/*
+ * Looks up DOMAIN\NAME. Used for names that resolve to a domain since
+ * a user with the same name as the computer is otherwise returned as
+ * the computer (KB 185246). Returns 0 or an error.
+ */
+static int TwapiAccountLookupQualified(LSA_HANDLE policy,
+                                       const LSA_UNICODE_STRING *domP,
+                                       const LSA_UNICODE_STRING *nameP,
+                                       char **resultP)
+{
+    LSA_UNICODE_STRING ustr;
+    PLSA_REFERENCED_DOMAIN_LIST domainsP = NULL;
+    PLSA_TRANSLATED_SID2 sidsP = NULL;
+    NTSTATUS status;
+    int len, error;
+
+    len = domP->Length + sizeof(WCHAR) + nameP->Length;
+    if (len > 0xffff)
+        return ERROR_INVALID_PARAMETER;
+    ustr.Buffer = (WCHAR *) ckalloc(len);
+    CopyMemory(ustr.Buffer, domP->Buffer, domP->Length);
+    ustr.Buffer[domP->Length / sizeof(WCHAR)] = L'\\';
+    CopyMemory(ustr.Buffer + domP->Length / sizeof(WCHAR) + 1,
+               nameP->Buffer, nameP->Length);
+    ustr.Length = ustr.MaximumLength = (USHORT) len;
+    status = LsaLookupNames2(policy, 0, 1, &ustr, &domainsP, &sidsP);
+    if (status == STATUS_SUCCESS)
+        error = TwapiAccountFormatSid(sidsP, domainsP, resultP);
+    else
+        error = TwapiAccountLsaError(status);
+    if (domainsP)
+        LsaFreeMemory(domainsP);
+    if (sidsP)
+        LsaFreeMemory(sidsP);
+    ckfree((char *) ustr.Buffer);
+    return error;
+}
+
+/* Translates names on one system. indices[] index the batch arrays. */
+static void TwapiAccountLookupNames(LSA_HANDLE policy, int n,
+                                    const int *indices,
+                                    const char *const queries[],
+                                    char *results[], int statuses[])
+{
+    LSA_UNICODE_STRING *names;
+    int *map;
+    int i, nnames;
+    NTSTATUS status;
+    PLSA_REFERENCED_DOMAIN_LIST domainsP = NULL;
+    PLSA_TRANSLATED_SID2 sidsP = NULL;
+
+    names = (LSA_UNICODE_STRING *) ckalloc(n * sizeof(LSA_UNICODE_STRING));
+    map = (int *) ckalloc(n * sizeof(int));
+    for (i = 0, nnames = 0; i < n; ++i) {
+        int ix = indices[i];
+        const char *account = TwapiAccountQueryAccount(queries[ix]);
+        int nchars;
+        /*
+         * Empty names are rejected as LookupAccountName treats them as
+         * an insufficient buffer error.
+         */
+        if (*account == 0 || strlen(account) > 0x7fff) {
+            statuses[ix] = ERROR_INVALID_PARAMETER;
+            continue;
+        }
+        names[nnames].Buffer =
+            TwapiAccountUtf8ToWide(account, (int) strlen(account), &nchars);
+        names[nnames].Length = (USHORT) (nchars * sizeof(WCHAR));
+        names[nnames].MaximumLength = names[nnames].Length;
+        map[nnames++] = ix;
+    }
+    if (nnames == 0)
+        goto vamoose;
+
+    status = LsaLookupNames2(policy, 0, nnames, names, &domainsP, &sidsP);
+    for (i = 0; i < nnames; ++i) {
+        int ix = map[i];
+        if (status != STATUS_SUCCESS && status != STATUS_SOME_NOT_MAPPED) {
+            statuses[ix] = TwapiAccountLsaError(status);
+            continue;
+        }
+        statuses[ix] = TwapiAccountFormatSid(&sidsP[i], domainsP, &results[ix]);
+        if (statuses[ix] == 0 && sidsP[i].Use == SidTypeDomain) {
+            const LSA_UNICODE_STRING *domP;
+            char *qualified = NULL;
+            domP = TwapiAccountDomainName(domainsP, sidsP[i].DomainIndex);
+            if (domP && TwapiAccountLookupQualified(policy, domP, &names[i],
+                                                    &qualified) == 0) {
+                ckfree(results[ix]);
+                results[ix] = qualified;
+            }
+        }
+    }
+
+vamoose:
+    if (domainsP)
+        LsaFreeMemory(domainsP);
+    if (sidsP)
+        LsaFreeMemory(sidsP);
+    for (i = 0; i < nnames; ++i)
+        ckfree((char *) names[i].Buffer);
+    ckfree((char *) map);
+    ckfree((char *) names);
+}
+
+/*
+ * Batch lookup procedure for the resolver. Called from its worker
+ * threads or from NameResResolve in the interpreter thread. The queries
+ * are grouped by system and each group is translated with one call.
+ */
+static void TwapiAccountBatchLookup(void *ctx, int kind, int family, int n,
+                                    const char *const queries[],
+                                    char *results[], int statuses[])
+{
+    int *indices;
+    char *done;
+    int i, j, ngroup;
+
+    indices = (int *) ckalloc(n * sizeof(int));
+    done = ckalloc(n);
+    ZeroMemory(done, n);
+    for (i = 0; i < n; ++i) {
+        LSA_HANDLE policy;
+        NTSTATUS status;
+
+        if (done[i])
+            continue;
+        for (j = i, ngroup = 0; j < n; ++j) {
+            if (!done[j] && TwapiAccountQuerySameSystem(queries[i], queries[j])) {
+                done[j] = 1;
+                indices[ngroup++] = j;
+            }
+        }
+        status = TwapiAccountOpenPolicy(queries[i], &policy);
+        if (status != STATUS_SUCCESS) {
+            for (j = 0; j < ngroup; ++j)
+                statuses[indices[j]] = LsaNtStatusToWinError(status);
+            continue;
+        }
+        if (kind == TWAPI_ACCOUNT_SID)
+            TwapiAccountLookupSids(policy, ngroup, indices, queries, results,
+                                   statuses);
+        else
+            TwapiAccountLookupNames(policy, ngroup, indices, queries, results,
+                                    statuses);
+        LsaClose(policy);
+    }
+    ckfree(done);
+    ckfree((char *) indices);
+}
+
+static int TwapiAcctResInit(void *unused)
+{
+    NameResConfig config;
+
+    config.lookup = NULL;
+    config.batch_lookup = TwapiAccountBatchLookup;
+    config.lookup_ctx = NULL;
+    config.max_batch = TWAPI_ACCTRES_MAX_BATCH;
+    config.max_workers = TWAPI_ACCTRES_MAX_WORKERS;
+    config.positive_ttl = TWAPI_ACCTRES_POSITIVE_TTL;
+    config.negative_ttl = TWAPI_ACCTRES_NEGATIVE_TTL;
+    config.max_entries = TWAPI_ACCTRES_MAX_ENTRIES;
+    config.idle_timeout = TWAPI_ACCTRES_IDLE_TIMEOUT;
+    gTwapiAcctResP = NameResNew(&config);
+    return TCL_OK;
+}
+
+static NameRes *TwapiAcctRes(void)
+{
+    if (! TwapiDoOneTimeInit(&gTwapiAcctResInitialized, TwapiAcctResInit, NULL))
+        return NULL;
+    return gTwapiAcctResP;
+}
+
+/*
+ * Common argument parsing. Stores SYSTEM\nACCOUNT queries, allocated
+ * from the SWS, in *queriesP.
+ */
+static TCL_RESULT TwapiAccountResolveArgs(Tcl_Interp *interp, int objc,
+                                          Tcl_Obj *CONST objv[], int *kindP,
+                                          int *nP, char ***queriesP)
+{
+    char *system;
+    Tcl_Size syslen, i, naccounts;
+    Tcl_Obj *accountsObj;
+    Tcl_Obj **accountsv;
+    char **queries;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETINT(*kindP), GETASTRN(system, syslen),
+                     GETOBJ(accountsObj), ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    if (*kindP != TWAPI_ACCOUNT_SID && *kindP != TWAPI_ACCOUNT_NAME)
+        return TwapiReturnError(interp, TWAPI_INVALID_ARGS);
+    if (ObjGetElements(interp, accountsObj, &naccounts, &accountsv) != TCL_OK)
+        return TCL_ERROR;
+    if (naccounts > INT_MAX / (int) sizeof(char *))
+        return TwapiReturnError(interp, TWAPI_INVALID_ARGS);
+
+    queries = SWSAlloc(naccounts * sizeof(char *) + 1, NULL);
+    for (i = 0; i < naccounts; ++i) {
+        Tcl_Size len;
+        char *account = ObjToStringN(accountsv[i], &len);
+        queries[i] = SWSAlloc(syslen + 1 + len + 1, NULL);
+        CopyMemory(queries[i], system, syslen);
+        queries[i][syslen] = '\n';
+        CopyMemory(queries[i] + syslen + 1, account, len + 1);
+    }
+    *nP = (int) naccounts;
+    *queriesP = queries;
+    return TCL_OK;
+}
+
+/*
+ * Twapi_AccountResolve KIND SYSTEM ACCOUNTS
+ * Resolves ACCOUNTS, SIDs if KIND is 0 or names if 1, returning a flat
+ * list of STATUS RESULT pairs. Cached results are returned directly and
+ * the rest looked up in this thread in batches, or waited for if being
+ * looked up for another request.
+ */
+int Twapi_AccountResolveObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    NameRes *nrP;
+    char **queries;
+    char **results;
+    int *statuses;
+    int i, n, kind;
+    Tcl_Obj *resultObj;
+    SWSMark mark;
+    TCL_RESULT res;
+
+    mark = SWSPushMark();
+    res = TwapiAccountResolveArgs(interp, objc, objv, &kind, &n, &queries);
+    if (res != TCL_OK)
+        goto vamoose;
+    nrP = TwapiAcctRes();
+    if (nrP == NULL) {
+        res = TwapiReturnError(interp, TWAPI_SYSTEM_ERROR);
+        goto vamoose;
+    }
+    statuses = SWSAlloc(n * sizeof(int) + 1, NULL);
+    results = SWSAlloc(n * sizeof(char *) + 1, NULL);
+    NameResResolve(nrP, kind, 0, n, (const char *const *) queries,
+                   statuses, results);
+
+    resultObj = ObjNewList(2 * n, NULL);
+    for (i = 0; i < n; ++i) {
+        ObjAppendElement(NULL, resultObj, ObjFromInt(statuses[i]));
+        ObjAppendElement(NULL, resultObj,
+                         ObjFromString(results[i] ? results[i] : ""));
+        if (results[i])
+            ckfree(results[i]);
+    }
+    ObjSetResult(interp, resultObj);
+
+vamoose:
+    SWSPopMark(mark);
+    return res;
+}
+
+/* Called in the interpreter thread with the result of a request */
+static int TwapiAccountResolveCallbackFn(TwapiCallback *cbP)
+{
+    TwapiAccountResolveCallback *arcP = (TwapiAccountResolveCallback *) cbP;
+    Tcl_Obj *objs[5];
+    int tcl_status = TCL_OK;
+
+    if (arcP->ticP->interp != NULL && ! Tcl_InterpDeleted(arcP->ticP->interp)) {
+        objs[0] = STRING_LITERAL_OBJ(TWAPI_TCL_NAMESPACE "::_account_resolve_handler");
+        objs[1] = ObjFromTwapiId(arcP->id);
+        objs[2] = ObjFromString(arcP->account);
+        if (arcP->status == ERROR_SUCCESS) {
+            objs[3] = STRING_LITERAL_OBJ("success");
+            objs[4] = ObjFromString(arcP->result ? arcP->result : "");
+        } else {
+            objs[3] = STRING_LITERAL_OBJ("fail");
+            objs[4] = ObjFromLong(arcP->status);
+        }
+        tcl_status = TwapiEvalAndUpdateCallback(cbP, 5, objs, TRT_EMPTY);
+    }
+    if (arcP->result) {
+        ckfree(arcP->result);
+        arcP->result = NULL;
+    }
+    TwapiInterpContextUnref(arcP->ticP, 1); /* Ref from submission */
+    arcP->ticP = NULL;
+    return tcl_status;
+}
+
+/*
+ * Called by the resolver when a lookup completes, from a worker thread
+ * or from the requesting thread if the result was cached.
+ */
+static void TwapiAccountResolveDone(void *client, int status,
+                                    const char *result, int cached)
+{
+    TwapiAccountResolveCallback *arcP = client;
+    size_t len;
+
+    arcP->status = status;
+    len = strlen(result);
+    if (status == 0 && len) {
+        arcP->result = ckalloc((int) len + 1);
+        CopyMemory(arcP->result, result, len + 1);
+    }
+    TwapiEnqueueCallback(arcP->ticP, &arcP->cb, TWAPI_ENQUEUE_DIRECT, 0, NULL);
+}
+
+/*
+ * Twapi_AccountResolveAsync KIND SYSTEM ACCOUNTS
+ * As Twapi_AccountResolve but returns an id right away. The result for
+ * each account is passed to _account_resolve_handler as it completes.
+ */
+int Twapi_AccountResolveAsyncObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    NameRes *nrP;
+    TwapiId id;
+    char **queries;
+    TwapiAccountResolveCallback **arcPP;
+    int i, n, kind, nsubmitted, status;
+    SWSMark mark;
+    TCL_RESULT res;
+
+    RETURN_ERROR_IF_UNTHREADED(interp);
+
+    mark = SWSPushMark();
+    res = TwapiAccountResolveArgs(interp, objc, objv, &kind, &n, &queries);
+    if (res != TCL_OK)
+        goto vamoose;
+    nrP = TwapiAcctRes();
+    if (nrP == NULL) {
+        res = TwapiReturnError(interp, TWAPI_SYSTEM_ERROR);
+        goto vamoose;
+    }
+
+    id = TWAPI_NEWID(ticP);
+    arcPP = SWSAlloc(n * sizeof(*arcPP) + 1, NULL);
+    for (i = 0; i < n; ++i) {
+        size_t len = strlen(queries[i]);
+        TwapiAccountResolveCallback *arcP;
+        arcP = (TwapiAccountResolveCallback *) TwapiCallbackNew(
+            ticP, TwapiAccountResolveCallbackFn,
+            (int) SIZE_TwapiAccountResolveCallback(len));
+        arcP->ticP = ticP;
+        TwapiInterpContextRef(ticP, 1); /* So it does not go away */
+        arcP->id = id;
+        arcP->status = ERROR_SUCCESS;
+        arcP->result = NULL;
+        CopyMemory(arcP->query, queries[i], len + 1);
+        arcP->account = (char *) TwapiAccountQueryAccount(arcP->query);
+        queries[i] = arcP->query;
+        arcPP[i] = arcP;
+    }
+
+    status = NameResSubmitMany(nrP, kind, 0, n, (const char *const *) queries,
+                               TwapiAccountResolveDone, (void *const *) arcPP,
+                               &nsubmitted);
+    if (status != 0) {
+        /* Requests already submitted still complete */
+        for (i = nsubmitted; i < n; ++i) {
+            TwapiInterpContextUnref(ticP, 1);
+            TwapiCallbackDelete(&arcPP[i]->cb);
+        }
+        res = Twapi_AppendSystemError(interp, status);
+        goto vamoose;
+    }
+    ObjSetResult(interp, ObjFromTwapiId(id));
+
+vamoose:
+    SWSPopMark(mark);
+    return res;
+}
+
+/* Twapi_AccountResolverForget KIND SYSTEM ACCOUNT - discards a cached result */
+int Twapi_AccountResolverForgetObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    NameRes *nrP;
+    char **queries;
+    int i, n, kind;
+    SWSMark mark;
+    TCL_RESULT res;
+
+    mark = SWSPushMark();
+    res = TwapiAccountResolveArgs(interp, objc, objv, &kind, &n, &queries);
+    if (res == TCL_OK) {
+        nrP = TwapiAcctRes();
+        if (nrP == NULL)
+            res = TwapiReturnError(interp, TWAPI_SYSTEM_ERROR);
+        else {
+            for (i = 0; i < n; ++i)
+                NameResForget(nrP, kind, 0, queries[i]);
+        }
+    }
+    SWSPopMark(mark);
+    return res;
+}
+
+/*
+ * Twapi_AccountResolverFlush - discards all cached results
+ * Twapi_AccountResolverStats - returns resolver counters as a dict
+ */
+int Twapi_AccountResolverFlushObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    NameRes *nrP;
+
+    if (objc != 1)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    nrP = TwapiAcctRes();
+    if (nrP == NULL)
+        return TwapiReturnError(interp, TWAPI_SYSTEM_ERROR);
+    NameResFlush(nrP);
+    return TCL_OK;
+}
+
+int Twapi_AccountResolverStatsObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    NameRes *nrP;
+    NameResStats stats;
+    Tcl_Obj *objs[14];
+
+    if (objc != 1)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    nrP = TwapiAcctRes();
+    if (nrP == NULL)
+        return TwapiReturnError(interp, TWAPI_SYSTEM_ERROR);
+    NameResGetStats(nrP, &stats);
+    objs[0] = STRING_LITERAL_OBJ("requests");
+    objs[1] = ObjFromWideInt(stats.requests);
+    objs[2] = STRING_LITERAL_OBJ("lookups");
+    objs[3] = ObjFromWideInt(stats.lookups);
+    objs[4] = STRING_LITERAL_OBJ("batches");
+    objs[5] = ObjFromWideInt(stats.batches);
+    objs[6] = STRING_LITERAL_OBJ("hits");
+    objs[7] = ObjFromWideInt(stats.hits);
+    objs[8] = STRING_LITERAL_OBJ("coalesced");
+    objs[9] = ObjFromWideInt(stats.coalesced);
+    objs[10] = STRING_LITERAL_OBJ("workers");
+    objs[11] = ObjFromInt(stats.workers);
+    objs[12] = STRING_LITERAL_OBJ("entries");
+    objs[13] = ObjFromInt(stats.entries);
+    return ObjSetResult(interp, ObjNewList(14, objs));
+}
@@ -0,0 +1,577 @@
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Network adapter snapshot cache. See adaptcache.h.
+ *
+ * Build with -DADAPTCACHE_TEST to get a standalone test using a simulated
+ * notification source and a benchmark against refetching on every query
+ * (see end of file).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "adaptcache.h"
+
+typedef struct AdaptEntry {
+    Tcl_Obj *recObj;
+    Tcl_HashEntry *nameHe;      /* Entry in the names table */
+    int ifindex[2];             /* 0 if not present */
+    unsigned int seen;          /* Generation of the last fetch with it */
+} AdaptEntry;
+
+struct AdaptCache {
+    AdaptCacheConfig config;
+    Tcl_HashTable names;        /* Lower case name -> AdaptEntry */
+    Tcl_HashTable indices;      /* Interface index -> AdaptEntry */
+    Tcl_HashTable dirty;        /* Interface indices notified since fetch */
+    Tcl_Obj *listObj;           /* All records, NULL before first fetch */
+    unsigned int generation;
+    int stale;                  /* Notification received since fetch */
+    int all_dirty;              /* Notification for index 0 received */
+    AdaptCacheStats stats;
+};
+
+/* Initializes dsP to the lower case form of the name used as key */
+static void AdaptNameKey(Tcl_Obj *nameObj, Tcl_DString *dsP)
+{
+    Tcl_DStringInit(dsP);
+    Tcl_DStringAppend(dsP, Tcl_GetString(nameObj), -1);
+    Tcl_DStringSetLength(dsP, Tcl_UtfToLower(Tcl_DStringValue(dsP)));
+}
+
+static void AdaptGetIndices(AdaptCache *acP, Tcl_Obj *recObj, int ifindex[2])
+{
+    int i;
+    for (i = 0; i < 2; ++i) {
+        Tcl_Obj *objP;
+        ifindex[i] = 0;
+        if (acP->config.index_fields[i] >= 0 &&
+            Tcl_ListObjIndex(NULL, recObj, acP->config.index_fields[i],
+                             &objP) == TCL_OK &&
+            objP != NULL &&
+            Tcl_GetIntFromObj(NULL, objP, &ifindex[i]) != TCL_OK)
+            ifindex[i] = 0;
+    }
+}
+
+static int AdaptIsDirty(AdaptCache *acP, const int ifindex[2])
+{
+    int i;
+    if (acP->all_dirty)
+        return 1;
+    for (i = 0; i < 2; ++i) {
+        if (ifindex[i] &&
+            Tcl_FindHashEntry(&acP->dirty, (char *)(size_t)ifindex[i]))
+            return 1;
+    }
+    return 0;
+}
+
+static int AdaptRecordsEqual(Tcl_Obj *aObj, Tcl_Obj *bObj)
+{
+    const char *a, *b;
+    int alen, blen;
+
+    if (aObj == bObj)
+        return 1;
+    a = Tcl_GetStringFromObj(aObj, &alen);
+    b = Tcl_GetStringFromObj(bObj, &blen);
+    return alen == blen && memcmp(a, b, alen) == 0;
+}
+
+static void AdaptAppendChange(Tcl_Obj *changesObj, const char *event,
+                              Tcl_Obj *recObj, int name_field)
+{
+    Tcl_Obj *nameObj;
+    Tcl_ListObjIndex(NULL, recObj, name_field, &nameObj);
+    Tcl_ListObjAppendElement(NULL, changesObj, Tcl_NewStringObj(event, -1));
+    Tcl_ListObjAppendElement(NULL, changesObj, nameObj);
+}
+
+/* Rebuilds the index table. The first adapter with an index wins. */
+static void AdaptRebuildIndices(AdaptCache *acP)
+{
+    Tcl_HashSearch hs;
+    Tcl_HashEntry *he;
+
+    Tcl_DeleteHashTable(&acP->indices);
+    Tcl_InitHashTable(&acP->indices, TCL_ONE_WORD_KEYS);
+    for (he = Tcl_FirstHashEntry(&acP->names, &hs); he;
+         he = Tcl_NextHashEntry(&hs)) {
+        AdaptEntry *eP = (AdaptEntry *) Tcl_GetHashValue(he);
+        int i, isnew;
+        for (i = 0; i < 2; ++i) {
+            if (eP->ifindex[i]) {
+                Tcl_HashEntry *ihe = Tcl_CreateHashEntry(
+                    &acP->indices, (char *)(size_t)eP->ifindex[i], &isnew);
+                if (isnew)
+                    Tcl_SetHashValue(ihe, eP);
+            }
+        }
+    }
+}
+
+AdaptCache *AdaptCacheNew(const AdaptCacheConfig *configP)
+{
+    AdaptCache *acP = (AdaptCache *) ckalloc(sizeof(*acP));
+
+    memset(acP, 0, sizeof(*acP));
+    acP->config = *configP;
+    Tcl_InitHashTable(&acP->names, TCL_STRING_KEYS);
+    Tcl_InitHashTable(&acP->indices, TCL_ONE_WORD_KEYS);
+    Tcl_InitHashTable(&acP->dirty, TCL_ONE_WORD_KEYS);
+    acP->stale = 1;
+    return acP;
+}
+
+void AdaptCacheDelete(AdaptCache *acP)
+{
+    Tcl_HashSearch hs;
+    Tcl_HashEntry *he;
+
+    for (he = Tcl_FirstHashEntry(&acP->names, &hs); he;
+         he = Tcl_NextHashEntry(&hs)) {
+        AdaptEntry *eP = (AdaptEntry *) Tcl_GetHashValue(he);
+        Tcl_DecrRefCount(eP->recObj);
+        ckfree((char *) eP);
+    }
+    Tcl_DeleteHashTable(&acP->names);
+    Tcl_DeleteHashTable(&acP->indices);
+    Tcl_DeleteHashTable(&acP->dirty);
+    if (acP->listObj)
+        Tcl_DecrRefCount(acP->listObj);
+    ckfree((char *) acP);
+}
+
+void AdaptCacheNotify(AdaptCache *acP, int ifindex)
+{
+    int isnew;
+
+    acP->stats.notifications++;
+    acP->stale = 1;
+    if (ifindex == 0)
+        acP->all_dirty = 1;
+    else if (! acP->all_dirty)
+        Tcl_CreateHashEntry(&acP->dirty, (char *)(size_t)ifindex, &isnew);
+}
+
+int AdaptCacheRefresh(AdaptCache *acP, Tcl_Interp *interp,
+                      Tcl_Obj **changesP)
+{
+    Tcl_Obj *fetchedObj, **recs, **oldRecs, *nameObj, *newListObj;
+    Tcl_Obj *changesObj = NULL;
+    Tcl_HashSearch hs;
+    Tcl_HashEntry *he;
+    int i, nrecs, nold, modified;
+    unsigned int gen;
+
+    if (! acP->stale) {
+        if (changesP)
+            *changesP = Tcl_NewListObj(0, NULL);
+        return TCL_OK;
+    }
+
+    acP->stats.fetches++;
+    if (acP->config.fetch(acP->config.fetch_ctx, interp,
+                          &fetchedObj) != TCL_OK)
+        return TCL_ERROR;
+    Tcl_IncrRefCount(fetchedObj);
+    if (Tcl_ListObjGetElements(interp, fetchedObj, &nrecs, &recs) != TCL_OK)
+        goto error_return;
+    /* Verify all records before touching the snapshot */
+    for (i = 0; i < nrecs; ++i) {
+        if (Tcl_ListObjIndex(interp, recs[i], acP->config.name_field,
+                             &nameObj) != TCL_OK)
+            goto error_return;
+        if (nameObj == NULL) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Adapter record has no name field.", -1));
+            goto error_return;
+        }
+    }
+
+    if (changesP)
+        changesObj = Tcl_NewListObj(0, NULL);
+    if (acP->listObj) {
+        Tcl_ListObjGetElements(NULL, acP->listObj, &nold, &oldRecs);
+        modified = (nold != nrecs);
+    } else {
+        nold = 0;
+        oldRecs = NULL;
+        modified = 1;
+    }
+
+    gen = ++acP->generation;
+    newListObj = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(newListObj);
+    for (i = 0; i < nrecs; ++i) {
+        Tcl_DString ds;
+        AdaptEntry *eP;
+        int isnew;
+
+        Tcl_ListObjIndex(NULL, recs[i], acP->config.name_field, &nameObj);
+        AdaptNameKey(nameObj, &ds);
+        he = Tcl_CreateHashEntry(&acP->names, Tcl_DStringValue(&ds), &isnew);
+        Tcl_DStringFree(&ds);
+        if (isnew) {
+            eP = (AdaptEntry *) ckalloc(sizeof(*eP));
+            eP->recObj = recs[i];
+            Tcl_IncrRefCount(eP->recObj);
+            eP->nameHe = he;
+            AdaptGetIndices(acP, recs[i], eP->ifindex);
+            Tcl_SetHashValue(he, eP);
+            if (changesObj && acP->listObj)
+                AdaptAppendChange(changesObj, "added", recs[i],
+                                  acP->config.name_field);
+            modified = 1;
+        } else {
+            eP = (AdaptEntry *) Tcl_GetHashValue(he);
+            if (eP->seen == gen)
+                continue;       /* Duplicate name, keep the first */
+            if (! AdaptRecordsEqual(eP->recObj, recs[i])) {
+                int ifindex[2];
+                AdaptGetIndices(acP, recs[i], ifindex);
+                if (changesObj && (AdaptIsDirty(acP, eP->ifindex) ||
+                                   AdaptIsDirty(acP, ifindex)))
+                    AdaptAppendChange(changesObj, "changed", recs[i],
+                                      acP->config.name_field);
+                Tcl_IncrRefCount(recs[i]);
+                Tcl_DecrRefCount(eP->recObj);
+                eP->recObj = recs[i];
+                eP->ifindex[0] = ifindex[0];
+                eP->ifindex[1] = ifindex[1];
+                modified = 1;
+            }
+        }
+        eP->seen = gen;
+        if (! modified && oldRecs[i] != eP->recObj)
+            modified = 1;       /* Order changed */
+        Tcl_ListObjAppendElement(NULL, newListObj, eP->recObj);
+    }
+
+    /* Deleting the entry just returned is permitted during a search */
+    for (he = Tcl_FirstHashEntry(&acP->names, &hs); he;
+         he = Tcl_NextHashEntry(&hs)) {
+        AdaptEntry *eP = (AdaptEntry *) Tcl_GetHashValue(he);
+        if (eP->seen != gen) {
+            if (changesObj)
+                AdaptAppendChange(changesObj, "removed", eP->recObj,
+                                  acP->config.name_field);
+            Tcl_DecrRefCount(eP->recObj);
+            ckfree((char *) eP);
+            Tcl_DeleteHashEntry(he);
+            modified = 1;
+        }
+    }
+
+    if (modified) {
+        /* Unchanged snapshots keep the same list object */
+        if (acP->listObj)
+            Tcl_DecrRefCount(acP->listObj);
+        acP->listObj = newListObj;
+        AdaptRebuildIndices(acP);
+    } else
+        Tcl_DecrRefCount(newListObj);
+
+    if (acP->dirty.numEntries) {
+        Tcl_DeleteHashTable(&acP->dirty);
+        Tcl_InitHashTable(&acP->dirty, TCL_ONE_WORD_KEYS);
+    }
+    acP->all_dirty = 0;
+    acP->stale = 0;
+    acP->stats.adapters = acP->names.numEntries;
+    Tcl_DecrRefCount(fetchedObj);
+    if (changesP)
+        *changesP = changesObj;
+    return TCL_OK;
+
+error_return:
+    Tcl_DecrRefCount(fetchedObj);
+    return TCL_ERROR;
+}
+
+int AdaptCacheList(AdaptCache *acP, Tcl_Interp *interp, Tcl_Obj **listP)
+{
+    if (acP->stale && AdaptCacheRefresh(acP, interp, NULL) != TCL_OK)
+        return TCL_ERROR;
+    acP->stats.queries++;
+    *listP = acP->listObj;
+    return TCL_OK;
+}
+
+int AdaptCacheLookup(AdaptCache *acP, Tcl_Interp *interp, Tcl_Obj *keyObj,
+                     Tcl_Obj **recP)
+{
+    Tcl_DString ds;
+    Tcl_HashEntry *he;
+    int ifindex;
+
+    if (acP->stale && AdaptCacheRefresh(acP, interp, NULL) != TCL_OK)
+        return TCL_ERROR;
+    acP->stats.queries++;
+
+    AdaptNameKey(keyObj, &ds);
+    he = Tcl_FindHashEntry(&acP->names, Tcl_DStringValue(&ds));
+    Tcl_DStringFree(&ds);
+    if (he == NULL &&
+        Tcl_GetIntFromObj(NULL, keyObj, &ifindex) == TCL_OK && ifindex != 0)
+        he = Tcl_FindHashEntry(&acP->indices, (char *)(size_t)ifindex);
+    *recP = he ? ((AdaptEntry *) Tcl_GetHashValue(he))->recObj : NULL;
+    return TCL_OK;
+}
+
+void AdaptCacheGetStats(AdaptCache *acP, AdaptCacheStats *statsP)
+{
+    *statsP = acP->stats;
+}
+
+#ifdef ADAPTCACHE_TEST
+#include <stdlib.h>
+
+/*
+ * Standalone test. Build with
+ *   cc -DADAPTCACHE_TEST adaptcache.c -ltcl
+ *
+ * The simulated source holds the adapter list that the next fetch
+ * returns. Records are {ifindex name mtu addresses ipv6ifindex}. Each
+ * fetch returns freshly parsed objects, as the real fetch does.
+ */
+
+typedef struct TestSource {
+    Tcl_Obj *adaptersObj;
+    int fail;
+} TestSource;
+
+static int TestFetch(void *ctx, Tcl_Interp *interp, Tcl_Obj **adaptersP)
+{
+    TestSource *srcP = (TestSource *) ctx;
+    if (srcP->fail) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("fetch failed", -1));
+        return TCL_ERROR;
+    }
+    *adaptersP = Tcl_NewStringObj(Tcl_GetString(srcP->adaptersObj), -1);
+    return TCL_OK;
+}
+
+typedef struct TestState {
+    TestSource source;
+    AdaptCache *acP;
+} TestState;
+
+/* cache subcommand ?arg? */
+static int TestCacheObjCmd(ClientData cd, Tcl_Interp *interp, int objc,
+                           Tcl_Obj *const objv[])
+{
+    TestState *tsP = (TestState *) cd;
+    static const char *const cmds[] = {
+        "source", "fail", "notify", "refresh", "list", "lookup", "objid",
+        "fetches", "fetch", NULL
+    };
+    enum { SOURCE, FAIL, NOTIFY, REFRESH, LIST, LOOKUP, OBJID, FETCHES,
+           FETCH };
+    Tcl_Obj *objP;
+    AdaptCacheStats stats;
+    int cmd, ival;
+
+    if (objc < 2 || objc > 3) {
+        Tcl_WrongNumArgs(interp, 1, objv, "SUBCOMMAND ?ARG?");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[1], cmds, "subcommand", 0,
+                            &cmd) != TCL_OK)
+        return TCL_ERROR;
+    switch (cmd) {
+    case SOURCE:
+        Tcl_IncrRefCount(objv[2]);
+        Tcl_DecrRefCount(tsP->source.adaptersObj);
+        tsP->source.adaptersObj = objv[2];
+        return TCL_OK;
+    case FAIL:
+        return Tcl_GetBooleanFromObj(interp, objv[2], &tsP->source.fail);
+    case NOTIFY:
+        if (Tcl_GetIntFromObj(interp, objv[2], &ival) != TCL_OK)
+            return TCL_ERROR;
+        AdaptCacheNotify(tsP->acP, ival);
+        return TCL_OK;
+    case REFRESH:
+        if (AdaptCacheRefresh(tsP->acP, interp, &objP) != TCL_OK)
+            return TCL_ERROR;
+        Tcl_SetObjResult(interp, objP);
+        return TCL_OK;
+    case LIST:
+        if (AdaptCacheList(tsP->acP, interp, &objP) != TCL_OK)
+            return TCL_ERROR;
+        Tcl_SetObjResult(interp, objP);
+        return TCL_OK;
+    case LOOKUP:
+    case OBJID:
+        if (AdaptCacheLookup(tsP->acP, interp, objv[2], &objP) != TCL_OK)
+            return TCL_ERROR;
+        if (cmd == OBJID)
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("%p", (void *) objP));
+        else if (objP)
+            Tcl_SetObjResult(interp, objP);
+        return TCL_OK;
+    case FETCHES:
+        AdaptCacheGetStats(tsP->acP, &stats);
+        Tcl_SetObjResult(interp, Tcl_NewWideIntObj(stats.fetches));
+        return TCL_OK;
+    case FETCH:
+        /* What an uncached implementation pays on every query */
+        if (TestFetch(&tsP->source, interp, &objP) != TCL_OK)
+            return TCL_ERROR;
+        Tcl_SetObjResult(interp, objP);
+        return TCL_OK;
+    }
+    return TCL_ERROR;
+}
+
+static const char *testScript =
+    "proc check {script expected} {\n"
+    "    set code [catch {uplevel 1 $script} result]\n"
+    "    if {$code} {set result [list error $result]}\n"
+    "    if {$result ne $expected} {\n"
+    "        puts \"FAIL: $script\\n  got:      $result\\n  expected: $expected\"\n"
+    "        incr ::failures\n"
+    "    }\n"
+    "    incr ::checks\n"
+    "}\n"
+    "set failures 0; set checks 0\n"
+    "set eth {3 {{ETH-0}} 1500 {10.0.0.5} 3}\n"
+    "set wifi {7 {{WIFI-1}} 1500 {192.168.1.9} 7}\n"
+    "set lo {1 {{LOOPBACK}} 65535 {127.0.0.1 ::1} 1}\n"
+    "set tun {0 {{TUN-6}} 1280 {fd00::1} 12}\n"
+    "cache source [list $eth $wifi $lo $tun]\n"
+    /* First use fetches once, reports nothing, then serves from cache */
+    "check {cache refresh} {}\n"
+    "check {cache fetches} 1\n"
+    "check {lindex [cache lookup {{eth-0}}] 2} 1500\n"
+    "check {lindex [cache lookup 7] 1} {{WIFI-1}}\n"
+    "check {lindex [cache lookup 12] 1} {{TUN-6}}\n"
+    "check {cache lookup 0} {}\n"
+    "check {cache lookup nosuch} {}\n"
+    "check {llength [cache list]} 4\n"
+    "check {cache fetches} 1\n"
+    /* Source changes are not seen without a notification */
+    "set eth2 [lreplace $eth 2 2 9000]\n"
+    "cache source [list $eth2 $wifi $lo $tun]\n"
+    "check {lindex [cache lookup 3] 2} 1500\n"
+    "set wifiid [cache objid 7]\n"
+    "cache notify 3\n"
+    "check {cache refresh} {changed {{ETH-0}}}\n"
+    "check {lindex [cache lookup 3] 2} 9000\n"
+    "check {cache fetches} 2\n"
+    /* Unchanged adapters keep their objects */
+    "check {expr {[cache objid 7] eq $wifiid}} 1\n"
+    "check {cache refresh} {}\n"
+    "check {cache fetches} 2\n"
+    /* Notification without a change keeps the list object */
+    "set ethid [cache objid {{ETH-0}}]\n"
+    "cache notify 7\n"
+    "check {cache refresh} {}\n"
+    "check {expr {[cache objid {{ETH-0}}] eq $ethid}} 1\n"
+    /* Drift on an interface that was not notified is silent */
+    "set lo2 [lreplace $lo 3 3 {127.0.0.1 ::1 fe80::1}]\n"
+    "cache source [list $eth2 $wifi $lo2 $tun]\n"
+    "cache notify 7\n"
+    "check {cache refresh} {}\n"
+    "check {lindex [cache lookup 1] 3} {127.0.0.1 ::1 fe80::1}\n"
+    /* IPv6 index notifications */
+    "set tun2 [lreplace $tun 3 3 {fd00::2}]\n"
+    "cache source [list $eth2 $wifi $lo2 $tun2]\n"
+    "cache notify 12\n"
+    "check {cache refresh} {changed {{TUN-6}}}\n"
+    /* Adds and removes are always reported */
+    "set usb {9 {{USB-2}} 1500 {} 9}\n"
+    "cache source [list $eth2 $lo2 $usb $tun2]\n"
+    "cache notify 1\n"
+    "check {cache refresh} {added {{USB-2}} removed {{WIFI-1}}}\n"
+    "check {cache lookup 7} {}\n"
+    "check {lindex [cache lookup 9] 1} {{USB-2}}\n"
+    "check {lmap r [cache list] {lindex $r 0}} {3 1 9 0}\n"
+    /* Index moves with the adapter */
+    "set usb2 [lreplace [lreplace $usb 4 4 10] 0 0 10]\n"
+    "cache source [list $eth2 $lo2 $usb2 $tun2]\n"
+    "cache notify 0\n"
+    "check {cache refresh} {changed {{USB-2}}}\n"
+    "check {cache lookup 9} {}\n"
+    "check {lindex [cache lookup 10] 1} {{USB-2}}\n"
+    /* Order change alone replaces the list */
+    "cache source [list $lo2 $eth2 $usb2 $tun2]\n"
+    "cache notify 0\n"
+    "check {cache refresh} {}\n"
+    "check {lmap r [cache list] {lindex $r 0}} {1 3 10 0}\n"
+    /* Failed fetch leaves the snapshot and retries on the next query */
+    "cache fail 1\n"
+    "cache notify 0\n"
+    "check {cache lookup 3} {error {fetch failed}}\n"
+    "cache fail 0\n"
+    "check {lindex [cache lookup 3] 2} 9000\n"
+    "cache source {{5}}\n"
+    "cache notify 0\n"
+    "check {cache refresh} {error {Adapter record has no name field.}}\n"
+    "check {llength [cache list]} {error {Adapter record has no name field.}}\n"
+    "cache source [list $eth2 $eth2]\n"
+    "check {lsort -stride 2 -index 1 [cache refresh]} {removed {{LOOPBACK}} removed {{TUN-6}} removed {{USB-2}}}\n"
+    "check {llength [cache list]} 1\n"
+    "puts \"$checks checks, $failures failures\"\n"
+
+    /* Benchmark: 32 adapters with a few addresses each */
+    "set adapters {}\n"
+    "for {set i 1} {$i <= 32} {incr i} {\n"
+    "    set addrs {}\n"
+    "    for {set j 0} {$j < 8} {incr j} {lappend addrs [list 0 10.$i.$j.1 1 1 4 86400 86400 86400]}\n"
+    "    lappend adapters [list $i \"{ADAPTER-$i}\" 1500 $addrs $i]\n"
+    "}\n"
+    "cache source $adapters\n"
+    "cache notify 0\n"
+    "proc script_lookup {name} {\n"
+    "    lsearch -nocase -exact -inline -index 1 [cache fetch] $name\n"
+    "}\n"
+    "check {expr {[script_lookup {{adapter-17}}] eq [cache lookup {{adapter-17}}]}} 1\n"
+    "proc bench {label script {n 10000}} {\n"
+    "    set t [lindex [uplevel 1 [list time $script $n]] 0]\n"
+    "    puts [format {%-44s %12.2f us} $label $t]\n"
+    "}\n"
+    "bench {refetch and search per query} {script_lookup {{adapter-17}}}\n"
+    "bench {cached lookup by name} {cache lookup {{adapter-17}}}\n"
+    "bench {cached lookup by index} {cache lookup 17}\n"
+    "bench {notify one and refresh} {cache notify 17; cache refresh} 1000\n"
+    "puts \"$checks checks, $failures failures\"\n"
+    "set failures\n";
+
+int main(int argc, char **argv)
+{
+    Tcl_Interp *interp;
+    TestState ts;
+    AdaptCacheConfig config;
+    int failures;
+
+    (void) argc;
+    Tcl_FindExecutable(argv[0]);
+    interp = Tcl_CreateInterp();
+
+    ts.source.adaptersObj = Tcl_NewObj();
+    Tcl_IncrRefCount(ts.source.adaptersObj);
+    ts.source.fail = 0;
+    config.fetch = TestFetch;
+    config.fetch_ctx = &ts.source;
+    config.name_field = 1;
+    config.index_fields[0] = 0;
+    config.index_fields[1] = 4;
+    ts.acP = AdaptCacheNew(&config);
+    Tcl_CreateObjCommand(interp, "cache", TestCacheObjCmd, &ts, NULL);
+
+    if (Tcl_Eval(interp, testScript) != TCL_OK) {
+        fprintf(stderr, "%s\n", Tcl_GetStringResult(interp));
+        return 1;
+    }
+    failures = atoi(Tcl_GetStringResult(interp));
+    Tcl_DeleteInterp(interp);
+    AdaptCacheDelete(ts.acP);
+    Tcl_DecrRefCount(ts.source.adaptersObj);
+    return failures ? 1 : 0;
+}
+#endif /* ADAPTCACHE_TEST */
@@ -0,0 +1,85 @@
+#ifndef ADAPTCACHE_H
+#define ADAPTCACHE_H
+
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Snapshot of network adapter records indexed by adapter name and
+ * interface index. The snapshot is only refetched after a change
+ * notification has been received, and the new records are compared
+ * against the old ones so unchanged adapters keep their existing Tcl_Obj
+ * and callers can be told which adapters were added, changed or removed.
+ *
+ * Records are fetched and notifications delivered by the host so this
+ * module only depends on Tcl and can be tested with a simulated
+ * notification source on any platform. All calls must be made from the
+ * thread that owns the cache.
+ */
+
+#include <tcl.h>
+
+/*
+ * Fetches the records of all adapters. On success stores a list of
+ * records, each a Tcl list, in *adaptersP and returns TCL_OK. On error
+ * returns TCL_ERROR with a message in interp.
+ */
+typedef int AdaptCacheFetchProc(void *ctx, Tcl_Interp *interp,
+                                Tcl_Obj **adaptersP);
+
+typedef struct AdaptCacheConfig {
+    AdaptCacheFetchProc *fetch;
+    void *fetch_ctx;
+    int name_field;             /* Record field holding the adapter name */
+    int index_fields[2];        /* Fields holding interface indices or -1 */
+} AdaptCacheConfig;
+
+typedef struct AdaptCacheStats {
+    Tcl_WideInt fetches;        /* Calls to the fetch procedure */
+    Tcl_WideInt queries;        /* List and lookup calls */
+    Tcl_WideInt notifications;
+    int adapters;
+} AdaptCacheStats;
+
+typedef struct AdaptCache AdaptCache;
+
+AdaptCache *AdaptCacheNew(const AdaptCacheConfig *configP);
+void AdaptCacheDelete(AdaptCache *acP);
+
+/*
+ * Records a change notification for an interface index, 0 meaning any or
+ * all interfaces. The snapshot is refetched on the next refresh or query.
+ */
+void AdaptCacheNotify(AdaptCache *acP, int ifindex);
+
+/*
+ * Refetches the snapshot if a notification has been received since the
+ * last fetch. If changesP is not NULL, it receives a list of alternating
+ * event (added, changed or removed) and adapter name elements. Only
+ * adapters whose interface was named in a notification, or all adapters
+ * after a notification for index 0, are reported as changed. Other
+ * records are updated silently, so values such as address lifetimes that
+ * drift without notification do not generate events. The first fetch
+ * reports no events.
+ */
+int AdaptCacheRefresh(AdaptCache *acP, Tcl_Interp *interp,
+                      Tcl_Obj **changesP);
+
+/*
+ * Stores the list of all records in *listP. The object is owned by the
+ * cache and stays the same object until the snapshot changes.
+ */
+int AdaptCacheList(AdaptCache *acP, Tcl_Interp *interp, Tcl_Obj **listP);
+
+/*
+ * Stores the record of the adapter with the given name (case-insensitive)
+ * or interface index in *recP, or NULL if there is none.
+ */
+int AdaptCacheLookup(AdaptCache *acP, Tcl_Interp *interp, Tcl_Obj *keyObj,
+                     Tcl_Obj **recP);
+
+void AdaptCacheGetStats(AdaptCache *acP, AdaptCacheStats *statsP);
+
+#endif /* ADAPTCACHE_H */
@@ -7,6 +7,8 @@
 
 #include "twapi.h"
 #include "twapi_base.h"
+#include "secdesc.h"
+#include "sidobj.h"
 #include <wincred.h>
 
 static TCL_RESULT Twapi_LsaQueryInformationPolicy (
@@ -792,6 +794,9 @@ static int Twapi_CallOneArgObjCmd(ClientData clientdata, Tcl_Interp *interp, int
     Tcl_Obj *objs[2];
     GUID guid;
     SYSTEMTIME systime;
+    SecdView secdview;
+    const unsigned char *sidbinP;
+    unsigned int sidlen;
     Tcl_Size i;
     SWSMark mark = NULL;
     TCL_RESULT res;
@@ -843,7 +848,9 @@ static int Twapi_CallOneArgObjCmd(ClientData clientdata, Tcl_Interp *interp, int
 
     case 1004: // Twapi_ParseBinarySECURITY_DESCRIPTOR_RELATIVE
         u.secdP = (SECURITY_DESCRIPTOR *) ObjToByteArray(objv[0], &i);
-        if (i >= sizeof(SECURITY_DESCRIPTOR_RELATIVE) && IsValidSecurityDescriptor(u.secdP) && (u.secdP->Control & SE_SELF_RELATIVE)) {
+        /* IsValidSecurityDescriptor does not check offsets against the
+           length so use SecdParse which does */
+        if (SecdParse(&secdview, u.secdP, i) == 0) {
             result.type = TRT_OBJ;
             result.value.obj = ObjFromSECURITY_DESCRIPTOR(interp, u.secdP);
         } else {
@@ -918,6 +925,12 @@ static int Twapi_CallOneArgObjCmd(ClientData clientdata, Tcl_Interp *interp, int
     case 1015:
         u.sidP = NULL;
         result.type = TRT_BOOL;
+        /* Called for every account mapped so check the common form first.
+           This also leaves the binary SID as the internal rep. */
+        if (SidObjGet(objv[0], &sidbinP, &sidlen) == 0) {
+            result.value.bval = 1;
+            break;
+        }
         result.value.bval = ConvertStringSidToSidW(ObjToWinChars(objv[0]),
                                                    (void **)&u.sidP);
         if (u.sidP)
@@ -2465,6 +2478,9 @@ int Twapi_InitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
         DEFINE_TCL_CMD(parseargs, Twapi_ParseargsObjCmd),
         DEFINE_TCL_CMD(trap, Twapi_TrapObjCmd),
         DEFINE_TCL_CMD(kl_get, Twapi_KlGetObjCmd),
+        DEFINE_TCL_CMD(kl_set, Twapi_KlSetObjCmd),
+        DEFINE_TCL_CMD(kl_fields, Twapi_KlFieldsObjCmd),
+        DEFINE_TCL_CMD(kl_flatten, Twapi_KlFlattenObjCmd),
         DEFINE_TCL_CMD(twine, Twapi_TwineObjCmd),
         DEFINE_TCL_CMD(record, Twapi_RecordObjCmd),
         DEFINE_TCL_CMD(recordarray::_recordarray, Twapi_RecordArrayHelperObjCmd),
@@ -2480,6 +2496,11 @@ int Twapi_InitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
         DEFINE_TCL_CMD(FormatMessageFromString, Twapi_FormatMessageFromStringObjCmd),
         DEFINE_TCL_CMD(CredUIPromptForCredentials, Twapi_CredUIPromptObjCmd),
         DEFINE_TCL_CMD(CredUICmdLinePromptForCredentials, Twapi_CredUICmdLinePromptObjCmd),
+        DEFINE_TCL_CMD(Twapi_AccountResolve, Twapi_AccountResolveObjCmd),
+        DEFINE_TCL_CMD(Twapi_AccountResolveAsync, Twapi_AccountResolveAsyncObjCmd),
+        DEFINE_TCL_CMD(Twapi_AccountResolverForget, Twapi_AccountResolverForgetObjCmd),
+        DEFINE_TCL_CMD(Twapi_AccountResolverFlush, Twapi_AccountResolverFlushObjCmd),
+        DEFINE_TCL_CMD(Twapi_AccountResolverStats, Twapi_AccountResolverStatsObjCmd),
 #ifdef OBSOLETE
         DEFINE_TCL_CMD(ffi_load, Twapi_FfiLoadObjCmd),
         DEFINE_TCL_CMD(ffi0, Twapi_Ffi0ObjCmd),
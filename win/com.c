@@ -3176,6 +3176,13 @@ static int TwapiComInitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
         DEFINE_TCL_CMD(IDispatch_Invoke, Twapi_IDispatch_InvokeObjCmd),
         DEFINE_TCL_CMD(Twapi_ComServer, Twapi_ComServerObjCmd),
         DEFINE_TCL_CMD(Twapi_ClassFactory, Twapi_ClassFactoryObjCmd),
+        DEFINE_TCL_CMD(Twapi_ComEnumOpen, Twapi_ComEnumOpenObjCmd),
+        DEFINE_TCL_CMD(Twapi_ComEnumNext, Twapi_ComEnumNextObjCmd),
+        DEFINE_TCL_CMD(Twapi_ComEnumClose, Twapi_ComEnumCloseObjCmd),
+        DEFINE_TCL_CMD(Twapi_TypeLibCacheWrite, Twapi_TypeLibCacheWriteObjCmd),
+        DEFINE_TCL_CMD(Twapi_TypeLibCacheOpen, Twapi_TypeLibCacheOpenObjCmd),
+        DEFINE_TCL_CMD(Twapi_TypeLibCacheLookup, Twapi_TypeLibCacheLookupObjCmd),
+        DEFINE_TCL_CMD(Twapi_TypeLibCacheClose, Twapi_TypeLibCacheCloseObjCmd),
         DEFINE_TCL_CMD(CoCreateInstanceEx, Twapi_CoCreateInstanceExObjCmd),
         DEFINE_TCL_CMD(CoSetProxyBlanket, Twapi_CoSetProxyBlanketObjCmd),
         DEFINE_TCL_CMD(CoInitializeSecurity, Twapi_CoInitializeSecurityObjCmd),
@@ -0,0 +1,553 @@
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Prefetching IEnumVARIANT iterator. A background MTA thread keeps
+ * up to two batches of Next() results ready, retrieving only the
+ * requested properties of each item. Batches are handed to the
+ * script level as record arrays so no per-item comobj wrappers
+ * need to be created.
+ */
+
+#include "twapi.h"
+#include "twapi_com.h"
+#if !defined(TWAPI_REPLACE_CRT) && !defined(TWAPI_MINIMIZE_CRT)
+# include <process.h>
+#endif
+
+#define TWAPI_COMENUM_NSLOTS 2
+
+/* A batch of results. Filled by the worker, consumed by the interp thread */
+typedef struct TwapiComEnumSlot {
+    VARIANT *values;      /* nitems*nprops property values */
+    BYTE    *marshalled;  /* Per value flag - value holds IStreams to unmarshal */
+    ULONG    nitems;      /* Number of items (records) in the batch */
+    HRESULT  hr;          /* S_OK -> more to come, S_FALSE -> end, else error */
+} TwapiComEnumSlot;
+
+typedef struct TwapiComEnum {
+    IStream *streamP;          /* Marshalled IEnumVARIANT, consumed by worker */
+    HANDLE   thread;
+    HANDLE   free_sem;         /* Count of slots available to the worker */
+    HANDLE   ready_sem;        /* Count of slots ready for the interp */
+    HANDLE   cancel_event;     /* Signalled to stop the worker */
+    ULONG    batch_size;       /* Max items per Next() call */
+    int      nprops;           /* Number of property names */
+    WCHAR  **propnames;        /* Property names (in same block as struct) */
+    Tcl_Obj *fieldsObj;        /* Record array field names */
+    LCID     lcid;
+    VARIANT *items;            /* Worker scratch for Next(), batch_size items */
+    DISPID  *dispids;          /* Worker cache of property DISPIDs */
+    int      next_fill;        /* Slot the worker fills next. Worker only */
+    int      next_read;        /* Slot the interp reads next. Interp only */
+    int      done;             /* Interp has seen last batch. Interp only */
+    TwapiComEnumSlot slots[TWAPI_COMENUM_NSLOTS];
+} TwapiComEnum;
+
+static void TwapiComEnumFree(TwapiComEnum *ceP);
+
+/* Operations on the interface pointers held in a value */
+enum {
+    TWAPI_COMENUM_MARSHAL,      /* Worker - replace with IStreams */
+    TWAPI_COMENUM_UNMARSHAL,    /* Interp - replace IStreams with proxies */
+    TWAPI_COMENUM_RELEASE       /* Either - release unused marshal data */
+};
+
+static int TwapiComEnumMarshalVariant(VARIANT *varP, int op);
+
+/*
+ * Applies op to the interface pointer at ifcPP. A marshalled pointer is
+ * replaced by its IStream, which is an IUnknown like the pointer it
+ * replaces, so clearing the containing VARIANT or SAFEARRAY releases it.
+ * Pointers that fail to marshal or unmarshal are set to NULL.
+ * Returns 1 if *ifcPP was not NULL.
+ */
+static int TwapiComEnumMarshalIfc(IUnknown **ifcPP, REFIID iid, int op)
+{
+    IUnknown *ifcP = *ifcPP;
+    IStream *streamP;
+
+    if (ifcP == NULL)
+        return 0;
+    switch (op) {
+    case TWAPI_COMENUM_MARSHAL:
+        if (FAILED(CoMarshalInterThreadInterfaceInStream(iid, ifcP, &streamP)))
+            streamP = NULL;
+        ifcP->lpVtbl->Release(ifcP);
+        *ifcPP = (IUnknown *)streamP;
+        break;
+    case TWAPI_COMENUM_UNMARSHAL:
+        /* Stream released even on failure */
+        if (FAILED(CoGetInterfaceAndReleaseStream((IStream *)ifcP, iid,
+                                                  (void **)ifcPP)))
+            *ifcPP = NULL;
+        break;
+    case TWAPI_COMENUM_RELEASE:
+        CoReleaseMarshalData((IStream *)ifcP);
+        break;
+    }
+    return 1;
+}
+
+/*
+ * Applies op to the interface pointers in a SAFEARRAY of VT_DISPATCH,
+ * VT_UNKNOWN or VT_VARIANT elements. Returns 1 if there were any.
+ */
+static int TwapiComEnumMarshalArray(SAFEARRAY *saP, VARTYPE vt, int op)
+{
+    void *pv;
+    ULONG i, n;
+    int found = 0;
+
+    n = 1;
+    for (i = 0; i < saP->cDims; ++i)
+        n *= saP->rgsabound[i].cElements;
+    if (FAILED(SafeArrayAccessData(saP, &pv)))
+        return 0;
+    for (i = 0; i < n; ++i) {
+        if (vt == VT_VARIANT)
+            found |= TwapiComEnumMarshalVariant(&((VARIANT *)pv)[i], op);
+        else
+            found |= TwapiComEnumMarshalIfc(
+                &((IUnknown **)pv)[i],
+                vt == VT_DISPATCH ? &IID_IDispatch : &IID_IUnknown, op);
+    }
+    SafeArrayUnaccessData(saP);
+    return found;
+}
+
+/*
+ * Applies op to the interface pointers in a VARIANT, including those in
+ * arrays of interfaces or VARIANTs. The VARTYPE is left unchanged except
+ * that a lone interface that could not be marshalled becomes VT_EMPTY.
+ * Returns 1 if the value held any interface pointers.
+ */
+static int TwapiComEnumMarshalVariant(VARIANT *varP, int op)
+{
+    VARTYPE vt = V_VT(varP);
+    int found;
+
+    if (vt == VT_DISPATCH || vt == VT_UNKNOWN) {
+        found = TwapiComEnumMarshalIfc(
+            &V_UNKNOWN(varP),
+            vt == VT_DISPATCH ? &IID_IDispatch : &IID_IUnknown, op);
+        if (found && V_UNKNOWN(varP) == NULL)
+            V_VT(varP) = VT_EMPTY;
+        return found;
+    }
+    if ((vt & VT_ARRAY) && !(vt & VT_BYREF) && V_ARRAY(varP)) {
+        vt &= VT_TYPEMASK;
+        if (vt == VT_DISPATCH || vt == VT_UNKNOWN || vt == VT_VARIANT)
+            return TwapiComEnumMarshalArray(V_ARRAY(varP), vt, op);
+    }
+    return 0;
+}
+
+/*
+ * Retrieves property values for one item into valuesP. Called in the
+ * worker. Property DISPIDs are cached from the first item and only
+ * re-resolved if an item does not recognize them (e.g. different WMI class).
+ */
+static void TwapiComEnumGetProps(TwapiComEnum *ceP, VARIANT *itemP,
+                                 VARIANT *valuesP, BYTE *marshalledP)
+{
+    IDispatch *idispP = NULL;
+    DISPPARAMS noargs = {NULL, NULL, 0, 0};
+    HRESULT hr;
+    int i, retried;
+
+    if (V_VT(itemP) == VT_DISPATCH)
+        idispP = V_DISPATCH(itemP);
+    else if (V_VT(itemP) == VT_UNKNOWN && V_UNKNOWN(itemP)) {
+        if (FAILED(V_UNKNOWN(itemP)->lpVtbl->QueryInterface(
+                       V_UNKNOWN(itemP), &IID_IDispatch, (void **)&idispP)))
+            idispP = NULL;
+        else
+            idispP->lpVtbl->Release(idispP); /* Item still holds a ref */
+    }
+
+    for (i = 0; i < ceP->nprops; ++i) {
+        VariantInit(&valuesP[i]);
+        marshalledP[i] = 0;
+        if (idispP == NULL)
+            continue;
+        retried = 0;
+        if (ceP->dispids[i] == DISPID_UNKNOWN) {
+        resolve:
+            hr = idispP->lpVtbl->GetIDsOfNames(idispP, &IID_NULL,
+                                               &ceP->propnames[i], 1,
+                                               ceP->lcid, &ceP->dispids[i]);
+            if (FAILED(hr)) {
+                ceP->dispids[i] = DISPID_UNKNOWN;
+                continue;
+            }
+        }
+        hr = idispP->lpVtbl->Invoke(idispP, ceP->dispids[i], &IID_NULL,
+                                    ceP->lcid, DISPATCH_PROPERTYGET, &noargs,
+                                    &valuesP[i], NULL, NULL);
+        if ((hr == DISP_E_MEMBERNOTFOUND || hr == DISP_E_UNKNOWNNAME)
+            && ! retried) {
+            /* Cached DISPID not valid for this object */
+            VariantClear(&valuesP[i]);
+            retried = 1;
+            goto resolve;
+        }
+        if (FAILED(hr)) {
+            VariantClear(&valuesP[i]);
+            continue;
+        }
+
+        /*
+         * Interface pointers, including those in arrays, belong to our
+         * MTA. Marshal them so the interp thread can unmarshal into its
+         * own apartment.
+         */
+        marshalledP[i] = (BYTE) TwapiComEnumMarshalVariant(
+            &valuesP[i], TWAPI_COMENUM_MARSHAL);
+    }
+}
+
+#if defined(TWAPI_REPLACE_CRT) || defined(TWAPI_MINIMIZE_CRT)
+static DWORD WINAPI TwapiComEnumThread(void *pv)
+#else
+static unsigned __stdcall TwapiComEnumThread(void *pv)
+#endif
+{
+    TwapiComEnum *ceP = pv;
+    IEnumVARIANT *enumP = NULL;
+    TwapiComEnumSlot *slotP;
+    HANDLE waiters[2];
+    HRESULT hr;
+    ULONG i, nfetched;
+    int com_initialized;
+
+    hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    com_initialized = SUCCEEDED(hr);
+    if (com_initialized) {
+        hr = CoGetInterfaceAndReleaseStream(ceP->streamP, &IID_IEnumVARIANT,
+                                            (void **)&enumP);
+        ceP->streamP = NULL;
+    }
+
+    waiters[0] = ceP->cancel_event;
+    waiters[1] = ceP->free_sem;
+    while (1) {
+        if (WaitForMultipleObjects(2, waiters, FALSE, INFINITE) != (WAIT_OBJECT_0+1))
+            break;              /* Cancelled or error */
+        slotP = &ceP->slots[ceP->next_fill];
+        ceP->next_fill = (ceP->next_fill + 1) % TWAPI_COMENUM_NSLOTS;
+        slotP->nitems = 0;
+        if (enumP == NULL) {
+            /* Could not initialize. Report error through the slot */
+            slotP->hr = hr;
+            ReleaseSemaphore(ceP->ready_sem, 1, NULL);
+            break;
+        }
+
+        /* See comments in TwapiIEnumNextHelper about initializing */
+        for (i = 0; i < ceP->batch_size; ++i)
+            VariantInit(&ceP->items[i]);
+        nfetched = 0;
+        hr = enumP->lpVtbl->Next(enumP, ceP->batch_size, ceP->items, &nfetched);
+        if (hr == S_OK || hr == S_FALSE) {
+            if (nfetched > ceP->batch_size)
+                nfetched = ceP->batch_size; /* Paranoia */
+            for (i = 0; i < nfetched; ++i) {
+                TwapiComEnumGetProps(ceP, &ceP->items[i],
+                                     &slotP->values[i*ceP->nprops],
+                                     &slotP->marshalled[i*ceP->nprops]);
+                VariantClear(&ceP->items[i]);
+            }
+            slotP->nitems = nfetched;
+        }
+        slotP->hr = hr;
+        ReleaseSemaphore(ceP->ready_sem, 1, NULL);
+        if (hr != S_OK)
+            break;              /* End of enumeration or error */
+    }
+
+    if (enumP)
+        enumP->lpVtbl->Release(enumP);
+    if (com_initialized)
+        CoUninitialize();
+    return 0;
+}
+
+/* Releases the contents of a slot that was never passed to the interp */
+static void TwapiComEnumClearSlot(TwapiComEnum *ceP, TwapiComEnumSlot *slotP)
+{
+    ULONG i, n;
+    n = slotP->nitems * ceP->nprops;
+    for (i = 0; i < n; ++i) {
+        if (slotP->marshalled[i])
+            TwapiComEnumMarshalVariant(&slotP->values[i],
+                                       TWAPI_COMENUM_RELEASE);
+        VariantClear(&slotP->values[i]);
+    }
+    slotP->nitems = 0;
+}
+
+static void TwapiComEnumFree(TwapiComEnum *ceP)
+{
+    DWORD index;
+    int i;
+
+    if (ceP->thread) {
+        SetEvent(ceP->cancel_event);
+        /*
+         * The worker may be blocked in a call marshalled to this apartment
+         * so pump while waiting for it.
+         */
+        CoWaitForMultipleHandles(0, INFINITE, 1, &ceP->thread, &index);
+        CloseHandle(ceP->thread);
+    }
+    /* Worker is gone, any slot contents are ours to release */
+    for (i = 0; i < TWAPI_COMENUM_NSLOTS; ++i) {
+        TwapiComEnumClearSlot(ceP, &ceP->slots[i]);
+        if (ceP->slots[i].values)
+            TwapiFree(ceP->slots[i].values);
+        if (ceP->slots[i].marshalled)
+            TwapiFree(ceP->slots[i].marshalled);
+    }
+    if (ceP->streamP) {
+        CoReleaseMarshalData(ceP->streamP);
+        ceP->streamP->lpVtbl->Release(ceP->streamP);
+    }
+    if (ceP->items)
+        TwapiFree(ceP->items);
+    if (ceP->dispids)
+        TwapiFree(ceP->dispids);
+    if (ceP->fieldsObj)
+        ObjDecrRefs(ceP->fieldsObj);
+    if (ceP->free_sem)
+        CloseHandle(ceP->free_sem);
+    if (ceP->ready_sem)
+        CloseHandle(ceP->ready_sem);
+    if (ceP->cancel_event)
+        CloseHandle(ceP->cancel_event);
+    TwapiFree(ceP);
+}
+
+/*
+ * Twapi_ComEnumOpen IENUMVARIANT PROPNAMES BATCHSIZE LCID
+ * Returns a handle to a prefetching iterator. IENUMVARIANT is not
+ * released and may be released by caller once this returns.
+ */
+int Twapi_ComEnumOpenObjCmd(
+    ClientData clientdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiComEnum *ceP;
+    IEnumVARIANT *enumP;
+    Tcl_Obj **propObjs;
+    Tcl_Size nprops, len, names_size;
+    DWORD batch_size, lcid;
+    WCHAR *nameP;
+    HRESULT hr;
+    int i;
+#if defined(TWAPI_REPLACE_CRT) || defined(TWAPI_MINIMIZE_CRT)
+    DWORD tid;
+#else
+    unsigned int tid;
+#endif
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETPTR(enumP, IEnumVARIANT), ARGSKIP,
+                     GETDWORD(batch_size), GETDWORD(lcid),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    if (enumP == NULL)
+        return TwapiReturnError(interp, TWAPI_NULL_POINTER);
+    if (ObjGetElements(interp, objv[2], &nprops, &propObjs) != TCL_OK)
+        return TCL_ERROR;
+    if (nprops == 0)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
+                                   "No property names specified.");
+    if (batch_size == 0 || batch_size > 10000)
+        return TwapiReturnErrorMsg(interp, TWAPI_OUT_OF_RANGE,
+                                   "Batch size must be between 1 and 10000.");
+
+    /* Property names are stored in the same block following the struct */
+    names_size = 0;
+    for (i = 0; i < nprops; ++i) {
+        ObjToWinCharsN(propObjs[i], &len);
+        names_size += sizeof(WCHAR *) + (len + 1) * sizeof(WCHAR);
+    }
+    ceP = TwapiAllocZero(sizeof(*ceP) + names_size);
+    ceP->propnames = (WCHAR **)(ceP + 1);
+    nameP = (WCHAR *)(ceP->propnames + nprops);
+    for (i = 0; i < nprops; ++i) {
+        WCHAR *srcP = ObjToWinCharsN(propObjs[i], &len);
+        CopyMemory(nameP, srcP, len * sizeof(WCHAR));
+        nameP[len] = 0;
+        ceP->propnames[i] = nameP;
+        nameP += len + 1;
+    }
+    ceP->nprops = (int) nprops;
+    ceP->batch_size = batch_size;
+    ceP->lcid = lcid;
+    ceP->fieldsObj = ObjNewList(nprops, propObjs);
+    ObjIncrRefs(ceP->fieldsObj);
+
+    /* All buffers are allocated up front so memory use is bounded. */
+    ceP->items = TwapiAlloc(batch_size * sizeof(VARIANT));
+    ceP->dispids = TwapiAlloc(nprops * sizeof(DISPID));
+    for (i = 0; i < nprops; ++i)
+        ceP->dispids[i] = DISPID_UNKNOWN;
+    for (i = 0; i < TWAPI_COMENUM_NSLOTS; ++i) {
+        ceP->slots[i].values = TwapiAlloc(batch_size * nprops * sizeof(VARIANT));
+        ceP->slots[i].marshalled = TwapiAlloc(batch_size * nprops);
+    }
+
+    ceP->free_sem = CreateSemaphoreW(NULL, TWAPI_COMENUM_NSLOTS,
+                                     TWAPI_COMENUM_NSLOTS, NULL);
+    ceP->ready_sem = CreateSemaphoreW(NULL, 0, TWAPI_COMENUM_NSLOTS, NULL);
+    ceP->cancel_event = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (ceP->free_sem == NULL || ceP->ready_sem == NULL ||
+        ceP->cancel_event == NULL) {
+        hr = GetLastError();
+        goto error_return;
+    }
+
+    hr = CoMarshalInterThreadInterfaceInStream(&IID_IEnumVARIANT,
+                                               (IUnknown *)enumP,
+                                               &ceP->streamP);
+    if (FAILED(hr))
+        goto error_return;
+
+#if defined(TWAPI_REPLACE_CRT) || defined(TWAPI_MINIMIZE_CRT)
+    ceP->thread = CreateThread(NULL, 0, TwapiComEnumThread, ceP, 0, &tid);
+#else
+    ceP->thread = (HANDLE) _beginthreadex(NULL, 0, TwapiComEnumThread,
+                                          ceP, 0, &tid);
+#endif
+    if (ceP->thread == NULL) {
+        hr = GetLastError();
+        goto error_return;
+    }
+
+    if (TwapiRegisterPointerTic(ticP, ceP, TwapiComEnumFree) != TCL_OK) {
+        TwapiComEnumFree(ceP);
+        return TCL_ERROR;
+    }
+    ObjSetResult(interp, ObjFromOpaque(ceP, "TwapiComEnum*"));
+    return TCL_OK;
+
+error_return:
+    TwapiComEnumFree(ceP);
+    return Twapi_AppendSystemError(interp, hr);
+}
+
+/*
+ * Twapi_ComEnumNext HANDLE TIMEOUT
+ * Returns {MORE RECORDARRAY}. MORE is 0 when the enumeration is complete.
+ */
+int Twapi_ComEnumNextObjCmd(
+    ClientData clientdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiComEnum *ceP;
+    TwapiComEnumSlot *slotP;
+    Tcl_Obj *objs[2];
+    Tcl_Obj *raObjs[2];
+    Tcl_Obj **recObjs;
+    VARIANT *varP;
+    HRESULT hr;
+    DWORD timeout, index;
+    ULONG i;
+    int j;
+
+    if (TwapiGetArgsEx(ticP, objc-1, objv+1,
+                       GETVERIFIEDPTR(ceP, TwapiComEnum*, TwapiComEnumFree),
+                       GETDWORD(timeout), ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    if (ceP->done) {
+        objs[0] = ObjFromBoolean(0);
+        raObjs[0] = ceP->fieldsObj;
+        raObjs[1] = ObjEmptyList();
+        objs[1] = ObjNewList(2, raObjs);
+        return ObjSetResult(interp, ObjNewList(2, objs));
+    }
+
+    /* Pump so calls marshalled from the worker into our STA get serviced */
+    hr = CoWaitForMultipleHandles(0, timeout, 1, &ceP->ready_sem, &index);
+    if (hr == RPC_S_CALLPENDING)
+        return Twapi_AppendSystemError(interp, ERROR_TIMEOUT);
+    if (FAILED(hr))
+        return Twapi_AppendSystemError(interp, hr);
+
+    slotP = &ceP->slots[ceP->next_read];
+    ceP->next_read = (ceP->next_read + 1) % TWAPI_COMENUM_NSLOTS;
+
+    if (slotP->hr != S_OK && slotP->hr != S_FALSE) {
+        ceP->done = 1;
+        hr = slotP->hr;
+        TwapiComEnumClearSlot(ceP, slotP);
+        ReleaseSemaphore(ceP->free_sem, 1, NULL);
+        return Twapi_AppendSystemError(interp, hr);
+    }
+
+    recObjs = MemLifoPushFrame(ticP->memlifoP,
+                               (slotP->nitems + ceP->nprops) * sizeof(Tcl_Obj *),
+                               NULL);
+    for (i = 0; i < slotP->nitems; ++i) {
+        Tcl_Obj **fieldObjs = recObjs + slotP->nitems;
+        varP = &slotP->values[i * ceP->nprops];
+        for (j = 0; j < ceP->nprops; ++j, ++varP) {
+            if (slotP->marshalled[i*ceP->nprops + j]) {
+                /* Interfaces from the worker apartment */
+                TwapiComEnumMarshalVariant(varP, TWAPI_COMENUM_UNMARSHAL);
+            }
+            fieldObjs[j] = ObjFromVARIANT(varP, 1);
+            /* Ownership of interfaces passed on to the Tcl_Obj */
+            if (V_VT(varP) != VT_DISPATCH && V_VT(varP) != VT_UNKNOWN)
+                VariantClear(varP);
+        }
+        recObjs[i] = ObjNewList(ceP->nprops, fieldObjs);
+    }
+
+    raObjs[0] = ceP->fieldsObj;
+    raObjs[1] = ObjNewList(slotP->nitems, recObjs);
+    MemLifoPopFrame(ticP->memlifoP);
+
+    objs[0] = ObjFromBoolean(slotP->hr == S_OK);
+    objs[1] = ObjNewList(2, raObjs);
+    if (slotP->hr != S_OK)
+        ceP->done = 1;
+    slotP->nitems = 0;
+    ReleaseSemaphore(ceP->free_sem, 1, NULL);
+
+    return ObjSetResult(interp, ObjNewList(2, objs));
+}
+
+/*
+ * Twapi_ComEnumClose HANDLE
+ * Stops the worker and releases all resources.
+ */
+int Twapi_ComEnumCloseObjCmd(
+    ClientData clientdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiComEnum *ceP;
+
+    if (TwapiGetArgsEx(ticP, objc-1, objv+1,
+                       GETVERIFIEDPTR(ceP, TwapiComEnum*, TwapiComEnumFree),
+                       ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    if (TwapiUnregisterPointerTic(ticP, ceP, TwapiComEnumFree) != TCL_OK)
+        return TCL_ERROR;
+    TwapiComEnumFree(ceP);
+    return TCL_OK;
+}
@@ -0,0 +1,656 @@
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Connection table trackers. See conntrack.h.
+ *
+ * Build with -DCONNTRACK_TEST to get a standalone test driver that runs
+ * the diff engine over synthetic tables (see end of file).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "conntrack.h"
+
+void ConnTrackInit(ConnTrack *ctP, const ConnTrackFilter *filterP)
+{
+    memset(ctP, 0, sizeof(*ctP));
+    if (filterP)
+        ctP->filter = *filterP;
+    else {
+        ctP->filter.pid = -1;
+        ctP->filter.lport = -1;
+        ctP->filter.rport = -1;
+    }
+}
+
+void ConnTrackFinit(ConnTrack *ctP)
+{
+    free(ctP->entries);
+    free(ctP->loading);
+    free(ctP->events);
+    memset(ctP, 0, sizeof(*ctP));
+}
+
+void ConnTrackBegin(ConnTrack *ctP)
+{
+    ctP->nloading = 0;
+    ctP->nevents = 0;
+}
+
+/* Ensures *arrayPP has room for n elements of size elemsize */
+static int ConnTrackReserve(void **arrayPP, size_t *sizeP, size_t n,
+                            size_t elemsize)
+{
+    void *p;
+    size_t size;
+
+    if (n <= *sizeP)
+        return 0;
+    size = *sizeP ? *sizeP : 64;
+    while (size < n)
+        size *= 2;
+    p = realloc(*arrayPP, size * elemsize);
+    if (p == NULL)
+        return CONNTRACK_E_NOMEM;
+    *arrayPP = p;
+    *sizeP = size;
+    return 0;
+}
+
+static void ConnTrackPutU32(unsigned char *p, unsigned int v)
+{
+    p[0] = (unsigned char) (v >> 24);
+    p[1] = (unsigned char) (v >> 16);
+    p[2] = (unsigned char) (v >> 8);
+    p[3] = (unsigned char) v;
+}
+
+/* Row ports hold the network order port in their low 16 bits */
+static void ConnTrackPutPort(unsigned char *p, unsigned int rowport)
+{
+    unsigned short us = (unsigned short) rowport;
+    memcpy(p, &us, sizeof(us));
+}
+
+static int ConnTrackMatch(const ConnTrackFilter *filterP,
+                          const ConnTrackEntry *entryP)
+{
+    if (filterP->pid >= 0 &&
+        (unsigned long) filterP->pid != CONNTRACK_U32(entryP->key.pid))
+        return 0;
+    if (filterP->lport >= 0 &&
+        (unsigned long) filterP->lport != CONNTRACK_U16(entryP->key.lport))
+        return 0;
+    if (filterP->rport >= 0 &&
+        (unsigned long) filterP->rport != CONNTRACK_U16(entryP->key.rport))
+        return 0;
+    if (filterP->states &&
+        (entryP->state >= 32 || !(filterP->states & (1u << entryP->state))))
+        return 0;
+    return 1;
+}
+
+int ConnTrackAddRows(ConnTrack *ctP, int format, const void *rows,
+                     size_t nrows, size_t rowsize)
+{
+    ConnTrackEntry *entryP;
+    const char *rowP = rows;
+    size_t i, pid_offset;
+    unsigned int v;
+
+    if (ConnTrackReserve((void **) &ctP->loading, &ctP->loading_size,
+                         ctP->nloading + nrows, sizeof(ConnTrackEntry)))
+        return CONNTRACK_E_NOMEM;
+
+    switch (format) {
+    case CONNTRACK_TCP4: pid_offset = offsetof(ConnTrackTcp4Row, pid); break;
+    case CONNTRACK_TCP6: pid_offset = offsetof(ConnTrackTcp6Row, pid); break;
+    case CONNTRACK_UDP4: pid_offset = offsetof(ConnTrackUdp4Row, pid); break;
+    default: pid_offset = offsetof(ConnTrackUdp6Row, pid); break;
+    }
+
+    entryP = &ctP->loading[ctP->nloading];
+    for (i = 0; i < nrows; ++i, rowP += rowsize) {
+        memset(entryP, 0, sizeof(*entryP));
+        switch (format) {
+        case CONNTRACK_TCP4: {
+            const ConnTrackTcp4Row *r = (const ConnTrackTcp4Row *) rowP;
+            entryP->key.family = 4;
+            memcpy(entryP->key.laddr, &r->laddr, 4);
+            ConnTrackPutPort(entryP->key.lport, r->lport);
+            memcpy(entryP->key.raddr, &r->raddr, 4);
+            /* Windows leaves junk in the remote port of unconnected
+               sockets. Clear it so it does not show up as a change. */
+            if (r->raddr)
+                ConnTrackPutPort(entryP->key.rport, r->rport);
+            entryP->state = r->state;
+            break;
+        }
+        case CONNTRACK_TCP6: {
+            const ConnTrackTcp6Row *r = (const ConnTrackTcp6Row *) rowP;
+            static const unsigned char zeroes[16];
+            entryP->key.family = 6;
+            memcpy(entryP->key.laddr, r->laddr, 16);
+            ConnTrackPutPort(entryP->key.lport, r->lport);
+            ConnTrackPutU32(entryP->key.lscope, r->lscope);
+            memcpy(entryP->key.raddr, r->raddr, 16);
+            if (memcmp(r->raddr, zeroes, 16)) {
+                ConnTrackPutPort(entryP->key.rport, r->rport);
+                ConnTrackPutU32(entryP->key.rscope, r->rscope);
+            }
+            entryP->state = r->state;
+            break;
+        }
+        case CONNTRACK_UDP4: {
+            const ConnTrackUdp4Row *r = (const ConnTrackUdp4Row *) rowP;
+            entryP->key.family = 4;
+            memcpy(entryP->key.laddr, &r->laddr, 4);
+            ConnTrackPutPort(entryP->key.lport, r->lport);
+            break;
+        }
+        default: {
+            const ConnTrackUdp6Row *r = (const ConnTrackUdp6Row *) rowP;
+            entryP->key.family = 6;
+            memcpy(entryP->key.laddr, r->laddr, 16);
+            ConnTrackPutPort(entryP->key.lport, r->lport);
+            ConnTrackPutU32(entryP->key.lscope, r->lscope);
+            break;
+        }
+        }
+        if (rowsize >= pid_offset + sizeof(v)) {
+            memcpy(&v, rowP + pid_offset, sizeof(v));
+            ConnTrackPutU32(entryP->key.pid, v);
+        }
+        if (ConnTrackMatch(&ctP->filter, entryP)) {
+            ++entryP;
+            ++ctP->nloading;
+        }
+    }
+    return 0;
+}
+
+static int ConnTrackCompare(const void *a, const void *b)
+{
+    return memcmp(&((const ConnTrackEntry *) a)->key,
+                  &((const ConnTrackEntry *) b)->key, sizeof(ConnTrackKey));
+}
+
+/* Sorts the loaded snapshot, skipping the sort if already in order */
+static void ConnTrackSort(ConnTrack *ctP)
+{
+    ConnTrackEntry *entries = ctP->loading;
+    size_t i, n = ctP->nloading;
+    int sorted = 1;
+
+    for (i = 1; i < n; ++i) {
+        if (ConnTrackCompare(&entries[i-1], &entries[i]) > 0) {
+            sorted = 0;
+            break;
+        }
+    }
+    if (! sorted)
+        qsort(entries, n, sizeof(entries[0]), ConnTrackCompare);
+
+    /* Tables may briefly list an endpoint twice. Keep the last. */
+    if (n > 1) {
+        size_t j = 0;
+        for (i = 1; i < n; ++i) {
+            if (ConnTrackCompare(&entries[j], &entries[i]) != 0)
+                ++j;
+            if (i != j)
+                entries[j] = entries[i];
+        }
+        ctP->nloading = j + 1;
+    }
+}
+
+int ConnTrackDiff(ConnTrack *ctP)
+{
+    const ConnTrackEntry *oldP, *oldEndP, *newP, *newEndP;
+    ConnTrackEvent *evP;
+    ConnTrackEntry *swapP;
+    size_t swapSize;
+    int cmp;
+
+    ConnTrackSort(ctP);
+    if (ConnTrackReserve((void **) &ctP->events, &ctP->events_size,
+                         ctP->nentries + ctP->nloading,
+                         sizeof(ConnTrackEvent)))
+        return CONNTRACK_E_NOMEM;
+
+    oldP = ctP->entries;
+    oldEndP = oldP + ctP->nentries;
+    newP = ctP->loading;
+    newEndP = newP + ctP->nloading;
+    evP = ctP->events;
+    while (oldP < oldEndP || newP < newEndP) {
+        if (oldP == oldEndP)
+            cmp = 1;
+        else if (newP == newEndP)
+            cmp = -1;
+        else
+            cmp = ConnTrackCompare(oldP, newP);
+        if (cmp < 0) {
+            evP->type = CONNTRACK_CLOSED;
+            evP->old_state = oldP->state;
+            evP->entryP = oldP++;
+            ++evP;
+        } else if (cmp > 0) {
+            evP->type = CONNTRACK_OPENED;
+            evP->old_state = 0;
+            evP->entryP = newP++;
+            ++evP;
+        } else {
+            if (oldP->state != newP->state) {
+                evP->type = CONNTRACK_CHANGED;
+                evP->old_state = oldP->state;
+                evP->entryP = newP;
+                ++evP;
+            }
+            ++oldP;
+            ++newP;
+        }
+    }
+    ctP->nevents = evP - ctP->events;
+
+    /* The loaded snapshot becomes the previous one */
+    swapP = ctP->entries;
+    swapSize = ctP->entries_size;
+    ctP->entries = ctP->loading;
+    ctP->entries_size = ctP->loading_size;
+    ctP->nentries = ctP->nloading;
+    ctP->loading = swapP;
+    ctP->loading_size = swapSize;
+    ctP->nloading = 0;
+    return 0;
+}
+
+#ifdef CONNTRACK_TEST
+/*
+ * Test driver. Builds synthetic tables in the GetExtended{Tcp,Udp}Table
+ * row formats and checks the reported events.
+ *   cc -O2 -DCONNTRACK_TEST conntrack.c -o conntrack_test
+ *   ./conntrack_test           - functional tests
+ *   ./conntrack_test bench     - additionally times 200k connection polls
+ */
+#include <stdio.h>
+#include <time.h>
+
+static int failures;
+
+#define CHECK(cond_)                                                    \
+    do {                                                                \
+        if (! (cond_)) {                                                \
+            printf("FAIL line %d: %s\n", __LINE__, #cond_);             \
+            ++failures;                                                 \
+        }                                                               \
+    } while (0)
+
+/* Row port value for a host order port */
+static unsigned int TestPort(unsigned int port)
+{
+    unsigned char b[2];
+    unsigned short us;
+    b[0] = (unsigned char) (port >> 8);
+    b[1] = (unsigned char) port;
+    memcpy(&us, b, sizeof(us));
+    return us;
+}
+
+static unsigned int TestAddr(int a, int b, int c, int d)
+{
+    unsigned char bytes[4];
+    unsigned int v;
+    bytes[0] = (unsigned char) a; bytes[1] = (unsigned char) b;
+    bytes[2] = (unsigned char) c; bytes[3] = (unsigned char) d;
+    memcpy(&v, bytes, sizeof(v));
+    return v;
+}
+
+static ConnTrackTcp4Row TestTcp4(unsigned int state, unsigned int lport,
+                                 unsigned int raddr, unsigned int rport,
+                                 unsigned int pid)
+{
+    ConnTrackTcp4Row row;
+    row.state = state;
+    row.laddr = TestAddr(10, 0, 0, 1);
+    row.lport = TestPort(lport);
+    row.raddr = raddr;
+    row.rport = TestPort(rport);
+    row.pid = pid;
+    return row;
+}
+
+/* Counts events of a type, optionally checking a local port is among them */
+static int TestCount(const ConnTrack *ctP, int type, int lport)
+{
+    size_t i;
+    int n = 0, found = lport < 0;
+    for (i = 0; i < ctP->nevents; ++i) {
+        if (ctP->events[i].type != type)
+            continue;
+        ++n;
+        if ((int) CONNTRACK_U16(ctP->events[i].entryP->key.lport) == lport)
+            found = 1;
+    }
+    return found ? n : -1;
+}
+
+static void TestPoll(ConnTrack *ctP, int format, const void *rows,
+                     size_t nrows, size_t rowsize)
+{
+    ConnTrackBegin(ctP);
+    CHECK(ConnTrackAddRows(ctP, format, rows, nrows, rowsize) == 0);
+    CHECK(ConnTrackDiff(ctP) == 0);
+}
+
+static void TestTcp4Diffs(void)
+{
+    ConnTrack ct;
+    ConnTrackTcp4Row rows[8];
+    unsigned int peer = TestAddr(192, 168, 1, 9);
+
+    ConnTrackInit(&ct, NULL);
+    rows[0] = TestTcp4(2, 80, 0, 0, 100);       /* Listener */
+    rows[1] = TestTcp4(5, 80, peer, 50000, 100);
+    rows[2] = TestTcp4(5, 443, peer, 50001, 200);
+    rows[3] = TestTcp4(5, 22, peer, 50002, 300);
+    TestPoll(&ct, CONNTRACK_TCP4, rows, 4, sizeof(rows[0]));
+    CHECK(ct.nevents == 4);
+    CHECK(TestCount(&ct, CONNTRACK_OPENED, 22) == 4);
+    CHECK(ct.nentries == 4);
+
+    /* Same table, unsorted and with junk in the listener's remote port */
+    rows[4] = rows[0];
+    rows[0] = rows[3];
+    rows[3] = rows[4];
+    rows[3].rport = TestPort(1234);
+    TestPoll(&ct, CONNTRACK_TCP4, rows, 4, sizeof(rows[0]));
+    CHECK(ct.nevents == 0);
+
+    /* One closed, one opened, one changed state */
+    rows[0] = TestTcp4(8, 22, peer, 50002, 300);
+    rows[1] = TestTcp4(5, 8080, peer, 50003, 400);
+    TestPoll(&ct, CONNTRACK_TCP4, rows, 4, sizeof(rows[0]));
+    CHECK(ct.nevents == 3);
+    CHECK(TestCount(&ct, CONNTRACK_CLOSED, 80) == 1);
+    CHECK(TestCount(&ct, CONNTRACK_OPENED, 8080) == 1);
+    CHECK(TestCount(&ct, CONNTRACK_CHANGED, 22) == 1);
+    CHECK(ct.events[0].type == CONNTRACK_CHANGED &&
+          ct.events[0].old_state == 5 && ct.events[0].entryP->state == 8);
+    /* Closed events describe the old connection */
+    {
+        size_t i;
+        for (i = 0; i < ct.nevents; ++i) {
+            if (ct.events[i].type == CONNTRACK_CLOSED) {
+                CHECK(ct.events[i].entryP->state == 5);
+                CHECK(CONNTRACK_U16(ct.events[i].entryP->key.rport) == 50000);
+                CHECK(CONNTRACK_U32(ct.events[i].entryP->key.pid) == 100);
+            }
+        }
+    }
+
+    /* Duplicate rows are reported once. Same endpoints, new pid is a
+       different connection. */
+    rows[4] = rows[1];
+    rows[5] = rows[1];
+    rows[5].pid = 401;
+    TestPoll(&ct, CONNTRACK_TCP4, rows, 6, sizeof(rows[0]));
+    CHECK(ct.nevents == 1 && ct.events[0].type == CONNTRACK_OPENED &&
+          CONNTRACK_U32(ct.events[0].entryP->key.pid) == 401);
+
+    /* Everything closed */
+    TestPoll(&ct, CONNTRACK_TCP4, rows, 0, sizeof(rows[0]));
+    CHECK(ct.nevents == 5 && TestCount(&ct, CONNTRACK_CLOSED, -1) == 5);
+    CHECK(ct.nentries == 0);
+    ConnTrackFinit(&ct);
+}
+
+static void TestFilters(void)
+{
+    ConnTrack ct;
+    ConnTrackFilter filter;
+    ConnTrackTcp4Row rows[4];
+    unsigned int peer = TestAddr(172, 16, 0, 1);
+
+    rows[0] = TestTcp4(5, 80, peer, 40000, 100);
+    rows[1] = TestTcp4(5, 443, peer, 40001, 100);
+    rows[2] = TestTcp4(11, 443, peer, 40002, 200);
+    rows[3] = TestTcp4(2, 443, 0, 0, 200);
+
+    filter.pid = 100; filter.lport = -1; filter.rport = -1; filter.states = 0;
+    ConnTrackInit(&ct, &filter);
+    TestPoll(&ct, CONNTRACK_TCP4, rows, 4, sizeof(rows[0]));
+    CHECK(ct.nevents == 2 && ct.nentries == 2);
+    ConnTrackFinit(&ct);
+
+    filter.pid = -1; filter.lport = 443;
+    ConnTrackInit(&ct, &filter);
+    TestPoll(&ct, CONNTRACK_TCP4, rows, 4, sizeof(rows[0]));
+    CHECK(ct.nevents == 3);
+    ConnTrackFinit(&ct);
+
+    filter.lport = -1; filter.rport = 40002;
+    ConnTrackInit(&ct, &filter);
+    TestPoll(&ct, CONNTRACK_TCP4, rows, 4, sizeof(rows[0]));
+    CHECK(ct.nevents == 1 && ct.events[0].entryP->state == 11);
+    ConnTrackFinit(&ct);
+
+    /* State filter - leaving the selected states reports a close */
+    filter.rport = -1; filter.states = 1u << 5;
+    ConnTrackInit(&ct, &filter);
+    TestPoll(&ct, CONNTRACK_TCP4, rows, 4, sizeof(rows[0]));
+    CHECK(ct.nevents == 2);
+    rows[1].state = 11;
+    TestPoll(&ct, CONNTRACK_TCP4, rows, 4, sizeof(rows[0]));
+    CHECK(ct.nevents == 1 && ct.events[0].type == CONNTRACK_CLOSED);
+    ConnTrackFinit(&ct);
+}
+
+static void TestOtherFormats(void)
+{
+    ConnTrack ct;
+    ConnTrackTcp6Row t6[2];
+    ConnTrackUdp4Row u4[2];
+    ConnTrackUdp6Row u6[1];
+    struct { ConnTrackTcp4Row row; char module[16]; } big[2];
+    unsigned int basic[2][5];
+
+    memset(t6, 0, sizeof(t6));
+    t6[0].laddr[15] = 1;
+    t6[0].lport = TestPort(80);
+    t6[0].state = 2;
+    t6[0].rport = TestPort(999);        /* Ignored, not connected */
+    t6[0].pid = 7;
+    t6[1] = t6[0];
+    t6[1].raddr[0] = 0xfe; t6[1].raddr[1] = 0x80; t6[1].raddr[15] = 2;
+    t6[1].rport = TestPort(5000);
+    t6[1].rscope = 3;
+    t6[1].state = 5;
+    ConnTrackInit(&ct, NULL);
+    TestPoll(&ct, CONNTRACK_TCP6, t6, 2, sizeof(t6[0]));
+    CHECK(ct.nevents == 2);
+    CHECK(ct.events[0].entryP->key.family == 6);
+    CHECK(CONNTRACK_U16(ct.events[0].entryP->key.rport) == 0);
+    CHECK(CONNTRACK_U16(ct.events[1].entryP->key.rport) == 5000);
+    CHECK(CONNTRACK_U32(ct.events[1].entryP->key.rscope) == 3);
+    t6[1].state = 6;
+    TestPoll(&ct, CONNTRACK_TCP6, t6, 2, sizeof(t6[0]));
+    CHECK(ct.nevents == 1 && ct.events[0].type == CONNTRACK_CHANGED);
+    ConnTrackFinit(&ct);
+
+    /* UDP, both families in one snapshot */
+    u4[0].laddr = 0; u4[0].lport = TestPort(53); u4[0].pid = 10;
+    u4[1].laddr = 0; u4[1].lport = TestPort(123); u4[1].pid = 11;
+    memset(u6, 0, sizeof(u6));
+    u6[0].lport = TestPort(53); u6[0].pid = 10;
+    ConnTrackInit(&ct, NULL);
+    ConnTrackBegin(&ct);
+    CHECK(ConnTrackAddRows(&ct, CONNTRACK_UDP6, u6, 1, sizeof(u6[0])) == 0);
+    CHECK(ConnTrackAddRows(&ct, CONNTRACK_UDP4, u4, 2, sizeof(u4[0])) == 0);
+    CHECK(ConnTrackDiff(&ct) == 0);
+    CHECK(ct.nevents == 3);
+    CHECK(ct.events[0].entryP->key.family == 4 &&
+          ct.events[2].entryP->key.family == 6);
+    ConnTrackBegin(&ct);
+    CHECK(ConnTrackAddRows(&ct, CONNTRACK_UDP4, u4 + 1, 1, sizeof(u4[0])) == 0);
+    CHECK(ConnTrackAddRows(&ct, CONNTRACK_UDP6, u6, 1, sizeof(u6[0])) == 0);
+    CHECK(ConnTrackDiff(&ct) == 0);
+    CHECK(ct.nevents == 1 && ct.events[0].type == CONNTRACK_CLOSED &&
+          CONNTRACK_U16(ct.events[0].entryP->key.lport) == 53);
+    ConnTrackFinit(&ct);
+
+    /* Larger (module) rows and smaller rows without a pid */
+    memset(big, 0xcc, sizeof(big));
+    big[0].row = TestTcp4(5, 1, TestAddr(1, 2, 3, 4), 2, 42);
+    big[1].row = TestTcp4(5, 3, TestAddr(1, 2, 3, 4), 4, 43);
+    ConnTrackInit(&ct, NULL);
+    TestPoll(&ct, CONNTRACK_TCP4, big, 2, sizeof(big[0]));
+    CHECK(ct.nevents == 2 &&
+          CONNTRACK_U32(ct.events[1].entryP->key.pid) == 43);
+    ConnTrackFinit(&ct);
+
+    memcpy(basic[0], &big[0].row, sizeof(basic[0]));
+    memcpy(basic[1], &big[1].row, sizeof(basic[1]));
+    ConnTrackInit(&ct, NULL);
+    TestPoll(&ct, CONNTRACK_TCP4, basic, 2, sizeof(basic[0]));
+    CHECK(ct.nevents == 2 &&
+          CONNTRACK_U32(ct.events[1].entryP->key.pid) == 0);
+    ConnTrackFinit(&ct);
+}
+
+/* Randomized tables checked against a brute force diff */
+static unsigned int TestRand(unsigned int *seedP)
+{
+    *seedP = *seedP * 1103515245u + 12345u;
+    return (*seedP >> 8) & 0xffffff;
+}
+
+static int TestFind(const ConnTrackTcp4Row *rows, size_t n,
+                    const ConnTrackTcp4Row *r)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        if (rows[i].laddr == r->laddr && rows[i].lport == r->lport &&
+            rows[i].raddr == r->raddr && rows[i].rport == r->rport &&
+            rows[i].pid == r->pid)
+            return (int) i;
+    }
+    return -1;
+}
+
+static void TestRandom(unsigned int seed)
+{
+    ConnTrack ct;
+    ConnTrackTcp4Row a[64], b[64];
+    size_t na, nb, i;
+    int opened = 0, closed = 0, changed = 0, j;
+
+    /* Unique rows drawn from a small space so they collide often */
+    for (na = 0, i = 0; i < 40; ++i) {
+        ConnTrackTcp4Row r = TestTcp4(1 + TestRand(&seed) % 3,
+                                      TestRand(&seed) % 8,
+                                      TestAddr(10, 0, 0, 2), 1000,
+                                      TestRand(&seed) % 2);
+        if (TestFind(a, na, &r) < 0)
+            a[na++] = r;
+    }
+    for (nb = 0, i = 0; i < 40; ++i) {
+        ConnTrackTcp4Row r = TestTcp4(1 + TestRand(&seed) % 3,
+                                      TestRand(&seed) % 8,
+                                      TestAddr(10, 0, 0, 2), 1000,
+                                      TestRand(&seed) % 2);
+        if (TestFind(b, nb, &r) < 0)
+            b[nb++] = r;
+    }
+    for (i = 0; i < na; ++i) {
+        j = TestFind(b, nb, &a[i]);
+        if (j < 0)
+            ++closed;
+        else if (b[j].state != a[i].state)
+            ++changed;
+    }
+    for (i = 0; i < nb; ++i) {
+        if (TestFind(a, na, &b[i]) < 0)
+            ++opened;
+    }
+
+    ConnTrackInit(&ct, NULL);
+    TestPoll(&ct, CONNTRACK_TCP4, a, na, sizeof(a[0]));
+    CHECK(ct.nevents == na);
+    TestPoll(&ct, CONNTRACK_TCP4, b, nb, sizeof(b[0]));
+    CHECK(TestCount(&ct, CONNTRACK_OPENED, -1) == opened);
+    CHECK(TestCount(&ct, CONNTRACK_CLOSED, -1) == closed);
+    CHECK(TestCount(&ct, CONNTRACK_CHANGED, -1) == changed);
+    for (i = 1; i < ct.nevents; ++i)
+        CHECK(ConnTrackCompare(ct.events[i-1].entryP, ct.events[i].entryP) < 0);
+    ConnTrackFinit(&ct);
+}
+
+static double TestSeconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 200k connections with about 1% churn per poll */
+static void TestBench(void)
+{
+    enum { N = 200000, POLLS = 20 };
+    ConnTrack ct;
+    ConnTrackTcp4Row *rows;
+    unsigned int seed = 1;
+    double t, worst = 0, total = 0;
+    size_t i, nevents = 0;
+    int poll;
+
+    rows = malloc(N * sizeof(*rows));
+    for (i = 0; i < N; ++i) {
+        rows[i] = TestTcp4(5, 443, TestAddr(10, (int) (i >> 16), (int) (i >> 8) & 0xff, (int) i & 0xff),
+                           1024 + (unsigned int) (i % 60000), 4);
+    }
+    ConnTrackInit(&ct, NULL);
+    for (poll = 0; poll <= POLLS; ++poll) {
+        for (i = 0; poll && i < N / 100; ++i) {
+            ConnTrackTcp4Row *r = &rows[TestRand(&seed) % N];
+            if (TestRand(&seed) & 1)
+                r->state = r->state == 5 ? 8 : 5;
+            else
+                r->rport = TestPort(TestRand(&seed) & 0xffff);
+        }
+        t = TestSeconds();
+        TestPoll(&ct, CONNTRACK_TCP4, rows, N, sizeof(rows[0]));
+        t = TestSeconds() - t;
+        if (poll) {
+            total += t;
+            nevents += ct.nevents;
+            if (t > worst)
+                worst = t;
+        }
+    }
+    printf("%d connections: %.2f ms average poll, %.2f ms worst, %lu events per poll\n",
+           N, 1000 * total / POLLS, 1000 * worst,
+           (unsigned long) (nevents / POLLS));
+    ConnTrackFinit(&ct);
+    free(rows);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int seed;
+
+    TestTcp4Diffs();
+    TestFilters();
+    TestOtherFormats();
+    for (seed = 1; seed <= 500; ++seed)
+        TestRandom(seed);
+    printf("%s\n", failures ? "FAILED" : "All tests OK");
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        TestBench();
+    return failures ? 1 : 0;
+}
+#endif
@@ -0,0 +1,161 @@
+#ifndef CONNTRACK_H
+#define CONNTRACK_H
+
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Connection table trackers. A tracker keeps the previous snapshot of a
+ * TCP or UDP connection table, sorted by endpoints, and compares each
+ * new snapshot against it with a single merge pass, reporting only the
+ * connections that were opened, closed or changed state. Rows are
+ * filtered by pid, port and state as they are loaded so connections of
+ * no interest are never converted to Tcl values.
+ *
+ * Rows are loaded in the raw formats returned by GetExtended{Tcp,Udp}Table.
+ * Only the C library is needed so the diff engine can be tested with
+ * synthetic tables on any platform.
+ */
+
+#include <stddef.h>
+
+/* Error code used when memory cannot be allocated */
+#ifndef CONNTRACK_E_NOMEM
+#define CONNTRACK_E_NOMEM 8      /* ERROR_NOT_ENOUGH_MEMORY */
+#endif
+
+/*
+ * Row formats. These match the layouts of MIB_TCPROW_OWNER_PID,
+ * MIB_TCP6ROW_OWNER_PID, MIB_UDPROW_OWNER_PID and MIB_UDP6ROW_OWNER_PID.
+ * Larger rows, such as the OWNER_MODULE variants, may be loaded by
+ * passing their size. Smaller rows without a pid, such as MIB_TCPROW,
+ * are loaded with pid 0.
+ */
+#define CONNTRACK_TCP4 0
+#define CONNTRACK_TCP6 1
+#define CONNTRACK_UDP4 2
+#define CONNTRACK_UDP6 3
+
+typedef struct ConnTrackTcp4Row {
+    unsigned int state;
+    unsigned int laddr;         /* Network byte order */
+    unsigned int lport;         /* Low 16 bits, network byte order */
+    unsigned int raddr;
+    unsigned int rport;
+    unsigned int pid;
+} ConnTrackTcp4Row;
+
+typedef struct ConnTrackTcp6Row {
+    unsigned char laddr[16];
+    unsigned int lscope;
+    unsigned int lport;
+    unsigned char raddr[16];
+    unsigned int rscope;
+    unsigned int rport;
+    unsigned int state;
+    unsigned int pid;
+} ConnTrackTcp6Row;
+
+typedef struct ConnTrackUdp4Row {
+    unsigned int laddr;
+    unsigned int lport;
+    unsigned int pid;
+} ConnTrackUdp4Row;
+
+typedef struct ConnTrackUdp6Row {
+    unsigned char laddr[16];
+    unsigned int lscope;
+    unsigned int lport;
+    unsigned int pid;
+} ConnTrackUdp6Row;
+
+/*
+ * Connection identity. All members are bytes, with ports and pid in
+ * network byte order, so there is no padding and memcmp orders
+ * connections by family, local endpoint, remote endpoint and pid.
+ * IPv4 addresses occupy the first 4 bytes of the address arrays.
+ */
+typedef struct ConnTrackKey {
+    unsigned char family;       /* 4 or 6 */
+    unsigned char laddr[16];
+    unsigned char lport[2];
+    unsigned char raddr[16];
+    unsigned char rport[2];
+    unsigned char lscope[4];
+    unsigned char rscope[4];
+    unsigned char pid[4];
+} ConnTrackKey;
+
+typedef struct ConnTrackEntry {
+    ConnTrackKey key;
+    unsigned int state;         /* MIB_TCP_STATE, 0 for UDP */
+} ConnTrackEntry;
+
+/* Accessors for ConnTrackKey members */
+#define CONNTRACK_U16(a_) (((unsigned int) (a_)[0] << 8) | (a_)[1])
+#define CONNTRACK_U32(a_) (((unsigned int) (a_)[0] << 24) |    \
+                           ((unsigned int) (a_)[1] << 16) |    \
+                           ((unsigned int) (a_)[2] << 8) | (a_)[3])
+
+/*
+ * Row filter. Negative values and an empty state mask match anything.
+ * Bit n of states selects state n. Filtering applies to every snapshot
+ * so a connection moving to a state that is not selected is reported
+ * as closed.
+ */
+typedef struct ConnTrackFilter {
+    long pid;
+    long lport;                 /* Host byte order */
+    long rport;
+    unsigned int states;
+} ConnTrackFilter;
+
+#define CONNTRACK_OPENED  0
+#define CONNTRACK_CLOSED  1
+#define CONNTRACK_CHANGED 2     /* State changed */
+
+typedef struct ConnTrackEvent {
+    int type;                   /* CONNTRACK_OPENED etc. */
+    unsigned int old_state;     /* CONNTRACK_CHANGED only */
+    const ConnTrackEntry *entryP; /* The new entry, or old one if closed */
+} ConnTrackEvent;
+
+typedef struct ConnTrack {
+    ConnTrackFilter filter;
+    ConnTrackEntry *entries;    /* Previous snapshot, sorted */
+    size_t nentries;
+    size_t entries_size;        /* Allocated */
+    ConnTrackEntry *loading;    /* Snapshot being loaded */
+    size_t nloading;
+    size_t loading_size;
+    ConnTrackEvent *events;     /* From the last diff */
+    size_t nevents;
+    size_t events_size;
+} ConnTrack;
+
+/* Initializes a tracker with no previous snapshot. filterP may be NULL. */
+void ConnTrackInit(ConnTrack *ctP, const ConnTrackFilter *filterP);
+void ConnTrackFinit(ConnTrack *ctP);
+
+/* Starts loading a new snapshot. Events from the last diff are invalidated. */
+void ConnTrackBegin(ConnTrack *ctP);
+
+/*
+ * Adds nrows rows of the given format, each rowsize bytes, to the
+ * snapshot being loaded. Returns 0 or CONNTRACK_E_NOMEM.
+ */
+int ConnTrackAddRows(ConnTrack *ctP, int format, const void *rows,
+                     size_t nrows, size_t rowsize);
+
+/*
+ * Compares the loaded snapshot against the previous one, which it then
+ * replaces. Fills ctP->events, in key order, and returns 0 or
+ * CONNTRACK_E_NOMEM in which case the previous snapshot is kept. Events
+ * remain valid until the next ConnTrackBegin. The first diff after
+ * ConnTrackInit reports every connection as opened.
+ */
+int ConnTrackDiff(ConnTrack *ctP);
+
+#endif /* CONNTRACK_H */
@@ -3013,6 +3013,369 @@ static TCL_RESULT Twapi_CertVerifyChainPolicyObjCmd(ClientData clientdata, Tcl_I
     return res;
 }
 
+/*
+ * Batch certificate verification. Chains are built and verified on
+ * thread pool workers that share one chain engine. Each result is
+ * queued back to the interpreter as a callback so the interp thread
+ * never blocks on revocation checks.
+ */
+typedef struct _TwapiCertVerifyBatch {
+    TwapiInterpContext *ticP;
+    LONG volatile nrefs;
+    LONG volatile next;         /* Index of next certificate to verify */
+    LONG volatile nworkers;     /* Workers still running */
+    LONG volatile cancelled;
+    int     closed;             /* Only accessed from interp thread */
+    DWORD   ncerts;
+    PCCERT_CONTEXT *certs;      /* Our own references */
+    HCERTCHAINENGINE hce;
+    HCERTSTORE hstore;
+    FILETIME ft;
+    FILETIME *ftP;
+    DWORD   chain_flags;
+    CERT_CHAIN_PARA chain_para;
+    DWORD   policy;
+    CERT_CHAIN_POLICY_PARA policy_para;
+    SSL_EXTRA_CERT_CHAIN_POLICY_PARA ssl_para;
+    DWORD   start_ticks;
+    DWORD   timeout;            /* Milliseconds, 0 -> none */
+    /* Usage OID pointers and strings, server name follow the structure */
+} TwapiCertVerifyBatch;
+
+typedef struct _TwapiCertVerifyCallback {
+    TwapiCallback cb;
+    TwapiCertVerifyBatch *batchP;
+    LONG  index;                /* -1 -> all certificates done */
+    DWORD trust_errors;         /* Chain TrustStatus.dwErrorStatus */
+    DWORD policy_status;        /* CERT_CHAIN_POLICY_STATUS.dwError */
+} TwapiCertVerifyCallback;
+
+static void TwapiCertVerifyBatchUnref(TwapiCertVerifyBatch *batchP, int decr)
+{
+    DWORD i;
+
+    if (InterlockedExchangeAdd(&batchP->nrefs, -decr) > decr)
+        return;
+
+    for (i = 0; i < batchP->ncerts; ++i)
+        CertFreeCertificateContext(batchP->certs[i]);
+    if (batchP->hstore)
+        CertCloseStore(batchP->hstore, 0);
+    if (batchP->hce)
+        CertFreeCertificateChainEngine(batchP->hce);
+    TwapiInterpContextUnref(batchP->ticP, 1);
+    TwapiFree(batchP);
+}
+
+static int TwapiCertVerifyCallbackFn(TwapiCallback *cbP)
+{
+    TwapiCertVerifyCallback *cvcbP = (TwapiCertVerifyCallback *) cbP;
+    TwapiCertVerifyBatch *batchP = cvcbP->batchP;
+    Tcl_Interp *interp = cbP->ticP->interp;
+    Tcl_Obj *objs[7];
+    int nobjs, tcl_status;
+
+    cvcbP->batchP = NULL;
+    cbP->response.type = TRT_EMPTY;
+    if (interp == NULL || Tcl_InterpDeleted(interp)) {
+        /* Nobody left to close the batch so drop the registration ref */
+        if (! batchP->closed) {
+            batchP->closed = 1;
+            InterlockedExchange(&batchP->cancelled, 1);
+            TwapiCertVerifyBatchUnref(batchP, 1);
+        }
+        TwapiCertVerifyBatchUnref(batchP, 1);
+        return TCL_ERROR;
+    }
+    if (batchP->closed) {
+        TwapiCertVerifyBatchUnref(batchP, 1);
+        return TCL_OK;
+    }
+
+    objs[0] = STRING_LITERAL_OBJ(TWAPI_TCL_NAMESPACE "::_cert_verify_batch_handler");
+    objs[1] = ObjFromOpaque(batchP, "TwapiCertVerifyBatch*");
+    if (cvcbP->index < 0) {
+        objs[2] = STRING_LITERAL_OBJ("done");
+        nobjs = 3;
+    } else {
+        objs[2] = STRING_LITERAL_OBJ("result");
+        objs[3] = ObjFromLong(cvcbP->index);
+        objs[4] = ObjFromDWORD(cbP->winerr);
+        objs[5] = ObjFromDWORD(cvcbP->trust_errors);
+        objs[6] = ObjFromDWORD(cvcbP->policy_status);
+        nobjs = 7;
+    }
+    TwapiCertVerifyBatchUnref(batchP, 1); /* Matches ref when queued */
+
+    tcl_status = TwapiEvalAndUpdateCallback(cbP, nobjs, objs, TRT_EMPTY);
+    if (tcl_status != TCL_OK)
+        Twapi_AppendLog(interp, L"CALLBACK FAIL");
+    return tcl_status;
+}
+
+static void TwapiCertVerifyBatchNotify(TwapiCertVerifyBatch *batchP,
+                                       LONG index, DWORD winerr,
+                                       DWORD trust_errors, DWORD policy_status)
+{
+    TwapiCertVerifyCallback *cvcbP;
+
+    cvcbP = (TwapiCertVerifyCallback *)
+        TwapiCallbackNew(batchP->ticP, TwapiCertVerifyCallbackFn,
+                         sizeof(*cvcbP));
+    InterlockedIncrement(&batchP->nrefs); /* Released in callback */
+    cvcbP->batchP = batchP;
+    cvcbP->index = index;
+    cvcbP->trust_errors = trust_errors;
+    cvcbP->policy_status = policy_status;
+    cvcbP->cb.winerr = winerr;
+    TwapiEnqueueCallback(batchP->ticP, &cvcbP->cb, TWAPI_ENQUEUE_DIRECT,
+                         0, /* No response wanted */
+                         NULL);
+}
+
+static DWORD WINAPI TwapiCertVerifyBatchWorker(void *pv)
+{
+    TwapiCertVerifyBatch *batchP = (TwapiCertVerifyBatch *) pv;
+    PCCERT_CHAIN_CONTEXT chainP;
+    CERT_CHAIN_POLICY_STATUS policy_status;
+    DWORD winerr, trust_errors;
+    LONG i;
+
+    while ((i = InterlockedIncrement(&batchP->next) - 1) < (LONG) batchP->ncerts) {
+        winerr = ERROR_SUCCESS;
+        trust_errors = 0;
+        policy_status.dwError = 0;
+        if (batchP->cancelled)
+            winerr = ERROR_CANCELLED;
+        else if (batchP->timeout &&
+                 (GetTickCount() - batchP->start_ticks) >= batchP->timeout)
+            winerr = ERROR_TIMEOUT;
+        else if (! CertGetCertificateChain(batchP->hce, batchP->certs[i],
+                                           batchP->ftP, batchP->hstore,
+                                           &batchP->chain_para,
+                                           batchP->chain_flags, NULL, &chainP))
+            winerr = GetLastError();
+        else {
+            trust_errors = chainP->TrustStatus.dwErrorStatus;
+            ZeroMemory(&policy_status, sizeof(policy_status));
+            policy_status.cbSize = sizeof(policy_status);
+            if (! CertVerifyCertificateChainPolicy(
+                    (LPCSTR) (DWORD_PTR) batchP->policy, chainP,
+                    &batchP->policy_para, &policy_status))
+                winerr = GetLastError();
+            CertFreeCertificateChain(chainP);
+        }
+        TwapiCertVerifyBatchNotify(batchP, i, winerr, trust_errors,
+                                   policy_status.dwError);
+    }
+
+    if (InterlockedDecrement(&batchP->nworkers) == 0)
+        TwapiCertVerifyBatchNotify(batchP, -1, ERROR_SUCCESS, 0, 0);
+    TwapiCertVerifyBatchUnref(batchP, 1);
+    return 0;
+}
+
+/*
+ * Twapi_CertVerifyBatch CERTS ENGINE TIMESTAMP HSTORE CHAINPARA CHAINFLAGS
+ *     POLICY POLICYPARA TIMEOUT NWORKERS
+ * ENGINE is 0 for the user and 1 for the machine chain engine. TIMEOUT
+ * bounds the whole batch and each URL retrieval. Returns a batch handle
+ * that must be passed to Twapi_CertVerifyBatchClose.
+ */
+static TCL_RESULT Twapi_CertVerifyBatchObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiCertVerifyBatch *batchP = NULL;
+    Tcl_Obj *certsObj, *ftObj, *chainObj, *policyObj, **certObjs;
+    Tcl_Size ncerts;
+    HCERTSTORE hstore;
+    DWORD engine, chain_flags, policy, timeout, nworkers, i, nusages;
+    CERT_CHAIN_PARA chain_para;
+    PCERT_CHAIN_POLICY_PARA policy_paramP = NULL;
+    SSL_EXTRA_CERT_CHAIN_POLICY_PARA *sslP;
+    CERT_CHAIN_ENGINE_CONFIG engine_config;
+    PCCERT_CONTEXT certP;
+    MemLifoMarkHandle mark;
+    size_t sz, server_len;
+    char *p;
+    TCL_RESULT res;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETOBJ(certsObj), GETDWORD(engine), GETOBJ(ftObj),
+                     GETVERIFIEDORNULL(hstore, HCERTSTORE, CertCloseStore),
+                     GETOBJ(chainObj), GETDWORD(chain_flags),
+                     GETDWORD(policy), GETOBJ(policyObj),
+                     GETDWORD(timeout), GETDWORD(nworkers),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    if (policy < 1 || policy > 8)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Invalid certificate policy identifier.");
+    if (ObjGetElements(interp, certsObj, &ncerts, &certObjs) != TCL_OK)
+        return TCL_ERROR;
+    for (i = 0; i < (DWORD) ncerts; ++i) {
+        if (ObjToVerifiedPointerTic(ticP, certObjs[i], (void **)&certP,
+                                    "PCCERT_CONTEXT",
+                                    CertFreeCertificateContext) != TCL_OK)
+            return TCL_ERROR;
+    }
+
+    mark = MemLifoPushMark(ticP->memlifoP);
+    res = ParseCERT_CHAIN_PARA(ticP, chainObj, &chain_para);
+    if (res == TCL_OK)
+        res = ParseCERT_CHAIN_POLICY_PARA(ticP, policyObj, policy, &policy_paramP);
+    if (res != TCL_OK)
+        goto vamoose;
+
+    /*
+     * The parsed parameters live in the memlifo. Copy them into the
+     * batch allocation as workers outlive this call.
+     */
+    nusages = chain_para.RequestedUsage.Usage.cUsageIdentifier;
+    sz = sizeof(*batchP) + ncerts * sizeof(PCCERT_CONTEXT)
+        + nusages * sizeof(LPSTR);
+    for (i = 0; i < nusages; ++i)
+        sz += lstrlenA(chain_para.RequestedUsage.Usage.rgpszUsageIdentifier[i]) + 1;
+    sslP = policy_paramP->pvExtraPolicyPara;
+    server_len = 0;
+    if (sslP && sslP->pwszServerName)
+        server_len = lstrlenW(sslP->pwszServerName) + 1;
+    sz += server_len * sizeof(WCHAR);
+
+    batchP = TwapiAllocZero(sz);
+    batchP->ncerts = (DWORD) ncerts;
+    batchP->certs = (PCCERT_CONTEXT *) (batchP + 1);
+    batchP->chain_para = chain_para;
+    batchP->chain_para.RequestedUsage.Usage.rgpszUsageIdentifier =
+        (LPSTR *) (batchP->certs + ncerts);
+    p = (char *) (batchP->chain_para.RequestedUsage.Usage.rgpszUsageIdentifier + nusages);
+    if (server_len) {
+        /* WCHARs first to keep them aligned */
+        CopyMemory(p, sslP->pwszServerName, server_len * sizeof(WCHAR));
+        batchP->ssl_para = *sslP;
+        batchP->ssl_para.pwszServerName = (WCHAR *) p;
+        p += server_len * sizeof(WCHAR);
+    } else if (sslP) {
+        batchP->ssl_para = *sslP;
+    }
+    for (i = 0; i < nusages; ++i) {
+        LPSTR oid = chain_para.RequestedUsage.Usage.rgpszUsageIdentifier[i];
+        size_t len = lstrlenA(oid) + 1;
+        CopyMemory(p, oid, len);
+        batchP->chain_para.RequestedUsage.Usage.rgpszUsageIdentifier[i] = p;
+        p += len;
+    }
+    batchP->policy = policy;
+    batchP->policy_para = *policy_paramP;
+    if (sslP)
+        batchP->policy_para.pvExtraPolicyPara = &batchP->ssl_para;
+
+    if (ObjToFILETIME(NULL, ftObj, &batchP->ft) == TCL_OK)
+        batchP->ftP = &batchP->ft;
+    else if (ObjCharLength(ftObj) != 0) {
+        res = TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Invalid time format");
+        goto vamoose;
+    }
+
+    /*
+     * Private engine shared by all workers so the URL retrieval timeout
+     * can be bounded without changing the default engines.
+     */
+    ZeroMemory(&engine_config, sizeof(engine_config));
+    /* Size without the Windows 8 fields so older systems accept it */
+    engine_config.cbSize = offsetof(CERT_CHAIN_ENGINE_CONFIG, CycleDetectionModulus) + sizeof(DWORD);
+    if (engine)
+        engine_config.dwFlags = CERT_CHAIN_USE_LOCAL_MACHINE_STORE;
+    engine_config.dwUrlRetrievalTimeout = timeout;
+    if (! CertCreateCertificateChainEngine(&engine_config, &batchP->hce)) {
+        res = TwapiReturnSystemError(interp);
+        goto vamoose;
+    }
+    if (timeout)
+        chain_flags |= CERT_CHAIN_REVOCATION_ACCUMULATIVE_TIMEOUT;
+    batchP->chain_flags = chain_flags;
+    batchP->timeout = timeout;
+
+    if (hstore)
+        batchP->hstore = CertDuplicateStore(hstore);
+    for (i = 0; i < batchP->ncerts; ++i) {
+        ObjToVerifiedPointerTic(ticP, certObjs[i], (void **)&certP,
+                                "PCCERT_CONTEXT", CertFreeCertificateContext);
+        batchP->certs[i] = CertDuplicateCertificateContext(certP);
+    }
+
+    batchP->ticP = ticP;
+    TwapiInterpContextRef(ticP, 1);
+    batchP->nrefs = 1;          /* For the registration */
+
+    if (nworkers == 0)
+        nworkers = 1;
+    if (nworkers > batchP->ncerts)
+        nworkers = batchP->ncerts ? batchP->ncerts : 1;
+    batchP->start_ticks = GetTickCount();
+    for (i = 0; i < nworkers; ++i) {
+        InterlockedIncrement(&batchP->nworkers);
+        InterlockedIncrement(&batchP->nrefs);
+        if (! QueueUserWorkItem(TwapiCertVerifyBatchWorker, batchP,
+                                WT_EXECUTELONGFUNCTION)) {
+            InterlockedDecrement(&batchP->nrefs);
+            InterlockedDecrement(&batchP->nworkers);
+            break;
+        }
+    }
+    if (i == 0) {
+        res = TwapiReturnSystemError(interp);
+        TwapiCertVerifyBatchUnref(batchP, 1);
+        batchP = NULL;
+        goto vamoose;
+    }
+
+    res = TwapiRegisterPointerTic(ticP, batchP, TwapiCertVerifyBatchUnref);
+    if (res != TCL_OK) {
+        /* Workers already hold references. Stop them as close would. */
+        InterlockedExchange(&batchP->cancelled, 1);
+        batchP->closed = 1;
+        TwapiCertVerifyBatchUnref(batchP, 1);
+        batchP = NULL;
+        goto vamoose;
+    }
+    ObjSetResult(interp, ObjFromOpaque(batchP, "TwapiCertVerifyBatch*"));
+    batchP = NULL;              /* Now owned by registration and workers */
+
+vamoose:
+    if (batchP) {
+        /* Error before any worker started, nothing shared yet */
+        if (batchP->hce)
+            CertFreeCertificateChainEngine(batchP->hce);
+        TwapiFree(batchP);
+    }
+    MemLifoPopMark(mark);
+    return res;
+}
+
+/*
+ * Twapi_CertVerifyBatchClose BATCH
+ * Cancels any verifications not yet started and releases the batch.
+ * No further callbacks are made for the batch.
+ */
+static TCL_RESULT Twapi_CertVerifyBatchCloseObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiCertVerifyBatch *batchP;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETVERIFIEDPTR(batchP, TwapiCertVerifyBatch*,
+                                    TwapiCertVerifyBatchUnref),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    if (TwapiUnregisterPointerTic(ticP, batchP, TwapiCertVerifyBatchUnref) != TCL_OK)
+        return TCL_ERROR;
+    InterlockedExchange(&batchP->cancelled, 1);
+    batchP->closed = 1;
+    TwapiCertVerifyBatchUnref(batchP, 1);
+    return TCL_OK;
+}
+
 static TCL_RESULT Twapi_CertChainSimpleChainObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
     PCCERT_CHAIN_CONTEXT chainP;
@@ -5705,6 +6068,7 @@ static int Twapi_PBKDF2ObjCmd(ClientData clientdata, Tcl_Interp *interp, int obj
     switch (alg_id) {
     case CALG_SHA1: prf = &sha1Prf; break;
     case CALG_SHA_256: prf = &sha256Prf; break;
+    case CALG_SHA_512: prf = &sha512Prf; break;
     default:
         res = TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
                                   "Invalid PRF value specified.");
@@ -5817,6 +6181,8 @@ static int TwapiCryptoInitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
         DEFINE_TCL_CMD(CertFindCertificateInStore, Twapi_CertFindCertificateInStoreObjCmd),
         DEFINE_TCL_CMD(CertGetCertificateChain, Twapi_CertGetCertificateChainObjCmd),
         DEFINE_TCL_CMD(Twapi_CertVerifyChainPolicy, Twapi_CertVerifyChainPolicyObjCmd),
+        DEFINE_TCL_CMD(Twapi_CertVerifyBatch, Twapi_CertVerifyBatchObjCmd),
+        DEFINE_TCL_CMD(Twapi_CertVerifyBatchClose, Twapi_CertVerifyBatchCloseObjCmd),
         DEFINE_TCL_CMD(Twapi_HashPublicKeyInfo, Twapi_HashPublicKeyInfoObjCmd),
         DEFINE_TCL_CMD(CryptFindOIDInfo, Twapi_CryptFindOIDInfoObjCmd),
         DEFINE_TCL_CMD(CryptDecodeObjectEx, Twapi_CryptDecodeObjectExObjCmd), // Tcl
@@ -5828,6 +6194,7 @@ static int TwapiCryptoInitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
         DEFINE_TCL_CMD(CryptUnprotectData, Twapi_CryptUnprotectObjCmd),
         DEFINE_TCL_CMD(PFXExportCertStoreEx, Twapi_PFXExportCertStoreExObjCmd),
         DEFINE_TCL_CMD(PFXImportCertStore, Twapi_PFXImportCertStoreObjCmd),
+        DEFINE_TCL_CMD(Twapi_CertStoreRecords, Twapi_CertStoreRecordsObjCmd),
         DEFINE_TCL_CMD(CryptQueryObject, Twapi_CryptQueryObjectObjCmd),
         DEFINE_TCL_CMD(WinVerifyTrust, Twapi_WinVerifyTrustObjCmd), // TBD Tcl
         DEFINE_TCL_CMD(CryptCATAdminEnumCatalogFromHash, Twapi_CryptCATAdminEnumCatalogFromHashObjCmd), // TBD Tcl
@@ -0,0 +1,1086 @@
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * C structure layouts. See cslayout.h.
+ *
+ * Build with -DCSLAYOUT_TEST to get a standalone test and benchmark of
+ * encoding and decoding arrays of nested structures (see end of file).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "cslayout.h"
+
+/*
+ * Conversion table entries. A compiled layout is flattened into a
+ * sequence of operations with offsets relative to the start of the
+ * record, nested structures and arrays of structures being bracketed
+ * by BEGIN and END. The conversion routine for every leaf is picked at
+ * compile time so the encode and decode loops need no type dispatch.
+ */
+typedef Tcl_Obj *CsDecodeProc(const CsField *fieldP, const char *p);
+typedef int CsEncodeProc(Tcl_Interp *interp, const CsField *fieldP,
+                         Tcl_Obj *objP, char *p);
+typedef enum CsOpCode {
+    CS_OP_SCALAR,
+    CS_OP_ARRAY,                /* Array of scalars */
+    CS_OP_BEGIN,                /* Start of a nested list of values */
+    CS_OP_END
+} CsOpCode;
+typedef struct CsOp {
+    CsOpCode code;
+    unsigned int offset;        /* From start of the record */
+    unsigned int count;         /* ARRAY, BEGIN - number of values */
+    int exact;                  /* BEGIN - value list must have count elements */
+    const CsField *fieldP;
+    CsDecodeProc *decode;
+    CsEncodeProc *encode;
+} CsOp;
+
+/* Reference counts are shared across threads via the registry */
+TCL_DECLARE_MUTEX(csRefLock)
+
+CsLayout *CsLayoutNew(int nfields)
+{
+    CsLayout *layoutP;
+    size_t sz;
+
+    sz = sizeof(*layoutP);
+    if (nfields > 1)
+        sz += (nfields - 1) * sizeof(layoutP->fields[0]);
+    layoutP = (CsLayout *) ckalloc(sz);
+    memset(layoutP, 0, sz);
+    layoutP->nrefs = 1;
+    layoutP->nfields = nfields;
+    layoutP->alignment = 1;
+    return layoutP;
+}
+
+void CsLayoutRef(CsLayout *layoutP)
+{
+    Tcl_MutexLock(&csRefLock);
+    layoutP->nrefs += 1;
+    Tcl_MutexUnlock(&csRefLock);
+}
+
+void CsLayoutUnref(CsLayout *layoutP)
+{
+    int i, nrefs;
+
+    Tcl_MutexLock(&csRefLock);
+    nrefs = --layoutP->nrefs;
+    Tcl_MutexUnlock(&csRefLock);
+    if (nrefs > 0)
+        return;
+    if (layoutP->ops)
+        ckfree((char *) layoutP->ops);
+    for (i = 0; i < layoutP->nfields; ++i) {
+        if (layoutP->fields[i].name)
+            ckfree(layoutP->fields[i].name);
+        if (layoutP->fields[i].child)
+            CsLayoutUnref(layoutP->fields[i].child);
+    }
+    ckfree((char *) layoutP);
+}
+
+void CsFieldSetName(CsField *fieldP, Tcl_Obj *nameObj)
+{
+    int len;
+    const char *name = Tcl_GetStringFromObj(nameObj, &len);
+
+    if (fieldP->name)
+        ckfree(fieldP->name);
+    fieldP->name = ckalloc(len + 1);
+    memcpy(fieldP->name, name, len + 1);
+}
+
+int CsLayoutFieldIndex(const CsLayout *layoutP, const char *name)
+{
+    int i;
+    for (i = 0; i < layoutP->nfields; ++i) {
+        if (layoutP->fields[i].name &&
+            strcmp(layoutP->fields[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Data in byte arrays need not be aligned so all loads go through
+ * memcpy which compilers reduce to a single move. Needs a union u
+ * with a member for each type in scope.
+ */
+#define CS_LOAD(type_, p_) \
+    (memcpy(&u.type_, (p_), sizeof(u.type_)), u.type_)
+
+Tcl_Obj *CsFieldDecodeElem(const CsField *fieldP, const void *p, int flags)
+{
+    union {
+        signed char i8; unsigned char u8; short i16; unsigned short u16;
+        int i32; unsigned int u32; Tcl_WideInt i64; float f; double d;
+        void *pv; const char *s;
+    } u;
+
+    switch (fieldP->type) {
+    case CS_BOOL: return Tcl_NewBooleanObj(CS_LOAD(i32, p) != 0);
+    case CS_I8: return Tcl_NewIntObj(CS_LOAD(i8, p));
+    case CS_U8: return Tcl_NewIntObj(CS_LOAD(u8, p));
+    case CS_I16: return Tcl_NewIntObj(CS_LOAD(i16, p));
+    case CS_U16: return Tcl_NewIntObj(CS_LOAD(u16, p));
+    case CS_I32: return Tcl_NewIntObj(CS_LOAD(i32, p));
+    case CS_U32: return Tcl_NewWideIntObj(CS_LOAD(u32, p));
+    case CS_I64: /* Fall thru */
+    case CS_U64: return Tcl_NewWideIntObj(CS_LOAD(i64, p));
+    case CS_FLOAT: return Tcl_NewDoubleObj(CS_LOAD(f, p));
+    case CS_DOUBLE: return Tcl_NewDoubleObj(CS_LOAD(d, p));
+    case CS_STRING:
+        memcpy(&u.s, p, sizeof(u.s));
+        return Tcl_NewStringObj(u.s ? u.s : "", -1);
+    case CS_POINTER:
+        return Tcl_NewWideIntObj((Tcl_WideInt) (size_t) CS_LOAD(pv, p));
+    case CS_HOST:
+        return fieldP->from_ptr(p);
+    case CS_STRUCT:
+        return CsLayoutDecode(fieldP->child, p, flags);
+    default:
+        return Tcl_NewObj();
+    }
+}
+
+Tcl_Obj *CsFieldDecode(const CsField *fieldP, const void *p, int flags)
+{
+    Tcl_Obj *listObj;
+    unsigned int i;
+
+    if (fieldP->count == 0)
+        return CsFieldDecodeElem(fieldP, p, flags);
+    listObj = Tcl_NewListObj(0, NULL);
+    for (i = 0; i < fieldP->count; ++i) {
+        Tcl_ListObjAppendElement(NULL, listObj,
+                                 CsFieldDecodeElem(fieldP, p, flags));
+        p = (const char *) p + fieldP->size;
+    }
+    return listObj;
+}
+
+Tcl_Obj *CsLayoutDecode(const CsLayout *layoutP, const void *p, int flags)
+{
+    Tcl_Obj *objs[64] = {NULL};
+    Tcl_Obj **objv;
+    Tcl_Obj *listObj;
+    int i, n;
+
+    n = layoutP->nfields;
+    if (flags & CS_DECODE_DICT)
+        n *= 2;
+    objv = n <= (int) (sizeof(objs)/sizeof(objs[0])) ?
+        objs : (Tcl_Obj **) ckalloc(n * sizeof(*objv));
+    for (i = 0, n = 0; i < layoutP->nfields; ++i) {
+        const CsField *fieldP = &layoutP->fields[i];
+        if (flags & CS_DECODE_DICT)
+            objv[n++] = Tcl_NewStringObj(fieldP->name, -1);
+        objv[n++] = CsFieldDecode(fieldP, (const char *) p + fieldP->offset,
+                                  flags);
+    }
+    listObj = Tcl_NewListObj(n, objv);
+    if (objv != objs)
+        ckfree((char *) objv);
+    return listObj;
+}
+
+/*
+ * Layout compiler. Definitions have the same form as those accepted by
+ * ObjCastToCStruct, a list of {NAME TYPE ?COUNT? ?CHILDDEF?} elements.
+ */
+static const struct {
+    const char *name;
+    CsType type;
+    unsigned int size;
+} csBuiltinTypes[] = {
+    {"void", CS_VOID, 0},
+    {"bool", CS_BOOL, sizeof(int)},
+    {"i1", CS_I8, 1},
+    {"ui1", CS_U8, 1},
+    {"i2", CS_I16, 2},
+    {"ui2", CS_U16, 2},
+    {"i4", CS_I32, 4},
+    {"ui4", CS_U32, 4},
+    {"i8", CS_I64, 8},
+    {"ui8", CS_U64, 8},
+    {"r4", CS_FLOAT, sizeof(float)},
+    {"r8", CS_DOUBLE, sizeof(double)},
+    {"lpstr", CS_STRING, sizeof(char *)},
+    {"cbsize", CS_U32, 4},
+    {"struct", CS_STRUCT, 0},
+    {NULL, CS_VOID, 0}
+};
+
+#define CS_DECODER(name_, ctype_, newobj_)                              \
+    static Tcl_Obj *name_(const CsField *fieldP, const char *p)         \
+    {                                                                   \
+        ctype_ v;                                                       \
+        (void) fieldP;                                                  \
+        memcpy(&v, p, sizeof(v));                                       \
+        return newobj_;                                                 \
+    }
+CS_DECODER(CsDecodeBool, int, Tcl_NewBooleanObj(v != 0))
+CS_DECODER(CsDecodeI8, signed char, Tcl_NewIntObj(v))
+CS_DECODER(CsDecodeU8, unsigned char, Tcl_NewIntObj(v))
+CS_DECODER(CsDecodeI16, short, Tcl_NewIntObj(v))
+CS_DECODER(CsDecodeU16, unsigned short, Tcl_NewIntObj(v))
+CS_DECODER(CsDecodeI32, int, Tcl_NewIntObj(v))
+CS_DECODER(CsDecodeU32, unsigned int, Tcl_NewWideIntObj(v))
+CS_DECODER(CsDecodeI64, Tcl_WideInt, Tcl_NewWideIntObj(v))
+CS_DECODER(CsDecodeFloat, float, Tcl_NewDoubleObj(v))
+CS_DECODER(CsDecodeDouble, double, Tcl_NewDoubleObj(v))
+CS_DECODER(CsDecodeString, const char *, Tcl_NewStringObj(v ? v : "", -1))
+CS_DECODER(CsDecodePointer, void *,
+           Tcl_NewWideIntObj((Tcl_WideInt) (size_t) v))
+
+static Tcl_Obj *CsDecodeHost(const CsField *fieldP, const char *p)
+{
+    return fieldP->from_ptr(p);
+}
+
+static Tcl_Obj *CsDecodeVoid(const CsField *fieldP, const char *p)
+{
+    (void) fieldP; (void) p;
+    return Tcl_NewObj();
+}
+
+/* Integers are truncated to the field width as by a C cast */
+#define CS_INT_ENCODER(name_, ctype_)                                   \
+    static int name_(Tcl_Interp *interp, const CsField *fieldP,         \
+                     Tcl_Obj *objP, char *p)                            \
+    {                                                                   \
+        Tcl_WideInt w;                                                  \
+        ctype_ v;                                                       \
+        (void) fieldP;                                                  \
+        if (Tcl_GetWideIntFromObj(interp, objP, &w) != TCL_OK)          \
+            return TCL_ERROR;                                           \
+        v = (ctype_) w;                                                 \
+        memcpy(p, &v, sizeof(v));                                       \
+        return TCL_OK;                                                  \
+    }
+CS_INT_ENCODER(CsEncodeI8, signed char)
+CS_INT_ENCODER(CsEncodeI16, short)
+CS_INT_ENCODER(CsEncodeI32, int)
+CS_INT_ENCODER(CsEncodeI64, Tcl_WideInt)
+
+static int CsEncodeBool(Tcl_Interp *interp, const CsField *fieldP,
+                        Tcl_Obj *objP, char *p)
+{
+    int v;
+    (void) fieldP;
+    if (Tcl_GetBooleanFromObj(interp, objP, &v) != TCL_OK)
+        return TCL_ERROR;
+    memcpy(p, &v, sizeof(v));
+    return TCL_OK;
+}
+
+static int CsEncodeFloat(Tcl_Interp *interp, const CsField *fieldP,
+                         Tcl_Obj *objP, char *p)
+{
+    double d;
+    float f;
+    (void) fieldP;
+    if (Tcl_GetDoubleFromObj(interp, objP, &d) != TCL_OK)
+        return TCL_ERROR;
+    f = (float) d;
+    memcpy(p, &f, sizeof(f));
+    return TCL_OK;
+}
+
+static int CsEncodeDouble(Tcl_Interp *interp, const CsField *fieldP,
+                          Tcl_Obj *objP, char *p)
+{
+    double d;
+    (void) fieldP;
+    if (Tcl_GetDoubleFromObj(interp, objP, &d) != TCL_OK)
+        return TCL_ERROR;
+    memcpy(p, &d, sizeof(d));
+    return TCL_OK;
+}
+
+/* cbsize fields default to the size of the containing struct */
+static int CsEncodeCbSize(Tcl_Interp *interp, const CsField *fieldP,
+                          Tcl_Obj *objP, char *p)
+{
+    Tcl_WideInt w;
+    unsigned int v;
+    if (Tcl_GetWideIntFromObj(interp, objP, &w) != TCL_OK)
+        return TCL_ERROR;
+    v = w ? (unsigned int) w : (unsigned int) fieldP->cbsize;
+    memcpy(p, &v, sizeof(v));
+    return TCL_OK;
+}
+
+static int CsEncodeHost(Tcl_Interp *interp, const CsField *fieldP,
+                        Tcl_Obj *objP, char *p)
+{
+    return fieldP->to_ptr(interp, objP, p);
+}
+
+static int CsEncodeVoid(Tcl_Interp *interp, const CsField *fieldP,
+                        Tcl_Obj *objP, char *p)
+{
+    (void) interp; (void) fieldP; (void) objP; (void) p;
+    return TCL_OK;
+}
+
+/* Fields that cannot be encoded keep a NULL encoder */
+static void CsFieldProcs(const CsField *fieldP, CsDecodeProc **decodePP,
+                         CsEncodeProc **encodePP)
+{
+    CsDecodeProc *decodeP;
+    CsEncodeProc *encodeP = NULL;
+
+    switch (fieldP->type) {
+    case CS_BOOL: decodeP = CsDecodeBool; encodeP = CsEncodeBool; break;
+    case CS_I8: decodeP = CsDecodeI8; encodeP = CsEncodeI8; break;
+    case CS_U8: decodeP = CsDecodeU8; encodeP = CsEncodeI8; break;
+    case CS_I16: decodeP = CsDecodeI16; encodeP = CsEncodeI16; break;
+    case CS_U16: decodeP = CsDecodeU16; encodeP = CsEncodeI16; break;
+    case CS_I32: decodeP = CsDecodeI32; encodeP = CsEncodeI32; break;
+    case CS_U32:
+        decodeP = CsDecodeU32;
+        encodeP = fieldP->cbsize ? CsEncodeCbSize : CsEncodeI32;
+        break;
+    case CS_I64: /* Fall thru */
+    case CS_U64: decodeP = CsDecodeI64; encodeP = CsEncodeI64; break;
+    case CS_FLOAT: decodeP = CsDecodeFloat; encodeP = CsEncodeFloat; break;
+    case CS_DOUBLE: decodeP = CsDecodeDouble; encodeP = CsEncodeDouble; break;
+    case CS_STRING: decodeP = CsDecodeString; break;
+    case CS_POINTER: decodeP = CsDecodePointer; break;
+    case CS_HOST:
+        decodeP = CsDecodeHost;
+        if (fieldP->to_ptr)
+            encodeP = CsEncodeHost;
+        break;
+    default: decodeP = CsDecodeVoid; encodeP = CsEncodeVoid; break;
+    }
+    *decodePP = decodeP;
+    *encodePP = encodeP;
+}
+
+/* Number of operations needed for a layout. Arrays of structs are unrolled. */
+static int CsCountOps(const CsLayout *layoutP)
+{
+    int i, n = 0, nchild;
+
+    for (i = 0; i < layoutP->nfields; ++i) {
+        const CsField *fieldP = &layoutP->fields[i];
+        if (fieldP->type != CS_STRUCT) {
+            n += 1;
+            continue;
+        }
+        nchild = 2 + CsCountOps(fieldP->child);
+        if (fieldP->count)
+            n += 2 + fieldP->count * nchild;
+        else
+            n += nchild;
+    }
+    return n;
+}
+
+static CsOp *CsEmitBegin(CsOp *opP, const CsField *fieldP,
+                         unsigned int offset, unsigned int count, int exact)
+{
+    memset(opP, 0, sizeof(*opP));
+    opP->code = CS_OP_BEGIN;
+    opP->fieldP = fieldP;
+    opP->offset = offset;
+    opP->count = count;
+    opP->exact = exact;
+    return opP + 1;
+}
+
+static CsOp *CsEmitEnd(CsOp *opP, const CsField *fieldP)
+{
+    memset(opP, 0, sizeof(*opP));
+    opP->code = CS_OP_END;
+    opP->fieldP = fieldP;
+    return opP + 1;
+}
+
+static CsOp *CsEmitOps(const CsLayout *layoutP, unsigned int base, CsOp *opP)
+{
+    const CsLayout *childP;
+    unsigned int i, j, offset;
+
+    for (i = 0; i < (unsigned int) layoutP->nfields; ++i) {
+        const CsField *fieldP = &layoutP->fields[i];
+        offset = base + fieldP->offset;
+        if (fieldP->type != CS_STRUCT) {
+            opP->code = fieldP->count ? CS_OP_ARRAY : CS_OP_SCALAR;
+            opP->offset = offset;
+            opP->count = fieldP->count;
+            opP->exact = 0;
+            opP->fieldP = fieldP;
+            CsFieldProcs(fieldP, &opP->decode, &opP->encode);
+            ++opP;
+            continue;
+        }
+        childP = fieldP->child;
+        if (fieldP->count == 0) {
+            opP = CsEmitBegin(opP, fieldP, offset, childP->nfields, 1);
+            opP = CsEmitOps(childP, offset, opP);
+            opP = CsEmitEnd(opP, fieldP);
+            continue;
+        }
+        opP = CsEmitBegin(opP, fieldP, offset, fieldP->count, 0);
+        for (j = 0; j < fieldP->count; ++j, offset += fieldP->size) {
+            opP = CsEmitBegin(opP, fieldP, offset, childP->nfields, 1);
+            opP = CsEmitOps(childP, offset, opP);
+            opP = CsEmitEnd(opP, fieldP);
+        }
+        opP = CsEmitEnd(opP, fieldP);
+    }
+    return opP;
+}
+
+static int CsInvalidDef(Tcl_Interp *interp, Tcl_Obj *defObj)
+{
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("Invalid cstruct definition \"%s\".",
+                                           Tcl_GetString(defObj)));
+    return TCL_ERROR;
+}
+
+int CsLayoutCompile(Tcl_Interp *interp, Tcl_Obj *defObj,
+                    const CsHostType *hostTypes, CsLayout **layoutPP)
+{
+    CsLayout *layoutP;
+    Tcl_Obj **defs, **elems;
+    int i, j, ndefs, nelems, count, cbsize_field = -1;
+    unsigned int offset, align;
+
+    if (Tcl_ListObjGetElements(NULL, defObj, &ndefs, &defs) != TCL_OK ||
+        ndefs == 0)
+        return CsInvalidDef(interp, defObj);
+
+    layoutP = CsLayoutNew(ndefs);
+    layoutP->encodable = 1;
+    for (offset = 0, i = 0; i < ndefs; ++i) {
+        CsField *fieldP = &layoutP->fields[i];
+        const char *typeName;
+
+        if (Tcl_ListObjGetElements(NULL, defs[i], &nelems, &elems) != TCL_OK ||
+            nelems < 2 || nelems > 4)
+            goto invalid_def;
+        count = 0;
+        if (nelems > 2 &&
+            (Tcl_GetIntFromObj(NULL, elems[2], &count) != TCL_OK || count < 0))
+            goto invalid_def;
+        CsFieldSetName(fieldP, elems[0]);
+        fieldP->count = count;
+
+        typeName = Tcl_GetString(elems[1]);
+        for (j = 0; csBuiltinTypes[j].name; ++j) {
+            if (strcmp(typeName, csBuiltinTypes[j].name) == 0)
+                break;
+        }
+        if (csBuiltinTypes[j].name) {
+            fieldP->type = csBuiltinTypes[j].type;
+            fieldP->size = csBuiltinTypes[j].size;
+        } else if (hostTypes) {
+            for (j = 0; hostTypes[j].name; ++j) {
+                if (strcmp(typeName, hostTypes[j].name) == 0)
+                    break;
+            }
+            if (hostTypes[j].name == NULL)
+                goto invalid_def;
+            fieldP->type = CS_HOST;
+            fieldP->size = hostTypes[j].size;
+            fieldP->from_ptr = hostTypes[j].from_ptr;
+            fieldP->to_ptr = hostTypes[j].to_ptr;
+        } else
+            goto invalid_def;
+
+        align = fieldP->size;
+        switch (fieldP->type) {
+        case CS_VOID:
+            /* Only valid as the sole field, for function returns */
+            if (ndefs != 1)
+                goto invalid_def;
+            align = 1;
+            break;
+        case CS_U32:
+            if (strcmp(typeName, "cbsize") == 0) {
+                if (count)
+                    goto invalid_def;
+                cbsize_field = i;
+            }
+            break;
+        case CS_STRING:
+            layoutP->encodable = 0;
+            break;
+        case CS_HOST:
+            if (fieldP->to_ptr == NULL)
+                layoutP->encodable = 0;
+            break;
+        case CS_STRUCT:
+            if (nelems < 4)
+                goto invalid_def;
+            if (CsLayoutCompile(interp, elems[3], hostTypes,
+                                &fieldP->child) != TCL_OK) {
+                CsLayoutUnref(layoutP);
+                return TCL_ERROR;
+            }
+            fieldP->size = fieldP->child->size;
+            align = fieldP->child->alignment;
+            if (! fieldP->child->encodable)
+                layoutP->encodable = 0;
+            break;
+        default:
+            break;
+        }
+
+        if (align > layoutP->alignment)
+            layoutP->alignment = align;
+        offset = (offset + align - 1) & ~(align - 1);
+        fieldP->offset = offset;
+        offset += fieldP->size * (count ? count : 1);
+    }
+    layoutP->size = (offset + layoutP->alignment - 1) & ~(layoutP->alignment - 1);
+    if (cbsize_field >= 0) {
+        layoutP->fields[cbsize_field].cbsize = layoutP->size;
+    }
+
+    layoutP->nops = CsCountOps(layoutP);
+    layoutP->ops = (CsOp *) ckalloc(layoutP->nops * sizeof(CsOp));
+    CsEmitOps(layoutP, 0, layoutP->ops);
+
+    *layoutPP = layoutP;
+    return TCL_OK;
+
+invalid_def:
+    CsLayoutUnref(layoutP);
+    return CsInvalidDef(interp, defObj);
+}
+
+Tcl_Obj *CsLayoutDecodeArray(const CsLayout *layoutP, const void *p,
+                             Tcl_WideInt count, Tcl_WideInt stride)
+{
+    const CsOp *opP, *endP;
+    const char *recP;
+    Tcl_Obj **recs, **objv, *resultObj;
+    int *starts;
+    int i, n, depth, nslots;
+    Tcl_WideInt r;
+
+    if (count <= 0)
+        return Tcl_NewObj();
+
+    /* Each op pushes one value, arrays one per element, before folding */
+    endP = layoutP->ops + layoutP->nops;
+    for (nslots = 1, opP = layoutP->ops; opP < endP; ++opP)
+        nslots += opP->code == CS_OP_ARRAY ? opP->count : 1;
+    objv = (Tcl_Obj **) ckalloc(nslots * sizeof(*objv));
+    starts = (int *) ckalloc((layoutP->nops + 1) * sizeof(*starts));
+    recs = (Tcl_Obj **) ckalloc((size_t) count * sizeof(*recs));
+
+    for (r = 0, recP = p; r < count; ++r, recP += stride) {
+        for (n = 0, depth = 0, opP = layoutP->ops; opP < endP; ++opP) {
+            switch (opP->code) {
+            case CS_OP_SCALAR:
+                objv[n++] = opP->decode(opP->fieldP, recP + opP->offset);
+                break;
+            case CS_OP_ARRAY:
+                for (i = 0; i < (int) opP->count; ++i) {
+                    objv[n + i] = opP->decode(
+                        opP->fieldP, recP + opP->offset + i * opP->fieldP->size);
+                }
+                objv[n] = Tcl_NewListObj(opP->count, objv + n);
+                ++n;
+                break;
+            case CS_OP_BEGIN:
+                starts[depth++] = n;
+                break;
+            case CS_OP_END:
+                i = starts[--depth];
+                objv[i] = Tcl_NewListObj(n - i, objv + i);
+                n = i + 1;
+                break;
+            }
+        }
+        recs[r] = Tcl_NewListObj(n, objv);
+    }
+
+    resultObj = Tcl_NewListObj((int) count, recs);
+    ckfree((char *) recs);
+    ckfree((char *) starts);
+    ckfree((char *) objv);
+    return resultObj;
+}
+
+typedef struct CsEncodeFrame {
+    Tcl_Obj **objv;
+    int n;
+    int next;
+} CsEncodeFrame;
+
+static int CsEncodeValues(Tcl_Interp *interp, CsEncodeFrame *frameP,
+                          Tcl_Obj *objP, unsigned int count, int exact,
+                          const CsField *fieldP)
+{
+    if (Tcl_ListObjGetElements(interp, objP, &frameP->n, &frameP->objv) != TCL_OK)
+        return TCL_ERROR;
+    if (exact ? frameP->n != (int) count : frameP->n < (int) count) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                             "Field %s needs %u values, got %d.",
+                             fieldP ? fieldP->name : "record",
+                             count, frameP->n));
+        return TCL_ERROR;
+    }
+    frameP->next = 0;
+    return TCL_OK;
+}
+
+int CsLayoutEncodeArray(Tcl_Interp *interp, const CsLayout *layoutP,
+                        Tcl_Obj *const recs[], Tcl_WideInt count, void *p)
+{
+    const CsOp *opP, *endP;
+    CsEncodeFrame *frames, *frameP;
+    CsEncodeFrame arrayFrame;
+    char *recP;
+    Tcl_WideInt r;
+    unsigned int i;
+    int res = TCL_ERROR;
+
+    if (! layoutP->encodable) {
+        Tcl_SetResult(interp, "Struct contains pointer fields and cannot be encoded.", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    if (count <= 0)
+        return TCL_OK;
+    memset(p, 0, (size_t) count * layoutP->size);
+
+    endP = layoutP->ops + layoutP->nops;
+    frames = (CsEncodeFrame *) ckalloc((layoutP->nops + 1) * sizeof(*frames));
+    for (r = 0, recP = p; r < count; ++r, recP += layoutP->size) {
+        frameP = frames;
+        if (CsEncodeValues(interp, frameP, recs[r], layoutP->nfields, 1,
+                           NULL) != TCL_OK)
+            goto vamoose;
+        for (opP = layoutP->ops; opP < endP; ++opP) {
+            Tcl_Obj *objP = NULL;
+            if (opP->code != CS_OP_END)
+                objP = frameP->objv[frameP->next++];
+            switch (opP->code) {
+            case CS_OP_SCALAR:
+                if (opP->encode(interp, opP->fieldP, objP,
+                                recP + opP->offset) != TCL_OK)
+                    goto vamoose;
+                break;
+            case CS_OP_ARRAY:
+                if (CsEncodeValues(interp, &arrayFrame, objP, opP->count, 0,
+                                   opP->fieldP) != TCL_OK)
+                    goto vamoose;
+                for (i = 0; i < opP->count; ++i) {
+                    if (opP->encode(interp, opP->fieldP, arrayFrame.objv[i],
+                                    recP + opP->offset + i * opP->fieldP->size)
+                        != TCL_OK)
+                        goto vamoose;
+                }
+                break;
+            case CS_OP_BEGIN:
+                if (CsEncodeValues(interp, frameP + 1, objP, opP->count,
+                                   opP->exact, opP->fieldP) != TCL_OK)
+                    goto vamoose;
+                ++frameP;
+                break;
+            case CS_OP_END:
+                --frameP;
+                break;
+            }
+        }
+    }
+    res = TCL_OK;
+
+vamoose:
+    ckfree((char *) frames);
+    return res;
+}
+
+struct CsRegistry {
+    Tcl_Mutex lock;
+    Tcl_HashTable layouts;      /* Definition string -> CsLayout */
+    const CsHostType *hostTypes;
+};
+
+CsRegistry *CsRegistryNew(const CsHostType *hostTypes)
+{
+    CsRegistry *regP = (CsRegistry *) ckalloc(sizeof(*regP));
+    memset(regP, 0, sizeof(*regP));
+    Tcl_InitHashTable(&regP->layouts, TCL_STRING_KEYS);
+    regP->hostTypes = hostTypes;
+    return regP;
+}
+
+void CsRegistryFree(CsRegistry *regP)
+{
+    Tcl_HashEntry *he;
+    Tcl_HashSearch hs;
+
+    for (he = Tcl_FirstHashEntry(&regP->layouts, &hs); he;
+         he = Tcl_NextHashEntry(&hs)) {
+        CsLayoutUnref(Tcl_GetHashValue(he));
+    }
+    Tcl_DeleteHashTable(&regP->layouts);
+    Tcl_MutexFinalize(&regP->lock);
+    ckfree((char *) regP);
+}
+
+int CsRegistryLookup(Tcl_Interp *interp, CsRegistry *regP, Tcl_Obj *defObj,
+                     CsLayout **layoutPP)
+{
+    Tcl_HashEntry *he;
+    CsLayout *layoutP = NULL;
+    const char *key;
+    int isnew;
+
+    key = Tcl_GetString(defObj);
+    Tcl_MutexLock(&regP->lock);
+    he = Tcl_FindHashEntry(&regP->layouts, key);
+    if (he) {
+        layoutP = Tcl_GetHashValue(he);
+        CsLayoutRef(layoutP);
+    }
+    Tcl_MutexUnlock(&regP->lock);
+    if (layoutP) {
+        *layoutPP = layoutP;
+        return TCL_OK;
+    }
+
+    /* Compile outside the lock. If another thread wins the race, use its. */
+    if (CsLayoutCompile(interp, defObj, regP->hostTypes, &layoutP) != TCL_OK)
+        return TCL_ERROR;
+    Tcl_MutexLock(&regP->lock);
+    he = Tcl_CreateHashEntry(&regP->layouts, key, &isnew);
+    if (isnew) {
+        Tcl_SetHashValue(he, layoutP);
+        CsLayoutRef(layoutP);   /* For the caller */
+    } else {
+        CsLayoutUnref(layoutP);
+        layoutP = Tcl_GetHashValue(he);
+        CsLayoutRef(layoutP);
+    }
+    Tcl_MutexUnlock(&regP->lock);
+    *layoutPP = layoutP;
+    return TCL_OK;
+}
+
+void CsRegistryRemove(CsRegistry *regP, Tcl_Obj *defObj)
+{
+    Tcl_HashEntry *he;
+    CsLayout *layoutP = NULL;
+
+    Tcl_MutexLock(&regP->lock);
+    he = Tcl_FindHashEntry(&regP->layouts, Tcl_GetString(defObj));
+    if (he) {
+        layoutP = Tcl_GetHashValue(he);
+        Tcl_DeleteHashEntry(he);
+    }
+    Tcl_MutexUnlock(&regP->lock);
+    if (layoutP)
+        CsLayoutUnref(layoutP);
+}
+
+#ifdef CSLAYOUT_TEST
+/*
+ * Standalone test and benchmark. Build with
+ *
+ *   cc -O2 -DCSLAYOUT_TEST -I<tcl>/include cslayout.c -L<tcl>/lib -ltcl8.6
+ *
+ * Compares the conversion tables against binary format/scan loops and
+ * the field by field decoder for arrays of nested structures.
+ */
+
+#include <stdio.h>
+
+static CsRegistry *testRegistry;
+
+/* Test host types, a 16 bit value shown as hex and an opaque pointer */
+static Tcl_Obj *TestHexFromPtr(const void *p)
+{
+    unsigned short us;
+    memcpy(&us, p, sizeof(us));
+    return Tcl_ObjPrintf("0x%04x", us);
+}
+
+static int TestHexToPtr(Tcl_Interp *interp, Tcl_Obj *objP, void *p)
+{
+    int i;
+    unsigned short us;
+    if (Tcl_GetIntFromObj(interp, objP, &i) != TCL_OK)
+        return TCL_ERROR;
+    us = (unsigned short) i;
+    memcpy(p, &us, sizeof(us));
+    return TCL_OK;
+}
+
+static Tcl_Obj *TestPtrFromPtr(const void *p)
+{
+    void *pv;
+    memcpy(&pv, p, sizeof(pv));
+    return Tcl_ObjPrintf("%p", pv);
+}
+
+static const CsHostType testHostTypes[] = {
+    {"hex2", 2, TestHexFromPtr, TestHexToPtr},
+    {"ptr", sizeof(void *), TestPtrFromPtr, NULL},
+    {NULL, 0, NULL, NULL}
+};
+
+/* compile DEF - returns size, alignment and op count */
+static int TestCompileObjCmd(ClientData cd, Tcl_Interp *interp,
+                             int objc, Tcl_Obj *const objv[])
+{
+    CsLayout *layoutP;
+    Tcl_Obj *objs[3];
+
+    (void) cd;
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "DEF");
+        return TCL_ERROR;
+    }
+    if (CsRegistryLookup(interp, testRegistry, objv[1], &layoutP) != TCL_OK)
+        return TCL_ERROR;
+    objs[0] = Tcl_NewIntObj(layoutP->size);
+    objs[1] = Tcl_NewIntObj(layoutP->alignment);
+    objs[2] = Tcl_NewIntObj(layoutP->nops);
+    Tcl_SetObjResult(interp, Tcl_NewListObj(3, objs));
+    CsLayoutUnref(layoutP);
+    return TCL_OK;
+}
+
+/* layoutid DEF - address of the registered layout */
+static int TestLayoutIdObjCmd(ClientData cd, Tcl_Interp *interp,
+                              int objc, Tcl_Obj *const objv[])
+{
+    CsLayout *layoutP;
+
+    (void) cd; (void) objc;
+    if (CsRegistryLookup(interp, testRegistry, objv[1], &layoutP) != TCL_OK)
+        return TCL_ERROR;
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("%p", (void *) layoutP));
+    CsLayoutUnref(layoutP);
+    return TCL_OK;
+}
+
+/* encode DEF RECORDS */
+static int TestEncodeObjCmd(ClientData cd, Tcl_Interp *interp,
+                            int objc, Tcl_Obj *const objv[])
+{
+    CsLayout *layoutP;
+    Tcl_Obj **recs, *bytesObj;
+    int nrecs, res;
+
+    (void) cd;
+    if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 1, objv, "DEF RECORDS");
+        return TCL_ERROR;
+    }
+    if (Tcl_ListObjGetElements(interp, objv[2], &nrecs, &recs) != TCL_OK ||
+        CsRegistryLookup(interp, testRegistry, objv[1], &layoutP) != TCL_OK)
+        return TCL_ERROR;
+    bytesObj = Tcl_NewByteArrayObj(NULL, nrecs * layoutP->size);
+    res = CsLayoutEncodeArray(interp, layoutP, recs, nrecs,
+                              Tcl_GetByteArrayFromObj(bytesObj, NULL));
+    CsLayoutUnref(layoutP);
+    if (res != TCL_OK) {
+        Tcl_DecrRefCount(bytesObj);
+        return res;
+    }
+    Tcl_SetObjResult(interp, bytesObj);
+    return TCL_OK;
+}
+
+/* decode DEF BYTES ?TREE? - TREE uses the field by field decoder */
+static int TestDecodeObjCmd(ClientData cd, Tcl_Interp *interp,
+                            int objc, Tcl_Obj *const objv[])
+{
+    CsLayout *layoutP;
+    unsigned char *bytes;
+    int len, count, i, tree = 0;
+
+    (void) cd;
+    if (objc != 3 && objc != 4) {
+        Tcl_WrongNumArgs(interp, 1, objv, "DEF BYTES ?TREE?");
+        return TCL_ERROR;
+    }
+    if ((objc == 4 && Tcl_GetBooleanFromObj(interp, objv[3], &tree) != TCL_OK) ||
+        CsRegistryLookup(interp, testRegistry, objv[1], &layoutP) != TCL_OK)
+        return TCL_ERROR;
+    bytes = Tcl_GetByteArrayFromObj(objv[2], &len);
+    count = layoutP->size ? len / layoutP->size : 0;
+    if (tree) {
+        Tcl_Obj *listObj = Tcl_NewListObj(0, NULL);
+        for (i = 0; i < count; ++i) {
+            Tcl_ListObjAppendElement(
+                NULL, listObj,
+                CsLayoutDecode(layoutP, bytes + i * layoutP->size, 0));
+        }
+        Tcl_SetObjResult(interp, listObj);
+    } else
+        Tcl_SetObjResult(interp, CsLayoutDecodeArray(layoutP, bytes, count,
+                                                     layoutP->size));
+    CsLayoutUnref(layoutP);
+    return TCL_OK;
+}
+
+/* decodedict DEF BYTES - first record as a dictionary */
+static int TestDecodeDictObjCmd(ClientData cd, Tcl_Interp *interp,
+                                int objc, Tcl_Obj *const objv[])
+{
+    CsLayout *layoutP;
+    unsigned char *bytes;
+    int len;
+
+    (void) cd;
+    if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 1, objv, "DEF BYTES");
+        return TCL_ERROR;
+    }
+    if (CsRegistryLookup(interp, testRegistry, objv[1], &layoutP) != TCL_OK)
+        return TCL_ERROR;
+    bytes = Tcl_GetByteArrayFromObj(objv[2], &len);
+    if ((unsigned int) len >= layoutP->size)
+        Tcl_SetObjResult(interp, CsLayoutDecode(layoutP, bytes, CS_DECODE_DICT));
+    CsLayoutUnref(layoutP);
+    return TCL_OK;
+}
+
+/* forget DEF - returns the number of layouts left in the registry */
+static int TestForgetObjCmd(ClientData cd, Tcl_Interp *interp,
+                            int objc, Tcl_Obj *const objv[])
+{
+    (void) cd;
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "DEF");
+        return TCL_ERROR;
+    }
+    CsRegistryRemove(testRegistry, objv[1]);
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(testRegistry->layouts.numEntries));
+    return TCL_OK;
+}
+
+static const char *testScript =
+    "proc check {script expected} {\n"
+    "    set code [catch {uplevel 1 $script} result]\n"
+    "    if {$code} {set result [list error $result]}\n"
+    "    if {$result ne $expected} {\n"
+    "        puts \"FAIL: $script\\n  got:      $result\\n  expected: $expected\"\n"
+    "        incr ::failures\n"
+    "    }\n"
+    "    incr ::checks\n"
+    "}\n"
+    "set failures 0; set checks 0\n"
+    "set inner {{c i1} {d i4}}\n"
+    "check {compile $inner} {8 4 2}\n"
+    "set rec {{a i4} {b r8} {pts struct 2 {{x i2} {y i2}}} {arr ui2 3} {in struct 0 {{c i1} {d i4}}} {h hex2} {f r4} {ok bool} {sz cbsize}}\n"
+    "check {compile $rec} {56 8 21}\n"
+    /* Same definition string from a different object shares the layout */
+    "check {string equal [layoutid $rec] [layoutid [string range \" $rec\" 1 end]]} 1\n"
+    "set v1 {1 2.5 {{1 2} {3 4}} {5 65535 7} {-1 9} 0x1234 1.25 1 0}\n"
+    "set v2 {-2 -0.5 {{-1 -2} {-3 -4} {9 9}} {0 1 2 3} {127 -9} 0xffff 0.5 0 77}\n"
+    "set b [encode $rec [list $v1 $v2]]\n"
+    "check {string length $b} 112\n"
+    "check {string equal $b [binary format {i x4 d s4 s3 x2 c x3 i s x2 f i i i x4 d s4 s3 x2 c x3 i s x2 f i i} 1 2.5 {1 2 3 4} {5 65535 7} -1 9 0x1234 1.25 1 56 -2 -0.5 {-1 -2 -3 -4} {0 1 2} 127 -9 0xffff 0.5 0 77]} 1\n"
+    "check {decode $rec $b} {{1 2.5 {{1 2} {3 4}} {5 65535 7} {-1 9} 0x1234 1.25 1 56} {-2 -0.5 {{-1 -2} {-3 -4}} {0 1 2} {127 -9} 0xffff 0.5 0 77}}\n"
+    "check {string equal [decode $rec $b] [decode $rec $b 1]} 1\n"
+    "check {encode $rec {{1 2}}} {error {Field record needs 9 values, got 2.}}\n"
+    "check {encode $rec [list [lreplace $v1 3 3 {1 2}]]} {error {Field arr needs 3 values, got 2.}}\n"
+    "check {encode $rec [list [lreplace $v1 2 2 {{1 2}}]]} {error {Field pts needs 2 values, got 1.}}\n"
+    "check {encode $rec [list [lreplace $v1 4 4 {1 2 3}]]} {error {Field in needs 2 values, got 3.}}\n"
+    "check {encode $rec [list [lreplace $v1 0 0 x]]} {error {expected integer but got \"x\"}}\n"
+    "check {encode {{p ptr} {n i4}} {{0 1}}} {error {Struct contains pointer fields and cannot be encoded.}}\n"
+    "check {encode {{s struct 0 {{p lpstr}}}} {{{0}}}} {error {Struct contains pointer fields and cannot be encoded.}}\n"
+    "check {compile {{a i4} {b r8} {p ptr}}} {24 8 3}\n"
+    "check {decodedict $rec $b} {a 1 b 2.5 pts {{x 1 y 2} {x 3 y 4}} arr {5 65535 7} in {c -1 d 9} h 0x1234 f 1.25 ok 1 sz 56}\n"
+    "check {dict keys [decodedict $rec $b]} {a b pts arr in h f ok sz}\n"
+    /* Forgotten layouts are dropped and recompiled on next use */
+    "set nlayouts [forget {{nosuch i4}}]\n"
+    "check {forget $inner} [expr {$nlayouts - 1}]\n"
+    "check {forget $inner} [expr {$nlayouts - 1}]\n"
+    "check {compile $inner} {8 4 2}\n"
+    "check {forget {{nosuch i4}}} $nlayouts\n"
+    "check {compile {}} {error {Invalid cstruct definition \"\".}}\n"
+    "check {compile {{a nosuch}}} {error {Invalid cstruct definition \"{a nosuch}\".}}\n"
+    "check {compile {{a void} {b i4}}} {error {Invalid cstruct definition \"{a void} {b i4}\".}}\n"
+    "check {compile {{a cbsize 2}}} {error {Invalid cstruct definition \"{a cbsize 2}\".}}\n"
+    "check {compile {{a struct}}} {error {Invalid cstruct definition \"{a struct}\".}}\n"
+    "check {compile {{a struct 0 {{x bad}}}}} {error {Invalid cstruct definition \"{x bad}\".}}\n"
+    "check {compile {{a i4 -1}}} {error {Invalid cstruct definition \"{a i4 -1}\".}}\n"
+    "puts \"$checks checks, $failures failures\"\n"
+
+    /* Benchmark over 10k records of nested structures */
+    "set item {{id i4} {flags ui4} {bounds struct 0 {{left i4} {top i4} {right i4} {bottom i4}}} {pts struct 2 {{x i2} {y i2}}} {weight r8}}\n"
+    "check {compile $item} {40 8 19}\n"
+    "set n 10000\n"
+    "set recs {}\n"
+    "for {set i 0} {$i < $n} {incr i} {\n"
+    "    lappend recs [list $i [expr {$i & 0xff}] [list $i [expr {$i+1}] [expr {$i+2}] [expr {$i+3}]] [list [list [expr {$i & 0x7fff}] 1] [list 2 3]] [expr {$i * 0.25}]]\n"
+    "}\n"
+    "proc format_loop {recs} {\n"
+    "    set b {}\n"
+    "    foreach r $recs {\n"
+    "        lassign $r id flags bounds pts weight\n"
+    "        append b [binary format iii4s4d $id $flags $bounds [concat {*}$pts] $weight]\n"
+    "    }\n"
+    "    return $b\n"
+    "}\n"
+    "proc scan_loop {b n} {\n"
+    "    set l {}\n"
+    "    for {set i 0; set off 0} {$i < $n} {incr i; incr off 40} {\n"
+    "        binary scan $b @${off}iiui4s2s2d id flags bounds p0 p1 weight\n"
+    "        lappend l [list $id $flags $bounds [list $p0 $p1] $weight]\n"
+    "    }\n"
+    "    return $l\n"
+    "}\n"
+    "set b [encode $item $recs]\n"
+    "check {string equal $b [format_loop $recs]} 1\n"
+    "check {string equal [decode $item $b] [scan_loop $b $n]} 1\n"
+    "check {string equal [decode $item $b] [decode $item $b 1]} 1\n"
+    "check {string equal [decode $item $b] $recs} 1\n"
+    "proc bench {label script} {\n"
+    "    set t [lindex [uplevel 1 [list time $script 10]] 0]\n"
+    "    puts [format {%-40s %10.1f us} $label $t]\n"
+    "}\n"
+    "bench {encode, conversion table (10k)} {encode $item $recs}\n"
+    "bench {encode, binary format loop} {format_loop $recs}\n"
+    "bench {decode, conversion table} {decode $item $b}\n"
+    "bench {decode, field by field} {decode $item $b 1}\n"
+    "bench {decode, binary scan loop} {scan_loop $b $n}\n"
+    "bench {registry lookup} {compile $item}\n"
+    "set failures\n";
+
+int main(int argc, char **argv)
+{
+    Tcl_Interp *interp;
+    int failures;
+
+    (void) argc;
+    Tcl_FindExecutable(argv[0]);
+    interp = Tcl_CreateInterp();
+    testRegistry = CsRegistryNew(testHostTypes);
+    Tcl_CreateObjCommand(interp, "compile", TestCompileObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "layoutid", TestLayoutIdObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "encode", TestEncodeObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "decode", TestDecodeObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "decodedict", TestDecodeDictObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "forget", TestForgetObjCmd, NULL, NULL);
+
+    if (Tcl_Eval(interp, testScript) != TCL_OK) {
+        fprintf(stderr, "%s\n", Tcl_GetStringResult(interp));
+        return 1;
+    }
+    failures = atoi(Tcl_GetStringResult(interp));
+    Tcl_DeleteInterp(interp);
+    CsRegistryFree(testRegistry);
+    return failures ? 1 : 0;
+}
+#endif /* CSLAYOUT_TEST */
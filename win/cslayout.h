@@ -0,0 +1,145 @@
+#ifndef CSLAYOUT_H
+#define CSLAYOUT_H
+
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * C structure layouts. A layout describes the offset, size and type of
+ * every field of a C structure, including arrays and nested structures,
+ * and decodes raw memory into Tcl values field by field. Types that need
+ * platform specific conversions (wide strings, handles, SIDs) are
+ * delegated to the host through a conversion callback in the field so
+ * this module only depends on Tcl and can be built and tested on any
+ * platform.
+ *
+ * Layouts are compiled from cstruct definitions, the same lists used by
+ * ObjCastToCStruct, and cached in a registry keyed by the definition
+ * string so that the layout is computed once per process and shared
+ * between threads. Compilation also flattens the layout into a table of
+ * conversion operations used to encode and decode arrays of records.
+ */
+
+#include <tcl.h>
+
+typedef enum CsType {
+    CS_VOID,
+    CS_BOOL,                    /* int sized */
+    CS_I8,
+    CS_U8,
+    CS_I16,
+    CS_U16,
+    CS_I32,
+    CS_U32,
+    CS_I64,
+    CS_U64,
+    CS_FLOAT,
+    CS_DOUBLE,
+    CS_STRING,                  /* char *, NULL is returned as empty */
+    CS_POINTER,                 /* Raw address */
+    CS_HOST,                    /* Converted by CsField.from_ptr */
+    CS_STRUCT                   /* Nested structure, CsField.child */
+} CsType;
+
+/* Converts a single CS_HOST element at p to a Tcl_Obj */
+typedef Tcl_Obj *CsFromPtrProc(const void *p);
+/* Stores a Tcl value into the CS_HOST element at p */
+typedef int CsToPtrProc(Tcl_Interp *interp, Tcl_Obj *objP, void *p);
+
+/*
+ * Types supplied by the host in addition to the built-in ones. Only
+ * types with a to_ptr procedure can be encoded. Tables are terminated
+ * by an entry with a NULL name.
+ */
+typedef struct CsHostType {
+    const char *name;
+    unsigned int size;          /* Also the alignment */
+    CsFromPtrProc *from_ptr;
+    CsToPtrProc *to_ptr;
+} CsHostType;
+
+struct CsLayout;
+typedef struct CsField {
+    char *name;                 /* ckalloc'ed. Not a Tcl_Obj since layouts
+                                   are shared between threads */
+    struct CsLayout *child;     /* CS_STRUCT only */
+    CsFromPtrProc *from_ptr;    /* CS_HOST only */
+    CsToPtrProc *to_ptr;        /* CS_HOST only, may be NULL */
+    unsigned int offset;        /* From start of the containing struct */
+    unsigned int size;          /* Size of one element */
+    unsigned int count;         /* 0 -> scalar, else number of elements */
+    CsType type;
+    int cbsize;                 /* Set to the struct size if encoded as 0 */
+} CsField;
+
+struct CsOp;
+
+/*
+ * Layouts are reference counted and immutable once filled in so they
+ * may be shared between views, threads and Tcl_Obj internal reps.
+ */
+typedef struct CsLayout {
+    int nrefs;                  /* Protected by a global mutex */
+    int nfields;
+    unsigned int size;          /* Including trailing padding */
+    unsigned int alignment;
+    struct CsOp *ops;           /* Conversion table, NULL if not compiled */
+    int nops;
+    int encodable;              /* No fields that point to other memory */
+    CsField fields[1];          /* Actually nfields entries */
+} CsLayout;
+
+/* Allocates a layout with nrefs 1 and all fields zeroed */
+CsLayout *CsLayoutNew(int nfields);
+void CsLayoutRef(CsLayout *layoutP);
+void CsLayoutUnref(CsLayout *layoutP);
+
+/* Sets the field name to a copy of the string in nameObj */
+void CsFieldSetName(CsField *fieldP, Tcl_Obj *nameObj);
+/* Returns the index of the named field or -1 */
+int CsLayoutFieldIndex(const CsLayout *layoutP, const char *name);
+
+/* Decodes the struct at p as a list of field values or a dictionary */
+#define CS_DECODE_DICT 0x1
+Tcl_Obj *CsLayoutDecode(const CsLayout *layoutP, const void *p, int flags);
+/* Decodes the field starting at p, as a list if it is an array */
+Tcl_Obj *CsFieldDecode(const CsField *fieldP, const void *p, int flags);
+/* Decodes the single field element at p */
+Tcl_Obj *CsFieldDecodeElem(const CsField *fieldP, const void *p, int flags);
+
+/*
+ * Compiles a cstruct definition into a new layout. hostTypes may be NULL.
+ * On success the layout is returned with one reference.
+ */
+int CsLayoutCompile(Tcl_Interp *interp, Tcl_Obj *defObj,
+                    const CsHostType *hostTypes, CsLayout **layoutPP);
+
+/*
+ * Decodes count records, stride bytes apart, into a list of records
+ * using the compiled conversion table.
+ */
+Tcl_Obj *CsLayoutDecodeArray(const CsLayout *layoutP, const void *p,
+                             Tcl_WideInt count, Tcl_WideInt stride);
+/*
+ * Encodes a list of records into count consecutive structs at p, which
+ * must have room for count * layoutP->size bytes. Padding is zeroed.
+ */
+int CsLayoutEncodeArray(Tcl_Interp *interp, const CsLayout *layoutP,
+                        Tcl_Obj *const recs[], Tcl_WideInt count, void *p);
+
+/* Registry of compiled layouts, keyed by definition */
+typedef struct CsRegistry CsRegistry;
+CsRegistry *CsRegistryNew(const CsHostType *hostTypes);
+void CsRegistryFree(CsRegistry *regP);
+/* Returns the layout for a definition with a reference for the caller */
+int CsRegistryLookup(Tcl_Interp *interp, CsRegistry *regP, Tcl_Obj *defObj,
+                     CsLayout **layoutPP);
+/*
+ * Drops the layout for a definition, e.g. when a struct is redefined.
+ * Views holding the layout keep their reference.
+ */
+void CsRegistryRemove(CsRegistry *regP, Tcl_Obj *defObj);
+
+#endif /* CSLAYOUT_H */
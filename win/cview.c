@@ -0,0 +1,596 @@
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Struct views. See cview.h.
+ *
+ * Build with -DCVIEW_TEST to get a standalone test and benchmark over
+ * synthetic buffers (see end of file).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "cview.h"
+
+/* A field path resolved against a layout */
+typedef struct CViewPath {
+    const CsLayout *layoutP;    /* Whole struct if fieldP is NULL */
+    const CsField *fieldP;
+    int elem;                   /* If 1, a single element of fieldP */
+    unsigned int offset;        /* From start of record */
+} CViewPath;
+
+static int CViewError(Tcl_Interp *interp, const char *msg)
+{
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(msg, -1));
+    return TCL_ERROR;
+}
+
+static int CViewResolvePath(Tcl_Interp *interp, const CsLayout *layoutP,
+                            Tcl_Obj *pathObj, CViewPath *pathP)
+{
+    Tcl_Obj **elems;
+    int i, nelems, index;
+
+    pathP->layoutP = layoutP;
+    pathP->fieldP = NULL;
+    pathP->elem = 0;
+    pathP->offset = 0;
+    if (pathObj == NULL)
+        return TCL_OK;
+    if (Tcl_ListObjGetElements(interp, pathObj, &nelems, &elems) != TCL_OK)
+        return TCL_ERROR;
+
+    for (i = 0; i < nelems; ++i) {
+        const CsField *fieldP = pathP->fieldP;
+        if (fieldP && ! pathP->elem) {
+            /* Array field so expect an element index */
+            if (Tcl_GetIntFromObj(NULL, elems[i], &index) != TCL_OK ||
+                index < 0 || (unsigned int) index >= fieldP->count) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("Invalid index \"%s\" for array field %s.", Tcl_GetString(elems[i]), fieldP->name));
+                return TCL_ERROR;
+            }
+            pathP->offset += index * fieldP->size;
+            pathP->elem = 1;
+            continue;
+        }
+        if (fieldP) {
+            if (fieldP->type != CS_STRUCT) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("Field %s is not a struct.", fieldP->name));
+                return TCL_ERROR;
+            }
+            pathP->layoutP = fieldP->child;
+        }
+        index = CsLayoutFieldIndex(pathP->layoutP, Tcl_GetString(elems[i]));
+        if (index < 0) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unknown field \"%s\".", Tcl_GetString(elems[i])));
+            return TCL_ERROR;
+        }
+        pathP->fieldP = &pathP->layoutP->fields[index];
+        pathP->offset += pathP->fieldP->offset;
+        pathP->elem = pathP->fieldP->count == 0;
+    }
+    return TCL_OK;
+}
+
+static Tcl_Obj *CViewDecodePath(const CViewPath *pathP,
+                                const unsigned char *recP, int flags)
+{
+    recP += pathP->offset;
+    if (pathP->fieldP == NULL)
+        return CsLayoutDecode(pathP->layoutP, recP, flags);
+    if (pathP->elem)
+        return CsFieldDecodeElem(pathP->fieldP, recP, flags);
+    return CsFieldDecode(pathP->fieldP, recP, flags);
+}
+
+/*
+ * Returns 1 if count records of size bytes, stride apart and starting at
+ * offset, fit in len bytes. All values are non-negative but may come
+ * from scripts so the check is written to not overflow.
+ */
+static int CViewFits(Tcl_WideInt len, Tcl_WideInt offset, Tcl_WideInt count,
+                     Tcl_WideInt stride, Tcl_WideInt size)
+{
+    if (count <= 0)
+        return 1;
+    if (offset > len || len - offset < size)
+        return 0;
+    return count - 1 <= (len - offset - size) / stride;
+}
+
+/*
+ * Returns the address of the first record, checking a byte array is
+ * still large enough. It is fetched again on every access as the byte
+ * array storage is released if the Tcl_Obj shimmers to another type.
+ */
+static const unsigned char *CViewRecords(Tcl_Interp *interp, CView *viewP)
+{
+    const unsigned char *bytes;
+    int len;
+
+    if (viewP->dataObj == NULL)
+        return viewP->base + viewP->offset;
+    bytes = Tcl_GetByteArrayFromObj(viewP->dataObj, &len);
+    if (! CViewFits(len, viewP->offset, viewP->count, viewP->stride,
+                    viewP->layoutP->size)) {
+        CViewError(interp, "Byte array is too small for the view.");
+        return NULL;
+    }
+    return bytes + viewP->offset;
+}
+
+/*
+ * Parses the optional START COUNT STEP arguments selecting records and
+ * returns the number of records selected.
+ */
+static int CViewRange(Tcl_Interp *interp, CView *viewP, int objc,
+                      Tcl_Obj *const objv[], Tcl_WideInt *startP,
+                      Tcl_WideInt *nP, Tcl_WideInt *stepP)
+{
+    Tcl_WideInt start = 0, n = -1, step = 1, avail;
+
+    if ((objc > 0 && Tcl_GetWideIntFromObj(interp, objv[0], &start) != TCL_OK) ||
+        (objc > 1 && Tcl_GetWideIntFromObj(interp, objv[1], &n) != TCL_OK) ||
+        (objc > 2 && Tcl_GetWideIntFromObj(interp, objv[2], &step) != TCL_OK))
+        return TCL_ERROR;
+    if (start < 0 || start > viewP->count)
+        return CViewError(interp, "Record index out of range.");
+    if (step <= 0)
+        return CViewError(interp, "Step must be a positive integer.");
+    avail = (viewP->count - start + step - 1) / step;
+    if (n < 0)
+        n = avail;
+    else if (n > avail)
+        return CViewError(interp, "Record index out of range.");
+    *startP = start;
+    *nP = n;
+    *stepP = step;
+    return TCL_OK;
+}
+
+static int CViewObjCmd(ClientData clientdata, Tcl_Interp *interp,
+                       int objc, Tcl_Obj *const objv[])
+{
+    static const char *methods[] = {
+        "count", "get", "getdict", "column", "records", NULL
+    };
+    enum { M_COUNT, M_GET, M_GETDICT, M_COLUMN, M_RECORDS };
+    CView *viewP = (CView *) clientdata;
+    const unsigned char *recsP;
+    CViewPath path;
+    Tcl_WideInt index, start, n, step, i;
+    Tcl_Obj *listObj;
+    int method;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "method ?arg ...?");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[1], methods, "method", 0, &method) != TCL_OK)
+        return TCL_ERROR;
+
+    switch (method) {
+    case M_COUNT:
+        if (objc != 2) {
+            Tcl_WrongNumArgs(interp, 2, objv, NULL);
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, Tcl_NewWideIntObj(viewP->count));
+        return TCL_OK;
+
+    case M_GET:
+    case M_GETDICT:
+        if (objc != 3 && objc != 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "INDEX ?FIELDPATH?");
+            return TCL_ERROR;
+        }
+        if (Tcl_GetWideIntFromObj(interp, objv[2], &index) != TCL_OK)
+            return TCL_ERROR;
+        if (index < 0 || index >= viewP->count)
+            return CViewError(interp, "Record index out of range.");
+        if (CViewResolvePath(interp, viewP->layoutP,
+                             objc == 4 ? objv[3] : NULL, &path) != TCL_OK)
+            return TCL_ERROR;
+        recsP = CViewRecords(interp, viewP);
+        if (recsP == NULL)
+            return TCL_ERROR;
+        Tcl_SetObjResult(interp, CViewDecodePath(&path, recsP + index * viewP->stride, method == M_GETDICT ? CS_DECODE_DICT : 0));
+        return TCL_OK;
+
+    case M_COLUMN:
+    case M_RECORDS:
+        if (method == M_COLUMN) {
+            if (objc < 3 || objc > 6) {
+                Tcl_WrongNumArgs(interp, 2, objv, "FIELDPATH ?START? ?COUNT? ?STEP?");
+                return TCL_ERROR;
+            }
+            if (CViewResolvePath(interp, viewP->layoutP, objv[2], &path) != TCL_OK)
+                return TCL_ERROR;
+            objc -= 3;
+            objv += 3;
+        } else {
+            if (objc > 5) {
+                Tcl_WrongNumArgs(interp, 2, objv, "?START? ?COUNT? ?STEP?");
+                return TCL_ERROR;
+            }
+            CViewResolvePath(interp, viewP->layoutP, NULL, &path);
+            objc -= 2;
+            objv += 2;
+        }
+        if (CViewRange(interp, viewP, objc, objv, &start, &n, &step) != TCL_OK)
+            return TCL_ERROR;
+        recsP = CViewRecords(interp, viewP);
+        if (recsP == NULL)
+            return TCL_ERROR;
+        /* Path is resolved once, each record is then a fixed offset */
+        recsP += start * viewP->stride;
+        listObj = Tcl_NewListObj(0, NULL);
+        for (i = 0; i < n; ++i, recsP += step * viewP->stride) {
+            Tcl_ListObjAppendElement(NULL, listObj,
+                                     CViewDecodePath(&path, recsP, 0));
+        }
+        Tcl_SetObjResult(interp, listObj);
+        return TCL_OK;
+    }
+    return TCL_ERROR;
+}
+
+static void CViewDeleteCmd(ClientData clientdata)
+{
+    CView *viewP = (CView *) clientdata;
+
+    CsLayoutUnref(viewP->layoutP);
+    if (viewP->dataObj)
+        Tcl_DecrRefCount(viewP->dataObj);
+    ckfree((char *) viewP);
+}
+
+int CViewCreate(Tcl_Interp *interp, const char *cmdName, CsLayout *layoutP,
+                Tcl_Obj *dataObj, const void *base, Tcl_WideInt offset,
+                Tcl_WideInt count, Tcl_WideInt stride)
+{
+    CView *viewP;
+    int len;
+
+    if (layoutP->size == 0)
+        return CViewError(interp, "Struct views need a non-empty struct.");
+    if (stride == 0)
+        stride = layoutP->size;
+    if (stride < 0 || offset < 0)
+        return CViewError(interp, "Invalid offset or stride for view.");
+    if (dataObj) {
+        Tcl_GetByteArrayFromObj(dataObj, &len);
+        if (count < 0) {
+            count = 0;
+            if (offset <= len && len - offset >= layoutP->size)
+                count = 1 + (len - offset - layoutP->size) / stride;
+        } else if (! CViewFits(len, offset, count, stride, layoutP->size)) {
+            return CViewError(interp, "Byte array is too small for the view.");
+        }
+    } else if (base == NULL || count < 0) {
+        return CViewError(interp, "Pointer views need a non-NULL address and record count.");
+    }
+
+    viewP = (CView *) ckalloc(sizeof(*viewP));
+    viewP->layoutP = layoutP;
+    CsLayoutRef(layoutP);
+    viewP->dataObj = dataObj;
+    if (dataObj)
+        Tcl_IncrRefCount(dataObj);
+    viewP->base = (const unsigned char *) base;
+    viewP->offset = offset;
+    viewP->count = count;
+    viewP->stride = stride;
+    Tcl_CreateObjCommand(interp, cmdName, CViewObjCmd, viewP, CViewDeleteCmd);
+    return TCL_OK;
+}
+
+#ifdef CVIEW_TEST
+/*
+ * Standalone test and benchmark. Build with
+ *
+ *   cc -O2 -DCVIEW_TEST -I<tcl>/include cview.c cslayout.c \
+ *      -L<tcl>/lib -ltcl8.6
+ *
+ * Layouts are built by a simple test command using natural alignment
+ * and records are synthesized with binary format.
+ */
+
+#include <stdio.h>
+
+static Tcl_HashTable testLayouts;
+
+/* Test host conversion, a 16 bit value shown as hex */
+static Tcl_Obj *TestHostFromPtr(const void *p)
+{
+    unsigned short us;
+    memcpy(&us, p, sizeof(us));
+    return Tcl_ObjPrintf("0x%04x", us);
+}
+
+/* layout NAME {{name type ?count? ?child?} ...} */
+static int TestLayoutObjCmd(ClientData cd, Tcl_Interp *interp,
+                            int objc, Tcl_Obj *const objv[])
+{
+    static const char *types[] = {
+        "void", "bool", "i1", "ui1", "i2", "ui2", "i4", "ui4", "i8", "ui8",
+        "r4", "r8", "lpstr", "ptr", "host", "struct", NULL
+    };
+    static const unsigned int sizes[] = {
+        0, sizeof(int), 1, 1, 2, 2, 4, 4, 8, 8, 4, 8,
+        sizeof(char *), sizeof(void *), 2, 0
+    };
+    CsLayout *layoutP;
+    Tcl_HashEntry *he;
+    Tcl_Obj **defs, **elems;
+    int i, ndefs, nelems, type, count, isnew;
+    unsigned int offset = 0, align;
+
+    (void) cd;
+    if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 1, objv, "NAME DEFS");
+        return TCL_ERROR;
+    }
+    if (Tcl_ListObjGetElements(interp, objv[2], &ndefs, &defs) != TCL_OK)
+        return TCL_ERROR;
+    layoutP = CsLayoutNew(ndefs);
+    for (i = 0; i < ndefs; ++i) {
+        CsField *fieldP = &layoutP->fields[i];
+        if (Tcl_ListObjGetElements(interp, defs[i], &nelems, &elems) != TCL_OK ||
+            nelems < 2 ||
+            Tcl_GetIndexFromObj(interp, elems[1], types, "type", 0, &type) != TCL_OK)
+            goto error_return;
+        count = 0;
+        if (nelems > 2 && Tcl_GetIntFromObj(interp, elems[2], &count) != TCL_OK)
+            goto error_return;
+        CsFieldSetName(fieldP, elems[0]);
+        fieldP->type = (CsType) type;
+        fieldP->count = count;
+        fieldP->size = sizes[type];
+        align = fieldP->size;
+        if (type == CS_HOST)
+            fieldP->from_ptr = TestHostFromPtr;
+        if (type == CS_STRUCT) {
+            if (nelems < 4 ||
+                (he = Tcl_FindHashEntry(&testLayouts, Tcl_GetString(elems[3]))) == NULL) {
+                Tcl_SetResult(interp, "Unknown child layout", TCL_STATIC);
+                goto error_return;
+            }
+            fieldP->child = Tcl_GetHashValue(he);
+            CsLayoutRef(fieldP->child);
+            fieldP->size = fieldP->child->size;
+            align = fieldP->child->alignment;
+        }
+        if (align > layoutP->alignment)
+            layoutP->alignment = align;
+        offset = (offset + align - 1) & ~(align - 1);
+        fieldP->offset = offset;
+        offset += fieldP->size * (count ? count : 1);
+    }
+    layoutP->size = (offset + layoutP->alignment - 1) & ~(layoutP->alignment - 1);
+
+    he = Tcl_CreateHashEntry(&testLayouts, Tcl_GetString(objv[1]), &isnew);
+    if (! isnew)
+        CsLayoutUnref(Tcl_GetHashValue(he));
+    Tcl_SetHashValue(he, layoutP);
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(layoutP->size));
+    return TCL_OK;
+
+error_return:
+    CsLayoutUnref(layoutP);
+    return TCL_ERROR;
+}
+
+static CsLayout *TestGetLayout(Tcl_Interp *interp, Tcl_Obj *nameObj)
+{
+    Tcl_HashEntry *he = Tcl_FindHashEntry(&testLayouts, Tcl_GetString(nameObj));
+    if (he == NULL) {
+        Tcl_SetResult(interp, "Unknown layout", TCL_STATIC);
+        return NULL;
+    }
+    return Tcl_GetHashValue(he);
+}
+
+/* view CMD LAYOUT BYTES ?OFFSET COUNT STRIDE? */
+static int TestViewObjCmd(ClientData cd, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[])
+{
+    CsLayout *layoutP;
+    Tcl_WideInt offset = 0, count = -1, stride = 0;
+
+    (void) cd;
+    if (objc != 4 && objc != 7) {
+        Tcl_WrongNumArgs(interp, 1, objv, "CMD LAYOUT BYTES ?OFFSET COUNT STRIDE?");
+        return TCL_ERROR;
+    }
+    if ((layoutP = TestGetLayout(interp, objv[2])) == NULL)
+        return TCL_ERROR;
+    if (objc == 7 &&
+        (Tcl_GetWideIntFromObj(interp, objv[4], &offset) != TCL_OK ||
+         Tcl_GetWideIntFromObj(interp, objv[5], &count) != TCL_OK ||
+         Tcl_GetWideIntFromObj(interp, objv[6], &stride) != TCL_OK))
+        return TCL_ERROR;
+    return CViewCreate(interp, Tcl_GetString(objv[1]), layoutP, objv[3],
+                       NULL, offset, count, stride);
+}
+
+/* Frees the copy made by ptrview when its view command goes away */
+static void TestFreeCopy(ClientData cd, Tcl_Interp *interp,
+                         const char *oldName, const char *newName, int flags)
+{
+    (void) interp; (void) oldName; (void) newName;
+    if (flags & TCL_TRACE_DELETE)
+        free(cd);
+}
+
+/* ptrview CMD LAYOUT BYTES COUNT - views a malloc'ed copy of BYTES */
+static int TestPtrViewObjCmd(ClientData cd, Tcl_Interp *interp,
+                             int objc, Tcl_Obj *const objv[])
+{
+    CsLayout *layoutP;
+    Tcl_WideInt count;
+    unsigned char *bytes;
+    void *copy;
+    int len;
+
+    (void) cd;
+    if (objc != 5) {
+        Tcl_WrongNumArgs(interp, 1, objv, "CMD LAYOUT BYTES COUNT");
+        return TCL_ERROR;
+    }
+    if ((layoutP = TestGetLayout(interp, objv[2])) == NULL ||
+        Tcl_GetWideIntFromObj(interp, objv[4], &count) != TCL_OK)
+        return TCL_ERROR;
+    bytes = Tcl_GetByteArrayFromObj(objv[3], &len);
+    copy = malloc(len);
+    memcpy(copy, bytes, len);
+    if (CViewCreate(interp, Tcl_GetString(objv[1]), layoutP, NULL,
+                    copy, 0, count, 0) != TCL_OK) {
+        free(copy);
+        return TCL_ERROR;
+    }
+    return Tcl_TraceCommand(interp, Tcl_GetString(objv[1]), TCL_TRACE_DELETE,
+                            TestFreeCopy, copy);
+}
+
+/* Pointer to a static string so lpstr fields can be tested */
+static const char testString[] = "pointed to";
+static int TestStringAddrObjCmd(ClientData cd, Tcl_Interp *interp,
+                                int objc, Tcl_Obj *const objv[])
+{
+    (void) cd; (void) objc; (void) objv;
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt) (size_t) testString));
+    return TCL_OK;
+}
+
+static const char *testScript =
+    "proc check {script expected} {\n"
+    "    set code [catch {uplevel 1 $script} result]\n"
+    "    if {$code} {set result [list error $result]}\n"
+    "    if {$result ne $expected} {\n"
+    "        puts \"FAIL: $script\\n  got:      $result\\n  expected: $expected\"\n"
+    "        incr ::failures\n"
+    "    }\n"
+    "    incr ::checks\n"
+    "}\n"
+    "set failures 0; set checks 0\n"
+    "check {layout inner {{c i1} {d i4}}} 8\n"
+    "check {layout rec {{a i4} {b r8} {arr ui2 3} {in struct 0 inner} {h host} {f r4} {ok bool}}} 48\n"
+    "set b {}\n"
+    "for {set i 0} {$i < 3} {incr i} {\n"
+    "    append b [binary format {i x4 d s3 x2 c x3 i s x2 f i x4} $i [expr {$i + 0.5}] [list $i 65535 7] -1 [expr {100 + $i}] 0x1234 1.25 [expr {$i % 2}]]\n"
+    "}\n"
+    "check {string length $b} 144\n"
+    "view v rec $b\n"
+    "check {v count} 3\n"
+    "check {v get 1} {1 1.5 {1 65535 7} {-1 101} 0x1234 1.25 1}\n"
+    "check {v getdict 2} {a 2 b 2.5 arr {2 65535 7} in {c -1 d 102} h 0x1234 f 1.25 ok 0}\n"
+    "check {v get 2 b} 2.5\n"
+    "check {v get 2 arr} {2 65535 7}\n"
+    "check {v get 2 {arr 1}} 65535\n"
+    "check {v get 0 {in d}} 100\n"
+    "check {v get 0 in} {-1 100}\n"
+    "check {v column a} {0 1 2}\n"
+    "check {v column {in d} 1} {101 102}\n"
+    "check {v column {arr 0} 0 2 2} {0 2}\n"
+    "check {v column ok 0 -1 2} {0 0}\n"
+    "check {v records 2} {{2 2.5 {2 65535 7} {-1 102} 0x1234 1.25 0}}\n"
+    "check {llength [v records 0 -1 2]} 2\n"
+    "check {v get 3} {error {Record index out of range.}}\n"
+    "check {v column a 1 3} {error {Record index out of range.}}\n"
+    "check {v column a 0 -1 0} {error {Step must be a positive integer.}}\n"
+    "check {v get 0 nosuch} {error {Unknown field \"nosuch\".}}\n"
+    "check {v get 0 {arr 3}} {error {Invalid index \"3\" for array field arr.}}\n"
+    "check {v get 0 {a x}} {error {Field a is not a struct.}}\n"
+    /* Offset, explicit count and stride larger than the record */
+    "layout pair {{x i2} {y i2}}\n"
+    "set p [binary format s* {-9 1 2 -9 3 4 -9 5 6 -9 -9}]\n"
+    "view pv pair $p 2 3 6\n"
+    "check {pv records} {{1 2} {3 4} {5 6}}\n"
+    "check {pv column y} {2 4 6}\n"
+    "check {view bad pair $p 2 4 6} {error {Byte array is too small for the view.}}\n"
+    /* Counts and offsets whose products or sums would overflow */
+    "check {view bad pair $p 0 [expr {1 << 62}] 8} {error {Byte array is too small for the view.}}\n"
+    "check {view bad pair $p [expr {(1 << 63) - 2}] 1 0} {error {Byte array is too small for the view.}}\n"
+    "check {view bad pair $p [expr {(1 << 63) - 2}] -1 0; bad count} 0\n"
+    "rename bad {}\n"
+    "view all pair $p\n"
+    "check {all count} 5\n"
+    /* Byte array shimmered to a list must not leave a dangling pointer */
+    "set s [binary format s2 {7 8}]; view sv pair $s\n"
+    "llength $s\n"
+    "check {sv get 0} {7 8}\n"
+    "rename sv {}; unset s\n"
+    /* Pointer views and pointer fields */
+    "layout sp {{s lpstr} {n i4}}\n"
+    "set addr [stringaddr]\n"
+    "ptrview ptv sp [binary format wii $addr 5 0] 1\n"
+    "check {ptv get 0} {{pointed to} 5}\n"
+    "check {ptrview pbad sp {} -1} {error {Pointer views need a non-NULL address and record count.}}\n"
+    "puts \"$checks checks, $failures failures\"\n"
+
+    /* Benchmark over a table shaped like MIB_TCPROW */
+    "layout tcprow {{state ui4} {laddr ui4} {lport ui4} {raddr ui4} {rport ui4}}\n"
+    "set n 10000\n"
+    "set rows {}\n"
+    "for {set i 0} {$i < $n} {incr i} {\n"
+    "    append rows [binary format iiiii [expr {$i % 12}] $i [expr {$i & 0xffff}] [expr {$i * 7}] 443]\n"
+    "}\n"
+    "view tv tcprow $rows\n"
+    "proc bench {label script} {\n"
+    "    set t [lindex [uplevel 1 [list time $script 20]] 0]\n"
+    "    puts [format {%-40s %10.1f us} $label $t]\n"
+    "}\n"
+    "proc scan_column {rows n} {\n"
+    "    set l {}\n"
+    "    for {set i 0; set off 8} {$i < $n} {incr i; incr off 20} {\n"
+    "        binary scan $rows @${off}iu v\n"
+    "        lappend l $v\n"
+    "    }\n"
+    "    return $l\n"
+    "}\n"
+    "proc scan_records {rows n} {\n"
+    "    set l {}\n"
+    "    for {set i 0; set off 0} {$i < $n} {incr i; incr off 20} {\n"
+    "        binary scan $rows @${off}iu5 v\n"
+    "        lappend l $v\n"
+    "    }\n"
+    "    return $l\n"
+    "}\n"
+    "check {string equal [tv column lport] [scan_column $rows $n]} 1\n"
+    "check {string equal [tv records] [scan_records $rows $n]} 1\n"
+    "bench {column lport, view (10k records)} {tv column lport}\n"
+    "bench {column lport, binary scan loop} {scan_column $rows $n}\n"
+    "bench {all records, view} {tv records}\n"
+    "bench {all records, binary scan loop} {scan_records $rows $n}\n"
+    "bench {single field access, view} {tv get 5000 lport}\n"
+    "bench {every 10th record, view} {tv records 0 -1 10}\n"
+    "set failures\n";
+
+int main(int argc, char **argv)
+{
+    Tcl_Interp *interp;
+    int failures;
+
+    (void) argc;
+    Tcl_FindExecutable(argv[0]);
+    interp = Tcl_CreateInterp();
+    Tcl_InitHashTable(&testLayouts, TCL_STRING_KEYS);
+    Tcl_CreateObjCommand(interp, "layout", TestLayoutObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "view", TestViewObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "ptrview", TestPtrViewObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "stringaddr", TestStringAddrObjCmd, NULL, NULL);
+
+    if (Tcl_Eval(interp, testScript) != TCL_OK) {
+        fprintf(stderr, "%s\n", Tcl_GetStringResult(interp));
+        return 1;
+    }
+    failures = atoi(Tcl_GetStringResult(interp));
+    Tcl_DeleteInterp(interp);
+    return failures != 0;
+}
+
+#endif /* CVIEW_TEST */
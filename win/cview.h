@@ -0,0 +1,48 @@
+#ifndef CVIEW_H
+#define CVIEW_H
+
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Struct views. A view overlays a C structure layout (cslayout.h) on a
+ * Tcl byte array or raw memory holding an array of records, possibly
+ * with a stride larger than the structure. Fields are decoded only when
+ * accessed so scripts can pick individual fields or whole columns out of
+ * large tables without building a list for every record.
+ *
+ * Views are Tcl commands:
+ *   VIEW count
+ *   VIEW get INDEX ?FIELDPATH?
+ *   VIEW getdict INDEX ?FIELDPATH?
+ *   VIEW column FIELDPATH ?START? ?COUNT? ?STEP?
+ *   VIEW records ?START? ?COUNT? ?STEP?
+ * FIELDPATH is a list of field names, each followed by an element index
+ * if the field is an array, descending into nested structures.
+ */
+
+#include "cslayout.h"
+
+typedef struct CView {
+    CsLayout *layoutP;
+    Tcl_Obj *dataObj;           /* Byte array holding records or NULL */
+    const unsigned char *base;  /* Memory holding records if no dataObj */
+    Tcl_WideInt offset;         /* Of first record from start of data */
+    Tcl_WideInt count;          /* Number of records */
+    Tcl_WideInt stride;         /* Distance between records */
+} CView;
+
+/*
+ * Creates a view command. Exactly one of dataObj and base must be
+ * non-NULL. For byte arrays, a negative count covers all records that
+ * fit. A stride of 0 means the layout size. The view holds a reference
+ * to the layout and to dataObj. Raw memory must stay valid for the
+ * lifetime of the view.
+ */
+int CViewCreate(Tcl_Interp *interp, const char *cmdName, CsLayout *layoutP,
+                Tcl_Obj *dataObj, const void *base, Tcl_WideInt offset,
+                Tcl_WideInt count, Tcl_WideInt stride);
+
+#endif /* CVIEW_H */
@@ -8,6 +8,8 @@
 #include "twapi.h"
 #include "twapi_base.h"
 #include "dyncall.h"
+#include "ffithunk.h"
+#include "cview.h"
 
 /*
  * TwapiCStruct is a Tcl "type" that holds definition of a C structure.
@@ -60,7 +62,7 @@ static void CStructRepDecrRefs(TwapiCStructRep *csP)
     csP->nrefs -= 1;
     if (csP->nrefs <= 0) {
         int i;
-        for (i = 0; i < csP->nrefs; ++i) {
+        for (i = 0; i < csP->nfields; ++i) {
             if (csP->fields[i].name)
                 ObjDecrRefs(csP->fields[i].name);
             if (csP->fields[i].child)
@@ -614,6 +616,180 @@ TCL_RESULT ObjFromCStruct(Tcl_Interp *interp, void *pv, int nbytes, Tcl_Obj *csO
 }
 
 
+static Tcl_Obj *TwapiCsWinCharsFromPtr(const void *p)
+{
+    WCHAR *ws;
+    CopyMemory(&ws, p, sizeof(ws));
+    return ObjFromWinChars(ws);
+}
+
+static Tcl_Obj *TwapiCsHandleFromPtr(const void *p)
+{
+    HANDLE h;
+    CopyMemory(&h, p, sizeof(h));
+    return ObjFromHANDLE(h);
+}
+
+static Tcl_Obj *TwapiCsSidFromPtr(const void *p)
+{
+    PSID sidP;
+    CopyMemory(&sidP, p, sizeof(sidP));
+    return ObjFromSIDNoFail(sidP);
+}
+
+static TCL_RESULT TwapiCsHandleToPtr(Tcl_Interp *interp, Tcl_Obj *objP, void *p)
+{
+    HANDLE h;
+    if (ObjToHANDLE(interp, objP, &h) != TCL_OK)
+        return TCL_ERROR;
+    CopyMemory(p, &h, sizeof(h));
+    return TCL_OK;
+}
+
+/*
+ * cstruct types that need Windows conversions. Strings and SIDs point
+ * to other memory so structs containing them can only be decoded.
+ */
+static const CsHostType gTwapiCsHostTypes[] = {
+    {"lpwstr", sizeof(WCHAR *), TwapiCsWinCharsFromPtr, NULL},
+    {"handle", sizeof(HANDLE), TwapiCsHandleFromPtr, TwapiCsHandleToPtr},
+    {"psid", sizeof(PSID), TwapiCsSidFromPtr, NULL},
+    {NULL, 0, NULL, NULL}
+};
+
+/* Compiled layouts, shared by all interpreters and threads */
+static TwapiOneTimeInitState gCsRegistryInitialized;
+static CsRegistry *gCsRegistryP;
+
+static int TwapiCsRegistryInit(void *unused)
+{
+    gCsRegistryP = CsRegistryNew(gTwapiCsHostTypes);
+    return TCL_OK;
+}
+
+/*
+ * Returns the compiled layout, as used by struct views and the bulk
+ * encode/decode commands, for a cstruct definition. Decoding matches
+ * ObjFromCStruct. Caller must CsLayoutUnref the layout.
+ */
+static TCL_RESULT TwapiCStructLayout(Tcl_Interp *interp, Tcl_Obj *csObj,
+                                     CsLayout **layoutPP)
+{
+    if (! TwapiDoOneTimeInit(&gCsRegistryInitialized, TwapiCsRegistryInit, NULL))
+        return TwapiReturnError(interp, TWAPI_SYSTEM_ERROR);
+    return CsRegistryLookup(interp, gCsRegistryP, csObj, layoutPP);
+}
+
+/*
+ * cstruct_view_create CMDNAME CSTRUCT DATA OFFSET COUNT STRIDE ISPOINTER
+ * DATA is a byte array or, if ISPOINTER is true, an address.
+ */
+static TCL_RESULT Twapi_CStructViewObjCmd(void *clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    CsLayout *layoutP;
+    Tcl_WideInt offset, count, stride;
+    void *pv = NULL;
+    int is_pointer;
+    TCL_RESULT res;
+
+    if (objc != 8)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    if (ObjToWideInt(interp, objv[4], &offset) != TCL_OK ||
+        ObjToWideInt(interp, objv[5], &count) != TCL_OK ||
+        ObjToWideInt(interp, objv[6], &stride) != TCL_OK ||
+        ObjToBoolean(interp, objv[7], &is_pointer) != TCL_OK)
+        return TCL_ERROR;
+    if (is_pointer && ObjToLPVOID(interp, objv[3], &pv) != TCL_OK)
+        return TCL_ERROR;
+    if (TwapiCStructLayout(interp, objv[2], &layoutP) != TCL_OK)
+        return TCL_ERROR;
+    res = CViewCreate(interp, ObjToString(objv[1]), layoutP,
+                      is_pointer ? NULL : objv[3], pv, offset, count, stride);
+    CsLayoutUnref(layoutP);     /* View holds its own reference */
+    return res;
+}
+
+/*
+ * cstruct_encode CSTRUCT RECORDS
+ * Returns a byte array holding the records as consecutive structs.
+ */
+static TCL_RESULT Twapi_CStructEncodeObjCmd(void *clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    CsLayout *layoutP;
+    Tcl_Obj **recObjs;
+    Tcl_Obj *resultObj;
+    Tcl_Size nrecs;
+    void *pv;
+    TCL_RESULT res;
+
+    if (objc != 3)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    if (ObjGetElements(interp, objv[2], &nrecs, &recObjs) != TCL_OK ||
+        TwapiCStructLayout(interp, objv[1], &layoutP) != TCL_OK)
+        return TCL_ERROR;
+    resultObj = ObjAllocateByteArray(nrecs * layoutP->size, &pv);
+    res = CsLayoutEncodeArray(interp, layoutP, recObjs, nrecs, pv);
+    CsLayoutUnref(layoutP);
+    if (res != TCL_OK) {
+        ObjDecrRefs(resultObj);
+        return res;
+    }
+    return ObjSetResult(interp, resultObj);
+}
+
+/*
+ * cstruct_decode CSTRUCT BYTES ?COUNT?
+ * Returns the list of records in BYTES. COUNT defaults to all that fit.
+ */
+static TCL_RESULT Twapi_CStructDecodeObjCmd(void *clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    CsLayout *layoutP;
+    Tcl_WideInt count = -1;
+    Tcl_Size len;
+    unsigned char *bytes;
+
+    if (objc != 3 && objc != 4)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    if (objc == 4 && ObjToWideInt(interp, objv[3], &count) != TCL_OK)
+        return TCL_ERROR;
+    if (TwapiCStructLayout(interp, objv[1], &layoutP) != TCL_OK)
+        return TCL_ERROR;
+    bytes = ObjToByteArray(objv[2], &len);
+    if (count < 0)
+        count = layoutP->size ? len / layoutP->size : 0;
+    else if (count * layoutP->size > len) {
+        CsLayoutUnref(layoutP);
+        return TwapiReturnError(interp, TWAPI_BUFFER_OVERRUN);
+    }
+    ObjSetResult(interp,
+                 CsLayoutDecodeArray(layoutP, bytes, count, layoutP->size));
+    CsLayoutUnref(layoutP);
+    return TCL_OK;
+}
+
+/*
+ * cstruct_forget CSTRUCT
+ * Drops the compiled layout for a definition that is being replaced.
+ */
+static TCL_RESULT Twapi_CStructForgetObjCmd(void *clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    if (objc != 2)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    if (! TwapiDoOneTimeInit(&gCsRegistryInitialized, TwapiCsRegistryInit, NULL))
+        return TwapiReturnError(interp, TWAPI_SYSTEM_ERROR);
+    CsRegistryRemove(gCsRegistryP, objv[1]);
+    return TCL_OK;
+}
+
+/* Frees the layout registry at process exit */
+void TwapiCsRegistryCleanup(void)
+{
+    if (gCsRegistryP) {
+        CsRegistryFree(gCsRegistryP);
+        gCsRegistryP = NULL;
+    }
+}
+
 TCL_RESULT TwapiCStructSize(Tcl_Interp *interp, Tcl_Obj *csObj, int *szP)
 {
     TwapiCStructRep *csP;
@@ -888,9 +1064,450 @@ void TwapiDeleteFfiCmd(ClientData vmP)
     dcFree((DCCallVM *) vmP);
 }
 
+/*
+ * Call VMs shared by ffi_callable and the callables it creates. Reference
+ * counted since the order in which the commands are deleted when the
+ * interpreter goes away is not defined.
+ */
+typedef struct TwapiFfiVMs {
+    int nrefs;
+    DCCallVM *cdeclP;
+    DCCallVM *stdcallP;         /* Same as cdeclP on Win64 */
+} TwapiFfiVMs;
+
+static void TwapiFfiVMsUnref(TwapiFfiVMs *vmsP)
+{
+    if (--vmsP->nrefs > 0)
+        return;
+    if (vmsP->stdcallP != vmsP->cdeclP)
+        dcFree(vmsP->stdcallP);
+    dcFree(vmsP->cdeclP);
+    TwapiFree(vmsP);
+}
+
+static void *TwapiFfiMark(void)
+{
+    return SWSPushMark();
+}
+
+static void TwapiFfiRelease(void *mark)
+{
+    SWSPopMark((SWSMark) mark);
+}
+
+static int TwapiFfiWinCharsToPtr(Tcl_Interp *interp, Tcl_Obj *objP, void *data, void **pvP)
+{
+    Tcl_Size len;
+    WCHAR *ws = ObjToWinCharsN(objP, &len);
+    /* Copy since a later argument may shimmer objP */
+    *pvP = MemLifoCopy(SWS(), ws, (MemLifoSize) (len + 1) * sizeof(WCHAR));
+    return TCL_OK;
+}
+
+static Tcl_Obj *TwapiFfiWinCharsFromPtr(void *pv, void *data)
+{
+    return pv ? ObjFromWinChars((WCHAR *) pv) : ObjFromEmptyString();
+}
+
+static int TwapiFfiHandleToPtr(Tcl_Interp *interp, Tcl_Obj *objP, void *data, void **pvP)
+{
+    return ObjToHANDLE(interp, objP, (HANDLE *) pvP);
+}
+
+static Tcl_Obj *TwapiFfiHandleFromPtr(void *pv, void *data)
+{
+    return ObjFromHANDLE((HANDLE) pv);
+}
+
+/* Pointer to struct parameters. data is the TwapiCStructRep. */
+static int TwapiFfiStructToPtr(Tcl_Interp *interp, Tcl_Obj *objP, void *data, void **pvP)
+{
+    TwapiCStructRep *csP = (TwapiCStructRep *) data;
+
+    if (ObjCharLength(objP) == 0) {
+        *pvP = NULL;
+        return TCL_OK;
+    }
+    *pvP = SWSAlloc(csP->size, NULL);
+    return ParseCStructHelper(interp, SWS(), csP, objP, 0, csP->size, *pvP);
+}
+
+/* Pointer to struct callback parameters. data is the TwapiCStructRep. */
+static Tcl_Obj *TwapiFfiStructFromPtr(void *pv, void *data)
+{
+    Tcl_Obj *objP;
+    TwapiCStructRep *csP = (TwapiCStructRep *) data;
+
+    if (pv == NULL ||
+        ObjFromCStructHelper(NULL, pv, csP->size, csP, 0, &objP) != TCL_OK)
+        return ObjFromEmptyString();
+    return objP;
+}
+
+static void TwapiFfiPlanCleanup(FfiPlan *planP)
+{
+    int i;
+    for (i = 0; i < planP->nparams; ++i) {
+        if (planP->params[i].to_ptr == TwapiFfiStructToPtr)
+            CStructRepDecrRefs((TwapiCStructRep *) planP->params[i].data);
+    }
+    TwapiFfiVMsUnref((TwapiFfiVMs *) planP->hostdata);
+}
+
+static const FfiPlanHost gTwapiFfiHost = {
+    TwapiFfiMark, TwapiFfiRelease, TwapiFfiPlanCleanup
+};
+
+/*
+ * Sets up the marshalling for a parameter or return value. If callback
+ * is non-0, the value is passed in the reverse direction, from C code
+ * to a Tcl callback script and back.
+ */
+static TCL_RESULT TwapiFfiPlanParam(Tcl_Interp *interp, TwapiCStructField *fldP,
+                                    int is_param, int callback,
+                                    FfiPlanParam *paramP)
+{
+    if (fldP->count)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Array types not supported in FFI calls.");
+
+    switch (fldP->type) {
+    case CSTRUCT_VOID:
+        if (is_param)
+            goto unsupported;
+        paramP->op = FFIPLAN_VOID;
+        break;
+    case CSTRUCT_BOOLEAN: paramP->op = FFIPLAN_BOOL; break;
+    case CSTRUCT_CHAR: paramP->op = FFIPLAN_I8; break;
+    case CSTRUCT_UCHAR: paramP->op = FFIPLAN_U8; break;
+    case CSTRUCT_SHORT: paramP->op = FFIPLAN_I16; break;
+    case CSTRUCT_USHORT: paramP->op = FFIPLAN_U16; break;
+    case CSTRUCT_CBSIZE: /* Fall thru */
+    case CSTRUCT_INT: paramP->op = FFIPLAN_I32; break;
+    case CSTRUCT_UINT: paramP->op = FFIPLAN_U32; break;
+    case CSTRUCT_INT64: paramP->op = FFIPLAN_I64; break;
+    case CSTRUCT_UINT64: paramP->op = FFIPLAN_U64; break;
+    case CSTRUCT_FLOAT: paramP->op = FFIPLAN_FLOAT; break;
+    case CSTRUCT_DOUBLE: paramP->op = FFIPLAN_DOUBLE; break;
+    case CSTRUCT_STRING: paramP->op = FFIPLAN_STRING; break;
+    case CSTRUCT_WSTRING:
+        /* Callback return strings would not outlive the script result */
+        if (callback && ! is_param)
+            goto unsupported;
+        paramP->op = FFIPLAN_HOSTPTR;
+        paramP->to_ptr = TwapiFfiWinCharsToPtr;
+        paramP->from_ptr = TwapiFfiWinCharsFromPtr;
+        break;
+    case CSTRUCT_HANDLE:
+        paramP->op = FFIPLAN_HOSTPTR;
+        paramP->to_ptr = TwapiFfiHandleToPtr;
+        paramP->from_ptr = TwapiFfiHandleFromPtr;
+        break;
+    case CSTRUCT_STRUCT:
+        /* Structs are passed by pointer */
+        if (! is_param)
+            goto unsupported;
+        paramP->op = FFIPLAN_HOSTPTR;
+        paramP->to_ptr = TwapiFfiStructToPtr;
+        paramP->from_ptr = TwapiFfiStructFromPtr;
+        paramP->data = fldP->child;
+        fldP->child->nrefs += 1; /* Released in the plan or thunk cleanup */
+        break;
+    default:
+        goto unsupported;
+    }
+    return TCL_OK;
+
+unsupported:
+    return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
+                               is_param ? "Unsupported parameter type" : "Unsupported return type");
+}
+
+/* ffi_callable CMDNAME FNADDR RETTYPE PARAMTYPES ?CALLCONV? */
+TCL_RESULT Twapi_FfiCallableObjCmd(void *clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    static const char *callconvs[] = {"cdecl", "stdcall", NULL};
+    TwapiFfiVMs *vmsP = (TwapiFfiVMs *) clientdata;
+    FARPROC fn;
+    TwapiCStructRep *fntypeP;
+    TwapiCStructRep *paramtypesP;
+    FfiPlan *planP;
+    Tcl_DString ds;
+    int i, callconv = 0;
+
+    if (objc != 5 && objc != 6)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    if (ObjToFARPROC(NULL, objv[2], &fn) != TCL_OK || fn == NULL)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Invalid or NULL function pointer.");
+    if (objc == 6 &&
+        Tcl_GetIndexFromObj(interp, objv[5], callconvs, "calling convention", TCL_EXACT, &callconv) != TCL_OK)
+        return TCL_ERROR;
+
+    /*
+     * Unlike ffi_call, no need to hold references across the casts as
+     * the return and parameter types are only parsed once here. Note the
+     * two may be the same Tcl_Obj so only look at the reps after both
+     * casts are done.
+     */
+    if (ObjCastToCStruct(interp, objv[3], 0) != TCL_OK ||
+        ObjCastToCStruct(interp, objv[4], 1) != TCL_OK)
+        return TCL_ERROR;
+    fntypeP = CSTRUCT_REP(objv[3]);
+    paramtypesP = CSTRUCT_REP(objv[4]);
+    if (fntypeP->nfields > 1)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Function return type has multiple elements.");
+
+    Tcl_DStringInit(&ds);
+    for (i = 0; i < paramtypesP->nfields; ++i)
+        Tcl_DStringAppendElement(&ds, ObjToString(paramtypesP->fields[i].name));
+    planP = FfiPlanNew(fn, callconv ? vmsP->stdcallP : vmsP->cdeclP,
+                       &gTwapiFfiHost, paramtypesP->nfields,
+                       Tcl_DStringValue(&ds));
+    Tcl_DStringFree(&ds);
+    planP->hostdata = vmsP;
+    vmsP->nrefs += 1;           /* Released in TwapiFfiPlanCleanup */
+
+    if (TwapiFfiPlanParam(interp, &fntypeP->fields[0], 0, 0, &planP->ret) != TCL_OK)
+        goto error_return;
+    for (i = 0; i < paramtypesP->nfields; ++i) {
+        if (TwapiFfiPlanParam(interp, &paramtypesP->fields[i], 1, 0, &planP->params[i]) != TCL_OK)
+            goto error_return;
+    }
+    FfiPlanFinalize(planP);
+
+    Tcl_CreateObjCommand(interp, ObjToString(objv[1]), FfiPlanObjCmd,
+                         planP, FfiPlanDeleteCmd);
+    return TCL_OK;
+
+error_return:
+    FfiPlanFree(planP);         /* Releases references taken so far */
+    return TCL_ERROR;
+}
+
+static void TwapiDeleteFfiCallableCmd(ClientData vmsP)
+{
+    TwapiFfiVMsUnref((TwapiFfiVMs *) vmsP);
+}
+
+/*
+ * FFI callbacks. The thunk host data is a TwapiFfiThunkData. Calls
+ * from threads other than the interpreter's are passed to it through
+ * the standard callback queue. Callbacks that are alive are recorded in
+ * the base context's ffi_callbacks table, keyed by function pointer,
+ * which is also used to detect callbacks freed while a call from
+ * another thread was queued (e.g. after the caller timed out).
+ */
+typedef struct TwapiFfiThunkData {
+    TwapiInterpContext *ticP;
+    int timeout;                /* For calls from other threads */
+} TwapiFfiThunkData;
+
+/*
+ * State of a call queued from another thread. The arguments in call
+ * point into the native caller's frame, so once the caller has timed
+ * out and returned the call must not be executed.
+ */
+#define TWAPI_FFI_CALL_QUEUED    0
+#define TWAPI_FFI_CALL_RUNNING   1
+#define TWAPI_FFI_CALL_ABANDONED 2
+
+typedef struct TwapiFfiCallback {
+    TwapiCallback cb;
+    LONG volatile state;        /* TWAPI_FFI_CALL_* */
+    FfiThunkCall call;          /* Must be last, variable size */
+} TwapiFfiCallback;
+
+static int TwapiFfiCallbackFn(TwapiCallback *cbP)
+{
+    TwapiFfiCallback *fcbP = (TwapiFfiCallback *) cbP;
+    Tcl_HashEntry *he;
+
+    if (InterlockedCompareExchange(&fcbP->state, TWAPI_FFI_CALL_RUNNING,
+                                   TWAPI_FFI_CALL_QUEUED)
+        != TWAPI_FFI_CALL_QUEUED)
+        return TCL_ERROR;       /* Caller timed out and has returned */
+    if (cbP->ticP->interp == NULL)
+        return TCL_ERROR;
+    he = Tcl_FindHashEntry(&BASE_CONTEXT(cbP->ticP)->ffi_callbacks,
+                           (char *) cbP->clientdata);
+    if (he == NULL || Tcl_GetHashValue(he) != fcbP->call.thunkP)
+        return TCL_ERROR;
+    FfiThunkExecute(&fcbP->call);
+    return fcbP->call.status;
+}
+
+/*
+ * Called in a thread other than the one owning the callback. The wait
+ * is done here rather than in TwapiEnqueueCallback so that on a timeout
+ * the queued call can be abandoned and our reference released.
+ */
+static void TwapiFfiThunkDispatch(FfiThunkCall *callP)
+{
+    FfiThunk *thunkP = callP->thunkP;
+    TwapiFfiThunkData *tdP = (TwapiFfiThunkData *) thunkP->hostdata;
+    TwapiFfiCallback *fcbP;
+    DWORD winerr;
+    int sz = FFITHUNK_CALL_SIZE(thunkP->nparams);
+
+    /* On errors callP->status remains TCL_ERROR and the result is 0 */
+    fcbP = (TwapiFfiCallback *) TwapiCallbackNew(
+        tdP->ticP, TwapiFfiCallbackFn, offsetof(TwapiFfiCallback, call) + sz);
+    CopyMemory(&fcbP->call, callP, sz);
+    fcbP->cb.clientdata = (DWORD_PTR) thunkP->fnptr;
+    fcbP->state = TWAPI_FFI_CALL_QUEUED;
+    fcbP->cb.completion_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (fcbP->cb.completion_event == NULL) {
+        TwapiCallbackDelete(&fcbP->cb);
+        return;
+    }
+
+    TwapiCallbackRef(&fcbP->cb, 1); /* Ours, released below */
+    if (TwapiEnqueueCallback(tdP->ticP, &fcbP->cb, TWAPI_ENQUEUE_DIRECT,
+                             0, NULL) != ERROR_SUCCESS) {
+        TwapiCallbackUnref(&fcbP->cb, 1);
+        return;
+    }
+
+    winerr = WaitForSingleObject(fcbP->cb.completion_event, tdP->timeout);
+    if (winerr != WAIT_OBJECT_0 &&
+        InterlockedCompareExchange(&fcbP->state, TWAPI_FFI_CALL_ABANDONED,
+                                   TWAPI_FFI_CALL_QUEUED)
+        != TWAPI_FFI_CALL_QUEUED) {
+        /* Already running with our arguments so have to see it through */
+        winerr = WaitForSingleObject(fcbP->cb.completion_event, INFINITE);
+    }
+    if (winerr == WAIT_OBJECT_0 && fcbP->cb.winerr == ERROR_SUCCESS) {
+        callP->status = fcbP->call.status;
+        callP->result = fcbP->call.result;
+    }
+    /* If abandoned, the late event sees the state and skips the call */
+    TwapiCallbackUnref(&fcbP->cb, 1);
+}
+
+static void TwapiFfiThunkCleanup(FfiThunk *thunkP)
+{
+    TwapiFfiThunkData *tdP = (TwapiFfiThunkData *) thunkP->hostdata;
+    int i;
+
+    for (i = 0; i < thunkP->nparams; ++i) {
+        if (thunkP->params[i].to_ptr == TwapiFfiStructToPtr)
+            CStructRepDecrRefs((TwapiCStructRep *) thunkP->params[i].data);
+    }
+    if (tdP) {
+        TwapiInterpContextUnref(tdP->ticP, 1);
+        TwapiFree(tdP);
+    }
+}
+
+static const FfiThunkHost gTwapiFfiThunkHost = {
+    TwapiFfiThunkDispatch, TwapiFfiThunkCleanup
+};
+
+/* ffi_callback_create RETTYPE PARAMTYPES SCRIPT ?CALLCONV? ?TIMEOUT? */
+static TCL_RESULT Twapi_FfiCallbackCreateObjCmd(void *clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    static const char *callconvs[] = {"cdecl", "stdcall", NULL};
+    TwapiInterpContext *ticP;
+    TwapiCStructRep *fntypeP;
+    TwapiCStructRep *paramtypesP;
+    TwapiFfiThunkData *tdP;
+    FfiThunk *thunkP;
+    Tcl_HashEntry *he;
+    int i, new_entry, callconv = 0, timeout = -1;
+
+    if (objc < 4 || objc > 6)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    if (objc > 4 &&
+        Tcl_GetIndexFromObj(interp, objv[4], callconvs, "calling convention", TCL_EXACT, &callconv) != TCL_OK)
+        return TCL_ERROR;
+    if (objc > 5 && ObjToInt(interp, objv[5], &timeout) != TCL_OK)
+        return TCL_ERROR;
+    if (timeout == 0)
+        timeout = -1;           /* 0 would mean do not wait, INFINITE */
+
+    ticP = TwapiGetBaseContext(interp);
+    if (ticP == NULL)
+        return TCL_ERROR;
+
+    /* See Twapi_FfiCallableObjCmd regarding order of casts */
+    if (ObjCastToCStruct(interp, objv[1], 0) != TCL_OK ||
+        ObjCastToCStruct(interp, objv[2], 1) != TCL_OK)
+        return TCL_ERROR;
+    fntypeP = CSTRUCT_REP(objv[1]);
+    paramtypesP = CSTRUCT_REP(objv[2]);
+    if (fntypeP->nfields > 1)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Function return type has multiple elements.");
+
+    thunkP = FfiThunkNew(interp, objv[3], &gTwapiFfiThunkHost,
+                         paramtypesP->nfields, callconv);
+    if (TwapiFfiPlanParam(interp, &fntypeP->fields[0], 0, 1, &thunkP->ret) != TCL_OK)
+        goto error_return;
+    for (i = 0; i < paramtypesP->nfields; ++i) {
+        if (TwapiFfiPlanParam(interp, &paramtypesP->fields[i], 1, 1, &thunkP->params[i]) != TCL_OK)
+            goto error_return;
+    }
+    if (FfiThunkFinalize(interp, thunkP) != TCL_OK)
+        goto error_return;
+
+    tdP = TwapiAlloc(sizeof(*tdP));
+    tdP->ticP = ticP;
+    TwapiInterpContextRef(ticP, 1); /* Released in TwapiFfiThunkCleanup */
+    tdP->timeout = timeout;
+    thunkP->hostdata = tdP;
+
+    he = Tcl_CreateHashEntry(&BASE_CONTEXT(ticP)->ffi_callbacks,
+                             (char *) thunkP->fnptr, &new_entry);
+    TWAPI_ASSERT(new_entry);
+    Tcl_SetHashValue(he, thunkP);
+    return ObjSetResult(interp, ObjFromFARPROC((FARPROC) thunkP->fnptr));
+
+error_return:
+    FfiThunkDelete(thunkP);     /* Releases references taken so far */
+    return TCL_ERROR;
+}
+
+/* ffi_callback_free FNPTR */
+static TCL_RESULT Twapi_FfiCallbackFreeObjCmd(void *clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP;
+    Tcl_HashEntry *he;
+    FARPROC fnptr;
+
+    if (objc != 2)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    if (ObjToFARPROC(interp, objv[1], &fnptr) != TCL_OK)
+        return TCL_ERROR;
+    ticP = TwapiGetBaseContext(interp);
+    if (ticP == NULL)
+        return TCL_ERROR;
+    he = Tcl_FindHashEntry(&BASE_CONTEXT(ticP)->ffi_callbacks, (char *) fnptr);
+    if (he == NULL)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Unknown FFI callback.");
+    FfiThunkDelete((FfiThunk *) Tcl_GetHashValue(he));
+    Tcl_DeleteHashEntry(he);
+    return TCL_OK;
+}
+
+/* Frees callbacks that are still allocated when the interp is deleted */
+void TwapiFfiCallbacksCleanup(TwapiInterpContext *ticP)
+{
+    Tcl_HashSearch hs;
+    Tcl_HashEntry *he;
+
+    for (he = Tcl_FirstHashEntry(&BASE_CONTEXT(ticP)->ffi_callbacks, &hs);
+         he != NULL;
+         he = Tcl_NextHashEntry(&hs)) {
+        /* It is safe to delete this and only this hash element */
+        FfiThunk *thunkP = Tcl_GetHashValue(he);
+        Tcl_DeleteHashEntry(he);
+        FfiThunkDelete(thunkP);
+    }
+    Tcl_DeleteHashTable(&BASE_CONTEXT(ticP)->ffi_callbacks);
+}
+
 void TwapiFfiInit(Tcl_Interp *interp)
 {
     DCCallVM *vmP;
+    TwapiFfiVMs *vmsP;
 
     vmP = dcNewCallVM(4096);
     dcMode(vmP, DC_CALL_C_DEFAULT);
@@ -902,5 +1519,22 @@ void TwapiFfiInit(Tcl_Interp *interp)
     dcMode(vmP, DC_CALL_C_X86_WIN32_STD);
     Tcl_CreateObjCommand(interp, TWAPI_TCL_NAMESPACE "::ffi_stdcall", Twapi_FfiCallObjCmd, vmP, TwapiDeleteFfiCmd);
 #endif
-    
+
+    vmsP = TwapiAlloc(sizeof(*vmsP));
+    vmsP->nrefs = 1;
+    vmsP->cdeclP = dcNewCallVM(4096);
+    dcMode(vmsP->cdeclP, DC_CALL_C_DEFAULT);
+#ifdef _WIN64
+    vmsP->stdcallP = vmsP->cdeclP;
+#else
+    vmsP->stdcallP = dcNewCallVM(4096);
+    dcMode(vmsP->stdcallP, DC_CALL_C_X86_WIN32_STD);
+#endif
+    Tcl_CreateObjCommand(interp, TWAPI_TCL_NAMESPACE "::ffi_callable", Twapi_FfiCallableObjCmd, vmsP, TwapiDeleteFfiCallableCmd);
+    Tcl_CreateObjCommand(interp, TWAPI_TCL_NAMESPACE "::ffi_callback_create", Twapi_FfiCallbackCreateObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, TWAPI_TCL_NAMESPACE "::ffi_callback_free", Twapi_FfiCallbackFreeObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, TWAPI_TCL_NAMESPACE "::cstruct_view_create", Twapi_CStructViewObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, TWAPI_TCL_NAMESPACE "::cstruct_encode", Twapi_CStructEncodeObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, TWAPI_TCL_NAMESPACE "::cstruct_decode", Twapi_CStructDecodeObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, TWAPI_TCL_NAMESPACE "::cstruct_forget", Twapi_CStructForgetObjCmd, NULL, NULL);
 }
@@ -0,0 +1,674 @@
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Precompiled FFI call plans. See ffiplan.h.
+ *
+ * Build with -DFFIPLAN_TEST to get a standalone test and benchmark
+ * that calls C library functions through dlopen (see end of file).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "ffiplan.h"
+
+/* Ranges for the integer operations narrower than 64 bits */
+static const struct {
+    Tcl_WideInt min, max;
+    const char *name;
+} ffiplanIntRanges[] = {
+    {0, 0, NULL},               /* FFIPLAN_VOID */
+    {0, 0, NULL},               /* FFIPLAN_BOOL */
+    {-128, 255, "i1"},          /* Unsigned values accepted as in C */
+    {0, 255, "ui1"},
+    {-32768, 65535, "i2"},
+    {0, 65535, "ui2"},
+    {-2147483647-1, 4294967295U, "i4"},
+    {0, 4294967295U, "ui4"},
+};
+
+FfiPlan *FfiPlanNew(void *fn, DCCallVM *vmP, const FfiPlanHost *hostP,
+                    int nparams, const char *usage)
+{
+    FfiPlan *planP;
+    size_t sz;
+
+    sz = sizeof(*planP);
+    if (nparams > 1)
+        sz += (nparams - 1) * sizeof(planP->params[0]);
+    planP = (FfiPlan *) ckalloc(sz);
+    memset(planP, 0, sz);
+    planP->fn = fn;
+    planP->vmP = vmP;
+    planP->hostP = hostP;
+    planP->nparams = nparams;
+    if (usage) {
+        planP->usage = ckalloc(strlen(usage) + 1);
+        strcpy(planP->usage, usage);
+    }
+    return planP;
+}
+
+void FfiPlanFinalize(FfiPlan *planP)
+{
+    int i;
+    planP->needs_scratch = 0;
+    for (i = 0; i < planP->nparams; ++i) {
+        if (planP->params[i].op == FFIPLAN_HOSTPTR)
+            planP->needs_scratch = 1;
+    }
+}
+
+void FfiPlanFree(FfiPlan *planP)
+{
+    if (planP->hostP && planP->hostP->cleanup)
+        planP->hostP->cleanup(planP);
+    if (planP->usage)
+        ckfree(planP->usage);
+    ckfree((char *) planP);
+}
+
+static int FfiPlanIntArg(Tcl_Interp *interp, Tcl_Obj *objP, FfiPlanOp op,
+                         Tcl_WideInt *wideP)
+{
+    if (Tcl_GetWideIntFromObj(interp, objP, wideP) != TCL_OK)
+        return TCL_ERROR;
+    if (*wideP < ffiplanIntRanges[op].min || *wideP > ffiplanIntRanges[op].max) {
+        if (interp) {
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("Integer value %s out of range for type %s.",
+                                           Tcl_GetString(objP),
+                                           ffiplanIntRanges[op].name));
+        }
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+int FfiPlanInvoke(FfiPlan *planP, Tcl_Interp *interp,
+                  int objc, Tcl_Obj *const objv[])
+{
+    DCCallVM *vmP = planP->vmP;
+    const FfiPlanParam *paramP;
+    void *mark = NULL;
+    Tcl_Obj *resultObj;
+    int i;
+    union {
+        int i; Tcl_WideInt w; double d; void *pv;
+    } u;
+
+    if (objc != planP->nparams) {
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("Wrong number of arguments: should be \"%s\".",
+                                       planP->usage ? planP->usage : ""));
+        return TCL_ERROR;
+    }
+
+    if (planP->needs_scratch)
+        mark = planP->hostP->mark();
+
+    dcReset(vmP);
+    for (i = 0, paramP = planP->params; i < objc; ++i, ++paramP) {
+        switch (paramP->op) {
+        case FFIPLAN_BOOL:
+            if (Tcl_GetBooleanFromObj(interp, objv[i], &u.i) != TCL_OK)
+                goto error_return;
+            dcArgBool(vmP, u.i);
+            break;
+        case FFIPLAN_I8:
+        case FFIPLAN_U8:
+            if (FfiPlanIntArg(interp, objv[i], paramP->op, &u.w) != TCL_OK)
+                goto error_return;
+            dcArgChar(vmP, (DCchar) u.w);
+            break;
+        case FFIPLAN_I16:
+        case FFIPLAN_U16:
+            if (FfiPlanIntArg(interp, objv[i], paramP->op, &u.w) != TCL_OK)
+                goto error_return;
+            dcArgShort(vmP, (DCshort) u.w);
+            break;
+        case FFIPLAN_I32:
+        case FFIPLAN_U32:
+            if (FfiPlanIntArg(interp, objv[i], paramP->op, &u.w) != TCL_OK)
+                goto error_return;
+            dcArgInt(vmP, (DCint) u.w);
+            break;
+        case FFIPLAN_I64:
+        case FFIPLAN_U64:
+            if (Tcl_GetWideIntFromObj(interp, objv[i], &u.w) != TCL_OK)
+                goto error_return;
+            dcArgLongLong(vmP, (DClonglong) u.w);
+            break;
+        case FFIPLAN_FLOAT:
+            if (Tcl_GetDoubleFromObj(interp, objv[i], &u.d) != TCL_OK)
+                goto error_return;
+            dcArgFloat(vmP, (DCfloat) u.d);
+            break;
+        case FFIPLAN_DOUBLE:
+            if (Tcl_GetDoubleFromObj(interp, objv[i], &u.d) != TCL_OK)
+                goto error_return;
+            dcArgDouble(vmP, u.d);
+            break;
+        case FFIPLAN_STRING:
+            /* The string rep is never freed by shimmering so no copy */
+            dcArgPointer(vmP, Tcl_GetString(objv[i]));
+            break;
+        case FFIPLAN_HOSTPTR:
+            if (paramP->to_ptr(interp, objv[i], paramP->data, &u.pv) != TCL_OK)
+                goto error_return;
+            dcArgPointer(vmP, u.pv);
+            break;
+        default:
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Unsupported parameter type.", -1));
+            goto error_return;
+        }
+    }
+
+    paramP = &planP->ret;
+    switch (paramP->op) {
+    case FFIPLAN_VOID:
+        dcCallVoid(vmP, planP->fn);
+        resultObj = NULL;
+        break;
+    case FFIPLAN_BOOL:
+        resultObj = Tcl_NewBooleanObj(dcCallBool(vmP, planP->fn) != 0);
+        break;
+    case FFIPLAN_I8:
+        resultObj = Tcl_NewIntObj((signed char) dcCallChar(vmP, planP->fn));
+        break;
+    case FFIPLAN_U8:
+        resultObj = Tcl_NewIntObj((unsigned char) dcCallChar(vmP, planP->fn));
+        break;
+    case FFIPLAN_I16:
+        resultObj = Tcl_NewIntObj((short) dcCallShort(vmP, planP->fn));
+        break;
+    case FFIPLAN_U16:
+        resultObj = Tcl_NewIntObj((unsigned short) dcCallShort(vmP, planP->fn));
+        break;
+    case FFIPLAN_I32:
+        resultObj = Tcl_NewIntObj(dcCallInt(vmP, planP->fn));
+        break;
+    case FFIPLAN_U32:
+        resultObj = Tcl_NewWideIntObj((unsigned int) dcCallInt(vmP, planP->fn));
+        break;
+    case FFIPLAN_I64:
+    case FFIPLAN_U64:
+        resultObj = Tcl_NewWideIntObj(dcCallLongLong(vmP, planP->fn));
+        break;
+    case FFIPLAN_FLOAT:
+        resultObj = Tcl_NewDoubleObj(dcCallFloat(vmP, planP->fn));
+        break;
+    case FFIPLAN_DOUBLE:
+        resultObj = Tcl_NewDoubleObj(dcCallDouble(vmP, planP->fn));
+        break;
+    case FFIPLAN_STRING:
+        u.pv = dcCallPointer(vmP, planP->fn);
+        resultObj = Tcl_NewStringObj(u.pv ? (char *) u.pv : "", -1);
+        break;
+    case FFIPLAN_HOSTPTR:
+        u.pv = dcCallPointer(vmP, planP->fn);
+        resultObj = paramP->from_ptr(u.pv, paramP->data);
+        break;
+    default:
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Unsupported return type.", -1));
+        goto error_return;
+    }
+
+    if (mark)
+        planP->hostP->release(mark);
+    if (resultObj)
+        Tcl_SetObjResult(interp, resultObj);
+    else
+        Tcl_ResetResult(interp);
+    return TCL_OK;
+
+error_return:
+    if (mark)
+        planP->hostP->release(mark);
+    return TCL_ERROR;
+}
+
+int FfiPlanObjCmd(ClientData clientdata, Tcl_Interp *interp,
+                  int objc, Tcl_Obj *const objv[])
+{
+    return FfiPlanInvoke((FfiPlan *) clientdata, interp, objc-1, objv+1);
+}
+
+void FfiPlanDeleteCmd(ClientData clientdata)
+{
+    FfiPlanFree((FfiPlan *) clientdata);
+}
+
+#ifdef FFIPLAN_TEST
+/*
+ * Standalone test and benchmark. Build on Linux x86-64 with
+ *
+ *   cc -O2 -DFFIPLAN_TEST -I../dyncall/dyncall-0.9/include \
+ *      -I<tcl>/include ffiplan.c -L<tcl>/lib -ltcl8.6 -ldl -lm
+ *
+ * dyncall is only shipped in this tree as Windows libraries so the
+ * driver carries a minimal dyncall VM for the SysV x86-64 convention.
+ * It only handles up to 6 integer/pointer and 8 floating point
+ * arguments which is all the C library functions below need.
+ */
+
+#include <stdio.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <wchar.h>
+
+#if !defined(__x86_64__) || defined(_WIN32)
+#error The FFIPLAN_TEST driver only supports SysV x86-64.
+#endif
+
+struct DCCallVM_ {
+    int nints, nfps;
+    DClonglong ints[6];
+    double fps[8];
+};
+
+DCCallVM *dcNewCallVM(DCsize size) {
+    (void) size;
+    return (DCCallVM *) calloc(1, sizeof(DCCallVM));
+}
+void dcFree(DCCallVM *vm) { free(vm); }
+void dcReset(DCCallVM *vm) { vm->nints = vm->nfps = 0; }
+void dcMode(DCCallVM *vm, DCint mode) { (void) vm; (void) mode; }
+
+static void ShimInt(DCCallVM *vm, DClonglong v) {
+    if (vm->nints == 6) {
+        fprintf(stderr, "Too many integer arguments for test shim\n");
+        abort();
+    }
+    vm->ints[vm->nints++] = v;
+}
+static void ShimFp(DCCallVM *vm, double d) {
+    if (vm->nfps == 8) {
+        fprintf(stderr, "Too many floating point arguments for test shim\n");
+        abort();
+    }
+    vm->fps[vm->nfps++] = d;
+}
+void dcArgBool(DCCallVM *vm, DCbool v) { ShimInt(vm, v); }
+void dcArgChar(DCCallVM *vm, DCchar v) { ShimInt(vm, v); }
+void dcArgShort(DCCallVM *vm, DCshort v) { ShimInt(vm, v); }
+void dcArgInt(DCCallVM *vm, DCint v) { ShimInt(vm, v); }
+void dcArgLong(DCCallVM *vm, DClong v) { ShimInt(vm, v); }
+void dcArgLongLong(DCCallVM *vm, DClonglong v) { ShimInt(vm, v); }
+void dcArgPointer(DCCallVM *vm, DCpointer v) { ShimInt(vm, (DClonglong) v); }
+void dcArgDouble(DCCallVM *vm, DCdouble v) { ShimFp(vm, v); }
+void dcArgFloat(DCCallVM *vm, DCfloat v) {
+    /* A float is passed in the low 32 bits of the XMM register */
+    double d = 0;
+    memcpy(&d, &v, sizeof(v));
+    ShimFp(vm, d);
+}
+
+/*
+ * Unused trailing registers are harmless for non-variadic callees so
+ * every call passes all of them.
+ */
+#define SHIM_ARGS(vm_)                                                  \
+    vm_->ints[0], vm_->ints[1], vm_->ints[2], vm_->ints[3], vm_->ints[4], vm_->ints[5], \
+    vm_->fps[0], vm_->fps[1], vm_->fps[2], vm_->fps[3], vm_->fps[4], vm_->fps[5], \
+    vm_->fps[6], vm_->fps[7]
+#define SHIM_PROTO(ret_)                                                \
+    ret_ (*)(DClonglong, DClonglong, DClonglong, DClonglong, DClonglong, DClonglong, \
+             double, double, double, double, double, double, double, double)
+
+void dcCallVoid(DCCallVM *vm, DCpointer f) { ((SHIM_PROTO(void))f)(SHIM_ARGS(vm)); }
+DCbool dcCallBool(DCCallVM *vm, DCpointer f) { return ((SHIM_PROTO(DCint))f)(SHIM_ARGS(vm)); }
+DCchar dcCallChar(DCCallVM *vm, DCpointer f) { return ((SHIM_PROTO(DCchar))f)(SHIM_ARGS(vm)); }
+DCshort dcCallShort(DCCallVM *vm, DCpointer f) { return ((SHIM_PROTO(DCshort))f)(SHIM_ARGS(vm)); }
+DCint dcCallInt(DCCallVM *vm, DCpointer f) { return ((SHIM_PROTO(DCint))f)(SHIM_ARGS(vm)); }
+DClong dcCallLong(DCCallVM *vm, DCpointer f) { return ((SHIM_PROTO(DClong))f)(SHIM_ARGS(vm)); }
+DClonglong dcCallLongLong(DCCallVM *vm, DCpointer f) { return ((SHIM_PROTO(DClonglong))f)(SHIM_ARGS(vm)); }
+DCfloat dcCallFloat(DCCallVM *vm, DCpointer f) { return ((SHIM_PROTO(DCfloat))f)(SHIM_ARGS(vm)); }
+DCdouble dcCallDouble(DCCallVM *vm, DCpointer f) { return ((SHIM_PROTO(DCdouble))f)(SHIM_ARGS(vm)); }
+DCpointer dcCallPointer(DCCallVM *vm, DCpointer f) { return ((SHIM_PROTO(DCpointer))f)(SHIM_ARGS(vm)); }
+
+/*
+ * Test host. Scratch memory is a simple bump allocator standing in
+ * for the twapi SWS memlifo. Pointer parameter conversions:
+ *   TestToWide - wchar_t string copied into scratch (as lpwstr)
+ *   TestToTm   - struct tm from a {sec min hour mday mon year} list
+ *                (as a pointer to a struct parameter)
+ *   TestToPtr  - integer or empty string for NULL (as handle)
+ */
+static char testScratch[65536];
+static size_t testScratchTop;
+static int testMarks;
+
+static void *TestMark(void) {
+    testMarks++;
+    return (void *) (testScratchTop + 1);
+}
+static void TestRelease(void *mark) {
+    testMarks--;
+    testScratchTop = (size_t) mark - 1;
+}
+static void *TestScratchAlloc(size_t sz) {
+    void *pv;
+    sz = (sz + 15) & ~(size_t)15;
+    if (testScratchTop + sz > sizeof(testScratch))
+        return NULL;
+    pv = testScratch + testScratchTop;
+    testScratchTop += sz;
+    return pv;
+}
+static int testCleanups;
+static void TestCleanup(FfiPlan *planP) { (void) planP; testCleanups++; }
+static const FfiPlanHost testHost = {TestMark, TestRelease, TestCleanup};
+
+static int TestToWide(Tcl_Interp *interp, Tcl_Obj *objP, void *data, void **pvP)
+{
+    int i, len;
+    const char *s = Tcl_GetStringFromObj(objP, &len);
+    wchar_t *ws = TestScratchAlloc((len + 1) * sizeof(wchar_t));
+    (void) data;
+    if (ws == NULL) {
+        Tcl_SetResult(interp, "Out of scratch memory.", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    /* ASCII is enough for the test */
+    for (i = 0; i < len; ++i)
+        ws[i] = (unsigned char) s[i];
+    ws[len] = 0;
+    *pvP = ws;
+    return TCL_OK;
+}
+
+static int TestToTm(Tcl_Interp *interp, Tcl_Obj *objP, void *data, void **pvP)
+{
+    Tcl_Obj **elems;
+    int i, n, v[6];
+    struct tm *tmP;
+
+    (void) data;
+    if (Tcl_ListObjGetElements(interp, objP, &n, &elems) != TCL_OK)
+        return TCL_ERROR;
+    if (n == 0) {
+        *pvP = NULL;
+        return TCL_OK;
+    }
+    if (n != 6) {
+        Tcl_SetResult(interp, "Invalid struct tm value.", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    for (i = 0; i < 6; ++i) {
+        if (Tcl_GetIntFromObj(interp, elems[i], &v[i]) != TCL_OK)
+            return TCL_ERROR;
+    }
+    tmP = TestScratchAlloc(sizeof(*tmP));
+    if (tmP == NULL) {
+        Tcl_SetResult(interp, "Out of scratch memory.", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    memset(tmP, 0, sizeof(*tmP));
+    tmP->tm_sec = v[0];
+    tmP->tm_min = v[1];
+    tmP->tm_hour = v[2];
+    tmP->tm_mday = v[3];
+    tmP->tm_mon = v[4];
+    tmP->tm_year = v[5];
+    *pvP = tmP;
+    return TCL_OK;
+}
+
+static int TestToPtr(Tcl_Interp *interp, Tcl_Obj *objP, void *data, void **pvP)
+{
+    Tcl_WideInt w;
+    (void) data;
+    if (Tcl_GetCharLength(objP) == 0) {
+        *pvP = NULL;
+        return TCL_OK;
+    }
+    if (Tcl_GetWideIntFromObj(interp, objP, &w) != TCL_OK)
+        return TCL_ERROR;
+    *pvP = (void *) (size_t) w;
+    return TCL_OK;
+}
+
+static Tcl_Obj *TestFromPtr(void *pv, void *data)
+{
+    (void) data;
+    return Tcl_NewWideIntObj((Tcl_WideInt) (size_t) pv);
+}
+
+static const char *testTypes[] = {
+    "void", "bool", "i1", "ui1", "i2", "ui2", "i4", "ui4", "i8", "ui8",
+    "r4", "r8", "lpstr", "lpwstr", "tm", "handle", NULL
+};
+
+static int TestSetOp(Tcl_Interp *interp, Tcl_Obj *typeObj, FfiPlanParam *paramP)
+{
+    int index;
+    memset(paramP, 0, sizeof(*paramP));
+    if (Tcl_GetIndexFromObj(interp, typeObj, testTypes, "type", 0, &index) != TCL_OK)
+        return TCL_ERROR;
+    paramP->from_ptr = TestFromPtr;
+    switch (index) {
+    case 13: paramP->op = FFIPLAN_HOSTPTR; paramP->to_ptr = TestToWide; break;
+    case 14: paramP->op = FFIPLAN_HOSTPTR; paramP->to_ptr = TestToTm; break;
+    case 15: paramP->op = FFIPLAN_HOSTPTR; paramP->to_ptr = TestToPtr; break;
+    default: paramP->op = (FfiPlanOp) index; break; /* Same order */
+    }
+    return TCL_OK;
+}
+
+static DCCallVM *testVM;
+
+static FfiPlan *TestCompile(Tcl_Interp *interp, Tcl_Obj *fnObj,
+                            Tcl_Obj *retObj, Tcl_Obj *paramsObj)
+{
+    void *fn;
+    FfiPlan *planP;
+    FfiPlanParam ret;
+    Tcl_Obj **types;
+    int i, ntypes;
+
+    fn = dlsym(RTLD_DEFAULT, Tcl_GetString(fnObj));
+    if (fn == NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Symbol %s not found.",
+                                               Tcl_GetString(fnObj)));
+        return NULL;
+    }
+    /*
+     * Return type is converted first since retObj and paramsObj may be
+     * the same literal and the conversion would free the list elements.
+     */
+    if (TestSetOp(interp, retObj, &ret) != TCL_OK)
+        return NULL;
+    if (Tcl_ListObjGetElements(interp, paramsObj, &ntypes, &types) != TCL_OK)
+        return NULL;
+    planP = FfiPlanNew(fn, testVM, &testHost, ntypes, Tcl_GetString(paramsObj));
+    planP->ret = ret;
+    for (i = 0; i < ntypes; ++i) {
+        if (TestSetOp(interp, types[i], &planP->params[i]) != TCL_OK)
+            goto error_return;
+        if (planP->params[i].op == FFIPLAN_VOID) {
+            Tcl_SetResult(interp, "Parameters cannot be void.", TCL_STATIC);
+            goto error_return;
+        }
+    }
+    FfiPlanFinalize(planP);
+    return planP;
+
+error_return:
+    FfiPlanFree(planP);
+    return NULL;
+}
+
+/* callable NAME FUNCTION RETTYPE PARAMTYPES */
+static int TestCallableObjCmd(ClientData cd, Tcl_Interp *interp,
+                              int objc, Tcl_Obj *const objv[])
+{
+    FfiPlan *planP;
+    (void) cd;
+    if (objc != 5) {
+        Tcl_WrongNumArgs(interp, 1, objv, "NAME FUNCTION RETTYPE PARAMTYPES");
+        return TCL_ERROR;
+    }
+    planP = TestCompile(interp, objv[2], objv[3], objv[4]);
+    if (planP == NULL)
+        return TCL_ERROR;
+    Tcl_CreateObjCommand(interp, Tcl_GetString(objv[1]), FfiPlanObjCmd,
+                         planP, FfiPlanDeleteCmd);
+    return TCL_OK;
+}
+
+/*
+ * call FUNCTION RETTYPE PARAMTYPES PARAMS - models the per-call cost of
+ * the previous ffi_call which converted the type lists, duplicated the
+ * parameter list and set up the marshalling on every call.
+ */
+static int TestCallObjCmd(ClientData cd, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[])
+{
+    FfiPlan *planP;
+    Tcl_Obj *paramsObj, **params;
+    int nparams, res;
+    (void) cd;
+    if (objc != 5) {
+        Tcl_WrongNumArgs(interp, 1, objv, "FUNCTION RETTYPE PARAMTYPES PARAMS");
+        return TCL_ERROR;
+    }
+    planP = TestCompile(interp, objv[1], objv[2], objv[3]);
+    if (planP == NULL)
+        return TCL_ERROR;
+    paramsObj = Tcl_DuplicateObj(objv[4]);
+    Tcl_IncrRefCount(paramsObj);
+    res = Tcl_ListObjGetElements(interp, paramsObj, &nparams, &params);
+    if (res == TCL_OK)
+        res = FfiPlanInvoke(planP, interp, nparams, params);
+    Tcl_DecrRefCount(paramsObj);
+    FfiPlanFree(planP);
+    return res;
+}
+
+/* Baseline: a native Tcl command wrapping abs() */
+static int TestAbsObjCmd(ClientData cd, Tcl_Interp *interp,
+                         int objc, Tcl_Obj *const objv[])
+{
+    int i;
+    (void) cd;
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "INT");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIntFromObj(interp, objv[1], &i) != TCL_OK)
+        return TCL_ERROR;
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(abs(i)));
+    return TCL_OK;
+}
+
+static const char *testScript =
+    "proc check {script expected} {\n"
+    "    set code [catch {uplevel 1 $script} result]\n"
+    "    if {$code} {set result [list error $result]}\n"
+    "    if {$result ne $expected} {\n"
+    "        puts \"FAIL: $script\\n  got:      $result\\n  expected: $expected\"\n"
+    "        incr ::failures\n"
+    "    }\n"
+    "    incr ::checks\n"
+    "}\n"
+    "set failures 0; set checks 0\n"
+    "callable abs abs i4 {i4}\n"
+    "callable labs labs i8 {i8}\n"
+    "callable strlen strlen ui8 {lpstr}\n"
+    "callable strtod strtod r8 {lpstr handle}\n"
+    "callable ldexp ldexp r8 {r8 i4}\n"
+    "callable sqrtf sqrtf r4 {r4}\n"
+    "callable wcslen wcslen ui8 {lpwstr}\n"
+    "callable timegm timegm i8 {tm}\n"
+    "callable toupper toupper ui1 {i4}\n"
+    "callable strnlen strnlen ui8 {lpstr ui8}\n"
+    "callable srand srand void {ui4}\n"
+    "check {abs -42} 42\n"
+    "check {abs 2147483647} 2147483647\n"
+    "check {labs -12345678901} 12345678901\n"
+    "check {strlen hello} 5\n"
+    "check {strlen {}} 0\n"
+    "check {strtod 2.5 {}} 2.5\n"
+    "check {ldexp 1.5 4} 24.0\n"
+    "check {sqrtf 2.25} 1.5\n"
+    "check {wcslen {wide chars}} 10\n"
+    "check {timegm {0 0 0 1 0 70}} 0\n"
+    "check {timegm {40 46 1 9 8 101}} 1000000000\n"
+    "check {toupper 97} 65\n"
+    "check {srand 4294967295} {}\n"
+    "check {abs} {error {Wrong number of arguments: should be \"i4\".}}\n"
+    "check {abs 1 2} {error {Wrong number of arguments: should be \"i4\".}}\n"
+    "check {abs notanint} {error {expected integer but got \"notanint\"}}\n"
+    "check {abs 4294967296} {error {Integer value 4294967296 out of range for type i4.}}\n"
+    "check {srand -1} {error {Integer value -1 out of range for type ui4.}}\n"
+    "check {timegm {1 2 3}} {error {Invalid struct tm value.}}\n"
+    "check {call abs i4 {i4} {-7}} 7\n"
+    "check {call wcslen ui8 {lpwstr} {abc}} 3\n"
+    /* Same object passed as string and shimmered to int */
+    "set v 123; check {strnlen $v $v} 3\n"
+    "check {set ::testmarks} 0\n"
+    "set c $::testcleanups; rename abs {}\n"
+    "check {expr {$::testcleanups - $c}} 1\n"
+    "puts \"$checks checks, $failures failures\"\n"
+    "callable abs abs i4 {i4}\n"
+    "set n 1000000\n"
+    "proc bench {label script n} {\n"
+    "    set t [lindex [uplevel 1 [list time $script $n]] 0]\n"
+    "    puts [format {%-36s %8.1f ns/call} $label [expr {$t * 1000.0}]]\n"
+    "}\n"
+    "proc run {n} {\n"
+    "    set x -5\n"
+    "    bench {native Tcl command abs} {nativeabs $x} $n\n"
+    "    bench {callable abs (i4)} {abs $x} $n\n"
+    "    bench {per-call ffi_call abs (i4)} {call abs i4 {i4} [list $x]} $n\n"
+    "    set s hello\n"
+    "    bench {callable strlen (lpstr)} {strlen $s} $n\n"
+    "    bench {per-call ffi_call strlen (lpstr)} {call strlen ui8 {lpstr} [list $s]} $n\n"
+    "    bench {callable wcslen (lpwstr)} {wcslen $s} $n\n"
+    "    set tm {40 46 1 9 8 101}\n"
+    "    bench {callable timegm (struct tm *)} {timegm $tm} $n\n"
+    "    bench {callable ldexp (r8 i4)} {ldexp 1.5 4} $n\n"
+    "}\n"
+    "run $n\n"
+    "set failures\n";
+
+int main(int argc, char **argv)
+{
+    Tcl_Interp *interp;
+    int failures;
+    volatile unsigned int sink = 0;
+    int (*volatile absfn)(int) = abs;
+    int i, n = 10000000;
+    clock_t start;
+
+    (void) argc;
+    Tcl_FindExecutable(argv[0]);
+    interp = Tcl_CreateInterp();
+    testVM = dcNewCallVM(4096);
+    Tcl_CreateObjCommand(interp, "callable", TestCallableObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "call", TestCallObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "nativeabs", TestAbsObjCmd, NULL, NULL);
+    Tcl_LinkVar(interp, "testmarks", (char *) &testMarks, TCL_LINK_INT);
+    Tcl_LinkVar(interp, "testcleanups", (char *) &testCleanups, TCL_LINK_INT);
+
+    start = clock();
+    for (i = 0; i < n; ++i)
+        sink += absfn(-i);
+    printf("%-36s %8.1f ns/call\n", "direct C call abs",
+           (clock() - start) * 1e9 / CLOCKS_PER_SEC / n);
+    fflush(stdout);
+
+    if (Tcl_Eval(interp, testScript) != TCL_OK) {
+        fprintf(stderr, "%s\n", Tcl_GetStringResult(interp));
+        return 1;
+    }
+    failures = atoi(Tcl_GetStringResult(interp));
+    Tcl_DeleteInterp(interp);
+    dcFree(testVM);
+    return failures != 0;
+}
+
+#endif /* FFIPLAN_TEST */
@@ -0,0 +1,101 @@
+#ifndef FFIPLAN_H
+#define FFIPLAN_H
+
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Precompiled FFI call plans. A plan binds a function address, the
+ * dyncall VM for its calling convention and the marshalling operation
+ * for the return value and each parameter. The plan is built once and
+ * then invoked directly as a Tcl command so a call only converts the
+ * argument values. Conversions of pointer types (wide strings, handles,
+ * structures) are delegated to the host through callbacks so this
+ * module only depends on Tcl and dyncall and can be built and
+ * benchmarked on any platform.
+ */
+
+#include <tcl.h>
+#include "dyncall.h"
+
+/* Marshalling operations for parameters and return values */
+typedef enum FfiPlanOp {
+    FFIPLAN_VOID,               /* Return values only */
+    FFIPLAN_BOOL,
+    FFIPLAN_I8,
+    FFIPLAN_U8,
+    FFIPLAN_I16,
+    FFIPLAN_U16,
+    FFIPLAN_I32,
+    FFIPLAN_U32,
+    FFIPLAN_I64,
+    FFIPLAN_U64,
+    FFIPLAN_FLOAT,
+    FFIPLAN_DOUBLE,
+    FFIPLAN_STRING,             /* char *, passed from the string rep */
+    FFIPLAN_HOSTPTR             /* Pointer converted by host callbacks */
+} FfiPlanOp;
+
+/*
+ * Converts a Tcl value to a pointer argument. Any memory that the
+ * pointer refers to must be allocated from the host scratch area
+ * (see FfiPlanHost.mark) and not from the Tcl_Obj itself since
+ * a later argument conversion may shimmer the same Tcl_Obj.
+ */
+typedef int FfiPlanToPtrProc(Tcl_Interp *interp, Tcl_Obj *objP,
+                             void *data, void **pvP);
+/* Converts a pointer return value to a Tcl_Obj */
+typedef Tcl_Obj *FfiPlanFromPtrProc(void *pv, void *data);
+
+typedef struct FfiPlanParam {
+    FfiPlanOp op;
+    FfiPlanToPtrProc *to_ptr;     /* FFIPLAN_HOSTPTR parameters */
+    FfiPlanFromPtrProc *from_ptr; /* FFIPLAN_HOSTPTR return values */
+    void *data;                   /* Passed to above callbacks */
+} FfiPlanParam;
+
+struct FfiPlan;
+typedef struct FfiPlanHost {
+    /*
+     * Scratch storage bracketing a call with FFIPLAN_HOSTPTR arguments.
+     * mark is called before arguments are converted and release after
+     * the call returns or an argument fails to convert.
+     */
+    void *(*mark)(void);
+    void (*release)(void *mark);
+    /* Called when a plan is freed to release FfiPlanParam.data etc. */
+    void (*cleanup)(struct FfiPlan *planP);
+} FfiPlanHost;
+
+typedef struct FfiPlan {
+    void *fn;                   /* Function to call */
+    DCCallVM *vmP;              /* Shared VM, not owned by the plan */
+    const FfiPlanHost *hostP;
+    void *hostdata;             /* For use by the host */
+    char *usage;                /* Parameter names for error messages */
+    int needs_scratch;          /* Whether any FFIPLAN_HOSTPTR params */
+    int nparams;
+    FfiPlanParam ret;
+    FfiPlanParam params[1];     /* Actually nparams entries */
+} FfiPlan;
+
+/*
+ * Allocates a plan with all operations initialized to FFIPLAN_VOID.
+ * The caller fills in ret and params[] and then calls FfiPlanFinalize.
+ */
+FfiPlan *FfiPlanNew(void *fn, DCCallVM *vmP, const FfiPlanHost *hostP,
+                    int nparams, const char *usage);
+void FfiPlanFinalize(FfiPlan *planP);
+void FfiPlanFree(FfiPlan *planP);
+
+/* Calls the planned function with objc argument values */
+int FfiPlanInvoke(FfiPlan *planP, Tcl_Interp *interp,
+                  int objc, Tcl_Obj *const objv[]);
+
+/* Command procedures for plans created as Tcl commands. */
+Tcl_ObjCmdProc FfiPlanObjCmd;
+Tcl_CmdDeleteProc FfiPlanDeleteCmd;
+
+#endif /* FFIPLAN_H */
@@ -0,0 +1,881 @@
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * FFI callbacks. See ffithunk.h.
+ *
+ * Build with -DFFITHUNK_TEST to get a standalone test and benchmark
+ * that passes thunks to C library functions (see end of file).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "ffithunk.h"
+
+/*
+ * Pool of DCCallback objects. dcbNewCallback allocates executable memory
+ * for every callback which costs a page (or more) and a system call, so
+ * released callbacks are kept and reinitialized with dcbInitCallback.
+ * Shared by all threads.
+ */
+#define FFITHUNK_POOL_MAX 64
+TCL_DECLARE_MUTEX(ffiThunkPoolMutex)
+static DCCallback *ffiThunkPool[FFITHUNK_POOL_MAX];
+static int ffiThunkPoolCount;
+
+static char FfiThunkHandler(DCCallback *dcbP, DCArgs *args,
+                            DCValue *result, void *userdata);
+
+#ifdef FFITHUNK_TEST
+static void *ShimCallbackAddress(DCCallback *dcbP); /* See test driver */
+#define FFITHUNK_FNPTR(dcbP_) ShimCallbackAddress(dcbP_)
+#else
+/* A DCCallback starts with the thunk code so it is the function pointer */
+#define FFITHUNK_FNPTR(dcbP_) ((void *) (dcbP_))
+#endif
+
+static DCCallback *FfiThunkPoolGet(const char *signature, void *userdata)
+{
+    DCCallback *dcbP = NULL;
+
+    Tcl_MutexLock(&ffiThunkPoolMutex);
+    if (ffiThunkPoolCount > 0)
+        dcbP = ffiThunkPool[--ffiThunkPoolCount];
+    Tcl_MutexUnlock(&ffiThunkPoolMutex);
+
+    if (dcbP) {
+        dcbInitCallback(dcbP, signature, FfiThunkHandler, userdata);
+        return dcbP;
+    }
+    return dcbNewCallback(signature, FfiThunkHandler, userdata);
+}
+
+static void FfiThunkPoolPut(DCCallback *dcbP)
+{
+    Tcl_MutexLock(&ffiThunkPoolMutex);
+    if (ffiThunkPoolCount < FFITHUNK_POOL_MAX) {
+        ffiThunkPool[ffiThunkPoolCount++] = dcbP;
+        dcbP = NULL;
+    }
+    Tcl_MutexUnlock(&ffiThunkPoolMutex);
+    if (dcbP)
+        dcbFreeCallback(dcbP);
+}
+
+void FfiThunkPoolFinalize(void)
+{
+    Tcl_MutexLock(&ffiThunkPoolMutex);
+    while (ffiThunkPoolCount > 0)
+        dcbFreeCallback(ffiThunkPool[--ffiThunkPoolCount]);
+    Tcl_MutexUnlock(&ffiThunkPoolMutex);
+}
+
+FfiThunk *FfiThunkNew(Tcl_Interp *interp, Tcl_Obj *scriptObj,
+                      const FfiThunkHost *hostP, int nparams, int stdcall)
+{
+    FfiThunk *thunkP;
+    size_t sz;
+
+    sz = sizeof(*thunkP);
+    if (nparams > 1)
+        sz += (nparams - 1) * sizeof(thunkP->params[0]);
+    thunkP = (FfiThunk *) ckalloc(sz);
+    memset(thunkP, 0, sz);
+    thunkP->interp = interp;
+    thunkP->owner = Tcl_GetCurrentThread();
+    /* Private copy so the list rep cannot be shimmered away */
+    thunkP->scriptObj = Tcl_DuplicateObj(scriptObj);
+    Tcl_IncrRefCount(thunkP->scriptObj);
+    thunkP->hostP = hostP;
+    thunkP->nrefs = 1;
+    thunkP->stdcall = stdcall;
+    thunkP->nparams = nparams;
+    return thunkP;
+}
+
+/* dyncallback signature characters indexed by FfiPlanOp */
+static const char ffiThunkSigChars[] = {
+    'v',                        /* FFIPLAN_VOID */
+    'B',                        /* FFIPLAN_BOOL */
+    'c', 'C', 's', 'S', 'i', 'I', 'l', 'L',
+    'f', 'd',
+    'Z',                        /* FFIPLAN_STRING */
+    'p',                        /* FFIPLAN_HOSTPTR */
+};
+
+int FfiThunkFinalize(Tcl_Interp *interp, FfiThunk *thunkP)
+{
+    char *sigP;
+    int i, nelems;
+    Tcl_Obj **elems;
+
+    if (thunkP->nparams > FFITHUNK_MAX_PARAMS) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Callbacks are limited to %d parameters.", FFITHUNK_MAX_PARAMS));
+        return TCL_ERROR;
+    }
+    if (Tcl_ListObjGetElements(interp, thunkP->scriptObj, &nelems, &elems) != TCL_OK)
+        return TCL_ERROR;
+    if (nelems == 0) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Callback script must not be empty.", -1));
+        return TCL_ERROR;
+    }
+
+    sigP = thunkP->signature;
+    if (thunkP->stdcall) {
+        *sigP++ = '_';
+        *sigP++ = 's';
+    }
+    for (i = 0; i < thunkP->nparams; ++i) {
+        if (thunkP->params[i].op == FFIPLAN_VOID) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Callback parameters cannot be void.", -1));
+            return TCL_ERROR;
+        }
+        *sigP++ = ffiThunkSigChars[thunkP->params[i].op];
+    }
+    *sigP++ = ')';
+    /* Returned strings would not outlive the script result */
+    if (thunkP->ret.op == FFIPLAN_STRING) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Callbacks cannot return strings.", -1));
+        return TCL_ERROR;
+    }
+    *sigP++ = ffiThunkSigChars[thunkP->ret.op];
+    *sigP = '\0';
+
+    thunkP->dcbP = FfiThunkPoolGet(thunkP->signature, thunkP);
+    if (thunkP->dcbP == NULL) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Could not allocate callback.", -1));
+        return TCL_ERROR;
+    }
+    thunkP->fnptr = FFITHUNK_FNPTR(thunkP->dcbP);
+    return TCL_OK;
+}
+
+static void FfiThunkRelease(FfiThunk *thunkP)
+{
+    if (--thunkP->nrefs > 0)
+        return;
+    if (thunkP->dcbP)
+        FfiThunkPoolPut(thunkP->dcbP);
+    if (thunkP->hostP && thunkP->hostP->cleanup)
+        thunkP->hostP->cleanup(thunkP);
+    Tcl_DecrRefCount(thunkP->scriptObj);
+    ckfree((char *) thunkP);
+}
+
+void FfiThunkDelete(FfiThunk *thunkP)
+{
+    if (thunkP->deleted)
+        return;
+    thunkP->deleted = 1;
+    FfiThunkRelease(thunkP);
+}
+
+static Tcl_Obj *FfiThunkArgObj(const FfiPlanParam *paramP, FfiThunkValue *valP)
+{
+    switch (paramP->op) {
+    case FFIPLAN_BOOL:
+        return Tcl_NewBooleanObj(valP->w != 0);
+    case FFIPLAN_I8: case FFIPLAN_U8: case FFIPLAN_I16:
+    case FFIPLAN_U16: case FFIPLAN_I32:
+        return Tcl_NewIntObj((int) valP->w);
+    case FFIPLAN_U32: case FFIPLAN_I64: case FFIPLAN_U64:
+        return Tcl_NewWideIntObj(valP->w);
+    case FFIPLAN_FLOAT: case FFIPLAN_DOUBLE:
+        return Tcl_NewDoubleObj(valP->d);
+    case FFIPLAN_STRING:
+        return Tcl_NewStringObj(valP->pv ? (char *) valP->pv : "", -1);
+    case FFIPLAN_HOSTPTR:
+        return paramP->from_ptr(valP->pv, paramP->data);
+    default:
+        return Tcl_NewObj();
+    }
+}
+
+static int FfiThunkResult(Tcl_Interp *interp, const FfiPlanParam *paramP,
+                          Tcl_Obj *objP, FfiThunkValue *valP)
+{
+    int i;
+
+    switch (paramP->op) {
+    case FFIPLAN_VOID:
+        return TCL_OK;
+    case FFIPLAN_BOOL:
+        if (Tcl_GetBooleanFromObj(interp, objP, &i) != TCL_OK)
+            return TCL_ERROR;
+        valP->w = i;
+        return TCL_OK;
+    case FFIPLAN_FLOAT: case FFIPLAN_DOUBLE:
+        return Tcl_GetDoubleFromObj(interp, objP, &valP->d);
+    case FFIPLAN_HOSTPTR:
+        return paramP->to_ptr(interp, objP, paramP->data, &valP->pv);
+    default:
+        /* Integers are truncated to the return type as in C */
+        return Tcl_GetWideIntFromObj(interp, objP, &valP->w);
+    }
+}
+
+void FfiThunkExecute(FfiThunkCall *callP)
+{
+    FfiThunk *thunkP = callP->thunkP;
+    Tcl_Interp *interp = thunkP->interp;
+    Tcl_Obj *stackObjs[FFITHUNK_MAX_PARAMS + 8];
+    Tcl_Obj **objv, **prefix;
+    int i, nprefix, objc, code;
+
+    callP->status = TCL_ERROR;
+    if (thunkP->deleted || interp == NULL || Tcl_InterpDeleted(interp))
+        return;
+
+    /* Script is private and never shimmers so ignore error checks */
+    Tcl_ListObjGetElements(NULL, thunkP->scriptObj, &nprefix, &prefix);
+    objc = nprefix + thunkP->nparams;
+    if (objc <= (int) (sizeof(stackObjs)/sizeof(stackObjs[0])))
+        objv = stackObjs;
+    else
+        objv = (Tcl_Obj **) ckalloc(objc * sizeof(*objv));
+    for (i = 0; i < nprefix; ++i) {
+        objv[i] = prefix[i];
+        Tcl_IncrRefCount(objv[i]);
+    }
+    for (i = 0; i < thunkP->nparams; ++i) {
+        objv[nprefix + i] = FfiThunkArgObj(&thunkP->params[i], &callP->args[i]);
+        Tcl_IncrRefCount(objv[nprefix + i]);
+    }
+
+    /* In case the script deletes the thunk or the interp */
+    thunkP->nrefs += 1;
+    Tcl_Preserve(interp);
+    code = Tcl_EvalObjv(interp, objc, objv, TCL_EVAL_GLOBAL);
+    if (code == TCL_OK)
+        code = FfiThunkResult(interp, &thunkP->ret, Tcl_GetObjResult(interp),
+                              &callP->result);
+    if (code == TCL_OK)
+        callP->status = TCL_OK;
+    else
+        Tcl_BackgroundError(interp);
+    Tcl_Release(interp);
+    FfiThunkRelease(thunkP);
+
+    for (i = 0; i < objc; ++i)
+        Tcl_DecrRefCount(objv[i]);
+    if (objv != stackObjs)
+        ckfree((char *) objv);
+}
+
+static char FfiThunkHandler(DCCallback *dcbP, DCArgs *args,
+                            DCValue *result, void *userdata)
+{
+    FfiThunk *thunkP = (FfiThunk *) userdata;
+    union {
+        FfiThunkCall call;
+        char buf[FFITHUNK_CALL_SIZE(FFITHUNK_MAX_PARAMS)];
+    } u;
+    FfiThunkCall *callP = &u.call;
+    FfiThunkValue *valP;
+    int i;
+
+    (void) dcbP;
+    for (i = 0, valP = callP->args; i < thunkP->nparams; ++i, ++valP) {
+        switch (thunkP->params[i].op) {
+        case FFIPLAN_BOOL: valP->w = dcbArgBool(args); break;
+        case FFIPLAN_I8: valP->w = dcbArgChar(args); break;
+        case FFIPLAN_U8: valP->w = dcbArgUChar(args); break;
+        case FFIPLAN_I16: valP->w = dcbArgShort(args); break;
+        case FFIPLAN_U16: valP->w = dcbArgUShort(args); break;
+        case FFIPLAN_I32: valP->w = dcbArgInt(args); break;
+        case FFIPLAN_U32: valP->w = dcbArgUInt(args); break;
+        case FFIPLAN_I64: valP->w = dcbArgLongLong(args); break;
+        case FFIPLAN_U64: valP->w = (Tcl_WideInt) dcbArgULongLong(args); break;
+        case FFIPLAN_FLOAT: valP->d = dcbArgFloat(args); break;
+        case FFIPLAN_DOUBLE: valP->d = dcbArgDouble(args); break;
+        default: valP->pv = dcbArgPointer(args); break;
+        }
+    }
+    callP->thunkP = thunkP;
+    callP->status = TCL_ERROR;
+    callP->result.w = 0;
+
+    if (Tcl_GetCurrentThread() == thunkP->owner)
+        FfiThunkExecute(callP);
+    else
+        thunkP->hostP->dispatch(callP);
+
+    if (callP->status != TCL_OK)
+        memset(&callP->result, 0, sizeof(callP->result));
+
+    switch (thunkP->ret.op) {
+    case FFIPLAN_VOID: break;
+    case FFIPLAN_BOOL: result->B = callP->result.w != 0; break;
+    case FFIPLAN_I8: result->c = (DCchar) callP->result.w; break;
+    case FFIPLAN_U8: result->C = (DCuchar) callP->result.w; break;
+    case FFIPLAN_I16: result->s = (DCshort) callP->result.w; break;
+    case FFIPLAN_U16: result->S = (DCushort) callP->result.w; break;
+    case FFIPLAN_I32: result->i = (DCint) callP->result.w; break;
+    case FFIPLAN_U32: result->I = (DCuint) callP->result.w; break;
+    case FFIPLAN_I64: result->l = callP->result.w; break;
+    case FFIPLAN_U64: result->L = (DCulonglong) callP->result.w; break;
+    case FFIPLAN_FLOAT: result->f = (DCfloat) callP->result.d; break;
+    case FFIPLAN_DOUBLE: result->d = callP->result.d; break;
+    default: result->p = callP->result.pv; break;
+    }
+    return ffiThunkSigChars[thunkP->ret.op];
+}
+
+#ifdef FFITHUNK_TEST
+/*
+ * Standalone test and benchmark. Build on Linux x86-64 with
+ *
+ *   cc -O2 -DFFITHUNK_TEST -I../dyncall/dyncall-0.9/include \
+ *      -I<tcl>/include ffithunk.c -L<tcl>/lib -ltcl8.6 -ldl -lpthread
+ *
+ * Tcl must be built with threads. dyncall is only shipped in this tree
+ * as Windows libraries so the driver carries a minimal dyncallback for
+ * the SysV x86-64 convention. Instead of generating code, callbacks are
+ * bound to a fixed set of trampolines that receive all argument
+ * registers and return a struct so both RAX and XMM0 are set.
+ */
+
+#include <stdio.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
+
+#if !defined(__x86_64__) || defined(_WIN32)
+#error The FFITHUNK_TEST driver only supports SysV x86-64.
+#endif
+
+struct DCArgs {
+    int nints, nfps;
+    DClonglong ints[6];
+    double fps[8];
+};
+
+#define SHIM_NCALLBACKS 16
+struct DCCallback {
+    void *trampoline;           /* Function pointer for the callback */
+    int in_use;
+    DCCallbackHandler *handler;
+    void *userdata;
+};
+static DCCallback shimCallbacks[SHIM_NCALLBACKS];
+static int shimNewCallbacks;
+
+typedef struct ShimRet { DClonglong i; double d; } ShimRet;
+
+static ShimRet ShimDispatch(int slot, DClonglong *ints, double *fps)
+{
+    DCCallback *cbP = &shimCallbacks[slot];
+    DCArgs args;
+    DCValue result;
+    ShimRet r = {0, 0};
+
+    args.nints = args.nfps = 0;
+    memcpy(args.ints, ints, sizeof(args.ints));
+    memcpy(args.fps, fps, sizeof(args.fps));
+    memset(&result, 0, sizeof(result));
+    switch (cbP->handler(cbP, &args, &result, cbP->userdata)) {
+    case 'B': r.i = result.B; break;
+    case 'c': r.i = result.c; break;
+    case 'C': r.i = result.C; break;
+    case 's': r.i = result.s; break;
+    case 'S': r.i = result.S; break;
+    case 'i': r.i = result.i; break;
+    case 'I': r.i = result.I; break;
+    case 'l': r.i = result.l; break;
+    case 'L': r.i = (DClonglong) result.L; break;
+    case 'p': r.i = (DClonglong) result.p; break;
+    case 'f': memcpy(&r.d, &result.f, sizeof(result.f)); break;
+    case 'd': r.d = result.d; break;
+    }
+    return r;
+}
+
+#define SHIM_TRAMPOLINE(n_)                                             \
+    static ShimRet ShimTrampoline##n_(DClonglong a0, DClonglong a1, DClonglong a2, \
+                                      DClonglong a3, DClonglong a4, DClonglong a5, \
+                                      double d0, double d1, double d2, double d3, \
+                                      double d4, double d5, double d6, double d7) { \
+        DClonglong ints[6] = {a0, a1, a2, a3, a4, a5};                  \
+        double fps[8] = {d0, d1, d2, d3, d4, d5, d6, d7};               \
+        return ShimDispatch(n_, ints, fps);                             \
+    }
+SHIM_TRAMPOLINE(0) SHIM_TRAMPOLINE(1) SHIM_TRAMPOLINE(2) SHIM_TRAMPOLINE(3)
+SHIM_TRAMPOLINE(4) SHIM_TRAMPOLINE(5) SHIM_TRAMPOLINE(6) SHIM_TRAMPOLINE(7)
+SHIM_TRAMPOLINE(8) SHIM_TRAMPOLINE(9) SHIM_TRAMPOLINE(10) SHIM_TRAMPOLINE(11)
+SHIM_TRAMPOLINE(12) SHIM_TRAMPOLINE(13) SHIM_TRAMPOLINE(14) SHIM_TRAMPOLINE(15)
+static void *shimTrampolines[SHIM_NCALLBACKS] = {
+    (void *) ShimTrampoline0, (void *) ShimTrampoline1, (void *) ShimTrampoline2,
+    (void *) ShimTrampoline3, (void *) ShimTrampoline4, (void *) ShimTrampoline5,
+    (void *) ShimTrampoline6, (void *) ShimTrampoline7, (void *) ShimTrampoline8,
+    (void *) ShimTrampoline9, (void *) ShimTrampoline10, (void *) ShimTrampoline11,
+    (void *) ShimTrampoline12, (void *) ShimTrampoline13, (void *) ShimTrampoline14,
+    (void *) ShimTrampoline15,
+};
+
+void dcbInitCallback(DCCallback *pcb, const char *signature,
+                     DCCallbackHandler *handler, void *userdata)
+{
+    (void) signature;
+    pcb->handler = handler;
+    pcb->userdata = userdata;
+}
+
+DCCallback *dcbNewCallback(const char *signature, DCCallbackHandler *handler,
+                           void *userdata)
+{
+    int i;
+    for (i = 0; i < SHIM_NCALLBACKS; ++i) {
+        if (! shimCallbacks[i].in_use) {
+            shimCallbacks[i].in_use = 1;
+            shimCallbacks[i].trampoline = shimTrampolines[i];
+            dcbInitCallback(&shimCallbacks[i], signature, handler, userdata);
+            shimNewCallbacks++;
+            return &shimCallbacks[i];
+        }
+    }
+    return NULL;
+}
+
+void dcbFreeCallback(DCCallback *pcb) { pcb->in_use = 0; }
+
+static void *ShimCallbackAddress(DCCallback *dcbP) { return dcbP->trampoline; }
+
+static DClonglong ShimInt(DCArgs *p) { return p->ints[p->nints++]; }
+DCbool dcbArgBool(DCArgs *p) { return (DCint) ShimInt(p) != 0; }
+DCchar dcbArgChar(DCArgs *p) { return (DCchar) ShimInt(p); }
+DCshort dcbArgShort(DCArgs *p) { return (DCshort) ShimInt(p); }
+DCint dcbArgInt(DCArgs *p) { return (DCint) ShimInt(p); }
+DClonglong dcbArgLongLong(DCArgs *p) { return ShimInt(p); }
+DCuchar dcbArgUChar(DCArgs *p) { return (DCuchar) ShimInt(p); }
+DCushort dcbArgUShort(DCArgs *p) { return (DCushort) ShimInt(p); }
+DCuint dcbArgUInt(DCArgs *p) { return (DCuint) ShimInt(p); }
+DCulonglong dcbArgULongLong(DCArgs *p) { return (DCulonglong) ShimInt(p); }
+DCpointer dcbArgPointer(DCArgs *p) { return (DCpointer) ShimInt(p); }
+DCdouble dcbArgDouble(DCArgs *p) { return p->fps[p->nfps++]; }
+DCfloat dcbArgFloat(DCArgs *p) {
+    float f;
+    memcpy(&f, &p->fps[p->nfps++], sizeof(f));
+    return f;
+}
+
+/*
+ * Test host. Calls from other threads are queued to the owning thread
+ * with Tcl_ThreadQueueEvent, which is what TwapiEnqueueCallback does
+ * on Windows, and the calling thread waits on a condition variable.
+ * Plain pthread objects are used as Tcl's lazily allocated sync objects
+ * are not meant to live on the stack.
+ */
+typedef struct TestWait {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int done;
+} TestWait;
+
+typedef struct TestEvent {
+    Tcl_Event header;
+    FfiThunkCall *callP;
+    TestWait *waitP;
+} TestEvent;
+
+static int testDispatches;
+
+static int TestEventProc(Tcl_Event *evP, int flags)
+{
+    TestEvent *tevP = (TestEvent *) evP;
+    (void) flags;
+    /* The calling thread is blocked so callP is safe to use in place */
+    FfiThunkExecute(tevP->callP);
+    pthread_mutex_lock(&tevP->waitP->mutex);
+    tevP->waitP->done = 1;
+    pthread_cond_signal(&tevP->waitP->cond);
+    pthread_mutex_unlock(&tevP->waitP->mutex);
+    return 1;
+}
+
+static void TestDispatch(FfiThunkCall *callP)
+{
+    TestWait wait;
+    TestEvent *evP = (TestEvent *) ckalloc(sizeof(*evP));
+
+    wait.done = 0;
+    pthread_mutex_init(&wait.mutex, NULL);
+    pthread_cond_init(&wait.cond, NULL);
+    evP->header.proc = TestEventProc;
+    evP->callP = callP;
+    evP->waitP = &wait;
+    pthread_mutex_lock(&wait.mutex);
+    __sync_fetch_and_add(&testDispatches, 1);
+    Tcl_ThreadQueueEvent(callP->thunkP->owner, &evP->header, TCL_QUEUE_TAIL);
+    Tcl_ThreadAlert(callP->thunkP->owner);
+    while (! wait.done)
+        pthread_cond_wait(&wait.cond, &wait.mutex);
+    pthread_mutex_unlock(&wait.mutex);
+    pthread_cond_destroy(&wait.cond);
+    pthread_mutex_destroy(&wait.mutex);
+}
+
+static int testCleanups;
+static void TestCleanup(FfiThunk *thunkP) { (void) thunkP; testCleanups++; }
+static const FfiThunkHost testHost = {TestDispatch, TestCleanup};
+
+static int TestToPtr(Tcl_Interp *interp, Tcl_Obj *objP, void *data, void **pvP)
+{
+    Tcl_WideInt w;
+    (void) data;
+    if (Tcl_GetWideIntFromObj(interp, objP, &w) != TCL_OK)
+        return TCL_ERROR;
+    *pvP = (void *) (size_t) w;
+    return TCL_OK;
+}
+
+static Tcl_Obj *TestFromPtr(void *pv, void *data)
+{
+    (void) data;
+    return Tcl_NewWideIntObj((Tcl_WideInt) (size_t) pv);
+}
+
+static const char *testTypes[] = {
+    "void", "bool", "i1", "ui1", "i2", "ui2", "i4", "ui4", "i8", "ui8",
+    "r4", "r8", "lpstr", "handle", NULL
+};
+
+static int TestSetOp(Tcl_Interp *interp, Tcl_Obj *typeObj, FfiPlanParam *paramP)
+{
+    int index;
+    if (Tcl_GetIndexFromObj(interp, typeObj, testTypes, "type", 0, &index) != TCL_OK)
+        return TCL_ERROR;
+    paramP->op = (FfiPlanOp) index; /* Same order, handle is HOSTPTR */
+    paramP->to_ptr = TestToPtr;
+    paramP->from_ptr = TestFromPtr;
+    return TCL_OK;
+}
+
+static Tcl_HashTable testThunks;
+
+/* thunk RETTYPE PARAMTYPES SCRIPT */
+static int TestThunkObjCmd(ClientData cd, Tcl_Interp *interp,
+                           int objc, Tcl_Obj *const objv[])
+{
+    FfiThunk *thunkP;
+    FfiPlanParam ret;
+    Tcl_Obj **types;
+    int i, ntypes, isnew;
+    (void) cd;
+
+    if (objc != 4) {
+        Tcl_WrongNumArgs(interp, 1, objv, "RETTYPE PARAMTYPES SCRIPT");
+        return TCL_ERROR;
+    }
+    /* Return type first as the two may be the same literal */
+    if (TestSetOp(interp, objv[1], &ret) != TCL_OK ||
+        Tcl_ListObjGetElements(interp, objv[2], &ntypes, &types) != TCL_OK)
+        return TCL_ERROR;
+    thunkP = FfiThunkNew(interp, objv[3], &testHost, ntypes, 0);
+    thunkP->ret = ret;
+    for (i = 0; i < ntypes; ++i) {
+        if (TestSetOp(interp, types[i], &thunkP->params[i]) != TCL_OK)
+            goto error_return;
+    }
+    if (FfiThunkFinalize(interp, thunkP) != TCL_OK)
+        goto error_return;
+    Tcl_SetHashValue(Tcl_CreateHashEntry(&testThunks, thunkP->fnptr, &isnew), thunkP);
+    Tcl_SetObjResult(interp, TestFromPtr(thunkP->fnptr, NULL));
+    return TCL_OK;
+
+error_return:
+    FfiThunkDelete(thunkP);
+    return TCL_ERROR;
+}
+
+static int TestGetFn(Tcl_Interp *interp, Tcl_Obj *objP, void **fnP)
+{
+    if (TestToPtr(interp, objP, NULL, fnP) != TCL_OK)
+        return TCL_ERROR;
+    if (Tcl_FindHashEntry(&testThunks, *fnP) == NULL) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Unknown thunk.", -1));
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/* thunkfree FNPTR */
+static int TestThunkFreeObjCmd(ClientData cd, Tcl_Interp *interp,
+                               int objc, Tcl_Obj *const objv[])
+{
+    void *fn;
+    Tcl_HashEntry *heP;
+    (void) cd;
+    if (objc != 2 || TestGetFn(interp, objv[1], &fn) != TCL_OK)
+        return TCL_ERROR;
+    heP = Tcl_FindHashEntry(&testThunks, fn);
+    FfiThunkDelete((FfiThunk *) Tcl_GetHashValue(heP));
+    Tcl_DeleteHashEntry(heP);
+    return TCL_OK;
+}
+
+/* callthunk KIND FNPTR ARGS... - calls fnptr from C */
+static int TestCallThunkObjCmd(ClientData cd, Tcl_Interp *interp,
+                               int objc, Tcl_Obj *const objv[])
+{
+    void *fn;
+    const char *kind;
+    int i1, i2;
+    double d1, d2;
+    (void) cd;
+
+    if (objc < 3 || TestGetFn(interp, objv[2], &fn) != TCL_OK)
+        return TCL_ERROR;
+    kind = Tcl_GetString(objv[1]);
+    if (!strcmp(kind, "int_int_int") && objc == 5 &&
+        Tcl_GetIntFromObj(interp, objv[3], &i1) == TCL_OK &&
+        Tcl_GetIntFromObj(interp, objv[4], &i2) == TCL_OK) {
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(((int (*)(int, int)) fn)(i1, i2)));
+    } else if (!strcmp(kind, "double_double_int") && objc == 5 &&
+               Tcl_GetDoubleFromObj(interp, objv[3], &d1) == TCL_OK &&
+               Tcl_GetIntFromObj(interp, objv[4], &i1) == TCL_OK) {
+        Tcl_SetObjResult(interp, Tcl_NewDoubleObj(((double (*)(double, int)) fn)(d1, i1)));
+    } else if (!strcmp(kind, "float_float_double") && objc == 5 &&
+               Tcl_GetDoubleFromObj(interp, objv[3], &d1) == TCL_OK &&
+               Tcl_GetDoubleFromObj(interp, objv[4], &d2) == TCL_OK) {
+        Tcl_SetObjResult(interp, Tcl_NewDoubleObj(((float (*)(float, double)) fn)((float) d1, d2)));
+    } else if (!strcmp(kind, "i8_str_ui1_i8") && objc == 6 &&
+               Tcl_GetIntFromObj(interp, objv[4], &i1) == TCL_OK) {
+        Tcl_WideInt w;
+        if (Tcl_GetWideIntFromObj(interp, objv[5], &w) != TCL_OK)
+            return TCL_ERROR;
+        Tcl_SetObjResult(interp, Tcl_NewWideIntObj(
+                             ((long long (*)(const char *, unsigned char, long long)) fn)(
+                                 Tcl_GetString(objv[3]), (unsigned char) i1, w)));
+    } else if (!strcmp(kind, "void_void") && objc == 3) {
+        ((void (*)(void)) fn)();
+    } else {
+        if (*Tcl_GetStringResult(interp) == '\0')
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("Bad callthunk arguments.", -1));
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+static int TestCompareInts(const void *a, const void *b)
+{
+    int x = *(const int *) a, y = *(const int *) b;
+    return x < y ? -1 : (x > y);
+}
+
+/*
+ * qsortints LIST FNPTR - sorts with libc qsort (found via dlsym).
+ * FNPTR may be "native" to use a C comparison function.
+ */
+static int TestQsortObjCmd(ClientData cd, Tcl_Interp *interp,
+                           int objc, Tcl_Obj *const objv[])
+{
+    void (*qsortfn)(void *, size_t, size_t, int (*)(const void *, const void *));
+    void *fn;
+    Tcl_Obj **elems, *resultObj;
+    int i, n, *ints;
+    (void) cd;
+
+    if (objc != 3 || Tcl_ListObjGetElements(interp, objv[1], &n, &elems) != TCL_OK)
+        return TCL_ERROR;
+    if (!strcmp(Tcl_GetString(objv[2]), "native"))
+        fn = NULL;
+    else if (TestGetFn(interp, objv[2], &fn) != TCL_OK)
+        return TCL_ERROR;
+    ints = (int *) ckalloc(n * sizeof(int) + 1);
+    for (i = 0; i < n; ++i) {
+        if (Tcl_GetIntFromObj(interp, elems[i], &ints[i]) != TCL_OK) {
+            ckfree((char *) ints);
+            return TCL_ERROR;
+        }
+    }
+    qsortfn = dlsym(RTLD_DEFAULT, "qsort");
+    if (fn == NULL) {
+        qsortfn(ints, n, sizeof(int), TestCompareInts);
+    } else {
+        qsortfn(ints, n, sizeof(int), (int (*)(const void *, const void *)) fn);
+    }
+    resultObj = Tcl_NewListObj(0, NULL);
+    for (i = 0; i < n; ++i)
+        Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(ints[i]));
+    ckfree((char *) ints);
+    Tcl_SetObjResult(interp, resultObj);
+    return TCL_OK;
+}
+
+/* peekint PTR */
+static int TestPeekIntObjCmd(ClientData cd, Tcl_Interp *interp,
+                             int objc, Tcl_Obj *const objv[])
+{
+    void *pv;
+    (void) cd;
+    if (objc != 2 || TestToPtr(interp, objv[1], NULL, &pv) != TCL_OK)
+        return TCL_ERROR;
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(*(int *) pv));
+    return TCL_OK;
+}
+
+static Tcl_ThreadId mainThread;
+
+typedef struct TestThread {
+    int (*fn)(int, int);
+    int n;
+    long long sum;
+    volatile int done;
+} TestThread;
+
+static int TestWakeEventProc(Tcl_Event *evP, int flags)
+{
+    (void) evP;
+    (void) flags;
+    return 1;
+}
+
+static void *TestThreadMain(void *arg)
+{
+    TestThread *ttP = (TestThread *) arg;
+    Tcl_Event *evP;
+    int i;
+    for (i = 0; i < ttP->n; ++i)
+        ttP->sum += ttP->fn(i, 1);
+    __sync_synchronize();
+    ttP->done = 1;
+    /* Tcl_DoOneEvent only returns after servicing an event */
+    evP = (Tcl_Event *) ckalloc(sizeof(*evP));
+    evP->proc = TestWakeEventProc;
+    Tcl_ThreadQueueEvent(mainThread, evP, TCL_QUEUE_TAIL);
+    Tcl_ThreadAlert(mainThread);
+    return NULL;
+}
+
+/* callinthread FNPTR N - calls the int(int,int) thunk N times in a thread */
+static int TestCallInThreadObjCmd(ClientData cd, Tcl_Interp *interp,
+                                  int objc, Tcl_Obj *const objv[])
+{
+    TestThread tt;
+    pthread_t tid;
+    void *fn;
+    (void) cd;
+
+    if (objc != 3 || TestGetFn(interp, objv[1], &fn) != TCL_OK ||
+        Tcl_GetIntFromObj(interp, objv[2], &tt.n) != TCL_OK)
+        return TCL_ERROR;
+    tt.fn = (int (*)(int, int)) fn;
+    tt.sum = 0;
+    tt.done = 0;
+    if (pthread_create(&tid, NULL, TestThreadMain, &tt) != 0) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("Could not create thread.", -1));
+        return TCL_ERROR;
+    }
+    /* Service the thunk calls queued by the thread */
+    while (! tt.done)
+        Tcl_DoOneEvent(TCL_ALL_EVENTS);
+    pthread_join(tid, NULL);
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(tt.sum));
+    return TCL_OK;
+}
+
+static const char *testScript =
+    "proc check {script expected} {\n"
+    "    set code [catch {uplevel 1 $script} result]\n"
+    "    if {$code} {set result [list error $result]}\n"
+    "    if {$result ne $expected} {\n"
+    "        puts \"FAIL: $script\\n  got:      $result\\n  expected: $expected\"\n"
+    "        incr ::failures\n"
+    "    }\n"
+    "    incr ::checks\n"
+    "}\n"
+    "proc bgerror {msg} {lappend ::bgerrors $msg}\n"
+    "set failures 0; set checks 0; set bgerrors {}\n"
+    "proc cmp {a b} {expr {[peekint $a] - [peekint $b]}}\n"
+    "set fcmp [thunk i4 {handle handle} cmp]\n"
+    "check {qsortints {5 3 9 1 7} $fcmp} {1 3 5 7 9}\n"
+    "check {qsortints {} $fcmp} {}\n"
+    /* Command prefix with extra words */
+    "set fadd [thunk i4 {i4 i4} {::tcl::mathop::+ 100}]\n"
+    "check {callthunk int_int_int $fadd 2 3} 105\n"
+    "check {callthunk int_int_int $fadd -2 -3} 95\n"
+    "set fd [thunk r8 {r8 i4} {apply {{d i} {expr {$d * $i}}}}]\n"
+    "check {callthunk double_double_int $fd 1.5 4} 6.0\n"
+    "set ff [thunk r4 {r4 r8} {apply {{f d} {expr {$f + $d}}}}]\n"
+    "check {callthunk float_float_double $ff 1.5 0.25} 1.75\n"
+    "set fs [thunk i8 {lpstr ui1 i8} {apply {{s c w} {expr {[string length $s] * 1000 + $c + $w}}}}]\n"
+    "check {callthunk i8_str_ui1_i8 $fs hello 255 10000000000} 10000005255\n"
+    /* Script errors are background errors and return 0 */
+    "set ferr [thunk i4 {i4 i4} {error oops}]\n"
+    "check {callthunk int_int_int $ferr 1 2} 0\n"
+    "update\n"
+    "check {set ::bgerrors} oops\n"
+    "set fbad [thunk i4 {i4 i4} {apply {{a b} {return notanint}}}]\n"
+    "check {callthunk int_int_int $fbad 1 2} 0\n"
+    "update\n"
+    "check {llength $::bgerrors} 2\n"
+    /* A thunk that deletes itself while running */
+    "set fself [thunk void {} {apply {{} {thunkfree $::fself; set ::selfran 1}}}]\n"
+    "set c $::testcleanups\n"
+    "check {callthunk void_void $fself; set ::selfran} 1\n"
+    "check {expr {$::testcleanups - $c}} 1\n"
+    "check {thunk i4 {void} cmp} {error {Callback parameters cannot be void.}}\n"
+    "check {thunk lpstr {} cmp} {error {Callbacks cannot return strings.}}\n"
+    "check {thunk i4 {} {}} {error {Callback script must not be empty.}}\n"
+    /* Calls from another thread are dispatched to this one */
+    "set ::tcalls 0\n"
+    "set ft [thunk i4 {i4 i4} {apply {{a b} {incr ::tcalls; expr {$a + $b}}}}]\n"
+    "check {callinthread $ft 100} 5050\n"
+    "check {set ::tcalls} 100\n"
+    "check {expr {$::testdispatches >= 100}} 1\n"
+    /* Pooling - the same DCCallback is reused */
+    "thunkfree [thunk i4 {i4 i4} cmp]\n"
+    "set n $::shimnew\n"
+    "for {set i 0} {$i < 1000} {incr i} {thunkfree [thunk i4 {i4 i4} cmp]}\n"
+    "check {expr {$::shimnew - $n}} 0\n"
+    "puts \"$checks checks, $failures failures\"\n"
+    "proc bench {label script n {per 1}} {\n"
+    "    set t [lindex [uplevel 1 [list time $script $n]] 0]\n"
+    "    puts [format {%-40s %8.1f ns/call} $label [expr {$t * 1000.0 / $per}]]\n"
+    "}\n"
+    "set l {}\n"
+    "for {set i 0} {$i < 2000} {incr i} {lappend l [expr {($i * 7919) % 2003}]}\n"
+    "set ncmp 0\n"
+    "proc cmpcount {a b} {incr ::ncmp; expr {[peekint $a] - [peekint $b]}}\n"
+    "set fcount [thunk i4 {handle handle} cmpcount]\n"
+    "qsortints $l $fcount\n"
+    "bench {qsort, C comparator (per compare)} {qsortints $l native} 20 $ncmp\n"
+    "bench {qsort, thunk comparator (per compare)} {qsortints $l $fcmp} 20 $ncmp\n"
+    "bench {direct thunk call i4(i4,i4)} {callthunk int_int_int $fadd 2 3} 200000\n"
+    "bench {foreign thread thunk call i4(i4,i4)} {callinthread $ft 10000} 5 10000\n"
+    "bench {thunk create and free (pooled)} {thunkfree [thunk i4 {i4 i4} cmp]} 100000\n"
+    "set failures\n";
+
+int main(int argc, char **argv)
+{
+    Tcl_Interp *interp;
+    int failures;
+
+    (void) argc;
+    Tcl_FindExecutable(argv[0]);
+    interp = Tcl_CreateInterp();
+    mainThread = Tcl_GetCurrentThread();
+    Tcl_InitHashTable(&testThunks, TCL_ONE_WORD_KEYS);
+    Tcl_CreateObjCommand(interp, "thunk", TestThunkObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "thunkfree", TestThunkFreeObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "callthunk", TestCallThunkObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "qsortints", TestQsortObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "peekint", TestPeekIntObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "callinthread", TestCallInThreadObjCmd, NULL, NULL);
+    Tcl_LinkVar(interp, "testcleanups", (char *) &testCleanups, TCL_LINK_INT | TCL_LINK_READ_ONLY);
+    Tcl_LinkVar(interp, "testdispatches", (char *) &testDispatches, TCL_LINK_INT | TCL_LINK_READ_ONLY);
+    Tcl_LinkVar(interp, "shimnew", (char *) &shimNewCallbacks, TCL_LINK_INT | TCL_LINK_READ_ONLY);
+
+    if (Tcl_Eval(interp, testScript) != TCL_OK) {
+        fprintf(stderr, "%s\n", Tcl_GetStringResult(interp));
+        return 1;
+    }
+    failures = atoi(Tcl_GetStringResult(interp));
+    Tcl_DeleteInterp(interp);
+    FfiThunkPoolFinalize();
+    return failures != 0;
+}
+
+#endif /* FFITHUNK_TEST */
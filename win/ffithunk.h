@@ -0,0 +1,131 @@
+#ifndef FFITHUNK_H
+#define FFITHUNK_H
+
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * FFI callbacks. A thunk is a C function pointer, created with dyncall's
+ * dyncallback module, that invokes a Tcl script in the interpreter that
+ * created it. Calls made in the thread owning the interpreter evaluate
+ * the script directly. Calls from other threads are handed over to the
+ * owning thread through a host supplied dispatcher and the calling
+ * thread waits for the result. The DCCallback objects, which each need
+ * executable memory, are pooled across thunks.
+ *
+ * Parameter and return value marshalling uses the same operations as
+ * call plans (ffiplan.h) with the direction reversed - from_ptr converts
+ * pointer arguments and to_ptr pointer return values.
+ */
+
+#include "ffiplan.h"
+
+#ifdef HAVE_DYNCALL_CALLBACK_H
+#include "dyncall_callback.h"
+#else
+/*
+ * dyncall/ only ships the prebuilt dyncallback library and not its
+ * headers so declare the parts of the dyncallback API used here.
+ */
+typedef struct DCCallback DCCallback;
+typedef struct DCArgs DCArgs;
+typedef union DCValue_ {
+    DCbool B; DCchar c; DCuchar C; DCshort s; DCushort S;
+    DCint i; DCuint I; DClong j; DCulong J; DClonglong l; DCulonglong L;
+    DCfloat f; DCdouble d; DCpointer p; DCstring Z;
+} DCValue;
+typedef char (DCCallbackHandler)(DCCallback *pcb, DCArgs *args,
+                                 DCValue *result, void *userdata);
+DC_API DCCallback *dcbNewCallback(const char *signature,
+                                  DCCallbackHandler *funcptr, void *userdata);
+DC_API void dcbInitCallback(DCCallback *pcb, const char *signature,
+                            DCCallbackHandler *handler, void *userdata);
+DC_API void dcbFreeCallback(DCCallback *pcb);
+DC_API DCbool dcbArgBool(DCArgs *);
+DC_API DCchar dcbArgChar(DCArgs *);
+DC_API DCshort dcbArgShort(DCArgs *);
+DC_API DCint dcbArgInt(DCArgs *);
+DC_API DClonglong dcbArgLongLong(DCArgs *);
+DC_API DCuchar dcbArgUChar(DCArgs *);
+DC_API DCushort dcbArgUShort(DCArgs *);
+DC_API DCuint dcbArgUInt(DCArgs *);
+DC_API DCulonglong dcbArgULongLong(DCArgs *);
+DC_API DCfloat dcbArgFloat(DCArgs *);
+DC_API DCdouble dcbArgDouble(DCArgs *);
+DC_API DCpointer dcbArgPointer(DCArgs *);
+#endif
+
+#define FFITHUNK_MAX_PARAMS 32
+
+/* Raw argument and return values passed between threads */
+typedef union FfiThunkValue {
+    Tcl_WideInt w;
+    double d;
+    void *pv;
+} FfiThunkValue;
+
+struct FfiThunk;
+
+/*
+ * One invocation of a thunk. For calls from other threads the dispatcher
+ * may copy it, FFITHUNK_CALL_SIZE bytes, into its own storage.
+ */
+typedef struct FfiThunkCall {
+    struct FfiThunk *thunkP;
+    int status;                 /* TCL_OK if result is valid */
+    FfiThunkValue result;
+    FfiThunkValue args[1];      /* thunkP->nparams entries */
+} FfiThunkCall;
+#define FFITHUNK_CALL_SIZE(nparams_) \
+    (sizeof(FfiThunkCall) + ((nparams_) > 1 ? (nparams_) - 1 : 0) * sizeof(FfiThunkValue))
+
+typedef struct FfiThunkHost {
+    /*
+     * Called in a thread other than the owner. Must arrange for
+     * FfiThunkExecute to be called on (a copy of) callP in the owning
+     * thread and copy back status and result once it completes.
+     */
+    void (*dispatch)(FfiThunkCall *callP);
+    /* Called when a thunk is freed to release FfiPlanParam.data etc. */
+    void (*cleanup)(struct FfiThunk *thunkP);
+} FfiThunkHost;
+
+typedef struct FfiThunk {
+    void *fnptr;                /* Function pointer to pass to C code */
+    DCCallback *dcbP;
+    Tcl_Interp *interp;
+    Tcl_ThreadId owner;         /* Thread that created the thunk */
+    Tcl_Obj *scriptObj;         /* Command prefix, private copy */
+    const FfiThunkHost *hostP;
+    void *hostdata;             /* For use by the host */
+    int nrefs;                  /* Only accessed in owner thread */
+    int deleted;
+    int stdcall;
+    char signature[FFITHUNK_MAX_PARAMS + 4];
+    int nparams;
+    FfiPlanParam ret;
+    FfiPlanParam params[1];     /* Actually nparams entries */
+} FfiThunk;
+
+/*
+ * Allocates a thunk. The caller fills in ret and params[] and then
+ * calls FfiThunkFinalize which makes fnptr callable. On error the
+ * thunk must be released with FfiThunkDelete.
+ */
+FfiThunk *FfiThunkNew(Tcl_Interp *interp, Tcl_Obj *scriptObj,
+                      const FfiThunkHost *hostP, int nparams, int stdcall);
+int FfiThunkFinalize(Tcl_Interp *interp, FfiThunk *thunkP);
+/*
+ * Deletes the thunk. The function pointer must not be called after this.
+ * If the thunk script is active, the memory is released when it returns.
+ */
+void FfiThunkDelete(FfiThunk *thunkP);
+/* Runs the script for a call. Must be called in the owning thread. */
+void FfiThunkExecute(FfiThunkCall *callP);
+
+/* Releases DCCallback objects cached in the pool */
+void FfiThunkPoolFinalize(void);
+
+#endif /* FFITHUNK_H */
@@ -0,0 +1,1738 @@
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Parallel file tree scanner. See ftscan.h. The scheduler and the POSIX
+ * backend only depend on Tcl and libc. The Windows backend and the Tcl
+ * commands are in the _WIN32 section at the end.
+ */
+
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE             /* fstatat, st_mtim, getdents64 */
+#endif
+
+#include <string.h>
+#include "ftscan.h"
+
+#define FTS_READ_MAX 256        /* Entries per backend read call */
+
+/* A directory waiting to be scanned */
+typedef struct FtsDir {
+    char *path;                 /* Full path, ckalloc'ed with the struct */
+    int pathlen;
+    int rel;                    /* Offset of the path relative to the root */
+    int depth;                  /* Depth of its entries */
+} FtsDir;
+
+/*
+ * Per thread queue of directories. The owning thread pushes and pops at
+ * the tail so it works depth first, which keeps queues short. Other
+ * threads steal from the head, which holds the directories closest to
+ * the root and so likely the largest subtrees.
+ */
+typedef struct FtsQueue {
+    Tcl_Mutex lock;
+    FtsDir **items;             /* Ring buffer */
+    int head;
+    int count;
+    int size;
+} FtsQueue;
+
+/* A distinct security descriptor */
+typedef struct FtsSd {
+    Tcl_WideUInt hash;
+    int len;
+    int next;                   /* Next index in hash chain, -1 at end */
+    unsigned char data[1];      /* Variable size */
+} FtsSd;
+
+typedef struct FtsWorker {
+    struct FtsScan *scanP;
+    int index;
+    FtsBatch *batchP;
+    FtsEntry entries[FTS_READ_MAX];
+    FtsDir *subdirs[FTS_READ_MAX];
+    FtsBuf sd;                  /* Security of current entry */
+    FtsBuf last_sd;             /* Last distinct descriptor seen */
+    int last_sd_index;
+    FtsStats counts;            /* Since last merged into scan stats */
+} FtsWorker;
+
+struct FtsScan {
+    FtsConfig cfg;
+    char *root;
+    int rootlen;
+    int relstart;               /* Offset of relative paths in full paths */
+    int status;                 /* Error opening the root */
+    volatile int cancelled;
+    FtsQueue *queues;           /* One per thread */
+
+    Tcl_Mutex lock;             /* Protects the fields below */
+    Tcl_Condition cond;         /* Signaled when work is queued or done */
+    int pending;                /* Directories queued or being scanned */
+    int nidle;
+    unsigned int generation;    /* Incremented when work is queued */
+    FtsStats stats;
+
+    Tcl_Mutex sd_lock;          /* Protects the descriptor table */
+    FtsSd **sds;
+    int nsds;
+    int sds_size;
+    int *buckets;
+    int nbuckets;               /* Power of 2 */
+};
+
+void FtsBufReserve(FtsBuf *bufP, int size)
+{
+    if (size > bufP->size) {
+        bufP->size = size < 256 ? 256 : size;
+        bufP->p = (unsigned char *) ckrealloc((char *) bufP->p, bufP->size);
+    }
+}
+
+static void FtsBufFree(FtsBuf *bufP)
+{
+    if (bufP->p)
+        ckfree((char *) bufP->p);
+    bufP->p = NULL;
+    bufP->len = bufP->size = 0;
+}
+
+void FtsBatchFree(FtsBatch *batchP)
+{
+    ckfree((char *) batchP->records);
+    ckfree(batchP->strings);
+    ckfree((char *) batchP);
+}
+
+static FtsBatch *FtsBatchNew(int size)
+{
+    FtsBatch *batchP = (FtsBatch *) ckalloc(sizeof(*batchP));
+    batchP->next = NULL;
+    batchP->n = 0;
+    batchP->size = size;
+    batchP->records = (FtsRecord *) ckalloc(size * sizeof(FtsRecord));
+    batchP->strings_size = 64 * size;
+    batchP->strings = ckalloc(batchP->strings_size);
+    batchP->strings_len = 0;
+    return batchP;
+}
+
+/* Appends len chars and a nul to the batch strings, returning the offset */
+static int FtsBatchString(FtsBatch *batchP, const char *s, int len)
+{
+    int off = batchP->strings_len;
+    if (off + len + 1 > batchP->strings_size) {
+        batchP->strings_size = 2 * (off + len + 1);
+        batchP->strings = ckrealloc(batchP->strings, batchP->strings_size);
+    }
+    memcpy(batchP->strings + off, s, len);
+    batchP->strings[off + len] = '\0';
+    batchP->strings_len += len + 1;
+    return off;
+}
+
+/*
+ * Queues
+ */
+
+static void FtsQueuePush(FtsQueue *qP, FtsDir **dirs, int n)
+{
+    int i;
+    Tcl_MutexLock(&qP->lock);
+    if (qP->count + n > qP->size) {
+        int size = 2 * (qP->count + n) + 16;
+        FtsDir **items = (FtsDir **) ckalloc(size * sizeof(FtsDir *));
+        for (i = 0; i < qP->count; ++i)
+            items[i] = qP->items[(qP->head + i) % qP->size];
+        if (qP->items)
+            ckfree((char *) qP->items);
+        qP->items = items;
+        qP->size = size;
+        qP->head = 0;
+    }
+    /* Pushed in reverse so the first directory is popped first */
+    for (i = n - 1; i >= 0; --i)
+        qP->items[(qP->head + qP->count++) % qP->size] = dirs[i];
+    Tcl_MutexUnlock(&qP->lock);
+}
+
+/* Takes from the tail if own is non-zero, else from the head */
+static FtsDir *FtsQueueTake(FtsQueue *qP, int own)
+{
+    FtsDir *dirP = NULL;
+    Tcl_MutexLock(&qP->lock);
+    if (qP->count) {
+        if (own)
+            dirP = qP->items[(qP->head + qP->count - 1) % qP->size];
+        else {
+            dirP = qP->items[qP->head];
+            qP->head = (qP->head + 1) % qP->size;
+        }
+        --qP->count;
+    }
+    Tcl_MutexUnlock(&qP->lock);
+    return dirP;
+}
+
+static FtsDir *FtsDirNew(const char *parent, int parentlen, char sep,
+                         const char *name, int namelen)
+{
+    FtsDir *dirP;
+    int addsep = parentlen && namelen && parent[parentlen-1] != sep;
+    dirP = (FtsDir *) ckalloc(sizeof(*dirP) + parentlen + addsep + namelen + 1);
+    dirP->path = (char *) (dirP + 1);
+    memcpy(dirP->path, parent, parentlen);
+    if (addsep)
+        dirP->path[parentlen] = sep;
+    memcpy(dirP->path + parentlen + addsep, name, namelen);
+    dirP->pathlen = parentlen + addsep + namelen;
+    dirP->path[dirP->pathlen] = '\0';
+    return dirP;
+}
+
+/*
+ * Security descriptor table
+ */
+
+static Tcl_WideUInt FtsHash(const unsigned char *p, int len)
+{
+    Tcl_WideUInt h = 0xcbf29ce484222325ULL; /* FNV-1a */
+    while (len--) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Returns the index of the descriptor, adding it if new. Caller locks. */
+static int FtsSdIntern(FtsScan *scanP, const unsigned char *data, int len)
+{
+    Tcl_WideUInt hash = FtsHash(data, len);
+    FtsSd *sdP;
+    int i;
+
+    if (scanP->nbuckets) {
+        for (i = scanP->buckets[hash & (scanP->nbuckets - 1)]; i >= 0;
+             i = sdP->next) {
+            sdP = scanP->sds[i];
+            if (sdP->hash == hash && sdP->len == len &&
+                memcmp(sdP->data, data, len) == 0)
+                return i;
+        }
+    }
+    if (scanP->nsds == scanP->sds_size) {
+        scanP->sds_size = scanP->sds_size ? 2 * scanP->sds_size : 16;
+        scanP->sds = (FtsSd **) ckrealloc((char *) scanP->sds,
+                                          scanP->sds_size * sizeof(FtsSd *));
+    }
+    if (scanP->nsds >= scanP->nbuckets) {
+        /* Rehash so chains stay short */
+        scanP->nbuckets = scanP->nbuckets ? 4 * scanP->nbuckets : 64;
+        scanP->buckets = (int *) ckrealloc((char *) scanP->buckets,
+                                           scanP->nbuckets * sizeof(int));
+        memset(scanP->buckets, 0xff, scanP->nbuckets * sizeof(int));
+        for (i = 0; i < scanP->nsds; ++i) {
+            int *bucketP = &scanP->buckets[scanP->sds[i]->hash
+                                           & (scanP->nbuckets - 1)];
+            scanP->sds[i]->next = *bucketP;
+            *bucketP = i;
+        }
+    }
+    sdP = (FtsSd *) ckalloc(sizeof(FtsSd) + len);
+    sdP->hash = hash;
+    sdP->len = len;
+    memcpy(sdP->data, data, len);
+    i = scanP->nsds++;
+    scanP->sds[i] = sdP;
+    sdP->next = scanP->buckets[hash & (scanP->nbuckets - 1)];
+    scanP->buckets[hash & (scanP->nbuckets - 1)] = i;
+    return i;
+}
+
+/* Returns the descriptor index for an entry, or -1 */
+static int FtsSdIndex(FtsWorker *wP, void *dir, const FtsEntry *entryP)
+{
+    FtsScan *scanP = wP->scanP;
+    int index;
+
+    wP->sd.len = 0;
+    if (scanP->cfg.backend->security(scanP->cfg.backend_ctx, dir, entryP,
+                                     &wP->sd) != 0) {
+        wP->counts.sd_errors++;
+        return -1;
+    }
+    /* Entries in a directory mostly have the same descriptor */
+    if (wP->last_sd_index >= 0 && wP->sd.len == wP->last_sd.len &&
+        memcmp(wP->sd.p, wP->last_sd.p, wP->sd.len) == 0)
+        return wP->last_sd_index;
+
+    Tcl_MutexLock(&scanP->sd_lock);
+    index = FtsSdIntern(scanP, wP->sd.p, wP->sd.len);
+    Tcl_MutexUnlock(&scanP->sd_lock);
+
+    FtsBufReserve(&wP->last_sd, wP->sd.len);
+    memcpy(wP->last_sd.p, wP->sd.p, wP->sd.len);
+    wP->last_sd.len = wP->sd.len;
+    wP->last_sd_index = index;
+    return index;
+}
+
+int FtsScanSecurity(FtsScan *scanP, int index, const unsigned char **dataP,
+                    int *lenP)
+{
+    int found = 0;
+    Tcl_MutexLock(&scanP->sd_lock);
+    if (index >= 0 && index < scanP->nsds) {
+        *dataP = scanP->sds[index]->data;
+        *lenP = scanP->sds[index]->len;
+        found = 1;
+    }
+    Tcl_MutexUnlock(&scanP->sd_lock);
+    return found;
+}
+
+/*
+ * Scanning
+ */
+
+static void FtsStatsAdd(FtsStats *toP, FtsStats *fromP)
+{
+    toP->entries += fromP->entries;
+    toP->dirs += fromP->dirs;
+    toP->errors += fromP->errors;
+    toP->batches += fromP->batches;
+    toP->sd_errors += fromP->sd_errors;
+    toP->steals += fromP->steals;
+    memset(fromP, 0, sizeof(*fromP));
+}
+
+/* Passes on the current batch, if any, and merges the worker counters */
+static void FtsFlush(FtsWorker *wP)
+{
+    FtsScan *scanP = wP->scanP;
+    FtsBatch *batchP = wP->batchP;
+
+    wP->batchP = NULL;
+    if (batchP) {
+        if (batchP->n) {
+            wP->counts.batches++;
+            scanP->cfg.batch_proc(scanP->cfg.batch_ctx, batchP);
+        } else
+            FtsBatchFree(batchP);
+    }
+    Tcl_MutexLock(&scanP->lock);
+    FtsStatsAdd(&scanP->stats, &wP->counts);
+    Tcl_MutexUnlock(&scanP->lock);
+}
+
+static void FtsAddRecord(FtsWorker *wP, const FtsDir *dirP,
+                         const FtsEntry *entryP, int sd)
+{
+    FtsScan *scanP = wP->scanP;
+    FtsBatch *batchP;
+    FtsRecord *recP;
+    int rellen, off;
+
+    if (wP->batchP == NULL)
+        wP->batchP = FtsBatchNew(scanP->cfg.batch_size);
+    batchP = wP->batchP;
+    recP = &batchP->records[batchP->n++];
+    recP->file_id = entryP->file_id;
+    recP->size = entryP->size;
+    recP->alloc_size = entryP->alloc_size;
+    recP->create_time = entryP->create_time;
+    recP->access_time = entryP->access_time;
+    recP->write_time = entryP->write_time;
+    recP->change_time = entryP->change_time;
+    recP->attrs = entryP->attrs;
+    recP->depth = dirP->depth;
+    recP->sd = sd;
+
+    /* Path is the directory's relative path, separator and name */
+    rellen = dirP->pathlen - dirP->rel;
+    off = FtsBatchString(batchP, dirP->path + dirP->rel, rellen);
+    if (rellen) {
+        batchP->strings[off + rellen] = scanP->cfg.backend->sep;
+        batchP->strings_len = off + rellen + 1;
+    } else
+        batchP->strings_len = off;
+    FtsBatchString(batchP, entryP->name, entryP->namelen);
+    recP->path = off;
+    recP->pathlen = batchP->strings_len - 1 - off;
+    recP->short_name = FtsBatchString(batchP, entryP->short_name,
+                                      entryP->short_namelen);
+    recP->short_namelen = entryP->short_namelen;
+
+    wP->counts.entries++;
+    if (batchP->n == batchP->size)
+        FtsFlush(wP);
+}
+
+/* Queues directories found by the worker and wakes up idle threads */
+static void FtsQueueDirs(FtsWorker *wP, int n)
+{
+    FtsScan *scanP = wP->scanP;
+
+    /*
+     * The directory being scanned is still pending so the count cannot
+     * reach 0 even if the new ones are stolen and finished right away.
+     */
+    FtsQueuePush(&scanP->queues[wP->index], wP->subdirs, n);
+    Tcl_MutexLock(&scanP->lock);
+    scanP->pending += n;
+    scanP->generation++;
+    if (scanP->nidle)
+        Tcl_ConditionNotify(&scanP->cond);
+    Tcl_MutexUnlock(&scanP->lock);
+}
+
+static int FtsIsDot(const FtsEntry *entryP)
+{
+    return entryP->name[0] == '.' &&
+        (entryP->namelen == 1 ||
+         (entryP->namelen == 2 && entryP->name[1] == '.'));
+}
+
+static void FtsScanDir(FtsWorker *wP, FtsDir *dirP)
+{
+    FtsScan *scanP = wP->scanP;
+    const FtsBackend *backendP = scanP->cfg.backend;
+    void *dir;
+    int i, n, nsubdirs, err = 0;
+    int descend = scanP->cfg.max_depth <= 0 ?
+        dirP->depth < FTS_MAX_DEPTH : dirP->depth < scanP->cfg.max_depth;
+
+    if (scanP->cancelled)
+        return;
+    dir = backendP->open(scanP->cfg.backend_ctx, dirP->path, &err);
+    if (dir == NULL) {
+        if (dirP->depth == 1)
+            scanP->status = err; /* Only the root has depth 1 */
+        else
+            wP->counts.errors++;
+        return;
+    }
+    wP->counts.dirs++;
+    wP->last_sd_index = -1;
+    while (! scanP->cancelled) {
+        n = backendP->read(scanP->cfg.backend_ctx, dir, wP->entries,
+                           FTS_READ_MAX, &err);
+        if (n <= 0) {
+            if (n < 0)
+                wP->counts.errors++;
+            break;
+        }
+        nsubdirs = 0;
+        for (i = 0; i < n; ++i) {
+            FtsEntry *entryP = &wP->entries[i];
+            if (FtsIsDot(entryP))
+                continue;
+            FtsAddRecord(wP, dirP, entryP,
+                         scanP->cfg.security ? FtsSdIndex(wP, dir, entryP) : -1);
+            if (entryP->descend && descend) {
+                FtsDir *subdirP = FtsDirNew(dirP->path, dirP->pathlen,
+                                            backendP->sep, entryP->name,
+                                            entryP->namelen);
+                subdirP->rel = scanP->relstart;
+                subdirP->depth = dirP->depth + 1;
+                wP->subdirs[nsubdirs++] = subdirP;
+            }
+        }
+        if (nsubdirs)
+            FtsQueueDirs(wP, nsubdirs);
+    }
+    backendP->close(scanP->cfg.backend_ctx, dir);
+}
+
+/* Returns the next directory to scan or NULL when there are no more */
+static FtsDir *FtsNextDir(FtsWorker *wP)
+{
+    FtsScan *scanP = wP->scanP;
+    FtsDir *dirP;
+    unsigned int generation;
+    int i, nthreads = scanP->cfg.nthreads;
+
+    while (1) {
+        Tcl_MutexLock(&scanP->lock);
+        generation = scanP->generation;
+        Tcl_MutexUnlock(&scanP->lock);
+
+        dirP = FtsQueueTake(&scanP->queues[wP->index], 1);
+        if (dirP)
+            return dirP;
+        for (i = 1; i < nthreads; ++i) {
+            dirP = FtsQueueTake(&scanP->queues[(wP->index + i) % nthreads], 0);
+            if (dirP) {
+                wP->counts.steals++;
+                return dirP;
+            }
+        }
+
+        /* Nothing to do. Pass on what we have so it is not held up. */
+        if (wP->batchP && wP->batchP->n)
+            FtsFlush(wP);
+
+        Tcl_MutexLock(&scanP->lock);
+        if (scanP->pending == 0) {
+            Tcl_MutexUnlock(&scanP->lock);
+            return NULL;
+        }
+        /* Unless something was queued after we looked, wait for it */
+        if (generation == scanP->generation) {
+            scanP->nidle++;
+            Tcl_ConditionWait(&scanP->cond, &scanP->lock, NULL);
+            scanP->nidle--;
+        }
+        Tcl_MutexUnlock(&scanP->lock);
+    }
+}
+
+static void FtsWorkerRun(FtsWorker *wP)
+{
+    FtsScan *scanP = wP->scanP;
+    FtsDir *dirP;
+
+    while ((dirP = FtsNextDir(wP)) != NULL) {
+        FtsScanDir(wP, dirP);
+        ckfree((char *) dirP);
+        Tcl_MutexLock(&scanP->lock);
+        if (--scanP->pending == 0)
+            Tcl_ConditionNotify(&scanP->cond);
+        Tcl_MutexUnlock(&scanP->lock);
+    }
+    FtsFlush(wP);
+    FtsBufFree(&wP->sd);
+    FtsBufFree(&wP->last_sd);
+}
+
+static Tcl_ThreadCreateType FtsWorkerThread(ClientData clientdata)
+{
+    FtsWorkerRun((FtsWorker *) clientdata);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+FtsScan *FtsScanNew(const FtsConfig *cfgP, const char *path)
+{
+    FtsScan *scanP = (FtsScan *) ckalloc(sizeof(*scanP));
+    memset(scanP, 0, sizeof(*scanP));
+    scanP->cfg = *cfgP;
+    if (scanP->cfg.nthreads < 1)
+        scanP->cfg.nthreads = 1;
+    if (scanP->cfg.nthreads > FTS_MAX_THREADS)
+        scanP->cfg.nthreads = FTS_MAX_THREADS;
+    if (scanP->cfg.batch_size < 1)
+        scanP->cfg.batch_size = 1000;
+    if (scanP->cfg.backend->security == NULL)
+        scanP->cfg.security = 0;
+    scanP->rootlen = (int) strlen(path);
+    scanP->root = ckalloc(scanP->rootlen + 1);
+    memcpy(scanP->root, path, scanP->rootlen + 1);
+    scanP->relstart = scanP->rootlen;
+    if (scanP->rootlen && path[scanP->rootlen-1] != cfgP->backend->sep)
+        scanP->relstart++;
+    return scanP;
+}
+
+void FtsScanFree(FtsScan *scanP)
+{
+    int i;
+    for (i = 0; i < scanP->nsds; ++i)
+        ckfree((char *) scanP->sds[i]);
+    if (scanP->sds)
+        ckfree((char *) scanP->sds);
+    if (scanP->buckets)
+        ckfree((char *) scanP->buckets);
+    ckfree(scanP->root);
+    Tcl_MutexFinalize(&scanP->lock);
+    Tcl_ConditionFinalize(&scanP->cond);
+    Tcl_MutexFinalize(&scanP->sd_lock);
+    ckfree((char *) scanP);
+}
+
+int FtsScanRun(FtsScan *scanP)
+{
+    FtsWorker *workers;
+    FtsDir *rootP;
+    Tcl_ThreadId tids[FTS_MAX_THREADS];
+    int i, nthreads = scanP->cfg.nthreads, nstarted = 0;
+
+    scanP->queues = (FtsQueue *) ckalloc(nthreads * sizeof(FtsQueue));
+    memset(scanP->queues, 0, nthreads * sizeof(FtsQueue));
+    workers = (FtsWorker *) ckalloc(nthreads * sizeof(FtsWorker));
+    memset(workers, 0, nthreads * sizeof(FtsWorker));
+    for (i = 0; i < nthreads; ++i) {
+        workers[i].scanP = scanP;
+        workers[i].index = i;
+        workers[i].last_sd_index = -1;
+    }
+
+    rootP = FtsDirNew(scanP->root, scanP->rootlen, 0, "", 0);
+    rootP->rel = rootP->pathlen;
+    rootP->depth = 1;
+    scanP->pending = 1;
+    FtsQueuePush(&scanP->queues[0], &rootP, 1);
+
+    for (i = 1; i < nthreads; ++i) {
+        if (Tcl_CreateThread(&tids[nstarted], FtsWorkerThread, &workers[i],
+                             TCL_THREAD_STACK_DEFAULT,
+                             TCL_THREAD_JOINABLE) == TCL_OK)
+            ++nstarted;
+        else
+            break;
+    }
+    /* Queues of threads that could not be started just stay empty */
+    FtsWorkerRun(&workers[0]);
+    for (i = 0; i < nstarted; ++i) {
+        int result;
+        Tcl_JoinThread(tids[i], &result);
+    }
+
+    for (i = 0; i < nthreads; ++i) {
+        if (scanP->queues[i].items)
+            ckfree((char *) scanP->queues[i].items);
+        Tcl_MutexFinalize(&scanP->queues[i].lock);
+    }
+    ckfree((char *) scanP->queues);
+    scanP->queues = NULL;
+    ckfree((char *) workers);
+
+    Tcl_MutexLock(&scanP->lock);
+    scanP->stats.threads = nstarted + 1;
+    Tcl_MutexUnlock(&scanP->lock);
+    if (scanP->status)
+        return scanP->status;
+    return scanP->cancelled ? FTS_E_CANCELLED : 0;
+}
+
+void FtsScanCancel(FtsScan *scanP)
+{
+    scanP->cancelled = 1;
+}
+
+void FtsScanStats(FtsScan *scanP, FtsStats *statsP)
+{
+    Tcl_MutexLock(&scanP->lock);
+    *statsP = scanP->stats;
+    Tcl_MutexUnlock(&scanP->lock);
+    Tcl_MutexLock(&scanP->sd_lock);
+    statsP->sds = scanP->nsds;
+    Tcl_MutexUnlock(&scanP->sd_lock);
+}
+
+#ifndef _WIN32
+/*
+ * POSIX backend
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#else
+#include <dirent.h>
+#endif
+
+/* Seconds between 1601 and 1970 in FILETIME units */
+#define FTS_EPOCH_DIFF 116444736000000000LL
+
+typedef struct FtsPosixDir {
+    int fd;
+#ifdef __linux__
+    int pos;                    /* Offset of next dirent in buf */
+    int len;
+    Tcl_WideInt buf[4096];      /* 32K, aligned for linux_dirent64 */
+#else
+    DIR *dirP;
+#endif
+    unsigned int *sds;          /* Owner, group and mode of each entry */
+    int nsds;
+} FtsPosixDir;
+
+#ifdef __linux__
+/* As returned by getdents64, not declared by glibc */
+typedef struct FtsDirent64 {
+    Tcl_WideUInt d_ino;
+    Tcl_WideInt d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+} FtsDirent64;
+#endif
+
+static void *FtsPosixOpen(void *ctx, const char *path, int *errP)
+{
+    FtsPosixDir *dirP;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    (void) ctx;
+    if (fd < 0) {
+        *errP = errno;
+        return NULL;
+    }
+    dirP = (FtsPosixDir *) ckalloc(sizeof(*dirP));
+    dirP->fd = fd;
+    dirP->sds = NULL;
+    dirP->nsds = 0;
+#ifdef __linux__
+    dirP->pos = dirP->len = 0;
+#else
+    dirP->dirP = fdopendir(fd);
+    if (dirP->dirP == NULL) {
+        *errP = errno;
+        close(fd);
+        ckfree((char *) dirP);
+        return NULL;
+    }
+#endif
+    return dirP;
+}
+
+static void FtsPosixClose(void *ctx, void *dir)
+{
+    FtsPosixDir *dirP = (FtsPosixDir *) dir;
+    (void) ctx;
+#ifdef __linux__
+    close(dirP->fd);
+#else
+    closedir(dirP->dirP);
+#endif
+    if (dirP->sds)
+        ckfree((char *) dirP->sds);
+    ckfree((char *) dirP);
+}
+
+static Tcl_WideInt FtsPosixTime(time_t sec, long nsec)
+{
+    return (Tcl_WideInt) sec * 10000000 + nsec / 100 + FTS_EPOCH_DIFF;
+}
+
+/*
+ * Fills in entryP for name, the n'th entry of the read. Entries that
+ * vanished are only named.
+ */
+static void FtsPosixStat(FtsPosixDir *dirP, const char *name, int n,
+                         FtsEntry *entryP)
+{
+    unsigned int *sd = dirP->sds + 3 * n;
+    struct stat st;
+
+    memset(entryP, 0, sizeof(*entryP));
+    entryP->name = name;
+    entryP->namelen = (int) strlen(name);
+    entryP->short_name = "";
+    entryP->native = sd;
+    sd[0] = sd[1] = sd[2] = 0;
+    if (fstatat(dirP->fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        entryP->attrs = FTS_ATTR_NORMAL;
+        return;
+    }
+    entryP->file_id = (Tcl_WideInt) st.st_ino;
+    entryP->size = st.st_size;
+    entryP->alloc_size = (Tcl_WideInt) st.st_blocks * 512;
+#ifdef __linux__
+    entryP->access_time = FtsPosixTime(st.st_atim.tv_sec, st.st_atim.tv_nsec);
+    entryP->write_time = FtsPosixTime(st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    entryP->change_time = FtsPosixTime(st.st_ctim.tv_sec, st.st_ctim.tv_nsec);
+#else
+    entryP->access_time = FtsPosixTime(st.st_atime, 0);
+    entryP->write_time = FtsPosixTime(st.st_mtime, 0);
+    entryP->change_time = FtsPosixTime(st.st_ctime, 0);
+#endif
+    /* No portable creation time */
+    if (S_ISDIR(st.st_mode)) {
+        entryP->attrs |= FTS_ATTR_DIRECTORY;
+        entryP->descend = 1;
+    } else if (S_ISLNK(st.st_mode))
+        entryP->attrs |= FTS_ATTR_REPARSE_POINT;
+    if ((st.st_mode & 0222) == 0)
+        entryP->attrs |= FTS_ATTR_READONLY;
+    if (name[0] == '.')
+        entryP->attrs |= FTS_ATTR_HIDDEN;
+    if (entryP->attrs == 0)
+        entryP->attrs = FTS_ATTR_NORMAL;
+    sd[0] = (unsigned int) st.st_uid;
+    sd[1] = (unsigned int) st.st_gid;
+    sd[2] = (unsigned int) (st.st_mode & 07777);
+}
+
+static int FtsPosixRead(void *ctx, void *dir, FtsEntry *entries, int max,
+                        int *errP)
+{
+    FtsPosixDir *dirP = (FtsPosixDir *) dir;
+    int n = 0;
+
+    (void) ctx;
+    if (dirP->nsds < max) {
+        dirP->sds = (unsigned int *) ckrealloc((char *) dirP->sds,
+                                               3 * max * sizeof(unsigned int));
+        dirP->nsds = max;
+    }
+#ifdef __linux__
+    while (n < max) {
+        FtsDirent64 *dP;
+        if (dirP->pos >= dirP->len) {
+            long len;
+            if (n)
+                break;          /* Entry names point into buf */
+            len = syscall(SYS_getdents64, dirP->fd, dirP->buf,
+                          sizeof(dirP->buf));
+            if (len < 0) {
+                *errP = errno;
+                return -1;
+            }
+            if (len == 0)
+                break;
+            dirP->pos = 0;
+            dirP->len = (int) len;
+        }
+        dP = (FtsDirent64 *) ((char *) dirP->buf + dirP->pos);
+        dirP->pos += dP->d_reclen;
+        FtsPosixStat(dirP, dP->d_name, n, &entries[n]);
+        ++n;
+    }
+#else
+    struct dirent *dP;
+    /* readdir reuses its buffer so only one entry per call */
+    (void) max;
+    errno = 0;
+    if ((dP = readdir(dirP->dirP)) != NULL) {
+        FtsPosixStat(dirP, dP->d_name, 0, &entries[0]);
+        n = 1;
+    } else if (errno) {
+        *errP = errno;
+        return -1;
+    }
+#endif
+    return n;
+}
+
+/* The owner, group and mode of the entry, from the lstat done by read */
+static int FtsPosixSecurity(void *ctx, void *dir, const FtsEntry *entryP,
+                            FtsBuf *bufP)
+{
+    (void) ctx; (void) dir;
+    bufP->len = 3 * sizeof(unsigned int);
+    FtsBufReserve(bufP, bufP->len);
+    memcpy(bufP->p, entryP->native, bufP->len);
+    return 0;
+}
+
+const FtsBackend FtsPosixBackend = {
+    "posix",
+    '/',
+    FtsPosixOpen,
+    FtsPosixRead,
+    FtsPosixClose,
+    FtsPosixSecurity
+};
+#endif /* ! _WIN32 */
+
+#ifdef _WIN32
+/*
+ * Windows backend and Tcl commands
+ */
+#include "twapi.h"
+#include "twapi_storage.h"
+
+typedef struct TwapiFtsDir {
+    HANDLE h;
+    int pos;                    /* Offset of next entry in buf, -1 if none */
+    int eof;
+    WCHAR *path;                /* Directory path followed by '\' */
+    int pathlen;
+    WCHAR *epath;               /* Entry path for GetFileSecurity */
+    int epath_size;
+    char utf8[65536];           /* Entry names from the last read */
+    __int64 buf[65536 / 8];     /* FILE_ID_BOTH_DIR_INFO records */
+} TwapiFtsDir;
+
+static void *TwapiFtsOpen(void *ctx, const char *path, int *errP)
+{
+    TwapiFtsDir *dirP;
+    int n;
+
+    n = MultiByteToWideChar(CP_UTF8, 0, path, -1, NULL, 0);
+    if (n == 0) {
+        *errP = GetLastError();
+        return NULL;
+    }
+    dirP = (TwapiFtsDir *) ckalloc(sizeof(*dirP));
+    dirP->path = (WCHAR *) ckalloc((n + 1) * sizeof(WCHAR));
+    MultiByteToWideChar(CP_UTF8, 0, path, -1, dirP->path, n);
+    dirP->h = CreateFileW(dirP->path, FILE_LIST_DIRECTORY,
+                          FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                          NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (dirP->h == INVALID_HANDLE_VALUE) {
+        *errP = GetLastError();
+        ckfree((char *) dirP->path);
+        ckfree((char *) dirP);
+        return NULL;
+    }
+    dirP->pathlen = n - 1;
+    if (dirP->pathlen && dirP->path[dirP->pathlen - 1] != L'\\')
+        dirP->path[dirP->pathlen++] = L'\\';
+    dirP->pos = -1;
+    dirP->eof = 0;
+    dirP->epath = NULL;
+    dirP->epath_size = 0;
+    return dirP;
+}
+
+static void TwapiFtsClose(void *ctx, void *dir)
+{
+    TwapiFtsDir *dirP = (TwapiFtsDir *) dir;
+    CloseHandle(dirP->h);
+    ckfree((char *) dirP->path);
+    if (dirP->epath)
+        ckfree((char *) dirP->epath);
+    ckfree((char *) dirP);
+}
+
+/* Converts to nul terminated UTF-8 at *pP, advancing it. Returns length. */
+static int TwapiFtsUtf8(const WCHAR *ws, int nchars, char **pP, char *end)
+{
+    int len = 0;
+    if (nchars)
+        len = WideCharToMultiByte(CP_UTF8, 0, ws, nchars, *pP,
+                                  (int) (end - *pP) - 1, NULL, NULL);
+    (*pP)[len] = '\0';
+    *pP += len + 1;
+    return len;
+}
+
+/*
+ * Each GetFileInformationByHandleEx call returns as many entries as fit
+ * in the 64K buffer, several hundred for typical names, in a single
+ * NtQueryDirectoryFile request.
+ */
+static int TwapiFtsRead(void *ctx, void *dir, FtsEntry *entries, int max,
+                        int *errP)
+{
+    TwapiFtsDir *dirP = (TwapiFtsDir *) dir;
+    char *utf8 = dirP->utf8;
+    int n = 0;
+
+    if (dirP->pos < 0) {
+        if (dirP->eof)
+            return 0;
+        if (! GetFileInformationByHandleEx(dirP->h, FileIdBothDirectoryInfo,
+                                           dirP->buf, sizeof(dirP->buf))) {
+            DWORD winerr = GetLastError();
+            if (winerr == ERROR_NO_MORE_FILES) {
+                dirP->eof = 1;
+                return 0;
+            }
+            *errP = winerr;
+            return -1;
+        }
+        dirP->pos = 0;
+    }
+    while (n < max && dirP->pos >= 0) {
+        FILE_ID_BOTH_DIR_INFO *infoP =
+            (FILE_ID_BOTH_DIR_INFO *) (dirP->pos + (char *) dirP->buf);
+        FtsEntry *entryP;
+
+        /* A UTF-16 char needs at most 3 UTF-8 bytes. Rest at next call. */
+        if (3 * (infoP->FileNameLength + infoP->ShortNameLength) / sizeof(WCHAR) + 2
+            > (size_t) (dirP->utf8 + sizeof(dirP->utf8) - utf8))
+            break;
+        entryP = &entries[n++];
+
+        entryP->file_id = infoP->FileId.QuadPart;
+        entryP->size = infoP->EndOfFile.QuadPart;
+        entryP->alloc_size = infoP->AllocationSize.QuadPart;
+        entryP->create_time = infoP->CreationTime.QuadPart;
+        entryP->access_time = infoP->LastAccessTime.QuadPart;
+        entryP->write_time = infoP->LastWriteTime.QuadPart;
+        entryP->change_time = infoP->ChangeTime.QuadPart;
+        entryP->attrs = infoP->FileAttributes;
+        /* Junctions and symbolic links are not followed */
+        entryP->descend = (infoP->FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            && ! (infoP->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT);
+        entryP->name = utf8;
+        entryP->namelen = TwapiFtsUtf8(infoP->FileName,
+                                       infoP->FileNameLength / sizeof(WCHAR),
+                                       &utf8, dirP->utf8 + sizeof(dirP->utf8));
+        entryP->short_name = utf8;
+        entryP->short_namelen = TwapiFtsUtf8(infoP->ShortName,
+                                             infoP->ShortNameLength / sizeof(WCHAR),
+                                             &utf8, dirP->utf8 + sizeof(dirP->utf8));
+        entryP->native = infoP;
+        if (infoP->NextEntryOffset)
+            dirP->pos += infoP->NextEntryOffset;
+        else
+            dirP->pos = -1;
+    }
+    return n;
+}
+
+static int TwapiFtsSecurity(void *ctx, void *dir, const FtsEntry *entryP,
+                            FtsBuf *bufP)
+{
+    TwapiFtsDir *dirP = (TwapiFtsDir *) dir;
+    const FILE_ID_BOTH_DIR_INFO *infoP =
+        (const FILE_ID_BOTH_DIR_INFO *) entryP->native;
+    int nchars = infoP->FileNameLength / sizeof(WCHAR);
+    DWORD needed;
+
+    if (dirP->pathlen + nchars + 1 > dirP->epath_size) {
+        dirP->epath_size = dirP->pathlen + nchars + 64;
+        dirP->epath = (WCHAR *) ckrealloc((char *) dirP->epath,
+                                          dirP->epath_size * sizeof(WCHAR));
+    }
+    CopyMemory(dirP->epath, dirP->path, dirP->pathlen * sizeof(WCHAR));
+    CopyMemory(dirP->epath + dirP->pathlen, infoP->FileName,
+               nchars * sizeof(WCHAR));
+    dirP->epath[dirP->pathlen + nchars] = 0;
+
+    FtsBufReserve(bufP, 512);
+    while (! GetFileSecurityW(dirP->epath,
+                              OWNER_SECURITY_INFORMATION
+                              | GROUP_SECURITY_INFORMATION
+                              | DACL_SECURITY_INFORMATION,
+                              bufP->p, bufP->size, &needed)) {
+        DWORD winerr = GetLastError();
+        if (winerr != ERROR_INSUFFICIENT_BUFFER || (int) needed <= bufP->size)
+            return winerr;
+        FtsBufReserve(bufP, needed);
+    }
+    bufP->len = GetSecurityDescriptorLength(bufP->p);
+    return 0;
+}
+
+static const FtsBackend TwapiFtsBackend = {
+    "win32",
+    '\\',
+    TwapiFtsOpen,
+    TwapiFtsRead,
+    TwapiFtsClose,
+    TwapiFtsSecurity
+};
+
+/*
+ * A scan started from Tcl. Synchronous scans collect batches in a list.
+ * Asynchronous scans run in their own thread, pass each batch to the
+ * interp thread through a callback as soon as it is full and end with a
+ * callback that reports the result and frees the scan. They are tracked
+ * in the module's interp context so they can be cancelled.
+ */
+typedef struct _TwapiFileScan {
+    TwapiInterpContext *ticP;
+    TwapiId id;
+    FtsScan *scanP;
+    int async;
+    int status;                 /* Result of FtsScanRun */
+    Tcl_ThreadId tid;           /* Thread running an asynchronous scan */
+    int joined;
+    int linked;                 /* On the interp context list */
+    Tcl_Mutex lock;             /* Protects batches */
+    FtsBatch *batches;
+    FtsBatch **tailP;
+    Tcl_Obj **sdObjs;           /* Descriptors as Tcl lists, by index. Only
+                                   accessed in the interp thread. */
+    int nsdObjs;
+    ZLINK_DECL(TwapiFileScan);
+} TwapiFileScan;
+
+typedef struct TwapiFileScanCallback {
+    TwapiCallback cb;
+    TwapiFileScan *fsP;
+    FtsBatch *batchP;           /* NULL for the final callback */
+} TwapiFileScanCallback;
+
+static int TwapiFileScanCallbackFn(TwapiCallback *cbP);
+
+static void TwapiFileScanBatch(void *ctx, FtsBatch *batchP)
+{
+    TwapiFileScan *fsP = (TwapiFileScan *) ctx;
+    TwapiFileScanCallback *fscP;
+
+    if (! fsP->async) {
+        Tcl_MutexLock(&fsP->lock);
+        *fsP->tailP = batchP;
+        fsP->tailP = &batchP->next;
+        Tcl_MutexUnlock(&fsP->lock);
+        return;
+    }
+    fscP = (TwapiFileScanCallback *) TwapiCallbackNew(
+        fsP->ticP, TwapiFileScanCallbackFn, sizeof(*fscP));
+    fscP->fsP = fsP;
+    fscP->batchP = batchP;
+    TwapiEnqueueCallback(fsP->ticP, &fscP->cb, TWAPI_ENQUEUE_DIRECT, 0, NULL);
+}
+
+static TwapiFileScan *TwapiFileScanNew(TwapiInterpContext *ticP,
+                                       const char *path, int nthreads,
+                                       int batch_size, int max_depth,
+                                       int flags, int async)
+{
+    TwapiFileScan *fsP;
+    FtsConfig cfg;
+
+    if (nthreads <= 0) {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        nthreads = si.dwNumberOfProcessors;
+    }
+    fsP = (TwapiFileScan *) ckalloc(sizeof(*fsP));
+    ZeroMemory(fsP, sizeof(*fsP));
+    fsP->ticP = ticP;
+    TwapiInterpContextRef(ticP, 1);
+    fsP->async = async;
+    fsP->tailP = &fsP->batches;
+    ZLINK_INIT(fsP);
+
+    cfg.backend = &TwapiFtsBackend;
+    cfg.backend_ctx = NULL;
+    cfg.batch_proc = TwapiFileScanBatch;
+    cfg.batch_ctx = fsP;
+    cfg.nthreads = nthreads;
+    cfg.batch_size = batch_size;
+    cfg.max_depth = max_depth;
+    cfg.security = flags & 1;
+    fsP->scanP = FtsScanNew(&cfg, path);
+    return fsP;
+}
+
+static void TwapiFileScanFree(TwapiFileScan *fsP)
+{
+    int i;
+    while (fsP->batches) {
+        FtsBatch *batchP = fsP->batches;
+        fsP->batches = batchP->next;
+        FtsBatchFree(batchP);
+    }
+    for (i = 0; i < fsP->nsdObjs; ++i) {
+        if (fsP->sdObjs[i])
+            ObjDecrRefs(fsP->sdObjs[i]);
+    }
+    if (fsP->sdObjs)
+        ckfree((char *) fsP->sdObjs);
+    FtsScanFree(fsP->scanP);
+    Tcl_MutexFinalize(&fsP->lock);
+    TwapiInterpContextUnref(fsP->ticP, 1);
+    ckfree((char *) fsP);
+}
+
+/* Returns the descriptor with the given index, converted once per scan */
+static Tcl_Obj *TwapiFileScanSecurityObj(TwapiFileScan *fsP, int index)
+{
+    const unsigned char *sd;
+    Tcl_Obj *objP = NULL;
+    int len;
+
+    if (index < 0)
+        return ObjFromEmptyString();
+    if (index >= fsP->nsdObjs) {
+        int n = 2 * index + 16;
+        fsP->sdObjs = (Tcl_Obj **) ckrealloc((char *) fsP->sdObjs,
+                                             n * sizeof(Tcl_Obj *));
+        ZeroMemory(fsP->sdObjs + fsP->nsdObjs,
+                   (n - fsP->nsdObjs) * sizeof(Tcl_Obj *));
+        fsP->nsdObjs = n;
+    }
+    if (fsP->sdObjs[index] == NULL) {
+        if (FtsScanSecurity(fsP->scanP, index, &sd, &len))
+            objP = ObjFromSECURITY_DESCRIPTOR(NULL, (SECURITY_DESCRIPTOR *) sd);
+        if (objP == NULL)
+            objP = ObjFromEmptyString();
+        ObjIncrRefs(objP);
+        fsP->sdObjs[index] = objP;
+    }
+    return fsP->sdObjs[index];
+}
+
+static Tcl_Obj *TwapiFileScanFields(void)
+{
+    Tcl_Obj *objs[12];
+    objs[0] = STRING_LITERAL_OBJ("path");
+    objs[1] = STRING_LITERAL_OBJ("depth");
+    objs[2] = STRING_LITERAL_OBJ("attrs");
+    objs[3] = STRING_LITERAL_OBJ("size");
+    objs[4] = STRING_LITERAL_OBJ("allocation_size");
+    objs[5] = STRING_LITERAL_OBJ("ctime");
+    objs[6] = STRING_LITERAL_OBJ("atime");
+    objs[7] = STRING_LITERAL_OBJ("mtime");
+    objs[8] = STRING_LITERAL_OBJ("changetime");
+    objs[9] = STRING_LITERAL_OBJ("fileid");
+    objs[10] = STRING_LITERAL_OBJ("altname");
+    objs[11] = STRING_LITERAL_OBJ("securitydescriptor");
+    return ObjNewList(ARRAYSIZE(objs), objs);
+}
+
+/* Appends the records in the batch to recsObj */
+static void TwapiFileScanRecords(TwapiFileScan *fsP, const FtsBatch *batchP,
+                                 Tcl_Obj *recsObj)
+{
+    int i;
+    for (i = 0; i < batchP->n; ++i) {
+        const FtsRecord *recP = &batchP->records[i];
+        Tcl_Obj *objs[12];
+        objs[0] = ObjFromStringN(batchP->strings + recP->path, recP->pathlen);
+        objs[1] = ObjFromInt(recP->depth);
+        objs[2] = ObjFromDWORD(recP->attrs);
+        objs[3] = ObjFromWideInt(recP->size);
+        objs[4] = ObjFromWideInt(recP->alloc_size);
+        objs[5] = ObjFromWideInt(recP->create_time);
+        objs[6] = ObjFromWideInt(recP->access_time);
+        objs[7] = ObjFromWideInt(recP->write_time);
+        objs[8] = ObjFromWideInt(recP->change_time);
+        objs[9] = ObjFromWideInt(recP->file_id);
+        objs[10] = ObjFromStringN(batchP->strings + recP->short_name,
+                                  recP->short_namelen);
+        objs[11] = TwapiFileScanSecurityObj(fsP, recP->sd);
+        ObjAppendElement(NULL, recsObj, ObjNewList(ARRAYSIZE(objs), objs));
+    }
+}
+
+static Tcl_Obj *TwapiFileScanStatsObj(TwapiFileScan *fsP)
+{
+    FtsStats stats;
+    Tcl_Obj *objs[16];
+
+    FtsScanStats(fsP->scanP, &stats);
+    objs[0] = STRING_LITERAL_OBJ("entries");
+    objs[1] = ObjFromWideInt(stats.entries);
+    objs[2] = STRING_LITERAL_OBJ("dirs");
+    objs[3] = ObjFromInt(stats.dirs);
+    objs[4] = STRING_LITERAL_OBJ("errors");
+    objs[5] = ObjFromInt(stats.errors);
+    objs[6] = STRING_LITERAL_OBJ("batches");
+    objs[7] = ObjFromInt(stats.batches);
+    objs[8] = STRING_LITERAL_OBJ("securitydescriptors");
+    objs[9] = ObjFromInt(stats.sds);
+    objs[10] = STRING_LITERAL_OBJ("securityerrors");
+    objs[11] = ObjFromInt(stats.sd_errors);
+    objs[12] = STRING_LITERAL_OBJ("steals");
+    objs[13] = ObjFromInt(stats.steals);
+    objs[14] = STRING_LITERAL_OBJ("threads");
+    objs[15] = ObjFromInt(stats.threads);
+    return ObjNewList(ARRAYSIZE(objs), objs);
+}
+
+static TwapiStorageInterpContext *TwapiFileScanSic(TwapiFileScan *fsP)
+{
+    return (TwapiStorageInterpContext *) fsP->ticP->module.data.pval;
+}
+
+/*
+ * Called in the interp thread with a batch, or at the end of the scan.
+ * Invokes _file_tree_scan_handler with
+ *   ID batch RECORDARRAY
+ *   ID done STATS
+ *   ID error WINERROR
+ */
+static int TwapiFileScanCallbackFn(TwapiCallback *cbP)
+{
+    TwapiFileScanCallback *fscP = (TwapiFileScanCallback *) cbP;
+    TwapiFileScan *fsP = fscP->fsP;
+    Tcl_Interp *interp = cbP->ticP->interp;
+    Tcl_Obj *objs[4];
+    int tcl_status = TCL_OK;
+
+    if (interp != NULL && Tcl_InterpDeleted(interp))
+        interp = NULL;
+    if (interp) {
+        objs[0] = STRING_LITERAL_OBJ(TWAPI_TCL_NAMESPACE "::_file_tree_scan_handler");
+        objs[1] = ObjFromTwapiId(fsP->id);
+        if (fscP->batchP) {
+            Tcl_Obj *raObjs[2];
+            raObjs[0] = TwapiFileScanFields();
+            raObjs[1] = ObjNewList(fscP->batchP->n, NULL);
+            TwapiFileScanRecords(fsP, fscP->batchP, raObjs[1]);
+            objs[2] = STRING_LITERAL_OBJ("batch");
+            objs[3] = ObjNewList(2, raObjs);
+        } else if (fsP->status == 0) {
+            objs[2] = STRING_LITERAL_OBJ("done");
+            objs[3] = TwapiFileScanStatsObj(fsP);
+        } else {
+            objs[2] = STRING_LITERAL_OBJ("error");
+            objs[3] = ObjFromLong(fsP->status);
+        }
+        tcl_status = TwapiEvalAndUpdateCallback(cbP, 4, objs, TRT_EMPTY);
+    }
+
+    if (fscP->batchP) {
+        FtsBatchFree(fscP->batchP);
+        fscP->batchP = NULL;
+    } else {
+        /* Last callback for the scan */
+        if (fsP->linked)
+            ZLIST_REMOVE(&TwapiFileScanSic(fsP)->file_scans, fsP);
+        if (! fsP->joined) {
+            int result;
+            Tcl_JoinThread(fsP->tid, &result);
+        }
+        TwapiFileScanFree(fsP);
+    }
+    return tcl_status;
+}
+
+static Tcl_ThreadCreateType TwapiFileScanThread(ClientData clientdata)
+{
+    TwapiFileScan *fsP = (TwapiFileScan *) clientdata;
+    TwapiFileScanCallback *fscP;
+
+    fsP->status = FtsScanRun(fsP->scanP);
+    fscP = (TwapiFileScanCallback *) TwapiCallbackNew(
+        fsP->ticP, TwapiFileScanCallbackFn, sizeof(*fscP));
+    fscP->fsP = fsP;
+    fscP->batchP = NULL;
+    TwapiEnqueueCallback(fsP->ticP, &fscP->cb, TWAPI_ENQUEUE_DIRECT, 0, NULL);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+static TCL_RESULT TwapiFileScanArgs(TwapiInterpContext *ticP, int objc,
+                                    Tcl_Obj *CONST objv[], int async,
+                                    TwapiFileScan **fsPP)
+{
+    Tcl_Obj *pathObj;
+    int nthreads, batch_size, max_depth, flags;
+
+    if (TwapiGetArgs(ticP->interp, objc-1, objv+1,
+                     GETOBJ(pathObj), GETINT(nthreads), GETINT(batch_size),
+                     GETINT(max_depth), GETINT(flags),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    *fsPP = TwapiFileScanNew(ticP, ObjToString(pathObj), nthreads,
+                             batch_size, max_depth, flags, async);
+    return TCL_OK;
+}
+
+/*
+ * Twapi_FileTreeScan PATH NTHREADS BATCHSIZE MAXDEPTH FLAGS
+ * Returns a recordarray with the entries below PATH, which are read by
+ * NTHREADS threads, by default one per processor. MAXDEPTH limits the
+ * levels returned if > 0. Security descriptors are retrieved if bit 0 of
+ * FLAGS is set.
+ */
+int Twapi_FileTreeScanObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiFileScan *fsP;
+    Tcl_Obj *objs[2];
+    int status;
+
+    if (TwapiFileScanArgs(ticP, objc, objv, 0, &fsP) != TCL_OK)
+        return TCL_ERROR;
+    status = FtsScanRun(fsP->scanP);
+    if (status) {
+        TwapiFileScanFree(fsP);
+        return Twapi_AppendSystemError(interp, status);
+    }
+    objs[0] = TwapiFileScanFields();
+    objs[1] = ObjNewList(0, NULL);
+    while (fsP->batches) {
+        FtsBatch *batchP = fsP->batches;
+        fsP->batches = batchP->next;
+        TwapiFileScanRecords(fsP, batchP, objs[1]);
+        FtsBatchFree(batchP);
+    }
+    TwapiFileScanFree(fsP);
+    return ObjSetResult(interp, ObjNewList(2, objs));
+}
+
+/*
+ * Twapi_FileTreeScanAsync PATH NTHREADS BATCHSIZE MAXDEPTH FLAGS
+ * As Twapi_FileTreeScan but scans in the background and returns an id.
+ * Batches of up to BATCHSIZE records are passed to
+ * _file_tree_scan_handler as they are filled.
+ */
+int Twapi_FileTreeScanAsyncObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiFileScan *fsP;
+
+    RETURN_ERROR_IF_UNTHREADED(interp);
+
+    if (TwapiFileScanArgs(ticP, objc, objv, 1, &fsP) != TCL_OK)
+        return TCL_ERROR;
+    fsP->id = TWAPI_NEWID(ticP);
+    if (Tcl_CreateThread(&fsP->tid, TwapiFileScanThread, fsP,
+                         TCL_THREAD_STACK_DEFAULT,
+                         TCL_THREAD_JOINABLE) != TCL_OK) {
+        TwapiFileScanFree(fsP);
+        return TwapiReturnError(interp, TWAPI_SYSTEM_ERROR);
+    }
+    ZLIST_PREPEND(&((TwapiStorageInterpContext *)ticP->module.data.pval)->file_scans, fsP);
+    fsP->linked = 1;
+    return ObjSetResult(interp, ObjFromTwapiId(fsP->id));
+}
+
+/*
+ * Twapi_FileTreeScanCancel ID
+ * Stops an asynchronous scan. Batches already queued are still delivered,
+ * followed by an error callback.
+ */
+int Twapi_FileTreeScanCancelObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiFileScan *fsP;
+    TwapiId id;
+
+    if (objc != 2)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    if (ObjToTwapiId(interp, objv[1], &id) != TCL_OK)
+        return TCL_ERROR;
+    ZLIST_LOCATE(fsP, &((TwapiStorageInterpContext *)ticP->module.data.pval)->file_scans, id, id);
+    if (fsP)
+        FtsScanCancel(fsP->scanP);
+    return TCL_OK;
+}
+
+/*
+ * Called when the interp is deleted. Stops the scans and waits for their
+ * threads. Their final callbacks free them.
+ */
+void TwapiShutdownFileScans(TwapiStorageInterpContext *sicP)
+{
+    TwapiFileScan *fsP;
+
+    while ((fsP = ZLIST_HEAD(&sicP->file_scans)) != NULL) {
+        int result;
+        ZLIST_REMOVE(&sicP->file_scans, fsP);
+        fsP->linked = 0;
+        FtsScanCancel(fsP->scanP);
+        Tcl_JoinThread(fsP->tid, &result);
+        fsP->joined = 1;
+    }
+}
+#endif /* _WIN32 */
+
+#ifdef FTSCAN_TEST
+/*
+ * Standalone test. Build with
+ *   cc -DTCL_THREADS=1 -DFTSCAN_TEST ftscan.c -ltcl
+ *
+ * Trees are created under a temporary directory by the script and the
+ * scan results compared with what glob and file stat report.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct TestCollector {
+    Tcl_Mutex lock;
+    FtsBatch *batches;
+    int max_batch;              /* Largest batch seen */
+    int cancel_after;           /* Cancel after this many batches if > 0 */
+    int nbatches;
+    FtsScan *scanP;
+} TestCollector;
+
+static void TestBatchProc(void *ctx, FtsBatch *batchP)
+{
+    TestCollector *tcP = (TestCollector *) ctx;
+    Tcl_MutexLock(&tcP->lock);
+    batchP->next = tcP->batches;
+    tcP->batches = batchP;
+    if (batchP->n > tcP->max_batch)
+        tcP->max_batch = batchP->n;
+    if (++tcP->nbatches == tcP->cancel_after)
+        FtsScanCancel(tcP->scanP);
+    Tcl_MutexUnlock(&tcP->lock);
+}
+
+/*
+ * fts scan PATH ?-threads N? ?-batchsize N? ?-depth N? ?-security?
+ *     ?-cancelafter N? ?-count?
+ * Returns a dict with the stats, the largest batch and the records as a
+ * list of {PATH DEPTH ATTRS SIZE SECURITY}, empty with -count, where
+ * SECURITY is {UID GID MODE} or empty. Errors are returned as {error CODE}.
+ */
+static int TestFtsObjCmd(ClientData cd, Tcl_Interp *interp, int objc,
+                         Tcl_Obj *const objv[])
+{
+    static const char *const opts[] = {
+        "-threads", "-batchsize", "-depth", "-security", "-cancelafter",
+        "-count", NULL
+    };
+    enum { THREADS, BATCHSIZE, DEPTH, SECURITY, CANCELAFTER, COUNT };
+    TestCollector tc;
+    FtsConfig cfg;
+    FtsStats stats;
+    FtsScan *scanP;
+    Tcl_Obj *resultObj, *recsObj;
+    int i, opt, status, count = 0;
+
+    (void) cd;
+    if (objc < 3 || strcmp(Tcl_GetString(objv[1]), "scan")) {
+        Tcl_WrongNumArgs(interp, 1, objv, "scan PATH ?OPTIONS?");
+        return TCL_ERROR;
+    }
+    memset(&cfg, 0, sizeof(cfg));
+    memset(&tc, 0, sizeof(tc));
+    cfg.backend = &FtsPosixBackend;
+    cfg.batch_proc = TestBatchProc;
+    cfg.batch_ctx = &tc;
+    cfg.nthreads = 1;
+    for (i = 3; i < objc; ++i) {
+        int *intP = NULL;
+        if (Tcl_GetIndexFromObj(interp, objv[i], opts, "option", 0,
+                                &opt) != TCL_OK)
+            return TCL_ERROR;
+        switch (opt) {
+        case THREADS: intP = &cfg.nthreads; break;
+        case BATCHSIZE: intP = &cfg.batch_size; break;
+        case DEPTH: intP = &cfg.max_depth; break;
+        case CANCELAFTER: intP = &tc.cancel_after; break;
+        case SECURITY: cfg.security = 1; break;
+        case COUNT: count = 1; break;
+        }
+        if (intP &&
+            (++i == objc || Tcl_GetIntFromObj(interp, objv[i], intP) != TCL_OK)) {
+            Tcl_SetResult(interp, "missing or bad option value", TCL_STATIC);
+            return TCL_ERROR;
+        }
+    }
+
+    scanP = FtsScanNew(&cfg, Tcl_GetString(objv[2]));
+    tc.scanP = scanP;
+    status = FtsScanRun(scanP);
+    FtsScanStats(scanP, &stats);
+
+    recsObj = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(recsObj);
+    while (tc.batches) {
+        FtsBatch *batchP = tc.batches;
+        tc.batches = batchP->next;
+        for (i = 0; ! count && i < batchP->n; ++i) {
+            FtsRecord *recP = &batchP->records[i];
+            const unsigned char *sd;
+            int sdlen;
+            Tcl_Obj *objs[5];
+            objs[0] = Tcl_NewStringObj(batchP->strings + recP->path,
+                                       recP->pathlen);
+            objs[1] = Tcl_NewIntObj(recP->depth);
+            objs[2] = Tcl_NewIntObj(recP->attrs);
+            objs[3] = Tcl_NewWideIntObj(recP->size);
+            objs[4] = Tcl_NewListObj(0, NULL);
+            if (FtsScanSecurity(scanP, recP->sd, &sd, &sdlen)) {
+                unsigned int v[3];
+                int j;
+                memcpy(v, sd, sizeof(v));
+                for (j = 0; j < 3; ++j)
+                    Tcl_ListObjAppendElement(NULL, objs[4],
+                                             Tcl_NewWideIntObj(v[j]));
+            }
+            Tcl_ListObjAppendElement(NULL, recsObj, Tcl_NewListObj(5, objs));
+        }
+        FtsBatchFree(batchP);
+    }
+    FtsScanFree(scanP);
+    Tcl_MutexFinalize(&tc.lock);
+
+    if (status) {
+        Tcl_DecrRefCount(recsObj);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("error %d", status));
+        return TCL_OK;
+    }
+    resultObj = Tcl_NewListObj(0, NULL);
+#define TESTSTAT(name_, val_)                                           \
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj(name_, -1)); \
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(val_))
+    TESTSTAT("entries", stats.entries);
+    TESTSTAT("dirs", stats.dirs);
+    TESTSTAT("errors", stats.errors);
+    TESTSTAT("batches", stats.batches);
+    TESTSTAT("sds", stats.sds);
+    TESTSTAT("steals", stats.steals);
+    TESTSTAT("threads", stats.threads);
+    TESTSTAT("maxbatch", tc.max_batch);
+#undef TESTSTAT
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("records", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, recsObj);
+    Tcl_DecrRefCount(recsObj);
+    Tcl_SetObjResult(interp, resultObj);
+    return TCL_OK;
+}
+
+static const char *testScript =
+    "proc check {script expected} {\n"
+    "    set code [catch {uplevel 1 $script} result]\n"
+    "    if {$code} {set result [list error $result]}\n"
+    "    if {$result ne $expected} {\n"
+    "        puts \"FAIL: $script\\n  got:      $result\\n  expected: $expected\"\n"
+    "        incr ::failures\n"
+    "    }\n"
+    "    incr ::checks\n"
+    "}\n"
+    "set failures 0; set checks 0\n"
+    "encoding system utf-8\n"
+    "set tmp [expr {[info exists env(TMPDIR)] ? $env(TMPDIR) : {/tmp}}]\n"
+    "proc mktree {dir depth fanout nfiles} {\n"
+    "    file mkdir $dir\n"
+    "    for {set i 0} {$i < $nfiles} {incr i} {\n"
+    "        set f [open $dir/f$i w]\n"
+    "        puts -nonewline $f [string repeat x $i]\n"
+    "        close $f\n"
+    "    }\n"
+    "    if {$depth > 0} {\n"
+    "        for {set i 0} {$i < $fanout} {incr i} {\n"
+    "            mktree $dir/d$i [expr {$depth - 1}] $fanout $nfiles\n"
+    "        }\n"
+    "    }\n"
+    "}\n"
+    /* {PATH DEPTH TYPE SIZE MODE} of everything below dir, by glob */
+    "proc expected {dir {prefix {}} {depth 1}} {\n"
+    "    set result {}\n"
+    "    foreach path [glob -nocomplain -directory $dir * .*] {\n"
+    "        set name [file tail $path]\n"
+    "        if {$name in {. ..}} continue\n"
+    "        file lstat $path st\n"
+    "        set size [expr {$st(type) eq {file} ? $st(size) : 0}]\n"
+    "        lappend result [list $prefix$name $depth $st(type) $size [expr {$st(mode) & 07777}]]\n"
+    "        if {$st(type) eq {directory}} {\n"
+    "            lappend result {*}[expected $path $prefix$name/ [expr {$depth + 1}]]\n"
+    "        }\n"
+    "    }\n"
+    "    return [lsort -index 0 $result]\n"
+    "}\n"
+    "proc summary {scan} {\n"
+    "    set result {}\n"
+    "    foreach rec [dict get $scan records] {\n"
+    "        lassign $rec path depth attrs size sd\n"
+    "        set type [expr {$attrs & 0x10 ? {directory} : $attrs & 0x400 ? {link} : {file}}]\n"
+    "        if {$type ne {file}} {set size 0}\n"
+    "        lappend result [list $path $depth $type $size [lindex $sd 2]]\n"
+    "    }\n"
+    "    return [lsort -index 0 $result]\n"
+    "}\n"
+    "set root $tmp/ftscan[pid]\n"
+    "file delete -force $root\n"
+    "mktree $root 3 3 5\n"
+    "close [open $root/d1/caf\\u00e9 w]\n"
+    "close [open $root/d2/.hidden w]\n"
+    "file attributes $root/f1 -permissions 0600\n"
+    "file attributes $root/d0/d1/f2 -permissions 0444\n"
+    "file link -symbolic $root/d0/up $root\n"
+    "set expected [expected $root]\n"
+    "check {llength $expected} 242\n"
+    "foreach n {1 2 4 8} {\n"
+    "    set scan [fts scan $root -threads $n -security]\n"
+    "    check {summary $scan} $expected\n"
+    "    check {dict get $scan dirs} 40\n"
+    "    check {dict get $scan threads} $n\n"
+    "}\n"
+    /* Distinct owner, group and mode combinations */
+    "set modes {}\n"
+    "foreach e $expected {dict set modes [lindex $e 4] {}}\n"
+    "check {dict get $scan sds} [dict size $modes]\n"
+    "check {dict get [fts scan $root] sds} 0\n"
+    "check {lsort -unique [lmap rec [dict get [fts scan $root] records] {lindex $rec 4}]} {{}}\n"
+    "set scan [fts scan $root]\n"
+    "foreach rec [dict get $scan records] {dict set attrs [lindex $rec 0] [lindex $rec 2]}\n"
+    "check {format %#x [dict get $attrs d0/up]} 0x400\n"
+    "check {format %#x [dict get $attrs d2/.hidden]} 0x2\n"
+    "check {format %#x [dict get $attrs d0/d1/f2]} 0x1\n"
+    "check {format %#x [dict get $attrs f0]} 0x80\n"
+    "check {format %#x [dict get $attrs d0]} 0x10\n"
+    /* Depth limits */
+    "check {llength [dict get [fts scan $root -depth 1] records]} 8\n"
+    "check {dict get [fts scan $root -depth 1 -threads 4] dirs} 1\n"
+    "check {summary [fts scan $root -depth 2 -threads 3 -security]} [lmap e $expected {\n"
+    "    if {[lindex $e 1] > 2} continue\n"
+    "    set e\n"
+    "}]\n"
+    /* Batching. One thread only passes on partial batches at the end. */
+    "set scan [fts scan $root -batchsize 7 -count]\n"
+    "check {dict get $scan batches} [expr {(242 + 6) / 7}]\n"
+    "check {dict get $scan maxbatch} 7\n"
+    "check {dict get $scan records} {}\n"
+    "foreach n {2 4 8} {\n"
+    "    set scan [fts scan $root -batchsize 7 -threads $n -count]\n"
+    "    check {expr {[dict get $scan maxbatch] <= 7}} 1\n"
+    "    check {dict get $scan entries} 242\n"
+    "    check {expr {[dict get $scan batches] >= 35}} 1\n"
+    "}\n"
+    "check {dict get [fts scan $root -batchsize 100000 -count] batches} 1\n"
+    /* Errors */
+    "check {fts scan $root/nosuch} {error 2}\n"
+    "check {fts scan $root/f0} {error 20}\n"
+    "check {fts scan $root -batchsize 1 -cancelafter 5} {error 1223}\n"
+    "check {fts scan $root -batchsize 1 -cancelafter 5 -threads 4} {error 1223}\n"
+    "check {dict get [fts scan $root/d0/d0/d0] entries} 5\n"
+    "check {dict get [fts scan $root/d0/d0/d0/] entries} 5\n"
+    "check {lsort [lmap rec [dict get [fts scan $root/d0/d0/] records] {lindex $rec 0}]} [lmap e [expected $root/d0/d0] {lindex $e 0}]\n"
+    "file attributes $root/d1/d0 -permissions 0\n"
+    "if {! [file readable $root/d1/d0]} {\n"
+    "    foreach n {1 4} {\n"
+    "        set scan [fts scan $root -threads $n -count]\n"
+    "        check {dict get $scan errors} 1\n"
+    "        check {dict get $scan entries} [expr {242 - 23}]\n"
+    "    }\n"
+    "}\n"
+    "file attributes $root/d1/d0 -permissions 0755\n"
+    "file delete -force $root\n"
+    "puts \"[set checks] checks, [set failures] failures\"\n"
+    "set failures\n";
+
+static const char *benchScript =
+    "proc bench {label script {n 1}} {\n"
+    "    set t [lindex [uplevel 1 [list time $script $n]] 0]\n"
+    "    puts [format {%-44s %12.1f ms} $label [expr {$t / 1000.0}]]\n"
+    "}\n"
+    "proc script_scan {dir} {\n"
+    "    set n 0\n"
+    "    foreach path [glob -nocomplain -directory $dir * .*] {\n"
+    "        if {[file tail $path] in {. ..}} continue\n"
+    "        file lstat $path st\n"
+    "        incr n\n"
+    "        if {$st(type) eq {directory}} {incr n [script_scan $path]}\n"
+    "    }\n"
+    "    return $n\n"
+    "}\n"
+    "set root $tmp/ftscan[pid]\n"
+    "file delete -force $root\n"
+    /* 6 levels, fan out 6, 20 files per directory */
+    "mktree $root 4 6 20\n"
+    "set n [script_scan $root]\n"
+    "puts \"$n entries\"\n"
+    "foreach t {1 2 4 8} {check {dict get [fts scan $root -threads $t -count] entries} $n}\n"
+    "bench {glob and file lstat} {script_scan $root} 3\n"
+    "foreach t {1 2 4 8} {\n"
+    "    bench \"scan, $t threads\" {fts scan $root -threads $t -count} 5\n"
+    "}\n"
+    "foreach t {1 8} {\n"
+    "    bench \"scan with security, $t threads\" {fts scan $root -threads $t -count -security} 5\n"
+    "}\n"
+    "foreach t {1 8} {\n"
+    "    bench \"scan with records, $t threads\" {fts scan $root -threads $t} 3\n"
+    "}\n"
+    "foreach b {1 100 10000} {\n"
+    "    bench \"scan, batches of $b, 4 threads\" {fts scan $root -threads 4 -count -batchsize $b} 3\n"
+    "}\n"
+    "puts [dict remove [fts scan $root -threads 8 -count -security] records]\n"
+    "file delete -force $root\n"
+    "if {[file isdirectory /usr]} {\n"
+    "    puts \"/usr: [dict remove [fts scan /usr -threads 1 -count] records]\"\n"
+    "    foreach t {1 4 8} {\n"
+    "        bench \"scan /usr, $t threads\" {fts scan /usr -threads $t -count} 3\n"
+    "    }\n"
+    "}\n"
+    "puts \"$checks checks, $failures failures\"\n"
+    "set failures\n";
+
+int main(int argc, char **argv)
+{
+    Tcl_Interp *interp;
+    int failures;
+
+    Tcl_FindExecutable(argv[0]);
+    interp = Tcl_CreateInterp();
+    Tcl_CreateObjCommand(interp, "fts", TestFtsObjCmd, NULL, NULL);
+
+    if (Tcl_Eval(interp, testScript) != TCL_OK ||
+        (argc > 1 && strcmp(argv[1], "bench") == 0 &&
+         Tcl_Eval(interp, benchScript) != TCL_OK)) {
+        fprintf(stderr, "%s\n", Tcl_GetStringResult(interp));
+        return 1;
+    }
+    failures = atoi(Tcl_GetStringResult(interp));
+    Tcl_DeleteInterp(interp);
+    return failures ? 1 : 0;
+}
+#endif /* FTSCAN_TEST */
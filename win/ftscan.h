@@ -0,0 +1,197 @@
+#ifndef FTSCAN_H
+#define FTSCAN_H
+
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Parallel file tree scanner. Directories are read through a backend
+ * that returns many entries per call, FileIdBothDirectoryInfo on Windows
+ * and getdents64 elsewhere. Directories are scanned by a pool of threads,
+ * each with its own queue of subdirectories to scan. Threads with nothing
+ * left in their own queue steal from the others so deep or lopsided trees
+ * keep all threads busy.
+ *
+ * Entries are returned in batches of records from the scanning threads.
+ * Optionally the security information of each entry is retrieved. Since
+ * most entries in a tree share a few descriptors, these are stored once
+ * per scan, identified by hash, and records only hold an index.
+ *
+ * The scheduler and batching only depend on Tcl so they can be tested
+ * and benchmarked with the POSIX backend on any platform.
+ */
+
+#include <tcl.h>
+
+/* Error codes. Defaults match the corresponding Windows errors. */
+#ifndef FTS_E_NOMEM
+#define FTS_E_NOMEM      8      /* ERROR_NOT_ENOUGH_MEMORY */
+#endif
+#ifndef FTS_E_CANCELLED
+#define FTS_E_CANCELLED  1223   /* ERROR_CANCELLED */
+#endif
+
+/* Attribute bits, same as FILE_ATTRIBUTE_* */
+#define FTS_ATTR_READONLY      0x0001
+#define FTS_ATTR_HIDDEN        0x0002
+#define FTS_ATTR_DIRECTORY     0x0010
+#define FTS_ATTR_NORMAL        0x0080
+#define FTS_ATTR_REPARSE_POINT 0x0400
+
+#define FTS_MAX_THREADS 64
+#define FTS_MAX_DEPTH   1024
+
+/*
+ * An entry as returned by a backend. Times are in FILETIME units. The
+ * strings are UTF-8 and remain valid until the next read call.
+ */
+typedef struct FtsEntry {
+    Tcl_WideInt file_id;
+    Tcl_WideInt size;
+    Tcl_WideInt alloc_size;
+    Tcl_WideInt create_time;
+    Tcl_WideInt access_time;
+    Tcl_WideInt write_time;
+    Tcl_WideInt change_time;
+    unsigned int attrs;
+    int descend;                /* Directory to scan, not a link */
+    const char *name;
+    int namelen;
+    const char *short_name;     /* 8.3 name, may be empty */
+    int short_namelen;
+    const void *native;         /* For the backend's security proc */
+} FtsEntry;
+
+/* Buffer for security information. Grown with FtsBufReserve. */
+typedef struct FtsBuf {
+    unsigned char *p;
+    int len;
+    int size;
+} FtsBuf;
+
+void FtsBufReserve(FtsBuf *bufP, int size);
+
+/*
+ * Directory access. All procedures are called from scanning threads, with
+ * any one directory handle only used by one thread at a time.
+ *  open - opens the directory at the nul terminated path. Returns a
+ *      handle, or NULL with an error code in *errP.
+ *  read - stores up to max entries in entries[]. Returns the number
+ *      stored, 0 at the end or -1 with an error code in *errP. The "."
+ *      and ".." entries are skipped by the caller.
+ *  close - closes a handle returned by open.
+ *  security - optional. Stores the security information for an entry
+ *      from the last read in bufP->p and its length in bufP->len. Returns
+ *      0 or an error code.
+ */
+typedef struct FtsBackend {
+    const char *name;
+    char sep;                   /* Path separator */
+    void *(*open)(void *ctx, const char *path, int *errP);
+    int (*read)(void *ctx, void *dir, FtsEntry *entries, int max, int *errP);
+    void (*close)(void *ctx, void *dir);
+    int (*security)(void *ctx, void *dir, const FtsEntry *entryP,
+                    FtsBuf *bufP);
+} FtsBackend;
+
+/*
+ * A record in a batch. Paths are relative to the scanned directory and
+ * stored in the batch strings. depth is 1 for entries in the scanned
+ * directory. sd is an index for FtsScanSecurity or -1 if not retrieved.
+ */
+typedef struct FtsRecord {
+    Tcl_WideInt file_id;
+    Tcl_WideInt size;
+    Tcl_WideInt alloc_size;
+    Tcl_WideInt create_time;
+    Tcl_WideInt access_time;
+    Tcl_WideInt write_time;
+    Tcl_WideInt change_time;
+    unsigned int attrs;
+    int depth;
+    int sd;
+    int path;                   /* Offset of path in strings */
+    int pathlen;
+    int short_name;             /* Offset of short name in strings */
+    int short_namelen;
+} FtsRecord;
+
+typedef struct FtsBatch {
+    struct FtsBatch *next;      /* For use by the batch proc */
+    int n;
+    int size;
+    FtsRecord *records;
+    char *strings;              /* Nul terminated strings */
+    int strings_len;
+    int strings_size;
+} FtsBatch;
+
+void FtsBatchFree(FtsBatch *batchP);
+
+/*
+ * Called from the scanning threads, concurrently, with a full batch or
+ * the last one of a thread. The procedure takes ownership of the batch.
+ */
+typedef void FtsBatchProc(void *ctx, FtsBatch *batchP);
+
+typedef struct FtsConfig {
+    const FtsBackend *backend;
+    void *backend_ctx;
+    FtsBatchProc *batch_proc;
+    void *batch_ctx;
+    int nthreads;               /* Including the calling thread */
+    int batch_size;             /* Records per batch */
+    int max_depth;              /* Deepest level reported, <= 0 for all */
+    int security;               /* Retrieve security information */
+} FtsConfig;
+
+typedef struct FtsStats {
+    Tcl_WideInt entries;
+    int dirs;                   /* Directories read */
+    int errors;                 /* Directories that could not be read */
+    int batches;
+    int sds;                    /* Distinct security descriptors */
+    int sd_errors;              /* Entries whose security was not read */
+    int steals;                 /* Directories scanned by another thread */
+    int threads;                /* Threads actually used */
+} FtsStats;
+
+typedef struct FtsScan FtsScan;
+
+FtsScan *FtsScanNew(const FtsConfig *cfgP, const char *path);
+void FtsScanFree(FtsScan *scanP);
+
+/*
+ * Scans the tree, blocking until all batches have been passed to the
+ * batch proc. Returns 0, the error opening the starting directory or
+ * FTS_E_CANCELLED. Errors reading subdirectories are only counted.
+ */
+int FtsScanRun(FtsScan *scanP);
+
+/* Makes FtsScanRun return as soon as possible. May be called from any thread. */
+void FtsScanCancel(FtsScan *scanP);
+
+/* May be called from any thread, also while the scan is running */
+void FtsScanStats(FtsScan *scanP, FtsStats *statsP);
+
+/*
+ * Stores a pointer to the security information with the given index, and
+ * its length, in *dataP and *lenP. Returns 0 if there is no such index.
+ * The data remains valid until the scan is freed.
+ */
+int FtsScanSecurity(FtsScan *scanP, int index, const unsigned char **dataP,
+                    int *lenP);
+
+#ifndef _WIN32
+/*
+ * Backend using getdents64 on Linux and readdir elsewhere, with lstat for
+ * the entry information. Times, sizes and attributes are mapped to their
+ * Windows equivalents. The security information of an entry is its owner,
+ * group and permission bits as three 32-bit integers.
+ */
+extern const FtsBackend FtsPosixBackend;
+#endif
+
+#endif /* FTSCAN_H */
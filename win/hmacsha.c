@@ -0,0 +1,868 @@
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Native HMAC-SHA1/SHA256/SHA512 for PBKDF2. The key is absorbed into
+ * the inner and outer hash states once so each PBKDF2 iteration costs
+ * exactly two compression function calls on preformatted blocks. On x86
+ * processors with the SHA extensions, SHA-1 and SHA-256 use them.
+ *
+ * Build with -DHMACSHA_TEST to get a standalone test and benchmark
+ * driver (see end of file).
+ */
+
+#include <string.h>
+#include "hmacsha.h"
+
+#if (defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)) \
+    && ((defined(_MSC_VER) && _MSC_VER >= 1900) || defined(__GNUC__))
+# define HMACSHA_SHANI 1
+# include <immintrin.h>
+# ifdef _MSC_VER
+#  include <intrin.h>
+#  define HMACSHA_TARGET
+# else
+#  include <cpuid.h>
+#  define HMACSHA_TARGET __attribute__((target("sha,ssse3,sse4.1")))
+# endif
+#endif
+
+typedef void HmacShaCompressFn(HmacShaState *stP, const unsigned char *data,
+                               size_t nblocks);
+
+typedef struct HmacShaAlgDef {
+    unsigned int hlen;
+    unsigned int blocklen;
+    unsigned int lenbytes;      /* Size of length field in final block */
+    HmacShaCompressFn *compress;
+    void (*init)(HmacShaState *stP);
+    void (*output)(const HmacShaState *stP, unsigned char *digest);
+} HmacShaAlgDef;
+
+/* Streaming context for messages of arbitrary length */
+typedef struct HmacShaCtx {
+    const HmacShaAlgDef *defP;
+    HmacShaState st;
+    hmacsha_u64 total;
+    unsigned int buflen;
+    unsigned char buf[HMACSHA_MAX_BLOCK];
+} HmacShaCtx;
+
+/* -1 -> not yet checked, 0 -> not available, 1 -> available */
+static int hmacShaAccel = -1;
+
+#define ROTL32(x_, n_) (((x_) << (n_)) | ((x_) >> (32 - (n_))))
+#define ROTR32(x_, n_) (((x_) >> (n_)) | ((x_) << (32 - (n_))))
+#define ROTR64(x_, n_) (((x_) >> (n_)) | ((x_) << (64 - (n_))))
+
+static hmacsha_u32 GetBE32(const unsigned char *p)
+{
+    return ((hmacsha_u32)p[0] << 24) | ((hmacsha_u32)p[1] << 16)
+        | ((hmacsha_u32)p[2] << 8) | p[3];
+}
+
+static void PutBE32(unsigned char *p, hmacsha_u32 v)
+{
+    p[0] = (unsigned char) (v >> 24);
+    p[1] = (unsigned char) (v >> 16);
+    p[2] = (unsigned char) (v >> 8);
+    p[3] = (unsigned char) v;
+}
+
+static hmacsha_u64 GetBE64(const unsigned char *p)
+{
+    return ((hmacsha_u64) GetBE32(p) << 32) | GetBE32(p + 4);
+}
+
+static void PutBE64(unsigned char *p, hmacsha_u64 v)
+{
+    PutBE32(p, (hmacsha_u32) (v >> 32));
+    PutBE32(p + 4, (hmacsha_u32) v);
+}
+
+int HmacShaAccelerated(void)
+{
+#ifdef HMACSHA_SHANI
+    if (hmacShaAccel < 0) {
+        int regs[4];
+        int accel = 0;
+# ifdef _MSC_VER
+        __cpuid(regs, 0);
+        if (regs[0] >= 7) {
+            int ecx1;
+            __cpuid(regs, 1);
+            ecx1 = regs[2];
+            __cpuidex(regs, 7, 0);
+            /* SHA (leaf 7 EBX bit 29), SSSE3 (ECX bit 9), SSE4.1 (ECX bit 19) */
+            accel = (regs[1] & (1 << 29)) && (ecx1 & (1 << 9)) && (ecx1 & (1 << 19));
+        }
+# else
+        unsigned int a, b, c, d, ecx1;
+        if (__get_cpuid(1, &a, &b, &c, &d)) {
+            ecx1 = c;
+            if (__get_cpuid_max(0, NULL) >= 7) {
+                __cpuid_count(7, 0, a, b, c, d);
+                accel = (b & (1u << 29)) && (ecx1 & (1u << 9)) && (ecx1 & (1u << 19));
+            }
+        }
+        (void) regs;
+# endif
+        /* Benign race - all threads compute the same value */
+        hmacShaAccel = accel;
+    }
+    return hmacShaAccel;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * SHA-1
+ */
+
+static void Sha1Init(HmacShaState *stP)
+{
+    stP->s32[0] = 0x67452301;
+    stP->s32[1] = 0xefcdab89;
+    stP->s32[2] = 0x98badcfe;
+    stP->s32[3] = 0x10325476;
+    stP->s32[4] = 0xc3d2e1f0;
+}
+
+static void Sha1Output(const HmacShaState *stP, unsigned char *digest)
+{
+    int i;
+    for (i = 0; i < 5; ++i)
+        PutBE32(digest + 4*i, stP->s32[i]);
+}
+
+static void Sha1CompressC(HmacShaState *stP, const unsigned char *data,
+                          size_t nblocks)
+{
+    hmacsha_u32 w[80];
+    hmacsha_u32 a, b, c, d, e, t;
+    int i;
+
+    while (nblocks--) {
+        for (i = 0; i < 16; ++i)
+            w[i] = GetBE32(data + 4*i);
+        for (; i < 80; ++i) {
+            t = w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16];
+            w[i] = ROTL32(t, 1);
+        }
+        a = stP->s32[0]; b = stP->s32[1]; c = stP->s32[2];
+        d = stP->s32[3]; e = stP->s32[4];
+        for (i = 0; i < 80; ++i) {
+            if (i < 20)
+                t = ((b & c) | (~b & d)) + 0x5a827999;
+            else if (i < 40)
+                t = (b ^ c ^ d) + 0x6ed9eba1;
+            else if (i < 60)
+                t = ((b & c) | (b & d) | (c & d)) + 0x8f1bbcdc;
+            else
+                t = (b ^ c ^ d) + 0xca62c1d6;
+            t += ROTL32(a, 5) + e + w[i];
+            e = d; d = c; c = ROTL32(b, 30); b = a; a = t;
+        }
+        stP->s32[0] += a; stP->s32[1] += b; stP->s32[2] += c;
+        stP->s32[3] += d; stP->s32[4] += e;
+        data += 64;
+    }
+}
+
+#ifdef HMACSHA_SHANI
+/* Four rounds of SHA-1 using group j (0-19) of the message schedule */
+#define SHA1NI_GROUP(j_, f_)                                            \
+    do {                                                                \
+        if ((j_) < 4) {                                                 \
+            m[(j_)] = _mm_shuffle_epi8(                                 \
+                _mm_loadu_si128((const __m128i *)(data + 16*(j_))), mask); \
+        } else {                                                        \
+            m[(j_)&3] = _mm_sha1msg2_epu32(                             \
+                _mm_xor_si128(_mm_sha1msg1_epu32(m[(j_)&3], m[((j_)-3)&3]), \
+                              m[((j_)-2)&3]),                           \
+                m[((j_)-1)&3]);                                         \
+        }                                                               \
+        if ((j_) == 0)                                                  \
+            e = _mm_add_epi32(e0, m[0]);                                \
+        else                                                            \
+            e = _mm_sha1nexte_epu32(esave, m[(j_)&3]);                  \
+        esave = abcd;                                                   \
+        abcd = _mm_sha1rnds4_epu32(abcd, e, (f_));                      \
+    } while (0)
+
+static HMACSHA_TARGET void Sha1CompressShaNi(
+    HmacShaState *stP, const unsigned char *data, size_t nblocks)
+{
+    __m128i abcd, e0, e, esave, abcd_save, e0_save;
+    __m128i m[4];
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607LL,
+                                        0x08090a0b0c0d0e0fLL);
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) stP->s32), 0x1b);
+    e0 = _mm_set_epi32((int) stP->s32[4], 0, 0, 0);
+
+    while (nblocks--) {
+        abcd_save = abcd;
+        e0_save = e0;
+        SHA1NI_GROUP(0, 0);  SHA1NI_GROUP(1, 0);  SHA1NI_GROUP(2, 0);
+        SHA1NI_GROUP(3, 0);  SHA1NI_GROUP(4, 0);
+        SHA1NI_GROUP(5, 1);  SHA1NI_GROUP(6, 1);  SHA1NI_GROUP(7, 1);
+        SHA1NI_GROUP(8, 1);  SHA1NI_GROUP(9, 1);
+        SHA1NI_GROUP(10, 2); SHA1NI_GROUP(11, 2); SHA1NI_GROUP(12, 2);
+        SHA1NI_GROUP(13, 2); SHA1NI_GROUP(14, 2);
+        SHA1NI_GROUP(15, 3); SHA1NI_GROUP(16, 3); SHA1NI_GROUP(17, 3);
+        SHA1NI_GROUP(18, 3); SHA1NI_GROUP(19, 3);
+        e0 = _mm_sha1nexte_epu32(esave, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+        data += 64;
+    }
+
+    abcd = _mm_shuffle_epi32(abcd, 0x1b);
+    _mm_storeu_si128((__m128i *) stP->s32, abcd);
+    stP->s32[4] = (hmacsha_u32) _mm_extract_epi32(e0, 3);
+}
+#endif
+
+static void Sha1Compress(HmacShaState *stP, const unsigned char *data,
+                         size_t nblocks)
+{
+#ifdef HMACSHA_SHANI
+    if (HmacShaAccelerated()) {
+        Sha1CompressShaNi(stP, data, nblocks);
+        return;
+    }
+#endif
+    Sha1CompressC(stP, data, nblocks);
+}
+
+/*
+ * SHA-256
+ */
+
+static const hmacsha_u32 sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void Sha256Init(HmacShaState *stP)
+{
+    stP->s32[0] = 0x6a09e667;
+    stP->s32[1] = 0xbb67ae85;
+    stP->s32[2] = 0x3c6ef372;
+    stP->s32[3] = 0xa54ff53a;
+    stP->s32[4] = 0x510e527f;
+    stP->s32[5] = 0x9b05688c;
+    stP->s32[6] = 0x1f83d9ab;
+    stP->s32[7] = 0x5be0cd19;
+}
+
+static void Sha256Output(const HmacShaState *stP, unsigned char *digest)
+{
+    int i;
+    for (i = 0; i < 8; ++i)
+        PutBE32(digest + 4*i, stP->s32[i]);
+}
+
+static void Sha256CompressC(HmacShaState *stP, const unsigned char *data,
+                            size_t nblocks)
+{
+    hmacsha_u32 w[64];
+    hmacsha_u32 a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    while (nblocks--) {
+        for (i = 0; i < 16; ++i)
+            w[i] = GetBE32(data + 4*i);
+        for (; i < 64; ++i) {
+            hmacsha_u32 s0 = ROTR32(w[i-15], 7) ^ ROTR32(w[i-15], 18) ^ (w[i-15] >> 3);
+            hmacsha_u32 s1 = ROTR32(w[i-2], 17) ^ ROTR32(w[i-2], 19) ^ (w[i-2] >> 10);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+        a = stP->s32[0]; b = stP->s32[1]; c = stP->s32[2]; d = stP->s32[3];
+        e = stP->s32[4]; f = stP->s32[5]; g = stP->s32[6]; h = stP->s32[7];
+        for (i = 0; i < 64; ++i) {
+            t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25))
+                + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+            t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22))
+                + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        stP->s32[0] += a; stP->s32[1] += b; stP->s32[2] += c; stP->s32[3] += d;
+        stP->s32[4] += e; stP->s32[5] += f; stP->s32[6] += g; stP->s32[7] += h;
+        data += 64;
+    }
+}
+
+#ifdef HMACSHA_SHANI
+static HMACSHA_TARGET void Sha256CompressShaNi(
+    HmacShaState *stP, const unsigned char *data, size_t nblocks)
+{
+    __m128i state0, state1, msg, tmp, abef_save, cdgh_save;
+    __m128i m[4];
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bLL,
+                                        0x0405060700010203LL);
+    int j;
+
+    /* Rearrange state into the ABEF/CDGH layout the instructions need */
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &stP->s32[0]), 0xb1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &stP->s32[4]), 0x1b);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    while (nblocks--) {
+        abef_save = state0;
+        cdgh_save = state1;
+        for (j = 0; j < 16; ++j) {
+            if (j < 4) {
+                m[j] = _mm_shuffle_epi8(
+                    _mm_loadu_si128((const __m128i *) (data + 16*j)), mask);
+            } else {
+                m[j&3] = _mm_sha256msg2_epu32(
+                    _mm_add_epi32(_mm_sha256msg1_epu32(m[j&3], m[(j-3)&3]),
+                                  _mm_alignr_epi8(m[(j-1)&3], m[(j-2)&3], 4)),
+                    m[(j-1)&3]);
+            }
+            msg = _mm_add_epi32(m[j&3],
+                                _mm_loadu_si128((const __m128i *) &sha256K[4*j]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1,
+                                           _mm_shuffle_epi32(msg, 0x0e));
+        }
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+        data += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i *) &stP->s32[0], state0);
+    _mm_storeu_si128((__m128i *) &stP->s32[4], state1);
+}
+#endif
+
+static void Sha256Compress(HmacShaState *stP, const unsigned char *data,
+                           size_t nblocks)
+{
+#ifdef HMACSHA_SHANI
+    if (HmacShaAccelerated()) {
+        Sha256CompressShaNi(stP, data, nblocks);
+        return;
+    }
+#endif
+    Sha256CompressC(stP, data, nblocks);
+}
+
+/*
+ * SHA-512
+ */
+
+#define U64C(hi_, lo_) (((hmacsha_u64)(hi_) << 32) | (lo_))
+
+static const hmacsha_u64 sha512K[80] = {
+    U64C(0x428a2f98, 0xd728ae22), U64C(0x71374491, 0x23ef65cd),
+    U64C(0xb5c0fbcf, 0xec4d3b2f), U64C(0xe9b5dba5, 0x8189dbbc),
+    U64C(0x3956c25b, 0xf348b538), U64C(0x59f111f1, 0xb605d019),
+    U64C(0x923f82a4, 0xaf194f9b), U64C(0xab1c5ed5, 0xda6d8118),
+    U64C(0xd807aa98, 0xa3030242), U64C(0x12835b01, 0x45706fbe),
+    U64C(0x243185be, 0x4ee4b28c), U64C(0x550c7dc3, 0xd5ffb4e2),
+    U64C(0x72be5d74, 0xf27b896f), U64C(0x80deb1fe, 0x3b1696b1),
+    U64C(0x9bdc06a7, 0x25c71235), U64C(0xc19bf174, 0xcf692694),
+    U64C(0xe49b69c1, 0x9ef14ad2), U64C(0xefbe4786, 0x384f25e3),
+    U64C(0x0fc19dc6, 0x8b8cd5b5), U64C(0x240ca1cc, 0x77ac9c65),
+    U64C(0x2de92c6f, 0x592b0275), U64C(0x4a7484aa, 0x6ea6e483),
+    U64C(0x5cb0a9dc, 0xbd41fbd4), U64C(0x76f988da, 0x831153b5),
+    U64C(0x983e5152, 0xee66dfab), U64C(0xa831c66d, 0x2db43210),
+    U64C(0xb00327c8, 0x98fb213f), U64C(0xbf597fc7, 0xbeef0ee4),
+    U64C(0xc6e00bf3, 0x3da88fc2), U64C(0xd5a79147, 0x930aa725),
+    U64C(0x06ca6351, 0xe003826f), U64C(0x14292967, 0x0a0e6e70),
+    U64C(0x27b70a85, 0x46d22ffc), U64C(0x2e1b2138, 0x5c26c926),
+    U64C(0x4d2c6dfc, 0x5ac42aed), U64C(0x53380d13, 0x9d95b3df),
+    U64C(0x650a7354, 0x8baf63de), U64C(0x766a0abb, 0x3c77b2a8),
+    U64C(0x81c2c92e, 0x47edaee6), U64C(0x92722c85, 0x1482353b),
+    U64C(0xa2bfe8a1, 0x4cf10364), U64C(0xa81a664b, 0xbc423001),
+    U64C(0xc24b8b70, 0xd0f89791), U64C(0xc76c51a3, 0x0654be30),
+    U64C(0xd192e819, 0xd6ef5218), U64C(0xd6990624, 0x5565a910),
+    U64C(0xf40e3585, 0x5771202a), U64C(0x106aa070, 0x32bbd1b8),
+    U64C(0x19a4c116, 0xb8d2d0c8), U64C(0x1e376c08, 0x5141ab53),
+    U64C(0x2748774c, 0xdf8eeb99), U64C(0x34b0bcb5, 0xe19b48a8),
+    U64C(0x391c0cb3, 0xc5c95a63), U64C(0x4ed8aa4a, 0xe3418acb),
+    U64C(0x5b9cca4f, 0x7763e373), U64C(0x682e6ff3, 0xd6b2b8a3),
+    U64C(0x748f82ee, 0x5defb2fc), U64C(0x78a5636f, 0x43172f60),
+    U64C(0x84c87814, 0xa1f0ab72), U64C(0x8cc70208, 0x1a6439ec),
+    U64C(0x90befffa, 0x23631e28), U64C(0xa4506ceb, 0xde82bde9),
+    U64C(0xbef9a3f7, 0xb2c67915), U64C(0xc67178f2, 0xe372532b),
+    U64C(0xca273ece, 0xea26619c), U64C(0xd186b8c7, 0x21c0c207),
+    U64C(0xeada7dd6, 0xcde0eb1e), U64C(0xf57d4f7f, 0xee6ed178),
+    U64C(0x06f067aa, 0x72176fba), U64C(0x0a637dc5, 0xa2c898a6),
+    U64C(0x113f9804, 0xbef90dae), U64C(0x1b710b35, 0x131c471b),
+    U64C(0x28db77f5, 0x23047d84), U64C(0x32caab7b, 0x40c72493),
+    U64C(0x3c9ebe0a, 0x15c9bebc), U64C(0x431d67c4, 0x9c100d4c),
+    U64C(0x4cc5d4be, 0xcb3e42b6), U64C(0x597f299c, 0xfc657e2a),
+    U64C(0x5fcb6fab, 0x3ad6faec), U64C(0x6c44198c, 0x4a475817)
+};
+
+static void Sha512Init(HmacShaState *stP)
+{
+    stP->s64[0] = U64C(0x6a09e667, 0xf3bcc908);
+    stP->s64[1] = U64C(0xbb67ae85, 0x84caa73b);
+    stP->s64[2] = U64C(0x3c6ef372, 0xfe94f82b);
+    stP->s64[3] = U64C(0xa54ff53a, 0x5f1d36f1);
+    stP->s64[4] = U64C(0x510e527f, 0xade682d1);
+    stP->s64[5] = U64C(0x9b05688c, 0x2b3e6c1f);
+    stP->s64[6] = U64C(0x1f83d9ab, 0xfb41bd6b);
+    stP->s64[7] = U64C(0x5be0cd19, 0x137e2179);
+}
+
+static void Sha512Output(const HmacShaState *stP, unsigned char *digest)
+{
+    int i;
+    for (i = 0; i < 8; ++i)
+        PutBE64(digest + 8*i, stP->s64[i]);
+}
+
+static void Sha512Compress(HmacShaState *stP, const unsigned char *data,
+                           size_t nblocks)
+{
+    hmacsha_u64 w[80];
+    hmacsha_u64 a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    while (nblocks--) {
+        for (i = 0; i < 16; ++i)
+            w[i] = GetBE64(data + 8*i);
+        for (; i < 80; ++i) {
+            hmacsha_u64 s0 = ROTR64(w[i-15], 1) ^ ROTR64(w[i-15], 8) ^ (w[i-15] >> 7);
+            hmacsha_u64 s1 = ROTR64(w[i-2], 19) ^ ROTR64(w[i-2], 61) ^ (w[i-2] >> 6);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+        a = stP->s64[0]; b = stP->s64[1]; c = stP->s64[2]; d = stP->s64[3];
+        e = stP->s64[4]; f = stP->s64[5]; g = stP->s64[6]; h = stP->s64[7];
+        for (i = 0; i < 80; ++i) {
+            t1 = h + (ROTR64(e, 14) ^ ROTR64(e, 18) ^ ROTR64(e, 41))
+                + ((e & f) ^ (~e & g)) + sha512K[i] + w[i];
+            t2 = (ROTR64(a, 28) ^ ROTR64(a, 34) ^ ROTR64(a, 39))
+                + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        stP->s64[0] += a; stP->s64[1] += b; stP->s64[2] += c; stP->s64[3] += d;
+        stP->s64[4] += e; stP->s64[5] += f; stP->s64[6] += g; stP->s64[7] += h;
+        data += 128;
+    }
+}
+
+static const HmacShaAlgDef hmacShaAlgs[] = {
+    {20, 64, 8, Sha1Compress, Sha1Init, Sha1Output},
+    {32, 64, 8, Sha256Compress, Sha256Init, Sha256Output},
+    {64, 128, 16, Sha512Compress, Sha512Init, Sha512Output},
+};
+
+static const HmacShaAlgDef *HmacShaGetAlgDef(int alg)
+{
+    if (alg < HMACSHA_SHA1 || alg > HMACSHA_SHA512)
+        return NULL;
+    return &hmacShaAlgs[alg - HMACSHA_SHA1];
+}
+
+unsigned int HmacShaDigestSize(int alg)
+{
+    const HmacShaAlgDef *defP = HmacShaGetAlgDef(alg);
+    return defP ? defP->hlen : 0;
+}
+
+/*
+ * Streaming interface. The context may be started from a saved state
+ * that has already absorbed some number of whole blocks.
+ */
+
+static void HmacShaCtxStart(HmacShaCtx *ctxP, const HmacShaAlgDef *defP,
+                            const HmacShaState *stP, hmacsha_u64 total)
+{
+    ctxP->defP = defP;
+    if (stP)
+        ctxP->st = *stP;
+    else
+        defP->init(&ctxP->st);
+    ctxP->total = total;
+    ctxP->buflen = 0;
+}
+
+static void HmacShaCtxUpdate(HmacShaCtx *ctxP, const unsigned char *data,
+                             size_t len)
+{
+    unsigned int blocklen = ctxP->defP->blocklen;
+    size_t n;
+
+    ctxP->total += len;
+    if (ctxP->buflen) {
+        n = blocklen - ctxP->buflen;
+        if (n > len)
+            n = len;
+        memcpy(ctxP->buf + ctxP->buflen, data, n);
+        ctxP->buflen += (unsigned int) n;
+        data += n;
+        len -= n;
+        if (ctxP->buflen < blocklen)
+            return;
+        ctxP->defP->compress(&ctxP->st, ctxP->buf, 1);
+        ctxP->buflen = 0;
+    }
+    n = len / blocklen;
+    if (n) {
+        ctxP->defP->compress(&ctxP->st, data, n);
+        data += n * blocklen;
+        len -= n * blocklen;
+    }
+    if (len) {
+        memcpy(ctxP->buf, data, len);
+        ctxP->buflen = (unsigned int) len;
+    }
+}
+
+/* Fills in the padding and length at the end of a final block */
+static void HmacShaPad(const HmacShaAlgDef *defP, unsigned char *block,
+                       unsigned int used, hmacsha_u64 total)
+{
+    block[used++] = 0x80;
+    memset(block + used, 0, defP->blocklen - used);
+    PutBE64(block + defP->blocklen - 8, total << 3);
+}
+
+static void HmacShaCtxFinal(HmacShaCtx *ctxP, unsigned char *digest)
+{
+    const HmacShaAlgDef *defP = ctxP->defP;
+
+    if (ctxP->buflen + 1 + defP->lenbytes > defP->blocklen) {
+        ctxP->buf[ctxP->buflen] = 0x80;
+        memset(ctxP->buf + ctxP->buflen + 1, 0,
+               defP->blocklen - ctxP->buflen - 1);
+        defP->compress(&ctxP->st, ctxP->buf, 1);
+        memset(ctxP->buf, 0, defP->blocklen);
+        PutBE64(ctxP->buf + defP->blocklen - 8, ctxP->total << 3);
+    } else {
+        HmacShaPad(defP, ctxP->buf, ctxP->buflen, ctxP->total);
+    }
+    defP->compress(&ctxP->st, ctxP->buf, 1);
+    defP->output(&ctxP->st, digest);
+}
+
+static void HmacShaSecureZero(void *p, size_t len)
+{
+    volatile unsigned char *vp = p;
+    while (len--)
+        *vp++ = 0;
+}
+
+/*
+ * HMAC key setup. Returns 0 on success, -1 if the algorithm is unknown.
+ */
+int HmacShaKeyInit(HmacShaKey *keyP, int alg,
+                   const unsigned char *key, size_t keylen)
+{
+    const HmacShaAlgDef *defP = HmacShaGetAlgDef(alg);
+    unsigned char block[HMACSHA_MAX_BLOCK];
+    HmacShaCtx ctx;
+    unsigned int i;
+
+    if (defP == NULL)
+        return -1;
+
+    keyP->alg = alg;
+    keyP->hlen = defP->hlen;
+    keyP->blocklen = defP->blocklen;
+
+    memset(block, 0, sizeof(block));
+    if (keylen > defP->blocklen) {
+        HmacShaCtxStart(&ctx, defP, NULL, 0);
+        HmacShaCtxUpdate(&ctx, key, keylen);
+        HmacShaCtxFinal(&ctx, block);
+    } else if (keylen) {
+        memcpy(block, key, keylen);
+    }
+
+    for (i = 0; i < defP->blocklen; ++i)
+        block[i] ^= 0x36;
+    defP->init(&keyP->inner);
+    defP->compress(&keyP->inner, block, 1);
+
+    for (i = 0; i < defP->blocklen; ++i)
+        block[i] ^= 0x36 ^ 0x5c;
+    defP->init(&keyP->outer);
+    defP->compress(&keyP->outer, block, 1);
+
+    HmacShaSecureZero(block, sizeof(block));
+    HmacShaSecureZero(&ctx, sizeof(ctx));
+    return 0;
+}
+
+void HmacShaKeyClear(HmacShaKey *keyP)
+{
+    HmacShaSecureZero(keyP, sizeof(*keyP));
+}
+
+/* Finishes an HMAC given the inner hash context holding the message */
+static void HmacShaFinish(const HmacShaKey *keyP, HmacShaCtx *ctxP,
+                          unsigned char *digest)
+{
+    unsigned char inner[HMACSHA_MAX_DIGEST];
+
+    HmacShaCtxFinal(ctxP, inner);
+    HmacShaCtxStart(ctxP, ctxP->defP, &keyP->outer, keyP->blocklen);
+    HmacShaCtxUpdate(ctxP, inner, keyP->hlen);
+    HmacShaCtxFinal(ctxP, digest);
+    HmacShaSecureZero(inner, sizeof(inner));
+}
+
+void HmacSha(const HmacShaKey *keyP, const unsigned char *data, size_t len,
+             unsigned char *digest)
+{
+    HmacShaCtx ctx;
+
+    HmacShaCtxStart(&ctx, HmacShaGetAlgDef(keyP->alg), &keyP->inner,
+                    keyP->blocklen);
+    HmacShaCtxUpdate(&ctx, data, len);
+    HmacShaFinish(keyP, &ctx, digest);
+    HmacShaSecureZero(&ctx, sizeof(ctx));
+}
+
+/*
+ * Plain (unkeyed) digest, e.g. for certificate thumbprints.
+ * Returns 0 on success, -1 if the algorithm is unknown.
+ */
+int HmacShaDigest(int alg, const unsigned char *data, size_t len,
+                  unsigned char *digest)
+{
+    const HmacShaAlgDef *defP = HmacShaGetAlgDef(alg);
+    HmacShaCtx ctx;
+
+    if (defP == NULL)
+        return -1;
+    HmacShaCtxStart(&ctx, defP, NULL, 0);
+    HmacShaCtxUpdate(&ctx, data, len);
+    HmacShaCtxFinal(&ctx, digest);
+    return 0;
+}
+
+/*
+ * Computes PBKDF2 output block T_blockindex (RFC 8018 section 5.2).
+ * After the first iteration every HMAC input is exactly hlen bytes, so
+ * the inner and outer messages share one preformatted padded block and
+ * each iteration is two compressions starting from the saved key states.
+ */
+void HmacShaPbkdf2Block(const HmacShaKey *keyP,
+                        const unsigned char *salt, size_t saltlen,
+                        hmacsha_u32 blockindex, hmacsha_u32 iterations,
+                        unsigned char *out)
+{
+    const HmacShaAlgDef *defP = HmacShaGetAlgDef(keyP->alg);
+    unsigned int hlen = keyP->hlen;
+    unsigned char block[HMACSHA_MAX_BLOCK];
+    unsigned char idx[4];
+    HmacShaCtx ctx;
+    HmacShaState st;
+    hmacsha_u32 j;
+    unsigned int k;
+
+    /* U1 = HMAC(P, S || INT(i)) */
+    PutBE32(idx, blockindex);
+    HmacShaCtxStart(&ctx, defP, &keyP->inner, keyP->blocklen);
+    HmacShaCtxUpdate(&ctx, salt, saltlen);
+    HmacShaCtxUpdate(&ctx, idx, 4);
+    HmacShaFinish(keyP, &ctx, block);
+    memcpy(out, block, hlen);
+
+    HmacShaPad(defP, block, hlen, (hmacsha_u64) keyP->blocklen + hlen);
+    for (j = 1; j < iterations; ++j) {
+        st = keyP->inner;
+        defP->compress(&st, block, 1);
+        defP->output(&st, block);
+        st = keyP->outer;
+        defP->compress(&st, block, 1);
+        defP->output(&st, block);
+        for (k = 0; k < hlen; ++k)
+            out[k] ^= block[k];
+    }
+
+    HmacShaSecureZero(block, sizeof(block));
+    HmacShaSecureZero(&st, sizeof(st));
+    HmacShaSecureZero(&ctx, sizeof(ctx));
+}
+
+/* Serial PBKDF2 for callers that do not need to spread blocks across threads */
+void HmacShaPbkdf2(const HmacShaKey *keyP,
+                   const unsigned char *salt, size_t saltlen,
+                   hmacsha_u32 iterations,
+                   unsigned char *out, size_t outlen)
+{
+    unsigned char t[HMACSHA_MAX_DIGEST];
+    hmacsha_u32 i;
+    size_t n;
+
+    for (i = 1; outlen; ++i) {
+        HmacShaPbkdf2Block(keyP, salt, saltlen, i, iterations, t);
+        n = outlen < keyP->hlen ? outlen : keyP->hlen;
+        memcpy(out, t, n);
+        out += n;
+        outlen -= n;
+    }
+    HmacShaSecureZero(t, sizeof(t));
+}
+
+#ifdef HMACSHA_TEST
+/*
+ * Test and benchmark driver.
+ *   cc -O2 -DHMACSHA_TEST hmacsha.c -o hmacsha_test
+ *   ./hmacsha_test            - runs the RFC 6070 and RFC 7914 vectors
+ *   ./hmacsha_test bench      - additionally times 600000 iterations
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct HmacShaTestVector {
+    int alg;
+    const char *pass;
+    size_t passlen;
+    const char *salt;
+    size_t saltlen;
+    hmacsha_u32 iterations;
+    const char *hex;
+};
+
+static const struct HmacShaTestVector hmacShaVectors[] = {
+    /* RFC 6070 */
+    {HMACSHA_SHA1, "password", 8, "salt", 4, 1,
+     "0c60c80f961f0e71f3a9b524af6012062fe037a6"},
+    {HMACSHA_SHA1, "password", 8, "salt", 4, 2,
+     "ea6c014dc72d6f8ccd1ed92ace1d41f0d8de8957"},
+    {HMACSHA_SHA1, "password", 8, "salt", 4, 4096,
+     "4b007901b765489abead49d926f721d065a429c1"},
+    {HMACSHA_SHA1, "passwordPASSWORDpassword", 24,
+     "saltSALTsaltSALTsaltSALTsaltSALTsalt", 36, 4096,
+     "3d2eec4fe41c849b80c8d83662c0e44a8b291a964cf2f07038"},
+    {HMACSHA_SHA1, "pass\0word", 9, "sa\0lt", 5, 4096,
+     "56fa6aa75548099dcc37d7f03425e0c3"},
+    /* RFC 7914 section 11 */
+    {HMACSHA_SHA256, "passwd", 6, "salt", 4, 1,
+     "55ac046e56e3089fec1691c22544b605f94185216dde0465e68b9d57c20dacbc"
+     "49ca9cccf179b645991664b39d77ef317c71b845b1e30bd509112041d3a19783"},
+    {HMACSHA_SHA256, "Password", 8, "NaCl", 4, 80000,
+     "4ddcd8f60b98be21830cee5ef22701f9641a4418d04c0414aeff08876b34ab56"
+     "a1d425a1225833549adb841b51c9b3176a272bdebba1d078478f62b397f33c8d"},
+    /* Key longer than the block size */
+    {HMACSHA_SHA256,
+     "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX", 65,
+     "pass phrase exceeds block size", 30, 1200,
+     "22344bc4b6e32675a8090f3ea80be01d5f95126a2cddc3facc4a5e6dca04ec58"},
+    {HMACSHA_SHA512, "password", 8, "salt", 4, 1,
+     "867f70cf1ade02cff3752599a3a53dc4af34c7a669815ae5d513554e1c8cf252"
+     "c02d470a285a0501bad999bfe943c08f050235d7d68b1da55e63f73b60a57fce"},
+    {HMACSHA_SHA512, "password", 8, "salt", 4, 4096,
+     "d197b1b33db0143e018b12f3d1d1479e6cdebdcc97c5c0f87f6902e072f457b5"
+     "143f30602641b3d55cd335988cb36b84376060ecd532e039b742a239434af2d5"},
+};
+
+static int HmacShaRunVectors(void)
+{
+    unsigned char out[128];
+    char hex[257];
+    int i, failures = 0;
+    size_t k, outlen;
+    HmacShaKey key;
+
+    for (i = 0; i < (int) (sizeof(hmacShaVectors)/sizeof(hmacShaVectors[0])); ++i) {
+        const struct HmacShaTestVector *v = &hmacShaVectors[i];
+        outlen = strlen(v->hex) / 2;
+        HmacShaKeyInit(&key, v->alg, (const unsigned char *) v->pass, v->passlen);
+        HmacShaPbkdf2(&key, (const unsigned char *) v->salt, v->saltlen,
+                      v->iterations, out, outlen);
+        for (k = 0; k < outlen; ++k)
+            sprintf(hex + 2*k, "%02x", out[k]);
+        if (strcmp(hex, v->hex)) {
+            printf("Vector %d failed: got %s\n", i, hex);
+            ++failures;
+        }
+    }
+    /* FIPS 180-2 "abc" digests */
+    {
+        static const char *abc[] = {
+            "a9993e364706816aba3e25717850c26c9cd0d89d",
+            "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+            "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+            "2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f"
+        };
+        for (i = 0; i < 3; ++i) {
+            HmacShaDigest(HMACSHA_SHA1 + i, (const unsigned char *) "abc", 3, out);
+            for (k = 0; k < HmacShaDigestSize(HMACSHA_SHA1 + i); ++k)
+                sprintf(hex + 2*k, "%02x", out[k]);
+            if (strcmp(hex, abc[i])) {
+                printf("Digest %d failed: got %s\n", i, hex);
+                ++failures;
+            }
+        }
+    }
+    return failures;
+}
+
+static void HmacShaBench(int alg, const char *name)
+{
+    unsigned char out[HMACSHA_MAX_DIGEST];
+    HmacShaKey key;
+    clock_t start;
+
+    HmacShaKeyInit(&key, alg, (const unsigned char *) "password", 8);
+    start = clock();
+    HmacShaPbkdf2Block(&key, (const unsigned char *) "salt", 4, 1, 600000, out);
+    printf("%-8s 600000 iterations: %.1f ms\n", name,
+           (clock() - start) * 1000.0 / CLOCKS_PER_SEC);
+}
+
+int main(int argc, char *argv[])
+{
+    int failures, accel;
+
+    accel = HmacShaAccelerated();
+    failures = HmacShaRunVectors();
+    if (accel) {
+        /* Also check the portable code paths */
+        hmacShaAccel = 0;
+        failures += HmacShaRunVectors();
+        hmacShaAccel = accel;
+    }
+    printf("%s (SHA extensions %s)\n", failures ? "FAILED" : "All tests OK",
+           accel ? "used" : "not available");
+
+    if (argc > 1 && !strcmp(argv[1], "bench")) {
+        HmacShaBench(HMACSHA_SHA1, "sha1");
+        HmacShaBench(HMACSHA_SHA256, "sha256");
+        HmacShaBench(HMACSHA_SHA512, "sha512");
+        if (accel) {
+            hmacShaAccel = 0;
+            HmacShaBench(HMACSHA_SHA1, "sha1 (C)");
+            HmacShaBench(HMACSHA_SHA256, "sha256 (C)");
+            hmacShaAccel = accel;
+        }
+    }
+    return failures ? 1 : 0;
+}
+#endif
@@ -0,0 +1,67 @@
+#ifndef HMACSHA_H
+#define HMACSHA_H
+
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Native SHA-1/SHA-256/SHA-512 HMAC used for PBKDF2. Only depends on
+ * the C library (and compiler intrinsics for the SHA extensions on x86)
+ * so it can be built and tested on any platform.
+ */
+
+#include <stddef.h>
+
+#define HMACSHA_SHA1    1
+#define HMACSHA_SHA256  2
+#define HMACSHA_SHA512  3
+
+#define HMACSHA_MAX_DIGEST 64
+#define HMACSHA_MAX_BLOCK  128
+
+#if defined(_MSC_VER) && _MSC_VER < 1600
+typedef unsigned __int64 hmacsha_u64;
+#else
+typedef unsigned long long hmacsha_u64;
+#endif
+typedef unsigned int hmacsha_u32;
+
+typedef union HmacShaState {
+    hmacsha_u32 s32[8];
+    hmacsha_u64 s64[8];
+} HmacShaState;
+
+/*
+ * HMAC key with the hash state after absorbing the inner and outer
+ * padded key blocks. Computed once per password so each HMAC only
+ * costs the compressions for the message itself.
+ */
+typedef struct HmacShaKey {
+    int          alg;
+    unsigned int hlen;          /* Digest length */
+    unsigned int blocklen;      /* Hash block length */
+    HmacShaState inner;
+    HmacShaState outer;
+} HmacShaKey;
+
+int  HmacShaKeyInit(HmacShaKey *keyP, int alg,
+                    const unsigned char *key, size_t keylen);
+void HmacShaKeyClear(HmacShaKey *keyP);
+void HmacSha(const HmacShaKey *keyP, const unsigned char *data, size_t len,
+             unsigned char *digest);
+void HmacShaPbkdf2Block(const HmacShaKey *keyP,
+                        const unsigned char *salt, size_t saltlen,
+                        hmacsha_u32 blockindex, hmacsha_u32 iterations,
+                        unsigned char *out);
+void HmacShaPbkdf2(const HmacShaKey *keyP,
+                   const unsigned char *salt, size_t saltlen,
+                   hmacsha_u32 iterations,
+                   unsigned char *out, size_t outlen);
+int  HmacShaDigest(int alg, const unsigned char *data, size_t len,
+                   unsigned char *digest);
+unsigned int HmacShaDigestSize(int alg);
+int  HmacShaAccelerated(void);
+
+#endif
@@ -0,0 +1,927 @@
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * IPv4 and IPv6 addresses and CIDR prefix sets. See ipaddr.h.
+ *
+ * Build with -DIPADDR_TEST to get a standalone test and benchmark of
+ * prefix matching against a script implementation (see end of file).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "ipaddr.h"
+
+/*
+ * Addresses are held in the trie as 128 bit keys, most significant bit
+ * first, split into two 64 bit halves. IPv4 addresses occupy the top 32
+ * bits of the high half.
+ */
+typedef struct IpKey {
+    Tcl_WideUInt hi;
+    Tcl_WideUInt lo;
+} IpKey;
+
+/*
+ * Trie nodes are kept in a single array and refer to their children by
+ * index, 0 being unused, so a set is one allocation. Each node holds a
+ * prefix of plen bits of which every node below it is an extension.
+ * Nodes with index -1 only exist to branch and do not correspond to a
+ * prefix in the set.
+ */
+typedef struct IpTrieNode {
+    IpKey key;                  /* Bits beyond plen are zero */
+    unsigned int child[2];
+    int plen;
+    int index;                  /* Position in the prefix list or -1 */
+} IpTrieNode;
+
+struct IpSet {
+    int nrefs;
+    unsigned int root[2];       /* IPv4 and IPv6 tries */
+    IpTrieNode *nodes;
+    unsigned int nnodes;
+    unsigned int nodes_size;
+};
+
+/*
+ * Address Tcl_ObjType. twoPtrValue.ptr2 holds the family. For IPv4,
+ * ptr1 holds the address bytes, for IPv6 it points to a ckalloc'ed copy.
+ */
+static void FreeIpAddrRep(Tcl_Obj *objP);
+static void DupIpAddrRep(Tcl_Obj *srcP, Tcl_Obj *dstP);
+static void UpdateIpAddrString(Tcl_Obj *objP);
+static const Tcl_ObjType gIpAddrType = {
+    "TwapiIpAddr",
+    FreeIpAddrRep,
+    DupIpAddrRep,
+    UpdateIpAddrString,
+    NULL
+};
+
+/*
+ * Set Tcl_ObjType. twoPtrValue.ptr1 points to the IpSet. The string
+ * representation is always that of the original list.
+ */
+static void FreeIpSetRep(Tcl_Obj *objP);
+static void DupIpSetRep(Tcl_Obj *srcP, Tcl_Obj *dstP);
+static void UpdateIpSetString(Tcl_Obj *objP);
+static const Tcl_ObjType gIpSetType = {
+    "TwapiIpSet",
+    FreeIpSetRep,
+    DupIpSetRep,
+    UpdateIpSetString, /* Will panic. Never called as the string rep
+                          is never invalidated */
+    NULL
+};
+
+static int IpHexDigit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Parses a dotted quad into 4 bytes. Leading zeros are rejected as
+ * other parsers treat them as octal. Returns the number of characters
+ * consumed or 0.
+ */
+static int IpParseV4(const char *s, unsigned char *bytes)
+{
+    const char *p = s;
+    int i;
+
+    for (i = 0; i < 4; ++i) {
+        int val, ndigits;
+        if (i && *p++ != '.')
+            return 0;
+        for (val = 0, ndigits = 0; *p >= '0' && *p <= '9'; ++p, ++ndigits) {
+            if (ndigits && val == 0)
+                return 0;       /* Leading zero */
+            val = 10 * val + (*p - '0');
+            if (val > 255)
+                return 0;
+        }
+        if (ndigits == 0)
+            return 0;
+        bytes[i] = (unsigned char) val;
+    }
+    return (int) (p - s);
+}
+
+/* Parses an IPv6 address. Returns the number of characters consumed or 0 */
+static int IpParseV6(const char *s, unsigned char *bytes)
+{
+    const char *p = s;
+    unsigned short groups[8];
+    int ngroups = 0;
+    int gap = -1;               /* Group position of "::" */
+    int i;
+
+    if (p[0] == ':') {
+        if (p[1] != ':')
+            return 0;
+        gap = 0;
+        p += 2;
+    }
+    while (ngroups < 8) {
+        int val, ndigits, d;
+        const char *start = p;
+        for (val = 0, ndigits = 0; (d = IpHexDigit(*p)) >= 0 && ndigits < 5;
+             ++p, ++ndigits)
+            val = (val << 4) | d;
+        if (ndigits == 0)
+            break;              /* Only valid after "::" */
+        if (*p == '.') {
+            /* Embedded IPv4 address in the last two groups */
+            unsigned char v4[4];
+            int n;
+            if (ngroups > 6 || (n = IpParseV4(start, v4)) == 0)
+                return 0;
+            groups[ngroups++] = (unsigned short) ((v4[0] << 8) | v4[1]);
+            groups[ngroups++] = (unsigned short) ((v4[2] << 8) | v4[3]);
+            p = start + n;
+            break;
+        }
+        if (ndigits > 4)
+            return 0;
+        groups[ngroups++] = (unsigned short) val;
+        if (*p != ':')
+            break;
+        if (p[1] == ':') {
+            if (gap >= 0)
+                return 0;       /* Only one "::" */
+            gap = ngroups;
+            p += 2;
+        } else {
+            /* Single ':' must be followed by another group */
+            if (IpHexDigit(p[1]) < 0)
+                return 0;
+            p += 1;
+        }
+    }
+
+    if (gap < 0) {
+        if (ngroups != 8)
+            return 0;
+    } else if (ngroups > 7)
+        return 0;               /* "::" must stand for at least one group */
+
+    memset(bytes, 0, 16);
+    if (gap < 0)
+        gap = ngroups;
+    for (i = 0; i < gap; ++i) {
+        bytes[2*i] = (unsigned char) (groups[i] >> 8);
+        bytes[2*i+1] = (unsigned char) groups[i];
+    }
+    for (i = gap; i < ngroups; ++i) {
+        int pos = 8 - (ngroups - i);
+        bytes[2*pos] = (unsigned char) (groups[i] >> 8);
+        bytes[2*pos+1] = (unsigned char) groups[i];
+    }
+    return (int) (p - s);
+}
+
+/* Parses an address and returns the number of characters consumed or 0 */
+static int IpParseAddr(const char *s, IpAddr *addrP)
+{
+    int n;
+
+    memset(addrP, 0, sizeof(*addrP));
+    if ((n = IpParseV4(s, addrP->bytes)) != 0) {
+        addrP->family = 4;
+        return n;
+    }
+    if ((n = IpParseV6(s, addrP->bytes)) != 0) {
+        addrP->family = 6;
+        if (s[n] == '%') {
+            /* Zone index, not part of the address */
+            for (++n; s[n] && s[n] != '/'; ++n)
+                ;
+        }
+        return n;
+    }
+    return 0;
+}
+
+int IpAddrParse(const char *s, IpAddr *addrP)
+{
+    int n = IpParseAddr(s, addrP);
+    return n != 0 && s[n] == '\0';
+}
+
+int IpAddrParsePrefix(const char *s, IpAddr *addrP, int *prefixlenP)
+{
+    int n, maxlen, plen, i;
+
+    n = IpParseAddr(s, addrP);
+    if (n == 0)
+        return 0;
+    maxlen = addrP->family == 4 ? 32 : 128;
+    if (s[n] == '\0') {
+        *prefixlenP = maxlen;
+        return 1;
+    }
+    if (s[n] != '/' || s[n+1] == '\0')
+        return 0;
+    /* As for address octets, no leading zeroes, e.g. 1.2.3.4/08 */
+    if (s[n+1] == '0' && s[n+2] != '\0')
+        return 0;
+    for (plen = 0, s += n + 1; *s; ++s) {
+        if (*s < '0' || *s > '9')
+            return 0;
+        plen = 10 * plen + (*s - '0');
+        if (plen > maxlen)
+            return 0;
+    }
+    /* Clear host bits */
+    for (i = 0; i < 16; ++i) {
+        int bits = plen - 8*i;
+        if (bits <= 0)
+            addrP->bytes[i] = 0;
+        else if (bits < 8)
+            addrP->bytes[i] &= (unsigned char) (0xff << (8 - bits));
+    }
+    *prefixlenP = plen;
+    return 1;
+}
+
+int IpAddrFormat(const IpAddr *addrP, char *buf)
+{
+    const unsigned char *b = addrP->bytes;
+    unsigned short groups[8];
+    int i, best, bestlen, run, len;
+    char *p;
+
+    if (addrP->family == 4)
+        return sprintf(buf, "%u.%u.%u.%u", b[0], b[1], b[2], b[3]);
+
+    for (i = 0; i < 8; ++i)
+        groups[i] = (unsigned short) ((b[2*i] << 8) | b[2*i+1]);
+
+    /* RFC 5952 - compress the first longest run of two or more zeros */
+    best = -1;
+    bestlen = 1;
+    for (i = 0; i < 8; i += run ? run : 1) {
+        for (run = 0; i + run < 8 && groups[i+run] == 0; ++run)
+            ;
+        if (run > bestlen) {
+            best = i;
+            bestlen = run;
+        }
+    }
+
+    p = buf;
+    for (i = 0; i < 8; ++i) {
+        if (i == best) {
+            *p++ = ':';
+            if (i == 0)
+                *p++ = ':';
+            i += bestlen - 1;
+            continue;
+        }
+        /* IPv4 mapped addresses keep the dotted quad */
+        if (i == 6 && best == 0 && bestlen == 5 && groups[5] == 0xffff) {
+            p += sprintf(p, "%u.%u.%u.%u", b[12], b[13], b[14], b[15]);
+            break;
+        }
+        p += sprintf(p, "%x", groups[i]);
+        if (i < 7)
+            *p++ = ':';
+    }
+    *p = '\0';
+    len = (int) (p - buf);
+    return len;
+}
+
+static void IpKeyFromAddr(const IpAddr *addrP, IpKey *keyP)
+{
+    const unsigned char *b = addrP->bytes;
+    int i;
+
+    keyP->hi = keyP->lo = 0;
+    if (addrP->family == 4) {
+        for (i = 0; i < 4; ++i)
+            keyP->hi = (keyP->hi << 8) | b[i];
+        keyP->hi <<= 32;
+    } else {
+        for (i = 0; i < 8; ++i) {
+            keyP->hi = (keyP->hi << 8) | b[i];
+            keyP->lo = (keyP->lo << 8) | b[i+8];
+        }
+    }
+}
+
+/* Mask of the leading nbits bits of a 64 bit half */
+static Tcl_WideUInt IpMask64(int nbits)
+{
+    if (nbits <= 0)
+        return 0;
+    if (nbits >= 64)
+        return ~(Tcl_WideUInt) 0;
+    return ~(Tcl_WideUInt) 0 << (64 - nbits);
+}
+
+static int IpKeyMatch(const IpKey *aP, const IpKey *bP, int plen)
+{
+    return ((aP->hi ^ bP->hi) & IpMask64(plen)) == 0
+        && ((aP->lo ^ bP->lo) & IpMask64(plen - 64)) == 0;
+}
+
+static int IpKeyBit(const IpKey *keyP, int i)
+{
+    if (i < 64)
+        return (int) ((keyP->hi >> (63 - i)) & 1);
+    return (int) ((keyP->lo >> (127 - i)) & 1);
+}
+
+/* Number of leading zero bits, x must be non-zero */
+static int IpClz64(Tcl_WideUInt x)
+{
+#if defined(__GNUC__)
+    return __builtin_clzll(x);
+#else
+    int n = 0;
+    if ((x >> 32) == 0) { n += 32; x <<= 32; }
+    if ((x >> 48) == 0) { n += 16; x <<= 16; }
+    if ((x >> 56) == 0) { n += 8; x <<= 8; }
+    if ((x >> 60) == 0) { n += 4; x <<= 4; }
+    if ((x >> 62) == 0) { n += 2; x <<= 2; }
+    if ((x >> 63) == 0) { n += 1; }
+    return n;
+#endif
+}
+
+/* Length of the common prefix of two keys, at most maxlen */
+static int IpKeyCommon(const IpKey *aP, const IpKey *bP, int maxlen)
+{
+    Tcl_WideUInt x;
+    int n;
+
+    if ((x = aP->hi ^ bP->hi) != 0)
+        n = IpClz64(x);
+    else if ((x = aP->lo ^ bP->lo) != 0)
+        n = 64 + IpClz64(x);
+    else
+        n = 128;
+    return n < maxlen ? n : maxlen;
+}
+
+static IpSet *IpSetNew(void)
+{
+    IpSet *setP = (IpSet *) ckalloc(sizeof(*setP));
+    memset(setP, 0, sizeof(*setP));
+    setP->nrefs = 1;
+    setP->nnodes = 1;           /* Node 0 is unused */
+    return setP;
+}
+
+void IpSetUnref(IpSet *setP)
+{
+    if (--setP->nrefs <= 0) {
+        if (setP->nodes)
+            ckfree((char *) setP->nodes);
+        ckfree((char *) setP);
+    }
+}
+
+static unsigned int IpSetNewNode(IpSet *setP, const IpKey *keyP, int plen,
+                                 int index)
+{
+    IpTrieNode *nodeP = &setP->nodes[setP->nnodes];
+    nodeP->key.hi = keyP->hi & IpMask64(plen);
+    nodeP->key.lo = keyP->lo & IpMask64(plen - 64);
+    nodeP->child[0] = nodeP->child[1] = 0;
+    nodeP->plen = plen;
+    nodeP->index = index;
+    return setP->nnodes++;
+}
+
+static void IpSetInsert(IpSet *setP, const IpAddr *addrP, int plen, int index)
+{
+    IpKey key;
+    unsigned int *linkP;
+
+    /* An insertion adds at most two nodes. Reserve so pointers stay valid */
+    if (setP->nnodes + 2 > setP->nodes_size) {
+        setP->nodes_size = setP->nodes_size ? 2 * setP->nodes_size : 64;
+        setP->nodes = (IpTrieNode *) ckrealloc(
+            (char *) setP->nodes, setP->nodes_size * sizeof(IpTrieNode));
+    }
+
+    IpKeyFromAddr(addrP, &key);
+    linkP = &setP->root[addrP->family == 4 ? 0 : 1];
+    while (*linkP) {
+        IpTrieNode *nodeP = &setP->nodes[*linkP];
+        int common = IpKeyCommon(&nodeP->key, &key,
+                                 nodeP->plen < plen ? nodeP->plen : plen);
+        if (common < nodeP->plen) {
+            /* Diverges within this node's prefix, or is a prefix of it */
+            unsigned int old = *linkP;
+            int oldbit = IpKeyBit(&nodeP->key, common);
+            if (common == plen) {
+                *linkP = IpSetNewNode(setP, &key, plen, index);
+                setP->nodes[*linkP].child[oldbit] = old;
+            } else {
+                unsigned int branch = IpSetNewNode(setP, &key, common, -1);
+                setP->nodes[branch].child[oldbit] = old;
+                setP->nodes[branch].child[!oldbit] =
+                    IpSetNewNode(setP, &key, plen, index);
+                *linkP = branch;
+            }
+            return;
+        }
+        if (nodeP->plen == plen) {
+            if (nodeP->index < 0)
+                nodeP->index = index;
+            return;
+        }
+        linkP = &nodeP->child[IpKeyBit(&key, nodeP->plen)];
+    }
+    *linkP = IpSetNewNode(setP, &key, plen, index);
+}
+
+/* Returns the node of the longest prefix containing addrP, or 0 */
+static unsigned int IpSetLookup(const IpSet *setP, const IpAddr *addrP)
+{
+    IpKey key;
+    unsigned int i, best = 0;
+    int maxlen = addrP->family == 4 ? 32 : 128;
+
+    IpKeyFromAddr(addrP, &key);
+    i = setP->root[addrP->family == 4 ? 0 : 1];
+    while (i) {
+        const IpTrieNode *nodeP = &setP->nodes[i];
+        if (! IpKeyMatch(&nodeP->key, &key, nodeP->plen))
+            break;
+        if (nodeP->index >= 0)
+            best = i;
+        if (nodeP->plen >= maxlen)
+            break;
+        i = nodeP->child[IpKeyBit(&key, nodeP->plen)];
+    }
+    return best;
+}
+
+int IpSetMatch(const IpSet *setP, const IpAddr *addrP)
+{
+    unsigned int i = IpSetLookup(setP, addrP);
+    return i ? setP->nodes[i].index : -1;
+}
+
+int IpSetMatchPrefix(const IpSet *setP, const IpAddr *addrP,
+                     IpAddr *prefixP, int *prefixlenP)
+{
+    const IpTrieNode *nodeP;
+    unsigned int i = IpSetLookup(setP, addrP);
+    Tcl_WideUInt hi, lo;
+    int j;
+
+    if (i == 0)
+        return -1;
+    nodeP = &setP->nodes[i];
+    memset(prefixP, 0, sizeof(*prefixP));
+    prefixP->family = addrP->family;
+    hi = nodeP->key.hi;
+    lo = nodeP->key.lo;
+    for (j = 7; j >= 0; --j) {
+        prefixP->bytes[j] = (unsigned char) hi;
+        prefixP->bytes[j+8] = (unsigned char) lo;
+        hi >>= 8;
+        lo >>= 8;
+    }
+    *prefixlenP = nodeP->plen;
+    return nodeP->index;
+}
+
+static void IpFreeIntRep(Tcl_Obj *objP)
+{
+    if (objP->typePtr && objP->typePtr->freeIntRepProc)
+        objP->typePtr->freeIntRepProc(objP);
+    objP->typePtr = NULL;
+}
+
+static void IpAddrSetRep(Tcl_Obj *objP, const IpAddr *addrP)
+{
+    if (addrP->family == 4) {
+        unsigned int v4;
+        memcpy(&v4, addrP->bytes, 4);
+        objP->internalRep.twoPtrValue.ptr1 = (void *) (size_t) v4;
+    } else {
+        void *p = ckalloc(16);
+        memcpy(p, addrP->bytes, 16);
+        objP->internalRep.twoPtrValue.ptr1 = p;
+    }
+    objP->internalRep.twoPtrValue.ptr2 = (void *) (size_t) addrP->family;
+    objP->typePtr = &gIpAddrType;
+}
+
+static void IpAddrGetRep(Tcl_Obj *objP, IpAddr *addrP)
+{
+    memset(addrP, 0, sizeof(*addrP));
+    addrP->family = (unsigned char) (size_t) objP->internalRep.twoPtrValue.ptr2;
+    if (addrP->family == 4) {
+        unsigned int v4 = (unsigned int) (size_t) objP->internalRep.twoPtrValue.ptr1;
+        memcpy(addrP->bytes, &v4, 4);
+    } else
+        memcpy(addrP->bytes, objP->internalRep.twoPtrValue.ptr1, 16);
+}
+
+static void FreeIpAddrRep(Tcl_Obj *objP)
+{
+    if ((size_t) objP->internalRep.twoPtrValue.ptr2 == 6)
+        ckfree((char *) objP->internalRep.twoPtrValue.ptr1);
+    objP->internalRep.twoPtrValue.ptr1 = NULL;
+    objP->internalRep.twoPtrValue.ptr2 = NULL;
+    objP->typePtr = NULL;
+}
+
+static void DupIpAddrRep(Tcl_Obj *srcP, Tcl_Obj *dstP)
+{
+    IpAddr addr;
+    IpAddrGetRep(srcP, &addr);
+    IpAddrSetRep(dstP, &addr);
+}
+
+static void UpdateIpAddrString(Tcl_Obj *objP)
+{
+    IpAddr addr;
+    char buf[IPADDR_MAXSTR];
+    int len;
+
+    IpAddrGetRep(objP, &addr);
+    len = IpAddrFormat(&addr, buf);
+    objP->bytes = ckalloc(len + 1);
+    memcpy(objP->bytes, buf, len + 1);
+    objP->length = len;
+}
+
+int IpAddrFromObj(Tcl_Interp *interp, Tcl_Obj *objP, IpAddr *addrP)
+{
+    const char *s;
+
+    if (objP->typePtr == &gIpAddrType) {
+        IpAddrGetRep(objP, addrP);
+        return TCL_OK;
+    }
+    s = Tcl_GetString(objP);
+    if (! IpAddrParse(s, addrP)) {
+        if (interp)
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("Invalid IP address \"%s\".", s));
+        return TCL_ERROR;
+    }
+    IpFreeIntRep(objP);
+    IpAddrSetRep(objP, addrP);
+    return TCL_OK;
+}
+
+Tcl_Obj *IpAddrNewObj(const IpAddr *addrP)
+{
+    Tcl_Obj *objP = Tcl_NewObj();
+    Tcl_InvalidateStringRep(objP);
+    IpAddrSetRep(objP, addrP);
+    return objP;
+}
+
+static void FreeIpSetRep(Tcl_Obj *objP)
+{
+    IpSetUnref((IpSet *) objP->internalRep.twoPtrValue.ptr1);
+    objP->internalRep.twoPtrValue.ptr1 = NULL;
+    objP->typePtr = NULL;
+}
+
+static void DupIpSetRep(Tcl_Obj *srcP, Tcl_Obj *dstP)
+{
+    IpSet *setP = srcP->internalRep.twoPtrValue.ptr1;
+    setP->nrefs++;
+    dstP->internalRep.twoPtrValue.ptr1 = setP;
+    dstP->typePtr = &gIpSetType;
+}
+
+static void UpdateIpSetString(Tcl_Obj *objP)
+{
+    (void) objP;
+    Tcl_Panic("UpdateIpSetString called.");
+}
+
+IpSet *IpSetFromObj(Tcl_Interp *interp, Tcl_Obj *objP)
+{
+    IpSet *setP;
+    Tcl_Obj **elems;
+    int i, nelems;
+
+    if (objP->typePtr == &gIpSetType) {
+        setP = objP->internalRep.twoPtrValue.ptr1;
+        setP->nrefs++;
+        return setP;
+    }
+
+    /* Make sure the string rep exists as we do not generate one */
+    Tcl_GetString(objP);
+    if (Tcl_ListObjGetElements(interp, objP, &nelems, &elems) != TCL_OK)
+        return NULL;
+    setP = IpSetNew();
+    for (i = 0; i < nelems; ++i) {
+        IpAddr addr;
+        int plen;
+        if (! IpAddrParsePrefix(Tcl_GetString(elems[i]), &addr, &plen)) {
+            if (interp)
+                Tcl_SetObjResult(interp,
+                                 Tcl_ObjPrintf("Invalid CIDR prefix \"%s\".",
+                                               Tcl_GetString(elems[i])));
+            IpSetUnref(setP);
+            return NULL;
+        }
+        IpSetInsert(setP, &addr, plen, i);
+    }
+    /* elems[] is no longer needed so the list rep can go */
+    IpFreeIntRep(objP);
+    objP->internalRep.twoPtrValue.ptr1 = setP;
+    objP->typePtr = &gIpSetType;
+    setP->nrefs++;              /* For the caller */
+    return setP;
+}
+
+#ifdef IPADDR_TEST
+/*
+ * Standalone test and benchmark. Build with
+ *
+ *   cc -O2 -DIPADDR_TEST -I<tcl>/include ipaddr.c -L<tcl>/lib -ltcl8.6
+ *
+ * Compares longest prefix matching of connection table sized address
+ * lists against a script implementation using integer masks.
+ */
+
+#include <stdlib.h>
+
+static int TestNormalizeObjCmd(ClientData cd, Tcl_Interp *interp, int objc,
+                               Tcl_Obj *const objv[])
+{
+    IpAddr addr;
+    char buf[IPADDR_MAXSTR];
+    int plen;
+
+    (void) cd;
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "ADDR");
+        return TCL_ERROR;
+    }
+    if (strchr(Tcl_GetString(objv[1]), '/')) {
+        if (! IpAddrParsePrefix(Tcl_GetString(objv[1]), &addr, &plen)) {
+            Tcl_SetResult(interp, "invalid", TCL_STATIC);
+            return TCL_ERROR;
+        }
+        IpAddrFormat(&addr, buf);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s/%d", buf, plen));
+        return TCL_OK;
+    }
+    if (IpAddrFromObj(interp, objv[1], &addr) != TCL_OK)
+        return TCL_ERROR;
+    Tcl_SetObjResult(interp, IpAddrNewObj(&addr));
+    return TCL_OK;
+}
+
+/* match CIDRS ADDRS - returns the matching prefix index for each address */
+static int TestMatchObjCmd(ClientData cd, Tcl_Interp *interp, int objc,
+                           Tcl_Obj *const objv[])
+{
+    IpSet *setP;
+    Tcl_Obj **addrs, *resultObj;
+    int i, naddrs;
+
+    (void) cd;
+    if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 1, objv, "CIDRS ADDRS");
+        return TCL_ERROR;
+    }
+    if ((setP = IpSetFromObj(interp, objv[1])) == NULL)
+        return TCL_ERROR;
+    if (Tcl_ListObjGetElements(interp, objv[2], &naddrs, &addrs) != TCL_OK) {
+        IpSetUnref(setP);
+        return TCL_ERROR;
+    }
+    resultObj = Tcl_NewListObj(0, NULL);
+    for (i = 0; i < naddrs; ++i) {
+        IpAddr addr;
+        int index = -1;
+        if (IpAddrFromObj(NULL, addrs[i], &addr) == TCL_OK)
+            index = IpSetMatch(setP, &addr);
+        Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(index));
+    }
+    IpSetUnref(setP);
+    Tcl_SetObjResult(interp, resultObj);
+    return TCL_OK;
+}
+
+/* prefix CIDRS ADDR - returns the longest matching prefix */
+static int TestPrefixObjCmd(ClientData cd, Tcl_Interp *interp, int objc,
+                            Tcl_Obj *const objv[])
+{
+    IpSet *setP;
+    IpAddr addr, prefix;
+    char buf[IPADDR_MAXSTR];
+    int plen;
+
+    (void) cd;
+    if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 1, objv, "CIDRS ADDR");
+        return TCL_ERROR;
+    }
+    if (IpAddrFromObj(interp, objv[2], &addr) != TCL_OK ||
+        (setP = IpSetFromObj(interp, objv[1])) == NULL)
+        return TCL_ERROR;
+    if (IpSetMatchPrefix(setP, &addr, &prefix, &plen) >= 0) {
+        IpAddrFormat(&prefix, buf);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s/%d", buf, plen));
+    }
+    IpSetUnref(setP);
+    return TCL_OK;
+}
+
+/* filter CIDRS RECORDS FIELDINDEX - records whose field is in the set */
+static int TestFilterObjCmd(ClientData cd, Tcl_Interp *interp, int objc,
+                            Tcl_Obj *const objv[])
+{
+    IpSet *setP;
+    Tcl_Obj **recs, *resultObj;
+    int i, nrecs, pos;
+
+    (void) cd;
+    if (objc != 4) {
+        Tcl_WrongNumArgs(interp, 1, objv, "CIDRS RECORDS FIELDINDEX");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIntFromObj(interp, objv[3], &pos) != TCL_OK ||
+        (setP = IpSetFromObj(interp, objv[1])) == NULL)
+        return TCL_ERROR;
+    if (Tcl_ListObjGetElements(interp, objv[2], &nrecs, &recs) != TCL_OK) {
+        IpSetUnref(setP);
+        return TCL_ERROR;
+    }
+    resultObj = Tcl_NewListObj(0, NULL);
+    for (i = 0; i < nrecs; ++i) {
+        Tcl_Obj *valueObj;
+        IpAddr addr;
+        if (Tcl_ListObjIndex(NULL, recs[i], pos, &valueObj) == TCL_OK &&
+            valueObj && IpAddrFromObj(NULL, valueObj, &addr) == TCL_OK &&
+            IpSetMatch(setP, &addr) >= 0)
+            Tcl_ListObjAppendElement(NULL, resultObj, recs[i]);
+    }
+    IpSetUnref(setP);
+    Tcl_SetObjResult(interp, resultObj);
+    return TCL_OK;
+}
+
+static const char *testScript =
+    "proc check {script expected} {\n"
+    "    set code [catch {uplevel 1 $script} result]\n"
+    "    if {$code} {set result [list error $result]}\n"
+    "    if {$result ne $expected} {\n"
+    "        puts \"FAIL: $script\\n  got:      $result\\n  expected: $expected\"\n"
+    "        incr ::failures\n"
+    "    }\n"
+    "    incr ::checks\n"
+    "}\n"
+    "set failures 0; set checks 0\n"
+    "check {normalize 10.1.2.3} 10.1.2.3\n"
+    "check {normalize 255.255.255.255} 255.255.255.255\n"
+    "check {normalize 010.1.2.3} {error {Invalid IP address \"010.1.2.3\".}}\n"
+    "check {normalize 1.2.3} {error {Invalid IP address \"1.2.3\".}}\n"
+    "check {normalize 1.2.3.256} {error {Invalid IP address \"1.2.3.256\".}}\n"
+    "check {normalize 1.2.3.4.5} {error {Invalid IP address \"1.2.3.4.5\".}}\n"
+    "check {normalize ::} ::\n"
+    "check {normalize ::1} ::1\n"
+    "check {normalize 1::} 1::\n"
+    "check {normalize 2001:DB8:0:0:0:0:2:1} 2001:db8::2:1\n"
+    "check {normalize 2001:db8:0000:1:1:1:1:1} 2001:db8:0:1:1:1:1:1\n"
+    "check {normalize 2001:0:0:1:0:0:0:1} 2001:0:0:1::1\n"
+    "check {normalize 2001:db8:0:0:1:0:0:1} 2001:db8::1:0:0:1\n"
+    "check {normalize fe80::1%12} fe80::1\n"
+    "check {normalize ::ffff:192.0.2.1} ::ffff:192.0.2.1\n"
+    "check {normalize ::FFFF:c000:0201} ::ffff:192.0.2.1\n"
+    "check {normalize 64:ff9b::192.0.2.1} 64:ff9b::c000:201\n"
+    "check {normalize 1:2:3:4:5:6:7:8} 1:2:3:4:5:6:7:8\n"
+    "check {normalize 1:2:3:4:5:6:7::} 1:2:3:4:5:6:7:0\n"
+    "check {normalize 1:2:3:4:5:6:7:8:9} {error {Invalid IP address \"1:2:3:4:5:6:7:8:9\".}}\n"
+    "check {normalize 1::2::3} {error {Invalid IP address \"1::2::3\".}}\n"
+    "check {normalize 1:2} {error {Invalid IP address \"1:2\".}}\n"
+    "check {normalize :1::2} {error {Invalid IP address \":1::2\".}}\n"
+    "check {normalize 1::2:} {error {Invalid IP address \"1::2:\".}}\n"
+    "check {normalize 12345::} {error {Invalid IP address \"12345::\".}}\n"
+    "check {normalize 10.1.2.3/8} 10.0.0.0/8\n"
+    "check {normalize 2001:db8:ffff::1/33} 2001:db8:8000::/33\n"
+    "check {normalize 10.0.0.0/33} {error invalid}\n"
+    "check {normalize 10.0.0.0/} {error invalid}\n"
+    "check {normalize 1.2.3.4/08} {error invalid}\n"
+    "check {normalize 2001:db8::/032} {error invalid}\n"
+    "check {normalize 1.2.3.4/00} {error invalid}\n"
+    "check {normalize 1.2.3.4/0} 0.0.0.0/0\n"
+    /* Longest prefix match, duplicates and families */
+    "set cidrs {10.0.0.0/8 10.1.0.0/16 10.1.2.0/24 0.0.0.0/0 2001:db8::/32 10.1.0.0/16 192.168.1.7 ::/0 2001:db8:1::/48}\n"
+    "check {match $cidrs {10.2.3.4 10.1.3.4 10.1.2.3 11.0.0.1 192.168.1.7 192.168.1.8}} {0 1 2 3 6 3}\n"
+    "check {match $cidrs {2001:db8::1 2001:db8:1::1 2001:db9::1 bad}} {4 8 7 -1}\n"
+    "check {match {10.0.0.0/8} {::a00:1 10.0.0.1}} {-1 0}\n"
+    "check {match {} {10.0.0.1}} -1\n"
+    "check {match {10.1.0.0/16 10.0.0.0/8} {10.1.1.1 10.2.1.1}} {0 1}\n"
+    "check {match {10.0.0.0/9 10.128.0.0/9} {10.0.0.1 10.200.0.1 11.0.0.1}} {0 1 -1}\n"
+    "check {match {bad/8} 1.2.3.4} {error {Invalid CIDR prefix \"bad/8\".}}\n"
+    /* The set is cached and the string rep preserved */
+    "check {match $cidrs 10.1.2.3; set cidrs} $cidrs\n"
+    "check {llength $cidrs} 9\n"
+    "check {match $cidrs 10.1.2.3} 2\n"
+    "check {prefix $cidrs 10.1.2.3} 10.1.2.0/24\n"
+    "check {prefix $cidrs 2001:db8:1:2::1} 2001:db8:1::/48\n"
+    "check {prefix $cidrs 11.1.1.1} 0.0.0.0/0\n"
+    "check {prefix {10.1.2.3/8} 10.9.9.9} 10.0.0.0/8\n"
+    "check {prefix {10.0.0.0/8} 11.9.9.9} {}\n"
+    "puts \"$checks checks, $failures failures\"\n"
+
+    /* Benchmark: 200k connections against 1000 prefixes */
+    "expr {srand(1)}\n"
+    "set cidrs {}\n"
+    "for {set i 0} {$i < 1000} {incr i} {\n"
+    "    set len [expr {8 + int(rand() * 17)}]\n"
+    "    lappend cidrs [normalize [expr {int(rand()*224)}].[expr {int(rand()*256)}].[expr {int(rand()*256)}].0/$len]\n"
+    "}\n"
+    "set recs {}\n"
+    "for {set i 0} {$i < 200000} {incr i} {\n"
+    "    lappend recs [list tcp 10.0.0.1 [expr {$i & 0xffff}] [expr {int(rand()*224)}].[expr {int(rand()*256)}].[expr {int(rand()*256)}].[expr {int(rand()*256)}] 443]\n"
+    "}\n"
+    /* Script implementation - convert prefixes to masks grouped by length */
+    "proc tcl_filter {cidrs recs} {\n"
+    "    foreach c $cidrs {\n"
+    "        lassign [split $c /] a len\n"
+    "        scan $a %d.%d.%d.%d b0 b1 b2 b3\n"
+    "        set mask [expr {(0xffffffff << (32 - $len)) & 0xffffffff}]\n"
+    "        dict set nets $len [expr {(($b0<<24)|($b1<<16)|($b2<<8)|$b3) & $mask}] 1\n"
+    "        dict set masks $len $mask\n"
+    "    }\n"
+    "    set out {}\n"
+    "    foreach r $recs {\n"
+    "        scan [lindex $r 3] %d.%d.%d.%d b0 b1 b2 b3\n"
+    "        set v [expr {($b0<<24)|($b1<<16)|($b2<<8)|$b3}]\n"
+    "        dict for {len mask} $masks {\n"
+    "            if {[dict exists $nets $len [expr {$v & $mask}]]} {\n"
+    "                lappend out $r\n"
+    "                break\n"
+    "            }\n"
+    "        }\n"
+    "    }\n"
+    "    return $out\n"
+    "}\n"
+    "set expected [tcl_filter $cidrs $recs]\n"
+    "check {expr {[filter $cidrs $recs 3] eq $expected}} 1\n"
+    "puts \"[llength $expected] of [llength $recs] records match\"\n"
+    "proc bench {label script {n 3}} {\n"
+    "    set t [lindex [uplevel 1 [list time $script $n]] 0]\n"
+    "    puts [format {%-44s %12.1f us} $label $t]\n"
+    "}\n"
+    "bench {script filter, 200k records, 1000 prefixes} {tcl_filter $cidrs $recs} 1\n"
+    "set fresh [string range \" $recs\" 1 end]\n"
+    "bench {trie filter, first pass (parses addresses)} {filter $cidrs $fresh 3} 1\n"
+    "bench {trie filter, cached addresses} {filter $cidrs $recs 3}\n"
+    "set fresh [string range \" $cidrs\" 1 end]\n"
+    "bench {compile 1000 prefixes} {match $fresh {}; set fresh [string range \" $cidrs\" 1 end]} 10\n"
+    "set v6 {}\n"
+    "for {set i 0} {$i < 1000} {incr i} {\n"
+    "    lappend v6 [format 2001:db8:%x:%x::/64 [expr {int(rand()*65536)}] $i]\n"
+    "}\n"
+    "set v6addrs {}\n"
+    "foreach c [lrange $v6 0 99] {\n"
+    "    for {set i 0} {$i < 1000} {incr i} {lappend v6addrs [string map {::/64 ::} $c][format %x $i]}\n"
+    "}\n"
+    "check {lsort -integer -unique [match $v6 $v6addrs]} [lrange [lsearch -all $v6 *] 0 99]\n"
+    "bench {IPv6 match, 100k addresses, 1000 prefixes} {match $v6 $v6addrs}\n"
+    "puts \"$checks checks, $failures failures\"\n"
+    "set failures\n";
+
+int main(int argc, char **argv)
+{
+    Tcl_Interp *interp;
+    int failures;
+
+    (void) argc;
+    Tcl_FindExecutable(argv[0]);
+    interp = Tcl_CreateInterp();
+    Tcl_CreateObjCommand(interp, "normalize", TestNormalizeObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "match", TestMatchObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "filter", TestFilterObjCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "prefix", TestPrefixObjCmd, NULL, NULL);
+
+    if (Tcl_Eval(interp, testScript) != TCL_OK) {
+        fprintf(stderr, "%s\n", Tcl_GetStringResult(interp));
+        return 1;
+    }
+    failures = atoi(Tcl_GetStringResult(interp));
+    Tcl_DeleteInterp(interp);
+    return failures ? 1 : 0;
+}
+#endif /* IPADDR_TEST */
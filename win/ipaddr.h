@@ -0,0 +1,70 @@
+#ifndef IPADDR_H
+#define IPADDR_H
+
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * IPv4 and IPv6 addresses and CIDR prefix sets. Addresses are parsed
+ * and formatted without Winsock and cached in binary form in the
+ * internal representation of Tcl_Objs so that values from connection
+ * tables are parsed at most once. A list of CIDR prefixes is likewise
+ * compiled once into a path compressed binary trie for membership and
+ * longest prefix match.
+ *
+ * The module only depends on Tcl so it can be built and benchmarked on
+ * any platform.
+ */
+
+#include <tcl.h>
+
+#define IPADDR_MAXSTR 64        /* Room for any formatted address/prefix */
+
+typedef struct IpAddr {
+    unsigned char family;       /* 4 or 6 */
+    unsigned char bytes[16];    /* Network order. IPv4 uses first 4 */
+} IpAddr;
+
+/*
+ * Parses an IPv4 dotted quad or an IPv6 address, optionally followed by
+ * a %zone suffix which is ignored. Returns 1 on success, 0 otherwise.
+ */
+int IpAddrParse(const char *s, IpAddr *addrP);
+/*
+ * Parses ADDRESS or ADDRESS/PREFIXLEN. Bits beyond the prefix are
+ * cleared. A plain address is a prefix of the full address length.
+ */
+int IpAddrParsePrefix(const char *s, IpAddr *addrP, int *prefixlenP);
+/* Formats in canonical (RFC 5952 for IPv6) form. Returns the length. */
+int IpAddrFormat(const IpAddr *addrP, char *buf);
+
+/* Tcl_Obj interfaces. interp may be NULL. */
+int IpAddrFromObj(Tcl_Interp *interp, Tcl_Obj *objP, IpAddr *addrP);
+/* Returns an object whose string representation is generated on demand */
+Tcl_Obj *IpAddrNewObj(const IpAddr *addrP);
+
+/*
+ * A compiled set of CIDR prefixes. Sets are immutable and reference
+ * counted so a set stays valid even if the Tcl_Obj it was compiled from
+ * changes type.
+ */
+typedef struct IpSet IpSet;
+
+/*
+ * Returns the set for a list of CIDR prefixes with a reference for the
+ * caller. The set is cached in the object's internal representation.
+ */
+IpSet *IpSetFromObj(Tcl_Interp *interp, Tcl_Obj *objP);
+void IpSetUnref(IpSet *setP);
+/*
+ * Returns the position in the list of the longest prefix containing
+ * addrP, or -1. Duplicate prefixes match their first occurrence.
+ */
+int IpSetMatch(const IpSet *setP, const IpAddr *addrP);
+/* As above, also returning the matching prefix with host bits cleared */
+int IpSetMatchPrefix(const IpSet *setP, const IpAddr *addrP,
+                     IpAddr *prefixP, int *prefixlenP);
+
+#endif /* IPADDR_H */
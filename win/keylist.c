@@ -7,6 +7,316 @@
 
 #include "twapi.h"
 
+/*
+ * Keyed lists are flat lists of alternating field names and values.
+ * Small keyed lists are searched linearly in place. For larger ones, an
+ * index from field name to position is built on the second lookup of the
+ * same object and kept in a small per-thread cache keyed by the Tcl_Obj.
+ * The object itself keeps its list internal rep so list operations from
+ * scripts, e.g. foreach or llength, are not affected. The cache holds a
+ * reference to each indexed object so its value, and therefore the
+ * index, cannot change while it is cached. That also makes the object
+ * shared, so a later lset or lappend has to copy it. Objects are only
+ * referenced once they have been looked up twice and the total size of
+ * the referenced lists is capped. Objects held only by the command's
+ * arguments are never cached.
+ */
+
+/* Keyed lists with fewer field pairs than this are not indexed */
+#define KL_INDEX_MIN_PAIRS 16
+
+/* Number of keyed lists whose index is cached per thread. Power of 2. */
+#define KL_CACHE_SIZE 64
+
+/* Maximum total elements of the keyed lists held by the cache */
+#define KL_CACHE_MAX_ELEMS 65536
+
+/*
+ * Open addressed hash table mapping field names to pair positions. It
+ * only refers to the fields by position so it can be shared between
+ * keyed lists that have the same fields in the same order, e.g. those
+ * returned by kl_set when replacing a value.
+ */
+typedef struct KlIndex {
+    int nrefs;
+    int npairs;
+    unsigned int mask;          /* Number of slots - 1 */
+    struct {
+        unsigned int hash;
+        int pair;               /* -1 if slot is empty */
+    } slots[1];                 /* Actually mask+1 elements */
+} KlIndex;
+
+/*
+ * Direct mapped cache of keyed list objects. If indexP is NULL, the
+ * object has only been looked up once and objP is not referenced. It may
+ * since have been freed and the address reused, so the element array and
+ * count are also compared. A false match only costs building an index.
+ */
+typedef struct TwapiKeylistCache {
+    struct {
+        Tcl_Obj *objP;
+        KlIndex *indexP;
+        Tcl_Obj **elems;        /* Element array of objP when it was seen */
+        Tcl_Size nelems;        /* Elements in objP */
+    } entries[KL_CACHE_SIZE];
+    Tcl_Size nelems;            /* Total over all entries */
+} TwapiKeylistCache;
+
+/* FNV-1a */
+static unsigned int KlHash(const char *p, Tcl_Size len)
+{
+    unsigned int hash = 2166136261U;
+    while (len--) {
+        hash ^= (unsigned char) *p++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static void KlIndexUnref(KlIndex *indexP)
+{
+    if (--indexP->nrefs <= 0)
+        ckfree((char *) indexP);
+}
+
+/*
+ * Builds the index for count elements. For duplicate fields, the first
+ * one is indexed to match the linear search.
+ */
+static KlIndex *KlIndexNew(Tcl_Size count, Tcl_Obj **elems)
+{
+    KlIndex *indexP;
+    unsigned int nslots, i, hash;
+    int npairs, pair;
+
+    npairs = (int) (count / 2);
+    /* Keep the load factor below 1/2 */
+    for (nslots = 16; nslots < 2 * (unsigned int) npairs; nslots *= 2)
+        ;
+    indexP = (KlIndex *) ckalloc(sizeof(*indexP)
+                                 + (nslots - 1) * sizeof(indexP->slots[0]));
+    indexP->nrefs = 0;
+    indexP->npairs = npairs;
+    indexP->mask = nslots - 1;
+    for (i = 0; i < nslots; ++i)
+        indexP->slots[i].pair = -1;
+
+    for (pair = 0; pair < npairs; ++pair) {
+        Tcl_Size len;
+        char *key = ObjToStringN(elems[2*pair], &len);
+        hash = KlHash(key, len);
+        for (i = hash & indexP->mask;
+             indexP->slots[i].pair >= 0;
+             i = (i + 1) & indexP->mask) {
+            if (indexP->slots[i].hash == hash) {
+                Tcl_Size len2;
+                char *key2 = ObjToStringN(elems[2*indexP->slots[i].pair],
+                                          &len2);
+                if (len == len2 && memcmp(key, key2, len) == 0)
+                    break;      /* Duplicate, keep the first */
+            }
+        }
+        if (indexP->slots[i].pair < 0) {
+            indexP->slots[i].hash = hash;
+            indexP->slots[i].pair = pair;
+        }
+    }
+    return indexP;
+}
+
+/* Returns the pair position of the field or -1 if not present */
+static int KlIndexFind(KlIndex *indexP, Tcl_Obj **elems,
+                       const char *key, Tcl_Size len)
+{
+    unsigned int i, hash;
+
+    hash = KlHash(key, len);
+    for (i = hash & indexP->mask;
+         indexP->slots[i].pair >= 0;
+         i = (i + 1) & indexP->mask) {
+        if (indexP->slots[i].hash == hash) {
+            Tcl_Size len2;
+            char *key2 = ObjToStringN(elems[2*indexP->slots[i].pair], &len2);
+            if (len == len2 && memcmp(key, key2, len) == 0)
+                return indexP->slots[i].pair;
+        }
+    }
+    return -1;
+}
+
+/* Returns the cache slot for a keyed list object */
+static unsigned int KlCacheSlot(Tcl_Obj *objP)
+{
+    size_t p = (size_t) objP;
+    return (unsigned int) ((p >> 4) ^ (p >> 10)) & (KL_CACHE_SIZE - 1);
+}
+
+static TwapiKeylistCache *KlCacheGet(void)
+{
+    TwapiTls *tlsP = Twapi_GetTls();
+    if (tlsP->keylist_cache == NULL) {
+        tlsP->keylist_cache =
+            (TwapiKeylistCache *) ckalloc(sizeof(TwapiKeylistCache));
+        memset(tlsP->keylist_cache, 0, sizeof(TwapiKeylistCache));
+    }
+    return tlsP->keylist_cache;
+}
+
+/* Releases the object and index held by a cache slot, if any */
+static void KlCacheClear(TwapiKeylistCache *cacheP, unsigned int slot)
+{
+    if (cacheP->entries[slot].indexP) {
+        ObjDecrRefs(cacheP->entries[slot].objP);
+        KlIndexUnref(cacheP->entries[slot].indexP);
+        cacheP->nelems -= cacheP->entries[slot].nelems;
+    }
+    cacheP->entries[slot].objP = NULL;
+    cacheP->entries[slot].indexP = NULL;
+    cacheP->entries[slot].elems = NULL;
+    cacheP->entries[slot].nelems = 0;
+}
+
+/*
+ * Stores objP in its cache slot, evicting any previous occupant. If
+ * indexP is not NULL, references are added to it and objP.
+ */
+static void KlCacheSet(TwapiKeylistCache *cacheP, unsigned int slot,
+                       Tcl_Obj *objP, KlIndex *indexP,
+                       Tcl_Size nelems, Tcl_Obj **elems)
+{
+    if (indexP) {
+        ObjIncrRefs(objP);      /* Before the clear in case it is the same */
+        indexP->nrefs += 1;
+    }
+    KlCacheClear(cacheP, slot);
+    cacheP->entries[slot].objP = objP;
+    cacheP->entries[slot].elems = elems;
+    cacheP->entries[slot].nelems = nelems;
+    if (indexP) {
+        cacheP->entries[slot].indexP = indexP;
+        cacheP->nelems += nelems;
+    }
+}
+
+/* Called when the thread's TLS area is released */
+void TwapiKeylistCacheFree(TwapiTls *tlsP)
+{
+    TwapiKeylistCache *cacheP = tlsP->keylist_cache;
+    unsigned int i;
+
+    if (cacheP) {
+        for (i = 0; i < KL_CACHE_SIZE; ++i)
+            KlCacheClear(cacheP, i);
+        ckfree((char *) cacheP);
+        tlsP->keylist_cache = NULL;
+    }
+}
+
+/*
+ * Gets the elements of a keyed list. Note the returned array is only
+ * valid until klObj is next modified or shimmered. kl_set and kl_fields
+ * have always accepted an odd number of elements, treating the last
+ * one as a field with a missing value, so allow_odd is set for them.
+ */
+static TCL_RESULT KlGetElements(Tcl_Interp *interp, Tcl_Obj *klObj,
+                                int allow_odd,
+                                Tcl_Size *countP, Tcl_Obj ***elemsP)
+{
+    if (ObjGetElements(interp, klObj, countP, elemsP) != TCL_OK)
+        return TCL_ERROR;
+
+    if ((*countP & 1) && ! allow_odd) {
+        ObjSetStaticResult(interp, "Keyed list must have even number of elements.");
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ * Looks up a field in a keyed list, indexing it if it is large enough
+ * and has been looked up before. On success, *pairP is the pair position
+ * of the field or -1 if not present. *countP and *elemsP are set as for
+ * KlGetElements. Lists with an odd number of elements are only searched.
+ */
+static TCL_RESULT KlFind(Tcl_Interp *interp, Tcl_Obj *klObj, Tcl_Obj *keyObj,
+                         int allow_odd,
+                         Tcl_Size *countP, Tcl_Obj ***elemsP, int *pairP)
+{
+    TwapiKeylistCache *cacheP;
+    KlIndex *indexP;
+    Tcl_Size count, keylen, len, i;
+    Tcl_Obj **elems;
+    unsigned int slot;
+    char *key;
+
+    if (KlGetElements(interp, klObj, allow_odd, &count, &elems) != TCL_OK)
+        return TCL_ERROR;
+
+    key = ObjToStringN(keyObj, &keylen);
+    *countP = count;
+    *elemsP = elems;
+
+    /*
+     * An object whose only reference is the caller's argument, e.g. the
+     * result of a nested command, is freed on return and cannot be looked
+     * up again so it is not even remembered.
+     */
+    indexP = NULL;
+    if (count >= 2 * KL_INDEX_MIN_PAIRS && ! (count & 1)
+        && klObj->refCount > 1) {
+        if (count > INT_MAX)
+            return TwapiReturnErrorUIntMax(interp);
+        cacheP = KlCacheGet();
+        slot = KlCacheSlot(klObj);
+        if (cacheP->entries[slot].indexP) {
+            if (cacheP->entries[slot].objP == klObj)
+                indexP = cacheP->entries[slot].indexP;
+            else
+                KlCacheSet(cacheP, slot, klObj, NULL, count, elems);
+        } else if (cacheP->entries[slot].objP == klObj
+                   && cacheP->entries[slot].elems == elems
+                   && cacheP->entries[slot].nelems == count) {
+            /*
+             * Second lookup. Worth indexing if the cache has room.
+             * Otherwise keep searching.
+             */
+            KlCacheClear(cacheP, slot);
+            if (cacheP->nelems + count <= KL_CACHE_MAX_ELEMS) {
+                indexP = KlIndexNew(count, elems);
+                KlCacheSet(cacheP, slot, klObj, indexP, count, elems);
+            } else
+                KlCacheSet(cacheP, slot, klObj, NULL, count, elems);
+        } else {
+            /* First lookup. Remember it but just search it this time. */
+            KlCacheSet(cacheP, slot, klObj, NULL, count, elems);
+        }
+    }
+
+    if (indexP) {
+        *pairP = KlIndexFind(indexP, elems, key, keylen);
+        return TCL_OK;
+    }
+
+    /* For odd counts, this also matches a trailing field with no value */
+    *pairP = -1;
+    for (i = 0; i < count; i += 2) {
+        char *entry = ObjToStringN(elems[i], &len);
+        if (len == keylen && memcmp(key, entry, len) == 0) {
+            *pairP = (int) (i / 2);
+            break;
+        }
+    }
+    return TCL_OK;
+}
+
+static TCL_RESULT KlFieldNotFound(Tcl_Interp *interp, Tcl_Obj *keyObj)
+{
+    Tcl_AppendResult(interp, "No field ", ObjToString(keyObj),
+                     " found in keyed list.", NULL);
+    return TCL_ERROR;
+}
+
 int Twapi_KlGetObjCmd(
     ClientData dummy,
     Tcl_Interp *interp,
@@ -15,38 +325,117 @@ int Twapi_KlGetObjCmd(
 {
     Tcl_Obj **klObj;
     Tcl_Size  count;
-    int       i;
-    char     *key;
-
+    int       pair;
 
     if (objc < 3 || objc > 4) {
         Tcl_WrongNumArgs(interp, 1, objv, "KEYLIST KEY ?DEFAULT?");
         return TCL_ERROR;
     }
 
-    if (ObjGetElements(interp, objv[1], &count, &klObj) != TCL_OK) {
+    if (KlFind(interp, objv[1], objv[2], 0, &count, &klObj, &pair) != TCL_OK)
         return TCL_ERROR;
+
+    if (pair >= 0)
+        return ObjSetResult(interp, klObj[2*pair+1]);
+
+    /* Not found. see if a default was specified */
+    if (objc == 4) {
+        return ObjSetResult(interp, objv[3]);
     }
 
-    if (count & 1) {
-        ObjSetStaticResult(interp, "Keyed list must have even number of elements.");
+    return KlFieldNotFound(interp, objv[2]);
+}
+
+int Twapi_KlSetObjCmd(
+    ClientData dummy,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *CONST objv[])
+{
+    Tcl_Obj **elems;
+    Tcl_Obj  *listObj;
+    Tcl_Size  count;
+    int       pair;
+
+    if (objc != 4) {
+        Tcl_WrongNumArgs(interp, 1, objv, "KEYLIST KEY VALUE");
         return TCL_ERROR;
     }
 
-    /* Search for the key. */
-    key = ObjToString(objv[2]);
-    for (i = 0; i < count; i += 2) {
-        char *entry = ObjToString(klObj[i]);
-        if (STREQ(key, entry)) {
-            return ObjSetResult(interp, klObj[i+1]);
-        }
+    if (KlFind(interp, objv[1], objv[2], 1, &count, &elems, &pair) != TCL_OK)
+        return TCL_ERROR;
+
+    listObj = ObjNewList(count, elems);
+    if (pair >= 0) {
+        /* A trailing field with no value gets one appended */
+        Tcl_ListObjReplace(NULL, listObj, 2*pair+1,
+                           2*pair+1 < count ? 1 : 0, 1, (Tcl_Obj **)&objv[3]);
+    } else {
+        ObjAppendElement(NULL, listObj, objv[2]);
+        ObjAppendElement(NULL, listObj, objv[3]);
     }
+    return ObjSetResult(interp, listObj);
+}
 
-    /* Not found. see if a default was specified */
-    if (objc == 4) {
-        return ObjSetResult(interp, objv[3]);
+int Twapi_KlFieldsObjCmd(
+    ClientData dummy,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *CONST objv[])
+{
+    Tcl_Obj **elems;
+    Tcl_Obj  *resultObj;
+    Tcl_Size  count, i;
+
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "KEYLIST");
+        return TCL_ERROR;
+    }
+
+    if (KlGetElements(interp, objv[1], 1, &count, &elems) != TCL_OK)
+        return TCL_ERROR;
+
+    resultObj = ObjNewList(0, NULL);
+    for (i = 0; i < count; i += 2)
+        ObjAppendElement(NULL, resultObj, elems[i]);
+    return ObjSetResult(interp, resultObj);
+}
+
+int Twapi_KlFlattenObjCmd(
+    ClientData dummy,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *CONST objv[])
+{
+    Tcl_Obj **kls;
+    Tcl_Obj **elems;
+    Tcl_Obj  *resultObj;
+    Tcl_Size  nkls, count, i;
+    int       j, pair;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "KEYLISTS ?FIELD ...?");
+        return TCL_ERROR;
+    }
+
+    if (ObjGetElements(interp, objv[1], &nkls, &kls) != TCL_OK)
+        return TCL_ERROR;
+
+    resultObj = ObjNewList(0, NULL);
+    for (i = 0; i < nkls; ++i) {
+        for (j = 2; j < objc; ++j) {
+            if (KlFind(interp, kls[i], objv[j], 0, &count, &elems, &pair) != TCL_OK)
+                goto error_return;
+            if (pair < 0) {
+                KlFieldNotFound(interp, objv[j]);
+                goto error_return;
+            }
+            ObjAppendElement(NULL, resultObj, elems[2*pair+1]);
+        }
     }
+    return ObjSetResult(interp, resultObj);
 
-    Tcl_AppendResult(interp, "No field ", key, " found in keyed list.", NULL);
+error_return:
+    Twapi_FreeNewTclObj(resultObj);
     return TCL_ERROR;
 }
@@ -6,6 +6,8 @@
  */
 
 #include "twapi.h"
+#include <process.h>
+#include "pipering.h"
 
 #ifndef TWAPI_SINGLE_MODULE
 static HMODULE gModuleHandle;     /* DLL handle to ourselves */
@@ -19,6 +21,22 @@ typedef struct _NPipeChannel NPipeChannel;
 ZLINK_CREATE_TYPEDEFS(NPipeChannel); 
 ZLIST_CREATE_TYPEDEFS(NPipeChannel);
 
+typedef struct _NPipePool NPipePool;
+ZLINK_CREATE_TYPEDEFS(NPipePool); 
+ZLIST_CREATE_TYPEDEFS(NPipePool);
+
+/*
+ * Each overlapped operation on a pipe uses one of these. Completions are
+ * delivered by the thread pool (see BindIoCompletionCallback) and the
+ * containing struct identifies the channel and ring slot.
+ */
+typedef struct _NPipeOvl {
+    OVERLAPPED ovl;
+    NPipeChannel *pcP;
+    int direction;              /* READER, WRITER or NPIPE_CONNECT */
+    int slot;                   /* Index of ring slot */
+} NPipeOvl;
+
 typedef struct _NPipeChannel {
     ZLINK_DECL(NPipeChannel); /* List of registered pipes. Access sync
                                    through global pipe channel lock */
@@ -27,36 +45,38 @@ typedef struct _NPipeChannel {
                                of the corresponding thread. */
     Tcl_Channel channel;           /* The corresponding Tcl_Channel handle */
     HANDLE  hpipe;   /* Handle to the pipe */
-    HANDLE  hsync;   /* Event used for synchronous I/O, both read and write.
-                        Needed because we cannot use the hevent field
-                        for sync i/o as the thread pool will also be waiting
-                        on it */
-    struct _NPipeIO {
-        OVERLAPPED ovl;         /* Used in async i/o. Note the ovl.hEvent field
-                                   is always set at init time */
-        HANDLE hwait;       /* Handle returned by thread pool wait functions. */
-        HANDLE hevent;      /* Event for thread pool to wait on */
-        union {
-            char read_ahead[1];     /* Used to read-ahead a single byte */
-            struct {
-                char *p;     /* Data to write out */
-                int   sz;    /* Size of buffer (not length of data) */
-            } write_buf;
-        } data;
-        LONG volatile state;    /* State values IOBUF_*. Writing PENDING to
-                                   this location or writing to this location
-                                   while it contains PENDING must be done
-                                   using Interlocked* Win32 API since in
-                                   that state the worker threads also access
-                                   the location. */
-#define IOBUF_IDLE         0    /* I/O buffer not in use, no pending ops */
-#define IOBUF_IO_PENDING   1    /* Overlapped I/O has been queued. Does
-                                   not mean thread pool is waiting on it. */
-#define IOBUF_IO_COMPLETED 2    /* Overlapped I/O completed, buffer in use */
-#define IOBUF_IO_COMPLETED_WITH_ERROR 3 /* Overlapped I/O completed with error */
-    } io[2];                   /* 0 -> read, 1 -> write */
+    HANDLE  hsync;   /* Event used for blocking writes. Always passed in
+                        the OVERLAPPED with the low order bit set so
+                        the completion is not queued to the thread pool */
+    HANDLE  hready;  /* Auto-reset event signalled by the thread pool
+                        after every completion. Used to wait in blocking
+                        reads and when draining output on close. Only
+                        closed when the last ref goes away as thread pool
+                        completions may still be running until then. */
+
+    /*
+     * Buffer rings for reads and writes. Reads are kept posted on all
+     * free read slots once the pipe is connected. Writes on non-blocking
+     * channels are gathered into write slots with several outstanding
+     * at a time. Slot states are changed by the thread pool only through
+     * PipeRingComplete. All other ring access is from the owning thread.
+     */
+    PipeRing rings[2];          /* 0 -> read, 1 -> write */
 #define READER 0
 #define WRITER 1
+#define NPIPE_CONNECT 2
+    NPipeOvl ovls[2][PIPERING_MAX_DEPTH]; /* One per ring slot */
+
+    NPipeOvl connect;                   /* Used for ConnectNamedPipe */
+    WIN32_ERROR connect_err;            /* Status of the connect */
+    LONG volatile connect_state;        /* State values IOBUF_*. Must
+                                           be changed using Interlocked*
+                                           while PENDING since the thread
+                                           pool also accesses it. */
+#define IOBUF_IDLE         0    /* No connect pending or not notified */
+#define IOBUF_IO_PENDING   1    /* Overlapped connect has been queued. */
+#define IOBUF_IO_COMPLETED 2    /* Connect completed, not yet processed */
+#define IOBUF_IO_COMPLETED_WITH_ERROR 3 /* Connect completed with error */
 
     int    flags;
 #define NPIPE_F_WATCHREAD       1 /* Generate event when data available */
@@ -65,11 +85,78 @@ typedef struct _NPipeChannel {
 #define NPIPE_F_CONNECTED       8 /* Client has successfully connected */
 #define NPIPE_F_EVENT_QUEUED   16 /* A TCL event has been queued */ 
 #define NPIPE_F_EOF_NOTIFIED   32 /* Have already notified EOF */
+#define NPIPE_F_READABLE       64 /* Channel is open for reading */
+#define NPIPE_F_SYNC_WRITTEN  128 /* Blocking write done, not notified */
 
     long volatile nrefs;              /* Ref count */
     WIN32_ERROR winerr;
+
+    /*
+     * Pool the pipe instance belongs to, if any. The pipe handle is then
+     * associated with the pool's completion port instead of the thread
+     * pool. pool_state tells which pool list the instance is linked on
+     * through the ZLINK above and is protected by the pool lock.
+     */
+    NPipePool *poolP;
+    int pool_state;
+#define NPIPE_POOL_NONE      0  /* Not on a pool list */
+#define NPIPE_POOL_LISTENING 1  /* Waiting for a client to connect */
+#define NPIPE_POOL_ACCEPTED  2  /* Connected, not handed to interp yet */
+    DWORD connect_ticks;        /* When the connect completed */
 } NPipeChannel;
 
+/*
+ * A pool of server pipe instances that are all driven from a single
+ * completion port serviced by a small number of worker threads. Connected
+ * instances are queued on the accepted list and turned into Tcl channels
+ * from the NPipe event source of the owning thread which also creates
+ * replacements so the number of listening instances stays constant.
+ */
+typedef struct _NPipePool {
+    ZLINK_DECL(NPipePool);      /* Link on NPipeTls pools list */
+    TwapiInterpContext *ticP;
+    TwapiId id;
+    Tcl_ThreadId thread;        /* Owning thread */
+    HANDLE iocp;
+    LONG volatile nrefs;        /* One for the interp registration and one
+                                   for each pipe instance attached */
+    LONG volatile live_workers; /* Last worker to exit frees the pool */
+    int nworkers;
+    int flags;
+#define NPIPE_POOL_F_EVENT_QUEUED 1 /* Only accessed from owning thread */
+    int closed;                     /* Only accessed from owning thread */
+
+    /* Parameters for creating pipe instances */
+    Tcl_Obj *nameObj;
+    Tcl_Obj *secattrObj;
+    DWORD open_mode;
+    DWORD pipe_mode;
+    DWORD max_instances;
+    DWORD inbuf_sz;
+    DWORD outbuf_sz;
+    DWORD timeout;
+    int ninstances;             /* Number of instances to keep listening */
+
+    /* Everything below is protected by lock */
+    CRITICAL_SECTION lock;
+    ZLIST_DECL(NPipeChannel) listening;
+    ZLIST_DECL(NPipeChannel) accepted;
+    /* Metrics */
+    Tcl_WideInt nconnects;      /* Total connect completions */
+    Tcl_WideInt naccepted;      /* Total channels handed to interp */
+    Tcl_WideInt nfailed;        /* Instances that failed to connect */
+    int max_backlog;            /* High water mark of accepted list */
+    DWORD max_latency;          /* Max ms from connect to handoff */
+    DWORD last_error;           /* Last error creating an instance */
+} NPipePool;
+
+#define NPIPE_POOL_KEY_QUIT 1   /* Completion key to stop pool workers */
+#define NPIPE_POOL_MAX_WORKERS 16
+
+/* Default number of ring slots. Slot size is the channel -buffersize */
+#define NPIPE_DEFAULT_READAHEAD  4
+#define NPIPE_DEFAULT_WRITEBEHIND 4
+
 #define SET_NPIPE_ERROR(ctxP_, err_) \
     ((ctxP_)->winerr == ERROR_SUCCESS ? ((ctxP_)->winerr = (err_)) : (ctxP_)->winerr)
 #define NPIPE_CONNECTED(pcP_) ((pcP_)->flags & NPIPE_F_CONNECTED)
@@ -81,40 +168,40 @@ typedef struct _NPipeChannel {
  */
 #define NPIPE_EOF(pcP_) \
     ((pcP_)->winerr == ERROR_HANDLE_EOF ||      \
-     (pcP)->winerr == ERROR_BROKEN_PIPE ||      \
-     (pcP)->winerr == 0xc000014b)
+     (pcP_)->winerr == ERROR_BROKEN_PIPE ||     \
+     (pcP_)->winerr == 0xc000014b)
 
 #define NPIPE_EOF_NOTIFIABLE(pcP_) \
     (NPIPE_EOF(pcP_) && !((pcP_)->flags & NPIPE_F_EOF_NOTIFIED))
 
+#define NPIPE_CONNECT_NOTIFIABLE(pcP_) \
+    ((pcP_)->connect_state == IOBUF_IO_COMPLETED ||                     \
+     (pcP_)->connect_state == IOBUF_IO_COMPLETED_WITH_ERROR)
+
 /*
- * When should we notify for a read/write - data i/o completed
- * Note we do not include IDLE state as then we would continually generate
- * (potentially) notifications.
+ * When should we notify for a read/write - connect completed, data
+ * available to read, or writes completed. Note we do not include
+ * read data unless reads are being watched since reads are always
+ * posted and we would otherwise continually generate notifications.
  * Errors are only notified in connecting stage ( is that correct ?)
  */
 #define NPIPE_READ_NOTIFIABLE(pcP_) \
-    (((pcP_)->io[READER].state == IOBUF_IO_COMPLETED) ||                \
-     ((pcP_)->io[READER].state == IOBUF_IO_COMPLETED_WITH_ERROR) ||     \
+    ((((pcP_)->flags & NPIPE_F_WATCHREAD) &&                            \
+      PipeRingReady(&(pcP_)->rings[READER])) ||                         \
+     NPIPE_CONNECT_NOTIFIABLE(pcP_) ||                                  \
      ((pcP_)->winerr != ERROR_SUCCESS && !NPIPE_CONNECTED(pcP_)))
 
 #define NPIPE_WRITE_NOTIFIABLE(pcP_) \
-    (((pcP_)->io[WRITER].state == IOBUF_IO_COMPLETED) ||                \
-     ((pcP_)->io[WRITER].state == IOBUF_IO_COMPLETED_WITH_ERROR) ||     \
+    (PipeRingReady(&(pcP_)->rings[WRITER]) ||                           \
+     ((pcP_)->flags & NPIPE_F_SYNC_WRITTEN) ||                          \
+     NPIPE_CONNECT_NOTIFIABLE(pcP_) ||                                  \
      ((pcP_)->winerr != ERROR_SUCCESS && !NPIPE_CONNECTED(pcP_)))
 
 /* Combination of above */
 #define NPIPE_NOTIFIABLE(pcP_) \
-    (((pcP_)->io[READER].state == IOBUF_IO_COMPLETED) ||                \
-     ((pcP_)->io[READER].state == IOBUF_IO_COMPLETED_WITH_ERROR) ||     \
-     ((pcP_)->io[WRITER].state == IOBUF_IO_COMPLETED) ||                \
-     ((pcP_)->io[WRITER].state == IOBUF_IO_COMPLETED_WITH_ERROR) ||     \
-     NPIPE_EOF_NOTIFIABLE(pcP_) ||                                                 \
-     ((pcP_)->winerr != ERROR_SUCCESS && !NPIPE_CONNECTED(pcP_)))
-
-/* Is an async i/o pending ? */
-#define NPIPE_READ_PENDING(pcP_) ((pcP_)->io[READER].state == IOBUF_IO_PENDING)
-#define NPIPE_WRITE_PENDING(pcP_) ((pcP_)->io[WRITER].state == IOBUF_IO_PENDING)
+    (NPIPE_READ_NOTIFIABLE(pcP_) ||                                     \
+     NPIPE_WRITE_NOTIFIABLE(pcP_) ||                                    \
+     NPIPE_EOF_NOTIFIABLE(pcP_))
 
 
 /*
@@ -126,6 +213,7 @@ typedef struct _NPipeTls {
      */
     CRITICAL_SECTION lock;
     ZLIST_DECL(NPipeChannel) pipes;
+    ZLIST_DECL(NPipePool) pools;
     
 } NPipeTls;
 
@@ -139,11 +227,17 @@ typedef struct _NPipeEvent {
     HANDLE hpipe;               /* Pipe to which this event relates */
 } NPipeEvent;
 
+typedef struct _NPipePoolEvent {
+    Tcl_Event header;
+    TwapiId id;                 /* Pool to which this event relates */
+} NPipePoolEvent;
+
 
 static TwapiOneTimeInitState gNPipeModuleInitialized;
 
 /* Prototypes */
 static int NPipeEventProc(Tcl_Event *, int flags);
+static int NPipePoolEventProc(Tcl_Event *, int flags);
 
 #if TCL_MAJOR_VERSION < 9
 static Tcl_DriverCloseProc NPipeCloseProc;
@@ -155,6 +249,8 @@ static Tcl_DriverWatchProc NPipeWatchProc;
 static Tcl_DriverGetHandleProc NPipeGetHandleProc;
 static Tcl_DriverBlockModeProc NPipeBlockProc;
 static Tcl_DriverThreadActionProc NPipeThreadActionProc;
+static Tcl_DriverSetOptionProc NPipeSetOptionProc;
+static Tcl_DriverGetOptionProc NPipeGetOptionProc;
 
 static Tcl_ChannelType gNPipeChannelDispatch = {
     "namedpipe",
@@ -167,8 +263,8 @@ static Tcl_ChannelType gNPipeChannelDispatch = {
     NPipeInputProc,
     NPipeOutputProc,
     NULL /* ChannelSeek */,
-    NULL /* ChannelSetOption */,
-    NULL /* ChannelGetOption */,
+    NPipeSetOptionProc,
+    NPipeGetOptionProc,
     NPipeWatchProc,
     NPipeGetHandleProc,
     NPipeClose2Proc,
@@ -186,6 +282,8 @@ static void NPipeChannelDelete(NPipeChannel *pcP);
 void NPipeChannelUnref(NPipeChannel *pcP, int decr);
 static NPipeTls *GetNPipeTls();
 static void NPipeShutdown(Tcl_Interp *interp, NPipeChannel *pcP, int unrefs);
+static void NPipePoolUnref(NPipePool *poolP, int decr);
+static void NPipePoolConnectDone(NPipeChannel *pcP, WIN32_ERROR winerr);
 
 /*
  * Map Win32 errors to Tcl errno. Note it is important to use the same
@@ -240,6 +338,7 @@ void NPipeSetupProc(
     int flags)			/* Event flags as passed to Tcl_DoOneEvent. */
 {
     NPipeChannel *pcP;
+    NPipePool *poolP;
     NPipeTls *tlsP;
 
     if (!(flags & TCL_FILE_EVENTS)) {
@@ -258,7 +357,17 @@ void NPipeSetupProc(
             Tcl_Time blockTime = { 0, 0 };
             /* Set block time to 0 so event loop will call us right away */
 	    Tcl_SetMaxBlockTime(&blockTime);
-	    break;
+	    return;
+	}
+    }
+
+    for (poolP = ZLIST_HEAD(&tlsP->pools) ; poolP ; poolP = ZLIST_NEXT(poolP)) {
+        /* Unlocked peek at the list count. Pool workers alert us after
+           adding to the list so a stale value only delays the event */
+        if (ZLIST_COUNT(&poolP->accepted) != 0) {
+            Tcl_Time blockTime = { 0, 0 };
+	    Tcl_SetMaxBlockTime(&blockTime);
+	    return;
 	}
     }
 }
@@ -274,8 +383,10 @@ static void NPipeCheckProc(
     int flags)			/* Event flags as passed to Tcl_DoOneEvent. */
 {
     NPipeChannel *pcP;
+    NPipePool *poolP;
     NPipeTls *tlsP;
     NPipeEvent *evP;
+    NPipePoolEvent *pevP;
 
     if (!(flags & TCL_FILE_EVENTS)) {
 	return;
@@ -319,6 +430,18 @@ static void NPipeCheckProc(
 	    Tcl_QueueEvent(&evP->header, TCL_QUEUE_TAIL);
 	}
     }
+
+    for (poolP = ZLIST_HEAD(&tlsP->pools) ; poolP ; poolP = ZLIST_NEXT(poolP)) {
+        if (ZLIST_COUNT(&poolP->accepted) != 0 &&
+            !(poolP->flags & NPIPE_POOL_F_EVENT_QUEUED)) {
+	    pevP = (NPipePoolEvent *) ckalloc(sizeof(*pevP));
+	    pevP->header.proc = NPipePoolEventProc;
+	    pevP->id = poolP->id;
+            poolP->flags |= NPIPE_POOL_F_EVENT_QUEUED;
+            /* As for pipes, the receiver locates the pool by its id */
+	    Tcl_QueueEvent(&pevP->header, TCL_QUEUE_TAIL);
+	}
+    }
 }
 
 static NPipeTls *GetNPipeTls()
@@ -335,6 +458,7 @@ static NPipeTls *GetNPipeTls()
      */
     InitializeCriticalSectionAndSpinCount(&tlsP->lock, 4000);
     ZLIST_INIT(&tlsP->pipes);
+    ZLIST_INIT(&tlsP->pools);
 
     //TBD - any other init tlsP?
 
@@ -347,31 +471,48 @@ static NPipeTls *GetNPipeTls()
     return tlsP;
 }
 
+static int NPipeReadPostFn(void *ctx, int slot, char *p, size_t len);
+static int NPipeWritePostFn(void *ctx, int slot, char *p, size_t len);
+
 /* Always returns non-NULL, or panics */
 static NPipeChannel *NPipeChannelNew(void)
 {
     NPipeChannel *pcP;
+    int i;
 
     pcP = (NPipeChannel *) TwapiAlloc(sizeof(*pcP));
     pcP->thread = NULL;
     pcP->channel = NULL;
     pcP->hpipe = INVALID_HANDLE_VALUE;
     pcP->hsync = NULL;
+    pcP->hready = NULL;
+
+    PipeRingInit(&pcP->rings[READER], NPipeReadPostFn, pcP,
+                 NPIPE_DEFAULT_READAHEAD, 0);
+    PipeRingInit(&pcP->rings[WRITER], NPipeWritePostFn, pcP,
+                 NPIPE_DEFAULT_WRITEBEHIND, 0);
+    for (i = 0; i < PIPERING_MAX_DEPTH; ++i) {
+        pcP->ovls[READER][i].pcP = pcP;
+        pcP->ovls[READER][i].direction = READER;
+        pcP->ovls[READER][i].slot = i;
+        pcP->ovls[WRITER][i].pcP = pcP;
+        pcP->ovls[WRITER][i].direction = WRITER;
+        pcP->ovls[WRITER][i].slot = i;
+    }
 
-    pcP->io[READER].hwait = INVALID_HANDLE_VALUE;
-    pcP->io[READER].hevent = NULL;
-    pcP->io[READER].state = IOBUF_IDLE;
-
-    pcP->io[WRITER].hwait = INVALID_HANDLE_VALUE;
-    pcP->io[WRITER].hevent = NULL;
-    pcP->io[WRITER].state = IOBUF_IDLE;
-    pcP->io[WRITER].data.write_buf.p = NULL;
-    pcP->io[WRITER].data.write_buf.sz = 0;
+    pcP->connect.pcP = pcP;
+    pcP->connect.direction = NPIPE_CONNECT;
+    pcP->connect.slot = 0;
+    pcP->connect_state = IOBUF_IDLE;
+    pcP->connect_err = ERROR_SUCCESS;
 
     pcP->flags = 0;
 
     pcP->winerr = ERROR_SUCCESS;
     pcP->nrefs = 0;
+    pcP->poolP = NULL;
+    pcP->pool_state = NPIPE_POOL_NONE;
+    pcP->connect_ticks = 0;
     ZLINK_INIT(pcP);
     return pcP;
 }
@@ -380,15 +521,21 @@ static void NPipeChannelDelete(NPipeChannel *pcP)
 {
     TWAPI_ASSERT(pcP->thread == NULL);
     TWAPI_ASSERT(pcP->nrefs <= 0);
-    TWAPI_ASSERT(pcP->io[READER].hwait == INVALID_HANDLE_VALUE);
-    TWAPI_ASSERT(pcP->io[READER].hevent == NULL);
-    TWAPI_ASSERT(pcP->io[WRITER].hwait == INVALID_HANDLE_VALUE);
-    TWAPI_ASSERT(pcP->io[WRITER].hevent == NULL);
     TWAPI_ASSERT(pcP->hsync == NULL);
     TWAPI_ASSERT(pcP->hpipe == INVALID_HANDLE_VALUE);
 
-    if (pcP->io[WRITER].data.write_buf.p)
-        TwapiFree(pcP->io[WRITER].data.write_buf.p);
+    /*
+     * No I/O can be outstanding at this point since every posted
+     * operation holds a ref until its completion has run.
+     */
+    if (pcP->hready)
+        CloseHandle(pcP->hready);
+    PipeRingFree(&pcP->rings[READER]);
+    PipeRingFree(&pcP->rings[WRITER]);
+
+    /* Completion port must stay serviced until the pipe is gone */
+    if (pcP->poolP)
+        NPipePoolUnref(pcP->poolP, 1);
 
     TwapiFree(pcP);
 }
@@ -403,55 +550,144 @@ void NPipeChannelUnref(NPipeChannel *pcP, int decr)
 }
 
 /*
- * Called from thread pool when a overlapped read or write completes.
- * Note this must match the prototype typedef for WaitOrTimerCallback 
+ * Called from the thread pool, or a pool worker, when an overlapped
+ * operation on the pipe completes. Note this must match the prototype
+ * typedef for LPOVERLAPPED_COMPLETION_ROUTINE.
  */
-static void NPipeThreadPoolHandler(
-    NPipeChannel *pcP,
-    int direction               /* READER or WRITER */
+static VOID CALLBACK NPipeIoCompletionFn(
+    DWORD winerr,
+    DWORD nbytes,
+    LPOVERLAPPED ovlP
 )
 {
-    LONG state;
+    NPipeOvl *npovlP = CONTAINING_RECORD(ovlP, NPipeOvl, ovl);
+    NPipeChannel *pcP = npovlP->pcP;
+    Tcl_ThreadId thread;
+    int changed;
+
+    if (npovlP->direction == NPIPE_CONNECT && pcP->poolP) {
+        /* Pool instances are handed over by the pool, not notified */
+        NPipePoolConnectDone(pcP, winerr);
+        changed = 0;
+    } else if (npovlP->direction == NPIPE_CONNECT) {
+        pcP->connect_err = winerr;
+        changed = InterlockedCompareExchange(
+            &pcP->connect_state,
+            winerr == ERROR_SUCCESS ? IOBUF_IO_COMPLETED : IOBUF_IO_COMPLETED_WITH_ERROR,
+            IOBUF_IO_PENDING) == IOBUF_IO_PENDING;
+    } else {
+        changed = PipeRingComplete(&pcP->rings[npovlP->direction],
+                                   npovlP->slot, nbytes, winerr);
+    }
 
-    TWAPI_ASSERT(HasOverlappedIoCompleted(&pcP->io[direction].ovl));
+    SetEvent(pcP->hready);
+    thread = pcP->thread;
+    if (changed && thread) {
+        /* Since we changed state, wake up the thread */
+        Tcl_ThreadAlert(thread);
+    }
 
-    state = pcP->io[direction].ovl.Internal == ERROR_SUCCESS
-        ? IOBUF_IO_COMPLETED : IOBUF_IO_COMPLETED_WITH_ERROR;
+    NPipeChannelUnref(pcP, 1);  /* Ref taken when the I/O was posted */
+}
 
-    /*
-     * We only change state if it was IO_PENDING else someone has already
-     * taken over the buffer
-     */
-    state = InterlockedCompareExchange(&pcP->io[direction].state,
-                                       state, IOBUF_IO_PENDING);
-    if (state == IOBUF_IO_PENDING) {
-        /* Since we changed state, wake up the thread */
-        Tcl_ThreadAlert(pcP->thread);
+/*
+ * Starts an overlapped read or write on a ring slot. Called through
+ * PipeRing post callbacks. Note that with the handle bound to the
+ * thread pool, completions are queued even when the I/O completes
+ * synchronously so the async path is always followed.
+ */
+static int NPipePostIo(NPipeChannel *pcP, int direction, int slot,
+                       char *p, size_t len)
+{
+    NPipeOvl *npovlP = &pcP->ovls[direction][slot];
+    BOOL ok;
+
+    TwapiZeroMemory(&npovlP->ovl, sizeof(npovlP->ovl));
+    NPipeChannelRef(pcP, 1);    /* Released by NPipeIoCompletionFn */
+    if (direction == READER)
+        ok = ReadFile(pcP->hpipe, p, (DWORD) len, NULL, &npovlP->ovl);
+    else
+        ok = WriteFile(pcP->hpipe, p, (DWORD) len, NULL, &npovlP->ovl);
+    if (! ok) {
+        WIN32_ERROR winerr = GetLastError();
+        if (winerr != ERROR_IO_PENDING) {
+            /* No completion will be queued. Caller holds a ref so pcP
+               will not go away here */
+            NPipeChannelUnref(pcP, 1);
+            return winerr;
+        }
     }
+    return ERROR_SUCCESS;
+}
+
+static int NPipeReadPostFn(void *ctx, int slot, char *p, size_t len)
+{
+    return NPipePostIo((NPipeChannel *) ctx, READER, slot, p, len);
+}
+
+static int NPipeWritePostFn(void *ctx, int slot, char *p, size_t len)
+{
+    return NPipePostIo((NPipeChannel *) ctx, WRITER, slot, p, len);
 }
 
 /*
- * Called from thread pool when a overlapped read completes.
- * Note this must match the prototype typedef for WaitOrTimerCallback 
+ * The system completes an overlapped operation before the thread pool
+ * delivers the completion. If the oldest operation on a ring has completed
+ * in that sense, waits for the delivery so callers do not report
+ * EAGAIN for data that is already in our buffers.
  */
-static VOID CALLBACK NPipeReadThreadPoolFn(
-    PVOID lpParameter,
-    BOOLEAN TimerOrWaitFired
-)
+static void NPipeAwaitCompletion(NPipeChannel *pcP, int direction)
+{
+    PipeRing *ringP = &pcP->rings[direction];
+
+    while (ringP->count > 0 &&
+           ringP->slots[ringP->head].state == PIPERING_SLOT_POSTED &&
+           HasOverlappedIoCompleted(&pcP->ovls[direction][ringP->head].ovl)) {
+        WaitForSingleObject(pcP->hready, 10);
+    }
+}
+
+/* Picks up the channel -buffersize as the size of the ring buffers */
+static void NPipeConfigureRings(NPipeChannel *pcP)
+{
+    size_t bufsize;
+
+    if (pcP->channel == NULL)
+        return;
+    bufsize = Tcl_GetChannelBufferSize(pcP->channel);
+    PipeRingConfigure(&pcP->rings[READER], 0, bufsize);
+    PipeRingConfigure(&pcP->rings[WRITER], 0, bufsize);
+}
+
+/* Posts reads on all free read slots. */
+static void NPipeStartReads(NPipeChannel *pcP)
 {
-    NPipeThreadPoolHandler((NPipeChannel *) lpParameter, READER);
+    TWAPI_ASSERT(NPIPE_CONNECTED(pcP));
+
+    if (pcP->flags & NPIPE_F_READABLE) {
+        NPipeConfigureRings(pcP);
+        /* Errors are picked up in order with the data when reading */
+        PipeRingFill(&pcP->rings[READER]);
+    }
 }
 
 /*
- * Called from thread pool when a overlapped write completes.
- * Note this must match the prototype typedef for WaitOrTimerCallback 
+ * Processes a completed ConnectNamedPipe. Returns 1 if there was a
+ * completion to process, else 0.
  */
-static VOID CALLBACK NPipeWriteThreadPoolFn(
-    PVOID lpParameter,
-    BOOLEAN TimerOrWaitFired
-)
+static int NPipeCompleteConnect(NPipeChannel *pcP)
 {
-    NPipeThreadPoolHandler((NPipeChannel *) lpParameter, WRITER);
+    if (! NPIPE_CONNECT_NOTIFIABLE(pcP))
+        return 0;
+
+    if (pcP->connect_state == IOBUF_IO_COMPLETED_WITH_ERROR)
+        SET_NPIPE_ERROR(pcP, pcP->connect_err);
+    pcP->connect_state = IOBUF_IDLE;
+    /* Marked as connected even on error so I/O calls report the error */
+    pcP->flags |= NPIPE_F_CONNECTED;
+    if (pcP->winerr == ERROR_SUCCESS)
+        NPipeStartReads(pcP);
+    return 1;
 }
 
 /*
@@ -486,43 +722,31 @@ static int NPipeEventProc(
     /* Indicate no events on queue so new events will be enqueued */
     pcP->flags &= ~ NPIPE_F_EVENT_QUEUED;
 
-#if 0
-WRONG - there is something to do -> change the io buf state on writes
-    /*
-     * If we are connected but not watching any reads or writes, 
-     * nothing to do.
-     */
-    if (NPIPE_CONNECTED(pcP) &&
-        ! (pcP->flags & (NPIPE_F_WATCHWRITE | NPIPE_F_WATCHREAD))) {
-        return 1;               /* Not watching any reads or writes */
-    }
-#endif
-
-    /* Update channel state error if necessary */
-    if (pcP->io[READER].state == IOBUF_IO_COMPLETED_WITH_ERROR) {
-        SET_NPIPE_ERROR(pcP, (WIN32_ERROR) pcP->io[READER].ovl.Internal);
-    }
-    if (pcP->io[WRITER].state == IOBUF_IO_COMPLETED_WITH_ERROR) {
-        SET_NPIPE_ERROR(pcP, (WIN32_ERROR) pcP->io[WRITER].ovl.Internal);
-    }
-
-    /* Now set the direction bits that are notifiable */
-    if ((pcP->flags & NPIPE_F_WATCHREAD) && NPIPE_READ_NOTIFIABLE(pcP)) {
-        event_mask |= TCL_READABLE;
+    /* A connect completion is notified as both readable and writable */
+    if (NPipeCompleteConnect(pcP)) {
+        if (pcP->flags & NPIPE_F_WATCHREAD)
+            event_mask |= TCL_READABLE;
+        if (pcP->flags & NPIPE_F_WATCHWRITE)
+            event_mask |= TCL_WRITABLE;
     }
 
+    /*
+     * Release completed writes. This also submits output that was
+     * gathered while those writes were in progress.
+     */
     if (NPIPE_WRITE_NOTIFIABLE(pcP)) {
-        /* This might be a connect complete */
-        if (! NPIPE_CONNECTED(pcP)) {
-            pcP->flags |= NPIPE_F_CONNECTED;
-            /* Also mark as readable on connect complete */
-            if (pcP->flags & NPIPE_F_WATCHREAD)
-                event_mask |= TCL_READABLE;
-        }
+        pcP->flags &= ~ NPIPE_F_SYNC_WRITTEN;
+        if (PipeRingReap(&pcP->rings[WRITER]) != ERROR_SUCCESS)
+            SET_NPIPE_ERROR(pcP, (WIN32_ERROR) pcP->rings[WRITER].err);
         if (pcP->flags & NPIPE_F_WATCHWRITE)
             event_mask |= TCL_WRITABLE;
     }
 
+    /* Note READ_NOTIFIABLE already checks if reads are being watched */
+    if (NPIPE_READ_NOTIFIABLE(pcP)) {
+        event_mask |= TCL_READABLE;
+    }
+
     /* On EOF, both read and write notification are set */
     if (NPIPE_EOF_NOTIFIABLE(pcP)) {
         if (pcP->flags & NPIPE_F_WATCHWRITE)
@@ -533,15 +757,6 @@ WRONG - there is something to do -> change the io buf state on writes
         pcP->flags |= NPIPE_F_EOF_NOTIFIED;
     }
 
-    /*
-     * Mark write direction as idle if write completed successfully.
-     * Note this includes a connection completion which also uses the WRITER
-     * io struct.
-     */
-    InterlockedCompareExchange(&pcP->io[WRITER].state,
-                               IOBUF_IDLE,
-                               IOBUF_IO_COMPLETED);
-
     if (event_mask) {
         Tcl_NotifyChannel(pcP->channel, event_mask);
     }
@@ -553,138 +768,25 @@ WRONG - there is something to do -> change the io buf state on writes
     return 1;
 }
 
-/* Sets up overlapped reads on a pipe. */
-static void NPipeWatchReads(NPipeChannel *pcP)
-{
-    TWAPI_ASSERT(NPIPE_CONNECTED(pcP));
-
-    /*
-     * If channel has errored , ignore orders.
-     * If a previous I/O has completed, ignore as well since we cannot
-     * use the input buffer. The read completion handler will set up
-     * the watch later.
-     */
-    if (pcP->winerr != ERROR_SUCCESS ||
-        pcP->io[READER].state == IOBUF_IO_COMPLETED ||
-        pcP->io[READER].state == IOBUF_IO_COMPLETED_WITH_ERROR) {
-        /* Note we do not mark it here as a pipe error (pcP->winerr) */
-        return;
-    }
-
-    /*
-     * If a read is not already pending, initiate it.
-     * We set up a single byte read so we're told when data is available.
-     * We do not bother to special case when i/o completes immediately.
-     * Let it also follow the async path for simplicity.
-     */
-    if (pcP->io[READER].state != IOBUF_IO_PENDING) {
-        pcP->io[READER].state = IOBUF_IO_PENDING; /* Important to set this first since reader thread might run immediately */
-        TwapiZeroMemory(&pcP->io[READER].ovl, sizeof(pcP->io[READER].ovl));
-        pcP->io[READER].ovl.hEvent = pcP->io[READER].hevent;
-        if (! ReadFile(pcP->hpipe,
-                       &pcP->io[READER].data.read_ahead,
-                       1,
-                       NULL,
-                       &pcP->io[READER].ovl)) {
-            WIN32_ERROR winerr = GetLastError();
-            if (winerr != ERROR_IO_PENDING) {
-                pcP->io[READER].state = IOBUF_IDLE;
-                pcP->winerr = winerr;
-                return;
-            }
-        }
-    }
-
-    /* Have the thread pool wait on it if not already doing so */
-    if (pcP->io[READER].hwait == INVALID_HANDLE_VALUE) {
-        /* The thread pool will hold a ref to the context */
-        NPipeChannelRef(pcP, 1);
-        if (! RegisterWaitForSingleObject(
-                &pcP->io[READER].hwait,
-                pcP->io[READER].hevent,
-                NPipeReadThreadPoolFn,
-                pcP,
-                INFINITE,           /* No timeout */
-                WT_EXECUTEDEFAULT
-                )) {
-            NPipeChannelUnref(pcP, 1);
-            pcP->io[READER].hwait = INVALID_HANDLE_VALUE; /* Just in case... */
-            /* Note the call does not set GetLastError. Make up our own */
-            pcP->winerr = TWAPI_ERROR_TO_WIN32(TWAPI_REGISTER_WAIT_FAILED);
-            return;
-        }
-
-    }
-
-    return;
-}
-
-static void NPipeDisableWatch(NPipeChannel *pcP, int direction)
-{
-    if (pcP->io[direction].hwait != INVALID_HANDLE_VALUE) {
-        UnregisterWaitEx(pcP->io[direction].hwait, INVALID_HANDLE_VALUE);
-        pcP->io[direction].hwait = INVALID_HANDLE_VALUE;
-        NPipeChannelUnref(pcP, 1);
-    }
-
-    /*
-     * Note io state might still be PENDING with an outstanding overlapped
-     * operation that has not yet completed. The read/write routines
-     * handle that appropriately.
-     */
-}
-
 /* Called from Tcl I/O to indicate an interest in TCL_READABLE/TCL_WRITABLE */
 static void NPipeWatchProc(ClientData clientdata, int mask)
 {
     NPipeChannel *pcP = (NPipeChannel *)clientdata;
 
-    if (mask & TCL_READABLE) {
-        /* Only take action if we are not already watching reads */
-        if (! (pcP->flags & NPIPE_F_WATCHREAD)) {
-            pcP->flags |= NPIPE_F_WATCHREAD;
-            /*
-             * Set up the read only if we are connected.
-             * If not connected, the connection complete code
-             * will set up the read events.
-             */
-            if (NPIPE_CONNECTED(pcP)) {
-                /*
-                 * May set pcP errors. Those are automatically handled when
-                 * we check for watchable events at function exit.
-                 */
-                NPipeWatchReads(pcP);
-            }
-        }
-    } else {
-        /* Not interested in reads, turn them off */
+    /*
+     * Reads are kept posted irrespective of whether they are being
+     * watched and write completions are always tracked, so we only need
+     * to record what the channel is interested in.
+     */
+    if (mask & TCL_READABLE)
+        pcP->flags |= NPIPE_F_WATCHREAD;
+    else
         pcP->flags &= ~ NPIPE_F_WATCHREAD;
-        NPipeDisableWatch(pcP, READER);
-    }
-
-    /* Now do the write side in more or less identical fashion */
-    if (mask & TCL_WRITABLE) {
-        if (! (pcP->flags & NPIPE_F_WATCHWRITE)) {
-            pcP->flags |= NPIPE_F_WATCHWRITE;
-            /*
-             * Note we do not need to set up the thread pool callback here.
-             * Non-blocking pipes, it will already be set up. For blocking case,
-             * write notifications will be generated after every write anyways.
-             */
-        }
-    } else {
-        /* Not interested in writes. Turn them off if currently on */
-        if (pcP->flags & NPIPE_F_WATCHWRITE) {
-            pcP->flags &= ~ NPIPE_F_WATCHWRITE;
-            /*
-             * Note we disable watching only on blocking pipes since
-             * non-blocking pipes require the thread pool to be running
-             */
-            if ((pcP->flags & NPIPE_F_NONBLOCKING) == 0)
-                NPipeDisableWatch(pcP, WRITER);
-        }
-    }
 
+    if (mask & TCL_WRITABLE)
+        pcP->flags |= NPIPE_F_WATCHWRITE;
+    else
+        pcP->flags &= ~ NPIPE_F_WATCHWRITE;
 
     /* Finally, if any watchable events, trigger them */
     if (mask & (TCL_READABLE|TCL_WRITABLE)) {
@@ -749,85 +851,6 @@ static int NPipeBlockProc(ClientData clientdata, int mode)
 }
 
 
-/*
- * Read up to buf_sz bytes. Returns number of bytes read. For non-blocking
- * channels, if no data available, returns 0. For blocking channels, will
- * block until at least one byte is available. In case of errors, returns
- * 0. Caller can distinguish between "no data" for non-blocking channels
- * and error by checking pcP->winerr.
- */
-static DWORD NPipeReadData(NPipeChannel *pcP, char *bufP, DWORD bufsz)
-{
-    struct _NPipeIO *ioP = &pcP->io[READER];
-    DWORD overlap_count;      /* Count returned in async completion */
-    DWORD sync_count;         /* Count returned in sync completion */
-    DWORD num_to_read;        /* How much to try and read */
-    DWORD nread = 0;          /* Actually read */
-
-    /* Must not be a pending read or error*/
-    TWAPI_ASSERT(ioP->state != IOBUF_IO_PENDING && ioP->state != IOBUF_IO_COMPLETED_WITH_ERROR);
-    TWAPI_ASSERT(bufsz > 0);
-
-    if (ioP->state == IOBUF_IO_COMPLETED) {
-        --bufsz;
-        ++nread;
-        *bufP++ = ioP->data.read_ahead[0];
-        ioP->state = IOBUF_IDLE;
-    }
-
-    if (bufsz == 0)
-        return nread;      /* Only asked for a single byte */
-
-    if (!PeekNamedPipe(pcP->hpipe, NULL, 0, NULL, &num_to_read, NULL)) {
-        pcP->winerr = GetLastError();
-        return 0;
-    }
-
-    if (num_to_read == 0) {
-        if (pcP->flags & NPIPE_F_NONBLOCKING) {
-            /* Non-blocking. Return what we have, if anything */
-            return nread; /* May be 0 */
-        }
-        num_to_read = 1;        /* Blocking chan - Wait for at least one byte */
-    }
-
-    if (num_to_read > bufsz)
-        num_to_read = bufsz;
-    
-    TwapiZeroMemory(&ioP->ovl, sizeof(ioP->ovl));
-    ioP->ovl.hEvent = pcP->hsync; /* Event used for "synchronous" reads */
-    if (ReadFile(pcP->hpipe, bufP, num_to_read, &sync_count, &ioP->ovl)) {
-        /*
-         * Synchronous completion. Note must not use GetOverlappedResult
-         * (see http://support.microsoft.com/kb/156932)
-         */
-        nread += sync_count;
-    } else {
-        WIN32_ERROR winerr = GetLastError();
-        if (winerr != ERROR_IO_PENDING) {
-            ioP->ovl.hEvent = NULL;
-            pcP->winerr = winerr;
-            return 0;
-        }
-        /*
-         * Pending I/O - when we have blocking reads and not enough data
-         * in pipe. Fall thru, will block in GetOverlappedResult
-         */
-        if (!GetOverlappedResult(pcP->hpipe, &ioP->ovl, &overlap_count, TRUE)) {
-            ioP->ovl.hEvent = NULL;
-            pcP->winerr = GetLastError();
-            return 0;
-        }
-        nread += overlap_count;
-    }
-
-    /* TBD - if more data is available in pipe, get it as well if there is room */
-
-    ioP->ovl.hEvent = NULL;
-
-    return nread;
-}
-
 /* Called from Tcl I/O channel layer to read bytes from the pipe */
 static int NPipeInputProc(
     ClientData clientdata,
@@ -836,33 +859,37 @@ static int NPipeInputProc(
     int *errnoP)
 {
     NPipeChannel *pcP = (NPipeChannel *)clientdata;
-    struct _NPipeIO *ioP;
-    DWORD nread;
+    PipeRing *ringP = &pcP->rings[READER];
+    size_t nread;
+    int winerr;
 
     TWAPI_ASSERT(pcP->thread == Tcl_GetCurrentThread());
 
+    NPipeCompleteConnect(pcP);
     if (! NPIPE_CONNECTED(pcP)) {
         /* Note we do not set pcP->winerr here */
         *errnoP = NPipeSetTclErrnoFromWin32Error(ERROR_PIPE_NOT_CONNECTED);
         return -1;
     }
 
-    ioP = &pcP->io[READER];
-
-    /* If thread pool thread has set an error, we need to copy it. */
-    if (ioP->state == IOBUF_IO_COMPLETED_WITH_ERROR)
-        SET_NPIPE_ERROR(pcP, (WIN32_ERROR) ioP->ovl.Internal);
-    
     if (pcP->winerr != ERROR_SUCCESS)
         goto error_return;
 
-    if (pcP->flags & NPIPE_F_NONBLOCKING) {
-        /* Non-blocking, we should always be either COMPLETED or PENDING */
-#if 0
-        TBD This assert fails as state is IDLE. I think that is legit but verify
-        TWAPI_ASSERT(ioP->state == IOBUF_IO_COMPLETED || ioP->state == IOBUF_IO_PENDING);
-#endif
-        if (ioP->state == IOBUF_IO_PENDING) {
+    /*
+     * Data is returned from completed read slots, in the order the reads
+     * were posted. Emptied slots are reposted by PipeRingRead.
+     */
+    NPipeConfigureRings(pcP);
+    while (1) {
+        NPipeAwaitCompletion(pcP, READER);
+        nread = PipeRingRead(ringP, bufP, buf_sz, &winerr);
+        if (nread)
+            return (int) nread;
+        if (winerr != ERROR_SUCCESS) {
+            SET_NPIPE_ERROR(pcP, (WIN32_ERROR) winerr);
+            goto error_return;
+        }
+        if (pcP->flags & NPIPE_F_NONBLOCKING) {
             /*
              * Non-blocking channel and we are awaiting data. We need to
              * return an EAGAIN or EWOULDBLOCK to Tcl. ERROR_PIPE_BUSY
@@ -871,59 +898,10 @@ static int NPipeInputProc(
             *errnoP = NPipeSetTclErrnoFromWin32Error(ERROR_PIPE_BUSY);
             return -1;
         }
-
-    } else {
-
-        /* Blocking I/O */
-        if (ioP->state == IOBUF_IO_PENDING) {
-            /*
-             * Blocking channel. Need to block waiting for data.
-             * but there is an outstanding I/O pending. May be a thread pool
-             * thread waiting on it via an overlapped read. Unregister it.
-             * Might not be the most efficient mechanism but the combination
-             * of fileevent with blocking channels is unlikely anyways.
-             */
-            if (ioP->hwait != INVALID_HANDLE_VALUE) {
-                UnregisterWaitEx(pcP->io[READER].hwait, INVALID_HANDLE_VALUE);
-                NPipeChannelUnref(pcP, 1);
-                ioP->hwait = INVALID_HANDLE_VALUE;
-            }
-            /* Note ioP->state might have changed while we unregistered */
-            /* If state is still pending, wait for outstanding read */
-            if (ioP->state == IOBUF_IO_PENDING) {
-                if (GetOverlappedResult(pcP->hpipe, &ioP->ovl, &nread, TRUE))
-                    ioP->state = IOBUF_IO_COMPLETED;
-                else
-                    ioP->state = IOBUF_IO_COMPLETED_WITH_ERROR;
-            }
-            if (ioP->state == IOBUF_IO_COMPLETED_WITH_ERROR) {
-                SET_NPIPE_ERROR(pcP, (WIN32_ERROR) ioP->ovl.Internal);
-                goto error_return;
-            }
-        }
+        /* Blocking channel. Wait for the thread pool to complete a read */
+        WaitForSingleObject(pcP->hready, INFINITE);
     }
 
-    TWAPI_ASSERT(ioP->state != IOBUF_IO_PENDING);
-
-    nread = NPipeReadData(pcP, bufP, buf_sz);
-    /* Note nread may be 0 for non-blocking pipes and no data */
-    if (pcP->winerr != ERROR_SUCCESS)
-        goto error_return;
-
-    /*
-     * Need to fire another read event if more data is available. This
-     * is also required in case we unregistered the thread pool wait
-     * in the blocking I/O case above.
-     */
-    if (pcP->flags & NPIPE_F_WATCHREAD)
-        NPipeWatchReads(pcP);
-    /*
-     * Note error, if any, from TwapiPipeEnableReadWatch ignored,
-     * will be picked up on next call
-     */
-
-    return nread;
-
 error_return:
     if (NPIPE_EOF(pcP)) {
         return 0;               /* EOF */
@@ -942,132 +920,83 @@ static int NPipeOutputProc(
     int *errnoP)
 {
     NPipeChannel *pcP = (NPipeChannel *)clientdata;
-    struct _NPipeIO *ioP;
+    PipeRing *ringP = &pcP->rings[WRITER];
+    OVERLAPPED ovl;
+    DWORD nwritten;
+    WIN32_ERROR winerr;
 
     TWAPI_ASSERT(pcP->thread == Tcl_GetCurrentThread());
 
+    NPipeCompleteConnect(pcP);
     if (! NPIPE_CONNECTED(pcP)) {
         /* Note we do not set pcP->winerr here */
         *errnoP = NPipeSetTclErrnoFromWin32Error(ERROR_PIPE_NOT_CONNECTED);
         return -1;
     }
 
-    ioP = &pcP->io[WRITER];
-
-    /* If thread pool thread has set an error, we need to copy it. */
-    if (ioP->state == IOBUF_IO_COMPLETED_WITH_ERROR)
-        SET_NPIPE_ERROR(pcP, (WIN32_ERROR) ioP->ovl.Internal);
-    
     if (pcP->winerr != ERROR_SUCCESS)
         goto error_return;
-    
-    if (pcP->flags & NPIPE_F_NONBLOCKING) {
-        /* Non-blocking */
-        if (ioP->state == IOBUF_IO_PENDING) {
-            /*
-             * Non-blocking channel and we are awaiting data. We need to
-             * return an EAGAIN or EWOULDBLOCK to Tcl. ERROR_PIPE_BUSY
-             * maps to EAGAIN in the Tcl code.
-             */
-            *errnoP = NPipeSetTclErrnoFromWin32Error(ERROR_PIPE_BUSY);
-            return -1;
-        }
 
-        TwapiZeroMemory(&ioP->ovl, sizeof(ioP->ovl));
-        ioP->ovl.hEvent = ioP->hevent;
+    NPipeConfigureRings(pcP);
 
-        /*
-         * Reallocate buffer if necessary. Note as as aside, that once
-         * allocated, we do not deallocate except to grow the buffer.
-         */
-        if (ioP->data.write_buf.sz < count) {
-            size_t actual_sz;
-            if (ioP->data.write_buf.p != NULL)
-                TwapiFree(ioP->data.write_buf.p);
-            ioP->data.write_buf.p = TwapiAllocSize(count, &actual_sz);
-            ioP->data.write_buf.sz = (DWORD) actual_sz;
-        }
-        CopyMemory(ioP->data.write_buf.p, bufP, count);
-        ioP->state = IOBUF_IO_PENDING;
-        if (WriteFile(pcP->hpipe, ioP->data.write_buf.p, count, NULL, &ioP->ovl)) {
-            /*
-             * Operation completed right away. Double check to make
-             * sure, and if so change state. The thread pool callback
-             * will run any way but will basically be a no-op since
-             * we change state here. Note the thread pool might have
-             * run BEFORE us as well (immediately after the WriteFile above)
-             * hence the interlocked check that state is still PENDING.
-             * We do this so caller will not needlessly get EAGAIN if he tries
-             * writing right away. This is striclty for efficiency.
-             */
-            InterlockedCompareExchange(&ioP->state,
-                                       IOBUF_IO_COMPLETED, IOBUF_IO_PENDING);
-            /* Note state is changed to COMPLETED, not IDLE, so that
-               file event notification will be generated if necessary */
-        } else {
-            /* WriteFile did not complete successfully right away */
-            WIN32_ERROR winerr = GetLastError();
-            if (winerr != ERROR_IO_PENDING) {
-                /* Genuine error */
-                pcP->winerr = winerr;
-                goto error_return;
-            }
+    /* Release completed writes, picking up any errors from them */
+    if (PipeRingReap(ringP) != ERROR_SUCCESS) {
+        SET_NPIPE_ERROR(pcP, (WIN32_ERROR) ringP->err);
+        goto error_return;
+    }
 
-            /* Have the thread pool wait on it if not already doing so */
-            if (ioP->hwait == INVALID_HANDLE_VALUE) {
-                /* The thread pool will hold a ref to the context */
-                NPipeChannelRef(pcP, 1);
-                if (! RegisterWaitForSingleObject(
-                        &ioP->hwait,
-                        ioP->hevent,
-                        NPipeWriteThreadPoolFn,
-                        pcP,
-                        INFINITE,           /* No timeout */
-                        WT_EXECUTEDEFAULT
-                        )) {
-                    NPipeChannelUnref(pcP, 1);
-                    ioP->hwait = INVALID_HANDLE_VALUE; /* Just in case... */
-                    /* Note the call does not set GetLastError. Make up our own */
-                    pcP->winerr = TWAPI_ERROR_TO_WIN32(TWAPI_REGISTER_WAIT_FAILED);
-                    goto error_return;
-                }
-            }
-        }
-    } else {
+    if (pcP->flags & NPIPE_F_NONBLOCKING) {
         /*
-         * Blocking I/O
-         * We do not use the buffer in ioP since we will block for completion
-         * anyway and might as well save the copy. In addition, we do not
-         * need to check for IO_PENDING state. It's OK if there was
-         * a previous async write on this pipe that has not yet completed.
-         * The kernel will queue this sync write behind it. We just
-         * make sure we use a different OVERLAPPED struct and event.
+         * Non-blocking. Copy as much as fits into the write ring. Full
+         * slots are written right away and a partial slot as soon as
+         * there are no writes in progress so output from successive
+         * calls is gathered into fewer, larger writes.
          */
-        OVERLAPPED ovl;
-        TwapiZeroMemory(&ovl, sizeof(ovl));
-        ovl.hEvent = pcP->hsync;
-        if (! WriteFile(pcP->hpipe, bufP, count, NULL, &ovl)) {
-            WIN32_ERROR winerr = GetLastError();
-            if (winerr != ERROR_IO_PENDING) {
-                /* Genuine error */
-                pcP->winerr = winerr;
-                goto error_return;
-            }
-            /* Wait for I/O to complete */
-            if (!GetOverlappedResult(pcP->hpipe, &ovl, (DWORD *)&count, TRUE)) {
-                pcP->winerr = GetLastError();
-                goto error_return;
-            }
+        nwritten = (DWORD) PipeRingWrite(ringP, bufP, count);
+        if (nwritten)
+            return nwritten;    /* Tcl will retry the remainder */
+        if (ringP->err != ERROR_SUCCESS) {
+            SET_NPIPE_ERROR(pcP, (WIN32_ERROR) ringP->err);
+            goto error_return;
         }
         /*
-         * Sync I/O completed. Change state only if previous state was
-         * IDLE. If previous state was PENDING from a previous non-blocking
-         * call, the async callback will change state. If it was
-         * COMPLETED_WITH_ERROR we do not want to change state.
+         * All slots busy. We need to return an EAGAIN or EWOULDBLOCK to
+         * Tcl. ERROR_PIPE_BUSY maps to EAGAIN in the Tcl code.
          */
-        InterlockedCompareExchange(&ioP->state,
-                                   IOBUF_IO_COMPLETED, IOBUF_IDLE);
+        *errnoP = NPipeSetTclErrnoFromWin32Error(ERROR_PIPE_BUSY);
+        return -1;
+    }
+
+    /*
+     * Blocking I/O
+     * Output gathered by earlier non-blocking writes is submitted first.
+     * We then write directly from the caller's buffer since we will block
+     * for completion anyway and might as well save the copy. The kernel
+     * will queue this write behind any outstanding ones. The low order
+     * bit of the event handle is set so the completion is not queued to
+     * the thread pool.
+     */
+    if (PipeRingSubmit(ringP, 1) != ERROR_SUCCESS) {
+        SET_NPIPE_ERROR(pcP, (WIN32_ERROR) ringP->err);
+        goto error_return;
+    }
+    TwapiZeroMemory(&ovl, sizeof(ovl));
+    ovl.hEvent = (HANDLE) ((DWORD_PTR) pcP->hsync | 1);
+    if (! WriteFile(pcP->hpipe, bufP, count, NULL, &ovl)) {
+        winerr = GetLastError();
+        if (winerr != ERROR_IO_PENDING) {
+            /* Genuine error */
+            pcP->winerr = winerr;
+            goto error_return;
+        }
+        /* Wait for I/O to complete */
+        if (!GetOverlappedResult(pcP->hpipe, &ovl, &nwritten, TRUE)) {
+            pcP->winerr = GetLastError();
+            goto error_return;
+        }
     }
+    /* So file event notification will be generated if necessary */
+    pcP->flags |= NPIPE_F_SYNC_WRITTEN;
 
     /* As far as caller concerned, all bytes written in all non-error cases */
     return count;
@@ -1077,13 +1006,80 @@ error_return:
     return -1;
 }
 
-/* Called from Tcl I/O layer to add/remove a channel from a thread */
-static void NPipeThreadActionProc(
+/*
+ * Channel options -readahead and -writebehind set the number of buffers
+ * in the read and write rings. The size of each buffer is taken from
+ * the standard -buffersize option.
+ */
+static int NPipeSetOptionProc(
     ClientData clientdata,
-    int action)
+    Tcl_Interp *interp,
+    const char *optionName,
+    const char *value)
 {
-    NPipeChannel *pcP = (NPipeChannel *) clientdata;
-    NPipeTls *tlsP = GET_NPIPE_TLS();
+    NPipeChannel *pcP = (NPipeChannel *)clientdata;
+    int direction, depth;
+
+    if (!strcmp(optionName, "-readahead"))
+        direction = READER;
+    else if (!strcmp(optionName, "-writebehind"))
+        direction = WRITER;
+    else
+        return Tcl_BadChannelOption(interp, optionName, "readahead writebehind");
+
+    if (Tcl_GetInt(interp, value, &depth) != TCL_OK)
+        return TCL_ERROR;
+    if (depth < 1 || depth > PIPERING_MAX_DEPTH) {
+        if (interp)
+            ObjSetResult(interp,
+                         Tcl_ObjPrintf("Value for %s must be between 1 and %d.",
+                                       optionName, PIPERING_MAX_DEPTH));
+        return TCL_ERROR;
+    }
+
+    PipeRingConfigure(&pcP->rings[direction], depth, 0);
+    /* Post additional reads right away if read ahead was increased */
+    if (direction == READER && NPIPE_CONNECTED(pcP) &&
+        pcP->winerr == ERROR_SUCCESS)
+        NPipeStartReads(pcP);
+    return TCL_OK;
+}
+
+static int NPipeGetOptionProc(
+    ClientData clientdata,
+    Tcl_Interp *interp,
+    const char *optionName,
+    Tcl_DString *dsP)
+{
+    NPipeChannel *pcP = (NPipeChannel *)clientdata;
+    static const char *names[] = {"-readahead", "-writebehind"};
+    char buf[TCL_INTEGER_SPACE];
+    int direction;
+
+    for (direction = READER; direction <= WRITER; ++direction) {
+        if (optionName == NULL || !strcmp(optionName, names[direction])) {
+            if (optionName == NULL)
+                Tcl_DStringAppendElement(dsP, names[direction]);
+            wsprintfA(buf, "%d", pcP->rings[direction].depth);
+            Tcl_DStringAppendElement(dsP, buf);
+            if (optionName)
+                return TCL_OK;
+        }
+    }
+
+    if (optionName == NULL)
+        return TCL_OK;
+    return Tcl_BadChannelOption(interp, optionName, "readahead writebehind");
+}
+
+
+/* Called from Tcl I/O layer to add/remove a channel from a thread */
+static void NPipeThreadActionProc(
+    ClientData clientdata,
+    int action)
+{
+    NPipeChannel *pcP = (NPipeChannel *) clientdata;
+    NPipeTls *tlsP = GET_NPIPE_TLS();
     Tcl_ThreadId tid;
     
     tid = Tcl_GetCurrentThread();
@@ -1108,77 +1104,59 @@ static void NPipeThreadActionProc(
     }
 }
 
+/*
+ * Submits any gathered output and waits up to timeout milliseconds
+ * for outstanding writes to complete.
+ */
+static void NPipeDrainWrites(Tcl_Interp *interp, NPipeChannel *pcP, DWORD timeout)
+{
+    PipeRing *ringP = &pcP->rings[WRITER];
+    DWORD start = GetTickCount();
+    DWORD elapsed;
+
+    PipeRingSubmit(ringP, 1);
+    while (PipeRingReap(ringP) == ERROR_SUCCESS && ringP->count > 0) {
+        elapsed = GetTickCount() - start;
+        if (elapsed >= timeout ||
+            WaitForSingleObject(pcP->hready, timeout - elapsed) == WAIT_FAILED) {
+            if (interp) {
+                Twapi_AppendLog(interp, L"Timed out waiting for pending writes while shutting named pipe");
+            }
+            break;
+        }
+    }
+}
+
 /*
  * Initiates shut down of a pipe. 
  * It does NOT unregister the channel from the interp.
  * It does NOT remove the channel from the thread's pipe list.
  * Must be called from the thread that "owns" the channel to prevent races.
- * Note it DOES do an unref if unregistering from the thread pools so
- * to be sure that pcP is not deallocated on return, the caller must
- * ensure there is some other ref outstanding on it..
+ * Note I/O still outstanding when the pipe handle is closed holds refs
+ * on pcP until the thread pool delivers its (cancelled) completion so
+ * pcP may outlive this call even if the caller holds no other ref.
  * Caller can pass unrefs parameter as additional unrefs to do on pcP.
  */
 static void NPipeShutdown(Tcl_Interp *interp, NPipeChannel *pcP, int unrefs)
 {
     TWAPI_ASSERT(pcP->thread == NULL || pcP->thread == Tcl_GetCurrentThread());
 
-    /*
-     * stop the thread pool for this pipe. We need to do that before
-     * closing handles. Note the UnregisterWaitEx can result in thread pool
-     * callbacks running while it is blocked. That's ok because the thread
-     * pool only changes the io state.
-     */
-    if (pcP->io[READER].hwait != INVALID_HANDLE_VALUE) {
-        UnregisterWaitEx(pcP->io[READER].hwait,
-                         INVALID_HANDLE_VALUE);
-        pcP->io[READER].hwait = INVALID_HANDLE_VALUE;
-        ++unrefs;   /* Remove the ref coming from the thread pool */
-    }
-
-    if (pcP->io[WRITER].hwait != INVALID_HANDLE_VALUE) {
-        UnregisterWaitEx(pcP->io[WRITER].hwait,
-                         INVALID_HANDLE_VALUE);
-        pcP->io[WRITER].hwait = INVALID_HANDLE_VALUE;
-        ++unrefs;   /* Remove the ref coming from the thread pool */
-    }
-
-    /* Third, now that handles are unregistered, close them. */
     if (pcP->hpipe != INVALID_HANDLE_VALUE) {
-        CloseHandle(pcP->hpipe);
-        pcP->hpipe = INVALID_HANDLE_VALUE;
-    }
-
-    if (pcP->io[WRITER].hevent != NULL) {
         /*
-         * If there is any pending I/O, we have to wait or it to finish
-         * even though we closed the channel.
+         * Closing the handle cancels pending I/O so give output a chance
+         * to drain first. Reads still posted are simply cancelled.
          */
-        if (NPIPE_WRITE_PENDING(pcP) && pcP->io[WRITER].ovl.hEvent == pcP->io[WRITER].hevent) {
-            if (WaitForSingleObject(pcP->io[WRITER].hevent, 1000) != WAIT_OBJECT_0) {
-                if (interp) {
-                    Twapi_AppendLog(interp, L"WaitForSingleObject did not return WAIT_OBJECT_0 while shutting named pipe (WRITER)");
-                }
-            }
-        }
-        CloseHandle(pcP->io[WRITER].hevent);
-        pcP->io[WRITER].ovl.hEvent = NULL;
-        pcP->io[WRITER].hevent = NULL;
-    }
-
-    if (pcP->io[READER].hevent != NULL) {
-        /* See WRITER comments above */
-        if (NPIPE_READ_PENDING(pcP) && pcP->io[READER].ovl.hEvent == pcP->io[READER].hevent) {
-            if (WaitForSingleObject(pcP->io[READER].hevent, 1000) != WAIT_OBJECT_0) {
-                if (interp) {
-                    Twapi_AppendLog(interp, L"WaitForSingleObject did not return WAIT_OBJECT_0 while shutting named pipe (READER)");
-                }
-            }
-        }
-        CloseHandle(pcP->io[READER].hevent);
-        pcP->io[READER].hevent = NULL;
-        pcP->io[READER].ovl.hEvent = NULL;
+        if (pcP->hready != NULL && NPIPE_CONNECTED(pcP))
+            NPipeDrainWrites(interp, pcP, 1000);
+        CloseHandle(pcP->hpipe);
+        pcP->hpipe = INVALID_HANDLE_VALUE;
     }
 
+    /*
+     * Note hready and the ring buffers are not released here since the
+     * thread pool may still be delivering completions. That is done
+     * when the last ref goes away.
+     */
 
     if (pcP->hsync != NULL) {
         CloseHandle(pcP->hsync);
@@ -1194,43 +1172,63 @@ static WIN32_ERROR NPipeAccept(NPipeChannel *pcP)
 {
     WIN32_ERROR winerr;
 
-    /* The writer side i/o structure are is also used for connecting */
-
     /*
      * Wait for client connection. If there is already a client waiting,
-     * to connect, we will get success right away. Else we wait on the
-     * event and queue a callback later
+     * to connect, we will get ERROR_PIPE_CONNECTED right away. Else the
+     * thread pool will be called on completion. Note a successful return
+     * from ConnectNamedPipe also queues a completion.
      */
-    TwapiZeroMemory(&pcP->io[WRITER].ovl, sizeof(pcP->io[WRITER].ovl));
-    pcP->io[WRITER].ovl.hEvent = pcP->io[WRITER].hevent;
-    if (ConnectNamedPipe(pcP->hpipe, &pcP->io[WRITER].ovl) ||
-        (winerr = GetLastError()) == ERROR_PIPE_CONNECTED) {
-        /* Already a client in waiting, queue the callback */
-        pcP->flags |= NPIPE_F_CONNECTED;
+    TwapiZeroMemory(&pcP->connect.ovl, sizeof(pcP->connect.ovl));
+    pcP->connect_state = IOBUF_IO_PENDING; /* Before completion can run */
+    NPipeChannelRef(pcP, 1); /* Since we are passing to thread pool */
+    if (ConnectNamedPipe(pcP->hpipe, &pcP->connect.ovl))
+        return ERROR_IO_PENDING;
+    winerr = GetLastError();
+    if (winerr == ERROR_IO_PENDING)
+        return winerr;
+
+    /* No completion will be queued */
+    NPipeChannelUnref(pcP, 1); /* Undo above Ref */
+    if (winerr == ERROR_PIPE_CONNECTED) {
+        /* Already a client in waiting, event loop will process it */
+        pcP->connect_state = IOBUF_IO_COMPLETED;
         return ERROR_SUCCESS;
-    } else if (winerr == ERROR_IO_PENDING) {
-        /* Wait asynchronously for a connection */
-        NPipeChannelRef(pcP, 1); /* Since we are passing to thread pool */
-        if (RegisterWaitForSingleObject(
-                &pcP->io[WRITER].hwait,
-                pcP->io[WRITER].hevent,
-                NPipeWriteThreadPoolFn,
-                pcP,
-                INFINITE,           /* No timeout */
-                WT_EXECUTEDEFAULT
-                )) {
-            pcP->io[WRITER].state = IOBUF_IO_PENDING;
-            return ERROR_IO_PENDING;
-        } else {
-            winerr = GetLastError();
-            NPipeChannelUnref(pcP, 1); /* Undo above Ref */
-        }
     }
-
-    /* Either synchronous completion or error */
+    pcP->connect_state = IOBUF_IDLE;
     return winerr;
 }
 
+/*
+ * Creates the events used for I/O and binds the pipe handle to the
+ * thread pool completion port, or that of poolP if not NULL. Returns a
+ * Win32 error code.
+ */
+static WIN32_ERROR NPipeChannelAttach(NPipeChannel *pcP, NPipePool *poolP)
+{
+    /* Create event used for sync i/o. Note this is manual reset event */
+    pcP->hsync = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (pcP->hsync == NULL)
+        return GetLastError();
+
+    /* Auto-reset since waiters always recheck the state they wait on */
+    pcP->hready = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (pcP->hready == NULL)
+        return GetLastError();
+
+    if (poolP) {
+        if (CreateIoCompletionPort(pcP->hpipe, poolP->iocp, 0, 0) == NULL)
+            return GetLastError();
+        /* Pool must outlive the pipe. Released in NPipeChannelDelete */
+        InterlockedIncrement(&poolP->nrefs);
+        pcP->poolP = poolP;
+    } else {
+        if (! BindIoCompletionCallback(pcP->hpipe, NPipeIoCompletionFn, 0))
+            return GetLastError();
+    }
+
+    return ERROR_SUCCESS;
+}
+
 /*
  * For consistency with sockets, we configure the same options
  * as channel defaults.
@@ -1241,6 +1239,31 @@ static void NPipeConfigureChannelDefaults(Tcl_Interp *interp, NPipeChannel *pcP)
     Tcl_SetChannelOption(NULL, pcP->channel, "-eofchar", "");
 }
 
+/*
+ * Creates the Tcl channel for pcP and registers it in the interp.
+ * Returns the channel name in instance_name which must be at least
+ * 30 chars.
+ */
+static void NPipeCreateTclChannel(TwapiInterpContext *ticP, NPipeChannel *pcP,
+                                  int channel_mask, char *instance_name)
+{
+    wsprintfA(instance_name, "np%u", TWAPI_NEWID(ticP));
+    if (channel_mask & TCL_READABLE)
+        pcP->flags |= NPIPE_F_READABLE;
+    NPipeChannelRef(pcP, 1); /* Adding to Tcl channels */
+    pcP->channel = Tcl_CreateChannel(&gNPipeChannelDispatch,
+                                     instance_name, pcP,
+                                     channel_mask);
+    /*
+     * Note the CreateChannel will call back into our
+     * ThreadActionProc which would have added pcP to
+     * the thread tls
+     */
+
+    NPipeConfigureChannelDefaults(ticP->interp, pcP);
+    Tcl_RegisterChannel(ticP->interp, pcP->channel);
+}
+
 static int Twapi_NPipeServerObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
     TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
@@ -1291,68 +1314,40 @@ static int Twapi_NPipeServerObjCmd(ClientData clientdata, Tcl_Interp *interp, in
     SWSPopMark(mark);
 
     if (pcP->hpipe != INVALID_HANDLE_VALUE) {
-        /* Create event used for sync i/o. Note this is manual reset event */
-        pcP->hsync = CreateEvent(NULL, TRUE, FALSE, NULL);
-
-        if (pcP->hsync) {
-            /* 
-             * Create events to use for notification of completion. The
-             * events must be auto-reset to prevent multiple callback
-             * queueing on a single input notification. See MSDN docs for
-             * RegisterWaitForSingleObject.  As a consequence, we must
-             * make sure we never call GetOverlappedResult in blocking
-             * mode when using one of these events (unlike hsync)
-             */
-            pcP->io[READER].hevent = CreateEvent(NULL, FALSE, FALSE, NULL);
-            if (pcP->io[READER].hevent) {
-                pcP->io[WRITER].hevent = CreateEvent(NULL, FALSE, FALSE, NULL);
-                if (pcP->io[WRITER].hevent) {
-                    int channel_mask = 0;
-                    char instance_name[30];
-                    wsprintfA(instance_name, "np%u", TWAPI_NEWID(ticP));
-                    if (open_mode & PIPE_ACCESS_INBOUND)
-                        channel_mask |= TCL_READABLE;
-                    if (open_mode & PIPE_ACCESS_OUTBOUND)
-                        channel_mask |= TCL_WRITABLE;
-                    NPipeChannelRef(pcP, 1); /* Adding to Tcl channels */
-                    pcP->channel = Tcl_CreateChannel(&gNPipeChannelDispatch,
-                                                     instance_name, pcP,
-                                                     channel_mask);
-                    /*
-                     * Note the CreateChannel will call back into our
-                     * ThreadActionProc which would have added pcP to
-                     * the thread tls
-                     */
-
-                    NPipeConfigureChannelDefaults(interp, pcP);
-                    Tcl_RegisterChannel(interp, pcP->channel);
-
-                    /* Set up the accept */
-                    winerr = NPipeAccept(pcP);
-                    if (winerr == ERROR_SUCCESS || winerr == ERROR_IO_PENDING) {
-                        /*
-                         * On success (ie. immediate conn complete),
-                         * we ask the event loop to call us back right away
-                         * so we can generate the appropriate event.
-                         */
-                        if (winerr == ERROR_SUCCESS) {
-                            Tcl_Time block_time = { 0, 0 };
-                            Tcl_SetMaxBlockTime(&block_time);
-                        }
-
-                        /* Return channel name */
-                        ObjSetResult(ticP->interp,
-                                         Tcl_NewStringObj(instance_name, -1));
-                        return TCL_OK;
-                    } else {
-                        /* Genuine error. */
-                        Tcl_UnregisterChannel(interp, pcP->channel);
-                        /* We do not NPipeChannelUnref here. That will
-                         * happen when the Unregister calls our NPipeCloseProc
-                         */
-                        pcP->channel = NULL;
-                    }
+        winerr = NPipeChannelAttach(pcP, NULL);
+        if (winerr == ERROR_SUCCESS) {
+            int channel_mask = 0;
+            char instance_name[30];
+            if (open_mode & PIPE_ACCESS_INBOUND)
+                channel_mask |= TCL_READABLE;
+            if (open_mode & PIPE_ACCESS_OUTBOUND)
+                channel_mask |= TCL_WRITABLE;
+            NPipeCreateTclChannel(ticP, pcP, channel_mask, instance_name);
+
+            /* Set up the accept */
+            winerr = NPipeAccept(pcP);
+            if (winerr == ERROR_SUCCESS || winerr == ERROR_IO_PENDING) {
+                /*
+                 * On success (ie. immediate conn complete),
+                 * we ask the event loop to call us back right away
+                 * so we can generate the appropriate event.
+                 */
+                if (winerr == ERROR_SUCCESS) {
+                    Tcl_Time block_time = { 0, 0 };
+                    Tcl_SetMaxBlockTime(&block_time);
                 }
+
+                /* Return channel name */
+                ObjSetResult(ticP->interp,
+                                 Tcl_NewStringObj(instance_name, -1));
+                return TCL_OK;
+            } else {
+                /* Genuine error. */
+                Tcl_UnregisterChannel(interp, pcP->channel);
+                /* We do not NPipeChannelUnref here. That will
+                 * happen when the Unregister calls our NPipeCloseProc
+                 */
+                pcP->channel = NULL;
             }
         }
     }
@@ -1423,58 +1418,531 @@ int Twapi_NPipeClientObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc,
 
     pcP->hpipe = hpipe;
 
-    /* Create event used for sync i/o. Note this is manual reset event */
-    pcP->hsync = CreateEvent(NULL, TRUE, FALSE, NULL);
-    if (pcP->hsync) {
-        /* 
-         * Create events to use for notification of completion. The
-         * events must be auto-reset to prevent multiple callback
-         * queueing on a single input notification. See MSDN docs for
-         * RegisterWaitForSingleObject.  As a consequence, we must
-         * make sure we never call GetOverlappedResult in blocking
-         * mode when using one of these events (unlike hsync)
-         */
-        pcP->io[READER].hevent = CreateEvent(NULL, FALSE, FALSE, NULL);
-        if (pcP->io[READER].hevent) {
-            pcP->io[WRITER].hevent = CreateEvent(NULL, FALSE, FALSE, NULL);
-            if (pcP->io[WRITER].hevent) {
-                int channel_mask = 0;
-                char instance_name[30];
-                wsprintfA(instance_name, "np%u", TWAPI_NEWID(ticP));
-                if (desired_access & (GENERIC_READ |FILE_READ_DATA))
-                    channel_mask |= TCL_READABLE;
-                if (desired_access & (GENERIC_WRITE|FILE_WRITE_DATA))
-                    channel_mask |= TCL_WRITABLE;
-                NPipeChannelRef(pcP, 1); /* Adding to Tcl channels */
-                pcP->channel = Tcl_CreateChannel(&gNPipeChannelDispatch,
-                                                 instance_name, pcP,
-                                                 channel_mask);
-                /*
-                 * Note the CreateChannel will call back into our
-                 * ThreadActionProc which would have added pcP to
-                 * the thread tls
-                 */
-
-                NPipeConfigureChannelDefaults(interp, pcP);
+    winerr = NPipeChannelAttach(pcP, NULL);
+    if (winerr == ERROR_SUCCESS) {
+        int channel_mask = 0;
+        char instance_name[30];
+        if (desired_access & (GENERIC_READ |FILE_READ_DATA))
+            channel_mask |= TCL_READABLE;
+        if (desired_access & (GENERIC_WRITE|FILE_WRITE_DATA))
+            channel_mask |= TCL_WRITABLE;
+        NPipeCreateTclChannel(ticP, pcP, channel_mask, instance_name);
 
-                Tcl_RegisterChannel(interp, pcP->channel);
-                
-                pcP->flags |= NPIPE_F_CONNECTED;
-                /* Return channel name */
-                ObjSetResult(ticP->interp,
-                                 Tcl_NewStringObj(instance_name, -1));
-                return TCL_OK;
-            }
-        }
+        pcP->flags |= NPIPE_F_CONNECTED;
+        /* Keep reads posted from now on */
+        NPipeStartReads(pcP);
+        /* Return channel name */
+        ObjSetResult(ticP->interp,
+                         Tcl_NewStringObj(instance_name, -1));
+        return TCL_OK;
     }
 
-    winerr = GetLastError();
     pcP->winerr = winerr;
     NPipeShutdown(ticP->interp, pcP, 0);    /* pcP might be gone */
     return Twapi_AppendSystemError(ticP->interp, winerr);
 }
 
 
+/*
+ * Pooled servers. All instances of a pool are associated with the pool's
+ * completion port. The workers servicing the port dispatch completions
+ * to NPipeIoCompletionFn exactly as the thread pool does for stand-alone
+ * pipes, including for data transfers after an instance is handed over
+ * as a channel. The pool therefore lives until the last pipe attached
+ * to it is gone, not just until it is closed.
+ */
+static unsigned __stdcall NPipePoolWorker(void *arg)
+{
+    NPipePool *poolP = (NPipePool *) arg;
+    DWORD nbytes;
+    ULONG_PTR key;
+    LPOVERLAPPED ovlP;
+    WIN32_ERROR winerr;
+
+    while (1) {
+        ovlP = NULL;
+        winerr = ERROR_SUCCESS;
+        if (! GetQueuedCompletionStatus(poolP->iocp, &nbytes, &key,
+                                        &ovlP, INFINITE)) {
+            winerr = GetLastError();
+            if (ovlP == NULL)
+                break;          /* The port itself failed */
+        }
+        if (key == NPIPE_POOL_KEY_QUIT)
+            break;
+        NPipeIoCompletionFn(winerr, nbytes, ovlP);
+    }
+
+    /* Last worker out frees the pool. See NPipePoolUnref */
+    if (InterlockedDecrement(&poolP->live_workers) == 0) {
+        CloseHandle(poolP->iocp);
+        DeleteCriticalSection(&poolP->lock);
+        TwapiFree(poolP);
+    }
+    return 0;
+}
+
+/* May be called from any thread */
+static void NPipePoolUnref(NPipePool *poolP, int decr)
+{
+    HANDLE iocp;
+    int i, nworkers;
+
+    if (InterlockedExchangeAdd(&poolP->nrefs, -decr) > decr)
+        return;
+
+    /*
+     * No pipes are associated with the port any more. Tell the workers
+     * to exit. Note poolP may be freed as soon as the last quit packet
+     * is queued so copy what we need.
+     */
+    iocp = poolP->iocp;
+    nworkers = poolP->nworkers;
+    if (nworkers == 0) {
+        /* Failed during creation */
+        if (iocp)
+            CloseHandle(iocp);
+        DeleteCriticalSection(&poolP->lock);
+        TwapiFree(poolP);
+        return;
+    }
+    for (i = 0; i < nworkers; ++i)
+        PostQueuedCompletionStatus(iocp, 0, NPIPE_POOL_KEY_QUIT, NULL);
+}
+
+/*
+ * Called when a ConnectNamedPipe on a pool instance completes. Moves the
+ * instance to the accepted list and wakes up the owning thread whose
+ * event source will hand it over to the interp. May be called from
+ * any thread.
+ */
+static void NPipePoolConnectDone(NPipeChannel *pcP, WIN32_ERROR winerr)
+{
+    NPipePool *poolP = pcP->poolP;
+    Tcl_ThreadId thread = NULL;
+    int backlog;
+
+    pcP->connect_err = winerr;
+    pcP->connect_state = winerr == ERROR_SUCCESS ? IOBUF_IO_COMPLETED : IOBUF_IO_COMPLETED_WITH_ERROR;
+
+    EnterCriticalSection(&poolP->lock);
+    /* If not listening, the pool was closed and the connect cancelled */
+    if (pcP->pool_state == NPIPE_POOL_LISTENING) {
+        ZLIST_REMOVE(&poolP->listening, pcP);
+        pcP->pool_state = NPIPE_POOL_ACCEPTED;
+        pcP->connect_ticks = GetTickCount();
+        ZLIST_APPEND(&poolP->accepted, pcP);
+        if (winerr == ERROR_SUCCESS)
+            poolP->nconnects++;
+        backlog = ZLIST_COUNT(&poolP->accepted);
+        if (backlog > poolP->max_backlog)
+            poolP->max_backlog = backlog;
+        thread = poolP->thread;
+    }
+    LeaveCriticalSection(&poolP->lock);
+
+    if (thread)
+        Tcl_ThreadAlert(thread);
+}
+
+/*
+ * Creates a new pipe instance for the pool and starts listening on it.
+ * Must be called from the owning thread.
+ */
+static WIN32_ERROR NPipePoolAddInstance(NPipePool *poolP)
+{
+    NPipeChannel *pcP;
+    SECURITY_ATTRIBUTES *secattrP = NULL;
+    SWSMark mark;
+    WIN32_ERROR winerr;
+
+    pcP = NPipeChannelNew();
+    NPipeChannelRef(pcP, 1);    /* For the pool lists */
+
+    mark = SWSPushMark();
+    /* Already validated when the pool was created */
+    if (ObjToPSECURITY_ATTRIBUTESSWS(poolP->ticP->interp, poolP->secattrObj,
+                                     &secattrP) != TCL_OK) {
+        SWSPopMark(mark);
+        NPipeShutdown(NULL, pcP, 1);
+        return ERROR_INVALID_PARAMETER;
+    }
+    pcP->hpipe = CreateNamedPipeW(ObjToWinChars(poolP->nameObj),
+                                  poolP->open_mode, poolP->pipe_mode,
+                                  poolP->max_instances, poolP->outbuf_sz,
+                                  poolP->inbuf_sz, poolP->timeout, secattrP);
+    winerr = pcP->hpipe == INVALID_HANDLE_VALUE ? GetLastError() : ERROR_SUCCESS;
+    SWSPopMark(mark);
+    if (winerr == ERROR_SUCCESS)
+        winerr = NPipeChannelAttach(pcP, poolP);
+    if (winerr != ERROR_SUCCESS) {
+        NPipeShutdown(NULL, pcP, 1); /* pcP GONE */
+        return winerr;
+    }
+
+    /* Must be on the list before the connect can complete */
+    EnterCriticalSection(&poolP->lock);
+    pcP->pool_state = NPIPE_POOL_LISTENING;
+    ZLIST_APPEND(&poolP->listening, pcP);
+    LeaveCriticalSection(&poolP->lock);
+
+    winerr = NPipeAccept(pcP);
+    if (winerr == ERROR_SUCCESS) {
+        /* Client was already waiting. No completion will be queued. */
+        NPipePoolConnectDone(pcP, ERROR_SUCCESS);
+    } else if (winerr != ERROR_IO_PENDING) {
+        EnterCriticalSection(&poolP->lock);
+        ZLIST_REMOVE(&poolP->listening, pcP);
+        pcP->pool_state = NPIPE_POOL_NONE;
+        poolP->nfailed++;
+        LeaveCriticalSection(&poolP->lock);
+        NPipeShutdown(NULL, pcP, 1); /* pcP GONE */
+        return winerr;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+/*
+ * Tops up the number of listening instances. Returns the error from the
+ * last failed attempt, if any.
+ */
+static WIN32_ERROR NPipePoolFill(NPipePool *poolP)
+{
+    WIN32_ERROR winerr = ERROR_SUCCESS;
+    int attempts, nlistening;
+
+    /*
+     * Clients may connect as fast as instances are created so bound the
+     * number of attempts. Remaining instances are created when the
+     * connected ones are handed over.
+     */
+    for (attempts = 0; attempts < 2*poolP->ninstances; ++attempts) {
+        EnterCriticalSection(&poolP->lock);
+        nlistening = ZLIST_COUNT(&poolP->listening);
+        LeaveCriticalSection(&poolP->lock);
+        if (nlistening >= poolP->ninstances)
+            break;
+        winerr = NPipePoolAddInstance(poolP);
+        if (winerr != ERROR_SUCCESS) {
+            EnterCriticalSection(&poolP->lock);
+            poolP->last_error = winerr;
+            LeaveCriticalSection(&poolP->lock);
+            /* Client closing before we accepted is not fatal */
+            if (winerr != ERROR_NO_DATA)
+                break;
+        }
+    }
+    return winerr;
+}
+
+/*
+ * Closes a pool. Instances not yet handed over are closed. Channels
+ * already handed over are not affected. Must be called from the
+ * owning thread.
+ */
+static void NPipePoolClose(NPipePool *poolP)
+{
+    NPipeTls *tlsP = GET_NPIPE_TLS();
+    NPipeChannel *pcP;
+
+    if (poolP->closed)
+        return;
+    poolP->closed = 1;
+    ZLIST_REMOVE(&tlsP->pools, poolP);
+
+    /*
+     * Closing the handles of listening instances cancels their connects.
+     * Those completions will find the instance off the pool lists and
+     * ignore it.
+     */
+    while (1) {
+        EnterCriticalSection(&poolP->lock);
+        poolP->thread = NULL;
+        pcP = ZLIST_HEAD(&poolP->listening);
+        if (pcP) {
+            ZLIST_REMOVE(&poolP->listening, pcP);
+        } else {
+            pcP = ZLIST_HEAD(&poolP->accepted);
+            if (pcP)
+                ZLIST_REMOVE(&poolP->accepted, pcP);
+        }
+        if (pcP)
+            pcP->pool_state = NPIPE_POOL_NONE;
+        LeaveCriticalSection(&poolP->lock);
+        if (pcP == NULL)
+            break;
+        NPipeShutdown(NULL, pcP, 1);
+    }
+
+    ObjDecrRefs(poolP->nameObj);
+    ObjDecrRefs(poolP->secattrObj);
+    poolP->nameObj = NULL;
+    poolP->secattrObj = NULL;
+    TwapiInterpContextUnref(poolP->ticP, 1);
+    poolP->ticP = NULL;
+
+    NPipePoolUnref(poolP, 1);   /* Registration ref. poolP may be GONE */
+}
+
+/*
+ * Called from Tcl_ServiceEvent to hand over connected pool instances
+ * to the interp as channels.
+ */
+static int NPipePoolEventProc(
+    Tcl_Event *tcl_evP,		/* Event to service. */
+    int flags)			/* Flags that indicate what events to handle,
+				 * such as TCL_FILE_EVENTS. */
+{
+    NPipePoolEvent *evP = (NPipePoolEvent *)tcl_evP;
+    NPipePool *poolP;
+    NPipeChannel *pcP;
+    NPipeTls *tlsP;
+    Tcl_Interp *interp;
+    Tcl_Obj *objs[3];
+    char instance_name[30];
+    int channel_mask;
+    DWORD latency;
+
+    if (!(flags & TCL_FILE_EVENTS)) {
+	return 0;               /* 0 -> Event will stay on queue */
+    }
+
+    tlsP = GET_NPIPE_TLS();
+    ZLIST_LOCATE(poolP, &tlsP->pools, id, evP->id);
+    if (poolP == NULL)
+        return 1;               /* Stale event, pool is closed */
+
+    poolP->flags &= ~ NPIPE_POOL_F_EVENT_QUEUED;
+
+    interp = poolP->ticP->interp;
+    if (interp == NULL || Tcl_InterpDeleted(interp)) {
+        NPipePoolClose(poolP);
+        return 1;
+    }
+
+    channel_mask = 0;
+    if (poolP->open_mode & PIPE_ACCESS_INBOUND)
+        channel_mask |= TCL_READABLE;
+    if (poolP->open_mode & PIPE_ACCESS_OUTBOUND)
+        channel_mask |= TCL_WRITABLE;
+
+    /* Callbacks may close the pool */
+    InterlockedIncrement(&poolP->nrefs);
+    Tcl_Preserve(interp);
+
+    while (! poolP->closed) {
+        EnterCriticalSection(&poolP->lock);
+        pcP = ZLIST_HEAD(&poolP->accepted);
+        if (pcP) {
+            ZLIST_REMOVE(&poolP->accepted, pcP);
+            pcP->pool_state = NPIPE_POOL_NONE;
+            latency = GetTickCount() - pcP->connect_ticks;
+            if (latency > poolP->max_latency)
+                poolP->max_latency = latency;
+            if (pcP->connect_state == IOBUF_IO_COMPLETED)
+                poolP->naccepted++;
+            else
+                poolP->nfailed++;
+        }
+        LeaveCriticalSection(&poolP->lock);
+        if (pcP == NULL)
+            break;
+
+        /* Replace the instance before the callback runs */
+        NPipePoolFill(poolP);
+
+        if (pcP->connect_state != IOBUF_IO_COMPLETED) {
+            NPipeShutdown(NULL, pcP, 1); /* pcP GONE */
+            continue;
+        }
+
+        NPipeCreateTclChannel(poolP->ticP, pcP, channel_mask, instance_name);
+        NPipeChannelUnref(pcP, 1); /* Pool list ref, Tcl channel has its own */
+        pcP->connect_state = IOBUF_IDLE;
+        pcP->flags |= NPIPE_F_CONNECTED;
+        NPipeStartReads(pcP);
+
+        objs[0] = STRING_LITERAL_OBJ(TWAPI_TCL_NAMESPACE "::_namedpipe_pool_handler");
+        objs[1] = ObjFromTwapiId(poolP->id);
+        objs[2] = ObjFromString(instance_name);
+        ObjIncrRefs(objs[0]);
+        ObjIncrRefs(objs[1]);
+        ObjIncrRefs(objs[2]);
+        if (Tcl_EvalObjv(interp, 3, objs, TCL_EVAL_GLOBAL) != TCL_OK)
+            Tcl_BackgroundError(interp);
+        ObjDecrArrayRefs(3, objs);
+    }
+
+    Tcl_Release(interp);
+    NPipePoolUnref(poolP, 1);
+    return 1;
+}
+
+static NPipePool *NPipePoolLocate(Tcl_Interp *interp, Tcl_Obj *objP)
+{
+    NPipePool *poolP;
+    TwapiId id;
+
+    if (ObjToTwapiId(interp, objP, &id) != TCL_OK)
+        return NULL;
+    ZLIST_LOCATE(poolP, &GetNPipeTls()->pools, id, id);
+    if (poolP == NULL)
+        TwapiReturnError(interp, TWAPI_UNKNOWN_OBJECT);
+    return poolP;
+}
+
+static int Twapi_NPipePoolObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    DWORD open_mode, pipe_mode, max_instances;
+    DWORD inbuf_sz, outbuf_sz, timeout;
+    SECURITY_ATTRIBUTES *secattrP = NULL;
+    Tcl_Obj *nameObj, *secattrObj;
+    NPipePool *poolP;
+    NPipeTls *tlsP;
+    HANDLE hthread;
+    int ninstances, nworkers, i;
+    WIN32_ERROR winerr = ERROR_SUCCESS;
+    SWSMark mark;
+    TCL_RESULT res;
+
+    res = TwapiGetArgs(interp, objc-1, objv+1,
+                       GETOBJ(nameObj), GETDWORD(open_mode), GETDWORD(pipe_mode),
+                       GETDWORD(max_instances), GETDWORD(outbuf_sz),
+                       GETDWORD(inbuf_sz), GETDWORD(timeout),
+                       GETOBJ(secattrObj), GETINT(ninstances),
+                       GETINT(nworkers), ARGEND);
+    if (res != TCL_OK)
+        return res;
+
+    tlsP = GetNPipeTls();
+
+    if (pipe_mode & 0x7) {
+        ObjSetStaticResult(interp,  "Pipe mode must be byte mode and not specify the NPIPE_NOWAIT flag.");
+        return Twapi_AppendSystemError(interp, TWAPI_INVALID_ARGS);
+    }
+    if (ninstances < 1 || (DWORD) ninstances > max_instances)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Number of pool instances must be between 1 and the maximum number of pipe instances.");
+    if (nworkers < 1 || nworkers > NPIPE_POOL_MAX_WORKERS)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Number of pool workers must be between 1 and 16.");
+
+    /* Instances convert these again as they are created */
+    mark = SWSPushMark();
+    res = ObjToPSECURITY_ATTRIBUTESSWS(interp, secattrObj, &secattrP);
+    SWSPopMark(mark);
+    if (res != TCL_OK)
+        return res;
+
+    poolP = (NPipePool *) TwapiAlloc(sizeof(*poolP));
+    TwapiZeroMemory(poolP, sizeof(*poolP));
+    ZLINK_INIT(poolP);
+    ZLIST_INIT(&poolP->listening);
+    ZLIST_INIT(&poolP->accepted);
+    InitializeCriticalSectionAndSpinCount(&poolP->lock, 4000);
+    poolP->nrefs = 1;           /* Released by NPipePoolClose */
+    poolP->ticP = ticP;
+    TwapiInterpContextRef(ticP, 1);
+    poolP->id = TWAPI_NEWID(ticP);
+    poolP->thread = Tcl_GetCurrentThread();
+    poolP->nameObj = nameObj;
+    ObjIncrRefs(nameObj);
+    poolP->secattrObj = secattrObj;
+    ObjIncrRefs(secattrObj);
+    poolP->open_mode = open_mode | FILE_FLAG_OVERLAPPED;
+    poolP->pipe_mode = pipe_mode;
+    poolP->max_instances = max_instances;
+    poolP->inbuf_sz = inbuf_sz;
+    poolP->outbuf_sz = outbuf_sz;
+    poolP->timeout = timeout;
+    poolP->ninstances = ninstances;
+    ZLIST_APPEND(&tlsP->pools, poolP);
+
+    poolP->iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, nworkers);
+    if (poolP->iocp == NULL) {
+        winerr = GetLastError();
+        goto error_return;
+    }
+    for (i = 0; i < nworkers; ++i) {
+        InterlockedIncrement(&poolP->live_workers);
+        hthread = (HANDLE) _beginthreadex(NULL, 0, NPipePoolWorker, poolP, 0, NULL);
+        if (hthread == NULL) {
+            InterlockedDecrement(&poolP->live_workers);
+            winerr = GetLastError();
+            break;
+        }
+        CloseHandle(hthread);   /* Workers are never waited on */
+        poolP->nworkers++;
+    }
+    if (poolP->nworkers == 0)
+        goto error_return;
+
+    winerr = NPipePoolFill(poolP);
+    if (ZLIST_COUNT(&poolP->listening) == 0 &&
+        ZLIST_COUNT(&poolP->accepted) == 0 &&
+        winerr != ERROR_SUCCESS)
+        goto error_return;
+
+    ObjSetResult(interp, ObjFromTwapiId(poolP->id));
+    return TCL_OK;
+
+error_return:
+    NPipePoolClose(poolP);
+    return Twapi_AppendSystemError(interp, winerr);
+}
+
+static int Twapi_NPipePoolCloseObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    NPipePool *poolP;
+
+    if (objc != 2)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    poolP = NPipePoolLocate(interp, objv[1]);
+    if (poolP == NULL)
+        return TCL_ERROR;
+    NPipePoolClose(poolP);
+    return TCL_OK;
+}
+
+static int Twapi_NPipePoolStatsObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    NPipePool *poolP;
+    Tcl_Obj *objs[20];
+
+    if (objc != 2)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    poolP = NPipePoolLocate(interp, objv[1]);
+    if (poolP == NULL)
+        return TCL_ERROR;
+
+    EnterCriticalSection(&poolP->lock);
+    objs[0] = STRING_LITERAL_OBJ("instances");
+    objs[1] = ObjFromInt(poolP->ninstances);
+    objs[2] = STRING_LITERAL_OBJ("workers");
+    objs[3] = ObjFromInt(poolP->nworkers);
+    objs[4] = STRING_LITERAL_OBJ("listening");
+    objs[5] = ObjFromInt(ZLIST_COUNT(&poolP->listening));
+    objs[6] = STRING_LITERAL_OBJ("backlog");
+    objs[7] = ObjFromInt(ZLIST_COUNT(&poolP->accepted));
+    objs[8] = STRING_LITERAL_OBJ("maxbacklog");
+    objs[9] = ObjFromInt(poolP->max_backlog);
+    objs[10] = STRING_LITERAL_OBJ("connects");
+    objs[11] = ObjFromWideInt(poolP->nconnects);
+    objs[12] = STRING_LITERAL_OBJ("accepted");
+    objs[13] = ObjFromWideInt(poolP->naccepted);
+    objs[14] = STRING_LITERAL_OBJ("failed");
+    objs[15] = ObjFromWideInt(poolP->nfailed);
+    objs[16] = STRING_LITERAL_OBJ("maxlatency");
+    objs[17] = ObjFromDWORD(poolP->max_latency);
+    objs[18] = STRING_LITERAL_OBJ("lasterror");
+    objs[19] = ObjFromDWORD(poolP->last_error);
+    LeaveCriticalSection(&poolP->lock);
+
+    ObjSetResult(interp, ObjNewList(20, objs));
+    return TCL_OK;
+}
+
+
 int Twapi_NPipeImpersonateObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
     HANDLE h;
@@ -1496,6 +1964,9 @@ static int TwapiNPipeInitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
     Tcl_CreateObjCommand(interp, "twapi::Twapi_NPipeClient", Twapi_NPipeClientObjCmd, ticP, NULL);
     Tcl_CreateObjCommand(interp, "twapi::Twapi_NPipeServer", Twapi_NPipeServerObjCmd, ticP, NULL);
     Tcl_CreateObjCommand(interp, "twapi::ImpersonateNamedPipeClient", Twapi_NPipeImpersonateObjCmd, ticP, NULL);
+    Tcl_CreateObjCommand(interp, "twapi::Twapi_NPipePool", Twapi_NPipePoolObjCmd, ticP, NULL);
+    Tcl_CreateObjCommand(interp, "twapi::Twapi_NPipePoolClose", Twapi_NPipePoolCloseObjCmd, ticP, NULL);
+    Tcl_CreateObjCommand(interp, "twapi::Twapi_NPipePoolStats", Twapi_NPipePoolStatsObjCmd, ticP, NULL);
 
     return TCL_OK;
 }
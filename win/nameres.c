@@ -0,0 +1,1200 @@
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Asynchronous name resolution service. See nameres.h.
+ *
+ * Build with -DNAMERES_TEST to get a standalone test driver that runs
+ * the service against a stub resolver (see end of file).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "nameres.h"
+
+typedef struct NameResWaiter {
+    struct NameResWaiter *nextP;
+    NameResDoneProc *doneProc;
+    void *client;
+} NameResWaiter;
+
+/*
+ * Cache entries are keyed by kind, family and query. While pending, an
+ * entry is either on the work queue or being looked up by a worker and
+ * holds the requests waiting for it. Pending entries are never removed
+ * from the table so that later identical requests find them.
+ */
+typedef struct NameResEntry {
+    Tcl_HashEntry *hashP;
+    struct NameResEntry *nextQueuedP;
+    NameResWaiter *waitersP;    /* Most recent first */
+    char *resultP;              /* ckalloc'ed, may be NULL */
+    Tcl_Time expires;
+    int status;
+    int pending;
+    int kind;
+    int family;
+    char query[1];              /* Actually longer */
+} NameResEntry;
+
+struct NameRes {
+    NameResConfig config;
+    Tcl_Mutex lock;
+    Tcl_Condition workCond;     /* Signalled when work is queued */
+    Tcl_Condition exitCond;     /* Signalled when a worker exits */
+    Tcl_HashTable entries;
+    NameResEntry *queueHeadP;
+    NameResEntry *queueTailP;
+    int nqueued;
+    int npending;               /* Entries being looked up or queued */
+    int nworkers;
+    int nidle;
+    int stopping;
+    NameResStats stats;
+};
+
+static const char gNameResEmpty[] = "";
+
+static char *NameResStrdup(const char *s)
+{
+    size_t len;
+    char *p;
+    if (s == NULL)
+        return NULL;
+    len = strlen(s) + 1;
+    p = ckalloc(len);
+    memcpy(p, s, len);
+    return p;
+}
+
+static void NameResKey(Tcl_DString *dsP, int kind, int family,
+                       const char *query)
+{
+    char buf[40];
+    Tcl_DStringInit(dsP);
+    sprintf(buf, "%d %d ", kind, family);
+    Tcl_DStringAppend(dsP, buf, -1);
+    Tcl_DStringAppend(dsP, query, -1);
+}
+
+static int NameResExpired(const Tcl_Time *expiresP, const Tcl_Time *nowP)
+{
+    return nowP->sec > expiresP->sec
+        || (nowP->sec == expiresP->sec && nowP->usec >= expiresP->usec);
+}
+
+static void NameResAddMillis(Tcl_Time *timeP, int ms)
+{
+    timeP->sec += ms / 1000;
+    timeP->usec += (ms % 1000) * 1000;
+    if (timeP->usec >= 1000000) {
+        timeP->sec += 1;
+        timeP->usec -= 1000000;
+    }
+}
+
+/* Removes an entry that is not pending. Caller holds the lock. */
+static void NameResFreeEntry(NameResEntry *entryP)
+{
+    if (entryP->hashP)
+        Tcl_DeleteHashEntry(entryP->hashP);
+    if (entryP->resultP)
+        ckfree(entryP->resultP);
+    ckfree((char *) entryP);
+}
+
+/*
+ * Purges completed entries when the cache is full, expired ones first
+ * and then all of them. Caller holds the lock. Nothing is done if all
+ * entries are pending so submitting more names than the cache holds
+ * does not rescan the table for every name.
+ */
+static void NameResPurge(NameRes *nrP)
+{
+    Tcl_HashSearch hs;
+    Tcl_HashEntry *heP;
+    Tcl_Time now;
+    int pass;
+
+    Tcl_GetTime(&now);
+    for (pass = 0; pass < 2; ++pass) {
+        if (nrP->entries.numEntries < nrP->config.max_entries
+            || nrP->entries.numEntries == nrP->npending)
+            return;
+        for (heP = Tcl_FirstHashEntry(&nrP->entries, &hs); heP;
+             heP = Tcl_NextHashEntry(&hs)) {
+            NameResEntry *entryP = Tcl_GetHashValue(heP);
+            if (!entryP->pending
+                && (pass == 1 || NameResExpired(&entryP->expires, &now)))
+                NameResFreeEntry(entryP);
+        }
+    }
+}
+
+/*
+ * Returns the entry for a key, pending or completed, or NULL if there is
+ * none. Expired entries are removed. Caller holds the lock.
+ */
+static NameResEntry *NameResFind(NameRes *nrP, const char *key)
+{
+    Tcl_HashEntry *heP;
+    NameResEntry *entryP;
+    Tcl_Time now;
+
+    heP = Tcl_FindHashEntry(&nrP->entries, key);
+    if (heP == NULL)
+        return NULL;
+    entryP = Tcl_GetHashValue(heP);
+    if (entryP->pending)
+        return entryP;
+    Tcl_GetTime(&now);
+    if (NameResExpired(&entryP->expires, &now)) {
+        NameResFreeEntry(entryP);
+        return NULL;
+    }
+    return entryP;
+}
+
+/* Adds a pending entry for a query. Caller holds the lock. */
+static NameResEntry *NameResAddEntry(NameRes *nrP, const char *key, int kind,
+                                     int family, const char *query)
+{
+    NameResEntry *entryP;
+    int isnew;
+
+    NameResPurge(nrP);
+    entryP = (NameResEntry *) ckalloc(sizeof(*entryP) + strlen(query));
+    memset(entryP, 0, sizeof(*entryP));
+    entryP->pending = 1;
+    entryP->kind = kind;
+    entryP->family = family;
+    strcpy(entryP->query, query);
+    entryP->hashP = Tcl_CreateHashEntry(&nrP->entries, key, &isnew);
+    Tcl_SetHashValue(entryP->hashP, entryP);
+    nrP->npending++;
+    return entryP;
+}
+
+/* Attaches a request to a pending entry. Caller holds the lock. */
+static void NameResAddWaiter(NameResEntry *entryP, NameResDoneProc *doneProc,
+                             void *client)
+{
+    NameResWaiter *waiterP = (NameResWaiter *) ckalloc(sizeof(*waiterP));
+    waiterP->doneProc = doneProc;
+    waiterP->client = client;
+    waiterP->nextP = entryP->waitersP;
+    entryP->waitersP = waiterP;
+}
+
+/* Calls the done procedures of a list of waiters in submission order */
+static void NameResDeliver(NameResWaiter *waitersP, int status,
+                           const char *resultP, int cached)
+{
+    NameResWaiter *prevP = NULL;
+
+    /* Reverse to submission order */
+    while (waitersP) {
+        NameResWaiter *nextP = waitersP->nextP;
+        waitersP->nextP = prevP;
+        prevP = waitersP;
+        waitersP = nextP;
+    }
+    if (resultP == NULL)
+        resultP = gNameResEmpty;
+    while (prevP) {
+        NameResWaiter *nextP = prevP->nextP;
+        prevP->doneProc(prevP->client, status, resultP, cached);
+        ckfree((char *) prevP);
+        prevP = nextP;
+    }
+}
+
+/*
+ * Pending entries looked up together. The arrays are parallel and are
+ * laid out as the batch lookup procedure expects them.
+ */
+typedef struct NameResBatch {
+    int n;
+    NameResEntry **entries;
+    const char **queries;
+    char **results;
+    int *statuses;
+    NameResWaiter **waiters;
+} NameResBatch;
+
+static void NameResBatchInit(NameResBatch *batchP, int max)
+{
+    batchP->n = 0;
+    batchP->entries = (NameResEntry **) ckalloc(max * sizeof(NameResEntry *));
+    batchP->queries = (const char **) ckalloc(max * sizeof(char *));
+    batchP->results = (char **) ckalloc(max * sizeof(char *));
+    batchP->statuses = (int *) ckalloc(max * sizeof(int));
+    batchP->waiters = (NameResWaiter **) ckalloc(max * sizeof(NameResWaiter *));
+}
+
+static void NameResBatchFree(NameResBatch *batchP)
+{
+    ckfree((char *) batchP->entries);
+    ckfree((char *) batchP->queries);
+    ckfree((char *) batchP->results);
+    ckfree((char *) batchP->statuses);
+    ckfree((char *) batchP->waiters);
+}
+
+/*
+ * Takes the entry at the head of the queue and, if there is a batch
+ * lookup procedure, up to max-1 more queued entries of the same kind
+ * and family. Caller holds the lock.
+ */
+static void NameResDequeue(NameRes *nrP, NameResBatch *batchP, int max)
+{
+    NameResEntry *firstP = nrP->queueHeadP;
+    NameResEntry *entryP = firstP;
+    NameResEntry *prevP = NULL;
+
+    batchP->n = 0;
+    while (entryP && batchP->n < max) {
+        NameResEntry *nextP = entryP->nextQueuedP;
+        if (entryP->kind == firstP->kind && entryP->family == firstP->family) {
+            if (prevP)
+                prevP->nextQueuedP = nextP;
+            else
+                nrP->queueHeadP = nextP;
+            if (nrP->queueTailP == entryP)
+                nrP->queueTailP = prevP;
+            entryP->nextQueuedP = NULL;
+            batchP->entries[batchP->n++] = entryP;
+        } else {
+            prevP = entryP;
+        }
+        entryP = nextP;
+    }
+    nrP->nqueued -= batchP->n;
+    nrP->stats.lookups += batchP->n;
+    if (nrP->config.batch_lookup)
+        nrP->stats.batches++;
+}
+
+/*
+ * Looks up the entries in a batch. Called without the lock. Pending
+ * entries are not freed so their queries can be accessed unlocked.
+ */
+static void NameResLookup(NameRes *nrP, NameResBatch *batchP)
+{
+    NameResEntry *firstP = batchP->entries[0];
+    int i;
+
+    for (i = 0; i < batchP->n; ++i) {
+        batchP->queries[i] = batchP->entries[i]->query;
+        batchP->results[i] = NULL;
+        batchP->statuses[i] = 0;
+    }
+    if (nrP->config.batch_lookup) {
+        nrP->config.batch_lookup(nrP->config.lookup_ctx, firstP->kind,
+                                 firstP->family, batchP->n, batchP->queries,
+                                 batchP->results, batchP->statuses);
+    } else {
+        for (i = 0; i < batchP->n; ++i) {
+            batchP->statuses[i] =
+                nrP->config.lookup(nrP->config.lookup_ctx, firstP->kind,
+                                   firstP->family, batchP->queries[i],
+                                   &batchP->results[i]);
+        }
+    }
+}
+
+/*
+ * Stores the results of a batch in its entries and delivers them to the
+ * waiting requests. Called without the lock.
+ */
+static void NameResComplete(NameRes *nrP, NameResBatch *batchP)
+{
+    int i;
+
+    Tcl_MutexLock(&nrP->lock);
+    for (i = 0; i < batchP->n; ++i) {
+        NameResEntry *entryP = batchP->entries[i];
+        int status = batchP->statuses[i];
+        int ttl;
+        entryP->pending = 0;
+        entryP->status = status;
+        entryP->resultP = batchP->results[i];
+        batchP->waiters[i] = entryP->waitersP;
+        entryP->waitersP = NULL;
+        nrP->npending--;
+        ttl = status ? nrP->config.negative_ttl : nrP->config.positive_ttl;
+        if (ttl > 0 && !nrP->stopping) {
+            Tcl_GetTime(&entryP->expires);
+            NameResAddMillis(&entryP->expires, ttl);
+            /* The entry may be purged once unlocked so deliver a copy */
+            batchP->results[i] = NameResStrdup(entryP->resultP);
+        } else {
+            entryP->resultP = NULL;
+            NameResFreeEntry(entryP);
+        }
+    }
+    Tcl_MutexUnlock(&nrP->lock);
+
+    for (i = 0; i < batchP->n; ++i) {
+        NameResDeliver(batchP->waiters[i], batchP->statuses[i],
+                       batchP->results[i], 0);
+        if (batchP->results[i])
+            ckfree(batchP->results[i]);
+    }
+}
+
+static Tcl_ThreadCreateType NameResWorker(ClientData clientdata)
+{
+    NameRes *nrP = clientdata;
+    NameResBatch batch;
+    int max_batch = nrP->config.batch_lookup ? nrP->config.max_batch : 1;
+
+    NameResBatchInit(&batch, max_batch);
+    Tcl_MutexLock(&nrP->lock);
+    while (1) {
+        if (nrP->queueHeadP == NULL && !nrP->stopping) {
+            Tcl_Time deadline, now, timeout;
+            Tcl_GetTime(&deadline);
+            NameResAddMillis(&deadline, nrP->config.idle_timeout);
+            nrP->nidle++;
+            while (nrP->queueHeadP == NULL && !nrP->stopping) {
+                Tcl_GetTime(&now);
+                if (NameResExpired(&deadline, &now))
+                    break;
+                timeout.sec = deadline.sec - now.sec;
+                timeout.usec = deadline.usec - now.usec;
+                if (timeout.usec < 0) {
+                    timeout.sec -= 1;
+                    timeout.usec += 1000000;
+                }
+                Tcl_ConditionWait(&nrP->workCond, &nrP->lock, &timeout);
+            }
+            nrP->nidle--;
+        }
+        if (nrP->queueHeadP == NULL)
+            break;              /* Idle too long or stopping */
+        NameResDequeue(nrP, &batch, max_batch);
+        Tcl_MutexUnlock(&nrP->lock);
+
+        NameResLookup(nrP, &batch);
+        NameResComplete(nrP, &batch);
+
+        Tcl_MutexLock(&nrP->lock);
+    }
+    nrP->nworkers--;
+    Tcl_ConditionNotify(&nrP->exitCond);
+    Tcl_MutexUnlock(&nrP->lock);
+    NameResBatchFree(&batch);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+NameRes *NameResNew(const NameResConfig *configP)
+{
+    NameRes *nrP = (NameRes *) ckalloc(sizeof(*nrP));
+
+    memset(nrP, 0, sizeof(*nrP));
+    nrP->config = *configP;
+    if (nrP->config.max_workers <= 0)
+        nrP->config.max_workers = 1;
+    if (nrP->config.max_entries <= 0)
+        nrP->config.max_entries = 1000;
+    if (nrP->config.idle_timeout <= 0)
+        nrP->config.idle_timeout = 1;
+    if (nrP->config.max_batch <= 0)
+        nrP->config.max_batch = 1;
+    Tcl_InitHashTable(&nrP->entries, TCL_STRING_KEYS);
+    return nrP;
+}
+
+void NameResDelete(NameRes *nrP)
+{
+    NameResEntry *entryP;
+    Tcl_HashSearch hs;
+    Tcl_HashEntry *heP;
+
+    Tcl_MutexLock(&nrP->lock);
+    nrP->stopping = 1;
+    /* Unqueue entries that have not been picked up by a worker */
+    entryP = nrP->queueHeadP;
+    nrP->queueHeadP = nrP->queueTailP = NULL;
+    nrP->nqueued = 0;
+    Tcl_ConditionNotify(&nrP->workCond);
+    while (nrP->nworkers > 0) {
+        /* Notification wakes one waiter, repeat until all have exited */
+        Tcl_ConditionNotify(&nrP->workCond);
+        Tcl_ConditionWait(&nrP->exitCond, &nrP->lock, NULL);
+    }
+    Tcl_MutexUnlock(&nrP->lock);
+
+    /* No other threads now */
+    while (entryP) {
+        NameResEntry *nextP = entryP->nextQueuedP;
+        NameResDeliver(entryP->waitersP, NAMERES_E_CANCELLED, NULL, 0);
+        entryP->waitersP = NULL;
+        NameResFreeEntry(entryP);
+        entryP = nextP;
+    }
+    for (heP = Tcl_FirstHashEntry(&nrP->entries, &hs); heP;
+         heP = Tcl_NextHashEntry(&hs)) {
+        NameResFreeEntry(Tcl_GetHashValue(heP));
+    }
+    Tcl_DeleteHashTable(&nrP->entries);
+    Tcl_ConditionFinalize(&nrP->workCond);
+    Tcl_ConditionFinalize(&nrP->exitCond);
+    Tcl_MutexFinalize(&nrP->lock);
+    ckfree((char *) nrP);
+}
+
+/* A cached result to deliver once the lock is released */
+typedef struct NameResHit {
+    void *client;
+    int status;
+    char *resultP;
+} NameResHit;
+
+int NameResSubmitMany(NameRes *nrP, int kind, int family, int n,
+                      const char *const queries[], NameResDoneProc *doneProc,
+                      void *const clients[], int *nsubmittedP)
+{
+    Tcl_DString ds;
+    NameResEntry *entryP;
+    NameResHit *hits;
+    int i, nhits = 0, error = 0;
+    int per_worker = nrP->config.batch_lookup ? nrP->config.max_batch : 1;
+
+    if (n <= 0)
+        return 0;
+    hits = (NameResHit *) ckalloc(n * sizeof(*hits));
+
+    Tcl_MutexLock(&nrP->lock);
+    for (i = 0; i < n; ++i) {
+        NameResKey(&ds, kind, family, queries[i]);
+        nrP->stats.requests++;
+        entryP = NameResFind(nrP, Tcl_DStringValue(&ds));
+        if (entryP && !entryP->pending) {
+            hits[nhits].client = clients[i];
+            hits[nhits].status = entryP->status;
+            hits[nhits].resultP = NameResStrdup(entryP->resultP);
+            nhits++;
+            nrP->stats.hits++;
+        } else {
+            if (entryP == NULL) {
+                /*
+                 * Need a lookup. Start a worker unless enough are idle
+                 * to pick up everything queued, each taking a batch at a
+                 * time. Pending entries always have a worker since
+                 * workers only exit when the queue is empty.
+                 */
+                if (nrP->nqueued >= nrP->nidle * per_worker
+                    && nrP->nworkers < nrP->config.max_workers) {
+                    Tcl_ThreadId tid;
+                    if (Tcl_CreateThread(&tid, NameResWorker, nrP,
+                                         TCL_THREAD_STACK_DEFAULT,
+                                         TCL_THREAD_NOFLAGS) == TCL_OK) {
+                        nrP->nworkers++;
+                    } else if (nrP->nworkers == 0) {
+                        Tcl_DStringFree(&ds);
+                        error = NAMERES_E_NOTHREAD;
+                        break;
+                    }
+                }
+                entryP = NameResAddEntry(nrP, Tcl_DStringValue(&ds), kind,
+                                         family, queries[i]);
+                if (nrP->queueTailP)
+                    nrP->queueTailP->nextQueuedP = entryP;
+                else
+                    nrP->queueHeadP = entryP;
+                nrP->queueTailP = entryP;
+                nrP->nqueued++;
+                Tcl_ConditionNotify(&nrP->workCond);
+            } else {
+                nrP->stats.coalesced++;
+            }
+            NameResAddWaiter(entryP, doneProc, clients[i]);
+        }
+        Tcl_DStringFree(&ds);
+    }
+    Tcl_MutexUnlock(&nrP->lock);
+    if (nsubmittedP)
+        *nsubmittedP = i;
+
+    for (i = 0; i < nhits; ++i) {
+        doneProc(hits[i].client, hits[i].status,
+                 hits[i].resultP ? hits[i].resultP : gNameResEmpty, 1);
+        if (hits[i].resultP)
+            ckfree(hits[i].resultP);
+    }
+    ckfree((char *) hits);
+    return error;
+}
+
+int NameResSubmit(NameRes *nrP, int kind, int family, const char *query,
+                  NameResDoneProc *doneProc, void *client)
+{
+    return NameResSubmitMany(nrP, kind, family, 1, &query, doneProc, &client,
+                             NULL);
+}
+
+/*
+ * State of a NameResResolve call. Results of lookups in other threads
+ * are stored through a slot per query and counted under the lock.
+ */
+typedef struct NameResSync {
+    Tcl_Mutex lock;
+    Tcl_Condition cond;
+    int remaining;
+    int *statuses;
+    char **results;
+} NameResSync;
+
+typedef struct NameResSyncSlot {
+    NameResSync *syncP;
+    int index;
+} NameResSyncSlot;
+
+static void NameResSyncDone(void *client, int status, const char *result,
+                            int cached)
+{
+    NameResSyncSlot *slotP = client;
+    NameResSync *syncP = slotP->syncP;
+
+    (void) cached;
+    syncP->statuses[slotP->index] = status;
+    syncP->results[slotP->index] = result[0] ? NameResStrdup(result) : NULL;
+    Tcl_MutexLock(&syncP->lock);
+    if (--syncP->remaining == 0)
+        Tcl_ConditionNotify(&syncP->cond);
+    Tcl_MutexUnlock(&syncP->lock);
+}
+
+void NameResResolve(NameRes *nrP, int kind, int family, int n,
+                    const char *const queries[], int statuses[],
+                    char *results[])
+{
+    Tcl_DString ds;
+    NameResEntry *entryP;
+    NameResSync sync;
+    NameResSyncSlot *slots;
+    NameResBatch mine;          /* Entries looked up by this thread */
+    int i, max_batch;
+
+    if (n <= 0)
+        return;
+    memset(&sync, 0, sizeof(sync));
+    sync.statuses = statuses;
+    sync.results = results;
+    slots = (NameResSyncSlot *) ckalloc(n * sizeof(*slots));
+    NameResBatchInit(&mine, n);
+
+    Tcl_MutexLock(&nrP->lock);
+    for (i = 0; i < n; ++i) {
+        results[i] = NULL;
+        NameResKey(&ds, kind, family, queries[i]);
+        nrP->stats.requests++;
+        entryP = NameResFind(nrP, Tcl_DStringValue(&ds));
+        if (entryP && !entryP->pending) {
+            statuses[i] = entryP->status;
+            if (entryP->resultP && entryP->resultP[0])
+                results[i] = NameResStrdup(entryP->resultP);
+            nrP->stats.hits++;
+        } else {
+            if (entryP == NULL) {
+                /* Not queued, this thread looks it up below */
+                entryP = NameResAddEntry(nrP, Tcl_DStringValue(&ds), kind,
+                                         family, queries[i]);
+                mine.entries[mine.n++] = entryP;
+            } else {
+                nrP->stats.coalesced++;
+            }
+            slots[i].syncP = &sync;
+            slots[i].index = i;
+            NameResAddWaiter(entryP, NameResSyncDone, &slots[i]);
+            sync.remaining++;   /* Waiters are not run while locked */
+        }
+        Tcl_DStringFree(&ds);
+    }
+    Tcl_MutexUnlock(&nrP->lock);
+
+    max_batch = nrP->config.batch_lookup ? nrP->config.max_batch : mine.n;
+    for (i = 0; i < mine.n; i += max_batch) {
+        NameResBatch chunk;
+        chunk.n = mine.n - i < max_batch ? mine.n - i : max_batch;
+        chunk.entries = mine.entries + i;
+        chunk.queries = mine.queries + i;
+        chunk.results = mine.results + i;
+        chunk.statuses = mine.statuses + i;
+        chunk.waiters = mine.waiters + i;
+        Tcl_MutexLock(&nrP->lock);
+        nrP->stats.lookups += chunk.n;
+        if (nrP->config.batch_lookup)
+            nrP->stats.batches++;
+        Tcl_MutexUnlock(&nrP->lock);
+        NameResLookup(nrP, &chunk);
+        NameResComplete(nrP, &chunk);
+    }
+
+    /* Wait for lookups by workers or other NameResResolve calls */
+    Tcl_MutexLock(&sync.lock);
+    while (sync.remaining > 0)
+        Tcl_ConditionWait(&sync.cond, &sync.lock, NULL);
+    Tcl_MutexUnlock(&sync.lock);
+
+    Tcl_ConditionFinalize(&sync.cond);
+    Tcl_MutexFinalize(&sync.lock);
+    NameResBatchFree(&mine);
+    ckfree((char *) slots);
+}
+
+void NameResForget(NameRes *nrP, int kind, int family, const char *query)
+{
+    Tcl_DString ds;
+    Tcl_HashEntry *heP;
+
+    NameResKey(&ds, kind, family, query);
+    Tcl_MutexLock(&nrP->lock);
+    heP = Tcl_FindHashEntry(&nrP->entries, Tcl_DStringValue(&ds));
+    if (heP) {
+        NameResEntry *entryP = Tcl_GetHashValue(heP);
+        if (!entryP->pending)
+            NameResFreeEntry(entryP);
+    }
+    Tcl_MutexUnlock(&nrP->lock);
+    Tcl_DStringFree(&ds);
+}
+
+void NameResFlush(NameRes *nrP)
+{
+    Tcl_HashSearch hs;
+    Tcl_HashEntry *heP;
+
+    Tcl_MutexLock(&nrP->lock);
+    for (heP = Tcl_FirstHashEntry(&nrP->entries, &hs); heP;
+         heP = Tcl_NextHashEntry(&hs)) {
+        NameResEntry *entryP = Tcl_GetHashValue(heP);
+        if (!entryP->pending)
+            NameResFreeEntry(entryP);
+    }
+    Tcl_MutexUnlock(&nrP->lock);
+}
+
+void NameResGetStats(NameRes *nrP, NameResStats *statsP)
+{
+    Tcl_MutexLock(&nrP->lock);
+    *statsP = nrP->stats;
+    statsP->workers = nrP->nworkers;
+    statsP->entries = nrP->entries.numEntries;
+    Tcl_MutexUnlock(&nrP->lock);
+}
+
+#ifdef NAMERES_TEST
+/*
+ * Test driver. Runs the service against a stub resolver that sleeps to
+ * simulate network latency and counts lookups.
+ *   cc -O2 -DTCL_THREADS=1 -DNAMERES_TEST nameres.c -ltcl8.6 -o nameres_test
+ *   ./nameres_test             - functional tests
+ *   ./nameres_test bench       - additionally times a 20000 request batch,
+ *                                with and without batch lookups
+ */
+#include <stdlib.h>
+
+static int failures;
+
+#define CHECK(cond_)                                                    \
+    do {                                                                \
+        if (! (cond_)) {                                                \
+            printf("FAIL line %d: %s\n", __LINE__, #cond_);             \
+            ++failures;                                                 \
+        }                                                               \
+    } while (0)
+
+/* Stub resolver state */
+static Tcl_Mutex stubLock;
+static int stubDelay;           /* Milliseconds per lookup */
+static int stubCalls;
+static int stubActive;
+static int stubMaxActive;
+
+/* Names starting with "bad" fail, others resolve to "addr-NAME" */
+static int StubResult(int kind, const char *query, char **resultP)
+{
+    if (strncmp(query, "bad", 3) == 0)
+        return 11001;           /* WSAHOST_NOT_FOUND */
+    *resultP = ckalloc(strlen(query) + 6);
+    sprintf(*resultP, "%s-%s", kind == NAMERES_HOSTNAME ? "addr" : "name",
+            query);
+    return 0;
+}
+
+static int StubLookup(void *ctx, int kind, int family, const char *query,
+                      char **resultP)
+{
+    (void) ctx; (void) family;
+    Tcl_MutexLock(&stubLock);
+    stubCalls++;
+    if (++stubActive > stubMaxActive)
+        stubMaxActive = stubActive;
+    Tcl_MutexUnlock(&stubLock);
+
+    if (stubDelay)
+        Tcl_Sleep(stubDelay);
+
+    Tcl_MutexLock(&stubLock);
+    stubActive--;
+    Tcl_MutexUnlock(&stubLock);
+
+    return StubResult(kind, query, resultP);
+}
+
+/* Batch stub, the delay applies to the batch as a whole */
+static int stubBatches;
+static int stubMaxBatch;
+static void StubBatchLookup(void *ctx, int kind, int family, int n,
+                            const char *const queries[], char *results[],
+                            int statuses[])
+{
+    int i;
+
+    (void) ctx; (void) family;
+    Tcl_MutexLock(&stubLock);
+    stubBatches++;
+    stubCalls += n;
+    if (n > stubMaxBatch)
+        stubMaxBatch = n;
+    Tcl_MutexUnlock(&stubLock);
+    if (stubDelay)
+        Tcl_Sleep(stubDelay);
+    for (i = 0; i < n; ++i)
+        statuses[i] = StubResult(kind, queries[i], &results[i]);
+}
+
+static void StubReset(int delay)
+{
+    Tcl_MutexLock(&stubLock);
+    stubDelay = delay;
+    stubCalls = stubActive = stubMaxActive = 0;
+    stubBatches = stubMaxBatch = 0;
+    Tcl_MutexUnlock(&stubLock);
+}
+
+/* Collects completions */
+typedef struct TestResult {
+    int done;
+    int status;
+    int cached;
+    char result[64];
+} TestResult;
+
+static Tcl_Mutex doneLock;
+static Tcl_Condition doneCond;
+static int ndone;
+
+static void TestDone(void *client, int status, const char *result, int cached)
+{
+    TestResult *trP = client;
+    Tcl_MutexLock(&doneLock);
+    trP->done++;
+    trP->status = status;
+    trP->cached = cached;
+    strncpy(trP->result, result, sizeof(trP->result) - 1);
+    ndone++;
+    Tcl_ConditionNotify(&doneCond);
+    Tcl_MutexUnlock(&doneLock);
+}
+
+static void TestWait(int n)
+{
+    Tcl_MutexLock(&doneLock);
+    while (ndone < n)
+        Tcl_ConditionWait(&doneCond, &doneLock, NULL);
+    ndone = 0;
+    Tcl_MutexUnlock(&doneLock);
+}
+
+static NameRes *TestNew(int max_workers, int pos_ttl, int neg_ttl,
+                        int max_entries, int idle_timeout)
+{
+    NameResConfig config;
+    config.lookup = StubLookup;
+    config.batch_lookup = NULL;
+    config.lookup_ctx = NULL;
+    config.max_batch = 1;
+    config.max_workers = max_workers;
+    config.positive_ttl = pos_ttl;
+    config.negative_ttl = neg_ttl;
+    config.max_entries = max_entries;
+    config.idle_timeout = idle_timeout;
+    return NameResNew(&config);
+}
+
+static NameRes *TestNewBatch(int max_workers, int max_batch)
+{
+    NameResConfig config;
+    config.lookup = NULL;
+    config.batch_lookup = StubBatchLookup;
+    config.lookup_ctx = NULL;
+    config.max_batch = max_batch;
+    config.max_workers = max_workers;
+    config.positive_ttl = 60000;
+    config.negative_ttl = 60000;
+    config.max_entries = 10000;
+    config.idle_timeout = 1000;
+    return NameResNew(&config);
+}
+
+static void TestCoalesce(void)
+{
+    NameRes *nrP;
+    NameResStats stats;
+    static TestResult results[200];
+    char name[20];
+    int i;
+
+    memset(results, 0, sizeof(results));
+    StubReset(20);
+    nrP = TestNew(4, 60000, 60000, 100, 1000);
+    /* 200 requests for 10 distinct names */
+    for (i = 0; i < 200; ++i) {
+        sprintf(name, "host%d", i % 10);
+        CHECK(NameResSubmit(nrP, NAMERES_HOSTNAME, 0, name, TestDone,
+                            &results[i]) == 0);
+    }
+    TestWait(200);
+    CHECK(stubCalls == 10);
+    CHECK(stubMaxActive <= 4);
+    for (i = 0; i < 200; ++i) {
+        sprintf(name, "addr-host%d", i % 10);
+        CHECK(results[i].done == 1);
+        CHECK(results[i].status == 0);
+        CHECK(strcmp(results[i].result, name) == 0);
+    }
+    NameResGetStats(nrP, &stats);
+    CHECK(stats.requests == 200);
+    CHECK(stats.lookups == 10);
+    CHECK(stats.coalesced + stats.hits == 190);
+    CHECK(stats.workers <= 4);
+    CHECK(stats.entries == 10);
+
+    /* Now all cached and delivered synchronously */
+    memset(results, 0, sizeof(results));
+    CHECK(NameResSubmit(nrP, NAMERES_HOSTNAME, 0, "host3", TestDone,
+                        &results[0]) == 0);
+    CHECK(results[0].done == 1 && results[0].cached == 1);
+    CHECK(strcmp(results[0].result, "addr-host3") == 0);
+    TestWait(1);
+    /* Kind and family are part of the key */
+    CHECK(NameResSubmit(nrP, NAMERES_ADDRESS, 0, "host3", TestDone,
+                        &results[1]) == 0);
+    CHECK(NameResSubmit(nrP, NAMERES_HOSTNAME, 2, "host3", TestDone,
+                        &results[2]) == 0);
+    TestWait(2);
+    CHECK(results[1].cached == 0 && results[2].cached == 0);
+    CHECK(strcmp(results[1].result, "name-host3") == 0);
+    CHECK(stubCalls == 12);
+
+    /* Forget drops one entry */
+    NameResForget(nrP, NAMERES_HOSTNAME, 0, "host3");
+    CHECK(NameResSubmit(nrP, NAMERES_HOSTNAME, 0, "host3", TestDone,
+                        &results[3]) == 0);
+    TestWait(1);
+    CHECK(results[3].cached == 0 && stubCalls == 13);
+    NameResFlush(nrP);
+    NameResGetStats(nrP, &stats);
+    CHECK(stats.entries == 0);
+    NameResDelete(nrP);
+}
+
+static void TestTtl(void)
+{
+    NameRes *nrP;
+    TestResult results[8];
+
+    memset(results, 0, sizeof(results));
+    StubReset(0);
+    nrP = TestNew(2, 400, 100, 100, 1000);
+    CHECK(NameResSubmit(nrP, NAMERES_HOSTNAME, 0, "good", TestDone,
+                        &results[0]) == 0);
+    CHECK(NameResSubmit(nrP, NAMERES_HOSTNAME, 0, "bad.example", TestDone,
+                        &results[1]) == 0);
+    TestWait(2);
+    CHECK(results[0].status == 0);
+    CHECK(results[1].status == 11001 && results[1].result[0] == 0);
+
+    /* Both cached */
+    NameResSubmit(nrP, NAMERES_HOSTNAME, 0, "good", TestDone, &results[2]);
+    NameResSubmit(nrP, NAMERES_HOSTNAME, 0, "bad.example", TestDone,
+                  &results[3]);
+    TestWait(2);
+    CHECK(results[2].cached && results[3].cached);
+    CHECK(results[3].status == 11001);
+    CHECK(stubCalls == 2);
+
+    /* Negative entry expires first */
+    Tcl_Sleep(200);
+    NameResSubmit(nrP, NAMERES_HOSTNAME, 0, "good", TestDone, &results[4]);
+    NameResSubmit(nrP, NAMERES_HOSTNAME, 0, "bad.example", TestDone,
+                  &results[5]);
+    TestWait(2);
+    CHECK(results[4].cached && !results[5].cached);
+    CHECK(stubCalls == 3);
+
+    Tcl_Sleep(300);
+    NameResSubmit(nrP, NAMERES_HOSTNAME, 0, "good", TestDone, &results[6]);
+    TestWait(1);
+    CHECK(!results[6].cached && stubCalls == 4);
+    NameResDelete(nrP);
+
+    /* A zero TTL disables caching */
+    StubReset(0);
+    nrP = TestNew(2, 0, 0, 100, 1000);
+    NameResSubmit(nrP, NAMERES_HOSTNAME, 0, "good", TestDone, &results[0]);
+    TestWait(1);
+    NameResSubmit(nrP, NAMERES_HOSTNAME, 0, "good", TestDone, &results[1]);
+    TestWait(1);
+    CHECK(!results[1].cached && stubCalls == 2);
+    NameResDelete(nrP);
+}
+
+static void TestPurgeAndIdle(void)
+{
+    NameRes *nrP;
+    NameResStats stats;
+    static TestResult results[100];
+    char name[20];
+    int i;
+
+    StubReset(0);
+    nrP = TestNew(3, 60000, 60000, 50, 100);
+    for (i = 0; i < 100; ++i) {
+        sprintf(name, "host%d", i);
+        NameResSubmit(nrP, NAMERES_HOSTNAME, 0, name, TestDone, &results[i]);
+    }
+    TestWait(100);
+    /* Cache is purged when the next entry is added */
+    NameResSubmit(nrP, NAMERES_HOSTNAME, 0, "extra", TestDone, &results[0]);
+    TestWait(1);
+    NameResGetStats(nrP, &stats);
+    CHECK(stats.entries <= 50);
+    CHECK(stats.workers >= 1 && stats.workers <= 3);
+
+    /* Workers exit when idle */
+    Tcl_Sleep(400);
+    NameResGetStats(nrP, &stats);
+    CHECK(stats.workers == 0);
+    /* and are restarted on demand */
+    NameResSubmit(nrP, NAMERES_HOSTNAME, 0, "another", TestDone, &results[0]);
+    TestWait(1);
+    CHECK(strcmp(results[0].result, "addr-another") == 0);
+    NameResDelete(nrP);
+}
+
+static void TestCancel(void)
+{
+    NameRes *nrP;
+    static TestResult results[20];
+    char name[20];
+    int i, ncancelled = 0, nok = 0;
+
+    memset(results, 0, sizeof(results));
+    StubReset(100);
+    nrP = TestNew(1, 60000, 60000, 100, 1000);
+    for (i = 0; i < 20; ++i) {
+        sprintf(name, "host%d", i);
+        NameResSubmit(nrP, NAMERES_HOSTNAME, 0, name, TestDone, &results[i]);
+    }
+    Tcl_Sleep(50);
+    NameResDelete(nrP);
+    for (i = 0; i < 20; ++i) {
+        CHECK(results[i].done == 1);
+        if (results[i].status == NAMERES_E_CANCELLED)
+            ncancelled++;
+        else if (results[i].status == 0)
+            nok++;
+    }
+    CHECK(nok >= 1 && ncancelled >= 18 && nok + ncancelled == 20);
+    TestWait(20);
+}
+
+static void TestBatch(void)
+{
+    NameRes *nrP;
+    NameResStats stats;
+    static TestResult results[210];
+    static char names[210][20];
+    const char *queries[210];
+    void *clients[210];
+    int i;
+
+    memset(results, 0, sizeof(results));
+    StubReset(20);
+    nrP = TestNewBatch(2, 40);
+    /* 200 requests for 100 distinct names queued together */
+    for (i = 0; i < 200; ++i) {
+        sprintf(names[i], "%s%d", (i % 100) % 7 ? "host" : "bad", i % 100);
+        queries[i] = names[i];
+        clients[i] = &results[i];
+    }
+    CHECK(NameResSubmitMany(nrP, NAMERES_ADDRESS, 0, 200, queries, TestDone,
+                            clients, &i) == 0);
+    CHECK(i == 200);
+    TestWait(200);
+    CHECK(stubCalls == 100);
+    CHECK(stubBatches == 3);    /* 40 + 40 + 20 */
+    CHECK(stubMaxBatch == 40);
+    for (i = 0; i < 200; ++i) {
+        char expected[30];
+        CHECK(results[i].done == 1);
+        if ((i % 100) % 7 == 0) {
+            CHECK(results[i].status == 11001);
+        } else {
+            sprintf(expected, "name-%s", names[i]);
+            CHECK(results[i].status == 0);
+            CHECK(strcmp(results[i].result, expected) == 0);
+        }
+    }
+    NameResGetStats(nrP, &stats);
+    CHECK(stats.requests == 200);
+    CHECK(stats.lookups == 100);
+    CHECK(stats.batches == 3);
+    CHECK(stats.coalesced + stats.hits == 100);
+
+    /* Batches only hold one kind and family */
+    StubReset(0);
+    memset(results, 0, sizeof(results));
+    for (i = 0; i < 10; ++i) {
+        sprintf(names[i], "mixed%d", i);
+        queries[i] = names[i];
+        clients[i] = &results[i];
+        CHECK(NameResSubmitMany(nrP, i % 2 ? NAMERES_ADDRESS : NAMERES_HOSTNAME,
+                                0, 1, &queries[i], TestDone, &clients[i],
+                                NULL) == 0);
+    }
+    TestWait(10);
+    CHECK(stubCalls == 10 && stubBatches >= 2);
+    CHECK(strcmp(results[0].result, "addr-mixed0") == 0);
+    CHECK(strcmp(results[1].result, "name-mixed1") == 0);
+    NameResDelete(nrP);
+}
+
+static void TestResolve(void)
+{
+    NameRes *nrP;
+    NameResStats stats;
+    TestResult result;
+    const char *queries[6] = {"a", "b", "bad", "a", "c", "d"};
+    const char *slow = "slow";
+    int statuses[6];
+    char *results[6];
+    int i;
+
+    StubReset(0);
+    nrP = TestNewBatch(2, 2);
+    NameResResolve(nrP, NAMERES_HOSTNAME, 0, 6, queries, statuses, results);
+    CHECK(stubCalls == 5);
+    CHECK(stubBatches == 3);    /* max_batch 2 */
+    CHECK(statuses[0] == 0 && strcmp(results[0], "addr-a") == 0);
+    CHECK(statuses[2] == 11001 && results[2] == NULL);
+    CHECK(statuses[3] == 0 && strcmp(results[3], "addr-a") == 0);
+    CHECK(statuses[5] == 0 && strcmp(results[5], "addr-d") == 0);
+    for (i = 0; i < 6; ++i) {
+        if (results[i])
+            ckfree(results[i]);
+    }
+    /* Now from the cache, no lookups */
+    NameResResolve(nrP, NAMERES_HOSTNAME, 0, 6, queries, statuses, results);
+    CHECK(stubCalls == 5);
+    CHECK(statuses[2] == 11001 && strcmp(results[4], "addr-c") == 0);
+    for (i = 0; i < 6; ++i) {
+        if (results[i])
+            ckfree(results[i]);
+    }
+    NameResGetStats(nrP, &stats);
+    CHECK(stats.requests == 12 && stats.hits == 6 && stats.coalesced == 1);
+    CHECK(stats.workers == 0);
+
+    /* Waits for a lookup in progress in a worker instead of repeating it */
+    StubReset(200);
+    memset(&result, 0, sizeof(result));
+    CHECK(NameResSubmit(nrP, NAMERES_HOSTNAME, 0, slow, TestDone,
+                        &result) == 0);
+    Tcl_Sleep(50);
+    NameResResolve(nrP, NAMERES_HOSTNAME, 0, 1, &slow, statuses, results);
+    CHECK(statuses[0] == 0 && strcmp(results[0], "addr-slow") == 0);
+    CHECK(stubCalls == 1);
+    ckfree(results[0]);
+    TestWait(1);
+    NameResDelete(nrP);
+
+    /* Without a batch procedure */
+    StubReset(0);
+    nrP = TestNew(1, 60000, 60000, 100, 1000);
+    NameResResolve(nrP, NAMERES_ADDRESS, 0, 3, queries, statuses, results);
+    CHECK(stubCalls == 3);
+    CHECK(strcmp(results[1], "name-b") == 0 && results[2] == NULL);
+    ckfree(results[0]);
+    ckfree(results[1]);
+    NameResGetStats(nrP, &stats);
+    CHECK(stats.lookups == 3 && stats.batches == 0);
+    NameResDelete(nrP);
+}
+
+static void Bench(void)
+{
+    NameRes *nrP;
+    static TestResult results[20000];
+    char name[20];
+    Tcl_Time start, end;
+    int i;
+
+    StubReset(5);
+    nrP = TestNew(16, 60000, 60000, 10000, 1000);
+    Tcl_GetTime(&start);
+    for (i = 0; i < 20000; ++i) {
+        sprintf(name, "10.0.%d.%d", (i % 2000) / 256, (i % 2000) % 256);
+        NameResSubmit(nrP, NAMERES_ADDRESS, 0, name, TestDone, &results[i]);
+    }
+    TestWait(20000);
+    Tcl_GetTime(&end);
+    printf("20000 requests, 2000 distinct, 5ms lookups, 16 workers: "
+           "%d lookups in %ld ms\n", stubCalls,
+           (long) ((end.sec - start.sec) * 1000
+                   + (end.usec - start.usec) / 1000));
+    NameResDelete(nrP);
+
+    /* Same requests with a batch procedure */
+    StubReset(5);
+    nrP = TestNewBatch(16, 1000);
+    Tcl_GetTime(&start);
+    for (i = 0; i < 20000; ++i) {
+        sprintf(name, "10.0.%d.%d", (i % 2000) / 256, (i % 2000) % 256);
+        NameResSubmit(nrP, NAMERES_ADDRESS, 0, name, TestDone, &results[i]);
+    }
+    TestWait(20000);
+    Tcl_GetTime(&end);
+    printf("Same with 5ms batch lookups of up to 1000 names: "
+           "%d lookups in %d batches in %ld ms\n", stubCalls, stubBatches,
+           (long) ((end.sec - start.sec) * 1000
+                   + (end.usec - start.usec) / 1000));
+    NameResDelete(nrP);
+}
+
+int main(int argc, char *argv[])
+{
+    Tcl_FindExecutable(argv[0]);
+    TestCoalesce();
+    TestTtl();
+    TestPurgeAndIdle();
+    TestCancel();
+    TestBatch();
+    TestResolve();
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+        Bench();
+    if (failures) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("All tests OK\n");
+    return 0;
+}
+#endif /* NAMERES_TEST */
@@ -0,0 +1,140 @@
+#ifndef NAMERES_H
+#define NAMERES_H
+
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Asynchronous name resolution service. Lookups are run by a bounded
+ * pool of worker threads. Identical requests that arrive while a lookup
+ * is in progress are attached to it instead of starting another, and
+ * completed lookups are cached, successes and failures with separate
+ * lifetimes, so resolving every address in a large connection table
+ * costs one lookup per distinct address and never more than a fixed
+ * number of threads.
+ *
+ * Backends that can resolve many names in one call may supply a batch
+ * lookup procedure in which case queued requests of the same kind are
+ * looked up together.
+ *
+ * The actual lookup is done by a procedure supplied by the host so this
+ * module only depends on Tcl and can be tested with a stub resolver on
+ * any platform.
+ */
+
+#include <tcl.h>
+
+/* Status passed to callbacks of requests cancelled by NameResDelete */
+#ifndef NAMERES_E_CANCELLED
+#define NAMERES_E_CANCELLED 995 /* ERROR_OPERATION_ABORTED */
+#endif
+/* Returned by NameResSubmit if no worker thread could be started */
+#ifndef NAMERES_E_NOTHREAD
+#define NAMERES_E_NOTHREAD 8    /* ERROR_NOT_ENOUGH_MEMORY */
+#endif
+
+/* Request kinds. The meaning of each is up to the lookup procedure. */
+#define NAMERES_HOSTNAME 0      /* Host name -> addresses */
+#define NAMERES_ADDRESS  1      /* Address -> host name */
+
+/*
+ * Performs a lookup. Called from worker threads, possibly concurrently.
+ * On return *resultP may point to a result allocated with ckalloc, or be
+ * NULL. Returns 0 on success or an error code.
+ */
+typedef int NameResLookupProc(void *ctx, int kind, int family,
+                              const char *query, char **resultP);
+
+/*
+ * Optional procedure that looks up several queries of the same kind and
+ * family in one call, for backends where a single call for many names
+ * is much cheaper than a call per name. Called from worker threads, or
+ * the thread calling NameResResolve, possibly concurrently. Stores the
+ * status of each query in statuses[] and its result, allocated with
+ * ckalloc or NULL, in results[] which are initially NULL.
+ */
+typedef void NameResBatchLookupProc(void *ctx, int kind, int family, int n,
+                                    const char *const queries[],
+                                    char *results[], int statuses[]);
+
+/*
+ * Called once per request with the lookup status and result (never NULL).
+ * Called from a worker thread, or from the submitting thread if the
+ * result was cached. result is only valid for the duration of the call.
+ */
+typedef void NameResDoneProc(void *client, int status, const char *result,
+                             int cached);
+
+typedef struct NameResConfig {
+    NameResLookupProc *lookup;
+    NameResBatchLookupProc *batch_lookup; /* If not NULL, used instead
+                                             of lookup */
+    void *lookup_ctx;
+    int max_batch;              /* Max queries per batch_lookup call */
+    int max_workers;
+    int positive_ttl;           /* Milliseconds, 0 -> not cached */
+    int negative_ttl;           /* Same, for failed lookups */
+    int max_entries;            /* Cache size at which entries are purged */
+    int idle_timeout;           /* Milliseconds before idle workers exit */
+} NameResConfig;
+
+typedef struct NameResStats {
+    Tcl_WideInt requests;
+    Tcl_WideInt lookups;        /* Queries passed to the lookup procedure */
+    Tcl_WideInt batches;        /* Calls to the batch lookup procedure */
+    Tcl_WideInt hits;           /* Served from the cache */
+    Tcl_WideInt coalesced;      /* Attached to a lookup in progress */
+    int workers;
+    int entries;
+} NameResStats;
+
+typedef struct NameRes NameRes;
+
+NameRes *NameResNew(const NameResConfig *configP);
+
+/*
+ * Waits for lookups in progress to complete and deletes the resolver.
+ * Requests still queued are completed with NAMERES_E_CANCELLED.
+ */
+void NameResDelete(NameRes *nrP);
+
+/*
+ * Queues a request. doneProc is called exactly once if 0 is returned.
+ * Returns NAMERES_E_NOTHREAD if no worker could be started.
+ */
+int NameResSubmit(NameRes *nrP, int kind, int family, const char *query,
+                  NameResDoneProc *doneProc, void *client);
+
+/*
+ * As NameResSubmit for each of n queries, calling doneProc with the
+ * corresponding element of clients. The queries are queued together so
+ * that they are looked up in as few batches as possible. On error, the
+ * requests for the first *nsubmittedP queries (if not NULL) were
+ * submitted and still complete. The other clients are not used.
+ */
+int NameResSubmitMany(NameRes *nrP, int kind, int family, int n,
+                      const char *const queries[], NameResDoneProc *doneProc,
+                      void *const clients[], int *nsubmittedP);
+
+/*
+ * Resolves n queries synchronously, returning cached results where
+ * available and otherwise looking them up in the calling thread, or
+ * waiting for lookups already in progress. Stores the status and result
+ * (allocated with ckalloc, or NULL if empty) of each query in statuses[]
+ * and results[]. No worker threads are used so this may be called from
+ * unthreaded builds.
+ */
+void NameResResolve(NameRes *nrP, int kind, int family, int n,
+                    const char *const queries[], int statuses[],
+                    char *results[]);
+
+/* Discards a cached result. Lookups in progress are not affected. */
+void NameResForget(NameRes *nrP, int kind, int family, const char *query);
+/* Discards all cached results */
+void NameResFlush(NameRes *nrP);
+
+void NameResGetStats(NameRes *nrP, NameResStats *statsP);
+
+#endif /* NAMERES_H */
@@ -7,6 +7,10 @@
 
 #include "twapi.h"
 #include <ntverp.h>
+#include "conntrack.h"
+#include "nameres.h"
+#include "ipaddr.h"
+#include "adaptcache.h"
 
 /*
  * Vista+ IP_ADAPTER_ADDRESSES. We define our own structure even for newer
@@ -65,15 +69,11 @@ typedef struct _TwapiHostnameEvent {
     TwapiInterpContext *ticP;
     TwapiId    id;             /* Passed from script as a request id */
     DWORD  status;         /* 0 -> success, else Win32 error code */
-    union {
-        struct addrinfo *addrinfolist; /* Returned by getaddrinfo, to be
-                                          freed via freeaddrinfo
-                                          Used for host->addr */
-        char *hostname;      /* ckalloc'ed (used for addr->hostname) */
-    };
-    int family;                 /* AF_UNSPEC, AF_INET or AF_INET6 */
-    int ai_flags;                  /* Flags for ai_flags field in hint */
-    char name[1];           /* Holds query for hostname->addr */
+    char *result;          /* ckalloc'ed result string from TwapiNameResLookup,
+                              NULL if empty */
+    int kind;              /* NAMERES_HOSTNAME or NAMERES_ADDRESS */
+    int batch;             /* Deliver to _resolve_batch_handler */
+    char name[1];           /* Holds query */
     /* VARIABLE SIZE SINCE name[] IS ARBITRARY SIZE */
 } TwapiHostnameEvent;
 /*
@@ -1151,8 +1151,13 @@ int Twapi_GetNetworkParams(TwapiInterpContext *ticP)
 
 
 
-int Twapi_GetAdaptersAddresses(TwapiInterpContext *ticP, ULONG family,
-                               ULONG flags, void *reserved)
+/*
+ * Stores the list of adapter records in *adaptersP. On error returns
+ * TCL_ERROR with the message in the interpreter.
+ */
+static TCL_RESULT TwapiGetAdaptersAddressesObj(TwapiInterpContext *ticP,
+                                               ULONG family, ULONG flags,
+                                               Tcl_Obj **adaptersP)
 {
     IP_ADAPTER_ADDRESSES *iaaP;
     ULONG bufsz;
@@ -1193,7 +1198,7 @@ int Twapi_GetAdaptersAddresses(TwapiInterpContext *ticP, ULONG family,
             ObjAppendElement(NULL, resultObj, ObjFromIP_ADAPTER_ADDRESSES(iaaP));
             iaaP = iaaP->Next;
         }
-        ObjSetResult(ticP->interp, resultObj);
+        *adaptersP = resultObj;
     }
 
     MemLifoPopFrame(ticP->memlifoP);
@@ -1201,6 +1206,237 @@ int Twapi_GetAdaptersAddresses(TwapiInterpContext *ticP, ULONG family,
     return error == ERROR_SUCCESS ? TCL_OK : TCL_ERROR;
 }
 
+int Twapi_GetAdaptersAddresses(TwapiInterpContext *ticP, ULONG family,
+                               ULONG flags, void *reserved)
+{
+    Tcl_Obj *resultObj;
+
+    if (TwapiGetAdaptersAddressesObj(ticP, family, flags, &resultObj) != TCL_OK)
+        return TCL_ERROR;
+    return ObjSetResult(ticP->interp, resultObj);
+}
+
+/*
+ * Adapter snapshot. Each interpreter keeps the full GetAdaptersAddresses
+ * result in an AdaptCache (adaptcache.c) which is only refetched after
+ * NotifyIpInterfaceChange or NotifyUnicastIpAddressChange report a
+ * change, so the script level adapter queries do not walk the whole
+ * adapter list every time. The notifications arrive on system threads
+ * and are passed on to the interpreter thread with TwapiEnqueueCallback
+ * since the cache is only accessed from there.
+ */
+typedef struct TwapiAdapterMonitor {
+    TwapiInterpContext *ticP;
+    AdaptCache *cacheP;
+    HANDLE interface_notify;
+    HANDLE address_notify;
+    LONG volatile pending;      /* Notifications not yet processed.
+                                   Incremented on notification threads */
+    int subscribed;             /* Pass changes to the script level */
+} TwapiAdapterMonitor;
+
+/* Interface index fields in IP_ADAPTER_ADDRESSES records */
+#define TWAPI_ADAPTER_NAME_FIELD     1
+#define TWAPI_ADAPTER_IFINDEX_FIELD  0
+#define TWAPI_ADAPTER_IPV6INDEX_FIELD 14
+
+static int TwapiAdapterCacheFetch(void *ctx, Tcl_Interp *interp,
+                                  Tcl_Obj **adaptersP)
+{
+    /* Fetch everything so any field query can be answered */
+    return TwapiGetAdaptersAddressesObj((TwapiInterpContext *) ctx, AF_UNSPEC,
+                                        GAA_FLAG_INCLUDE_PREFIX, adaptersP);
+}
+
+/* Called in the interpreter thread for each queued change notification */
+static int TwapiAdapterChangeCallbackFn(TwapiCallback *cbP)
+{
+    TwapiInterpContext *ticP = cbP->ticP;
+    TwapiAdapterMonitor *amP;
+    Tcl_Obj *objs[2];
+    Tcl_Size nchanges;
+    int status = TCL_OK;
+
+    if (ticP->interp == NULL || Tcl_InterpDeleted(ticP->interp))
+        return TCL_OK;
+    amP = (TwapiAdapterMonitor *) ticP->module.data.pval;
+    if (amP == NULL)
+        return TCL_OK;          /* Monitor already shut down */
+
+    AdaptCacheNotify(amP->cacheP, (int) cbP->clientdata);
+
+    /*
+     * Changes usually come in bursts. Only refresh on the last queued
+     * notification. Without subscribers the cache is refreshed lazily
+     * on the next query.
+     */
+    if (InterlockedDecrement(&amP->pending) > 0 || ! amP->subscribed)
+        return TCL_OK;
+
+    if (AdaptCacheRefresh(amP->cacheP, ticP->interp, &objs[1]) != TCL_OK) {
+        Tcl_BackgroundError(ticP->interp);
+        return TCL_OK;
+    }
+    ObjIncrRefs(objs[1]);
+    if (ObjListLength(NULL, objs[1], &nchanges) == TCL_OK && nchanges != 0) {
+        objs[0] = STRING_LITERAL_OBJ(TWAPI_TCL_NAMESPACE "::_adapter_change_handler");
+        status = TwapiEvalAndUpdateCallback(cbP, 2, objs, TRT_EMPTY);
+    }
+    ObjDecrRefs(objs[1]);
+    return status;
+}
+
+/* Called from system threads. Must not touch the interpreter. */
+static void TwapiAdapterMonitorEnqueue(TwapiAdapterMonitor *amP, ULONG ifindex)
+{
+    TwapiCallback *cbP;
+
+    InterlockedIncrement(&amP->pending);
+    cbP = TwapiCallbackNew(amP->ticP, TwapiAdapterChangeCallbackFn,
+                           sizeof(*cbP));
+    cbP->clientdata = ifindex;
+    TwapiEnqueueCallback(amP->ticP, cbP, TWAPI_ENQUEUE_DIRECT, 0, NULL);
+}
+
+static VOID NETIOAPI_API_ TwapiInterfaceChangeNotify(
+    PVOID ctx, PMIB_IPINTERFACE_ROW rowP, MIB_NOTIFICATION_TYPE type)
+{
+    /* Initial notifications carry no row. Treat as a change to all. */
+    TwapiAdapterMonitorEnqueue((TwapiAdapterMonitor *) ctx,
+                               rowP ? rowP->InterfaceIndex : 0);
+}
+
+static VOID NETIOAPI_API_ TwapiAddressChangeNotify(
+    PVOID ctx, PMIB_UNICASTIPADDRESS_ROW rowP, MIB_NOTIFICATION_TYPE type)
+{
+    TwapiAdapterMonitorEnqueue((TwapiAdapterMonitor *) ctx,
+                               rowP ? rowP->InterfaceIndex : 0);
+}
+
+/* Returns the monitor for the interpreter, creating it on first use */
+static TwapiAdapterMonitor *TwapiAdapterMonitorGet(TwapiInterpContext *ticP)
+{
+    TwapiAdapterMonitor *amP;
+    AdaptCacheConfig config;
+
+    amP = (TwapiAdapterMonitor *) ticP->module.data.pval;
+    if (amP)
+        return amP;
+
+    config.fetch = TwapiAdapterCacheFetch;
+    config.fetch_ctx = ticP;
+    config.name_field = TWAPI_ADAPTER_NAME_FIELD;
+    config.index_fields[0] = TWAPI_ADAPTER_IFINDEX_FIELD;
+    config.index_fields[1] = TWAPI_ADAPTER_IPV6INDEX_FIELD;
+    amP = TwapiAlloc(sizeof(*amP));
+    amP->ticP = ticP;
+    amP->cacheP = AdaptCacheNew(&config);
+    amP->interface_notify = NULL;
+    amP->address_notify = NULL;
+    amP->pending = 0;
+    amP->subscribed = 0;
+
+    /*
+     * If notifications cannot be registered, the monitor still works but
+     * every query refetches (see TwapiAdapterMonitorQuery).
+     */
+    if (NotifyIpInterfaceChange(AF_UNSPEC, TwapiInterfaceChangeNotify, amP,
+                                FALSE, &amP->interface_notify) != NO_ERROR)
+        amP->interface_notify = NULL;
+    if (NotifyUnicastIpAddressChange(AF_UNSPEC, TwapiAddressChangeNotify, amP,
+                                     FALSE, &amP->address_notify) != NO_ERROR)
+        amP->address_notify = NULL;
+
+    ticP->module.data.pval = amP;
+    return amP;
+}
+
+/*
+ * Returns the monitor with the cache ready to be queried. pending is
+ * incremented on the notification thread so a change is seen here even
+ * if the script has not serviced the event loop since. Subscribers do
+ * service it and refreshing here would swallow the changes reported to
+ * their handler, so they are left to the queued callback.
+ */
+static TwapiAdapterMonitor *TwapiAdapterMonitorQuery(TwapiInterpContext *ticP)
+{
+    TwapiAdapterMonitor *amP = TwapiAdapterMonitorGet(ticP);
+    if (amP->interface_notify == NULL || amP->address_notify == NULL ||
+        (! amP->subscribed &&
+         InterlockedCompareExchange(&amP->pending, 0, 0) > 0))
+        AdaptCacheNotify(amP->cacheP, 0);
+    return amP;
+}
+
+static void TwapiAdapterMonitorDelete(TwapiAdapterMonitor *amP)
+{
+    /* Cancellation waits for callbacks in progress to return */
+    if (amP->interface_notify)
+        CancelMibChangeNotify2(amP->interface_notify);
+    if (amP->address_notify)
+        CancelMibChangeNotify2(amP->address_notify);
+    AdaptCacheDelete(amP->cacheP);
+    TwapiFree(amP);
+}
+
+/* Twapi_AdapterCacheList - returns the records of all adapters */
+static int Twapi_AdapterCacheListObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    Tcl_Obj *listObj;
+
+    if (objc != 1)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    if (AdaptCacheList(TwapiAdapterMonitorQuery(ticP)->cacheP, interp,
+                       &listObj) != TCL_OK)
+        return TCL_ERROR;
+    return ObjSetResult(interp, listObj);
+}
+
+/*
+ * Twapi_AdapterCacheLookup ADAPTER - returns the record of the adapter
+ * with the given name or interface index, or an empty list
+ */
+static int Twapi_AdapterCacheLookupObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    Tcl_Obj *recObj;
+
+    if (objc != 2)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    if (AdaptCacheLookup(TwapiAdapterMonitorQuery(ticP)->cacheP, interp,
+                         objv[1], &recObj) != TCL_OK)
+        return TCL_ERROR;
+    if (recObj)
+        ObjSetResult(interp, recObj);
+    return TCL_OK;
+}
+
+/*
+ * Twapi_AdapterCacheSubscribe BOOLEAN - controls whether changes are
+ * passed to twapi::_adapter_change_handler as they are notified.
+ */
+static int Twapi_AdapterCacheSubscribeObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiAdapterMonitor *amP;
+    int subscribe;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1, GETBOOL(subscribe),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    amP = TwapiAdapterMonitorGet(ticP);
+    if (subscribe && (amP->interface_notify == NULL ||
+                      amP->address_notify == NULL))
+        return TwapiReturnErrorMsg(interp, TWAPI_SYSTEM_ERROR,
+                                   "Adapter change notifications not available.");
+    /* Take the initial snapshot now so later changes can be reported */
+    if (subscribe && AdaptCacheRefresh(amP->cacheP, interp, NULL) != TCL_OK)
+        return TCL_ERROR;
+    amP->subscribed = subscribe;
+    return TCL_OK;
+}
+
 
 
 int Twapi_GetPerAdapterInfo(TwapiInterpContext *ticP, int adapter_index)
@@ -1350,6 +1586,213 @@ int Twapi_GetExtendedUdpTable(
     }
 }
 
+/*
+ * Connection trackers. The tracker owns the table buffer so polls
+ * allocate nothing once the table size has stabilized, and only the
+ * connections reported by the diff are converted to Tcl values.
+ */
+typedef struct TwapiConnTracker {
+    ConnTrack ct;
+    int udp;                    /* UDP table if non-0, else TCP */
+    int family;                 /* AF_INET, AF_INET6 or AF_UNSPEC for both */
+    void *bufP;                 /* Table buffer, reused across polls */
+    DWORD buf_sz;
+} TwapiConnTracker;
+
+static void TwapiConnTrackerFree(TwapiConnTracker *trackerP)
+{
+    ConnTrackFinit(&trackerP->ct);
+    if (trackerP->bufP)
+        TwapiFree(trackerP->bufP);
+    TwapiFree(trackerP);
+}
+
+/* Reads the table for one address family into the tracker snapshot */
+static DWORD TwapiConnTrackerLoad(TwapiConnTracker *trackerP, ULONG family)
+{
+    DWORD error, sz, nrows;
+    void *rowsP;
+    int i, format;
+    size_t rowsize;
+
+    /* Table size may change between calls so retry a few times */
+    for (i = 0; i < 10; ++i) {
+        sz = trackerP->buf_sz;
+        if (trackerP->udp)
+            error = GetExtendedUdpTable(trackerP->bufP, &sz, FALSE, family,
+                                        1, /* UDP_TABLE_OWNER_PID */
+                                        0);
+        else
+            error = GetExtendedTcpTable(trackerP->bufP, &sz, FALSE, family,
+                                        5, /* TCP_TABLE_OWNER_PID_ALL */
+                                        0);
+        if (error != ERROR_INSUFFICIENT_BUFFER)
+            break;
+        if (trackerP->bufP)
+            TwapiFree(trackerP->bufP);
+        sz += sz / 8;           /* Room for new connections */
+        trackerP->bufP = TwapiAlloc(sz);
+        trackerP->buf_sz = sz;
+    }
+    if (error != NO_ERROR)
+        return error;
+
+    if (trackerP->udp) {
+        if (family == AF_INET) {
+            MIB_UDPTABLE_OWNER_PID *tabP = trackerP->bufP;
+            nrows = tabP->dwNumEntries;
+            rowsP = tabP->table;
+            rowsize = sizeof(tabP->table[0]);
+            format = CONNTRACK_UDP4;
+        } else {
+            MIB_UDP6TABLE_OWNER_PID *tabP = trackerP->bufP;
+            nrows = tabP->dwNumEntries;
+            rowsP = tabP->table;
+            rowsize = sizeof(tabP->table[0]);
+            format = CONNTRACK_UDP6;
+        }
+    } else {
+        if (family == AF_INET) {
+            MIB_TCPTABLE_OWNER_PID *tabP = trackerP->bufP;
+            nrows = tabP->dwNumEntries;
+            rowsP = tabP->table;
+            rowsize = sizeof(tabP->table[0]);
+            format = CONNTRACK_TCP4;
+        } else {
+            MIB_TCP6TABLE_OWNER_PID *tabP = trackerP->bufP;
+            nrows = tabP->dwNumEntries;
+            rowsP = tabP->table;
+            rowsize = sizeof(tabP->table[0]);
+            format = CONNTRACK_TCP6;
+        }
+    }
+    /* CONNTRACK_E_NOMEM is ERROR_NOT_ENOUGH_MEMORY */
+    return ConnTrackAddRows(&trackerP->ct, format, rowsP, nrows, rowsize);
+}
+
+static Tcl_Obj *ObjFromConnTrackAddr(const ConnTrackKey *keyP, int local)
+{
+    DWORD dw;
+    if (keyP->family == 4) {
+        CopyMemory(&dw, local ? keyP->laddr : keyP->raddr, sizeof(dw));
+        return IPAddrObjFromDWORD(dw);
+    }
+    if (local)
+        return ObjFromIPv6Addr(keyP->laddr, CONNTRACK_U32(keyP->lscope));
+    else
+        return ObjFromIPv6Addr(keyP->raddr, CONNTRACK_U32(keyP->rscope));
+}
+
+/*
+ * Twapi_ConnTrackerCreate tcp|udp FAMILY PID LOCALPORT REMOTEPORT STATEMASK
+ * Negative PID and ports and a 0 STATEMASK match all connections.
+ */
+static int Twapi_ConnTrackerCreateObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiConnTracker *trackerP;
+    ConnTrackFilter filter;
+    char *proto;
+    int family, pid, lport, rport;
+    DWORD states;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETASTR(proto), GETINT(family), GETINT(pid),
+                     GETINT(lport), GETINT(rport), GETDWORD(states),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    if ((strcmp(proto, "tcp") && strcmp(proto, "udp")) ||
+        (family != AF_UNSPEC && family != AF_INET && family != AF_INET6))
+        return TwapiReturnError(interp, TWAPI_INVALID_ARGS);
+
+    filter.pid = pid;
+    filter.lport = lport;
+    filter.rport = rport;
+    filter.states = states;
+    trackerP = TwapiAlloc(sizeof(*trackerP));
+    ConnTrackInit(&trackerP->ct, &filter);
+    trackerP->udp = proto[0] == 'u';
+    trackerP->family = family;
+    trackerP->bufP = NULL;
+    trackerP->buf_sz = 0;
+    if (TwapiRegisterPointerTic(ticP, trackerP, TwapiConnTrackerFree) != TCL_OK) {
+        TwapiConnTrackerFree(trackerP);
+        return TCL_ERROR;
+    }
+    return ObjSetResult(interp, ObjFromOpaque(trackerP, "TwapiConnTracker*"));
+}
+
+/*
+ * Twapi_ConnTrackerPoll TRACKER
+ * Returns the connections opened, closed or changed since the last poll
+ * as a list of records. TCP records are
+ *   {EVENT STATE OLDSTATE LOCALADDR LOCALPORT REMOTEADDR REMOTEPORT PID}
+ * and UDP records {EVENT LOCALADDR LOCALPORT PID}.
+ */
+static int Twapi_ConnTrackerPollObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiConnTracker *trackerP;
+    static const char *events[] = {"opened", "closed", "changed"};
+    Tcl_Obj *objs[8];
+    Tcl_Obj *resultObj;
+    DWORD error = NO_ERROR;
+    size_t i;
+    int n;
+
+    if (TwapiGetArgsEx(ticP, objc-1, objv+1,
+                       GETVERIFIEDPTR(trackerP, TwapiConnTracker*, TwapiConnTrackerFree),
+                       ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    ConnTrackBegin(&trackerP->ct);
+    if (trackerP->family != AF_INET6)
+        error = TwapiConnTrackerLoad(trackerP, AF_INET);
+    if (error == NO_ERROR && trackerP->family != AF_INET)
+        error = TwapiConnTrackerLoad(trackerP, AF_INET6);
+    if (error == NO_ERROR)
+        error = ConnTrackDiff(&trackerP->ct);
+    if (error != NO_ERROR)
+        return Twapi_AppendSystemError(interp, error);
+
+    resultObj = ObjEmptyList();
+    for (i = 0; i < trackerP->ct.nevents; ++i) {
+        const ConnTrackEvent *evP = &trackerP->ct.events[i];
+        const ConnTrackKey *keyP = &evP->entryP->key;
+        n = 0;
+        objs[n++] = ObjFromString(events[evP->type]);
+        if (! trackerP->udp) {
+            objs[n++] = ObjFromDWORD(evP->entryP->state);
+            objs[n++] = evP->type == CONNTRACK_CHANGED ?
+                ObjFromDWORD(evP->old_state) : ObjFromEmptyString();
+        }
+        objs[n++] = ObjFromConnTrackAddr(keyP, 1);
+        objs[n++] = ObjFromInt(CONNTRACK_U16(keyP->lport));
+        if (! trackerP->udp) {
+            objs[n++] = ObjFromConnTrackAddr(keyP, 0);
+            objs[n++] = ObjFromInt(CONNTRACK_U16(keyP->rport));
+        }
+        objs[n++] = ObjFromDWORD(CONNTRACK_U32(keyP->pid));
+        ObjAppendElement(NULL, resultObj, ObjNewList(n, objs));
+    }
+    return ObjSetResult(interp, resultObj);
+}
+
+static int Twapi_ConnTrackerCloseObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiConnTracker *trackerP;
+
+    if (TwapiGetArgsEx(ticP, objc-1, objv+1,
+                       GETVERIFIEDPTR(trackerP, TwapiConnTracker*, TwapiConnTrackerFree),
+                       ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    if (TwapiUnregisterPointerTic(ticP, trackerP, TwapiConnTrackerFree) != TCL_OK)
+        return TCL_ERROR;
+    TwapiConnTrackerFree(trackerP);
+    return TCL_OK;
+}
+
 static int Twapi_GetNameInfoObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
     int status;
@@ -1494,24 +1937,185 @@ static int Twapi_GetBestInterfaceObjCmd(ClientData clientdata, Tcl_Interp *inter
 
 
 
-/* Called from the Tcl event loop with the result of a hostname lookup */
-static int TwapiHostnameEventProc(Tcl_Event *tclevP, int flags)
+/*
+ * Asynchronous name resolution. Requests from all interpreters go through
+ * a single resolver with a bounded pool of worker threads and a cache
+ * (see nameres.h). Results are delivered to the requesting interpreter
+ * as Tcl events.
+ */
+#define TWAPI_NAMERES_MAX_WORKERS   8
+#define TWAPI_NAMERES_POSITIVE_TTL  60000 /* getaddrinfo does not return
+                                             record TTLs so use a fixed one */
+#define TWAPI_NAMERES_NEGATIVE_TTL  10000
+#define TWAPI_NAMERES_MAX_ENTRIES   4096
+#define TWAPI_NAMERES_IDLE_TIMEOUT  30000
+
+static TwapiOneTimeInitState gTwapiNameResInitialized;
+static NameRes *gTwapiNameResP;
+
+/*
+ * Lookup procedure for the resolver, called from its worker threads. As
+ * Tcl_Objs cannot be passed between threads, results are returned as
+ * strings. Host name lookups return a list of {family address port}
+ * elements in the same form as TwapiCollectAddrInfo. Address lookups
+ * return the host name or an empty string if the address has no name.
+ */
+static int TwapiNameResLookup(void *ctx, int kind, int family,
+                              const char *query, char **resultP)
+{
+    Tcl_DString ds;
+    int status;
+    char buf[NI_MAXHOST];
+
+    if (kind == NAMERES_HOSTNAME) {
+        struct addrinfo hints;
+        struct addrinfo *addrlistP, *addrP;
+
+        /*
+         * AI_ALL because by default Windows enables AI_ADDRCONFIG which
+         * hides IPv6 addresses if the local system does not have a
+         * *global* IPv6 addr configured.
+         */
+        TwapiZeroMemory(&hints, sizeof(hints));
+        hints.ai_family = family;
+        hints.ai_flags = AI_ALL;
+        status = getaddrinfo(query, "0", &hints, &addrlistP);
+        if (status != 0)
+            return status;
+        Tcl_DStringInit(&ds);
+        for (addrP = addrlistP; addrP; addrP = addrP->ai_next) {
+            SOCKADDR *saddrP = addrP->ai_addr;
+            DWORD bufsz = ARRAYSIZE(buf);
+            if (saddrP == NULL ||
+                (family != AF_UNSPEC && family != addrP->ai_family))
+                continue;
+            if (! ((addrP->ai_family == PF_INET &&
+                    addrP->ai_addrlen == sizeof(SOCKADDR_IN) &&
+                    saddrP->sa_family == AF_INET)
+                   ||
+                   (addrP->ai_family == PF_INET6 &&
+                    addrP->ai_addrlen == sizeof(SOCKADDR_IN6) &&
+                    saddrP->sa_family == AF_INET6)))
+                continue;
+            /* Port is always 0 as service "0" was passed */
+            if (WSAAddressToStringA(saddrP, (DWORD) addrP->ai_addrlen, NULL,
+                                    buf, &bufsz) != 0)
+                continue;
+            Tcl_DStringStartSublist(&ds);
+            Tcl_DStringAppendElement(&ds,
+                                     saddrP->sa_family == AF_INET6 ? "23" : "2");
+            Tcl_DStringAppendElement(&ds, buf);
+            Tcl_DStringAppendElement(&ds, "0");
+            Tcl_DStringEndSublist(&ds);
+        }
+        freeaddrinfo(addrlistP);
+    } else {
+        SOCKADDR_STORAGE ss;
+        char portname[NI_MAXSERV];
+
+        /*
+         * As a special case, 0.0.0.0 is returned as is since getnameinfo
+         * translates it to the local host name which is completely bogus.
+         */
+        if (lstrcmpA(query, "0.0.0.0") == 0) {
+            *resultP = ckalloc(sizeof("0.0.0.0"));
+            lstrcpyA(*resultP, "0.0.0.0");
+            return 0;
+        }
+        if (TwapiStringToSOCKADDR_STORAGE((char *) query, &ss, family) == AF_UNSPEC)
+            return 10022;         /* WSAEINVAL - invalid address string */
+        status = getnameinfo((struct sockaddr *)&ss,
+                             ss.ss_family == AF_INET6 ? sizeof(SOCKADDR_IN6) : sizeof(SOCKADDR_IN),
+                             buf, ARRAYSIZE(buf),
+                             portname, ARRAYSIZE(portname),
+                             NI_NUMERICSERV);
+        if (status != 0)
+            return status;
+        /* If the function just returned back the address, then there
+           was really no name found so return empty string */
+        if (lstrcmpA(query, buf) == 0)
+            return 0;
+        Tcl_DStringInit(&ds);
+        Tcl_DStringAppend(&ds, buf, -1);
+    }
+
+    if (Tcl_DStringLength(&ds)) {
+        *resultP = ckalloc(Tcl_DStringLength(&ds) + 1);
+        CopyMemory(*resultP, Tcl_DStringValue(&ds), Tcl_DStringLength(&ds) + 1);
+    }
+    Tcl_DStringFree(&ds);
+    return 0;
+}
+
+/*
+ * Deletes the resolver at process exit. This waits for lookups in
+ * progress and completes queued ones as cancelled. It is an exit handler
+ * of this module, rather than part of Twapi_Cleanup, as the network
+ * module may be a separate DLL. Handlers run in reverse order of
+ * registration so this runs before Twapi_Cleanup calls WSACleanup.
+ */
+static void TwapiNameResCleanup(ClientData unused)
+{
+    if (gTwapiNameResP) {
+        NameResDelete(gTwapiNameResP);
+        gTwapiNameResP = NULL;
+    }
+}
+
+static int TwapiNameResInit(void *unused)
+{
+    NameResConfig config;
+
+    config.lookup = TwapiNameResLookup;
+    config.batch_lookup = NULL;
+    config.lookup_ctx = NULL;
+    config.max_batch = 1;
+    config.max_workers = TWAPI_NAMERES_MAX_WORKERS;
+    config.positive_ttl = TWAPI_NAMERES_POSITIVE_TTL;
+    config.negative_ttl = TWAPI_NAMERES_NEGATIVE_TTL;
+    config.max_entries = TWAPI_NAMERES_MAX_ENTRIES;
+    config.idle_timeout = TWAPI_NAMERES_IDLE_TIMEOUT;
+    gTwapiNameResP = NameResNew(&config);
+    Tcl_CreateExitHandler(TwapiNameResCleanup, NULL);
+    return TCL_OK;
+}
+
+static NameRes *TwapiNameRes(void)
+{
+    if (! TwapiDoOneTimeInit(&gTwapiNameResInitialized, TwapiNameResInit, NULL))
+        return NULL;
+    return gTwapiNameResP;
+}
+
+/* Called from the Tcl event loop with the result of a lookup */
+static int TwapiResolveEventProc(Tcl_Event *tclevP, int flags)
 {
     TwapiHostnameEvent *theP = (TwapiHostnameEvent *) tclevP;
 
     if (theP->ticP->interp != NULL &&
         ! Tcl_InterpDeleted(theP->ticP->interp)) {
-        /* Invoke the script */
         Tcl_Interp *interp = theP->ticP->interp;
         Tcl_Obj *objP = ObjEmptyList();
 
-        ObjAppendElement(
-            interp, objP, STRING_LITERAL_OBJ(TWAPI_TCL_NAMESPACE "::_hostname_resolve_handler"));
-        ObjAppendElement(interp, objP, ObjFromTwapiId(theP->id));
+        if (theP->batch) {
+            ObjAppendElement(
+                interp, objP, STRING_LITERAL_OBJ(TWAPI_TCL_NAMESPACE "::_resolve_batch_handler"));
+            ObjAppendElement(interp, objP, ObjFromTwapiId(theP->id));
+            ObjAppendElement(interp, objP, ObjFromString(theP->name));
+        } else {
+            ObjAppendElement(
+                interp, objP,
+                theP->kind == NAMERES_HOSTNAME ?
+                STRING_LITERAL_OBJ(TWAPI_TCL_NAMESPACE "::_hostname_resolve_handler") :
+                STRING_LITERAL_OBJ(TWAPI_TCL_NAMESPACE "::_address_resolve_handler"));
+            ObjAppendElement(interp, objP, ObjFromTwapiId(theP->id));
+        }
         if (theP->status == ERROR_SUCCESS) {
-            /* Success */
+            /* Success. Note theP->result may be NULL */
             ObjAppendElement(interp, objP, STRING_LITERAL_OBJ("success"));
-            ObjAppendElement(interp, objP, TwapiCollectAddrInfo(theP->addrinfolist, theP->family));
+            ObjAppendElement(
+                interp, objP,
+                ObjFromString((theP->result ? theP->result : "")));
         } else {
             /* Failure */
             ObjAppendElement(interp, objP, STRING_LITERAL_OBJ("fail"));
@@ -1527,155 +2131,107 @@ static int TwapiHostnameEventProc(Tcl_Event *tclevP, int flags)
 
     /* Done with the interp context */
     TwapiInterpContextUnref(theP->ticP, 1);
-
-    /* Assumes we can free this from different thread than allocated it ! */
-    if (theP->addrinfolist)
-        freeaddrinfo(theP->addrinfolist);
+    if (theP->result)
+        ckfree(theP->result);
 
     return 1;                   /* So Tcl removes from queue */
 }
 
-
-/* Called from the Win2000 thread pool */
-static DWORD WINAPI TwapiHostnameHandler(void *arg)
+/*
+ * Called by the resolver when a lookup completes, from a worker thread
+ * or from the requesting thread if the result was cached.
+ */
+static void TwapiResolveDone(void *client, int status, const char *result,
+                             int cached)
 {
-    TwapiHostnameEvent *theP = arg;
-    struct addrinfo hints;
+    TwapiHostnameEvent *theP = client;
+    size_t len;
 
-    TwapiZeroMemory(&hints, sizeof(hints));
-    hints.ai_family = theP->family;
-    hints.ai_flags = theP->ai_flags;
-    theP->tcl_ev.proc = TwapiHostnameEventProc;
-    theP->status = getaddrinfo(theP->name, "0", &hints, &theP->addrinfolist);
+    theP->status = status;
+    len = lstrlenA(result);
+    if (status == 0 && len) {
+        theP->result = ckalloc((int) len + 1);
+        CopyMemory(theP->result, result, len + 1);
+    }
     TwapiEnqueueTclEvent(theP->ticP, &theP->tcl_ev);
-    return 0;               /* Return value does not matter */
 }
 
-
-static int Twapi_ResolveHostnameAsyncObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+/*
+ * Allocates the event that delivers a lookup result to the handler for
+ * kind or, if batch is set, to _resolve_batch_handler.
+ */
+static TwapiHostnameEvent *TwapiResolveEventNew(
+    TwapiInterpContext *ticP, TwapiId id, int batch, int kind,
+    const char *name, Tcl_Size len)
 {
-    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
-    TwapiId id;
-    char *name;
-    Tcl_Size len;
     TwapiHostnameEvent *theP;
-    DWORD winerr;
-    int family;
-    int hint_flags;
 
-    RETURN_ERROR_IF_UNTHREADED(ticP->interp);
-
-    if (TwapiGetArgs(ticP->interp, objc-1, objv+1,
-                     GETASTRN(name, len), ARGUSEDEFAULT, GETINT(family),
-                     ARGUSEDEFAULT, GETINT(hint_flags),
-                     ARGEND) != TCL_OK)
-        return TCL_ERROR;
-
-    id =  TWAPI_NEWID(ticP);
     /* Allocate the callback context, must be allocated via ckalloc
      * as it will be passed to Tcl_QueueEvent.
      */
     theP = (TwapiHostnameEvent *) ckalloc(SIZE_TwapiHostnameEvent(len));
-    theP->tcl_ev.proc = NULL;
+    theP->tcl_ev.proc = TwapiResolveEventProc;
     theP->tcl_ev.nextPtr = NULL;
     theP->id = id;
     theP->status = ERROR_SUCCESS;
     theP->ticP = ticP;
     TwapiInterpContextRef(ticP, 1); /* So it does not go away */
-    theP->addrinfolist = NULL;
-    theP->family = family;
-    theP->ai_flags = hint_flags;
+    theP->result = NULL;
+    theP->kind = kind;
+    theP->batch = batch;
     CopyMemory(theP->name, name, len+1);
-
-    if (QueueUserWorkItem(TwapiHostnameHandler, theP, WT_EXECUTEDEFAULT)) {
-        ObjSetResult(ticP->interp, ObjFromTwapiId(id));
-        return TCL_OK;
-    }
-
-    winerr = GetLastError();    /* Remember the error */
-
-    TwapiInterpContextUnref(ticP, 1); /* Undo above ref */
-    Tcl_Free((char*) theP);
-    return Twapi_AppendSystemError(ticP->interp, winerr);
+    return theP;
 }
 
+/* Frees an event that was never queued */
+static void TwapiResolveEventFree(TwapiHostnameEvent *theP)
+{
+    TwapiInterpContextUnref(theP->ticP, 1);
+    ckfree((char*) theP);
+}
 
-/* Called from the Tcl event loop with the result of a address lookup */
-static int TwapiAddressEventProc(Tcl_Event *tclevP, int flags)
+/* Submits a lookup to the resolver. See TwapiResolveEventNew. */
+static int TwapiResolveSubmit(TwapiInterpContext *ticP, TwapiId id, int batch,
+                              int kind, int family, const char *name,
+                              Tcl_Size len)
 {
-    TwapiHostnameEvent *theP = (TwapiHostnameEvent *) tclevP;
+    NameRes *nrP;
+    TwapiHostnameEvent *theP;
+    int status;
 
-    if (theP->ticP->interp != NULL &&
-        ! Tcl_InterpDeleted(theP->ticP->interp)) {
-        /* Invoke the script */
-        Tcl_Interp *interp = theP->ticP->interp;
-        Tcl_Obj *objP = ObjEmptyList();
+    nrP = TwapiNameRes();
+    if (nrP == NULL)
+        return TwapiReturnError(ticP->interp, TWAPI_SYSTEM_ERROR);
 
-        ObjAppendElement(
-            interp, objP, STRING_LITERAL_OBJ(TWAPI_TCL_NAMESPACE "::_address_resolve_handler"));
-        ObjAppendElement(interp, objP, ObjFromTwapiId(theP->id));
-        if (theP->status == ERROR_SUCCESS) {
-            /* Success. Note theP->hostname may still be NULL */
-            ObjAppendElement(interp, objP, STRING_LITERAL_OBJ("success"));
-            ObjAppendElement(
-                interp, objP,
-                ObjFromString((theP->hostname ? theP->hostname : "")));
-        } else {
-            /* Failure */
-            ObjAppendElement(interp, objP, STRING_LITERAL_OBJ("fail"));
-            ObjAppendElement(interp, objP,
-                                     ObjFromLong(theP->status));
-        }
-        /* Invoke the script */
-        /* Do we need TclSave/RestoreResult ? */
-        ObjIncrRefs(objP);
-        (void) Tcl_EvalObjEx(interp, objP, TCL_EVAL_DIRECT|TCL_EVAL_GLOBAL);
-        ObjDecrRefs(objP);
-        /* TBD - check for error and add to background ? */
-    }
-    
-    /* Done with the interp context */
-    TwapiInterpContextUnref(theP->ticP, 1);
-    if (theP->hostname)
-        TwapiFree(theP->hostname);
-    
-    return 1;                   /* So Tcl removes from queue */
-}
+    theP = TwapiResolveEventNew(ticP, id, batch, kind, name, len);
+    status = NameResSubmit(nrP, kind, family, theP->name, TwapiResolveDone, theP);
+    if (status == 0)
+        return TCL_OK;
 
+    TwapiResolveEventFree(theP);
+    return Twapi_AppendSystemError(ticP->interp, status);
+}
 
-/* Called from the Win2000 thread pool */
-static DWORD WINAPI TwapiAddressHandler(void *arg)
+static int Twapi_ResolveHostnameAsyncObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
-    TwapiHostnameEvent *theP = arg;
-    SOCKADDR_STORAGE ss;
-    char hostname[NI_MAXHOST];
-    char portname[NI_MAXSERV];
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiId id;
+    char *name;
+    Tcl_Size len;
     int family;
 
-    theP->tcl_ev.proc = TwapiAddressEventProc;
-    family = TwapiStringToSOCKADDR_STORAGE(theP->name, &ss, theP->family);
-    if (family == AF_UNSPEC) {
-        // Fail, invalid address string
-        theP->status = 10022;         /* WSAINVAL error code */
-    } else {    
-        theP->status = getnameinfo((struct sockaddr *)&ss,
-                                   ss.ss_family == AF_INET6 ? sizeof(SOCKADDR_IN6) : sizeof(SOCKADDR_IN),
-                                   hostname, sizeof(hostname)/sizeof(hostname[0]),
-                                   portname, sizeof(portname)/sizeof(portname[0]),
-                                   NI_NUMERICSERV);
-    }
-    if (theP->status == 0) {
-        /* If the function just returned back the address, then there
-           was really no name found so return empty string (NULL) */
-        theP->hostname = NULL;
-        if (lstrcmpA(theP->name, hostname)) {
-            /* Really do have a name */
-            theP->hostname = TwapiAllocAString(hostname, -1);
-        }
-    }
+    RETURN_ERROR_IF_UNTHREADED(ticP->interp);
 
-    TwapiEnqueueTclEvent(theP->ticP, &theP->tcl_ev);
-    return 0;                   /* Return value ignored anyways */
+    if (TwapiGetArgs(ticP->interp, objc-1, objv+1,
+                     GETASTRN(name, len), ARGUSEDEFAULT, GETINT(family),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    id =  TWAPI_NEWID(ticP);
+    if (TwapiResolveSubmit(ticP, id, 0, NAMERES_HOSTNAME, family, name, len) != TCL_OK)
+        return TCL_ERROR;
+    ObjSetResult(ticP->interp, ObjFromTwapiId(id));
+    return TCL_OK;
 }
 
 static int Twapi_ResolveAddressAsyncObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
@@ -1684,8 +2240,6 @@ static int Twapi_ResolveAddressAsyncObjCmd(ClientData clientdata, Tcl_Interp *in
     TwapiId id;
     char *addrstr;
     Tcl_Size len;
-    TwapiHostnameEvent *theP;
-    DWORD winerr;
     int family;
 
     RETURN_ERROR_IF_UNTHREADED(ticP->interp);
@@ -1695,37 +2249,133 @@ static int Twapi_ResolveAddressAsyncObjCmd(ClientData clientdata, Tcl_Interp *in
                      ARGEND) != TCL_OK)
         return TCL_ERROR;
 
+    /* We do not syntactically validate address string here. All failures
+       are delivered asynchronously */
     id =  TWAPI_NEWID(ticP);
+    if (TwapiResolveSubmit(ticP, id, 0, NAMERES_ADDRESS, family, addrstr, len) != TCL_OK)
+        return TCL_ERROR;
+    ObjSetResult(ticP->interp, ObjFromTwapiId(id));
+    return TCL_OK;
+}
 
-    /* Allocate the callback context, must be allocated via ckalloc
-     * as it will be passed to Tcl_QueueEvent.
-     */
-    theP = (TwapiHostnameEvent *) ckalloc(SIZE_TwapiHostnameEvent(len));
-    theP->tcl_ev.proc = NULL;
-    theP->tcl_ev.nextPtr = NULL;
-    theP->id = id;
-    theP->status = ERROR_SUCCESS;
-    theP->ticP = ticP;
-    TwapiInterpContextRef(ticP, 1); /* So it does not go away */
-    theP->hostname = NULL;
-    theP->family = family;
-    theP->ai_flags = 0;
+/*
+ * Twapi_ResolveBatchAsync KIND NAMES ?FAMILY?
+ * Submits a lookup for every element of NAMES. Results are passed to
+ * _resolve_batch_handler, in order of completion, under a single id.
+ * Submitted lookups cannot be withdrawn, so if a submission fails after
+ * others have succeeded, that name and the remaining ones are delivered
+ * to the handler as failures and the id is still returned. Every name
+ * thus gets exactly one result. An error is only returned if nothing
+ * was submitted.
+ */
+static int Twapi_ResolveBatchAsyncObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiId id;
+    Tcl_Obj *namesObj;
+    Tcl_Obj **namesv;
+    Tcl_Size i, nnames;
+    int kind, family, status;
+    NameRes *nrP;
 
-    /* We do not syntactically validate address string here. All failures
-       are delivered asynchronously */
-    CopyMemory(theP->name, addrstr, len+1);
+    RETURN_ERROR_IF_UNTHREADED(ticP->interp);
 
-    if (QueueUserWorkItem(TwapiAddressHandler, theP, WT_EXECUTEDEFAULT)) {
-        ObjSetResult(ticP->interp, ObjFromTwapiId(id));
-        return TCL_OK;
+    if (TwapiGetArgs(ticP->interp, objc-1, objv+1,
+                     GETINT(kind), GETOBJ(namesObj),
+                     ARGUSEDEFAULT, GETINT(family),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    if (kind != NAMERES_HOSTNAME && kind != NAMERES_ADDRESS)
+        return TwapiReturnError(interp, TWAPI_INVALID_ARGS);
+    if (ObjGetElements(interp, namesObj, &nnames, &namesv) != TCL_OK)
+        return TCL_ERROR;
+
+    nrP = TwapiNameRes();
+    if (nrP == NULL)
+        return TwapiReturnError(interp, TWAPI_SYSTEM_ERROR);
+
+    id =  TWAPI_NEWID(ticP);
+    status = 0;
+    for (i = 0; i < nnames; ++i) {
+        TwapiHostnameEvent *theP;
+        Tcl_Size len;
+        char *name = ObjToStringN(namesv[i], &len);
+
+        theP = TwapiResolveEventNew(ticP, id, 1, kind, name, len);
+        if (status == 0) {
+            status = NameResSubmit(nrP, kind, family, theP->name,
+                                   TwapiResolveDone, theP);
+            if (status == 0)
+                continue;
+            if (i == 0) {
+                TwapiResolveEventFree(theP);
+                return Twapi_AppendSystemError(interp, status);
+            }
+        }
+        /* Earlier lookups are in flight, report this one as failed */
+        TwapiResolveDone(theP, status, "", 0);
     }
-    winerr = GetLastError();    /* Remember the error */
+    ObjSetResult(ticP->interp, ObjFromTwapiId(id));
+    return TCL_OK;
+}
 
-    TwapiInterpContextUnref(ticP, 1); /* Undo above ref */
-    Tcl_Free((char*) theP);
-    return Twapi_AppendSystemError(ticP->interp, winerr);
+/* Twapi_ResolverForget KIND NAME ?FAMILY? - discards a cached result */
+static int Twapi_ResolverForgetObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    NameRes *nrP;
+    char *name;
+    int kind, family;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETINT(kind), GETASTR(name),
+                     ARGUSEDEFAULT, GETINT(family),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    nrP = TwapiNameRes();
+    if (nrP == NULL)
+        return TwapiReturnError(interp, TWAPI_SYSTEM_ERROR);
+    NameResForget(nrP, kind, family, name);
+    return TCL_OK;
 }
 
+/*
+ * cidr_match CIDRS ADDRESS - returns the longest prefix in CIDRS
+ * containing ADDRESS, in canonical form, or an empty string
+ */
+static int Twapi_CidrMatchObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    IpSet *setP;
+    IpAddr addr, prefix;
+    int prefixlen;
+    char buf[IPADDR_MAXSTR];
+
+    if (objc != 3)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    if (IpAddrFromObj(interp, objv[2], &addr) != TCL_OK)
+        return TCL_ERROR;
+    setP = IpSetFromObj(interp, objv[1]);
+    if (setP == NULL)
+        return TCL_ERROR;
+    if (IpSetMatchPrefix(setP, &addr, &prefix, &prefixlen) >= 0) {
+        IpAddrFormat(&prefix, buf);
+        ObjSetResult(interp, Tcl_ObjPrintf("%s/%d", buf, prefixlen));
+    }
+    IpSetUnref(setP);
+    return TCL_OK;
+}
+
+/* normalize_ipaddr ADDRESS - returns ADDRESS in canonical form */
+static int Twapi_NormalizeIpAddrObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    IpAddr addr;
+
+    if (objc != 2)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    if (IpAddrFromObj(interp, objv[1], &addr) != TCL_OK)
+        return TCL_ERROR;
+    ObjSetResult(interp, IpAddrNewObj(&addr));
+    return TCL_OK;
+}
 
 static int Twapi_NetworkCallObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
@@ -1874,10 +2524,20 @@ static int TwapiNetworkInitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
         DEFINE_TCL_CMD(NetCall, Twapi_NetworkCallObjCmd),
         DEFINE_TCL_CMD(Twapi_ResolveAddressAsync,  Twapi_ResolveAddressAsyncObjCmd),
         DEFINE_TCL_CMD(Twapi_ResolveHostnameAsync,  Twapi_ResolveHostnameAsyncObjCmd),
+        DEFINE_TCL_CMD(Twapi_ResolveBatchAsync,  Twapi_ResolveBatchAsyncObjCmd),
+        DEFINE_TCL_CMD(Twapi_ResolverForget,  Twapi_ResolverForgetObjCmd),
         DEFINE_TCL_CMD(getaddrinfo,  Twapi_GetAddrInfoObjCmd),
         DEFINE_TCL_CMD(getnameinfo,  Twapi_GetNameInfoObjCmd),
         DEFINE_TCL_CMD(GetBestRoute, Twapi_GetBestRouteObjCmd),
         DEFINE_TCL_CMD(GetBestInterfaceEx, Twapi_GetBestInterfaceObjCmd),
+        DEFINE_TCL_CMD(Twapi_ConnTrackerCreate, Twapi_ConnTrackerCreateObjCmd),
+        DEFINE_TCL_CMD(Twapi_ConnTrackerPoll, Twapi_ConnTrackerPollObjCmd),
+        DEFINE_TCL_CMD(Twapi_ConnTrackerClose, Twapi_ConnTrackerCloseObjCmd),
+        DEFINE_TCL_CMD(cidr_match, Twapi_CidrMatchObjCmd),
+        DEFINE_TCL_CMD(normalize_ipaddr, Twapi_NormalizeIpAddrObjCmd),
+        DEFINE_TCL_CMD(Twapi_AdapterCacheList, Twapi_AdapterCacheListObjCmd),
+        DEFINE_TCL_CMD(Twapi_AdapterCacheLookup, Twapi_AdapterCacheLookupObjCmd),
+        DEFINE_TCL_CMD(Twapi_AdapterCacheSubscribe, Twapi_AdapterCacheSubscribeObjCmd),
     };
 
     static struct alias_dispatch_s NetDispatch[] = {
@@ -1906,6 +2566,15 @@ static int TwapiNetworkInitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
     return TCL_OK;
 }
 
+static void TwapiNetworkCleanup(TwapiInterpContext *ticP)
+{
+    TwapiAdapterMonitor *amP = (TwapiAdapterMonitor *) ticP->module.data.pval;
+    if (amP) {
+        ticP->module.data.pval = NULL; /* Queued callbacks check this */
+        TwapiAdapterMonitorDelete(amP);
+    }
+}
+
 #ifndef TWAPI_SINGLE_MODULE
 BOOL WINAPI DllMain(HINSTANCE hmod, DWORD reason, PVOID unused)
 {
@@ -1924,7 +2593,7 @@ int Twapi_network_Init(Tcl_Interp *interp)
     static TwapiModuleDef gModuleDef = {
         MODULENAME,
         TwapiNetworkInitCalls,
-        NULL
+        TwapiNetworkCleanup
     };
     /* IMPORTANT */
     /* MUST BE FIRST CALL as it initializes Tcl stubs - should this be the
@@ -1934,6 +2603,7 @@ int Twapi_network_Init(Tcl_Interp *interp)
         return TCL_ERROR;
     }
 
-    return TwapiRegisterModule(interp, MODULE_HANDLE, &gModuleDef, DEFAULT_TIC) ? TCL_OK : TCL_ERROR;
+    /* Private context as the adapter monitor uses ticP->module.data */
+    return TwapiRegisterModule(interp, MODULE_HANDLE, &gModuleDef, NEW_TIC) ? TCL_OK : TCL_ERROR;
 }
 
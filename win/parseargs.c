@@ -20,15 +20,38 @@ struct OptionDescriptor {
 #define OPT_INT    2
 #define OPT_SWITCH 3
 #define OPT_SYM    4
-    char        first;          /* First char of name[] */
 };
 
+/*
+ * A compiled option list. Option lists are almost always literals in proc
+ * bodies and are shared so compiled lists are reference counted and
+ * shared between the internal reps of all Tcl_Objs with the same string
+ * and the per-thread cache below. They hold Tcl_Objs so must not be
+ * passed between threads.
+ */
+typedef struct ParseargsSpec {
+    int nrefs;
+    int nopts;
+    int *sorted;                /* Indices into opts[] sorted by name */
+    struct OptionDescriptor opts[1]; /* Actually nopts elements */
+} ParseargsSpec;
+
+/*
+ * Compiled option lists are cached per thread keyed by the string so
+ * lists that lose their internal rep to shimmering, or are constructed
+ * at run time, are not parsed again. The cache is simply emptied if it
+ * grows beyond this many entries.
+ */
+#define PARSEARGS_CACHE_MAX 1000
 
-static int SetParseargsOptFromAny(Tcl_Interp *interp, Tcl_Obj *objP);
 static void DupParseargsOpt(Tcl_Obj *srcP, Tcl_Obj *dstP);
 static void FreeParseargsOpt(Tcl_Obj *objP);
 static void UpdateStringParseargsOpt(Tcl_Obj *objP);
 
+/*
+ * Tcl_Obj.internalRep.twoPtrValue.ptr1 holds the ParseargsSpec. Each
+ * Tcl_Obj holds a reference to it.
+ */
 static struct Tcl_ObjType gParseargsOptionType = {
     "TwapiParseargsOpt",
     FreeParseargsOpt,
@@ -53,19 +76,67 @@ static void CleanupOptionDescriptor(struct OptionDescriptor *optP)
     }
 }
 
+static void ParseargsSpecUnref(ParseargsSpec *specP)
+{
+    int i;
+
+    if (--specP->nrefs > 0)
+        return;
+    for (i = 0; i < specP->nopts; ++i)
+        CleanupOptionDescriptor(&specP->opts[i]);
+    ckfree((char *) specP);
+}
+
+/* Orders options by name length and then bytes. Returns <0, 0 or >0 */
+static int ParseargsNameCompare(const struct OptionDescriptor *optP,
+                                const char *name, Tcl_Size len)
+{
+    if (optP->name_len != len)
+        return optP->name_len < len ? -1 : 1;
+    return memcmp(ObjToString(optP->name), name, len);
+}
+
+/* Returns the index of the option with the given name or -1 */
+static int ParseargsSpecFind(ParseargsSpec *specP, const char *name,
+                             Tcl_Size len)
+{
+    int lo, hi, mid, cmp;
+    struct OptionDescriptor *opts = specP->opts;
+
+    lo = 0;
+    hi = specP->nopts - 1;
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        cmp = ParseargsNameCompare(&opts[specP->sorted[mid]], name, len);
+        if (cmp == 0) {
+            /* For duplicate names, the first definition wins as before */
+            while (mid > 0 &&
+                   ParseargsNameCompare(&opts[specP->sorted[mid-1]],
+                                        name, len) == 0)
+                --mid;
+            return specP->sorted[mid];
+        }
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
 static void UpdateStringParseargsOpt(Tcl_Obj *objP)
 {
     /* Not the most efficient but not likely to be called often */
-    unsigned long i;
+    int i;
     Tcl_Obj *listObj = ObjEmptyList();
+    ParseargsSpec *specP;
     struct OptionDescriptor *optP;
 
     TWAPI_ASSERT(objP->bytes == NULL);
     TWAPI_ASSERT(objP->typePtr == &gParseargsOptionType);
 
-    for (i = 0, optP = (struct OptionDescriptor *) objP->internalRep.ptrAndLongRep.ptr;
-         i < objP->internalRep.ptrAndLongRep.value;
-         ++i, ++optP) {
+    specP = (ParseargsSpec *) objP->internalRep.twoPtrValue.ptr1;
+    for (i = 0, optP = specP->opts; i < specP->nopts; ++i, ++optP) {
         Tcl_Obj *elems[3];
         int nelems;
         elems[0] = optP->name;
@@ -93,75 +164,51 @@ static void UpdateStringParseargsOpt(Tcl_Obj *objP)
 
 static void FreeParseargsOpt(Tcl_Obj *objP)
 {
-    unsigned long i;
-    struct OptionDescriptor *optsP;
-
-    if ((optsP = (struct OptionDescriptor *)objP->internalRep.ptrAndLongRep.ptr) != NULL) {
-        for (i = 0; i < objP->internalRep.ptrAndLongRep.value; ++i) {
-            CleanupOptionDescriptor(&optsP[i]);
-        }
-        ckfree((char *) optsP);
-    }
+    ParseargsSpec *specP;
 
-    objP->internalRep.ptrAndLongRep.ptr = NULL;
-    objP->internalRep.ptrAndLongRep.value = 0;
+    specP = (ParseargsSpec *) objP->internalRep.twoPtrValue.ptr1;
+    if (specP)
+        ParseargsSpecUnref(specP);
+    objP->internalRep.twoPtrValue.ptr1 = NULL;
     objP->typePtr = NULL;
 }
 
 static void DupParseargsOpt(Tcl_Obj *srcP, Tcl_Obj *dstP)
 {
-    int i;
-    struct OptionDescriptor *doptsP;
-    struct OptionDescriptor *soptsP;
-    
-    dstP->typePtr = &gParseargsOptionType;
-    soptsP = srcP->internalRep.ptrAndLongRep.ptr;
-    if (soptsP == NULL) {
-        dstP->internalRep.ptrAndLongRep.ptr = NULL;
-        dstP->internalRep.ptrAndLongRep.value = 0;
-        return;
-    }
-
-    /* TBD - optimize with reference counted intrep */
-    doptsP = (struct OptionDescriptor *) ckalloc(srcP->internalRep.ptrAndLongRep.value * sizeof(*doptsP));
-    dstP->internalRep.ptrAndLongRep.ptr = doptsP;
-    i = srcP->internalRep.ptrAndLongRep.value;
-    dstP->internalRep.ptrAndLongRep.value = i;
-    while (i--) {
-        if ((doptsP->name = soptsP->name) != NULL)
-            ObjIncrRefs(doptsP->name);
-        if ((doptsP->def_value = soptsP->def_value) != NULL)
-            ObjIncrRefs(doptsP->def_value);
-        if ((doptsP->valid_values = soptsP->valid_values) != NULL)
-            ObjIncrRefs(doptsP->valid_values);
-        doptsP->name_len = soptsP->name_len;
-        doptsP->type = soptsP->type;
-        doptsP->first = soptsP->first;
-        ++doptsP;
-        ++soptsP;
-    }
+    ParseargsSpec *specP;
 
+    specP = (ParseargsSpec *) srcP->internalRep.twoPtrValue.ptr1;
+    if (specP)
+        specP->nrefs += 1;
+    dstP->internalRep.twoPtrValue.ptr1 = specP;
+    dstP->internalRep.twoPtrValue.ptr2 = NULL;
+    dstP->typePtr = &gParseargsOptionType;
 }
 
-
-static int SetParseargsOptFromAny(Tcl_Interp *interp, Tcl_Obj *objP)
+/* Parses an option list. Returns a spec with a reference count of 0 */
+static ParseargsSpec *ParseargsSpecCompile(Tcl_Interp *interp, Tcl_Obj *objP)
 {
-    int k, nopts;
+    int j, k, nopts;
     Tcl_Obj **optObjs;
-    struct OptionDescriptor *optsP;
+    ParseargsSpec *specP;
     struct OptionDescriptor *curP;
     Tcl_Size len;
 
-    if (objP->typePtr == &gParseargsOptionType)
-        return TCL_OK;          /* Already in correct format */
-
     if (ObjGetElements(interp, objP, &len, &optObjs) != TCL_OK)
-        return TCL_ERROR;
-    if (len > INT_MAX)
-        return TwapiReturnErrorUIntMax(interp);
+        return NULL;
+    if (len > INT_MAX) {
+        TwapiReturnErrorUIntMax(interp);
+        return NULL;
+    }
     nopts = (int) len;
 
-    optsP = nopts ? (struct OptionDescriptor *) ckalloc(nopts * sizeof(*optsP)) : NULL;
+    /* Option descriptors and the sorted index are in one allocation */
+    specP = (ParseargsSpec *) ckalloc(sizeof(*specP)
+                                      + nopts * sizeof(specP->opts[0])
+                                      + nopts * sizeof(int));
+    specP->nrefs = 0;
+    specP->nopts = 0;           /* Incremented as options are parsed */
+    specP->sorted = (int *) &specP->opts[nopts ? nopts : 1];
 
     for (k = 0; k < nopts ; ++k) {
         Tcl_Obj   **elems;
@@ -169,7 +216,8 @@ static int SetParseargsOptFromAny(Tcl_Interp *interp, Tcl_Obj *objP)
         const char *type;
         const char *p;
 
-        curP = &optsP[k];
+        curP = &specP->opts[k];
+        specP->nopts = k + 1;   /* So error handling frees this one too */
 
         /* Init to NULL first so error handling frees correctly */
         curP->name = NULL;
@@ -185,7 +233,6 @@ static int SetParseargsOptFromAny(Tcl_Interp *interp, Tcl_Obj *objP)
         curP->name = elems[0];
         ObjIncrRefs(elems[0]);
         p = ObjToStringN(elems[0], &len);
-        curP->first = *p;
         type = Tcl_UtfFindFirst(p, '.');
         if (type == NULL)
             curP->name_len = (unsigned short) len;
@@ -232,44 +279,19 @@ static int SetParseargsOptFromAny(Tcl_Interp *interp, Tcl_Obj *objP)
                 ObjIncrRefs(elems[2]);
             }
         }
-    }
 
-    /* OK, options are in order. Convert the passed object's internal rep */
-    if (objP->typePtr && objP->typePtr->freeIntRepProc) {
-        objP->typePtr->freeIntRepProc(objP);
-        objP->typePtr = NULL;
+        /* Insert into the sorted index. Lists are short. */
+        for (j = k; j > 0; --j) {
+            struct OptionDescriptor *prevP = &specP->opts[specP->sorted[j-1]];
+            if (ParseargsNameCompare(prevP, ObjToString(curP->name),
+                                     curP->name_len) <= 0)
+                break;
+            specP->sorted[j] = specP->sorted[j-1];
+        }
+        specP->sorted[j] = k;
     }
 
-#if 0
-    /*
-     * Commented out - as per msofer:
-     * First reaction, from memory, is:
-     * a literal should ALWAYS have a string rep - the exact string rep it
-     * had when stored as a literal. As that string rep is not guaranteed to
-     * be regenerated exactly, it should never be cleared.
-     *
-     * Second reaction: Tcl_InvalidateStringRep must not be called on
-     * a shared object, ever. This is because ... because ... why was
-     * it?
-     *
-     * Note that you can shimmer a shared Tcl_Obj, ie, change its
-     * internal rep. You can also generate a string rep if there was
-     * none to begin with. But a Tcl_Obj that has a string rep must
-     * retain it forever, until its last ref is gone and the obj is
-     * returned to free mem.
-     * END QUOTE
-     *
-     * Since original intent was to just save memory, do not need this.
-     */
-
-    Tcl_InvalidateStringRep(objP);
-#endif
-
-    objP->internalRep.ptrAndLongRep.ptr = optsP;
-    objP->internalRep.ptrAndLongRep.value = nopts;
-    objP->typePtr = &gParseargsOptionType;
-
-    return TCL_OK;
+    return specP;
 
 error_handler: /* Tcl error result must have been set */
     /* k holds highest index that has been processed and is the error */
@@ -278,14 +300,89 @@ error_handler: /* Tcl error result must have been set */
                          ObjToString(optObjs[k]), "'", NULL);
         Tcl_SetObjErrorCode(interp, Twapi_MakeTwapiErrorCodeObj(TWAPI_INVALID_ARGS));
     }
-    if (optsP) {
-        while (k >= 0) {
-            CleanupOptionDescriptor(&optsP[k]);
-            --k;
-        }
-        ckfree((char *)optsP);
+    specP->nrefs = 1;
+    ParseargsSpecUnref(specP);
+    return NULL;
+}
+
+static void ParseargsCacheClear(Tcl_HashTable *cacheP)
+{
+    Tcl_HashEntry *heP;
+    Tcl_HashSearch hs;
+
+    for (heP = Tcl_FirstHashEntry(cacheP, &hs);
+         heP != NULL;
+         heP = Tcl_NextHashEntry(&hs)) {
+        ParseargsSpecUnref((ParseargsSpec *) Tcl_GetHashValue(heP));
     }
-    return TCL_ERROR;
+    Tcl_DeleteHashTable(cacheP);
+    Tcl_InitHashTable(cacheP, TCL_STRING_KEYS);
+}
+
+/* Called when the thread's TLS area is released */
+void TwapiParseargsCacheFree(TwapiTls *tlsP)
+{
+    if (tlsP->parseargs_cache) {
+        ParseargsCacheClear(tlsP->parseargs_cache);
+        Tcl_DeleteHashTable(tlsP->parseargs_cache);
+        ckfree((char *) tlsP->parseargs_cache);
+        tlsP->parseargs_cache = NULL;
+    }
+}
+
+/*
+ * Returns the compiled form of an option list, from its internal rep or
+ * the cache, compiling it if necessary. objP, shared or not, is converted
+ * to a TwapiParseargsOpt. Note its string rep is never touched. The
+ * caller must hold a reference to the returned spec while it is in use as
+ * objP may be shimmered again, for example if it is also the argument
+ * list being parsed.
+ */
+static ParseargsSpec *ParseargsSpecGet(Tcl_Interp *interp, Tcl_Obj *objP)
+{
+    TwapiTls *tlsP;
+    Tcl_HashEntry *heP;
+    ParseargsSpec *specP;
+    int new_entry;
+
+    if (objP->typePtr == &gParseargsOptionType)
+        return (ParseargsSpec *) objP->internalRep.twoPtrValue.ptr1;
+
+    tlsP = Twapi_GetTls();
+    if (tlsP->parseargs_cache == NULL) {
+        tlsP->parseargs_cache = (Tcl_HashTable *) ckalloc(sizeof(Tcl_HashTable));
+        Tcl_InitHashTable(tlsP->parseargs_cache, TCL_STRING_KEYS);
+    }
+
+    heP = Tcl_FindHashEntry(tlsP->parseargs_cache, ObjToString(objP));
+    if (heP) {
+        specP = (ParseargsSpec *) Tcl_GetHashValue(heP);
+    } else {
+        specP = ParseargsSpecCompile(interp, objP);
+        if (specP == NULL)
+            return NULL;
+        if (tlsP->parseargs_cache->numEntries >= PARSEARGS_CACHE_MAX)
+            ParseargsCacheClear(tlsP->parseargs_cache);
+        heP = Tcl_CreateHashEntry(tlsP->parseargs_cache, ObjToString(objP),
+                                  &new_entry);
+        Tcl_SetHashValue(heP, specP);
+        specP->nrefs += 1;      /* For the cache */
+    }
+
+    /*
+     * Convert the passed object's internal rep. Changing the internal rep
+     * of a shared object is fine as long as the string rep is retained.
+     * As per msofer, Tcl_InvalidateStringRep must never be called on a
+     * shared object, and a literal must always keep its string rep.
+     */
+    if (objP->typePtr && objP->typePtr->freeIntRepProc)
+        objP->typePtr->freeIntRepProc(objP);
+    objP->internalRep.twoPtrValue.ptr1 = specP;
+    objP->internalRep.twoPtrValue.ptr2 = NULL;
+    objP->typePtr = &gParseargsOptionType;
+    specP->nrefs += 1;          /* For objP */
+
+    return specP;
 }
 
 
@@ -335,8 +432,9 @@ int Twapi_ParseargsObjCmd(
     int         nopts;
     int         j, k;
     Tcl_WideInt wide;
-    Tcl_Obj *optsObj = NULL;
+    ParseargsSpec *specP;
     struct OptionDescriptor *opts;
+    int         opt;
     int         ignoreunknown = 0;
     int         nulldefault = 0;
     int         hyphenated = 0;
@@ -349,6 +447,14 @@ int Twapi_ParseargsObjCmd(
     Tcl_Obj    *retObjs[2*TWAPI_PARSEARGS_STATIC];
     Tcl_Obj    **retP = NULL;
     int         nret = 0;
+    static const char *parseargs_opts[] = {
+        "-ignoreunknown", "-hyphenated", "-maxleftover", "-nulldefault",
+        "-setvars", NULL
+    };
+    enum {
+        PA_IGNOREUNKNOWN, PA_HYPHENATED, PA_MAXLEFTOVER, PA_NULLDEFAULT,
+        PA_SETVARS
+    };
 
     if (objc < 3) {
         Tcl_WrongNumArgs(interp, 1, objv, "argvVar optlist ?-ignoreunknown? ?-nulldefault? ?-hyphenated? ?-maxleftover COUNT? ?--?");
@@ -356,18 +462,13 @@ int Twapi_ParseargsObjCmd(
         return TCL_ERROR;
     }
 
-    /* Now construct the option descriptors */
-    optsObj = Tcl_IsShared(objv[2]) ? Tcl_DuplicateObj(objv[2]) : objv[2];
-    ObjIncrRefs(optsObj);
-    if (optsObj->typePtr != &gParseargsOptionType) {
-        if (SetParseargsOptFromAny(interp, optsObj) != TCL_OK) {
-            ObjDecrRefs(optsObj);
-            return TCL_ERROR;
-        }
-    }
-
-    opts =  optsObj->internalRep.ptrAndLongRep.ptr;
-    nopts = optsObj->internalRep.ptrAndLongRep.value;
+    /* Now get the option descriptors */
+    specP = ParseargsSpecGet(interp, objv[2]);
+    if (specP == NULL)
+        return TCL_ERROR;
+    specP->nrefs += 1;          /* Released on return */
+    opts = specP->opts;
+    nopts = specP->nopts;
 
     if (nopts > TWAPI_PARSEARGS_STATIC) {
         valuesP = MemLifoPushFrame(ticP->memlifoP, nopts * sizeof(*valuesP), NULL);
@@ -380,13 +481,18 @@ int Twapi_ParseargsObjCmd(
     for (k = 0; k < nopts; ++k)
         valuesP[k] = NULL;      /* Values corresponding to each option */
 
-    /* TBD - use Tcl_GetIndexFromObj to parse parseargs options. Faster */
     for (j = 3 ; j < objc ; ++j) {
-        char *s = ObjToString(objv[j]);
-        if (STREQ("-nulldefault", s)) {
-            nulldefault = 1;
+        if (Tcl_GetIndexFromObj(NULL, objv[j], parseargs_opts, NULL,
+                                TCL_EXACT, &opt) != TCL_OK) {
+            Tcl_AppendResult(interp, "Extra argument or unknown option '",
+                             ObjToString(objv[j]), "'", NULL);
+            goto invalid_args_error;
         }
-        else if (STREQ("-maxleftover", s)) {
+        switch (opt) {
+        case PA_NULLDEFAULT:
+            nulldefault = 1;
+            break;
+        case PA_MAXLEFTOVER:
             ++j;
             if (j == objc) {
                 ObjSetStaticResult(interp, "Missing value for -maxleftover");
@@ -396,20 +502,16 @@ int Twapi_ParseargsObjCmd(
             if (ObjToInt(interp, objv[j], &maxleftover) != TCL_OK) {
                 goto invalid_args_error;
             }
-        }
-        else if (STREQ("-setvars", s)) {
+            break;
+        case PA_SETVARS:
             setvars = 1;
-        }
-        else if (STREQ("-ignoreunknown", s)) {
+            break;
+        case PA_IGNOREUNKNOWN:
             ignoreunknown = 1;
-        }
-        else if (STREQ("-hyphenated", s)) {
+            break;
+        case PA_HYPHENATED:
             hyphenated = 1;
-        }
-        else {
-            Tcl_AppendResult(interp, "Extra argument or unknown option '",
-                             ObjToString(objv[j]), "'", NULL);
-            goto invalid_args_error;
+            break;
         }
     }
 
@@ -437,16 +539,10 @@ int Twapi_ParseargsObjCmd(
             break;
         }
 
-        /* Check against each option in turn */
-        for (j = 0; j < nopts; ++j) {
-            if (opts[j].name_len == (argp_len-1) &&
-                opts[j].first == argp[1] &&
-                ! Tcl_UtfNcmp(ObjToString(opts[j].name), argp+1, (argp_len-1))) {
-                break;          /* Match ! */
-            }
-        }
+        /* Look up the option by name */
+        j = ParseargsSpecFind(specP, argp+1, argp_len-1);
 
-        if (j < nopts) {
+        if (j >= 0) {
             /*
              *  Matches option j. Remember the option value.
              */
@@ -688,8 +784,7 @@ int Twapi_ParseargsObjCmd(
     if (valuesP && valuesP != values)
         MemLifoPopFrame(ticP->memlifoP);
 
-    if (optsObj)
-        ObjDecrRefs(optsObj);
+    ParseargsSpecUnref(specP);
     return TCL_OK;
 
 invalid_args_error:
@@ -713,8 +808,7 @@ error_return:
     if (valuesP && valuesP != values)
         MemLifoPopFrame(ticP->memlifoP);
 
-    if (optsObj)
-        ObjDecrRefs(optsObj);
+    ParseargsSpecUnref(specP);
 
     return TCL_ERROR;
 }
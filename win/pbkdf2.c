@@ -31,189 +31,79 @@
 #endif
 
 #include <stdio.h>
-#include <math.h>
+#if !defined(TWAPI_REPLACE_CRT) && !defined(TWAPI_MINIMIZE_CRT)
+# include <process.h>
+#endif
 
+#include "hmacsha.h"
 #include "pbkdf2.h"
 
-/* Implementation of HMAC-SHA1 using CAPI */
-
-#define HMAC_SHA1_MAGIC 0x53484131
-
-typedef struct
-{
-   HCRYPTPROV hProv;
-   HCRYPTKEY hKey;
-} CAPI_CTX_PARAM;
+/*
+ * Implementation of HMAC-SHA using the native code in hmacsha.c.
+ * Earlier versions went through CAPI which meant a CryptCreateHash
+ * round trip for every iteration. The key is now absorbed into the
+ * HMAC inner and outer states once in hmacInit.
+ */
 
-// Structure used by CAPI for HMAC computation
-typedef struct {
-   BLOBHEADER hdr;
-   DWORD cbKeySize;
-} HMAC_KEY_BLOB;
+#define HMAC_SHA_MAGIC 0x53484131
 
-BOOL WINAPI hmacInit_sha(
+static BOOL hmacInit_sha(
+   int            alg,        /* HMACSHA_SHA1 etc. */
    PRF_CTX*       pContext,   /* PRF context used in HMAC computation */
    unsigned char* pbKey,      /* pointer to authentication key */
-   DWORD          cbKey       /* length of authentication key */                        
+   DWORD          cbKey       /* length of authentication key */
 )
 {
-   HCRYPTPROV hProv = 0;
-   HCRYPTKEY hKey = 0;
-   HMAC_KEY_BLOB *pKeyBlob = NULL;
-   BOOL bStatus = FALSE;
-   DWORD dwError = 0, dwLen;
-   CAPI_CTX_PARAM* pParam = NULL;
-
-#ifdef USE_SWS
-   pKeyBlob = (HMAC_KEY_BLOB *) SWSAlloc(sizeof(HMAC_KEY_BLOB) + cbKey + 20,
-                                         NULL); // enough room for 0's padding
-#else
-   pKeyBlob = (HMAC_KEY_BLOB *) LocalAlloc(0, sizeof(HMAC_KEY_BLOB) + cbKey + 20); // we put enough room for 0's padding
-   if (pKeyBlob == NULL) {
-      dwError = ERROR_NOT_ENOUGH_MEMORY;
-      goto hmacInit_end;
-   }
-#endif
-   
-   pKeyBlob->hdr.bType = PLAINTEXTKEYBLOB;
-   pKeyBlob->hdr.bVersion = CUR_BLOB_VERSION;
-   pKeyBlob->hdr.reserved = 0;
-   pKeyBlob->hdr.aiKeyAlg = CALG_RC2;
-   pKeyBlob->cbKeySize = cbKey;
-   memcpy(((LPBYTE) pKeyBlob) + sizeof(HMAC_KEY_BLOB), pbKey, cbKey);
+   HmacShaKey *pKey;
 
    if (!pContext)
    {
-      dwError = ERROR_BAD_ARGUMENTS;
-      goto hmacInit_end;
-   }
-
-   if (!CryptAcquireContext(&hProv, NULL, NULL, PROV_RSA_AES, CRYPT_VERIFYCONTEXT)) 
-   {
-      dwError = GetLastError();
-      goto hmacInit_end;
-   }
-
-   dwLen = sizeof(HMAC_KEY_BLOB) + cbKey;
-   if (dwLen < 20)
-   {
-      // we pad with zeros till the size of SHA1 digest.
-      // this is to avoid erros under Windows 8.1 wich doesn't accept 1-byte RC2 keys
-      // the result will be the same since the HMAC-SHA1 will perform the same padding
-	  DWORD dwPad = 20 - dwLen;
-	  memset(((LPBYTE) pKeyBlob) + dwLen, 0, dwPad);
-	  dwLen += dwPad;
-	  pKeyBlob->cbKeySize += dwPad;
-   }
-
-   if (!CryptImportKey(hProv, (LPBYTE) pKeyBlob, dwLen, 0, CRYPT_IPSEC_HMAC_KEY, &hKey))
-   {
-      dwError = GetLastError();
-      goto hmacInit_end;
+      SetLastError(ERROR_BAD_ARGUMENTS);
+      return FALSE;
    }
 
 #ifdef USE_SWS
-   pParam = (CAPI_CTX_PARAM*) SWSAlloc(sizeof(CAPI_CTX_PARAM), NULL);
+   pKey = (HmacShaKey *) SWSAlloc(sizeof(HmacShaKey), NULL);
 #else
-   pParam = (CAPI_CTX_PARAM*) LocalAlloc(0, sizeof(CAPI_CTX_PARAM));
-#endif
-   pParam->hProv = hProv;
-   pParam->hKey = hKey;
-
-   pContext->magic = HMAC_SHA1_MAGIC;
-   pContext->pParam = (void*) pParam;
-
-   hProv = 0;
-   hKey = 0;
-
-   bStatus = TRUE;
-
-hmacInit_end:
-
-   if (hKey) CryptDestroyKey(hKey);
-   if (hProv) CryptReleaseContext(hProv, 0);
-#ifndef USE_SWS
-   if (pKeyBlob) LocalFree(pKeyBlob);
-#endif
-   
-   SetLastError(dwError);
-   return bStatus;
-}
-
-static BOOL WINAPI hmac_sha(
-   ALG_ID          algid,         /* CALG_SHA1, CALG_SHA256 etc. */
-   PRF_CTX*        pContext,      /* PRF context used in HMAC computation */  
-   unsigned char*  pbData,        /* pointer to data stream */
-   DWORD           cbData,        /* length of data stream */
-   unsigned char*  pbDigest,      /* caller digest to be filled in */
-   DWORD           cbDigest
-)
-{
-   HCRYPTPROV hProv = 0;
-   HCRYPTHASH hHash = 0;
-   HCRYPTKEY hKey = 0;
-   HMAC_INFO   HmacInfo;
-   BOOL bStatus = FALSE;
-   DWORD dwError = 0;
-
-   ZeroMemory(&HmacInfo, sizeof(HmacInfo));
-   HmacInfo.HashAlgid = algid;
-
-   if (!pContext || (pContext->magic != HMAC_SHA1_MAGIC) || (!pContext->pParam))
-   {
-      dwError = ERROR_BAD_ARGUMENTS;
-      goto hmac_end;
-   }
-
-   hProv = ((CAPI_CTX_PARAM*) pContext->pParam)->hProv;
-   hKey = ((CAPI_CTX_PARAM*) pContext->pParam)->hKey;
-
-   if (!CryptCreateHash(hProv, CALG_HMAC, hKey, 0, &hHash))
-   {
-      dwError = GetLastError();
-      goto hmac_end;
-   }
-
-   if (!CryptSetHashParam( hHash, HP_HMAC_INFO, (BYTE*)&HmacInfo, 0))
-   {
-      dwError = GetLastError();
-      goto hmac_end;
-   }
-
-   if (!CryptHashData(hHash, pbData, cbData, 0))
+   pKey = (HmacShaKey *) LocalAlloc(0, sizeof(HmacShaKey));
+   if (pKey == NULL)
    {
-      dwError = GetLastError();
-      goto hmac_end;
+      SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+      return FALSE;
    }
+#endif
 
-   if (!CryptGetHashParam(hHash, HP_HASHVAL, pbDigest, &cbDigest, 0))
+   if (HmacShaKeyInit(pKey, alg, pbKey, cbKey) != 0)
    {
-      dwError = GetLastError();
-      goto hmac_end;
+#ifndef USE_SWS
+      LocalFree(pKey);
+#endif
+      SetLastError(ERROR_BAD_ARGUMENTS);
+      return FALSE;
    }
 
-   bStatus = TRUE;
+   pContext->magic = HMAC_SHA_MAGIC;
+   pContext->pParam = (void*) pKey;
 
-hmac_end:
+   return TRUE;
+}
 
-   if (hHash) CryptDestroyHash(hHash);
+BOOL WINAPI hmacInit_sha1(PRF_CTX* pContext, unsigned char* pbKey, DWORD cbKey)
+{
+   return hmacInit_sha(HMACSHA_SHA1, pContext, pbKey, cbKey);
+}
 
-   SetLastError(dwError);
-   return bStatus;
+BOOL WINAPI hmacInit_sha256(PRF_CTX* pContext, unsigned char* pbKey, DWORD cbKey)
+{
+   return hmacInit_sha(HMACSHA_SHA256, pContext, pbKey, cbKey);
 }
 
-BOOL WINAPI hmac_sha1(
-   PRF_CTX*       pContext,        /* PRF context used in HMAC computation */  
-   unsigned char*  pbData,         /* pointer to data stream */
-   DWORD           cbData,         /* length of data stream */
-   unsigned char*  pbDigest,       /* caller digest to be filled in */
-   DWORD           cbDigest        /* Space in pbDigest */
-)
+BOOL WINAPI hmacInit_sha512(PRF_CTX* pContext, unsigned char* pbKey, DWORD cbKey)
 {
-   return hmac_sha(CALG_SHA1, pContext, pbData, cbData, pbDigest, cbDigest);
+   return hmacInit_sha(HMACSHA_SHA512, pContext, pbKey, cbKey);
 }
 
-BOOL WINAPI hmac_sha256(
+BOOL WINAPI hmac_sha(
    PRF_CTX*       pContext,        /* PRF context used in HMAC computation */  
    unsigned char*  pbData,         /* pointer to data stream */
    DWORD           cbData,         /* length of data stream */
@@ -221,28 +111,39 @@ BOOL WINAPI hmac_sha256(
    DWORD           cbDigest        /* Space in pbDigest */
 )
 {
-   return hmac_sha(CALG_SHA_256, pContext, pbData, cbData, pbDigest, cbDigest);
+   HmacShaKey *pKey;
+   unsigned char digest[HMACSHA_MAX_DIGEST];
+
+   if (!pContext || (pContext->magic != HMAC_SHA_MAGIC) || (!pContext->pParam))
+   {
+      SetLastError(ERROR_BAD_ARGUMENTS);
+      return FALSE;
+   }
+
+   pKey = (HmacShaKey *) pContext->pParam;
+   if (cbDigest < pKey->hlen)
+   {
+      SetLastError(ERROR_INSUFFICIENT_BUFFER);
+      return FALSE;
+   }
+
+   HmacSha(pKey, pbData, cbData, digest);
+   memcpy(pbDigest, digest, pKey->hlen);
+   SecureZeroMemory(digest, sizeof(digest));
+   return TRUE;
 }
 
 BOOL WINAPI hmacFree_sha(
    PRF_CTX*       pContext          /* PRF context used in HMAC computation */  
 )
 {
-   HCRYPTPROV hProv = 0;
-   HCRYPTKEY hKey = 0;
-
-   if (!pContext || (pContext->magic != HMAC_SHA1_MAGIC) || (!pContext->pParam))
+   if (!pContext || (pContext->magic != HMAC_SHA_MAGIC) || (!pContext->pParam))
    {
       SetLastError(ERROR_BAD_ARGUMENTS);
       return FALSE;
    }
 
-   hProv = ((CAPI_CTX_PARAM*) pContext->pParam)->hProv;
-   hKey = ((CAPI_CTX_PARAM*) pContext->pParam)->hKey;
-
-   CryptDestroyKey(hKey);
-   CryptReleaseContext(hProv, 0);
-
+   HmacShaKeyClear((HmacShaKey *) pContext->pParam);
 #ifndef USE_SWS
    LocalFree(pContext->pParam);
 #endif
@@ -252,15 +153,50 @@ BOOL WINAPI hmacFree_sha(
 }
 
 /*
- * Definition of the HMAC-SHA1 PRF
+ * Definition of the HMAC-SHA PRFs
+ */
+PRF sha1Prf = {hmacInit_sha1, hmac_sha, hmacFree_sha, 20};
+PRF sha256Prf = {hmacInit_sha256, hmac_sha, hmacFree_sha, 32};
+PRF sha512Prf = {hmacInit_sha512, hmac_sha, hmacFree_sha, 64};
+
+/*
+ * Output blocks of PBKDF2 are independent of each other so when more
+ * than one is needed they are handed out to worker threads. The calling
+ * thread also works on blocks so a single block key never creates a
+ * thread.
  */
-PRF sha1Prf = {hmacInit_sha, hmac_sha1, hmacFree_sha, 20};
-PRF sha256Prf = {hmacInit_sha, hmac_sha256, hmacFree_sha, 32};
+#define PBKDF2_MAX_THREADS 16
+
+typedef struct
+{
+   HmacShaKey*    pKey;
+   unsigned char* pbSalt;
+   DWORD          cbSalt;
+   DWORD          dwIterationCount;
+   LPBYTE         pbBlocks;      /* nBlocks * hlen bytes */
+   DWORD          nBlocks;
+   volatile LONG  nextBlock;     /* Last block number handed out */
+} PBKDF2_WORK;
+
+static void PBKDF2DoBlocks(PBKDF2_WORK *pWork)
+{
+   LONG i;
+   while ((i = InterlockedIncrement(&pWork->nextBlock)) <= (LONG) pWork->nBlocks)
+   {
+      HmacShaPbkdf2Block(pWork->pKey, pWork->pbSalt, pWork->cbSalt, i,
+                         pWork->dwIterationCount,
+                         pWork->pbBlocks + (i-1) * pWork->pKey->hlen);
+   }
+}
 
-static __inline void xor(LPBYTE ptr1, LPBYTE ptr2, DWORD dwLen)
+#if defined(TWAPI_REPLACE_CRT) || defined(TWAPI_MINIMIZE_CRT)
+static DWORD WINAPI PBKDF2Thread(void *pv)
+#else
+static unsigned int __stdcall PBKDF2Thread(void *pv)
+#endif
 {
-   if (dwLen)
-      while (dwLen--) *ptr1++ ^= *ptr2++;
+   PBKDF2DoBlocks((PBKDF2_WORK *) pv);
+   return 0;
 }
 
 /*
@@ -277,17 +213,22 @@ BOOL PBKDF2(PRF *pPrf,
 {
    BOOL bStatus = FALSE;
    DWORD dwError = 0;
-   DWORD l, r, i,j;
+   DWORD l = 0, i, nThreads;
    DWORD hlen = pPrf->cbHmacLength;
-   LPBYTE Ti = NULL;
-   LPBYTE V = NULL;
-   LPBYTE U = NULL;
-   DWORD dwULen;
    PRF_CTX prfCtx = {0};
+   PBKDF2_WORK work;
+   HANDLE threads[PBKDF2_MAX_THREADS];
+   SYSTEM_INFO si;
+#if defined(TWAPI_REPLACE_CRT) || defined(TWAPI_MINIMIZE_CRT)
+   DWORD tid;
+#else
+   unsigned int tid;
+#endif
 #ifdef USE_SWS
    SWSMark mark = NULL;
 #endif
 
+   ZeroMemory(&work, sizeof(work));
    
    if (!pbDerivedKey || !cbDerivedKey || (!pbPassword && cbPassword) )
    {
@@ -295,25 +236,19 @@ BOOL PBKDF2(PRF *pPrf,
       goto PBKDF2_end;
    }
 
+   l = (cbDerivedKey + hlen - 1) / hlen;
+
 #ifdef USE_SWS
    mark = SWSPushMark();
-   Ti = (LPBYTE) SWSAlloc(hlen, NULL);
-   V = (LPBYTE) SWSAlloc(hlen, NULL);
-   U = (LPBYTE) SWSAlloc(max((cbSalt + 4), hlen), NULL);
+   work.pbBlocks = (LPBYTE) SWSAlloc(l * hlen, NULL);
 #else
-   Ti = (LPBYTE) LocalAlloc(0, hlen);
-   V = (LPBYTE) LocalAlloc(0, hlen);
-   U = (LPBYTE) LocalAlloc(0, max((cbSalt + 4), hlen));
-
-   if (!Ti || !U || !V)
+   work.pbBlocks = (LPBYTE) LocalAlloc(0, l * hlen);
+   if (!work.pbBlocks)
    {
       dwError = ERROR_NOT_ENOUGH_MEMORY;
       goto PBKDF2_end;
    }
 #endif
-   
-   l = (DWORD) ceil((double) cbDerivedKey / (double) hlen);
-   r = cbDerivedKey - (l - 1) * hlen;
 
    if (!pPrf->hmacInit(&prfCtx, pbPassword, cbPassword))
    {
@@ -321,60 +256,56 @@ BOOL PBKDF2(PRF *pPrf,
       goto PBKDF2_end;
    }
 
-   for (i = 1; i <= l; i++)
-   {
-      ZeroMemory(Ti, hlen);
-      for (j = 0; j < dwIterationCount; j++)
-      {
-         if (j == 0)
-         {
-            // construct first input for PRF
-            memcpy(U, pbSalt, cbSalt);
-            U[cbSalt] = (BYTE) ((i & 0xFF000000) >> 24);
-            U[cbSalt + 1] = (BYTE) ((i & 0x00FF0000) >> 16);
-            U[cbSalt + 2] = (BYTE) ((i & 0x0000FF00) >> 8);
-            U[cbSalt + 3] = (BYTE) ((i & 0x000000FF));
-            dwULen = cbSalt + 4;
-         }
-         else
-         {
-            memcpy(U, V, hlen);
-            dwULen = hlen;
-         }
-
-         if (!pPrf->hmac(&prfCtx, U, dwULen, V, hlen))
-         {
-            dwError = GetLastError();
-            goto PBKDF2_end;
-         }
-
-         xor(Ti, V, hlen);
-      }
-
-      if (i != l)
-      {
-         memcpy(&pbDerivedKey[(i-1) * hlen], Ti, hlen);
-      }
-      else
-      {
-         // Take only the first r bytes
-         memcpy(&pbDerivedKey[(i-1) * hlen], Ti, r);
-      }
+   work.pKey = (HmacShaKey *) prfCtx.pParam;
+   work.pbSalt = pbSalt;
+   work.cbSalt = cbSalt;
+   work.dwIterationCount = dwIterationCount;
+   work.nBlocks = l;
+   work.nextBlock = 0;
+
+   GetSystemInfo(&si);
+   nThreads = min(l, si.dwNumberOfProcessors);
+   if (nThreads > PBKDF2_MAX_THREADS)
+      nThreads = PBKDF2_MAX_THREADS;
+   /* One less since this thread also computes blocks */
+   for (i = 0; i + 1 < nThreads; ++i)
+   {
+#if defined(TWAPI_REPLACE_CRT) || defined(TWAPI_MINIMIZE_CRT)
+      threads[i] = CreateThread(NULL, 0, PBKDF2Thread, &work, 0, &tid);
+#else
+      threads[i] = (HANDLE) _beginthreadex(NULL, 0, PBKDF2Thread,
+                                           &work, 0, &tid);
+#endif
+      /* If a thread cannot be created, the remaining threads pick up its share */
+      if (threads[i] == NULL)
+         break;
+   }
+   nThreads = i;
+
+   PBKDF2DoBlocks(&work);
+
+   if (nThreads)
+   {
+      WaitForMultipleObjects(nThreads, threads, TRUE, INFINITE);
+      for (i = 0; i < nThreads; ++i)
+         CloseHandle(threads[i]);
    }
 
+   memcpy(pbDerivedKey, work.pbBlocks, cbDerivedKey);
    bStatus = TRUE;
 
 PBKDF2_end:
 
-   pPrf->hmacFree(&prfCtx);
+   if (prfCtx.pParam)
+      pPrf->hmacFree(&prfCtx);
 
+   if (work.pbBlocks)
+      SecureZeroMemory(work.pbBlocks, l * hlen);
 #ifdef USE_SWS
    if (mark)
        SWSPopMark(mark);
 #else
-   if (Ti) LocalFree(Ti);
-   if (U) LocalFree(U);
-   if (V) LocalFree(V);
+   if (work.pbBlocks) LocalFree(work.pbBlocks);
 #endif
    
    SetLastError(dwError);
@@ -581,7 +512,7 @@ int main(int argc, char* argv[])
                                        };
 
    
-   if (!PBKDF2(sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "salt", 4, 1, pbDerivedKey, 20))
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "salt", 4, 1, pbDerivedKey, 20))
    {
       printf("Test 1 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
       goto main_end;
@@ -593,7 +524,7 @@ int main(int argc, char* argv[])
    }
 
    
-   if (!PBKDF2(sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "salt", 4, 2, pbDerivedKey, 20))
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "salt", 4, 2, pbDerivedKey, 20))
    {
       printf("Test 2 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
       goto main_end;
@@ -604,7 +535,7 @@ int main(int argc, char* argv[])
       goto main_end;
    }
 
-   if (!PBKDF2(sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "salt", 4, 4096, pbDerivedKey, 20))
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "salt", 4, 4096, pbDerivedKey, 20))
    {
       printf("Test 3 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
       goto main_end;
@@ -615,7 +546,7 @@ int main(int argc, char* argv[])
       goto main_end;
    }
 
-   if (!PBKDF2(sha1Prf, (LPBYTE) "password", 8, pbSalt, 8, 2048, pbDerivedKey, 24))
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "password", 8, pbSalt, 8, 2048, pbDerivedKey, 24))
    {
       printf("Test 4 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
       goto main_end;
@@ -626,7 +557,7 @@ int main(int argc, char* argv[])
       goto main_end;
    }
 
-   if (!PBKDF2(sha1Prf, (LPBYTE) "Hello World", 11, pbOtherSalt, 8, 1000, pbDerivedKey, 20))
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "Hello World", 11, pbOtherSalt, 8, 1000, pbDerivedKey, 20))
    {
       printf("Test 5 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
       goto main_end;
@@ -637,7 +568,7 @@ int main(int argc, char* argv[])
       goto main_end;
    }
 
-   if (!PBKDF2(sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "ATHENA.MIT.EDUraeburn", 21, 1, pbDerivedKey, 32))
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "ATHENA.MIT.EDUraeburn", 21, 1, pbDerivedKey, 32))
    {
       printf("Test 6 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
       goto main_end;
@@ -648,7 +579,7 @@ int main(int argc, char* argv[])
       goto main_end;
    }
 
-   if (!PBKDF2(sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "ATHENA.MIT.EDUraeburn", 21, 2, pbDerivedKey, 32))
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "ATHENA.MIT.EDUraeburn", 21, 2, pbDerivedKey, 32))
    {
       printf("Test 7 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
       goto main_end;
@@ -659,7 +590,7 @@ int main(int argc, char* argv[])
       goto main_end;
    }
 
-   if (!PBKDF2(sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "ATHENA.MIT.EDUraeburn", 21, 1200, pbDerivedKey, 32))
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "ATHENA.MIT.EDUraeburn", 21, 1200, pbDerivedKey, 32))
    {
       printf("Test 8 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
       goto main_end;
@@ -670,7 +601,7 @@ int main(int argc, char* argv[])
       goto main_end;
    }
 
-   if (!PBKDF2(sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "\0224VxxV4\022", 8, 5, pbDerivedKey, 32))
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "\0224VxxV4\022", 8, 5, pbDerivedKey, 32))
    {
       printf("Test 9 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
       goto main_end;
@@ -681,7 +612,7 @@ int main(int argc, char* argv[])
       goto main_end;
    }
 
-   if (!PBKDF2(sha1Prf, (LPBYTE) "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX", 64, 
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX", 64, 
                         (LPBYTE) "pass phrase equals block size", 29, 1200, pbDerivedKey, 32))
    {
       printf("Test 10 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
@@ -693,7 +624,7 @@ int main(int argc, char* argv[])
       goto main_end;
    }
 
-   if (!PBKDF2(sha1Prf, (LPBYTE) "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX", 65, 
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX", 65, 
                         (LPBYTE) "pass phrase exceeds block size", 30, 1200, pbDerivedKey, 32))
    {
       printf("Test 11 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
@@ -705,7 +636,7 @@ int main(int argc, char* argv[])
       goto main_end;
    }
 
-   if (!PBKDF2(sha1Prf, (LPBYTE) "\360\235\204\236", 4, 
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "\360\235\204\236", 4, 
                         (LPBYTE) "EXAMPLE.COMpianist", 18, 50, pbDerivedKey, 32))
    {
       printf("Test 12 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
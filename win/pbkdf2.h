@@ -40,6 +40,7 @@ typedef struct
 
 extern PRF sha1Prf;
 extern PRF sha256Prf;
+extern PRF sha512Prf;
 
 BOOL PBKDF2(PRF *pPrf,
             unsigned char* pbPassword,
@@ -0,0 +1,741 @@
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Buffer ring state machine for overlapped pipe I/O. See pipering.h.
+ *
+ * Slots in use are always contiguous, starting at ring->head. In a read
+ * ring they are all POSTED or DONE. In a write ring they are DONE or
+ * POSTED followed by at most a few FILLING slots, of which only the last
+ * may be partially filled. A partially filled slot is only submitted when
+ * no other write is in flight (or on an explicit flush) so that small
+ * writes issued while the pipe is busy are gathered into one operation.
+ *
+ * Build with -DPIPERING_TEST to get a standalone test driver that runs
+ * the state machine against a fake I/O backend (see end of file).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "pipering.h"
+
+#ifdef _WIN32
+# include <windows.h>
+# define PipeRingCas(p_, new_, old_) InterlockedCompareExchange((p_), (new_), (old_))
+# define PipeRingStore(p_, v_)       InterlockedExchange((p_), (v_))
+static long PipeRingLoad(volatile long *p)
+{
+    long v = *p;
+    MemoryBarrier();
+    return v;
+}
+#else
+# define PipeRingCas(p_, new_, old_) PipeRingCasGcc((p_), (new_), (old_))
+# define PipeRingStore(p_, v_)       __atomic_store_n((p_), (v_), __ATOMIC_RELEASE)
+# define PipeRingLoad(p_)            __atomic_load_n((p_), __ATOMIC_ACQUIRE)
+static long PipeRingCasGcc(volatile long *p, long newval, long oldval)
+{
+    __atomic_compare_exchange_n(p, &oldval, newval, 0,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    return oldval;
+}
+#endif
+
+#define PIPERING_INDEX(ringP_, i_) (((ringP_)->head + (i_)) % PIPERING_MAX_DEPTH)
+
+void PipeRingInit(PipeRing *ringP, PipeRingPostFn *post, void *ctx,
+                  int depth, size_t bufsize)
+{
+    memset(ringP, 0, sizeof(*ringP));
+    ringP->post = post;
+    ringP->ctx = ctx;
+    ringP->depth = 1;
+    ringP->bufsize = 4096;
+    PipeRingConfigure(ringP, depth, bufsize);
+}
+
+/* Caller must ensure no I/O is outstanding on any slot */
+void PipeRingFree(PipeRing *ringP)
+{
+    int i;
+    for (i = 0; i < PIPERING_MAX_DEPTH; ++i) {
+        if (ringP->slots[i].p) {
+            free(ringP->slots[i].p);
+            ringP->slots[i].p = NULL;
+            ringP->slots[i].size = 0;
+        }
+    }
+}
+
+/*
+ * Changes the ring depth and buffer size. Values <= 0 leave the setting
+ * unchanged. Slots in use are not affected, new settings take effect as
+ * slots are reused.
+ */
+void PipeRingConfigure(PipeRing *ringP, int depth, size_t bufsize)
+{
+    if (depth > 0)
+        ringP->depth = depth > PIPERING_MAX_DEPTH ? PIPERING_MAX_DEPTH : depth;
+    if (bufsize > 0)
+        ringP->bufsize = bufsize;
+}
+
+/* (Re)allocates the slot buffer if it does not match the ring buffer size */
+static int PipeRingAllocSlot(PipeRing *ringP, PipeRingSlot *slotP)
+{
+    if (slotP->p == NULL || slotP->size != ringP->bufsize) {
+        if (slotP->p)
+            free(slotP->p);
+        slotP->p = malloc(ringP->bufsize);
+        if (slotP->p == NULL) {
+            slotP->size = 0;
+            return PIPERING_E_NOMEM;
+        }
+        slotP->size = ringP->bufsize;
+    }
+    return 0;
+}
+
+/*
+ * Records completion of the I/O posted on a slot. May be called from any
+ * thread. Returns 1 if the slot state changed, 0 if the slot did not
+ * have I/O posted.
+ */
+int PipeRingComplete(PipeRing *ringP, int slot, size_t nbytes, int err)
+{
+    PipeRingSlot *slotP = &ringP->slots[slot];
+
+    if (PipeRingLoad(&slotP->state) != PIPERING_SLOT_POSTED)
+        return 0;
+    slotP->len = nbytes;
+    slotP->err = err;
+    return PipeRingCas(&slotP->state, PIPERING_SLOT_DONE,
+                       PIPERING_SLOT_POSTED) == PIPERING_SLOT_POSTED;
+}
+
+/*
+ * Returns 1 if the oldest slot has completed. For read rings this means
+ * data or an error is available, for write rings that PipeRingReap has
+ * work to do.
+ */
+int PipeRingReady(PipeRing *ringP)
+{
+    return ringP->count > 0 &&
+        PipeRingLoad(&ringP->slots[ringP->head].state) == PIPERING_SLOT_DONE;
+}
+
+/* Marks a slot whose post failed as completed with an error */
+static void PipeRingPostFailed(PipeRing *ringP, PipeRingSlot *slotP, int err)
+{
+    slotP->len = 0;
+    slotP->err = err;
+    PipeRingStore(&slotP->state, PIPERING_SLOT_DONE);
+    ringP->err = err;
+}
+
+/*
+ * Posts reads on free slots until the ring depth is reached. Returns the
+ * ring error, if any. A failed post shows up as an error in the data
+ * stream after any data from preceding slots.
+ */
+int PipeRingFill(PipeRing *ringP)
+{
+    while (ringP->err == 0 && ringP->count < ringP->depth) {
+        int slot = PIPERING_INDEX(ringP, ringP->count);
+        PipeRingSlot *slotP = &ringP->slots[slot];
+        int err;
+
+        ringP->count++;
+        err = PipeRingAllocSlot(ringP, slotP);
+        if (err == 0) {
+            slotP->len = 0;
+            slotP->off = 0;
+            slotP->err = 0;
+            /* Must be set before posting as completion may be immediate */
+            PipeRingStore(&slotP->state, PIPERING_SLOT_POSTED);
+            err = ringP->post(ringP->ctx, slot, slotP->p, slotP->size);
+        }
+        if (err)
+            PipeRingPostFailed(ringP, slotP, err);
+    }
+    return ringP->err;
+}
+
+/*
+ * Copies up to sz bytes of received data into bufP, reposting reads on
+ * slots that are emptied. Returns the number of bytes copied. If 0, *errP
+ * is set to the error that ended the data stream or to 0 if no data is
+ * available yet. Errors are sticky.
+ */
+size_t PipeRingRead(PipeRing *ringP, char *bufP, size_t sz, int *errP)
+{
+    size_t nread = 0;
+
+    *errP = 0;
+    while (nread < sz && ringP->count > 0) {
+        PipeRingSlot *slotP = &ringP->slots[ringP->head];
+        size_t n;
+
+        if (PipeRingLoad(&slotP->state) != PIPERING_SLOT_DONE)
+            break;
+        if (slotP->err) {
+            /* Error slot stays at the head so the error is sticky */
+            if (ringP->err == 0)
+                ringP->err = slotP->err;
+            if (nread == 0)
+                *errP = slotP->err;
+            break;
+        }
+        n = slotP->len - slotP->off;
+        if (n > sz - nread)
+            n = sz - nread;
+        memcpy(bufP + nread, slotP->p + slotP->off, n);
+        nread += n;
+        slotP->off += n;
+        if (slotP->off == slotP->len) {
+            PipeRingStore(&slotP->state, PIPERING_SLOT_FREE);
+            ringP->head = PIPERING_INDEX(ringP, 1);
+            ringP->count--;
+        }
+    }
+
+    PipeRingFill(ringP);
+    return nread;
+}
+
+/*
+ * Copies up to len bytes into write slots and submits them. Returns the
+ * number of bytes accepted which may be less than len (or 0) if all
+ * slots are in use or the ring has an error.
+ */
+size_t PipeRingWrite(PipeRing *ringP, const char *bufP, size_t len)
+{
+    size_t written = 0;
+
+    while (written < len && ringP->err == 0) {
+        PipeRingSlot *slotP = NULL;
+        size_t n;
+
+        if (ringP->count > 0) {
+            slotP = &ringP->slots[PIPERING_INDEX(ringP, ringP->count - 1)];
+            if (slotP->state != PIPERING_SLOT_FILLING || slotP->len == slotP->size)
+                slotP = NULL;
+        }
+        if (slotP == NULL) {
+            if (ringP->count >= ringP->depth)
+                break;
+            slotP = &ringP->slots[PIPERING_INDEX(ringP, ringP->count)];
+            if (PipeRingAllocSlot(ringP, slotP) != 0) {
+                ringP->err = PIPERING_E_NOMEM;
+                break;
+            }
+            slotP->len = 0;
+            slotP->off = 0;
+            slotP->err = 0;
+            slotP->state = PIPERING_SLOT_FILLING;
+            ringP->count++;
+        }
+        n = slotP->size - slotP->len;
+        if (n > len - written)
+            n = len - written;
+        memcpy(slotP->p + slotP->len, bufP + written, n);
+        slotP->len += n;
+        written += n;
+    }
+
+    PipeRingSubmit(ringP, 0);
+    return written;
+}
+
+/*
+ * Posts writes for FILLING slots. Full slots are always posted. The last
+ * partially filled slot is only posted if no writes are in flight or
+ * force is non-zero. Returns the ring error, if any.
+ */
+int PipeRingSubmit(PipeRing *ringP, int force)
+{
+    int i;
+
+    for (i = 0; i < ringP->count && ringP->err == 0; ++i) {
+        int slot = PIPERING_INDEX(ringP, i);
+        PipeRingSlot *slotP = &ringP->slots[slot];
+        int err;
+
+        if (slotP->state != PIPERING_SLOT_FILLING)
+            continue;
+        if (slotP->len < slotP->size && ringP->inflight > 0 && !force)
+            break;
+        ringP->inflight++;      /* Released in PipeRingReap */
+        PipeRingStore(&slotP->state, PIPERING_SLOT_POSTED);
+        err = ringP->post(ringP->ctx, slot, slotP->p, slotP->len);
+        if (err)
+            PipeRingPostFailed(ringP, slotP, err);
+    }
+    return ringP->err;
+}
+
+/*
+ * Releases completed write slots, recording the first error, and submits
+ * any output gathered in the meanwhile. Returns the ring error, if any.
+ */
+int PipeRingReap(PipeRing *ringP)
+{
+    while (ringP->count > 0) {
+        PipeRingSlot *slotP = &ringP->slots[ringP->head];
+        if (PipeRingLoad(&slotP->state) != PIPERING_SLOT_DONE)
+            break;
+        if (slotP->err && ringP->err == 0)
+            ringP->err = slotP->err;
+        slotP->state = PIPERING_SLOT_FREE;
+        ringP->head = PIPERING_INDEX(ringP, 1);
+        ringP->count--;
+        ringP->inflight--;
+    }
+    return PipeRingSubmit(ringP, 0);
+}
+
+#ifdef PIPERING_TEST
+/*
+ * Test driver. Runs read and write rings against a fake pipe whose
+ * "kernel" fills posted reads and drains posted writes in posting order
+ * and delivers completions in random order, optionally from a separate
+ * thread.
+ *   cc -O2 -DPIPERING_TEST pipering.c -lpthread -o pipering_test
+ *   ./pipering_test           - randomized single threaded and threaded runs
+ *   ./pipering_test bench     - additionally measures threaded throughput
+ */
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#ifndef PIPERING_TEST_BYTES
+#define PIPERING_TEST_BYTES 20000000 /* Threaded test size, reduce for TSan */
+#endif
+
+#define FAKE_EOF        109     /* ERROR_BROKEN_PIPE */
+#define FAKE_POSTERR    232     /* ERROR_NO_DATA */
+
+typedef struct FakeOp {
+    int slot;
+    char *p;
+    size_t len;
+    size_t nbytes;
+    int err;
+} FakeOp;
+
+typedef struct FakePipe {
+    PipeRing ring;
+    pthread_mutex_t lock;
+    FakeOp queued[PIPERING_MAX_DEPTH];  /* Posted, FIFO */
+    int nqueued;
+    FakeOp finished[PIPERING_MAX_DEPTH]; /* Done, completion not delivered */
+    int nfinished;
+    unsigned long long avail;   /* Read: bytes written by peer */
+    unsigned long long moved;   /* Bytes transferred by the kernel */
+    unsigned long long total;   /* Size of the test stream */
+    unsigned long posts;
+    unsigned long fail_at;      /* Post number that fails, 0 -> none */
+    int eof;
+    int stop;                   /* Reader is done, kernel thread may exit */
+    int nofill;                 /* Do not generate data (benchmarks) */
+    unsigned int seed;
+} FakePipe;
+
+static unsigned char StreamByte(unsigned long long i)
+{
+    i ^= i >> 7;
+    return (unsigned char) ((i * 0x9E3779B1u) >> 5);
+}
+
+static unsigned int FakeRand(unsigned int *seedP)
+{
+    *seedP = *seedP * 1103515245u + 12345u;
+    return (*seedP >> 8) & 0xffffff;
+}
+
+static int FakePost(void *ctx, int slot, char *p, size_t len)
+{
+    FakePipe *fpP = ctx;
+    int err = 0;
+
+    pthread_mutex_lock(&fpP->lock);
+    if (++fpP->posts == fpP->fail_at) {
+        err = FAKE_POSTERR;
+    } else {
+        FakeOp *opP = &fpP->queued[fpP->nqueued++];
+        opP->slot = slot;
+        opP->p = p;
+        opP->len = len;
+    }
+    pthread_mutex_unlock(&fpP->lock);
+    return err;
+}
+
+/* Kernel side of a read. Fills the oldest posted read if possible. */
+static int FakeKernelRead(FakePipe *fpP)
+{
+    FakeOp op;
+    size_t i;
+
+    if (fpP->nqueued == 0)
+        return 0;
+    op = fpP->queued[0];
+    if (fpP->avail > fpP->moved) {
+        op.nbytes = op.len;
+        if (op.nbytes > fpP->avail - fpP->moved)
+            op.nbytes = (size_t) (fpP->avail - fpP->moved);
+        if (fpP->nofill)
+            memset(op.p, 0, op.nbytes);
+        else {
+            for (i = 0; i < op.nbytes; ++i)
+                op.p[i] = StreamByte(fpP->moved + i);
+        }
+        fpP->moved += op.nbytes;
+        op.err = 0;
+    } else if (fpP->eof) {
+        op.nbytes = 0;
+        op.err = FAKE_EOF;
+    } else {
+        return 0;
+    }
+    memmove(&fpP->queued[0], &fpP->queued[1],
+            --fpP->nqueued * sizeof(fpP->queued[0]));
+    fpP->finished[fpP->nfinished++] = op;
+    return 1;
+}
+
+/* Kernel side of a write. Drains the oldest posted write. */
+static int FakeKernelWrite(FakePipe *fpP, int *badP)
+{
+    FakeOp op;
+    size_t i;
+
+    if (fpP->nqueued == 0)
+        return 0;
+    op = fpP->queued[0];
+    for (i = 0; i < op.len; ++i) {
+        if ((unsigned char) op.p[i] != StreamByte(fpP->moved + i)) {
+            *badP = 1;
+            break;
+        }
+    }
+    fpP->moved += op.len;
+    op.nbytes = op.len;
+    op.err = 0;
+    memmove(&fpP->queued[0], &fpP->queued[1],
+            --fpP->nqueued * sizeof(fpP->queued[0]));
+    fpP->finished[fpP->nfinished++] = op;
+    return 1;
+}
+
+/* Delivers a random finished completion. Returns 0 if none. */
+static int FakeDeliver(FakePipe *fpP)
+{
+    FakeOp op;
+    int i;
+
+    pthread_mutex_lock(&fpP->lock);
+    if (fpP->nfinished == 0) {
+        pthread_mutex_unlock(&fpP->lock);
+        return 0;
+    }
+    i = FakeRand(&fpP->seed) % fpP->nfinished;
+    op = fpP->finished[i];
+    fpP->finished[i] = fpP->finished[--fpP->nfinished];
+    pthread_mutex_unlock(&fpP->lock);
+
+    if (!PipeRingComplete(&fpP->ring, op.slot, op.nbytes, op.err)) {
+        printf("Completion for slot %d not accepted\n", op.slot);
+        exit(1);
+    }
+    return 1;
+}
+
+static void FakeInit(FakePipe *fpP, unsigned int seed, int depth,
+                     size_t bufsize, unsigned long long total)
+{
+    memset(fpP, 0, sizeof(*fpP));
+    pthread_mutex_init(&fpP->lock, NULL);
+    fpP->seed = seed;
+    fpP->total = total;
+    PipeRingInit(&fpP->ring, FakePost, fpP, depth, bufsize);
+}
+
+/* Randomly reconfigures the ring the way fconfigure would */
+static void FakeReconfigure(FakePipe *fpP)
+{
+    if (FakeRand(&fpP->seed) % 64 == 0) {
+        PipeRingConfigure(&fpP->ring, 1 + FakeRand(&fpP->seed) % 8,
+                          1 + FakeRand(&fpP->seed) % 5000);
+    }
+}
+
+static int TestRead(unsigned int seed, unsigned long fail_at)
+{
+    FakePipe fp;
+    char buf[12000];
+    unsigned long long consumed = 0;
+    size_t i, n;
+    int err;
+
+    FakeInit(&fp, seed, 1 + seed % 8, 1 + seed % 3000, 200000 + seed % 1000);
+    fp.fail_at = fail_at;
+    PipeRingFill(&fp.ring);
+    for (;;) {
+        switch (FakeRand(&fp.seed) % 4) {
+        case 0:
+            /* Peer writes some data */
+            fp.avail += FakeRand(&fp.seed) % 6000;
+            if (fp.avail >= fp.total) {
+                fp.avail = fp.total;
+                fp.eof = 1;
+            }
+            break;
+        case 1:
+            pthread_mutex_lock(&fp.lock);
+            FakeKernelRead(&fp);
+            pthread_mutex_unlock(&fp.lock);
+            break;
+        case 2:
+            FakeDeliver(&fp);
+            break;
+        case 3:
+            FakeReconfigure(&fp);
+            n = PipeRingRead(&fp.ring, buf,
+                             1 + FakeRand(&fp.seed) % sizeof(buf), &err);
+            for (i = 0; i < n; ++i) {
+                if ((unsigned char) buf[i] != StreamByte(consumed + i)) {
+                    printf("read seed %u: data mismatch at offset %llu\n",
+                           seed, consumed + i);
+                    return 1;
+                }
+            }
+            consumed += n;
+            if (n == 0 && err) {
+                if (err == FAKE_POSTERR && fail_at) {
+                    /* Injected failure must not lose preceding data */
+                    if (consumed != fp.moved) {
+                        printf("read seed %u: lost data before error\n", seed);
+                        return 1;
+                    }
+                    goto done;
+                }
+                if (err != FAKE_EOF || consumed != fp.total) {
+                    printf("read seed %u: error %d after %llu of %llu bytes\n",
+                           seed, err, consumed, fp.total);
+                    return 1;
+                }
+                /* Errors must be sticky */
+                if (PipeRingRead(&fp.ring, buf, 10, &err) != 0 || err != FAKE_EOF) {
+                    printf("read seed %u: EOF not sticky\n", seed);
+                    return 1;
+                }
+                goto done;
+            }
+            break;
+        }
+    }
+done:
+    /* Drain outstanding completions before freeing buffers */
+    pthread_mutex_lock(&fp.lock);
+    while (FakeKernelRead(&fp))
+        ;
+    pthread_mutex_unlock(&fp.lock);
+    while (FakeDeliver(&fp))
+        ;
+    PipeRingFree(&fp.ring);
+    return 0;
+}
+
+static int TestWrite(unsigned int seed, unsigned long fail_at, int verbose)
+{
+    FakePipe fp;
+    char buf[12000];
+    unsigned long long produced = 0;
+    unsigned long writes = 0;
+    size_t i, n, len;
+    int bad = 0, err;
+
+    FakeInit(&fp, seed, 1 + seed % 8, 1 + seed % 3000, 200000 + seed % 1000);
+    fp.fail_at = fail_at;
+    while (produced < fp.total) {
+        switch (FakeRand(&fp.seed) % 4) {
+        case 0:
+        case 1:
+            len = 1 + FakeRand(&fp.seed) % 700;
+            if (len > fp.total - produced)
+                len = (size_t) (fp.total - produced);
+            for (i = 0; i < len; ++i)
+                buf[i] = StreamByte(produced + i);
+            FakeReconfigure(&fp);
+            n = PipeRingWrite(&fp.ring, buf, len);
+            produced += n;
+            ++writes;
+            if (fp.ring.err) {
+                if (!fail_at || fp.ring.err != FAKE_POSTERR) {
+                    printf("write seed %u: unexpected error %d\n", seed, fp.ring.err);
+                    return 1;
+                }
+                goto drain;
+            }
+            break;
+        case 2:
+            pthread_mutex_lock(&fp.lock);
+            FakeKernelWrite(&fp, &bad);
+            pthread_mutex_unlock(&fp.lock);
+            FakeDeliver(&fp);
+            break;
+        case 3:
+            err = PipeRingReap(&fp.ring);
+            if (err && !fail_at) {
+                printf("write seed %u: reap error %d\n", seed, err);
+                return 1;
+            }
+            break;
+        }
+    }
+
+    /* Flush whatever has been gathered and wait for it to drain */
+    PipeRingSubmit(&fp.ring, 1);
+drain:
+    while (fp.ring.count > 0 && fp.ring.err == 0) {
+        pthread_mutex_lock(&fp.lock);
+        FakeKernelWrite(&fp, &bad);
+        pthread_mutex_unlock(&fp.lock);
+        FakeDeliver(&fp);
+        PipeRingReap(&fp.ring);
+    }
+    pthread_mutex_lock(&fp.lock);
+    while (FakeKernelWrite(&fp, &bad))
+        ;
+    pthread_mutex_unlock(&fp.lock);
+    while (FakeDeliver(&fp))
+        ;
+    PipeRingReap(&fp.ring);
+    if (bad) {
+        printf("write seed %u: data mismatch\n", seed);
+        return 1;
+    }
+    if (!fail_at && fp.moved != fp.total) {
+        printf("write seed %u: wrote %llu of %llu bytes\n", seed, fp.moved, fp.total);
+        return 1;
+    }
+    if (verbose) {
+        printf("write: %lu writes gathered into %lu posts\n", writes, fp.posts);
+    }
+    PipeRingFree(&fp.ring);
+    return 0;
+}
+
+/* Kernel thread for the threaded read test */
+static void *KernelThread(void *arg)
+{
+    FakePipe *fpP = arg;
+    int done = 0;
+
+    while (!done) {
+        int progress;
+        pthread_mutex_lock(&fpP->lock);
+        if (fpP->avail < fpP->total) {
+            fpP->avail += fpP->ring.bufsize * 3;
+            if (fpP->avail >= fpP->total) {
+                fpP->avail = fpP->total;
+                fpP->eof = 1;
+            }
+        }
+        progress = FakeKernelRead(fpP);
+        done = fpP->stop && fpP->nqueued == 0 && fpP->nfinished == 0;
+        pthread_mutex_unlock(&fpP->lock);
+        progress |= FakeDeliver(fpP);
+        if (!progress)
+            sched_yield();
+    }
+    return NULL;
+}
+
+static int TestThreadedRead(unsigned long long total, size_t bufsize,
+                            int depth, int verify)
+{
+    FakePipe fp;
+    pthread_t tid;
+    char *buf;
+    unsigned long long consumed = 0;
+    size_t i, n;
+    int err = 0, status = 0;
+
+    buf = malloc(bufsize);
+    FakeInit(&fp, 1, depth, bufsize, total);
+    fp.nofill = !verify;
+    PipeRingFill(&fp.ring);
+    pthread_create(&tid, NULL, KernelThread, &fp);
+    for (;;) {
+        n = PipeRingRead(&fp.ring, buf, bufsize, &err);
+        if (verify) {
+            for (i = 0; i < n; ++i) {
+                if ((unsigned char) buf[i] != StreamByte(consumed + i)) {
+                    printf("threaded read: mismatch at %llu\n", consumed + i);
+                    status = 1;
+                    break;
+                }
+            }
+        }
+        consumed += n;
+        if (status || (n == 0 && err))
+            break;
+        if (n == 0)
+            sched_yield();
+    }
+    /* Kernel thread fails remaining posted reads with EOF and exits */
+    pthread_mutex_lock(&fp.lock);
+    fp.stop = 1;
+    fp.avail = fp.total;
+    fp.eof = 1;
+    pthread_mutex_unlock(&fp.lock);
+    pthread_join(tid, NULL);
+    if (!status && (err != FAKE_EOF || consumed != total)) {
+        printf("threaded read: error %d after %llu of %llu bytes\n",
+               err, consumed, total);
+        status = 1;
+    }
+    PipeRingFree(&fp.ring);
+    free(buf);
+    return status;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int seed;
+    int failures = 0;
+
+    for (seed = 1; seed <= 300; ++seed) {
+        failures += TestRead(seed, 0);
+        failures += TestRead(seed, 1 + seed % 40);
+        failures += TestWrite(seed, 0, seed == 300);
+        failures += TestWrite(seed, 1 + seed % 40, 0);
+    }
+    failures += TestThreadedRead(PIPERING_TEST_BYTES, 4096, 4, 1);
+    failures += TestThreadedRead(PIPERING_TEST_BYTES, 65536, 8, 1);
+    printf("%s\n", failures ? "FAILED" : "All tests OK");
+
+    if (argc > 1 && !strcmp(argv[1], "bench")) {
+        static const struct { size_t bufsize; int depth; } cfg[] = {
+            {4096, 1}, {4096, 4}, {65536, 4}, {1048576, 8}
+        };
+        for (seed = 0; seed < sizeof(cfg)/sizeof(cfg[0]); ++seed) {
+            struct timespec t0, t1;
+            double secs;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            TestThreadedRead(2000000000ULL, cfg[seed].bufsize, cfg[seed].depth, 0);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+            printf("bufsize %7lu depth %d: %.0f MB/s\n",
+                   (unsigned long) cfg[seed].bufsize, cfg[seed].depth,
+                   2000.0 / secs);
+        }
+    }
+    return failures ? 1 : 0;
+}
+#endif
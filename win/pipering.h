@@ -0,0 +1,86 @@
+#ifndef PIPERING_H
+#define PIPERING_H
+
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Buffer rings for overlapped pipe I/O. A ring is a fixed array of slots,
+ * each owning a buffer, that are used in FIFO order. A read ring keeps
+ * reads posted into all free slots and hands out data from completed slots
+ * in the order they were posted. A write ring gathers output into slots
+ * and submits them, keeping several writes outstanding.
+ *
+ * The ring does no I/O itself. Reads and writes are started through a
+ * caller supplied post function and their completions are reported with
+ * PipeRingComplete which may be called from any thread. All other calls
+ * must be made from a single owning thread. Only the C library is
+ * needed so the state machine can be tested with a fake I/O backend on
+ * any platform.
+ */
+
+#include <stddef.h>
+
+#define PIPERING_MAX_DEPTH 32
+
+/* Error code used when a slot buffer cannot be allocated */
+#ifndef PIPERING_E_NOMEM
+#define PIPERING_E_NOMEM 8      /* ERROR_NOT_ENOUGH_MEMORY */
+#endif
+
+/* Slot states */
+#define PIPERING_SLOT_FREE      0 /* Not in use */
+#define PIPERING_SLOT_FILLING   1 /* Write rings only - gathering output */
+#define PIPERING_SLOT_POSTED    2 /* I/O outstanding */
+#define PIPERING_SLOT_DONE      3 /* I/O completed, see err field */
+
+typedef struct PipeRingSlot {
+    char  *p;                   /* Buffer, allocated on first use */
+    size_t size;                /* Allocated size of p */
+    size_t len;                 /* Reads - bytes received,
+                                   writes - bytes to be written */
+    size_t off;                 /* Reads - bytes already handed out */
+    int    err;                 /* Completion status, 0 on success */
+    volatile long state;        /* PIPERING_SLOT_*. Only the transition
+                                   from POSTED is made by other threads */
+} PipeRingSlot;
+
+/*
+ * Starts an asynchronous read into, or write from, p. Returns 0 if the
+ * operation was started (even if it completed synchronously) in which
+ * case PipeRingComplete must eventually be called for the slot. Any other
+ * value is an error code and no completion will be reported.
+ */
+typedef int PipeRingPostFn(void *ctx, int slot, char *p, size_t len);
+
+typedef struct PipeRing {
+    PipeRingSlot slots[PIPERING_MAX_DEPTH];
+    PipeRingPostFn *post;
+    void   *ctx;
+    size_t  bufsize;            /* Size of newly allocated slot buffers */
+    int     depth;              /* Maximum number of slots in use */
+    int     head;               /* Oldest slot in use */
+    int     count;              /* Number of slots in use */
+    int     inflight;           /* Write rings - number of POSTED slots */
+    int     err;                /* Sticky error, no I/O is posted once set */
+} PipeRing;
+
+void   PipeRingInit(PipeRing *ringP, PipeRingPostFn *post, void *ctx,
+                    int depth, size_t bufsize);
+void   PipeRingFree(PipeRing *ringP);
+void   PipeRingConfigure(PipeRing *ringP, int depth, size_t bufsize);
+int    PipeRingComplete(PipeRing *ringP, int slot, size_t nbytes, int err);
+int    PipeRingReady(PipeRing *ringP);
+
+/* Read rings */
+int    PipeRingFill(PipeRing *ringP);
+size_t PipeRingRead(PipeRing *ringP, char *bufP, size_t sz, int *errP);
+
+/* Write rings */
+size_t PipeRingWrite(PipeRing *ringP, const char *bufP, size_t len);
+int    PipeRingSubmit(PipeRing *ringP, int force);
+int    PipeRingReap(PipeRing *ringP);
+
+#endif
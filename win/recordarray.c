@@ -7,6 +7,7 @@
 
 #include "twapi.h"
 #include "twapi_base.h"
+#include "ipaddr.h"
 
 int Twapi_RecordArrayHelperObjCmd(
     ClientData clientData,
@@ -34,9 +35,9 @@ int Twapi_RecordArrayHelperObjCmd(
     enum format_enum {RA_ARRAY, RA_FLAT, RA_LIST, RA_DICT};
     int format = RA_ARRAY;
     static const char *filter_ops[] = {
-        "eq", "ne", "~", "!~", "==", "!=", "<", "<=", ">", ">=", NULL
+        "eq", "ne", "~", "!~", "==", "!=", "<", "<=", ">", ">=", "in", "ni", NULL
     };
-    enum filter_ops_enum {RA_EQ, RA_NE, RA_MATCH, RA_NOMATCH, RA_EQ_INT, RA_NE_INT, RA_LT_INT, RA_LE_INT, RA_GT_INT, RA_GE_INT};
+    enum filter_ops_enum {RA_EQ, RA_NE, RA_MATCH, RA_NOMATCH, RA_EQ_INT, RA_NE_INT, RA_LT_INT, RA_LE_INT, RA_GT_INT, RA_GE_INT, RA_IN_CIDR, RA_NI_CIDR};
 
     Tcl_Obj *sliceObj = NULL,
         *filterObj = NULL,
@@ -54,6 +55,7 @@ int Twapi_RecordArrayHelperObjCmd(
         union {
             Tcl_WideInt wide;
             char *string;
+            IpSet *ipset;       /* Holds a reference */
         } operand;
         int (WINAPI *cmpfn) (const char *, const char *);
         int filter_pos;
@@ -97,7 +99,8 @@ int Twapi_RecordArrayHelperObjCmd(
      *      dict - each returned record is a dict with keys being field names
      *   -filter {{FIELDNAME OPERATOR OPERAND ?-nocase?}....}
      *      Only those records whose field FIELDNAME match OPERAND using
-     *      the given OPERATOR are returned
+     *      the given OPERATOR are returned. For the in and ni operators
+     *      OPERAND is a list of CIDR prefixes
      *   -key KEYFIELD
      *      Only used if -format is specified as 'list' or 'dict'.
      *      The returned value is a dictionary with KEYFIELD as the key
@@ -171,6 +174,8 @@ int Twapi_RecordArrayHelperObjCmd(
         if (res != TCL_OK)
             goto vamoose;
         filters = MemLifoAlloc(ticP->memlifoP, nfilters * sizeof(*filters), NULL);
+        /* Zero so vamoose only releases the address sets created */
+        TwapiZeroMemory(filters, nfilters * sizeof(*filters));
         for (i = 0; i < nfilters; ++i) {
             Tcl_Obj **filterElem;
             res = ObjGetElements(interp, filterElems[i], &j, &filterElem);
@@ -217,6 +222,15 @@ int Twapi_RecordArrayHelperObjCmd(
                 filters[i].cmpfn = filters[i].nocase ? TwapiGlobCmpCase : TwapiGlobCmp;
                 filters[i].operand.string = ObjToString(filterElem[2]);
                 break;
+            case RA_NI_CIDR: filters[i].negate = 1; /* FALLTHRU */
+            case RA_IN_CIDR:
+                /* Compiled prefix set is cached in the operand */
+                filters[i].operand.ipset = IpSetFromObj(interp, filterElem[2]);
+                if (filters[i].operand.ipset == NULL) {
+                    res = TCL_ERROR;
+                    goto vamoose;
+                }
+                break;
             }
         }
     }
@@ -317,6 +331,15 @@ int Twapi_RecordArrayHelperObjCmd(
                     }
                 }
                 break;
+            case RA_IN_CIDR:
+            case RA_NI_CIDR:
+                {
+                    IpAddr addr;
+                    /* Like integers, non-addresses never match */
+                    match = IpAddrFromObj(NULL, valueObj, &addr) == TCL_OK &&
+                        (IpSetMatch(filters[j].operand.ipset, &addr) >= 0) != filters[j].negate;
+                }
+                break;
             default:
                 if ((0 == filters[j].cmpfn(ObjToString(valueObj), filters[j].operand.string)) == filters[j].negate) {
                     match = 0;
@@ -427,6 +450,14 @@ int Twapi_RecordArrayHelperObjCmd(
     }
 
 vamoose:
+    if (filters) {
+        for (i = 0; i < nfilters; ++i) {
+            if ((filters[i].filter_op == RA_IN_CIDR ||
+                 filters[i].filter_op == RA_NI_CIDR) &&
+                filters[i].operand.ipset)
+                IpSetUnref(filters[i].operand.ipset);
+        }
+    }
     if (filterObj)
         ObjDecrRefs(filterObj);
     if (recsObj)
@@ -0,0 +1,1477 @@
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Offline registry hive reader. See regf.h.
+ *
+ * Build with -DREGF_TEST to get a standalone test against generated
+ * hives and a benchmark of parallel walks against walking in script
+ * (see end of file).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "regf.h"
+
+#define REGF_HEADER_SIZE     4096
+#define REGF_SEGMENT_SIZE    16344 /* Data bytes per big data segment */
+#define REGF_NK_NAME         76    /* Offset of name in nk cells */
+#define REGF_VK_NAME         20    /* Offset of name in vk cells */
+#define REGF_KEY_COMP_NAME   0x0020
+#define REGF_VALUE_COMP_NAME 0x0001
+#define REGF_NO_CELL         0xffffffff
+
+unsigned int RegfGetU32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+static unsigned int RegfGetU16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static Tcl_WideUInt RegfGetU64(const unsigned char *p)
+{
+    return RegfGetU32(p) | ((Tcl_WideUInt) RegfGetU32(p + 4) << 32);
+}
+
+/*
+ * Returns a pointer to the data of the cell at off and its length in
+ * *lenP, or NULL if the cell does not lie within the hive bins. Free
+ * cells (positive sizes) are accepted as damaged hives may reference
+ * them and their contents are usually still intact.
+ */
+static const unsigned char *RegfCell(const RegfHive *hiveP, unsigned int off,
+                                     unsigned int *lenP)
+{
+    unsigned int size;
+
+    if (hiveP->bins_size < 4 || off > hiveP->bins_size - 4)
+        return NULL;
+    size = RegfGetU32(hiveP->bins + off);
+    if (size & 0x80000000)
+        size = 0u - size;       /* Allocated cells have negative sizes */
+    if (size < 4 || size > hiveP->bins_size - off)
+        return NULL;
+    *lenP = size - 4;
+    return hiveP->bins + off + 4;
+}
+
+int RegfOpen(RegfHive *hiveP, const void *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    RegfKeyInfo info;
+    unsigned int bins_size;
+
+    if (size < REGF_HEADER_SIZE || memcmp(p, "regf", 4) != 0 ||
+        RegfGetU32(p + 20) != 1)  /* Major version */
+        return REGF_E_BADDB;
+
+    /* Trust the file size over the header for truncated copies */
+    bins_size = RegfGetU32(p + 40);
+    if (bins_size > size - REGF_HEADER_SIZE)
+        bins_size = (unsigned int) (size - REGF_HEADER_SIZE);
+
+    hiveP->base = p;
+    hiveP->bins = p + REGF_HEADER_SIZE;
+    hiveP->bins_size = bins_size;
+    hiveP->root = RegfGetU32(p + 36);
+    hiveP->big_data = RegfGetU32(p + 24) >= 4; /* Minor version */
+    return RegfGetKey(hiveP, hiveP->root, &info);
+}
+
+int RegfGetKey(const RegfHive *hiveP, unsigned int key, RegfKeyInfo *infoP)
+{
+    const unsigned char *p;
+    unsigned int len;
+
+    p = RegfCell(hiveP, key, &len);
+    if (p == NULL || len < REGF_NK_NAME || p[0] != 'n' || p[1] != 'k')
+        return REGF_E_BADDB;
+    infoP->name.p = p + REGF_NK_NAME;
+    infoP->name.len = RegfGetU16(p + 72);
+    infoP->name.latin1 = (RegfGetU16(p + 2) & REGF_KEY_COMP_NAME) != 0;
+    if ((unsigned int) infoP->name.len > len - REGF_NK_NAME)
+        return REGF_E_BADDB;
+    infoP->last_write = RegfGetU64(p + 4);
+    infoP->nsubkeys = RegfGetU32(p + 20);
+    infoP->subkey_list = RegfGetU32(p + 28);
+    infoP->nvalues = RegfGetU32(p + 36);
+    infoP->value_list = RegfGetU32(p + 40);
+    infoP->class_name = RegfGetU32(p + 48);
+    infoP->class_len = RegfGetU16(p + 74);
+    return 0;
+}
+
+typedef struct RegfOffsets {
+    unsigned int *v;
+    unsigned int n;
+    unsigned int size;
+} RegfOffsets;
+
+/*
+ * Appends the key offsets in a subkey list. lf and lh lists hold
+ * offset/hash pairs, li lists plain offsets and ri lists offsets of
+ * other lists, which may not themselves be ri lists.
+ */
+static int RegfCollectSubkeys(const RegfHive *hiveP, unsigned int list,
+                              int nested, RegfOffsets *offsP)
+{
+    const unsigned char *p;
+    unsigned int len, count, stride, i;
+    int ri;
+
+    p = RegfCell(hiveP, list, &len);
+    if (p == NULL || len < 4)
+        return REGF_E_BADDB;
+    ri = 0;
+    if (p[0] == 'l' && (p[1] == 'f' || p[1] == 'h'))
+        stride = 8;
+    else if (p[0] == 'l' && p[1] == 'i')
+        stride = 4;
+    else if (p[0] == 'r' && p[1] == 'i' && ! nested) {
+        stride = 4;
+        ri = 1;
+    } else
+        return REGF_E_BADDB;
+
+    count = RegfGetU16(p + 2);
+    if (count > (len - 4) / stride)
+        return REGF_E_BADDB;
+    for (i = 0; i < count; ++i) {
+        unsigned int off = RegfGetU32(p + 4 + i * stride);
+        if (ri) {
+            int status = RegfCollectSubkeys(hiveP, off, 1, offsP);
+            if (status)
+                return status;
+        } else {
+            if (offsP->n == offsP->size) {
+                offsP->size = offsP->size ? 2 * offsP->size : 16;
+                offsP->v = (unsigned int *) ckrealloc(
+                    (char *) offsP->v, offsP->size * sizeof(unsigned int));
+            }
+            offsP->v[offsP->n++] = off;
+        }
+    }
+    return 0;
+}
+
+int RegfSubkeys(const RegfHive *hiveP, unsigned int key,
+                unsigned int **keysP, unsigned int *nkeysP)
+{
+    RegfKeyInfo info;
+    RegfOffsets offs;
+    int status;
+
+    *keysP = NULL;
+    *nkeysP = 0;
+    if ((status = RegfGetKey(hiveP, key, &info)) != 0)
+        return status;
+    if (info.nsubkeys == 0 || info.subkey_list == REGF_NO_CELL)
+        return 0;
+    offs.v = NULL;
+    offs.n = 0;
+    offs.size = 0;
+    status = RegfCollectSubkeys(hiveP, info.subkey_list, 0, &offs);
+    if (status) {
+        if (offs.v)
+            ckfree((char *) offs.v);
+        return status;
+    }
+    *keysP = offs.v;
+    *nkeysP = offs.n;
+    return 0;
+}
+
+static void RegfAppendUtf8(Tcl_DString *dsP, unsigned int ch)
+{
+    char buf[4];
+    int n;
+
+    if (ch == 0) {
+        /* Tcl's internal form of NUL */
+        buf[0] = (char) 0xC0;
+        buf[1] = (char) 0x80;
+        n = 2;
+    } else if (ch < 0x80) {
+        buf[0] = (char) ch;
+        n = 1;
+    } else if (ch < 0x800) {
+        buf[0] = (char) (0xC0 | (ch >> 6));
+        buf[1] = (char) (0x80 | (ch & 0x3F));
+        n = 2;
+    } else if (ch < 0x10000) {
+        buf[0] = (char) (0xE0 | (ch >> 12));
+        buf[1] = (char) (0x80 | ((ch >> 6) & 0x3F));
+        buf[2] = (char) (0x80 | (ch & 0x3F));
+        n = 3;
+    } else {
+        buf[0] = (char) (0xF0 | (ch >> 18));
+        buf[1] = (char) (0x80 | ((ch >> 12) & 0x3F));
+        buf[2] = (char) (0x80 | ((ch >> 6) & 0x3F));
+        buf[3] = (char) (0x80 | (ch & 0x3F));
+        n = 4;
+    }
+    Tcl_DStringAppend(dsP, buf, n);
+}
+
+void RegfNameToUtf8(const RegfName *nameP, Tcl_DString *dsP)
+{
+    const unsigned char *p = nameP->p;
+    int i;
+
+    if (nameP->latin1) {
+        for (i = 0; i < nameP->len; ++i)
+            RegfAppendUtf8(dsP, p[i]);
+        return;
+    }
+    for (i = 0; i + 1 < nameP->len; i += 2) {
+        unsigned int ch = RegfGetU16(p + i);
+#if TCL_MAJOR_VERSION > 8
+        /* Tcl 8 keeps surrogates as separate characters as Windows does */
+        if (ch >= 0xD800 && ch < 0xDC00 && i + 3 < nameP->len) {
+            unsigned int lo = RegfGetU16(p + i + 2);
+            if (lo >= 0xDC00 && lo < 0xE000) {
+                ch = 0x10000 + ((ch - 0xD800) << 10) + (lo - 0xDC00);
+                i += 2;
+            }
+        }
+#endif
+        RegfAppendUtf8(dsP, ch);
+    }
+}
+
+/* Initializes dsP to the lower case UTF-8 form of a name */
+static void RegfFoldName(const char *s, int len, Tcl_DString *dsP)
+{
+    Tcl_DStringInit(dsP);
+    Tcl_DStringAppend(dsP, s, len);
+    Tcl_DStringSetLength(dsP, Tcl_UtfToLower(Tcl_DStringValue(dsP)));
+}
+
+int RegfFindKey(const RegfHive *hiveP, unsigned int key, const char *path,
+                unsigned int *foundP)
+{
+    while (*path) {
+        const char *end;
+        unsigned int *subkeys, nsubkeys, i;
+        Tcl_DString want;
+        int status;
+
+        if (*path == '\\') {
+            ++path;             /* Empty components are ignored */
+            continue;
+        }
+        for (end = path; *end && *end != '\\'; ++end)
+            ;
+        if ((status = RegfSubkeys(hiveP, key, &subkeys, &nsubkeys)) != 0)
+            return status;
+        RegfFoldName(path, (int) (end - path), &want);
+        for (i = 0; i < nsubkeys; ++i) {
+            RegfKeyInfo info;
+            Tcl_DString name, folded;
+            int match;
+            if (RegfGetKey(hiveP, subkeys[i], &info) != 0)
+                continue;
+            Tcl_DStringInit(&name);
+            RegfNameToUtf8(&info.name, &name);
+            RegfFoldName(Tcl_DStringValue(&name), Tcl_DStringLength(&name),
+                         &folded);
+            match = strcmp(Tcl_DStringValue(&folded),
+                           Tcl_DStringValue(&want)) == 0;
+            Tcl_DStringFree(&folded);
+            Tcl_DStringFree(&name);
+            if (match)
+                break;
+        }
+        Tcl_DStringFree(&want);
+        if (i == nsubkeys) {
+            if (subkeys)
+                ckfree((char *) subkeys);
+            return REGF_E_NOTFOUND;
+        }
+        key = subkeys[i];
+        ckfree((char *) subkeys);
+        path = end;
+    }
+    *foundP = key;
+    return 0;
+}
+
+int RegfValues(const RegfHive *hiveP, unsigned int key,
+               const unsigned char **valuesP, unsigned int *nvaluesP)
+{
+    RegfKeyInfo info;
+    const unsigned char *p;
+    unsigned int len;
+    int status;
+
+    *valuesP = NULL;
+    *nvaluesP = 0;
+    if ((status = RegfGetKey(hiveP, key, &info)) != 0)
+        return status;
+    if (info.nvalues == 0 || info.value_list == REGF_NO_CELL)
+        return 0;
+    p = RegfCell(hiveP, info.value_list, &len);
+    if (p == NULL || info.nvalues > len / 4)
+        return REGF_E_BADDB;
+    *valuesP = p;
+    *nvaluesP = info.nvalues;
+    return 0;
+}
+
+/*
+ * Assembles data of size bytes from the big data (db) cell at p. The
+ * size comes from the vk cell so it is checked against what the
+ * segments and the hive can hold before anything is allocated.
+ */
+static int RegfGetBigData(const RegfHive *hiveP, const unsigned char *p,
+                          unsigned int size, unsigned char **bufP)
+{
+    const unsigned char *segs;
+    unsigned char *buf;
+    unsigned int nsegs, len, got, i;
+
+    nsegs = RegfGetU16(p + 2);
+    segs = RegfCell(hiveP, RegfGetU32(p + 4), &len);
+    if (segs == NULL || nsegs > len / 4)
+        return REGF_E_BADDB;
+    /* nsegs is 16 bits so the product cannot overflow */
+    if (size > nsegs * REGF_SEGMENT_SIZE || size > hiveP->bins_size)
+        return REGF_E_BADDB;
+    buf = (unsigned char *) attemptckalloc(size);
+    if (buf == NULL)
+        return REGF_E_NOMEM;
+    for (i = 0, got = 0; i < nsegs && got < size; ++i) {
+        const unsigned char *seg;
+        unsigned int n;
+        seg = RegfCell(hiveP, RegfGetU32(segs + 4 * i), &n);
+        if (seg == NULL)
+            break;
+        if (n > REGF_SEGMENT_SIZE)
+            n = REGF_SEGMENT_SIZE; /* Rest is padding */
+        if (n > size - got)
+            n = size - got;
+        memcpy(buf + got, seg, n);
+        got += n;
+    }
+    if (got != size) {
+        ckfree((char *) buf);
+        return REGF_E_BADDB;
+    }
+    *bufP = buf;
+    return 0;
+}
+
+int RegfGetValue(const RegfHive *hiveP, unsigned int value, RegfValue *valP,
+                 unsigned char **freeP)
+{
+    const unsigned char *p, *data;
+    unsigned int len, size, datalen;
+
+    *freeP = NULL;
+    p = RegfCell(hiveP, value, &len);
+    if (p == NULL || len < REGF_VK_NAME || p[0] != 'v' || p[1] != 'k')
+        return REGF_E_BADDB;
+    valP->name.p = p + REGF_VK_NAME;
+    valP->name.len = RegfGetU16(p + 2);
+    valP->name.latin1 = (RegfGetU16(p + 16) & REGF_VALUE_COMP_NAME) != 0;
+    if ((unsigned int) valP->name.len > len - REGF_VK_NAME)
+        return REGF_E_BADDB;
+    valP->type = RegfGetU32(p + 12);
+
+    size = RegfGetU32(p + 4);
+    if (size & 0x80000000) {
+        /* Up to 4 bytes stored in place of the data offset */
+        size &= 0x7fffffff;
+        if (size > 4)
+            return REGF_E_BADDB;
+        valP->data = size ? p + 8 : NULL;
+        valP->len = size;
+        return 0;
+    }
+    if (size == 0) {
+        valP->data = NULL;
+        valP->len = 0;
+        return 0;
+    }
+    data = RegfCell(hiveP, RegfGetU32(p + 8), &datalen);
+    if (data == NULL)
+        return REGF_E_BADDB;
+    if (hiveP->big_data && size > REGF_SEGMENT_SIZE && datalen >= 8 &&
+        data[0] == 'd' && data[1] == 'b') {
+        int status = RegfGetBigData(hiveP, data, size, freeP);
+        if (status)
+            return status;
+        valP->data = *freeP;
+        valP->len = size;
+        return 0;
+    }
+    if (size > datalen)
+        return REGF_E_BADDB;
+    valP->data = data;
+    valP->len = size;
+    return 0;
+}
+
+/*
+ * Subtree walks. The starting key is expanded breadth first into a list
+ * of work items in depth first order until there are enough subtrees to
+ * keep the threads busy. Items are either a single key or a key and its
+ * whole subtree. Threads take items in turn and record the keys they
+ * visit in a per item buffer so the visit procedure can be called in
+ * order afterwards, in the calling thread.
+ */
+
+typedef struct RegfBuf {
+    char *p;
+    size_t len;
+    size_t size;
+} RegfBuf;
+
+/* Header of the records in item buffers, followed by the padded path */
+typedef struct RegfWalkRecord {
+    unsigned int key;
+    int depth;
+    int pathlen;
+} RegfWalkRecord;
+
+typedef struct RegfWalkItem {
+    unsigned int key;
+    int depth;
+    int subtree;                /* Walk descendants as well */
+    char *path;                 /* ckalloc'ed */
+    int pathlen;
+    RegfBuf out;
+    int keys;
+    int bad;
+} RegfWalkItem;
+
+typedef struct RegfWalkState {
+    const RegfHive *hiveP;
+    RegfWalkItem *items;
+    int nitems;
+    int next;                   /* Next item to walk, protected by lock */
+    Tcl_Mutex lock;
+    /*
+     * One byte per 8 bytes of cell space, set once a key is visited, so
+     * damaged hives with cycles or shared subtrees do not loop. Bytes are
+     * only ever set so unsynchronized access at worst visits a damaged
+     * shared key twice.
+     */
+    volatile unsigned char *seen;
+} RegfWalkState;
+
+static void RegfBufAppend(RegfBuf *bufP, const void *data, size_t n)
+{
+    if (bufP->len + n > bufP->size) {
+        bufP->size = 2 * (bufP->len + n) + 256;
+        bufP->p = ckrealloc(bufP->p, bufP->size);
+    }
+    memcpy(bufP->p + bufP->len, data, n);
+    bufP->len += n;
+}
+
+static void RegfWalkEmit(RegfWalkItem *itemP, unsigned int key, int depth,
+                         const char *path, int pathlen)
+{
+    static const char pad[sizeof(int)] = {0};
+    RegfWalkRecord rec;
+    int padlen = sizeof(int) - (pathlen % sizeof(int)); /* Includes \0 */
+
+    rec.key = key;
+    rec.depth = depth;
+    rec.pathlen = pathlen;
+    RegfBufAppend(&itemP->out, &rec, sizeof(rec));
+    RegfBufAppend(&itemP->out, path, pathlen);
+    RegfBufAppend(&itemP->out, pad, padlen);
+    itemP->keys++;
+}
+
+/* Returns 1 if key has not been seen before, marking it seen */
+static int RegfWalkMark(RegfWalkState *wsP, unsigned int key)
+{
+    if (wsP->seen[key >> 3])
+        return 0;
+    wsP->seen[key >> 3] = 1;
+    return 1;
+}
+
+/* Appends the child name, with separator, to the path of the parent */
+static void RegfWalkAppendName(Tcl_DString *pathP, const RegfKeyInfo *infoP)
+{
+    if (Tcl_DStringLength(pathP))
+        Tcl_DStringAppend(pathP, "\\", 1);
+    RegfNameToUtf8(&infoP->name, pathP);
+}
+
+/* Visits the descendants of key whose path is in pathP */
+static void RegfWalkChildren(RegfWalkState *wsP, RegfWalkItem *itemP,
+                             unsigned int key, int depth, Tcl_DString *pathP)
+{
+    unsigned int *subkeys, nsubkeys, i;
+    int pathlen = Tcl_DStringLength(pathP);
+
+    if (RegfSubkeys(wsP->hiveP, key, &subkeys, &nsubkeys) != 0) {
+        itemP->bad++;
+        return;
+    }
+    if (nsubkeys && depth >= REGF_MAX_DEPTH) {
+        itemP->bad++;
+        ckfree((char *) subkeys);
+        return;
+    }
+    for (i = 0; i < nsubkeys; ++i) {
+        RegfKeyInfo info;
+        if (RegfGetKey(wsP->hiveP, subkeys[i], &info) != 0 ||
+            ! RegfWalkMark(wsP, subkeys[i])) {
+            itemP->bad++;
+            continue;
+        }
+        RegfWalkAppendName(pathP, &info);
+        RegfWalkEmit(itemP, subkeys[i], depth + 1, Tcl_DStringValue(pathP),
+                     Tcl_DStringLength(pathP));
+        RegfWalkChildren(wsP, itemP, subkeys[i], depth + 1, pathP);
+        Tcl_DStringSetLength(pathP, pathlen);
+    }
+    if (subkeys)
+        ckfree((char *) subkeys);
+}
+
+static void RegfWalkRun(RegfWalkState *wsP)
+{
+    Tcl_DString path;
+
+    Tcl_DStringInit(&path);
+    while (1) {
+        RegfWalkItem *itemP;
+        int i;
+
+        Tcl_MutexLock(&wsP->lock);
+        i = wsP->next++;
+        Tcl_MutexUnlock(&wsP->lock);
+        if (i >= wsP->nitems)
+            break;
+        itemP = &wsP->items[i];
+        RegfWalkEmit(itemP, itemP->key, itemP->depth, itemP->path,
+                     itemP->pathlen);
+        if (itemP->subtree) {
+            Tcl_DStringSetLength(&path, 0);
+            Tcl_DStringAppend(&path, itemP->path, itemP->pathlen);
+            RegfWalkChildren(wsP, itemP, itemP->key, itemP->depth, &path);
+        }
+    }
+    Tcl_DStringFree(&path);
+}
+
+static Tcl_ThreadCreateType RegfWalkThread(ClientData clientdata)
+{
+    RegfWalkRun((RegfWalkState *) clientdata);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+static RegfWalkItem *RegfWalkAddItem(RegfWalkItem **itemsP, int *nitemsP,
+                                     int *sizeP)
+{
+    RegfWalkItem *itemP;
+    if (*nitemsP == *sizeP) {
+        *sizeP = *sizeP ? 2 * *sizeP : 16;
+        *itemsP = (RegfWalkItem *) ckrealloc((char *) *itemsP,
+                                             *sizeP * sizeof(RegfWalkItem));
+    }
+    itemP = &(*itemsP)[(*nitemsP)++];
+    memset(itemP, 0, sizeof(*itemP));
+    return itemP;
+}
+
+/*
+ * Splits subtree items into the key and its child subtrees, level by
+ * level, until there are at least target subtrees or nothing to split.
+ */
+static void RegfWalkExpand(RegfWalkState *wsP, int target, int *badP)
+{
+    int level;
+
+    for (level = 0; level < 16; ++level) {
+        RegfWalkItem *items = NULL;
+        int nitems = 0, size = 0, nsubtrees = 0, expanded = 0, i;
+
+        for (i = 0; i < wsP->nitems; ++i)
+            nsubtrees += wsP->items[i].subtree;
+        if (nsubtrees >= target)
+            return;
+
+        for (i = 0; i < wsP->nitems; ++i) {
+            RegfWalkItem *itemP = &wsP->items[i];
+            unsigned int *subkeys, nsubkeys, j;
+            Tcl_DString path;
+
+            if (! itemP->subtree || itemP->depth >= REGF_MAX_DEPTH ||
+                RegfSubkeys(wsP->hiveP, itemP->key, &subkeys, &nsubkeys) != 0
+                || nsubkeys == 0) {
+                /* Leave as is. Errors are counted when walked. */
+                *RegfWalkAddItem(&items, &nitems, &size) = *itemP;
+                continue;
+            }
+            expanded = 1;
+            itemP->subtree = 0;
+            *RegfWalkAddItem(&items, &nitems, &size) = *itemP;
+            Tcl_DStringInit(&path);
+            for (j = 0; j < nsubkeys; ++j) {
+                RegfWalkItem *childP;
+                RegfKeyInfo info;
+                if (RegfGetKey(wsP->hiveP, subkeys[j], &info) != 0 ||
+                    ! RegfWalkMark(wsP, subkeys[j])) {
+                    ++*badP;
+                    continue;
+                }
+                Tcl_DStringSetLength(&path, 0);
+                Tcl_DStringAppend(&path, itemP->path, itemP->pathlen);
+                RegfWalkAppendName(&path, &info);
+                childP = RegfWalkAddItem(&items, &nitems, &size);
+                childP->key = subkeys[j];
+                childP->depth = itemP->depth + 1;
+                childP->subtree = 1;
+                childP->pathlen = Tcl_DStringLength(&path);
+                childP->path = ckalloc(childP->pathlen + 1);
+                memcpy(childP->path, Tcl_DStringValue(&path),
+                       childP->pathlen + 1);
+            }
+            Tcl_DStringFree(&path);
+            ckfree((char *) subkeys);
+        }
+        ckfree((char *) wsP->items);
+        wsP->items = items;
+        wsP->nitems = nitems;
+        if (! expanded)
+            return;
+    }
+}
+
+int RegfWalk(const RegfHive *hiveP, unsigned int key, int nthreads,
+             RegfVisitProc *visit, void *ctx, RegfWalkStats *statsP)
+{
+    RegfWalkState ws;
+    RegfWalkItem *itemP;
+    RegfKeyInfo info;
+    Tcl_ThreadId *tids = NULL;
+    int i, nstarted, status, size;
+
+    statsP->keys = 0;
+    statsP->bad = 0;
+    statsP->threads = 1;
+    if ((status = RegfGetKey(hiveP, key, &info)) != 0)
+        return status;
+
+    ws.hiveP = hiveP;
+    ws.items = NULL;
+    ws.nitems = 0;
+    ws.next = 0;
+    ws.lock = NULL;
+    ws.seen = (volatile unsigned char *) ckalloc((hiveP->bins_size >> 3) + 1);
+    memset((void *) ws.seen, 0, (hiveP->bins_size >> 3) + 1);
+    size = 0;
+    itemP = RegfWalkAddItem(&ws.items, &ws.nitems, &size);
+    itemP->key = key;
+    itemP->subtree = 1;
+    itemP->path = ckalloc(1);
+    itemP->path[0] = '\0';
+    RegfWalkMark(&ws, key);
+
+    if (nthreads > 1)
+        RegfWalkExpand(&ws, 4 * nthreads, &statsP->bad);
+
+    nstarted = 0;
+    if (nthreads > 1 && ws.nitems > 1) {
+        tids = (Tcl_ThreadId *) ckalloc(nthreads * sizeof(Tcl_ThreadId));
+        for (i = 1; i < nthreads; ++i) {
+            if (Tcl_CreateThread(&tids[nstarted], RegfWalkThread, &ws,
+                                 TCL_THREAD_STACK_DEFAULT,
+                                 TCL_THREAD_JOINABLE) == TCL_OK)
+                ++nstarted;
+        }
+    }
+    RegfWalkRun(&ws);
+    for (i = 0; i < nstarted; ++i) {
+        int result;
+        Tcl_JoinThread(tids[i], &result);
+    }
+    if (tids)
+        ckfree((char *) tids);
+    statsP->threads = nstarted + 1;
+
+    status = 0;
+    for (i = 0; i < ws.nitems; ++i) {
+        RegfWalkItem *itemP = &ws.items[i];
+        size_t off = 0;
+        statsP->keys += itemP->keys;
+        statsP->bad += itemP->bad;
+        while (status == 0 && off < itemP->out.len) {
+            RegfWalkRecord rec;
+            RegfWalkEntry entry;
+            memcpy(&rec, itemP->out.p + off, sizeof(rec));
+            off += sizeof(rec);
+            entry.key = rec.key;
+            entry.depth = rec.depth;
+            entry.path = itemP->out.p + off;
+            entry.pathlen = rec.pathlen;
+            off += rec.pathlen + sizeof(int) - (rec.pathlen % sizeof(int));
+            status = visit(ctx, &entry);
+        }
+        if (itemP->out.p)
+            ckfree(itemP->out.p);
+        ckfree(itemP->path);
+    }
+    ckfree((char *) ws.items);
+    ckfree((char *) ws.seen);
+    Tcl_MutexFinalize(&ws.lock);
+    return status;
+}
+
+#ifdef REGF_TEST
+/*
+ * Standalone test. Build with
+ *   cc -DTCL_THREADS=1 -DREGF_TEST regf.c -ltcl
+ *
+ * Hives are generated from a nested list. Each key is
+ *   {NAME VALUES SUBKEYS}
+ * where VALUES is a list of {NAME TYPE DATA}. Types 1, 2 and 7 take
+ * strings, 4 and 11 integers, and others "fill BYTE COUNT" or a string
+ * whose bytes are stored. The list type used for subkeys and whether
+ * names are stored as UTF-16 can be chosen to exercise all cell layouts.
+ */
+#include <stdlib.h>
+
+typedef struct TestBuilder {
+    unsigned char *p;
+    size_t len;
+    size_t size;
+    const char *listtype;
+    int utf16;
+    Tcl_WideUInt last_write;
+} TestBuilder;
+
+static void TestPut16(unsigned char *p, unsigned int v)
+{
+    p[0] = (unsigned char) v;
+    p[1] = (unsigned char) (v >> 8);
+}
+
+static void TestPut32(unsigned char *p, unsigned int v)
+{
+    TestPut16(p, v & 0xffff);
+    TestPut16(p + 2, v >> 16);
+}
+
+/* Allocates a cell and returns its offset. Data is zeroed. */
+static unsigned int TestCell(TestBuilder *bP, unsigned int datalen)
+{
+    unsigned int size = (datalen + 4 + 7) & ~7u;
+    unsigned int off;
+
+    if (bP->len + size > bP->size) {
+        bP->size = 2 * (bP->len + size);
+        bP->p = (unsigned char *) ckrealloc((char *) bP->p, bP->size);
+    }
+    off = (unsigned int) (bP->len - REGF_HEADER_SIZE);
+    memset(bP->p + bP->len, 0, size);
+    TestPut32(bP->p + bP->len, 0u - size);
+    bP->len += size;
+    return off;
+}
+
+static unsigned char *TestData(TestBuilder *bP, unsigned int off)
+{
+    return bP->p + REGF_HEADER_SIZE + off + 4;
+}
+
+/* Encodes name as Latin-1 if possible, else UTF-16LE */
+static int TestEncodeName(TestBuilder *bP, const char *name, Tcl_DString *dsP)
+{
+    Tcl_UniChar ch;
+    const char *p;
+    int latin1 = ! bP->utf16;
+
+    Tcl_DStringInit(dsP);
+    for (p = name; *p && latin1; p += Tcl_UtfToUniChar(p, &ch))
+        if (Tcl_UtfToUniChar(p, &ch), ch > 0xff)
+            latin1 = 0;
+    for (p = name; *p; ) {
+        unsigned char buf[2];
+        p += Tcl_UtfToUniChar(p, &ch);
+        buf[0] = (unsigned char) ch;
+        buf[1] = (unsigned char) (ch >> 8);
+        Tcl_DStringAppend(dsP, (char *) buf, latin1 ? 1 : 2);
+    }
+    return latin1;
+}
+
+static void TestEncodeUtf16(const char *s, Tcl_DString *dsP)
+{
+    Tcl_UniChar ch;
+    unsigned char buf[2];
+
+    while (*s) {
+        s += Tcl_UtfToUniChar(s, &ch);
+        buf[0] = (unsigned char) ch;
+        buf[1] = (unsigned char) (ch >> 8);
+        Tcl_DStringAppend(dsP, (char *) buf, 2);
+    }
+    buf[0] = buf[1] = 0;
+    Tcl_DStringAppend(dsP, (char *) buf, 2);
+}
+
+static int TestBuildValue(Tcl_Interp *interp, TestBuilder *bP,
+                          Tcl_Obj *specObj, unsigned int *offP)
+{
+    Tcl_Obj **elems, **strs;
+    Tcl_DString name, data;
+    int nelems, type, latin1, i, nstrs, count, byte;
+    unsigned int off, len;
+    Tcl_WideInt wide;
+
+    if (Tcl_ListObjGetElements(interp, specObj, &nelems, &elems) != TCL_OK)
+        return TCL_ERROR;
+    if (nelems != 3 || Tcl_GetIntFromObj(interp, elems[1], &type) != TCL_OK) {
+        Tcl_SetResult(interp, "bad value spec", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    Tcl_DStringInit(&data);
+    switch (type) {
+    case REGF_REG_SZ:
+    case REGF_REG_EXPAND_SZ:
+        TestEncodeUtf16(Tcl_GetString(elems[2]), &data);
+        break;
+    case REGF_REG_MULTI_SZ:
+        if (Tcl_ListObjGetElements(interp, elems[2], &nstrs, &strs) != TCL_OK)
+            return TCL_ERROR;
+        for (i = 0; i < nstrs; ++i)
+            TestEncodeUtf16(Tcl_GetString(strs[i]), &data);
+        Tcl_DStringAppend(&data, "\0\0", 2);
+        break;
+    case REGF_REG_DWORD:
+    case REGF_REG_QWORD:
+        if (Tcl_GetWideIntFromObj(interp, elems[2], &wide) != TCL_OK)
+            return TCL_ERROR;
+        for (i = 0; i < (type == REGF_REG_DWORD ? 4 : 8); ++i) {
+            char c = (char) (wide >> (8 * i));
+            Tcl_DStringAppend(&data, &c, 1);
+        }
+        break;
+    default:
+        if (sscanf(Tcl_GetString(elems[2]), "fill %d %d", &byte,
+                   &count) == 2) {
+            Tcl_DStringSetLength(&data, count);
+            for (i = 0; i < count; ++i)
+                Tcl_DStringValue(&data)[i] = (char) (byte + i);
+        } else
+            Tcl_DStringAppend(&data, Tcl_GetString(elems[2]), -1);
+        break;
+    }
+
+    latin1 = TestEncodeName(bP, Tcl_GetString(elems[0]), &name);
+    *offP = off = TestCell(bP, REGF_VK_NAME + Tcl_DStringLength(&name));
+    len = Tcl_DStringLength(&data);
+    if (len <= 4) {
+        unsigned char *p = TestData(bP, off);
+        TestPut32(p + 4, len | 0x80000000);
+        memcpy(p + 8, Tcl_DStringValue(&data), len);
+    } else if (len > REGF_SEGMENT_SIZE) {
+        unsigned int nsegs = (len + REGF_SEGMENT_SIZE - 1) / REGF_SEGMENT_SIZE;
+        unsigned int db = TestCell(bP, 8);
+        unsigned int list = TestCell(bP, 4 * nsegs);
+        unsigned int seg, j;
+        for (j = 0; j < nsegs; ++j) {
+            unsigned int n = len - j * REGF_SEGMENT_SIZE;
+            if (n > REGF_SEGMENT_SIZE)
+                n = REGF_SEGMENT_SIZE;
+            seg = TestCell(bP, n);
+            memcpy(TestData(bP, seg),
+                   Tcl_DStringValue(&data) + j * REGF_SEGMENT_SIZE, n);
+            TestPut32(TestData(bP, list) + 4 * j, seg);
+        }
+        memcpy(TestData(bP, db), "db", 2);
+        TestPut16(TestData(bP, db) + 2, nsegs);
+        TestPut32(TestData(bP, db) + 4, list);
+        TestPut32(TestData(bP, off) + 4, len);
+        TestPut32(TestData(bP, off) + 8, db);
+    } else {
+        unsigned int cell = TestCell(bP, len);
+        memcpy(TestData(bP, cell), Tcl_DStringValue(&data), len);
+        TestPut32(TestData(bP, off) + 4, len);
+        TestPut32(TestData(bP, off) + 8, cell);
+    }
+    {
+        unsigned char *p = TestData(bP, off);
+        memcpy(p, "vk", 2);
+        TestPut16(p + 2, Tcl_DStringLength(&name));
+        TestPut32(p + 12, type);
+        TestPut16(p + 16, latin1 ? REGF_VALUE_COMP_NAME : 0);
+        memcpy(p + REGF_VK_NAME, Tcl_DStringValue(&name),
+               Tcl_DStringLength(&name));
+    }
+    Tcl_DStringFree(&name);
+    Tcl_DStringFree(&data);
+    return TCL_OK;
+}
+
+/* Builds a subkey list of the configured type */
+static unsigned int TestBuildList(TestBuilder *bP, unsigned int *keys,
+                                  int nkeys)
+{
+    const char *type = bP->listtype;
+    unsigned int off;
+    int i, stride;
+
+    if (strcmp(type, "ri") == 0) {
+        /* Split into lh lists of up to 3 keys */
+        int nlists = (nkeys + 2) / 3;
+        unsigned int *lists = (unsigned int *) ckalloc(nlists * sizeof(int));
+        bP->listtype = "lh";
+        for (i = 0; i < nlists; ++i)
+            lists[i] = TestBuildList(bP, keys + 3 * i,
+                                     nkeys - 3 * i > 3 ? 3 : nkeys - 3 * i);
+        bP->listtype = "ri";
+        off = TestCell(bP, 4 + 4 * nlists);
+        memcpy(TestData(bP, off), "ri", 2);
+        TestPut16(TestData(bP, off) + 2, nlists);
+        for (i = 0; i < nlists; ++i)
+            TestPut32(TestData(bP, off) + 4 + 4 * i, lists[i]);
+        ckfree((char *) lists);
+        return off;
+    }
+    stride = strcmp(type, "li") == 0 ? 4 : 8;
+    off = TestCell(bP, 4 + stride * nkeys);
+    memcpy(TestData(bP, off), type, 2);
+    TestPut16(TestData(bP, off) + 2, nkeys);
+    for (i = 0; i < nkeys; ++i)
+        TestPut32(TestData(bP, off) + 4 + stride * i, keys[i]);
+    return off;
+}
+
+static int TestBuildKey(Tcl_Interp *interp, TestBuilder *bP, Tcl_Obj *specObj,
+                        unsigned int parent, unsigned int *offP)
+{
+    Tcl_Obj **elems, **values, **subkeys;
+    Tcl_DString name;
+    unsigned int off, *offs, list;
+    int nelems, nvalues, nsubkeys, latin1, i;
+    unsigned char *p;
+
+    if (Tcl_ListObjGetElements(interp, specObj, &nelems, &elems) != TCL_OK)
+        return TCL_ERROR;
+    if (nelems != 3 ||
+        Tcl_ListObjGetElements(interp, elems[1], &nvalues, &values) != TCL_OK ||
+        Tcl_ListObjGetElements(interp, elems[2], &nsubkeys, &subkeys) != TCL_OK) {
+        Tcl_SetResult(interp, "bad key spec", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    latin1 = TestEncodeName(bP, Tcl_GetString(elems[0]), &name);
+    *offP = off = TestCell(bP, REGF_NK_NAME + Tcl_DStringLength(&name));
+    p = TestData(bP, off);
+    memcpy(p, "nk", 2);
+    TestPut16(p + 2, latin1 ? REGF_KEY_COMP_NAME : 0);
+    TestPut32(p + 4, (unsigned int) bP->last_write);
+    TestPut32(p + 8, (unsigned int) (bP->last_write >> 32));
+    bP->last_write++;
+    TestPut32(p + 16, parent);
+    TestPut32(p + 28, REGF_NO_CELL);
+    TestPut32(p + 40, REGF_NO_CELL);
+    TestPut32(p + 44, REGF_NO_CELL);
+    TestPut32(p + 48, REGF_NO_CELL);
+    TestPut16(p + 72, Tcl_DStringLength(&name));
+    memcpy(p + REGF_NK_NAME, Tcl_DStringValue(&name), Tcl_DStringLength(&name));
+    Tcl_DStringFree(&name);
+
+    offs = (unsigned int *) ckalloc((nvalues + nsubkeys + 1) * sizeof(int));
+    for (i = 0; i < nvalues; ++i) {
+        if (TestBuildValue(interp, bP, values[i], &offs[i]) != TCL_OK)
+            goto error_return;
+    }
+    if (nvalues) {
+        list = TestCell(bP, 4 * nvalues);
+        for (i = 0; i < nvalues; ++i)
+            TestPut32(TestData(bP, list) + 4 * i, offs[i]);
+        TestPut32(TestData(bP, off) + 36, nvalues);
+        TestPut32(TestData(bP, off) + 40, list);
+    }
+    for (i = 0; i < nsubkeys; ++i) {
+        if (TestBuildKey(interp, bP, subkeys[i], off, &offs[i]) != TCL_OK)
+            goto error_return;
+    }
+    if (nsubkeys) {
+        list = TestBuildList(bP, offs, nsubkeys);
+        TestPut32(TestData(bP, off) + 20, nsubkeys);
+        TestPut32(TestData(bP, off) + 28, list);
+    }
+    ckfree((char *) offs);
+    return TCL_OK;
+
+error_return:
+    ckfree((char *) offs);
+    return TCL_ERROR;
+}
+
+typedef struct TestState {
+    unsigned char *data;
+    size_t size;
+    RegfHive hive;
+    int open;
+    RegfWalkStats stats;
+} TestState;
+
+static int TestBuild(Tcl_Interp *interp, TestState *tsP, Tcl_Obj *specObj,
+                     const char *listtype, int utf16, int minor)
+{
+    TestBuilder b;
+    unsigned int root, bins;
+    int status;
+
+    b.size = 1 << 16;
+    b.p = (unsigned char *) ckalloc(b.size);
+    memset(b.p, 0, REGF_HEADER_SIZE + 32);
+    b.len = REGF_HEADER_SIZE + 32; /* Base block and hbin header */
+    b.listtype = listtype;
+    b.utf16 = utf16;
+    b.last_write = 133000000000000000ULL;
+    if (TestBuildKey(interp, &b, specObj, 0, &root) != TCL_OK) {
+        ckfree((char *) b.p);
+        return TCL_ERROR;
+    }
+    /* Pad hive bins to a multiple of 4K */
+    bins = (unsigned int) ((b.len - REGF_HEADER_SIZE + 4095) & ~4095u);
+    if (REGF_HEADER_SIZE + bins > b.size)
+        b.p = (unsigned char *) ckrealloc((char *) b.p, REGF_HEADER_SIZE + bins);
+    memset(b.p + b.len, 0, REGF_HEADER_SIZE + bins - b.len);
+    memcpy(b.p, "regf", 4);
+    TestPut32(b.p + 4, 1);
+    TestPut32(b.p + 8, 1);
+    TestPut32(b.p + 20, 1);
+    TestPut32(b.p + 24, minor);
+    TestPut32(b.p + 32, 1);
+    TestPut32(b.p + 36, root);
+    TestPut32(b.p + 40, bins);
+    memcpy(b.p + REGF_HEADER_SIZE, "hbin", 4);
+    TestPut32(b.p + REGF_HEADER_SIZE + 8, bins);
+
+    if (tsP->data)
+        ckfree((char *) tsP->data);
+    tsP->data = b.p;
+    tsP->size = REGF_HEADER_SIZE + bins;
+    status = RegfOpen(&tsP->hive, tsP->data, tsP->size);
+    tsP->open = status == 0;
+    if (status) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("open failed %d", status));
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+static int TestError(Tcl_Interp *interp, int status)
+{
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("regf error %d", status));
+    return TCL_ERROR;
+}
+
+static Tcl_Obj *TestNameObj(const RegfName *nameP)
+{
+    Tcl_DString ds;
+    Tcl_Obj *objP;
+
+    Tcl_DStringInit(&ds);
+    RegfNameToUtf8(nameP, &ds);
+    objP = Tcl_NewStringObj(Tcl_DStringValue(&ds), Tcl_DStringLength(&ds));
+    Tcl_DStringFree(&ds);
+    return objP;
+}
+
+/* Strings are decoded as UTF-16 names, dropping the terminator */
+static Tcl_Obj *TestValueObj(const RegfValue *valP)
+{
+    RegfName str;
+    Tcl_Obj *objP;
+    unsigned int i, start, sum;
+    char buf[40];
+
+    switch (valP->type) {
+    case REGF_REG_SZ:
+    case REGF_REG_EXPAND_SZ:
+        str.p = valP->data;
+        str.len = valP->len;
+        str.latin1 = 0;
+        if (str.len >= 2 && str.p[str.len - 1] == 0 && str.p[str.len - 2] == 0)
+            str.len -= 2;
+        return TestNameObj(&str);
+    case REGF_REG_MULTI_SZ:
+        objP = Tcl_NewListObj(0, NULL);
+        for (i = 0, start = 0; i + 1 < valP->len; i += 2) {
+            if (valP->data[i] == 0 && valP->data[i + 1] == 0) {
+                if (i == start)
+                    break;
+                str.p = valP->data + start;
+                str.len = i - start;
+                str.latin1 = 0;
+                Tcl_ListObjAppendElement(NULL, objP, TestNameObj(&str));
+                start = i + 2;
+            }
+        }
+        return objP;
+    case REGF_REG_DWORD:
+        if (valP->len == 4)
+            return Tcl_NewIntObj((int) RegfGetU32(valP->data));
+        break;
+    case REGF_REG_QWORD:
+        if (valP->len == 8)
+            return Tcl_NewWideIntObj((Tcl_WideInt) RegfGetU64(valP->data));
+        break;
+    }
+    for (i = 0, sum = 0; i < valP->len; ++i)
+        sum = sum * 31 + valP->data[i];
+    sprintf(buf, "%u bytes %08x", valP->len, sum);
+    return Tcl_NewStringObj(buf, -1);
+}
+
+/* Returns the values of key as a flat name {type value} list */
+static int TestKeyValues(Tcl_Interp *interp, TestState *tsP, unsigned int key,
+                         Tcl_Obj **resultP)
+{
+    const unsigned char *list;
+    unsigned int nvalues, i;
+    Tcl_Obj *resultObj;
+    int status;
+
+    if ((status = RegfValues(&tsP->hive, key, &list, &nvalues)) != 0)
+        return TestError(interp, status);
+    resultObj = Tcl_NewListObj(0, NULL);
+    for (i = 0; i < nvalues; ++i) {
+        RegfValue val;
+        unsigned char *freeP;
+        Tcl_Obj *objs[2];
+        if (RegfGetValue(&tsP->hive, RegfGetU32(list + 4 * i), &val,
+                         &freeP) != 0)
+            continue;           /* As RegEnumValue, skip bad values */
+        objs[0] = Tcl_NewIntObj(val.type);
+        objs[1] = TestValueObj(&val);
+        Tcl_ListObjAppendElement(NULL, resultObj, TestNameObj(&val.name));
+        Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewListObj(2, objs));
+        if (freeP)
+            ckfree((char *) freeP);
+    }
+    *resultP = resultObj;
+    return TCL_OK;
+}
+
+typedef struct TestWalkCtx {
+    Tcl_Interp *interp;
+    TestState *tsP;
+    Tcl_Obj *resultObj;
+    int values;
+    int limit;
+} TestWalkCtx;
+
+static int TestVisit(void *ctx, const RegfWalkEntry *entryP)
+{
+    TestWalkCtx *wcP = (TestWalkCtx *) ctx;
+    Tcl_Obj *valuesObj;
+
+    if (wcP->limit-- == 0)
+        return -1;
+    Tcl_ListObjAppendElement(NULL, wcP->resultObj,
+                             Tcl_NewStringObj(entryP->path, entryP->pathlen));
+    if (wcP->values) {
+        if (TestKeyValues(wcP->interp, wcP->tsP, entryP->key,
+                          &valuesObj) != TCL_OK)
+            valuesObj = Tcl_NewObj();
+        Tcl_ListObjAppendElement(NULL, wcP->resultObj, valuesObj);
+    }
+    return 0;
+}
+
+/* hive subcommand ?args? */
+static int TestHiveObjCmd(ClientData cd, Tcl_Interp *interp, int objc,
+                          Tcl_Obj *const objv[])
+{
+    TestState *tsP = (TestState *) cd;
+    static const char *const cmds[] = {
+        "build", "keys", "values", "info", "tree", "treevalues", "stats",
+        "poke", "peek", "load", NULL
+    };
+    enum { BUILD, KEYS, VALUES, INFO, TREE, TREEVALUES, STATS, POKE, PEEK,
+           LOAD };
+    unsigned int key, *subkeys, nsubkeys, i;
+    Tcl_Obj *resultObj;
+    RegfKeyInfo info;
+    int cmd, status, n;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "SUBCOMMAND ?ARG ...?");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[1], cmds, "subcommand", 0,
+                            &cmd) != TCL_OK)
+        return TCL_ERROR;
+
+    if (cmd == BUILD) {
+        /* build SPEC ?LISTTYPE? ?UTF16? ?MINOR? */
+        int utf16 = 0, minor = 5;
+        if (objc < 3 || objc > 6 ||
+            (objc > 4 && Tcl_GetBooleanFromObj(interp, objv[4], &utf16) != TCL_OK) ||
+            (objc > 5 && Tcl_GetIntFromObj(interp, objv[5], &minor) != TCL_OK)) {
+            Tcl_SetResult(interp, "usage: build SPEC ?LISTTYPE? ?UTF16? ?MINOR?", TCL_STATIC);
+            return TCL_ERROR;
+        }
+        return TestBuild(interp, tsP, objv[2],
+                         objc > 3 ? Tcl_GetString(objv[3]) : "lf", utf16, minor);
+    }
+    if (cmd == LOAD) {
+        /* load FILE - reads a real hive */
+        Tcl_Channel chan;
+        Tcl_Obj *dataObj;
+        unsigned char *bytes;
+        if (objc != 3 ||
+            (chan = Tcl_OpenFileChannel(interp, Tcl_GetString(objv[2]), "r", 0)) == NULL)
+            return TCL_ERROR;
+        Tcl_SetChannelOption(interp, chan, "-translation", "binary");
+        dataObj = Tcl_NewObj();
+        Tcl_IncrRefCount(dataObj);
+        Tcl_ReadChars(chan, dataObj, -1, 0);
+        Tcl_Close(interp, chan);
+        bytes = Tcl_GetByteArrayFromObj(dataObj, &n);
+        if (tsP->data)
+            ckfree((char *) tsP->data);
+        tsP->data = (unsigned char *) ckalloc(n);
+        tsP->size = n;
+        memcpy(tsP->data, bytes, n);
+        Tcl_DecrRefCount(dataObj);
+        status = RegfOpen(&tsP->hive, tsP->data, tsP->size);
+        tsP->open = status == 0;
+        return status ? TestError(interp, status) : TCL_OK;
+    }
+    if (cmd == POKE) {
+        /* poke BINSOFFSET BYTE - damages the hive */
+        int byte;
+        if (objc != 4 || Tcl_GetIntFromObj(interp, objv[2], &n) != TCL_OK ||
+            Tcl_GetIntFromObj(interp, objv[3], &byte) != TCL_OK)
+            return TCL_ERROR;
+        tsP->data[REGF_HEADER_SIZE + n] = (unsigned char) byte;
+        return TCL_OK;
+    }
+    if (cmd == PEEK) {
+        /* peek BINSOFFSET - reads a 32 bit word */
+        if (objc != 3 || Tcl_GetIntFromObj(interp, objv[2], &n) != TCL_OK)
+            return TCL_ERROR;
+        Tcl_SetObjResult(interp, Tcl_NewWideIntObj(
+                             RegfGetU32(tsP->data + REGF_HEADER_SIZE + n)));
+        return TCL_OK;
+    }
+    if (cmd == STATS) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("keys %d bad %d threads %d",
+                                               tsP->stats.keys, tsP->stats.bad,
+                                               tsP->stats.threads));
+        return TCL_OK;
+    }
+
+    if (objc < 3 || ! tsP->open) {
+        Tcl_SetResult(interp, "usage: SUBCOMMAND PATH ?ARG?", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    status = RegfFindKey(&tsP->hive, tsP->hive.root, Tcl_GetString(objv[2]), &key);
+    if (status)
+        return TestError(interp, status);
+
+    switch (cmd) {
+    case KEYS:
+        if ((status = RegfSubkeys(&tsP->hive, key, &subkeys, &nsubkeys)) != 0)
+            return TestError(interp, status);
+        resultObj = Tcl_NewListObj(0, NULL);
+        for (i = 0; i < nsubkeys; ++i) {
+            if (RegfGetKey(&tsP->hive, subkeys[i], &info) == 0)
+                Tcl_ListObjAppendElement(NULL, resultObj, TestNameObj(&info.name));
+        }
+        if (subkeys)
+            ckfree((char *) subkeys);
+        break;
+    case VALUES:
+        if (TestKeyValues(interp, tsP, key, &resultObj) != TCL_OK)
+            return TCL_ERROR;
+        break;
+    case INFO:
+        RegfGetKey(&tsP->hive, key, &info);
+        resultObj = Tcl_ObjPrintf("%s %u %u %u %u %u",
+                                  Tcl_GetString(TestNameObj(&info.name)),
+                                  info.nsubkeys, info.nvalues, key,
+                                  info.subkey_list, info.value_list);
+        break;
+    case TREE:
+    case TREEVALUES: {
+        /* tree PATH ?NTHREADS? ?LIMIT? */
+        TestWalkCtx wc;
+        int nthreads = 1;
+        wc.interp = interp;
+        wc.tsP = tsP;
+        wc.resultObj = Tcl_NewListObj(0, NULL);
+        wc.values = cmd == TREEVALUES;
+        wc.limit = -1;
+        if ((objc > 3 && Tcl_GetIntFromObj(interp, objv[3], &nthreads) != TCL_OK) ||
+            (objc > 4 && Tcl_GetIntFromObj(interp, objv[4], &wc.limit) != TCL_OK)) {
+            Tcl_DecrRefCount(wc.resultObj);
+            return TCL_ERROR;
+        }
+        status = RegfWalk(&tsP->hive, key, nthreads, TestVisit, &wc,
+                          &tsP->stats);
+        if (status > 0) {
+            Tcl_DecrRefCount(wc.resultObj);
+            return TestError(interp, status);
+        }
+        resultObj = wc.resultObj;
+        break;
+    }
+    default:
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, resultObj);
+    return TCL_OK;
+}
+
+static const char *testScript =
+    "proc check {script expected} {\n"
+    "    set code [catch {uplevel 1 $script} result]\n"
+    "    if {$code} {set result [list error $result]}\n"
+    "    if {$result ne $expected} {\n"
+    "        puts \"FAIL: $script\\n  got:      $result\\n  expected: $expected\"\n"
+    "        incr ::failures\n"
+    "    }\n"
+    "    incr ::checks\n"
+    "}\n"
+    "set failures 0; set checks 0\n"
+    "set spec {ROOT {{{} 1 default}} {\n"
+    "    {Software {} {\n"
+    "        {Vendor {{Path 1 {C:\\Program Files\\Vendor}} {Count 4 42} {Big 11 -5}} {\n"
+    "            {App {{List 7 {a bb ccc}} {Env 2 %SystemRoot%/x} {Tiny 3 ab}} {}}\n"
+    "            {Empty {} {}}\n"
+    "        }}\n"
+    "        {Caf\\u00e9 {{Blob 3 {fill 7 40000}} {Mid 3 {fill 1 100}}} {}}\n"
+    "    }}\n"
+    "    {System {{\\u0416 1 \\u4e2d}} {{Select {{Current 4 1}} {}}}}\n"
+    "}}\n"
+    "foreach {lt utf16} {lf 0 lh 0 li 1 ri 0 ri 1} {\n"
+    "    hive build $spec $lt $utf16\n"
+    "    check {hive keys {}} {Software System}\n"
+    "    check {hive keys software\\\\VENDOR} {App Empty}\n"
+    "    check {hive keys \\\\Software\\\\\\\\Vendor\\\\} {App Empty}\n"
+    "    check {hive keys Software\\\\Nope} {error {regf error 2}}\n"
+    "    check {hive keys software\\\\caf\\u00c9} {}\n"
+    "    check {hive values {}} {{} {1 default}}\n"
+    "    check {hive values Software\\\\Vendor} {Path {1 {C:\\Program Files\\Vendor}} Count {4 42} Big {11 -5}}\n"
+    "    check {hive values Software\\\\Vendor\\\\App} {List {7 {a bb ccc}} Env {2 %SystemRoot%/x} Tiny {3 {2 bytes 00000c21}}}\n"
+    "    check {hive values System} [list \\u0416 [list 1 \\u4e2d]]\n"
+    "    check {lrange [hive info Software] 0 2} {Software 2 0}\n"
+    "    check {hive tree {}} [list {} Software Software\\\\Vendor Software\\\\Vendor\\\\App Software\\\\Vendor\\\\Empty Software\\\\Caf\\u00e9 System System\\\\Select]\n"
+    "    check {hive tree Software\\\\Vendor} {{} App Empty}\n"
+    "    foreach n {2 3 8} {\n"
+    "        check {hive tree {} $n} [hive tree {}]\n"
+    "    }\n"
+    "    check {hive treevalues System 4} [list {} [list \\u0416 [list 1 \\u4e2d]] Select {Current {4 1}}]\n"
+    "}\n"
+    /* Big data values, and the same size without big data support */
+    "hive build $spec lf 0 5\n"
+    "set blob [lindex [hive values Software\\\\Caf\\u00e9] 1 1]\n"
+    "check {lindex $blob 0} 40000\n"
+    "check {hive values Software\\\\Caf\\u00e9} [list Blob [list 3 $blob] Mid {3 {100 bytes 6ce16272}}]\n"
+    "hive build $spec lf 0 3\n"
+    "check {hive values Software\\\\Caf\\u00e9} {Mid {3 {100 bytes 6ce16272}}}\n"
+    /* Big data sizes beyond the segments or the hive are bad values */
+    "hive build $spec lf 0 5\n"
+    "set vk [hive peek [expr {[lindex [hive info Software\\\\Caf\\u00e9] 5] + 4}]]\n"
+    "check {hive peek [expr {$vk + 8}]} 40000\n"
+    "foreach {size bytes} {49033 {137 191 0 0} 2147418112 {0 0 255 127}} {\n"
+    "    foreach i {0 1 2 3} b $bytes {hive poke [expr {$vk + 8 + $i}] $b}\n"
+    "    check {hive values Software\\\\Caf\\u00e9} {Mid {3 {100 bytes 6ce16272}}}\n"
+    "}\n"
+    /* Early termination */
+    "hive build $spec lf 0\n"
+    "check {hive tree {} 1 3} [list {} Software Software\\\\Vendor]\n"
+    "check {hive tree {} 4 3} [list {} Software Software\\\\Vendor]\n"
+    /* Damage. Cell offsets depend on the builder layout. */
+    "hive build {ROOT {} {{A {} {{A1 {} {}}}} {B {} {}}}} lf\n"
+    "check {hive tree {} 2} [list {} A A\\\\A1 B]\n"
+    /* Break the nk signature of A1 */
+    "hive poke [expr {[lindex [hive info A\\\\A1] 3] + 4}] 0\n"
+    "check {hive tree {} 2} {{} A B}\n"
+    "check {hive stats} {keys 3 bad 1 threads 2}\n"
+    "check {hive keys A\\\\A1} {error {regf error 2}}\n"
+    /* Make A's subkey list point back at the root */
+    "hive build {ROOT {} {{A {} {{A1 {} {}}}} {B {} {}}}} li\n"
+    "set list [lindex [hive info A] 4]\n"
+    "foreach {i b} {8 32 9 0 10 0 11 0} {hive poke [expr {$list + $i}] $b}\n"
+    "foreach n {1 2} {\n"
+    "    check {hive tree {} $n} {{} A B}\n"
+    "    check {dict get [hive stats] bad} 1\n"
+    "}\n"
+    "puts \"[set checks] checks, [set failures] failures\"\n"
+    "set failures\n";
+
+static const char *benchScript =
+    /* 100k keys with 4 values each, fan out 10 */
+    "proc mkspec {depth name} {\n"
+    "    set values [list [list Str 1 \"value of $name\"] [list Num 4 [string length $name]] [list Bin 3 {fill 3 64}] [list Multi 7 {x y z}]]\n"
+    "    set subkeys {}\n"
+    "    if {$depth > 0} {\n"
+    "        for {set i 0} {$i < 10} {incr i} {lappend subkeys [mkspec [expr {$depth - 1}] $name$i]}\n"
+    "    }\n"
+    "    return [list K$name $values $subkeys]\n"
+    "}\n"
+    "hive build [mkspec 5 {}] lh\n"
+    "proc script_tree {path} {\n"
+    "    set result [list $path [hive values $path]]\n"
+    "    foreach k [hive keys $path] {\n"
+    "        lappend result {*}[script_tree [string trimleft $path\\\\$k \\\\]]\n"
+    "    }\n"
+    "    return $result\n"
+    "}\n"
+    "proc bench {label script {n 1}} {\n"
+    "    set t [lindex [uplevel 1 [list time $script $n]] 0]\n"
+    "    puts [format {%-44s %12.1f ms} $label [expr {$t / 1000.0}]]\n"
+    "}\n"
+    "set expected [hive treevalues {} 1]\n"
+    "puts \"[expr {[llength $expected] / 2}] keys\"\n"
+    "check {llength [script_tree {}]} [llength $expected]\n"
+    "foreach n {2 4 8} {check {expr {[hive treevalues {} $n] eq $expected}} 1}\n"
+    "bench {script recursion, keys and values} {script_tree {}}\n"
+    "foreach n {1 2 4 8} {\n"
+    "    bench \"walk, paths only, $n threads\" {hive tree {} $n} 3\n"
+    "}\n"
+    "foreach n {1 4} {\n"
+    "    bench \"walk with values, $n threads\" {hive treevalues {} $n} 3\n"
+    "}\n"
+    "puts [hive stats]\n"
+    "puts \"$checks checks, $failures failures\"\n"
+    "set failures\n";
+
+int main(int argc, char **argv)
+{
+    Tcl_Interp *interp;
+    TestState ts;
+    int failures;
+
+    Tcl_FindExecutable(argv[0]);
+    interp = Tcl_CreateInterp();
+    memset(&ts, 0, sizeof(ts));
+    Tcl_CreateObjCommand(interp, "hive", TestHiveObjCmd, &ts, NULL);
+
+    if (Tcl_Eval(interp, testScript) != TCL_OK ||
+        (argc > 1 && strcmp(argv[1], "bench") == 0 &&
+         Tcl_Eval(interp, benchScript) != TCL_OK)) {
+        fprintf(stderr, "%s\n", Tcl_GetStringResult(interp));
+        return 1;
+    }
+    failures = atoi(Tcl_GetStringResult(interp));
+    Tcl_DeleteInterp(interp);
+    if (ts.data)
+        ckfree((char *) ts.data);
+    return failures ? 1 : 0;
+}
+#endif /* REGF_TEST */
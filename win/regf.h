@@ -0,0 +1,142 @@
+#ifndef REGF_H
+#define REGF_H
+
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Reader for registry hive files (the regf format used for SYSTEM,
+ * SOFTWARE, NTUSER.DAT etc.) that works directly on the file contents,
+ * usually a read-only mapping, without loading the hive into the
+ * registry. Keys and values are identified by their cell offsets. All
+ * cell accesses are bounds checked so damaged or hostile hives result in
+ * REGF_E_BADDB errors or skipped subtrees, never invalid accesses.
+ * Transaction logs are not applied.
+ *
+ * The module only depends on Tcl (for threads and memory allocation) so
+ * it can be tested against generated hives on any platform.
+ */
+
+#include <tcl.h>
+
+/* Error codes. Defaults match the corresponding Windows errors. */
+#ifndef REGF_E_NOTFOUND
+#define REGF_E_NOTFOUND 2       /* ERROR_FILE_NOT_FOUND */
+#endif
+#ifndef REGF_E_BADDB
+#define REGF_E_BADDB 1009       /* ERROR_BADDB */
+#endif
+#ifndef REGF_E_NOMEM
+#define REGF_E_NOMEM 8          /* ERROR_NOT_ENOUGH_MEMORY */
+#endif
+
+/* Value types needed by the reader itself */
+#define REGF_REG_SZ             1
+#define REGF_REG_EXPAND_SZ      2
+#define REGF_REG_BINARY         3
+#define REGF_REG_DWORD          4
+#define REGF_REG_MULTI_SZ       7
+#define REGF_REG_QWORD          11
+
+/* Deepest key nesting accepted, as for the registry itself */
+#define REGF_MAX_DEPTH 512
+
+typedef struct RegfHive {
+    const unsigned char *base;  /* Start of file */
+    const unsigned char *bins;  /* Start of hive bins, cell offset 0 */
+    unsigned int bins_size;     /* Bytes of hive bins present */
+    unsigned int root;          /* Cell offset of root key */
+    int big_data;               /* Format version supports db cells */
+} RegfHive;
+
+/*
+ * Names in hives are either Latin-1 ("compressed") or UTF-16LE. They
+ * point into the hive and are converted with RegfNameToUtf8.
+ */
+typedef struct RegfName {
+    const unsigned char *p;
+    int len;                    /* Bytes */
+    int latin1;
+} RegfName;
+
+typedef struct RegfKeyInfo {
+    RegfName name;
+    Tcl_WideUInt last_write;    /* FILETIME */
+    unsigned int nsubkeys;
+    unsigned int nvalues;
+    unsigned int subkey_list;   /* Cell offsets */
+    unsigned int value_list;
+    unsigned int class_name;
+    int class_len;              /* Bytes, UTF-16LE */
+} RegfKeyInfo;
+
+typedef struct RegfValue {
+    RegfName name;              /* Empty for the default value */
+    unsigned int type;
+    const unsigned char *data;  /* NULL if len is 0 */
+    unsigned int len;
+} RegfValue;
+
+/* Validates the header of the size bytes at data. Returns 0 or error. */
+int RegfOpen(RegfHive *hiveP, const void *data, size_t size);
+
+int RegfGetKey(const RegfHive *hiveP, unsigned int key, RegfKeyInfo *infoP);
+/*
+ * Stores the cell offsets of the subkeys in a ckalloc'ed array at *keysP
+ * (NULL if there are none) in the order in the hive, which is the order
+ * in which the registry enumerates them.
+ */
+int RegfSubkeys(const RegfHive *hiveP, unsigned int key,
+                unsigned int **keysP, unsigned int *nkeysP);
+/*
+ * Finds the key below key at path, a '\' separated relative path in
+ * UTF-8. Names are compared case-insensitively. An empty path is key.
+ */
+int RegfFindKey(const RegfHive *hiveP, unsigned int key, const char *path,
+                unsigned int *foundP);
+/* Stores the cell offsets of the values of key. *valuesP points into the
+ * hive and may not be aligned, read it with RegfGetU32. */
+int RegfValues(const RegfHive *hiveP, unsigned int key,
+               const unsigned char **valuesP, unsigned int *nvaluesP);
+/*
+ * Decodes a value. Data split across big data segments is assembled in
+ * a ckalloc'ed buffer stored in *freeP which the caller must free. *freeP
+ * is NULL otherwise.
+ */
+int RegfGetValue(const RegfHive *hiveP, unsigned int value, RegfValue *valP,
+                 unsigned char **freeP);
+
+unsigned int RegfGetU32(const unsigned char *p);
+/* Appends the name as UTF-8 */
+void RegfNameToUtf8(const RegfName *nameP, Tcl_DString *dsP);
+
+/*
+ * Subtree walk. Subtrees are traversed by up to nthreads threads,
+ * including the caller, and the keys are then passed to the visit
+ * procedure in the calling thread, in depth first order as the registry
+ * would enumerate them. path is relative to the starting key, which is
+ * passed first with an empty path. Subtrees with damaged cells are
+ * skipped and counted. The walk stops if visit returns non-zero, and that
+ * value is returned.
+ */
+typedef struct RegfWalkEntry {
+    unsigned int key;
+    int depth;
+    const char *path;           /* UTF-8, components separated by '\' */
+    int pathlen;
+} RegfWalkEntry;
+
+typedef int RegfVisitProc(void *ctx, const RegfWalkEntry *entryP);
+
+typedef struct RegfWalkStats {
+    int keys;
+    int bad;                    /* Skipped damaged or repeated cells */
+    int threads;                /* Threads actually used */
+} RegfWalkStats;
+
+int RegfWalk(const RegfHive *hiveP, unsigned int key, int nthreads,
+             RegfVisitProc *visit, void *ctx, RegfWalkStats *statsP);
+
+#endif /* REGF_H */
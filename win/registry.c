@@ -7,6 +7,8 @@
 
 #include "twapi.h"
 #include <shlwapi.h>
+#include "regf.h"
+#include "regsnap.h"
 
 #ifndef TWAPI_SINGLE_MODULE
 static HMODULE gModuleHandle;     /* DLL handle to ourselves */
@@ -314,6 +316,461 @@ TwapiRegQueryValueEx(Tcl_Interp *interp,
     }
 }
 
+/*
+ * Offline hives. The hive file is mapped read-only and parsed by the
+ * regf reader so hives from other systems, backups or shadow copies can
+ * be examined without loading them with RegLoadKey, which needs the
+ * backup and restore privileges and modifies the file.
+ */
+typedef struct TwapiRegfHive {
+    RegfHive hive;
+    HANDLE   hfile;
+    HANDLE   hmap;
+    void    *view;
+} TwapiRegfHive;
+
+static void TwapiRegfHiveFree(TwapiRegfHive *hiveP)
+{
+    if (hiveP->view)
+        UnmapViewOfFile(hiveP->view);
+    if (hiveP->hmap)
+        CloseHandle(hiveP->hmap);
+    if (hiveP->hfile != INVALID_HANDLE_VALUE)
+        CloseHandle(hiveP->hfile);
+    TwapiFree(hiveP);
+}
+
+static Tcl_Obj *ObjFromRegfName(const RegfName *nameP)
+{
+    Tcl_DString ds;
+    Tcl_Obj *objP;
+
+    Tcl_DStringInit(&ds);
+    RegfNameToUtf8(nameP, &ds);
+    objP = ObjFromStringN(Tcl_DStringValue(&ds), Tcl_DStringLength(&ds));
+    Tcl_DStringFree(&ds);
+    return objP;
+}
+
+/* Values of key in the same form as TwapiRegEnumValue */
+static int TwapiRegfValuesObj(Tcl_Interp *interp, TwapiRegfHive *hiveP,
+                              unsigned int key, DWORD flags, Tcl_Obj **objPP)
+{
+    const unsigned char *list;
+    unsigned int nvalues, i;
+    Tcl_Obj *resultObj;
+    int status;
+
+    status = RegfValues(&hiveP->hive, key, &list, &nvalues);
+    if (status)
+        return Twapi_AppendSystemError(interp, status);
+    resultObj = ObjNewList(0, NULL);
+    for (i = 0; i < nvalues; ++i) {
+        RegfValue val;
+        unsigned char *freeP;
+        Tcl_Obj *valueObj;
+
+        /* Bad values are skipped as in TwapiRegEnumValue */
+        if (RegfGetValue(&hiveP->hive, RegfGetU32(list + 4 * i), &val,
+                         &freeP) != 0)
+            continue;
+        if (flags & 1) {
+            valueObj = (flags & 2 ? ObjFromRegValueCooked : ObjFromRegValue)(
+                NULL, val.type, (BYTE *)val.data, val.len);
+            if (valueObj) {
+                ObjAppendElement(NULL, resultObj, ObjFromRegfName(&val.name));
+                ObjAppendElement(NULL, resultObj, valueObj);
+            }
+        } else
+            ObjAppendElement(NULL, resultObj, ObjFromRegfName(&val.name));
+        if (freeP)
+            ckfree((char *) freeP);
+    }
+    *objPP = resultObj;
+    return TCL_OK;
+}
+
+/* Resolves the HIVE SUBKEY arguments common to the Twapi_Regf* commands */
+static int TwapiRegfGetKey(TwapiInterpContext *ticP, Tcl_Obj *hiveObj,
+                           Tcl_Obj *subkeyObj, TwapiRegfHive **hivePP,
+                           unsigned int *keyP)
+{
+    TwapiRegfHive *hiveP;
+    int status;
+
+    if (ObjToVerifiedPointerTic(ticP, hiveObj, (void **)&hiveP,
+                                "TwapiRegfHive*", TwapiRegfHiveFree) != TCL_OK)
+        return TCL_ERROR;
+    status = RegfFindKey(&hiveP->hive, hiveP->hive.root,
+                         ObjToString(subkeyObj), keyP);
+    if (status)
+        return Twapi_AppendSystemError(ticP->interp, status);
+    *hivePP = hiveP;
+    return TCL_OK;
+}
+
+/* Twapi_RegfOpen PATH */
+static int Twapi_RegfOpenObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiRegfHive *hiveP;
+    LARGE_INTEGER size;
+    LPWSTR path;
+    DWORD status;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1, GETWSTR(path), ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    hiveP = TwapiAllocZero(sizeof(*hiveP));
+    hiveP->hfile = CreateFileW(path, GENERIC_READ,
+                               FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hiveP->hfile == INVALID_HANDLE_VALUE ||
+        ! GetFileSizeEx(hiveP->hfile, &size))
+        goto system_error;
+    if (size.QuadPart > UINT_MAX) {
+        /* Cell offsets are 32 bits */
+        status = ERROR_BADDB;
+        goto error_return;
+    }
+    hiveP->hmap = CreateFileMappingW(hiveP->hfile, NULL, PAGE_READONLY,
+                                     0, 0, NULL);
+    if (hiveP->hmap == NULL)
+        goto system_error;
+    hiveP->view = MapViewOfFile(hiveP->hmap, FILE_MAP_READ, 0, 0, 0);
+    if (hiveP->view == NULL)
+        goto system_error;
+    status = RegfOpen(&hiveP->hive, hiveP->view, (size_t) size.QuadPart);
+    if (status)
+        goto error_return;
+    if (TwapiRegisterPointerTic(ticP, hiveP, TwapiRegfHiveFree) != TCL_OK) {
+        TwapiRegfHiveFree(hiveP);
+        return TCL_ERROR;
+    }
+    return ObjSetResult(interp, ObjFromOpaque(hiveP, "TwapiRegfHive*"));
+
+system_error:
+    status = GetLastError();
+error_return:
+    TwapiRegfHiveFree(hiveP);
+    return Twapi_AppendSystemError(interp, status);
+}
+
+/* Twapi_RegfClose HIVE */
+static int Twapi_RegfCloseObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiRegfHive *hiveP;
+
+    if (TwapiGetArgsEx(ticP, objc-1, objv+1,
+                       GETVERIFIEDPTR(hiveP, TwapiRegfHive*, TwapiRegfHiveFree),
+                       ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    if (TwapiUnregisterPointerTic(ticP, hiveP, TwapiRegfHiveFree) != TCL_OK)
+        return TCL_ERROR;
+    TwapiRegfHiveFree(hiveP);
+    return TCL_OK;
+}
+
+/*
+ * Twapi_RegfKeys HIVE SUBKEY FLAGS
+ * Same result as RegEnumKeyEx for the key.
+ */
+static int Twapi_RegfKeysObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiRegfHive *hiveP;
+    unsigned int key, *subkeys, nsubkeys, i;
+    Tcl_Obj *resultObj;
+    DWORD flags;
+    int status;
+
+    if (objc != 4)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    if (ObjToDWORD(interp, objv[3], &flags) != TCL_OK ||
+        TwapiRegfGetKey(ticP, objv[1], objv[2], &hiveP, &key) != TCL_OK)
+        return TCL_ERROR;
+    status = RegfSubkeys(&hiveP->hive, key, &subkeys, &nsubkeys);
+    if (status)
+        return Twapi_AppendSystemError(interp, status);
+
+    resultObj = ObjNewList(0, NULL);
+    for (i = 0; i < nsubkeys; ++i) {
+        RegfKeyInfo info;
+        Tcl_Obj *objs[2];
+        if (RegfGetKey(&hiveP->hive, subkeys[i], &info) != 0)
+            continue;
+        objs[0] = ObjFromRegfName(&info.name);
+        if (flags & 1) {
+            FILETIME file_time;
+            file_time.dwLowDateTime = (DWORD) info.last_write;
+            file_time.dwHighDateTime = (DWORD) (info.last_write >> 32);
+            objs[1] = ObjFromFILETIME(&file_time);
+            ObjAppendElement(NULL, resultObj, ObjNewList(2, objs));
+        } else
+            ObjAppendElement(NULL, resultObj, objs[0]);
+    }
+    if (subkeys)
+        ckfree((char *) subkeys);
+    return ObjSetResult(interp, resultObj);
+}
+
+/*
+ * Twapi_RegfValues HIVE SUBKEY FLAGS
+ * Same result and flags as RegEnumValue for the key.
+ */
+static int Twapi_RegfValuesObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiRegfHive *hiveP;
+    unsigned int key;
+    Tcl_Obj *resultObj;
+    DWORD flags;
+
+    if (objc != 4)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    if (ObjToDWORD(interp, objv[3], &flags) != TCL_OK ||
+        TwapiRegfGetKey(ticP, objv[1], objv[2], &hiveP, &key) != TCL_OK ||
+        TwapiRegfValuesObj(interp, hiveP, key, flags, &resultObj) != TCL_OK)
+        return TCL_ERROR;
+    return ObjSetResult(interp, resultObj);
+}
+
+typedef struct TwapiRegfWalkContext {
+    Tcl_Interp    *interp;
+    TwapiRegfHive *hiveP;
+    Tcl_Obj       *resultObj;
+    int            value_flags;   /* -1 for paths only */
+} TwapiRegfWalkContext;
+
+static int TwapiRegfWalkVisit(void *ctx, const RegfWalkEntry *entryP)
+{
+    TwapiRegfWalkContext *wcP = (TwapiRegfWalkContext *) ctx;
+    Tcl_Obj *valuesObj;
+
+    ObjAppendElement(NULL, wcP->resultObj,
+                     ObjFromStringN(entryP->path, entryP->pathlen));
+    if (wcP->value_flags >= 0) {
+        if (TwapiRegfValuesObj(wcP->interp, wcP->hiveP, entryP->key,
+                               wcP->value_flags, &valuesObj) != TCL_OK) {
+            /* Damaged value list. Keep the key, as RegEnumValue would. */
+            Tcl_ResetResult(wcP->interp);
+            valuesObj = ObjNewList(0, NULL);
+        }
+        ObjAppendElement(NULL, wcP->resultObj, valuesObj);
+    }
+    return 0;
+}
+
+/*
+ * Twapi_RegfWalk HIVE SUBKEY NTHREADS ?VALUEFLAGS?
+ * Returns the paths of SUBKEY and all its descendants relative to
+ * SUBKEY, or if VALUEFLAGS is specified, a dictionary mapping the paths
+ * to the values in the same form as Twapi_RegfValues. Subtrees are
+ * traversed by NTHREADS threads, by default one per processor.
+ */
+static int Twapi_RegfWalkObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiRegfWalkContext wc;
+    RegfWalkStats stats;
+    unsigned int key;
+    int nthreads, status;
+
+    if (objc != 4 && objc != 5)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    wc.value_flags = -1;
+    if (ObjToInt(interp, objv[3], &nthreads) != TCL_OK ||
+        (objc == 5 && ObjToInt(interp, objv[4], &wc.value_flags) != TCL_OK) ||
+        TwapiRegfGetKey(ticP, objv[1], objv[2], &wc.hiveP, &key) != TCL_OK)
+        return TCL_ERROR;
+    if (nthreads <= 0) {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        nthreads = si.dwNumberOfProcessors;
+    }
+    if (nthreads > 64)
+        nthreads = 64;
+
+    wc.interp = interp;
+    wc.resultObj = ObjNewList(0, NULL);
+    status = RegfWalk(&wc.hiveP->hive, key, nthreads, TwapiRegfWalkVisit,
+                      &wc, &stats);
+    if (status) {
+        Twapi_FreeNewTclObj(wc.resultObj);
+        return Twapi_AppendSystemError(interp, status);
+    }
+    return ObjSetResult(interp, wc.resultObj);
+}
+
+/*
+ * Registry snapshots. The subtree is walked depth first and the values
+ * of a key are only read if its last write time differs from that in the
+ * previous snapshot, if any.
+ */
+typedef struct TwapiRegSnapWalk {
+    RegSnapBuilder *bP;
+    REGSAM          wow;        /* KEY_WOW64_* access flags */
+    Tcl_DString     path;       /* UTF-8 path of current key */
+    WCHAR           name[TWAPI_VALUE_NAME_NCHARS];
+    char            utf8[3 * TWAPI_VALUE_NAME_NCHARS];
+    LPBYTE          data;
+    DWORD           data_sz;
+} TwapiRegSnapWalk;
+
+static void TwapiRegSnapValues(TwapiRegSnapWalk *walkP, HKEY hkey)
+{
+    DWORD index, nch, nb, type;
+    LONG  status;
+    int   max_loop = 10; /* Safety measure if data size keeps changing */
+    int   len;
+
+    index = 0;
+    while (max_loop > 0) {
+        nch = ARRAYSIZE(walkP->name);
+        nb = walkP->data_sz;
+        status = RegEnumValueW(hkey, index, walkP->name, &nch, NULL, &type,
+                               walkP->data, &nb);
+        if (status == ERROR_MORE_DATA) {
+            walkP->data_sz = nb > walkP->data_sz ? nb : 2 * walkP->data_sz;
+            TwapiFree(walkP->data);
+            walkP->data = TwapiAlloc(walkP->data_sz);
+            --max_loop;
+            continue;           /* Retry same index */
+        }
+        if (status != ERROR_SUCCESS)
+            break;              /* ERROR_NO_MORE_ITEMS or other error */
+        len = TwapiWinCharsToUtf8(walkP->name, nch, walkP->utf8,
+                                  sizeof(walkP->utf8));
+        if (len > 0 && walkP->utf8[len-1] == '\0')
+            --len;
+        RegSnapAddValue(walkP->bP, walkP->utf8, len < 0 ? 0 : len, type,
+                        walkP->data, nb);
+        ++index;
+        max_loop = 10;
+    }
+}
+
+static void TwapiRegSnapKey(TwapiRegSnapWalk *walkP, HKEY hkey,
+                            const FILETIME *ftP, int depth)
+{
+    WCHAR    subkey[TWAPI_KEY_NAME_NCHARS+1];
+    FILETIME file_time;
+    DWORD    index, nch;
+    HKEY     hchild;
+    int      pathlen, len;
+
+    pathlen = Tcl_DStringLength(&walkP->path);
+    if (! RegSnapAddKey(walkP->bP, Tcl_DStringValue(&walkP->path), pathlen,
+                        ((Tcl_WideUInt) ftP->dwHighDateTime << 32)
+                        | ftP->dwLowDateTime))
+        TwapiRegSnapValues(walkP, hkey);
+
+    if (depth >= 512)
+        return;                 /* Registry nesting limit */
+    for (index = 0; ; ++index) {
+        nch = ARRAYSIZE(subkey);
+        if (RegEnumKeyExW(hkey, index, subkey, &nch, NULL, NULL, NULL,
+                          &file_time) != ERROR_SUCCESS)
+            break;
+        /* Keys that cannot be read are left out */
+        if (RegOpenKeyExW(hkey, subkey, 0, KEY_READ | walkP->wow,
+                          &hchild) != ERROR_SUCCESS)
+            continue;
+        if (pathlen)
+            Tcl_DStringAppend(&walkP->path, "\\", 1);
+        len = TwapiWinCharsToUtf8(subkey, nch, walkP->utf8,
+                                  sizeof(walkP->utf8));
+        if (len > 0 && walkP->utf8[len-1] == '\0')
+            --len;
+        if (len > 0)
+            Tcl_DStringAppend(&walkP->path, walkP->utf8, len);
+        TwapiRegSnapKey(walkP, hchild, &file_time, depth + 1);
+        RegCloseKey(hchild);
+        Tcl_DStringSetLength(&walkP->path, pathlen);
+    }
+}
+
+/*
+ * Twapi_RegSnapshot HKEY SUBKEY WOWFLAGS ?PREVIOUS?
+ * Returns a snapshot of the subtree. See regsnap.h.
+ */
+static int Twapi_RegSnapshotObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiRegSnapWalk *walkP;
+    Tcl_Obj  *subkeyObj, *prevObj = NULL;
+    FILETIME  file_time;
+    HKEY      hkey, hsubkey;
+    DWORD     wow;
+    LONG      status;
+    RegSnapBuilder *bP;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETHKEY(hkey), GETOBJ(subkeyObj), GETDWORD(wow),
+                     ARGUSEDEFAULT, GETOBJ(prevObj),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    wow &= KEY_WOW64_32KEY | KEY_WOW64_64KEY;
+
+    hsubkey = hkey;
+    if (ObjCharLength(subkeyObj)) {
+        status = RegOpenKeyExW(hkey, ObjToWinChars(subkeyObj), 0,
+                               KEY_READ | wow, &hsubkey);
+        if (status != ERROR_SUCCESS)
+            return Twapi_AppendSystemError(interp, status);
+    }
+    status = RegQueryInfoKeyW(hsubkey, NULL, NULL, NULL, NULL, NULL, NULL,
+                              NULL, NULL, NULL, NULL, &file_time);
+    if (status != ERROR_SUCCESS) {
+        if (hsubkey != hkey)
+            RegCloseKey(hsubkey);
+        return Twapi_AppendSystemError(interp, status);
+    }
+    bP = RegSnapBuilderNew(interp, prevObj);
+    if (bP == NULL) {
+        if (hsubkey != hkey)
+            RegCloseKey(hsubkey);
+        return TCL_ERROR;
+    }
+
+    walkP = TwapiAlloc(sizeof(*walkP));
+    walkP->bP = bP;
+    walkP->wow = wow;
+    Tcl_DStringInit(&walkP->path);
+    walkP->data_sz = 1024;
+    walkP->data = TwapiAlloc(walkP->data_sz);
+    TwapiRegSnapKey(walkP, hsubkey, &file_time, 0);
+    Tcl_DStringFree(&walkP->path);
+    TwapiFree(walkP->data);
+    TwapiFree(walkP);
+    if (hsubkey != hkey)
+        RegCloseKey(hsubkey);
+
+    return ObjSetResult(interp, RegSnapBuilderFinish(bP, NULL));
+}
+
+/* Twapi_RegSnapshotDiff OLD NEW */
+static int Twapi_RegSnapshotDiffObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Tcl_Obj *resultObj;
+
+    if (objc != 3)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    resultObj = RegSnapDiff(interp, objv[1], objv[2]);
+    return resultObj ? ObjSetResult(interp, resultObj) : TCL_ERROR;
+}
+
+/* Twapi_RegSnapshotInfo SNAPSHOT */
+static int Twapi_RegSnapshotInfoObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Tcl_Obj *resultObj;
+
+    if (objc != 2)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    resultObj = RegSnapInfo(interp, objv[1]);
+    return resultObj ? ObjSetResult(interp, resultObj) : TCL_ERROR;
+}
+
 static int Twapi_RegCallObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
     HKEY                 hkey, hkey2;
@@ -826,7 +1283,19 @@ static int TwapiRegInitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
         DEFINE_FNCODE_CMD(reg_key_enable_reflection, 31), // TBD doc and test
     };
 
+    static struct tcl_dispatch_s RegTclDispatch[] = {
+        DEFINE_TCL_CMD(Twapi_RegfOpen, Twapi_RegfOpenObjCmd),
+        DEFINE_TCL_CMD(Twapi_RegfClose, Twapi_RegfCloseObjCmd),
+        DEFINE_TCL_CMD(Twapi_RegfKeys, Twapi_RegfKeysObjCmd),
+        DEFINE_TCL_CMD(Twapi_RegfValues, Twapi_RegfValuesObjCmd),
+        DEFINE_TCL_CMD(Twapi_RegfWalk, Twapi_RegfWalkObjCmd),
+        DEFINE_TCL_CMD(Twapi_RegSnapshot, Twapi_RegSnapshotObjCmd),
+        DEFINE_TCL_CMD(Twapi_RegSnapshotDiff, Twapi_RegSnapshotDiffObjCmd),
+        DEFINE_TCL_CMD(Twapi_RegSnapshotInfo, Twapi_RegSnapshotInfoObjCmd),
+    };
+
     TwapiDefineFncodeCmds(interp, ARRAYSIZE(RegDispatch), RegDispatch, Twapi_RegCallObjCmd);
+    TwapiDefineTclCmds(interp, ARRAYSIZE(RegTclDispatch), RegTclDispatch, ticP);
 
     return TCL_OK;
 }
@@ -0,0 +1,912 @@
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Registry subtree snapshots and comparison. See regsnap.h.
+ *
+ * Build with -DREGSNAP_TEST to get a standalone test against simulated
+ * registry trees and a benchmark against comparing trees in script (see
+ * end of file).
+ *
+ * Snapshot format, all integers little endian:
+ *   header: "RSN1" NKEYS(4) NVALUES(4) POOLSIZE(4)
+ *   NKEYS key records of 40 bytes:
+ *     PATHHASH(8) LASTWRITE(8) VALUESHASH(8) PATHOFF(4) PATHLEN(4)
+ *     FIRSTVALUE(4) NVALUES(4)
+ *   NVALUES value records of 24 bytes:
+ *     NAMEHASH(8) DATAHASH(8) NAMEOFF(4) NAMELEN(4)
+ *   POOLSIZE bytes of UTF-8 paths and names
+ * Keys are sorted by path hash and the values of each key by name hash,
+ * ties being broken by the case folded path or name. Hashes are 64-bit
+ * FNV-1a of the case folded path or name, and of the type and data.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "regsnap.h"
+
+#define REGSNAP_HEADER_SIZE 16
+#define REGSNAP_KEY_SIZE    40
+#define REGSNAP_VALUE_SIZE  24
+
+#define REGSNAP_FNV_OFFSET 14695981039346656037ULL
+#define REGSNAP_FNV_PRIME  1099511628211ULL
+
+typedef struct RegSnapKey {
+    Tcl_WideUInt hash;
+    Tcl_WideUInt last_write;
+    Tcl_WideUInt values_hash;
+    unsigned int path_off;
+    unsigned int path_len;
+    unsigned int first_value;
+    unsigned int nvalues;
+} RegSnapKey;
+
+typedef struct RegSnapValue {
+    Tcl_WideUInt hash;
+    Tcl_WideUInt data_hash;
+    unsigned int name_off;
+    unsigned int name_len;
+} RegSnapValue;
+
+/* Parsed view of a snapshot byte array */
+typedef struct RegSnapView {
+    const unsigned char *keys;
+    unsigned int nkeys;
+    const unsigned char *values;
+    unsigned int nvalues;
+    const char *pool;
+} RegSnapView;
+
+struct RegSnapBuilder {
+    RegSnapKey *keys;
+    unsigned int nkeys;
+    unsigned int keys_size;
+    RegSnapValue *values;
+    unsigned int nvalues;
+    unsigned int values_size;
+    char *pool;
+    size_t pool_len;
+    size_t pool_size;
+    Tcl_Obj *prevObj;           /* Previous snapshot or NULL */
+    RegSnapView prev;
+    int reused;
+};
+
+static unsigned int RegSnapU32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+static Tcl_WideUInt RegSnapU64(const unsigned char *p)
+{
+    return RegSnapU32(p) | ((Tcl_WideUInt) RegSnapU32(p + 4) << 32);
+}
+
+static unsigned char *RegSnapPut32(unsigned char *p, unsigned int v)
+{
+    p[0] = (unsigned char) v;
+    p[1] = (unsigned char) (v >> 8);
+    p[2] = (unsigned char) (v >> 16);
+    p[3] = (unsigned char) (v >> 24);
+    return p + 4;
+}
+
+static unsigned char *RegSnapPut64(unsigned char *p, Tcl_WideUInt v)
+{
+    RegSnapPut32(p, (unsigned int) v);
+    return RegSnapPut32(p + 4, (unsigned int) (v >> 32));
+}
+
+static Tcl_WideUInt RegSnapHashBytes(Tcl_WideUInt h, const void *data,
+                                     size_t len)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    while (len--)
+        h = (h ^ *p++) * REGSNAP_FNV_PRIME;
+    return h;
+}
+
+/* Hash of the case folded form of a name. Only non-ASCII needs Tcl. */
+static Tcl_WideUInt RegSnapFoldHash(const char *s, int len)
+{
+    Tcl_WideUInt h = REGSNAP_FNV_OFFSET;
+    Tcl_DString ds;
+    int i;
+
+    for (i = 0; i < len; ++i) {
+        unsigned char c = (unsigned char) s[i];
+        if (c & 0x80)
+            break;
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        h = (h ^ c) * REGSNAP_FNV_PRIME;
+    }
+    if (i == len)
+        return h;
+    Tcl_DStringInit(&ds);
+    Tcl_DStringAppend(&ds, s, len);
+    len = Tcl_UtfToLower(Tcl_DStringValue(&ds));
+    h = RegSnapHashBytes(REGSNAP_FNV_OFFSET, Tcl_DStringValue(&ds), len);
+    Tcl_DStringFree(&ds);
+    return h;
+}
+
+/* Compares case folded names. Only needed when hashes are equal. */
+static int RegSnapFoldCompare(const char *a, int alen, const char *b, int blen)
+{
+    Tcl_DString da, db;
+    int la, lb, cmp;
+
+    Tcl_DStringInit(&da);
+    Tcl_DStringInit(&db);
+    Tcl_DStringAppend(&da, a, alen);
+    Tcl_DStringAppend(&db, b, blen);
+    la = Tcl_UtfToLower(Tcl_DStringValue(&da));
+    lb = Tcl_UtfToLower(Tcl_DStringValue(&db));
+    cmp = memcmp(Tcl_DStringValue(&da), Tcl_DStringValue(&db),
+                 la < lb ? la : lb);
+    if (cmp == 0)
+        cmp = la - lb;
+    Tcl_DStringFree(&da);
+    Tcl_DStringFree(&db);
+    return cmp;
+}
+
+static int RegSnapCompare(Tcl_WideUInt ha, const char *a, int alen,
+                          Tcl_WideUInt hb, const char *b, int blen)
+{
+    if (ha != hb)
+        return ha < hb ? -1 : 1;
+    return RegSnapFoldCompare(a, alen, b, blen);
+}
+
+static int RegSnapParse(Tcl_Interp *interp, Tcl_Obj *objP, RegSnapView *viewP)
+{
+    const unsigned char *p;
+    Tcl_WideUInt expected;
+    unsigned int poolsize, i;
+    int len;
+
+    p = Tcl_GetByteArrayFromObj(objP, &len);
+    if (len < REGSNAP_HEADER_SIZE || memcmp(p, "RSN1", 4) != 0)
+        goto invalid;
+    viewP->nkeys = RegSnapU32(p + 4);
+    viewP->nvalues = RegSnapU32(p + 8);
+    poolsize = RegSnapU32(p + 12);
+    expected = REGSNAP_HEADER_SIZE
+        + (Tcl_WideUInt) viewP->nkeys * REGSNAP_KEY_SIZE
+        + (Tcl_WideUInt) viewP->nvalues * REGSNAP_VALUE_SIZE + poolsize;
+    if (expected != (Tcl_WideUInt) len)
+        goto invalid;
+    viewP->keys = p + REGSNAP_HEADER_SIZE;
+    viewP->values = viewP->keys + viewP->nkeys * REGSNAP_KEY_SIZE;
+    viewP->pool = (const char *) viewP->values
+        + viewP->nvalues * REGSNAP_VALUE_SIZE;
+
+    for (i = 0; i < viewP->nkeys; ++i) {
+        const unsigned char *k = viewP->keys + i * REGSNAP_KEY_SIZE;
+        if ((Tcl_WideUInt) RegSnapU32(k + 24) + RegSnapU32(k + 28) > poolsize ||
+            RegSnapU32(k + 28) > INT_MAX ||
+            (Tcl_WideUInt) RegSnapU32(k + 32) + RegSnapU32(k + 36) > viewP->nvalues)
+            goto invalid;
+    }
+    for (i = 0; i < viewP->nvalues; ++i) {
+        const unsigned char *v = viewP->values + i * REGSNAP_VALUE_SIZE;
+        if ((Tcl_WideUInt) RegSnapU32(v + 16) + RegSnapU32(v + 20) > poolsize ||
+            RegSnapU32(v + 20) > INT_MAX)
+            goto invalid;
+    }
+    return TCL_OK;
+
+invalid:
+    if (interp)
+        Tcl_SetResult(interp, "Invalid registry snapshot.", TCL_STATIC);
+    return TCL_ERROR;
+}
+
+/* Accessors for key and value records in a view */
+#define REGSNAP_KEY(v_, i_) ((v_)->keys + (i_) * REGSNAP_KEY_SIZE)
+#define REGSNAP_VALUE(v_, i_) ((v_)->values + (i_) * REGSNAP_VALUE_SIZE)
+#define REGSNAP_STR(v_, rec_, off_) ((v_)->pool + RegSnapU32((rec_) + (off_)))
+#define REGSNAP_LEN(rec_, off_) ((int) RegSnapU32((rec_) + (off_)))
+
+RegSnapBuilder *RegSnapBuilderNew(Tcl_Interp *interp, Tcl_Obj *prevObj)
+{
+    RegSnapBuilder *bP;
+
+    bP = (RegSnapBuilder *) ckalloc(sizeof(*bP));
+    memset(bP, 0, sizeof(*bP));
+    bP->pool_size = 1024;
+    bP->pool = ckalloc(bP->pool_size);
+    if (prevObj) {
+        if (RegSnapParse(interp, prevObj, &bP->prev) != TCL_OK) {
+            RegSnapBuilderFree(bP);
+            return NULL;
+        }
+        Tcl_IncrRefCount(prevObj);
+        bP->prevObj = prevObj;
+    }
+    return bP;
+}
+
+void RegSnapBuilderFree(RegSnapBuilder *bP)
+{
+    if (bP->prevObj)
+        Tcl_DecrRefCount(bP->prevObj);
+    if (bP->keys)
+        ckfree((char *) bP->keys);
+    if (bP->values)
+        ckfree((char *) bP->values);
+    if (bP->pool)
+        ckfree(bP->pool);
+    ckfree((char *) bP);
+}
+
+static unsigned int RegSnapPoolAdd(RegSnapBuilder *bP, const char *s, int len)
+{
+    unsigned int off = (unsigned int) bP->pool_len;
+
+    if (bP->pool_len + len > bP->pool_size) {
+        bP->pool_size = 2 * (bP->pool_len + len) + 1024;
+        bP->pool = ckrealloc(bP->pool, bP->pool_size);
+    }
+    memcpy(bP->pool + bP->pool_len, s, len);
+    bP->pool_len += len;
+    return off;
+}
+
+static RegSnapValue *RegSnapNewValue(RegSnapBuilder *bP, const char *name,
+                                     int namelen)
+{
+    RegSnapValue *valP;
+
+    if (bP->nvalues == bP->values_size) {
+        bP->values_size = bP->values_size ? 2 * bP->values_size : 256;
+        bP->values = (RegSnapValue *) ckrealloc(
+            (char *) bP->values, bP->values_size * sizeof(RegSnapValue));
+    }
+    valP = &bP->values[bP->nvalues++];
+    valP->name_off = RegSnapPoolAdd(bP, name, namelen);
+    valP->name_len = namelen;
+    bP->keys[bP->nkeys - 1].nvalues++;
+    return valP;
+}
+
+/* Returns the index of path in the previous snapshot or -1 */
+static int RegSnapFindPrev(RegSnapBuilder *bP, Tcl_WideUInt hash,
+                           const char *path, int pathlen)
+{
+    const RegSnapView *viewP = &bP->prev;
+    unsigned int lo = 0, hi = viewP->nkeys;
+
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (RegSnapU64(REGSNAP_KEY(viewP, mid)) < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < viewP->nkeys; ++lo) {
+        const unsigned char *k = REGSNAP_KEY(viewP, lo);
+        if (RegSnapU64(k) != hash)
+            break;
+        if (RegSnapFoldCompare(REGSNAP_STR(viewP, k, 24), REGSNAP_LEN(k, 28),
+                               path, pathlen) == 0)
+            return (int) lo;
+    }
+    return -1;
+}
+
+int RegSnapAddKey(RegSnapBuilder *bP, const char *path, int pathlen,
+                  Tcl_WideUInt last_write)
+{
+    RegSnapKey *keyP;
+    int i;
+
+    if (bP->nkeys == bP->keys_size) {
+        bP->keys_size = bP->keys_size ? 2 * bP->keys_size : 64;
+        bP->keys = (RegSnapKey *) ckrealloc(
+            (char *) bP->keys, bP->keys_size * sizeof(RegSnapKey));
+    }
+    keyP = &bP->keys[bP->nkeys++];
+    keyP->hash = RegSnapFoldHash(path, pathlen);
+    keyP->last_write = last_write;
+    keyP->values_hash = 0;
+    keyP->path_off = RegSnapPoolAdd(bP, path, pathlen);
+    keyP->path_len = pathlen;
+    keyP->first_value = bP->nvalues;
+    keyP->nvalues = 0;
+
+    if (bP->prevObj == NULL ||
+        (i = RegSnapFindPrev(bP, keyP->hash, path, pathlen)) < 0)
+        return 0;
+    {
+        const RegSnapView *viewP = &bP->prev;
+        const unsigned char *k = REGSNAP_KEY(viewP, i);
+        unsigned int first, n;
+        if (RegSnapU64(k + 8) != last_write)
+            return 0;
+        first = RegSnapU32(k + 32);
+        for (n = RegSnapU32(k + 36); n > 0; --n, ++first) {
+            const unsigned char *v = REGSNAP_VALUE(viewP, first);
+            RegSnapValue *valP = RegSnapNewValue(
+                bP, REGSNAP_STR(viewP, v, 16), REGSNAP_LEN(v, 20));
+            valP->hash = RegSnapU64(v);
+            valP->data_hash = RegSnapU64(v + 8);
+        }
+    }
+    bP->reused++;
+    return 1;
+}
+
+void RegSnapAddValue(RegSnapBuilder *bP, const char *name, int namelen,
+                     unsigned int type, const void *data, size_t len)
+{
+    RegSnapValue *valP;
+    unsigned char typebuf[4];
+
+    if (bP->nkeys == 0)
+        return;
+    valP = RegSnapNewValue(bP, name, namelen);
+    valP->hash = RegSnapFoldHash(name, namelen);
+    RegSnapPut32(typebuf, type);
+    valP->data_hash = RegSnapHashBytes(
+        RegSnapHashBytes(REGSNAP_FNV_OFFSET, typebuf, 4), data, len);
+}
+
+typedef struct RegSnapSortItem {
+    Tcl_WideUInt hash;
+    const char *s;
+    int len;
+    unsigned int index;
+} RegSnapSortItem;
+
+static int RegSnapSortCompare(const void *a, const void *b)
+{
+    const RegSnapSortItem *ia = (const RegSnapSortItem *) a;
+    const RegSnapSortItem *ib = (const RegSnapSortItem *) b;
+    return RegSnapCompare(ia->hash, ia->s, ia->len, ib->hash, ib->s, ib->len);
+}
+
+Tcl_Obj *RegSnapBuilderFinish(RegSnapBuilder *bP, RegSnapStats *statsP)
+{
+    RegSnapSortItem *items, *vitems;
+    Tcl_Obj *resultObj;
+    unsigned char *p, *vp;
+    char *pool;
+    unsigned int i, j, nextvalue, maxvalues, pool_off;
+
+    /* Sort keys, and the values of each key */
+    items = (RegSnapSortItem *) ckalloc(
+        (bP->nkeys ? bP->nkeys : 1) * sizeof(RegSnapSortItem));
+    maxvalues = 1;
+    for (i = 0; i < bP->nkeys; ++i) {
+        items[i].hash = bP->keys[i].hash;
+        items[i].s = bP->pool + bP->keys[i].path_off;
+        items[i].len = bP->keys[i].path_len;
+        items[i].index = i;
+        if (bP->keys[i].nvalues > maxvalues)
+            maxvalues = bP->keys[i].nvalues;
+    }
+    qsort(items, bP->nkeys, sizeof(*items), RegSnapSortCompare);
+    vitems = (RegSnapSortItem *) ckalloc(maxvalues * sizeof(RegSnapSortItem));
+
+    resultObj = Tcl_NewByteArrayObj(NULL, 0);
+    p = Tcl_SetByteArrayLength(resultObj,
+                               REGSNAP_HEADER_SIZE
+                               + bP->nkeys * REGSNAP_KEY_SIZE
+                               + bP->nvalues * REGSNAP_VALUE_SIZE
+                               + (int) bP->pool_len);
+    memcpy(p, "RSN1", 4);
+    RegSnapPut32(p + 4, bP->nkeys);
+    RegSnapPut32(p + 8, bP->nvalues);
+    RegSnapPut32(p + 12, (unsigned int) bP->pool_len);
+    p += REGSNAP_HEADER_SIZE;
+    vp = p + bP->nkeys * REGSNAP_KEY_SIZE;
+    /* The pool is rewritten in sorted order so equal trees give equal bytes */
+    pool = (char *) vp + bP->nvalues * REGSNAP_VALUE_SIZE;
+    pool_off = 0;
+
+    nextvalue = 0;
+    for (i = 0; i < bP->nkeys; ++i) {
+        RegSnapKey *keyP = &bP->keys[items[i].index];
+        Tcl_WideUInt vhash = REGSNAP_FNV_OFFSET;
+        for (j = 0; j < keyP->nvalues; ++j) {
+            RegSnapValue *valP = &bP->values[keyP->first_value + j];
+            vitems[j].hash = valP->hash;
+            vitems[j].s = bP->pool + valP->name_off;
+            vitems[j].len = valP->name_len;
+            vitems[j].index = keyP->first_value + j;
+        }
+        qsort(vitems, keyP->nvalues, sizeof(*vitems), RegSnapSortCompare);
+        for (j = 0; j < keyP->nvalues; ++j) {
+            RegSnapValue *valP = &bP->values[vitems[j].index];
+            /* Hash the record bytes so the result is the same everywhere */
+            RegSnapPut64(vp, valP->hash);
+            RegSnapPut64(vp + 8, valP->data_hash);
+            vhash = RegSnapHashBytes(vhash, vp, 16);
+            vp += 16;
+            vp = RegSnapPut32(vp, pool_off);
+            vp = RegSnapPut32(vp, valP->name_len);
+            memcpy(pool + pool_off, bP->pool + valP->name_off, valP->name_len);
+            pool_off += valP->name_len;
+        }
+        p = RegSnapPut64(p, keyP->hash);
+        p = RegSnapPut64(p, keyP->last_write);
+        p = RegSnapPut64(p, vhash);
+        p = RegSnapPut32(p, pool_off);
+        p = RegSnapPut32(p, keyP->path_len);
+        memcpy(pool + pool_off, bP->pool + keyP->path_off, keyP->path_len);
+        pool_off += keyP->path_len;
+        p = RegSnapPut32(p, nextvalue);
+        p = RegSnapPut32(p, keyP->nvalues);
+        nextvalue += keyP->nvalues;
+    }
+
+    if (statsP) {
+        statsP->keys = bP->nkeys;
+        statsP->values = bP->nvalues;
+        statsP->reused = bP->reused;
+    }
+    ckfree((char *) vitems);
+    ckfree((char *) items);
+    RegSnapBuilderFree(bP);
+    return resultObj;
+}
+
+enum {
+    REGSNAP_KEY_ADDED,
+    REGSNAP_KEY_REMOVED,
+    REGSNAP_VALUE_ADDED,
+    REGSNAP_VALUE_REMOVED,
+    REGSNAP_VALUE_CHANGED
+};
+
+typedef struct RegSnapEvent {
+    int type;
+    const char *path;
+    int pathlen;
+    const char *name;           /* NULL for key events */
+    int namelen;
+} RegSnapEvent;
+
+typedef struct RegSnapEvents {
+    RegSnapEvent *v;
+    int n;
+    int size;
+} RegSnapEvents;
+
+static void RegSnapAddEvent(RegSnapEvents *evP, int type, const RegSnapView *viewP,
+                            const unsigned char *k, const unsigned char *v)
+{
+    RegSnapEvent *eP;
+
+    if (evP->n == evP->size) {
+        evP->size = evP->size ? 2 * evP->size : 64;
+        evP->v = (RegSnapEvent *) ckrealloc((char *) evP->v,
+                                            evP->size * sizeof(RegSnapEvent));
+    }
+    eP = &evP->v[evP->n++];
+    eP->type = type;
+    eP->path = REGSNAP_STR(viewP, k, 24);
+    eP->pathlen = REGSNAP_LEN(k, 28);
+    eP->name = v ? REGSNAP_STR(viewP, v, 16) : NULL;
+    eP->namelen = v ? REGSNAP_LEN(v, 20) : 0;
+}
+
+static int RegSnapBytesCompare(const char *a, int alen, const char *b, int blen)
+{
+    int cmp = memcmp(a, b, alen < blen ? alen : blen);
+    return cmp ? cmp : alen - blen;
+}
+
+static int RegSnapEventCompare(const void *a, const void *b)
+{
+    const RegSnapEvent *ea = (const RegSnapEvent *) a;
+    const RegSnapEvent *eb = (const RegSnapEvent *) b;
+    int cmp;
+
+    cmp = RegSnapBytesCompare(ea->path, ea->pathlen, eb->path, eb->pathlen);
+    if (cmp)
+        return cmp;
+    /* Key events sort before value events of the same key */
+    if (ea->name == NULL || eb->name == NULL)
+        return (ea->name != NULL) - (eb->name != NULL);
+    cmp = RegSnapBytesCompare(ea->name, ea->namelen, eb->name, eb->namelen);
+    return cmp ? cmp : ea->type - eb->type;
+}
+
+/* Compares the values of the same key in two snapshots */
+static void RegSnapDiffValues(const RegSnapView *oldP, const unsigned char *ok,
+                              const RegSnapView *newP, const unsigned char *nk,
+                              RegSnapEvents *evP)
+{
+    unsigned int i = RegSnapU32(ok + 32), iend = i + RegSnapU32(ok + 36);
+    unsigned int j = RegSnapU32(nk + 32), jend = j + RegSnapU32(nk + 36);
+
+    while (i < iend || j < jend) {
+        const unsigned char *ov = i < iend ? REGSNAP_VALUE(oldP, i) : NULL;
+        const unsigned char *nv = j < jend ? REGSNAP_VALUE(newP, j) : NULL;
+        int cmp;
+        if (ov == NULL)
+            cmp = 1;
+        else if (nv == NULL)
+            cmp = -1;
+        else
+            cmp = RegSnapCompare(RegSnapU64(ov), REGSNAP_STR(oldP, ov, 16),
+                                 REGSNAP_LEN(ov, 20), RegSnapU64(nv),
+                                 REGSNAP_STR(newP, nv, 16), REGSNAP_LEN(nv, 20));
+        if (cmp < 0) {
+            RegSnapAddEvent(evP, REGSNAP_VALUE_REMOVED, oldP, ok, ov);
+            ++i;
+        } else if (cmp > 0) {
+            RegSnapAddEvent(evP, REGSNAP_VALUE_ADDED, newP, nk, nv);
+            ++j;
+        } else {
+            if (RegSnapU64(ov + 8) != RegSnapU64(nv + 8))
+                RegSnapAddEvent(evP, REGSNAP_VALUE_CHANGED, newP, nk, nv);
+            ++i;
+            ++j;
+        }
+    }
+}
+
+Tcl_Obj *RegSnapDiff(Tcl_Interp *interp, Tcl_Obj *oldObj, Tcl_Obj *newObj)
+{
+    static const char *names[] = {
+        "key_added", "key_removed", "value_added", "value_removed",
+        "value_changed"
+    };
+    RegSnapView old, new;
+    RegSnapEvents events;
+    Tcl_Obj *resultObj, *typeObjs[5];
+    unsigned int i, j;
+    int k;
+
+    if (RegSnapParse(interp, oldObj, &old) != TCL_OK ||
+        RegSnapParse(interp, newObj, &new) != TCL_OK)
+        return NULL;
+
+    events.v = NULL;
+    events.n = 0;
+    events.size = 0;
+    i = j = 0;
+    while (i < old.nkeys || j < new.nkeys) {
+        const unsigned char *ok = i < old.nkeys ? REGSNAP_KEY(&old, i) : NULL;
+        const unsigned char *nk = j < new.nkeys ? REGSNAP_KEY(&new, j) : NULL;
+        int cmp;
+        if (ok == NULL)
+            cmp = 1;
+        else if (nk == NULL)
+            cmp = -1;
+        else
+            cmp = RegSnapCompare(RegSnapU64(ok), REGSNAP_STR(&old, ok, 24),
+                                 REGSNAP_LEN(ok, 28), RegSnapU64(nk),
+                                 REGSNAP_STR(&new, nk, 24), REGSNAP_LEN(nk, 28));
+        if (cmp < 0) {
+            RegSnapAddEvent(&events, REGSNAP_KEY_REMOVED, &old, ok, NULL);
+            ++i;
+        } else if (cmp > 0) {
+            RegSnapAddEvent(&events, REGSNAP_KEY_ADDED, &new, nk, NULL);
+            ++j;
+        } else {
+            if (RegSnapU64(ok + 16) != RegSnapU64(nk + 16))
+                RegSnapDiffValues(&old, ok, &new, nk, &events);
+            ++i;
+            ++j;
+        }
+    }
+
+    if (events.n)
+        qsort(events.v, events.n, sizeof(RegSnapEvent), RegSnapEventCompare);
+    for (k = 0; k < 5; ++k) {
+        typeObjs[k] = Tcl_NewStringObj(names[k], -1);
+        Tcl_IncrRefCount(typeObjs[k]);
+    }
+    resultObj = Tcl_NewListObj(0, NULL);
+    for (k = 0; k < events.n; ++k) {
+        RegSnapEvent *eP = &events.v[k];
+        Tcl_Obj *objs[3];
+        objs[0] = typeObjs[eP->type];
+        objs[1] = Tcl_NewStringObj(eP->path, eP->pathlen);
+        if (eP->name)
+            objs[2] = Tcl_NewStringObj(eP->name, eP->namelen);
+        Tcl_ListObjAppendElement(NULL, resultObj,
+                                 Tcl_NewListObj(eP->name ? 3 : 2, objs));
+    }
+    for (k = 0; k < 5; ++k)
+        Tcl_DecrRefCount(typeObjs[k]);
+    if (events.v)
+        ckfree((char *) events.v);
+    return resultObj;
+}
+
+Tcl_Obj *RegSnapInfo(Tcl_Interp *interp, Tcl_Obj *snapObj)
+{
+    RegSnapView view;
+    Tcl_Obj *objs[4];
+
+    if (RegSnapParse(interp, snapObj, &view) != TCL_OK)
+        return NULL;
+    objs[0] = Tcl_NewStringObj("keys", -1);
+    objs[1] = Tcl_NewWideIntObj(view.nkeys);
+    objs[2] = Tcl_NewStringObj("values", -1);
+    objs[3] = Tcl_NewWideIntObj(view.nvalues);
+    return Tcl_NewListObj(4, objs);
+}
+
+#ifdef REGSNAP_TEST
+/*
+ * Standalone test. Build with
+ *   cc -DREGSNAP_TEST regsnap.c -ltcl
+ *
+ * Registry trees are simulated by nested lists. Each key is
+ *   {NAME LASTWRITE VALUES SUBKEYS}
+ * where VALUES is a list of {NAME TYPE DATA}. The walker mirrors the one
+ * in registry.c, reading values only for keys that cannot be reused.
+ */
+#include <stdio.h>
+
+typedef struct TestState {
+    RegSnapStats stats;
+    int value_reads;            /* Keys whose values were read */
+} TestState;
+
+static int TestWalk(Tcl_Interp *interp, TestState *tsP, RegSnapBuilder *bP,
+                    Tcl_Obj *keyObj, Tcl_DString *pathP)
+{
+    Tcl_Obj **elems, **values, **subkeys, **val;
+    Tcl_WideInt last_write;
+    int nelems, nvalues, nsubkeys, nval, i, pathlen, type, len;
+    const char *s;
+
+    if (Tcl_ListObjGetElements(interp, keyObj, &nelems, &elems) != TCL_OK ||
+        nelems != 4 ||
+        Tcl_GetWideIntFromObj(interp, elems[1], &last_write) != TCL_OK ||
+        Tcl_ListObjGetElements(interp, elems[2], &nvalues, &values) != TCL_OK ||
+        Tcl_ListObjGetElements(interp, elems[3], &nsubkeys, &subkeys) != TCL_OK) {
+        Tcl_SetResult(interp, "bad key spec", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    if (! RegSnapAddKey(bP, Tcl_DStringValue(pathP), Tcl_DStringLength(pathP),
+                        (Tcl_WideUInt) last_write)) {
+        tsP->value_reads++;
+        for (i = 0; i < nvalues; ++i) {
+            if (Tcl_ListObjGetElements(interp, values[i], &nval, &val) != TCL_OK ||
+                nval != 3 || Tcl_GetIntFromObj(interp, val[1], &type) != TCL_OK)
+                return TCL_ERROR;
+            s = Tcl_GetStringFromObj(val[0], &len);
+            {
+                int datalen;
+                const char *data = Tcl_GetStringFromObj(val[2], &datalen);
+                RegSnapAddValue(bP, s, len, type, data, datalen);
+            }
+        }
+    }
+    pathlen = Tcl_DStringLength(pathP);
+    for (i = 0; i < nsubkeys; ++i) {
+        Tcl_Obj *nameObj;
+        if (Tcl_ListObjIndex(interp, subkeys[i], 0, &nameObj) != TCL_OK ||
+            nameObj == NULL)
+            return TCL_ERROR;
+        if (pathlen)
+            Tcl_DStringAppend(pathP, "\\", 1);
+        s = Tcl_GetStringFromObj(nameObj, &len);
+        Tcl_DStringAppend(pathP, s, len);
+        if (TestWalk(interp, tsP, bP, subkeys[i], pathP) != TCL_OK)
+            return TCL_ERROR;
+        Tcl_DStringSetLength(pathP, pathlen);
+    }
+    return TCL_OK;
+}
+
+/* snap build TREE ?PREV? | diff OLD NEW | info SNAP | stats */
+static int TestSnapObjCmd(ClientData cd, Tcl_Interp *interp, int objc,
+                          Tcl_Obj *const objv[])
+{
+    TestState *tsP = (TestState *) cd;
+    const char *cmd;
+    Tcl_Obj *resultObj;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "SUBCOMMAND ?ARG ...?");
+        return TCL_ERROR;
+    }
+    cmd = Tcl_GetString(objv[1]);
+    if (strcmp(cmd, "build") == 0 && (objc == 3 || objc == 4)) {
+        RegSnapBuilder *bP;
+        Tcl_DString path;
+        bP = RegSnapBuilderNew(interp, objc == 4 ? objv[3] : NULL);
+        if (bP == NULL)
+            return TCL_ERROR;
+        tsP->value_reads = 0;
+        Tcl_DStringInit(&path);
+        if (TestWalk(interp, tsP, bP, objv[2], &path) != TCL_OK) {
+            Tcl_DStringFree(&path);
+            RegSnapBuilderFree(bP);
+            return TCL_ERROR;
+        }
+        Tcl_DStringFree(&path);
+        resultObj = RegSnapBuilderFinish(bP, &tsP->stats);
+    } else if (strcmp(cmd, "diff") == 0 && objc == 4) {
+        resultObj = RegSnapDiff(interp, objv[2], objv[3]);
+    } else if (strcmp(cmd, "info") == 0 && objc == 3) {
+        resultObj = RegSnapInfo(interp, objv[2]);
+    } else if (strcmp(cmd, "stats") == 0 && objc == 2) {
+        resultObj = Tcl_ObjPrintf("keys %d values %d reused %d reads %d",
+                                  tsP->stats.keys, tsP->stats.values,
+                                  tsP->stats.reused, tsP->value_reads);
+    } else {
+        Tcl_SetResult(interp, "usage: snap build TREE ?PREV? | diff OLD NEW | info SNAP | stats", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    if (resultObj == NULL)
+        return TCL_ERROR;
+    Tcl_SetObjResult(interp, resultObj);
+    return TCL_OK;
+}
+
+static const char *testScript =
+    "proc check {script expected} {\n"
+    "    set code [catch {uplevel 1 $script} result]\n"
+    "    if {$code} {set result [list error $result]}\n"
+    "    if {$result ne $expected} {\n"
+    "        puts \"FAIL: $script\\n  got:      $result\\n  expected: $expected\"\n"
+    "        incr ::failures\n"
+    "    }\n"
+    "    incr ::checks\n"
+    "}\n"
+    "set failures 0; set checks 0\n"
+    "proc slashes {diffs} {lmap d $diffs {lmap x $d {string map {\\\\ /} $x}}}\n"
+    "set t1 {{} 1 {{{} 1 root}} {\n"
+    "    {Software 10 {} {\n"
+    "        {Vendor 20 {{Path 1 C:\\\\Vendor} {Count 4 42}} {\n"
+    "            {App 30 {{Version 1 1.0} {Flags 4 7}} {}}\n"
+    "        }}\n"
+    "        {\\u00c4pfel 40 {{Farbe 1 rot}} {}}\n"
+    "    }}\n"
+    "    {System 50 {{X 4 1}} {}}\n"
+    "}}\n"
+    "set s1 [snap build $t1]\n"
+    "check {snap info $s1} {keys 6 values 7}\n"
+    "check {snap diff $s1 $s1} {}\n"
+    /* Order of keys and values and case of names do not matter */
+    "set t2 {{} 1 {{{} 1 root}} {\n"
+    "    {SYSTEM 50 {{x 4 1}} {}}\n"
+    "    {software 10 {} {\n"
+    "        {\\u00e4PFEL 40 {{farbe 1 rot}} {}}\n"
+    "        {vendor 20 {{count 4 42} {PATH 1 C:\\\\Vendor}} {\n"
+    "            {APP 30 {{Flags 4 7} {Version 1 1.0}} {}}\n"
+    "        }}\n"
+    "    }}\n"
+    "}}\n"
+    "check {snap diff $s1 [snap build $t2]} {}\n"
+    "check {snap build $t2; snap stats} {keys 6 values 7 reused 0 reads 6}\n"
+    /* Changes, as an installer might make */
+    "set t3 {{} 1 {{{} 1 root}} {\n"
+    "    {Software 11 {} {\n"
+    "        {Vendor 21 {{Path 1 D:\\\\Vendor} {Count 4 42} {New 1 x}} {\n"
+    "            {App 31 {{Version 3 1.0}} {}}\n"
+    "            {Plugin 60 {{P 1 p}} {{Sub 61 {} {}}}}\n"
+    "        }}\n"
+    "        {\\u00c4pfel 40 {{Farbe 1 rot}} {}}\n"
+    "    }}\n"
+    "}}\n"
+    "set s3 [snap build $t3]\n"
+    "check {slashes [snap diff $s1 $s3]} {{value_added Software/Vendor New} {value_changed Software/Vendor Path} {value_removed Software/Vendor/App Flags} {value_changed Software/Vendor/App Version} {key_added Software/Vendor/Plugin} {key_added Software/Vendor/Plugin/Sub} {key_removed System}}\n"
+    "check {slashes [snap diff $s3 $s1]} {{value_removed Software/Vendor New} {value_changed Software/Vendor Path} {value_added Software/Vendor/App Flags} {value_changed Software/Vendor/App Version} {key_removed Software/Vendor/Plugin} {key_removed Software/Vendor/Plugin/Sub} {key_added System}}\n"
+    /* Rescans reuse values of keys with unchanged last write times */
+    "set r3 [snap build $t3 $s1]\n"
+    "check {snap stats} {keys 7 values 7 reused 2 reads 5}\n"
+    "check {expr {$r3 eq $s3}} 1\n"
+    "set r3 [snap build $t3 $s3]\n"
+    "check {snap stats} {keys 7 values 7 reused 7 reads 0}\n"
+    "check {expr {$r3 eq $s3}} 1\n"
+    /* ... so a change without a new last write time is not seen */
+    "set t4 [string map {{Farbe 1 rot} {Farbe 1 gr\\u00fcn}} $t3]\n"
+    "check {snap diff $s3 [snap build $t4 $s3]} {}\n"
+    "check {slashes [snap diff $s3 [snap build $t4]]} [list [list value_changed Software/\\u00c4pfel Farbe]]\n"
+    /* Empty trees and invalid snapshots */
+    "set e [snap build {{} 0 {} {}}]\n"
+    "check {snap info $e} {keys 1 values 0}\n"
+    "check {llength [snap diff $e $s1]} 6\n"
+    "check {snap diff junk $s1} {error {Invalid registry snapshot.}}\n"
+    "check {snap diff $s1 [string range $s1 0 end-1]} {error {Invalid registry snapshot.}}\n"
+    "check {snap build $t1 [string replace $s1 40 43 [binary format i 1000000]]} {error {Invalid registry snapshot.}}\n"
+    "check {snap diff [string replace $s1 48 51 [binary format i 1000]] $s1} {error {Invalid registry snapshot.}}\n"
+    "puts \"[set checks] checks, [set failures] failures\"\n"
+    "set failures\n";
+
+static const char *benchScript =
+    /* 111k keys with 4 values each, fan out 10 */
+    "proc mktree {depth name} {\n"
+    "    set values [list [list Str 1 \"value of $name\"] [list Num 4 [string length $name]] [list Bin 3 [string repeat x 64]] [list Multi 7 {x y z}]]\n"
+    "    set subkeys {}\n"
+    "    if {$depth > 0} {\n"
+    "        for {set i 0} {$i < 10} {incr i} {lappend subkeys [mktree [expr {$depth - 1}] $name$i]}\n"
+    "    }\n"
+    "    return [list K$name 100 $values $subkeys]\n"
+    "}\n"
+    "set before [mktree 5 {}]\n"
+    /* Change one value in a tenth of the keys */
+    "proc touch {key path} {\n"
+    "    lassign $key name lw values subkeys\n"
+    "    if {[string match *7 $path]} {set lw 200; lset values 0 2 changed}\n"
+    "    set new {}\n"
+    "    foreach k $subkeys {lappend new [touch $k $path[string index [lindex $k 0] end]]}\n"
+    "    return [list $name $lw $values $new]\n"
+    "}\n"
+    "set after [touch $before {}]\n"
+    /* Script equivalent of reg_tree_values and comparing the results */
+    "proc tree_values {key path resultVar} {\n"
+    "    upvar 1 $resultVar result\n"
+    "    lassign $key name lw values subkeys\n"
+    "    set d {}\n"
+    "    foreach v $values {dict set d [lindex $v 0] [lrange $v 1 2]}\n"
+    "    dict set result $path $d\n"
+    "    foreach k $subkeys {\n"
+    "        set child [lindex $k 0]\n"
+    "        tree_values $k [expr {$path eq {} ? $child : \"$path\\\\$child\"}] result\n"
+    "    }\n"
+    "}\n"
+    "proc script_diff {old new} {\n"
+    "    set diffs {}\n"
+    "    dict for {path values} $old {\n"
+    "        if {![dict exists $new $path]} {lappend diffs [list key_removed $path]; continue}\n"
+    "        set nvalues [dict get $new $path]\n"
+    "        dict for {name data} $values {\n"
+    "            if {![dict exists $nvalues $name]} {lappend diffs [list value_removed $path $name]\n"
+    "            } elseif {[dict get $nvalues $name] ne $data} {lappend diffs [list value_changed $path $name]}\n"
+    "        }\n"
+    "        dict for {name data} $nvalues {\n"
+    "            if {![dict exists $values $name]} {lappend diffs [list value_added $path $name]}\n"
+    "        }\n"
+    "    }\n"
+    "    dict for {path values} $new {\n"
+    "        if {![dict exists $old $path]} {lappend diffs [list key_added $path]}\n"
+    "    }\n"
+    "    return $diffs\n"
+    "}\n"
+    "proc bench {label script {n 1}} {\n"
+    "    set t [lindex [uplevel 1 [list time $script $n]] 0]\n"
+    "    puts [format {%-44s %12.1f ms} $label [expr {$t / 1000.0}]]\n"
+    "}\n"
+    "bench {script: capture before and after} {set d1 {}; tree_values $before {} d1; set d2 {}; tree_values $after {} d2}\n"
+    "bench {script: diff} {set sdiff [script_diff $d1 $d2]}\n"
+    "bench {native: capture before and after} {set s1 [snap build $before]; set s2 [snap build $after]}\n"
+    "bench {native: rescan after with before} {set r2 [snap build $after $s1]}\n"
+    "puts [snap stats]\n"
+    "bench {native: diff} {set ndiff [snap diff $s1 $s2]} 5\n"
+    "check {expr {$r2 eq $s2}} 1\n"
+    "check {llength $ndiff} [llength $sdiff]\n"
+    "check {lsort $ndiff} [lsort $sdiff]\n"
+    "puts \"snapshot [string length $s1] bytes, [format %.1f [expr {[string length $s1] / 111111.0}]] per key\"\n"
+    "puts \"$checks checks, $failures failures\"\n"
+    "set failures\n";
+
+int main(int argc, char **argv)
+{
+    Tcl_Interp *interp;
+    TestState ts;
+    int failures;
+
+    Tcl_FindExecutable(argv[0]);
+    interp = Tcl_CreateInterp();
+    memset(&ts, 0, sizeof(ts));
+    Tcl_CreateObjCommand(interp, "snap", TestSnapObjCmd, &ts, NULL);
+
+    if (Tcl_Eval(interp, testScript) != TCL_OK ||
+        (argc > 1 && strcmp(argv[1], "bench") == 0 &&
+         Tcl_Eval(interp, benchScript) != TCL_OK)) {
+        fprintf(stderr, "%s\n", Tcl_GetStringResult(interp));
+        return 1;
+    }
+    failures = atoi(Tcl_GetStringResult(interp));
+    Tcl_DeleteInterp(interp);
+    return failures ? 1 : 0;
+}
+#endif /* REGSNAP_TEST */
@@ -0,0 +1,75 @@
+#ifndef REGSNAP_H
+#define REGSNAP_H
+
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Compact snapshots of registry subtrees for detecting changes, for
+ * example before and after running an installer. A snapshot records for
+ * every key its relative path, last write time and a hash of its values,
+ * and for every value its name and a hash of its type and data. Records
+ * are sorted by path hash so two snapshots are compared with a single
+ * merge pass. Snapshots are byte arrays in a fixed little endian format
+ * so they can be saved and compared on another system.
+ *
+ * Snapshots are built by the caller adding keys in any order, each
+ * followed by its values. If a previous snapshot is supplied, keys whose
+ * last write time has not changed take their values from it so the
+ * caller need not read them again. Note a key's last write time only
+ * reflects changes to its own values and its list of subkeys, not changes
+ * further down, so the subkeys of such keys must still be visited.
+ *
+ * The module only depends on Tcl so it can be tested with synthetic trees
+ * on any platform.
+ */
+
+#include <tcl.h>
+
+typedef struct RegSnapBuilder RegSnapBuilder;
+
+typedef struct RegSnapStats {
+    int keys;
+    int values;
+    int reused;                 /* Keys whose values came from previous */
+} RegSnapStats;
+
+/*
+ * Creates a builder. prevObj, if not NULL, is a previous snapshot of the
+ * same tree. Returns NULL with an error in interp if it is not a valid
+ * snapshot.
+ */
+RegSnapBuilder *RegSnapBuilderNew(Tcl_Interp *interp, Tcl_Obj *prevObj);
+void RegSnapBuilderFree(RegSnapBuilder *bP);
+
+/*
+ * Adds a key. path is UTF-8, relative to the root of the snapshot, with
+ * '\' separators. Returns 1 if the values of the key were copied from
+ * the previous snapshot, else 0 in which case the caller should add them
+ * with RegSnapAddValue.
+ */
+int RegSnapAddKey(RegSnapBuilder *bP, const char *path, int pathlen,
+                  Tcl_WideUInt last_write);
+/* Adds a value to the last key added. */
+void RegSnapAddValue(RegSnapBuilder *bP, const char *name, int namelen,
+                     unsigned int type, const void *data, size_t len);
+
+/* Returns the snapshot as a byte array object and frees the builder */
+Tcl_Obj *RegSnapBuilderFinish(RegSnapBuilder *bP, RegSnapStats *statsP);
+
+/*
+ * Compares two snapshots. Returns a list of records sorted by path
+ *   {key_added PATH}, {key_removed PATH},
+ *   {value_added PATH NAME}, {value_removed PATH NAME},
+ *   {value_changed PATH NAME}
+ * Values of added or removed keys are not reported separately. Returns
+ * NULL with an error in interp if either snapshot is invalid.
+ */
+Tcl_Obj *RegSnapDiff(Tcl_Interp *interp, Tcl_Obj *oldObj, Tcl_Obj *newObj);
+
+/* Returns a dictionary with the number of keys and values */
+Tcl_Obj *RegSnapInfo(Tcl_Interp *interp, Tcl_Obj *snapObj);
+
+#endif /* REGSNAP_H */
@@ -79,6 +79,25 @@ static Tcl_Obj *ServiceTypeAtom(TwapiInterpContext *ticP, DWORD service_type)
     return TwapiGetAtom(ticP, ServiceTypeString(service_type));
 }
 
+/* Map start type and error control to the symbols used in scripts */
+static Tcl_Obj *ServiceStartTypeAtom(TwapiInterpContext *ticP, DWORD start_type)
+{
+    static char *types[] = {
+        "boot_start", "system_start", "auto_start", "demand_start", "disabled"
+    };
+    if (start_type < ARRAYSIZE(types))
+        return TwapiGetAtom(ticP, types[start_type]);
+    return ObjFromDWORD(start_type);
+}
+
+static Tcl_Obj *ServiceErrorControlAtom(TwapiInterpContext *ticP, DWORD error_control)
+{
+    static char *controls[] = { "ignore", "normal", "severe", "critical" };
+    if (error_control < ARRAYSIZE(controls))
+        return TwapiGetAtom(ticP, controls[error_control]);
+    return ObjFromDWORD(error_control);
+}
+
 static int Twapi_QueryServiceStatusEx(Tcl_Interp *interp, SC_HANDLE h,
                                       SC_STATUS_TYPE infolevel)
 {
@@ -128,6 +147,26 @@ static int Twapi_QueryServiceStatusEx(Tcl_Interp *interp, SC_HANDLE h,
 }
 
 
+/*
+ * Stores the fields of a SERVICE_STATUS_PROCESS in rec[0..8] in the order
+ * servicetype state controls_accepted exitcode service_code checkpoint
+ * wait_hint pid serviceflags
+ */
+static void ServiceStatusProcessObjs(TwapiInterpContext *ticP,
+                                     const SERVICE_STATUS_PROCESS *sspP,
+                                     Tcl_Obj **rec)
+{
+    rec[0] = ServiceTypeAtom(ticP, sspP->dwServiceType);
+    rec[1] = ServiceStateAtom(ticP, sspP->dwCurrentState);
+    rec[2] = ObjFromDWORD(sspP->dwControlsAccepted);
+    rec[3] = ObjFromDWORD(sspP->dwWin32ExitCode);
+    rec[4] = ObjFromDWORD(sspP->dwServiceSpecificExitCode);
+    rec[5] = ObjFromDWORD(sspP->dwCheckPoint);
+    rec[6] = ObjFromDWORD(sspP->dwWaitHint);
+    rec[7] = ObjFromDWORD(sspP->dwProcessId);
+    rec[8] = ObjFromDWORD(sspP->dwServiceFlags);
+}
+
 int Twapi_QueryServiceConfig(TwapiInterpContext *ticP, SC_HANDLE hService)
 {
     QUERY_SERVICE_CONFIGW *qbuf;
@@ -356,16 +395,7 @@ int Twapi_EnumServicesStatusEx(TwapiInterpContext *ticP, int objc, Tcl_Obj *CONS
 
             /* Note order should be same as order of field names above */
 
-            rec[0] = ServiceTypeAtom(ticP, sbuf[i].ServiceStatusProcess.dwServiceType);
-
-            rec[1] = ServiceStateAtom(ticP, sbuf[i].ServiceStatusProcess.dwCurrentState);
-            rec[2] = ObjFromDWORD(sbuf[i].ServiceStatusProcess.dwControlsAccepted);
-            rec[3] = ObjFromDWORD(sbuf[i].ServiceStatusProcess.dwWin32ExitCode);
-            rec[4] = ObjFromDWORD(sbuf[i].ServiceStatusProcess.dwServiceSpecificExitCode);
-            rec[5] = ObjFromDWORD(sbuf[i].ServiceStatusProcess.dwCheckPoint);
-            rec[6] = ObjFromDWORD(sbuf[i].ServiceStatusProcess.dwWaitHint);
-            rec[7] = ObjFromDWORD(sbuf[i].ServiceStatusProcess.dwProcessId);
-            rec[8] = ObjFromDWORD(sbuf[i].ServiceStatusProcess.dwServiceFlags);
+            ServiceStatusProcessObjs(ticP, &sbuf[i].ServiceStatusProcess, rec);
             rec[9] = ObjFromWinChars(sbuf[i].lpServiceName); /* KEY for record array */
             rec[10] = ObjFromWinChars(sbuf[i].lpDisplayName);
             rec[11] = Tcl_NewBooleanObj(sbuf[i].ServiceStatusProcess.dwServiceType & SERVICE_INTERACTIVE_PROCESS);
@@ -771,6 +801,922 @@ int Twapi_QueryServiceLockStatus(
 #endif // NOOP_BEYOND_VISTA
 
 
+/* Returns the number of WCHARs in s, or the multi_sz s, including nuls */
+static size_t TwapiServiceChars(const WCHAR *s, int multisz)
+{
+    const WCHAR *p = s;
+    if (s == NULL)
+        return 0;
+    if (! multisz)
+        return lstrlenW(s) + 1;
+    while (*p)
+        p += lstrlenW(p) + 1;
+    return p - s + 1;
+}
+
+static WCHAR *TwapiServiceCopyChars(WCHAR **dstPP, const WCHAR *s,
+                                          int multisz)
+{
+    size_t n = TwapiServiceChars(s, multisz);
+    WCHAR *dst = *dstPP;
+    if (n == 0)
+        return NULL;
+    CopyMemory(dst, s, n * sizeof(WCHAR));
+    *dstPP += n;
+    return dst;
+}
+
+/*
+ * EnumServicesStatusEx will not fill more than 256K in one call so larger
+ * sets of services are retrieved in chunks using the resume handle.
+ */
+#define TWAPI_ENUM_SERVICES_CHUNK_SIZE (64 * 1024)
+
+typedef struct _TwapiEnumServicesChunk {
+    struct _TwapiEnumServicesChunk *next;
+    DWORD n;
+    /* ENUM_SERVICE_STATUS_PROCESSW entries and their strings follow */
+} TwapiEnumServicesChunk;
+
+/*
+ * Retrieves the status of all services of the given types and states in
+ * a single TwapiAlloc'ed buffer. Unlike Twapi_EnumServicesStatusEx, the
+ * entries are all needed at the same time so the chunks are compacted
+ * into one array. Returns 0 or a Win32 error code. Does not use Tcl so
+ * may be called from any thread.
+ */
+static DWORD TwapiEnumServicesAll(SC_HANDLE scmH, DWORD service_types,
+                                  DWORD service_states,
+                                  ENUM_SERVICE_STATUS_PROCESSW **servicesPP,
+                                  DWORD *nservicesP)
+{
+    TwapiEnumServicesChunk *chunks, *chunkP, **tailPP;
+    ENUM_SERVICE_STATUS_PROCESSW *services, *entP;
+    DWORD buf_needed, resume_handle, winerr, nservices, i, j;
+    size_t nchars;
+    WCHAR *p;
+
+    chunks = NULL;
+    tailPP = &chunks;
+    nservices = 0;
+    nchars = 0;
+    resume_handle = 0;
+    do {
+        chunkP = TwapiAlloc(sizeof(*chunkP) + TWAPI_ENUM_SERVICES_CHUNK_SIZE);
+        chunkP->next = NULL;
+        chunkP->n = 0;
+        *tailPP = chunkP;
+        tailPP = &chunkP->next;
+        entP = (ENUM_SERVICE_STATUS_PROCESSW *) (chunkP + 1);
+        if (EnumServicesStatusExW(scmH, SC_ENUM_PROCESS_INFO, service_types,
+                                  service_states, (LPBYTE) entP,
+                                  TWAPI_ENUM_SERVICES_CHUNK_SIZE,
+                                  &buf_needed, &chunkP->n, &resume_handle,
+                                  NULL))
+            winerr = ERROR_SUCCESS;
+        else {
+            winerr = GetLastError();
+            if (winerr != ERROR_MORE_DATA)
+                goto vamoose;
+            if (chunkP->n == 0) {
+                /* Cannot happen but do not loop forever */
+                winerr = ERROR_INSUFFICIENT_BUFFER;
+                goto vamoose;
+            }
+        }
+        for (i = 0; i < chunkP->n; ++i) {
+            nchars += TwapiServiceChars(entP[i].lpServiceName, 0)
+                + TwapiServiceChars(entP[i].lpDisplayName, 0);
+        }
+        nservices += chunkP->n;
+    } while (winerr == ERROR_MORE_DATA);
+
+    services = TwapiAlloc(nservices * sizeof(*services) + nchars * sizeof(WCHAR));
+    p = (WCHAR *) (services + nservices);
+    for (i = 0, chunkP = chunks; chunkP; chunkP = chunkP->next) {
+        entP = (ENUM_SERVICE_STATUS_PROCESSW *) (chunkP + 1);
+        for (j = 0; j < chunkP->n; ++j, ++i) {
+            services[i] = entP[j];
+            services[i].lpServiceName = TwapiServiceCopyChars(&p, entP[j].lpServiceName, 0);
+            services[i].lpDisplayName = TwapiServiceCopyChars(&p, entP[j].lpDisplayName, 0);
+        }
+    }
+    *servicesPP = services;
+    *nservicesP = nservices;
+
+vamoose:
+    while (chunks) {
+        chunkP = chunks;
+        chunks = chunkP->next;
+        TwapiFree(chunkP);
+    }
+    return winerr;
+}
+
+/*
+ * Bulk retrieval of service status and configuration.
+ *
+ * The status of all services comes from a single EnumServicesStatusEx
+ * call but configuration has to be retrieved one service at a time, each
+ * an OpenService and QueryServiceConfig round trip to the SCM. These are
+ * spread over a few threads that pick the next service from a shared
+ * index. The SCM handle may be used concurrently.
+ */
+#define TWAPI_SERVICE_CONFIG_MAX_THREADS 32
+
+typedef struct _TwapiServiceConfigWork {
+    SC_HANDLE scmH;
+    ENUM_SERVICE_STATUS_PROCESSW *services;
+    DWORD nservices;
+    LONG volatile next;              /* Next service to query */
+    QUERY_SERVICE_CONFIGW **configs; /* Compact copies, NULL on error */
+    DWORD *errors;
+} TwapiServiceConfigWork;
+
+/*
+ * Returns a TwapiAlloc'ed copy of a QueryServiceConfig result sized to
+ * its contents. The query buffer itself has to be the 8K maximum.
+ */
+static QUERY_SERVICE_CONFIGW *TwapiServiceConfigCopy(const QUERY_SERVICE_CONFIGW *qP)
+{
+    QUERY_SERVICE_CONFIGW *copyP;
+    WCHAR *p;
+    size_t n;
+
+    n = TwapiServiceChars(qP->lpBinaryPathName, 0)
+        + TwapiServiceChars(qP->lpLoadOrderGroup, 0)
+        + TwapiServiceChars(qP->lpDependencies, 1)
+        + TwapiServiceChars(qP->lpServiceStartName, 0)
+        + TwapiServiceChars(qP->lpDisplayName, 0);
+    copyP = TwapiAlloc(sizeof(*copyP) + n * sizeof(WCHAR));
+    *copyP = *qP;
+    p = (WCHAR *) (copyP + 1);
+    copyP->lpBinaryPathName = TwapiServiceCopyChars(&p, qP->lpBinaryPathName, 0);
+    copyP->lpLoadOrderGroup = TwapiServiceCopyChars(&p, qP->lpLoadOrderGroup, 0);
+    copyP->lpDependencies = TwapiServiceCopyChars(&p, qP->lpDependencies, 1);
+    copyP->lpServiceStartName = TwapiServiceCopyChars(&p, qP->lpServiceStartName, 0);
+    copyP->lpDisplayName = TwapiServiceCopyChars(&p, qP->lpDisplayName, 0);
+    return copyP;
+}
+
+static void TwapiServiceConfigRun(TwapiServiceConfigWork *wP)
+{
+    QUERY_SERVICE_CONFIGW *qbuf;
+    DWORD buf_sz;
+    LONG i;
+
+    /* Max size of buffer required is 8K as per MSDN and must NOT be more. */
+    qbuf = TwapiAlloc(8 * 1024);
+    while ((i = InterlockedIncrement(&wP->next) - 1) < (LONG) wP->nservices) {
+        SC_HANDLE h;
+        h = OpenServiceW(wP->scmH, wP->services[i].lpServiceName,
+                         SERVICE_QUERY_CONFIG);
+        if (h == NULL) {
+            wP->errors[i] = GetLastError();
+            continue;
+        }
+        if (QueryServiceConfigW(h, qbuf, 8 * 1024, &buf_sz))
+            wP->configs[i] = TwapiServiceConfigCopy(qbuf);
+        else
+            wP->errors[i] = GetLastError();
+        CloseServiceHandle(h);
+    }
+    TwapiFree(qbuf);
+}
+
+static Tcl_ThreadCreateType TwapiServiceConfigThread(ClientData clientdata)
+{
+    TwapiServiceConfigRun((TwapiServiceConfigWork *) clientdata);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+ * Twapi_EnumServicesWithConfig SCMHANDLE SERVICETYPE SERVICESTATE NTHREADS
+ * Returns a list of records with the fields of Twapi_EnumServicesStatusEx
+ * followed by
+ *   starttype errorcontrol tagid command loadordergroup account
+ *   dependencies config_error
+ * The configuration fields are empty and config_error is the Win32 error
+ * if the configuration of a service could not be retrieved. NTHREADS,
+ * including the calling thread, query configurations in parallel.
+ */
+static int Twapi_EnumServicesWithConfig(TwapiInterpContext *ticP, int objc, Tcl_Obj *CONST objv[])
+{
+    Tcl_Interp *interp = ticP->interp;
+    TwapiServiceConfigWork work;
+    Tcl_ThreadId *tids = NULL;
+    DWORD service_types, service_states, winerr, i;
+    int nthreads, nstarted, j;
+    Tcl_Obj *resultObj;
+
+    if (TwapiGetArgs(interp, objc, objv,
+                     GETPTR(work.scmH, SC_HANDLE), GETDWORD(service_types),
+                     GETDWORD(service_states), GETINT(nthreads),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    winerr = TwapiEnumServicesAll(work.scmH, service_types, service_states,
+                                  &work.services, &work.nservices);
+    if (winerr != ERROR_SUCCESS)
+        return Twapi_AppendSystemError(interp, winerr);
+    work.next = 0;
+    work.configs = TwapiAllocZero((work.nservices + 1) * sizeof(*work.configs));
+    work.errors = TwapiAllocZero((work.nservices + 1) * sizeof(*work.errors));
+
+    /* No point in threads that would only get a service or two */
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > TWAPI_SERVICE_CONFIG_MAX_THREADS)
+        nthreads = TWAPI_SERVICE_CONFIG_MAX_THREADS;
+    if ((DWORD) nthreads > work.nservices / 8 + 1)
+        nthreads = work.nservices / 8 + 1;
+    nstarted = 0;
+    if (nthreads > 1) {
+        tids = TwapiAlloc(nthreads * sizeof(Tcl_ThreadId));
+        for (j = 1; j < nthreads; ++j) {
+            if (Tcl_CreateThread(&tids[nstarted], TwapiServiceConfigThread,
+                                 &work, TCL_THREAD_STACK_DEFAULT,
+                                 TCL_THREAD_JOINABLE) == TCL_OK)
+                ++nstarted;
+        }
+    }
+    TwapiServiceConfigRun(&work);
+    for (j = 0; j < nstarted; ++j) {
+        int result;
+        Tcl_JoinThread(tids[j], &result);
+    }
+    if (tids)
+        TwapiFree(tids);
+
+    resultObj = ObjNewList(work.nservices, NULL);
+    for (i = 0; i < work.nservices; ++i) {
+        ENUM_SERVICE_STATUS_PROCESSW *svcP = &work.services[i];
+        QUERY_SERVICE_CONFIGW *qP = work.configs[i];
+        Tcl_Obj *rec[20];
+
+        ServiceStatusProcessObjs(ticP, &svcP->ServiceStatusProcess, rec);
+        rec[9] = ObjFromWinChars(svcP->lpServiceName);
+        rec[10] = ObjFromWinChars(svcP->lpDisplayName);
+        rec[11] = ObjFromBoolean(svcP->ServiceStatusProcess.dwServiceType & SERVICE_INTERACTIVE_PROCESS);
+        if (qP) {
+            rec[12] = ServiceStartTypeAtom(ticP, qP->dwStartType);
+            rec[13] = ServiceErrorControlAtom(ticP, qP->dwErrorControl);
+            rec[14] = ObjFromDWORD(qP->dwTagId);
+            rec[15] = ObjFromWinChars(qP->lpBinaryPathName);
+            rec[16] = ObjFromWinChars(qP->lpLoadOrderGroup);
+            rec[17] = ObjFromWinChars(qP->lpServiceStartName);
+            rec[18] = ObjFromMultiSz_MAX(qP->lpDependencies);
+            TwapiFree(qP);
+        } else {
+            for (j = 12; j <= 18; ++j)
+                rec[j] = ObjFromEmptyString();
+        }
+        rec[19] = ObjFromDWORD(work.errors[i]);
+        ObjAppendElement(NULL, resultObj, ObjNewList(ARRAYSIZE(rec), rec));
+    }
+
+    TwapiFree(work.configs);
+    TwapiFree(work.errors);
+    TwapiFree(work.services);
+    return ObjSetResult(interp, resultObj);
+}
+
+/*
+ * Service status change notifications.
+ *
+ * NotifyServiceStatusChange delivers a notification as an APC to the
+ * thread that registered it, and each registration only fires once.
+ * Every notifier therefore has its own thread which registers for each
+ * watched service, and on the SCM for services being created and
+ * deleted, and then waits alertably. Registrations are rearmed from the
+ * thread loop after their APCs have run, and the changes seen in one
+ * wakeup are passed to the interp in a single callback.
+ *
+ * The first registration on a handle reports the current state. Changes
+ * are only reported when the state differs from the last one reported,
+ * or the one returned by the initial enumeration, so that is suppressed.
+ */
+
+#define TWAPI_SERVICE_NOTIFY_STATES                                     \
+    (SERVICE_NOTIFY_STOPPED | SERVICE_NOTIFY_START_PENDING |            \
+     SERVICE_NOTIFY_STOP_PENDING | SERVICE_NOTIFY_RUNNING |             \
+     SERVICE_NOTIFY_CONTINUE_PENDING | SERVICE_NOTIFY_PAUSE_PENDING |   \
+     SERVICE_NOTIFY_PAUSED | SERVICE_NOTIFY_DELETE_PENDING)
+
+/* Pseudo notification for a state change in change records */
+#define TWAPI_SERVICE_NOTIFY_STATE 0
+
+typedef struct _TwapiServiceWatch {
+    struct _TwapiServiceWatch *next;
+    SC_HANDLE h;                /* NULL once a delete is pending */
+    SERVICE_NOTIFYW notify;
+    DWORD last_state;           /* Last state reported */
+    int fired;                  /* APC has run, needs rearming */
+    int armed;                  /* Registered and APC not yet run */
+    int close_failed;           /* Registration may still be live */
+    WCHAR name[1];              /* Variable size */
+} TwapiServiceWatch;
+
+typedef struct _TwapiServiceChange {
+    WCHAR *name;
+    DWORD event;                /* SERVICE_NOTIFY_* or TWAPI_SERVICE_NOTIFY_STATE */
+    SERVICE_STATUS_PROCESS status;
+} TwapiServiceChange;
+
+struct _TwapiServiceNotifier {
+    ZLINK_DECL(TwapiServiceNotifier);
+    TwapiInterpContext *ticP;
+    TwapiId id;
+    Tcl_ThreadId tid;
+    HANDLE stop_event;
+    HANDLE ready_event;
+    DWORD status;               /* Setup error, valid once ready_event set */
+    WCHAR *system;              /* NULL for local system */
+    WCHAR *database;
+    DWORD service_types;
+    WCHAR **names;              /* Services to watch, all if nnames is 0 */
+    int nnames;
+
+    /* Only accessed from the notifier thread */
+    SC_HANDLE scmH;
+    TwapiServiceWatch *scm_watch; /* Created and deleted services */
+    TwapiServiceWatch *watches;
+    TwapiServiceWatch *closed;  /* Freed after an alertable wait */
+    TwapiServiceChange *changes;
+    int nchanges;
+    int changes_size;
+};
+
+typedef struct _TwapiServiceNotifierCallback {
+    TwapiCallback cb;           /* Must be first field. receiver_id is
+                                   the notifier id */
+    DWORD winerr;               /* If not 0, notifier has stopped */
+    TwapiServiceChange *changes;
+    int nchanges;
+} TwapiServiceNotifierCallback;
+
+static VOID CALLBACK TwapiServiceNotifyApc(PVOID param)
+{
+    SERVICE_NOTIFYW *notifyP = (SERVICE_NOTIFYW *) param;
+    TwapiServiceWatch *wP = (TwapiServiceWatch *) notifyP->pContext;
+    wP->fired = 1;
+    wP->armed = 0;
+}
+
+static DWORD TwapiServiceWatchArm(TwapiServiceWatch *wP, DWORD mask)
+{
+    DWORD winerr;
+
+    ZeroMemory(&wP->notify, sizeof(wP->notify));
+    wP->notify.dwVersion = SERVICE_NOTIFY_STATUS_CHANGE;
+    wP->notify.pfnNotifyCallback = TwapiServiceNotifyApc;
+    wP->notify.pContext = wP;
+    winerr = NotifyServiceStatusChangeW(wP->h, mask, &wP->notify);
+    wP->armed = (winerr == ERROR_SUCCESS);
+    return winerr;
+}
+
+static TwapiServiceWatch *TwapiServiceWatchNew(const WCHAR *name)
+{
+    int len = lstrlenW(name);
+    TwapiServiceWatch *wP;
+    wP = TwapiAllocZero(sizeof(*wP) + len * sizeof(WCHAR));
+    CopyMemory(wP->name, name, (len + 1) * sizeof(WCHAR));
+    return wP;
+}
+
+/*
+ * Closing a service handle cancels its registration and no APCs are
+ * queued for it once CloseServiceHandle succeeds. One that is already
+ * queued still runs at the next alertable wait so the watch is kept
+ * until then, see TwapiServiceNotifierFreeClosed.
+ */
+static void TwapiServiceWatchCloseHandle(TwapiServiceWatch *wP)
+{
+    if (wP->h && ! CloseServiceHandle(wP->h))
+        wP->close_failed = 1;
+    wP->h = NULL;
+}
+
+/* Moves a watch to the closed list after closing its handle */
+static void TwapiServiceWatchClose(TwapiServiceNotifier *snP,
+                                   TwapiServiceWatch *wP)
+{
+    TwapiServiceWatchCloseHandle(wP);
+    wP->next = snP->closed;
+    snP->closed = wP;
+}
+
+static int TwapiServiceNotifierWants(TwapiServiceNotifier *snP,
+                                     const WCHAR *name)
+{
+    int i;
+    if (snP->nnames == 0)
+        return 1;
+    for (i = 0; i < snP->nnames; ++i) {
+        if (lstrcmpiW(snP->names[i], name) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static void TwapiServiceNotifierAddChange(TwapiServiceNotifier *snP,
+                                          const WCHAR *name, DWORD event,
+                                          const SERVICE_STATUS_PROCESS *sspP)
+{
+    TwapiServiceChange *chP;
+
+    if (snP->nchanges == snP->changes_size) {
+        int size = 2 * snP->changes_size + 16;
+        chP = TwapiAlloc(size * sizeof(*chP));
+        if (snP->changes) {
+            CopyMemory(chP, snP->changes, snP->nchanges * sizeof(*chP));
+            TwapiFree(snP->changes);
+        }
+        snP->changes = chP;
+        snP->changes_size = size;
+    }
+    chP = &snP->changes[snP->nchanges++];
+    chP->name = TwapiAllocWString((WCHAR *) name, -1);
+    chP->event = event;
+    if (sspP)
+        chP->status = *sspP;
+    else
+        ZeroMemory(&chP->status, sizeof(chP->status));
+}
+
+/*
+ * Opens and registers a watch for a service. Services that cannot be
+ * opened, for example because of access restrictions, are not watched.
+ */
+static TwapiServiceWatch *TwapiServiceNotifierWatch(TwapiServiceNotifier *snP,
+                                                    const WCHAR *name,
+                                                    DWORD state)
+{
+    TwapiServiceWatch *wP;
+    SC_HANDLE h;
+
+    h = OpenServiceW(snP->scmH, name, SERVICE_QUERY_STATUS);
+    if (h == NULL)
+        return NULL;
+    wP = TwapiServiceWatchNew(name);
+    wP->h = h;
+    wP->last_state = state;
+    if (TwapiServiceWatchArm(wP, TWAPI_SERVICE_NOTIFY_STATES) != ERROR_SUCCESS) {
+        CloseServiceHandle(h);
+        TwapiFree(wP);
+        return NULL;
+    }
+    wP->next = snP->watches;
+    snP->watches = wP;
+    return wP;
+}
+
+/* Stops watching a service. Returns 1 if it was being watched. */
+static int TwapiServiceNotifierUnwatch(TwapiServiceNotifier *snP,
+                                       const WCHAR *name)
+{
+    TwapiServiceWatch *wP, **prevPP;
+
+    for (prevPP = &snP->watches; (wP = *prevPP) != NULL; prevPP = &wP->next) {
+        if (lstrcmpiW(wP->name, name) == 0) {
+            *prevPP = wP->next;
+            TwapiServiceWatchClose(snP, wP);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Handles a service reported as created by the SCM */
+static void TwapiServiceNotifierCreated(TwapiServiceNotifier *snP,
+                                        const WCHAR *name)
+{
+    SERVICE_STATUS_PROCESS ssp;
+    SC_HANDLE h;
+    DWORD nbytes;
+    BOOL ok;
+
+    if (! TwapiServiceNotifierWants(snP, name))
+        return;
+    /* A service deleted and recreated under the same name may still have
+       its old watch if the deletion was not reported first */
+    TwapiServiceNotifierUnwatch(snP, name);
+    h = OpenServiceW(snP->scmH, name, SERVICE_QUERY_STATUS);
+    if (h == NULL)
+        return;
+    ok = QueryServiceStatusEx(h, SC_STATUS_PROCESS_INFO, (LPBYTE) &ssp,
+                              sizeof(ssp), &nbytes);
+    CloseServiceHandle(h);
+    if (ok && (ssp.dwServiceType & snP->service_types) &&
+        TwapiServiceNotifierWatch(snP, name, ssp.dwCurrentState)) {
+        TwapiServiceNotifierAddChange(snP, name, SERVICE_NOTIFY_CREATED, &ssp);
+    }
+}
+
+/* Handles a service reported as deleted by the SCM */
+static void TwapiServiceNotifierDeleted(TwapiServiceNotifier *snP,
+                                        const WCHAR *name)
+{
+    if (TwapiServiceNotifierUnwatch(snP, name))
+        TwapiServiceNotifierAddChange(snP, name, SERVICE_NOTIFY_DELETED, NULL);
+}
+
+/*
+ * Called in the notifier thread after APCs have run. Records changes and
+ * rearms registrations. Returns 0 or a Win32 error code if notifications
+ * can no longer be received.
+ */
+static DWORD TwapiServiceNotifierProcess(TwapiServiceNotifier *snP)
+{
+    TwapiServiceWatch *wP, **prevPP;
+    DWORD status;
+
+    prevPP = &snP->watches;
+    while ((wP = *prevPP) != NULL) {
+        int close = 0;
+        if (! wP->fired) {
+            prevPP = &wP->next;
+            continue;
+        }
+        wP->fired = 0;
+        status = wP->notify.dwNotificationStatus;
+        if (status == ERROR_SUCCESS) {
+            SERVICE_STATUS_PROCESS *sspP = &wP->notify.ServiceStatus;
+            if (wP->notify.dwNotificationTriggered & SERVICE_NOTIFY_DELETE_PENDING) {
+                TwapiServiceNotifierAddChange(snP, wP->name, SERVICE_NOTIFY_DELETE_PENDING, sspP);
+                /* An open handle would keep the service from being
+                   deleted. The watch stays listed until the SCM reports
+                   the deletion. */
+                CloseServiceHandle(wP->h);
+                wP->h = NULL;
+                prevPP = &wP->next;
+                continue;
+            }
+            if (sspP->dwCurrentState != wP->last_state) {
+                wP->last_state = sspP->dwCurrentState;
+                TwapiServiceNotifierAddChange(snP, wP->name, TWAPI_SERVICE_NOTIFY_STATE, sspP);
+            }
+        } else if (status == ERROR_SERVICE_NOTIFY_CLIENT_LAGGING) {
+            /* Registration has to be redone on a new handle */
+            CloseServiceHandle(wP->h);
+            wP->h = OpenServiceW(snP->scmH, wP->name, SERVICE_QUERY_STATUS);
+            close = (wP->h == NULL);
+        } else {
+            close = 1;
+        }
+        if (! close &&
+            TwapiServiceWatchArm(wP, TWAPI_SERVICE_NOTIFY_STATES) != ERROR_SUCCESS)
+            close = 1;
+        if (close) {
+            *prevPP = wP->next;
+            TwapiServiceWatchClose(snP, wP);
+        } else
+            prevPP = &wP->next;
+    }
+
+    wP = snP->scm_watch;
+    if (wP->fired) {
+        wP->fired = 0;
+        status = wP->notify.dwNotificationStatus;
+        if (status != ERROR_SUCCESS)
+            return status;
+        if (wP->notify.pszServiceNames) {
+            WCHAR *nameP;
+            /* Names of created services are prefixed with a "/" */
+            for (nameP = wP->notify.pszServiceNames; *nameP;
+                 nameP += lstrlenW(nameP) + 1) {
+                if (*nameP == L'/')
+                    TwapiServiceNotifierCreated(snP, nameP + 1);
+                else
+                    TwapiServiceNotifierDeleted(snP, nameP);
+            }
+            LocalFree(wP->notify.pszServiceNames);
+        }
+        status = TwapiServiceWatchArm(wP, SERVICE_NOTIFY_CREATED | SERVICE_NOTIFY_DELETED);
+        if (status != ERROR_SUCCESS)
+            return status;
+    }
+    return ERROR_SUCCESS;
+}
+
+static int TwapiServiceNotifierCallbackFn(TwapiCallback *cbP)
+{
+    TwapiServiceNotifierCallback *sncP = (TwapiServiceNotifierCallback *) cbP;
+    TwapiInterpContext *ticP = cbP->ticP;
+    Tcl_Interp *interp = ticP->interp;
+    Tcl_Obj *objs[4];
+    int i, tcl_status = TCL_OK;
+
+    if (interp != NULL && Tcl_InterpDeleted(interp))
+        interp = NULL;
+    if (interp) {
+        objs[0] = STRING_LITERAL_OBJ(TWAPI_TCL_NAMESPACE "::_service_notifier_handler");
+        objs[1] = ObjFromTwapiId(cbP->receiver_id);
+        if (sncP->winerr == ERROR_SUCCESS) {
+            Tcl_Obj *raObjs[2];
+            Tcl_Obj *rec[12];
+            rec[0] = STRING_LITERAL_OBJ("name");
+            rec[1] = STRING_LITERAL_OBJ("event");
+            rec[2] = STRING_LITERAL_OBJ("servicetype");
+            rec[3] = STRING_LITERAL_OBJ("state");
+            rec[4] = STRING_LITERAL_OBJ("controls_accepted");
+            rec[5] = STRING_LITERAL_OBJ("exitcode");
+            rec[6] = STRING_LITERAL_OBJ("service_code");
+            rec[7] = STRING_LITERAL_OBJ("checkpoint");
+            rec[8] = STRING_LITERAL_OBJ("wait_hint");
+            rec[9] = STRING_LITERAL_OBJ("pid");
+            rec[10] = STRING_LITERAL_OBJ("serviceflags");
+            rec[11] = STRING_LITERAL_OBJ("interactive");
+            raObjs[0] = ObjNewList(ARRAYSIZE(rec), rec);
+            raObjs[1] = ObjNewList(sncP->nchanges, NULL);
+            for (i = 0; i < sncP->nchanges; ++i) {
+                TwapiServiceChange *chP = &sncP->changes[i];
+                char *event;
+                switch (chP->event) {
+                case SERVICE_NOTIFY_CREATED: event = "created"; break;
+                case SERVICE_NOTIFY_DELETED: event = "deleted"; break;
+                case SERVICE_NOTIFY_DELETE_PENDING: event = "delete_pending"; break;
+                default: event = "state"; break;
+                }
+                rec[0] = ObjFromWinChars(chP->name);
+                rec[1] = TwapiGetAtom(ticP, event);
+                ServiceStatusProcessObjs(ticP, &chP->status, &rec[2]);
+                rec[11] = ObjFromBoolean(chP->status.dwServiceType & SERVICE_INTERACTIVE_PROCESS);
+                ObjAppendElement(NULL, raObjs[1], ObjNewList(ARRAYSIZE(rec), rec));
+            }
+            objs[2] = STRING_LITERAL_OBJ("changes");
+            objs[3] = ObjNewList(2, raObjs);
+        } else {
+            objs[2] = STRING_LITERAL_OBJ("error");
+            objs[3] = ObjFromDWORD(sncP->winerr);
+        }
+        tcl_status = TwapiEvalAndUpdateCallback(cbP, 4, objs, TRT_EMPTY);
+    }
+
+    for (i = 0; i < sncP->nchanges; ++i)
+        TwapiFree(sncP->changes[i].name);
+    if (sncP->changes)
+        TwapiFree(sncP->changes);
+    return tcl_status;
+}
+
+/* Passes accumulated changes, or an error, to the interp */
+static void TwapiServiceNotifierFlush(TwapiServiceNotifier *snP, DWORD winerr)
+{
+    TwapiServiceNotifierCallback *sncP;
+
+    if (winerr == ERROR_SUCCESS && snP->nchanges == 0)
+        return;
+    sncP = (TwapiServiceNotifierCallback *) TwapiCallbackNew(
+        snP->ticP, TwapiServiceNotifierCallbackFn, sizeof(*sncP));
+    sncP->cb.receiver_id = snP->id;
+    sncP->winerr = winerr;
+    sncP->changes = snP->changes;
+    sncP->nchanges = snP->nchanges;
+    snP->changes = NULL;
+    snP->nchanges = 0;
+    snP->changes_size = 0;
+    TwapiEnqueueCallback(snP->ticP, &sncP->cb, TWAPI_ENQUEUE_DIRECT, 0, NULL);
+}
+
+/*
+ * Frees closed watches. Must only be called after an alertable wait
+ * that followed the close, so any APC queued before the close has run.
+ * A watch whose handle could not be closed may still get an APC. It is
+ * kept or, if teardown is set, deliberately leaked since the block must
+ * stay valid for as long as the registration might be live.
+ */
+static void TwapiServiceNotifierFreeClosed(TwapiServiceNotifier *snP,
+                                           int teardown)
+{
+    TwapiServiceWatch *wP, **prevPP;
+
+    prevPP = &snP->closed;
+    while ((wP = *prevPP) != NULL) {
+        if (wP->armed && wP->close_failed) {
+            if (teardown)
+                *prevPP = wP->next; /* Leaked */
+            else
+                prevPP = &wP->next;
+        } else {
+            *prevPP = wP->next;
+            TwapiFree(wP);
+        }
+    }
+}
+
+static DWORD TwapiServiceNotifierSetup(TwapiServiceNotifier *snP)
+{
+    ENUM_SERVICE_STATUS_PROCESSW *services;
+    DWORD nservices, i, winerr;
+
+    /* SC_MANAGER_ENUMERATE_SERVICE is also needed for the created and
+       deleted notifications */
+    snP->scmH = OpenSCManagerW(snP->system, snP->database,
+                               SC_MANAGER_CONNECT | SC_MANAGER_ENUMERATE_SERVICE);
+    if (snP->scmH == NULL)
+        return GetLastError();
+
+    winerr = TwapiEnumServicesAll(snP->scmH, snP->service_types,
+                                  SERVICE_STATE_ALL, &services, &nservices);
+    if (winerr != ERROR_SUCCESS)
+        return winerr;
+    for (i = 0; i < nservices; ++i) {
+        if (TwapiServiceNotifierWants(snP, services[i].lpServiceName))
+            TwapiServiceNotifierWatch(snP, services[i].lpServiceName,
+                                      services[i].ServiceStatusProcess.dwCurrentState);
+    }
+    TwapiFree(services);
+
+    snP->scm_watch = TwapiServiceWatchNew(L"");
+    snP->scm_watch->h = snP->scmH;
+    return TwapiServiceWatchArm(snP->scm_watch,
+                                SERVICE_NOTIFY_CREATED | SERVICE_NOTIFY_DELETED);
+}
+
+static Tcl_ThreadCreateType TwapiServiceNotifierThread(ClientData clientdata)
+{
+    TwapiServiceNotifier *snP = (TwapiServiceNotifier *) clientdata;
+    DWORD winerr;
+
+    winerr = TwapiServiceNotifierSetup(snP);
+    snP->status = winerr;
+    SetEvent(snP->ready_event);
+
+    while (winerr == ERROR_SUCCESS) {
+        DWORD wait = WaitForSingleObjectEx(snP->stop_event, INFINITE, TRUE);
+        if (wait == WAIT_OBJECT_0)
+            break;
+        if (wait != WAIT_IO_COMPLETION) {
+            winerr = GetLastError();
+            break;
+        }
+        TwapiServiceNotifierFreeClosed(snP, 0);
+        winerr = TwapiServiceNotifierProcess(snP);
+        TwapiServiceNotifierFlush(snP, ERROR_SUCCESS);
+    }
+    if (winerr != ERROR_SUCCESS && snP->status == ERROR_SUCCESS)
+        TwapiServiceNotifierFlush(snP, winerr);
+
+    /*
+     * Once the handles are closed no more APCs are queued. A final
+     * alertable wait runs any that were already queued, after which
+     * only watches whose handles failed to close can still be written to.
+     */
+    while (snP->watches) {
+        TwapiServiceWatch *wP = snP->watches;
+        snP->watches = wP->next;
+        TwapiServiceWatchClose(snP, wP);
+    }
+    if (snP->scm_watch) {
+        /* Shares the SCM handle */
+        TwapiServiceWatchCloseHandle(snP->scm_watch);
+    } else if (snP->scmH)
+        CloseServiceHandle(snP->scmH);
+    snP->scmH = NULL;
+    while (SleepEx(0, TRUE) == WAIT_IO_COMPLETION)
+        ;
+    TwapiServiceNotifierFreeClosed(snP, 1);
+    if (snP->scm_watch) {
+        TwapiServiceWatch *wP = snP->scm_watch;
+        snP->scm_watch = NULL;
+        if (! (wP->armed && wP->close_failed)) {
+            if (wP->fired && wP->notify.pszServiceNames)
+                LocalFree(wP->notify.pszServiceNames);
+            TwapiFree(wP);
+        }
+    }
+    TCL_THREAD_CREATE_RETURN;
+}
+
+static void TwapiServiceNotifierFree(TwapiServiceNotifier *snP)
+{
+    int i;
+    for (i = 0; i < snP->nnames; ++i)
+        TwapiFree(snP->names[i]);
+    if (snP->names)
+        TwapiFree(snP->names);
+    if (snP->system)
+        TwapiFree(snP->system);
+    if (snP->database)
+        TwapiFree(snP->database);
+    if (snP->stop_event)
+        CloseHandle(snP->stop_event);
+    if (snP->ready_event)
+        CloseHandle(snP->ready_event);
+    TwapiInterpContextUnref(snP->ticP, 1);
+    TwapiFree(snP);
+}
+
+/* Stops the notifier thread and frees the notifier. Interp thread only. */
+static void TwapiServiceNotifierStop(TwapiServiceNotifier *snP)
+{
+    int result;
+    SetEvent(snP->stop_event);
+    Tcl_JoinThread(snP->tid, &result);
+    TwapiServiceNotifierFree(snP);
+}
+
+static TwapiServiceInterpContext *TwapiServiceSic(TwapiInterpContext *ticP)
+{
+    return (TwapiServiceInterpContext *) ticP->module.data.pval;
+}
+
+/*
+ * Twapi_ServiceNotifierStart SYSTEM DATABASE SERVICETYPES NAMES
+ * Starts watching services of the given types, restricted to those in the
+ * list NAMES if not empty, and returns an id. Changes are passed to
+ * _service_notifier_handler as
+ *   ID changes RECORDARRAY
+ *   ID error WINERROR
+ * where the latter is only passed if the notifier can no longer receive
+ * notifications.
+ */
+static int Twapi_ServiceNotifierStart(TwapiInterpContext *ticP, int objc, Tcl_Obj *CONST objv[])
+{
+    Tcl_Interp *interp = ticP->interp;
+    TwapiServiceNotifier *snP;
+    Tcl_Obj *systemObj, *databaseObj, *namesObj, **nameObjs;
+    Tcl_Size i, nnames;
+    DWORD service_types, winerr;
+    WCHAR *s;
+
+    RETURN_ERROR_IF_UNTHREADED(interp);
+
+    if (TwapiGetArgs(interp, objc, objv,
+                     GETOBJ(systemObj), GETOBJ(databaseObj),
+                     GETDWORD(service_types), GETOBJ(namesObj),
+                     ARGEND) != TCL_OK
+        || ObjGetElements(interp, namesObj, &nnames, &nameObjs) != TCL_OK)
+        return TCL_ERROR;
+
+    snP = TwapiAllocZero(sizeof(*snP));
+    ZLINK_INIT(snP);
+    snP->ticP = ticP;
+    TwapiInterpContextRef(ticP, 1);
+    snP->id = TWAPI_NEWID(ticP);
+    snP->service_types = service_types;
+    if ((s = ObjToLPWSTR_NULL_IF_EMPTY(systemObj)) != NULL)
+        snP->system = TwapiAllocWString(s, -1);
+    if ((s = ObjToLPWSTR_NULL_IF_EMPTY(databaseObj)) != NULL)
+        snP->database = TwapiAllocWString(s, -1);
+    if (nnames) {
+        snP->names = TwapiAlloc(nnames * sizeof(WCHAR *));
+        for (i = 0; i < nnames; ++i)
+            snP->names[i] = TwapiAllocWStringFromObj(nameObjs[i], NULL);
+        snP->nnames = (int) nnames;
+    }
+
+    snP->stop_event = CreateEventW(NULL, TRUE, FALSE, NULL);
+    snP->ready_event = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (snP->stop_event == NULL || snP->ready_event == NULL) {
+        winerr = GetLastError();
+        TwapiServiceNotifierFree(snP);
+        return Twapi_AppendSystemError(interp, winerr);
+    }
+    if (Tcl_CreateThread(&snP->tid, TwapiServiceNotifierThread, snP,
+                         TCL_THREAD_STACK_DEFAULT,
+                         TCL_THREAD_JOINABLE) != TCL_OK) {
+        TwapiServiceNotifierFree(snP);
+        return TwapiReturnError(interp, TWAPI_SYSTEM_ERROR);
+    }
+
+    /* Wait for the initial registrations so errors can be returned */
+    WaitForSingleObject(snP->ready_event, INFINITE);
+    if (snP->status != ERROR_SUCCESS) {
+        int result;
+        winerr = snP->status;
+        Tcl_JoinThread(snP->tid, &result);
+        TwapiServiceNotifierFree(snP);
+        return Twapi_AppendSystemError(interp, winerr);
+    }
+
+    ZLIST_PREPEND(&TwapiServiceSic(ticP)->notifiers, snP);
+    return ObjSetResult(interp, ObjFromTwapiId(snP->id));
+}
+
+/*
+ * Twapi_ServiceNotifierStop ID
+ * Callbacks already queued are still delivered.
+ */
+static int Twapi_ServiceNotifierStop(TwapiInterpContext *ticP, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiServiceNotifier *snP;
+    TwapiId id;
+
+    if (objc != 1)
+        return TwapiReturnError(ticP->interp, TWAPI_BAD_ARG_COUNT);
+    if (ObjToTwapiId(ticP->interp, objv[0], &id) != TCL_OK)
+        return TCL_ERROR;
+    ZLIST_LOCATE(snP, &TwapiServiceSic(ticP)->notifiers, id, id);
+    if (snP) {
+        ZLIST_REMOVE(&TwapiServiceSic(ticP)->notifiers, snP);
+        TwapiServiceNotifierStop(snP);
+    }
+    return TCL_OK;
+}
+
 #ifndef TWAPI_SINGLE_MODULE
 BOOL WINAPI DllMain(HINSTANCE hmod, DWORD reason, PVOID unused)
 {
@@ -896,6 +1842,12 @@ static int Twapi_ServiceCallObjCmd(ClientData clientdata, Tcl_Interp *interp, in
             break;
         case 10008:
             return Twapi_ChangeServiceConfig2(ticP, objc-2, objv+2);
+        case 10009:
+            return Twapi_EnumServicesWithConfig(ticP, objc-2, objv+2);
+        case 10010:
+            return Twapi_ServiceNotifierStart(ticP, objc-2, objv+2);
+        case 10011:
+            return Twapi_ServiceNotifierStop(ticP, objc-2, objv+2);
         }
     }
 
@@ -926,6 +1878,9 @@ static int TwapiServiceInitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
         DEFINE_ALIAS_CMD(Twapi_BecomeAService, 10006),
         DEFINE_ALIAS_CMD(OpenSCManager, 10007),
         DEFINE_ALIAS_CMD(ChangeServiceConfig2, 10008),
+        DEFINE_ALIAS_CMD(Twapi_EnumServicesWithConfig, 10009),
+        DEFINE_ALIAS_CMD(Twapi_ServiceNotifierStart, 10010),
+        DEFINE_ALIAS_CMD(Twapi_ServiceNotifierStop, 10011),
     };
 
     /* Create the underlying call dispatch commands */
@@ -935,6 +1890,20 @@ static int TwapiServiceInitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
     return TCL_OK;
 }
 
+static void TwapiServiceCleanup(TwapiInterpContext *ticP)
+{
+    TwapiServiceInterpContext *sicP = TwapiServiceSic(ticP);
+    TwapiServiceNotifier *snP;
+
+    if (sicP == NULL)
+        return;
+    while ((snP = ZLIST_HEAD(&sicP->notifiers)) != NULL) {
+        ZLIST_REMOVE(&sicP->notifiers, snP);
+        TwapiServiceNotifierStop(snP);
+    }
+    TwapiFree(sicP);
+    ticP->module.data.pval = NULL;
+}
 
 
 /* Main entry point */
@@ -946,14 +1915,24 @@ int Twapi_service_Init(Tcl_Interp *interp)
     static TwapiModuleDef gModuleDef = {
         MODULENAME,
         TwapiServiceInitCalls,
-        NULL
+        TwapiServiceCleanup
     };
+    TwapiInterpContext *ticP;
+    TwapiServiceInterpContext *sicP;
     /* IMPORTANT */
     /* MUST BE FIRST CALL as it initializes Tcl stubs */
     if (Tcl_InitStubs(interp, TCL_VERSION, 0) == NULL) {
         return TCL_ERROR;
     }
 
-    return TwapiRegisterModule(interp, MODULE_HANDLE, &gModuleDef, DEFAULT_TIC) ? TCL_OK : TCL_ERROR;
+    /* NEW_TIC since we have a cleanup routine and use module.data */
+    ticP = TwapiRegisterModule(interp, MODULE_HANDLE, &gModuleDef, NEW_TIC);
+    if (ticP == NULL)
+        return TCL_ERROR;
+
+    sicP = TwapiAlloc(sizeof(TwapiServiceInterpContext));
+    ZLIST_INIT(&sicP->notifiers);
+    ticP->module.data.pval = sicP;
+    return TCL_OK;
 }
 
@@ -0,0 +1,1456 @@
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Binary security descriptor parsing and access evaluation. See secdesc.h.
+ *
+ * Build with -DSECDESC_TEST to get a standalone test against generated
+ * descriptors and a benchmark against evaluating access in script (see
+ * end of file).
+ *
+ * Formats, all integers little endian:
+ *   descriptor: REVISION(1) SBZ(1) CONTROL(2) OWNER(4) GROUP(4) SACL(4)
+ *     DACL(4), the last four being offsets from the start, 0 if absent.
+ *   SID: REVISION(1) NSUBAUTH(1) AUTHORITY(6, big endian) SUBAUTH(4)...
+ *   ACL: REVISION(1) SBZ(1) ACLSIZE(2) ACECOUNT(2) SBZ(2) followed by ACEs
+ *   ACE: TYPE(1) FLAGS(1) ACESIZE(2) followed by, for all defined types,
+ *     MASK(4) and then
+ *     - for object types, FLAGS(4) and the object type and inherited
+ *       object type GUIDs (16 each) if the corresponding flag is set,
+ *     - for the compound type, COMPOUNDTYPE(2) RESERVED(2),
+ *     followed by the SID and for callback types, application data.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "secdesc.h"
+
+#define SECD_HEADER_SIZE     20
+#define SECD_ACL_HEADER_SIZE 8
+#define SECD_ACE_HEADER_SIZE 4
+#define SECD_SID_MAX_SUBAUTH 15
+#define SECD_SID_MAX_SIZE    (8 + 4 * SECD_SID_MAX_SUBAUTH)
+#define SECD_GUID_SIZE       16
+
+#define SECD_GENERIC_MASK (SECD_GENERIC_READ | SECD_GENERIC_WRITE | \
+                           SECD_GENERIC_EXECUTE | SECD_GENERIC_ALL)
+#define SECD_ALL_RIGHTS   (SECD_STANDARD_RIGHTS_ALL | 0xFFFF)
+
+#define SECD_FNV_OFFSET 14695981039346656037ULL
+#define SECD_FNV_PRIME  1099511628211ULL
+
+/* ACE types */
+enum {
+    SECD_ALLOW,
+    SECD_DENY,
+    SECD_AUDIT,
+    SECD_ALARM,
+    SECD_ALLOW_COMPOUND,
+    SECD_ALLOW_OBJECT,
+    SECD_DENY_OBJECT,
+    SECD_AUDIT_OBJECT,
+    SECD_ALARM_OBJECT,
+    SECD_ALLOW_CALLBACK,
+    SECD_DENY_CALLBACK,
+    SECD_ALLOW_CALLBACK_OBJECT,
+    SECD_DENY_CALLBACK_OBJECT,
+    SECD_AUDIT_CALLBACK,
+    SECD_ALARM_CALLBACK,
+    SECD_AUDIT_CALLBACK_OBJECT,
+    SECD_ALARM_CALLBACK_OBJECT,
+    SECD_MANDATORY_LABEL,
+    SECD_RESOURCE_ATTRIBUTE,
+    SECD_SCOPED_POLICY_ID,
+    SECD_MAX_ACE_TYPE = SECD_SCOPED_POLICY_ID
+};
+
+/* Relative ids of S-1-3-N well known SIDs */
+#define SECD_RID_CREATOR_OWNER 0
+#define SECD_RID_CREATOR_GROUP 1
+#define SECD_RID_OWNER_RIGHTS  4
+
+/*
+ * Position of each ACE type in the sort_aces order. Inherited ACEs follow
+ * all explicit ones. Types not known to sort_aces go last.
+ */
+#define SECD_SORT_OTHER 18
+static const unsigned char secdSortRank[SECD_MAX_ACE_TYPE + 1] = {
+    4,                          /* allow */
+    0,                          /* deny */
+    9,                          /* audit */
+    14,                         /* alarm */
+    6,                          /* allow_compound */
+    5,                          /* allow_object */
+    1,                          /* deny_object */
+    10,                         /* audit_object */
+    15,                         /* alarm_object */
+    7,                          /* allow_callback */
+    2,                          /* deny_callback */
+    8,                          /* allow_callback_object */
+    3,                          /* deny_callback_object */
+    11,                         /* audit_callback */
+    16,                         /* alarm_callback */
+    12,                         /* audit_callback_object */
+    17,                         /* alarm_callback_object */
+    13,                         /* mandatory_label */
+    SECD_SORT_OTHER,            /* resource_attribute */
+    SECD_SORT_OTHER,            /* scoped_policy_id */
+};
+
+/* Result of matching a SID against a principal */
+#define SECD_MATCH_NONE      0
+#define SECD_MATCH_ENABLED   1
+#define SECD_MATCH_DENY_ONLY 2
+
+typedef struct SecdPrincipalSid {
+    unsigned int hash;
+    unsigned int len;
+    int deny_only;
+    unsigned char sid[SECD_SID_MAX_SIZE];
+} SecdPrincipalSid;
+
+struct SecdPrincipal {
+    SecdPrincipalSid *sids;
+    int nsids;
+    int sids_size;
+    int *table;                 /* Open addressed, index + 1, 0 if empty */
+    unsigned int table_mask;
+};
+
+static unsigned int SecdU16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned int SecdU32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+static void SecdPut16(unsigned char *p, unsigned int v)
+{
+    p[0] = (unsigned char) v;
+    p[1] = (unsigned char) (v >> 8);
+}
+
+static void SecdPut32(unsigned char *p, unsigned int v)
+{
+    p[0] = (unsigned char) v;
+    p[1] = (unsigned char) (v >> 8);
+    p[2] = (unsigned char) (v >> 16);
+    p[3] = (unsigned char) (v >> 24);
+}
+
+static Tcl_WideUInt SecdHash64(const unsigned char *p, size_t len)
+{
+    Tcl_WideUInt h = SECD_FNV_OFFSET;
+    while (len--)
+        h = (h ^ *p++) * SECD_FNV_PRIME;
+    return h;
+}
+
+static unsigned int SecdHash32(const unsigned char *p, size_t len)
+{
+    unsigned int h = 2166136261U;
+    while (len--)
+        h = (h ^ *p++) * 16777619U;
+    return h;
+}
+
+/* Length of a SID that has already been validated */
+static unsigned int SecdSidLen(const unsigned char *sid)
+{
+    return 8 + 4 * sid[1];
+}
+
+/* Returns 1 if sid is S-1-3-rid */
+static int SecdIsCreatorSid(const unsigned char *sid, unsigned int len,
+                            unsigned int rid)
+{
+    static const unsigned char prefix[8] = {1, 1, 0, 0, 0, 0, 0, 3};
+    return sid != NULL && len == 12 && memcmp(sid, prefix, 8) == 0 &&
+        SecdU32(sid + 8) == rid;
+}
+
+static int SecdIsObjectAceType(unsigned int type)
+{
+    switch (type) {
+    case SECD_ALLOW_OBJECT:
+    case SECD_DENY_OBJECT:
+    case SECD_AUDIT_OBJECT:
+    case SECD_ALARM_OBJECT:
+    case SECD_ALLOW_CALLBACK_OBJECT:
+    case SECD_DENY_CALLBACK_OBJECT:
+    case SECD_AUDIT_CALLBACK_OBJECT:
+    case SECD_ALARM_CALLBACK_OBJECT:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+unsigned int SecdSidLength(const void *sid, size_t size)
+{
+    const unsigned char *p = (const unsigned char *) sid;
+    unsigned int len;
+
+    if (size < 8 || p[0] != 1 || p[1] > SECD_SID_MAX_SUBAUTH)
+        return 0;
+    len = 8 + 4 * p[1];
+    return len <= size ? len : 0;
+}
+
+/*
+ * Decodes the ACE at p which has avail bytes left in its ACL. Types not
+ * defined at the time of writing are returned as just a header.
+ */
+static int SecdDecodeAce(const unsigned char *p, unsigned int avail,
+                         SecdAce *aceP)
+{
+    unsigned int size, off;
+
+    if (avail < SECD_ACE_HEADER_SIZE)
+        return SECD_E_INVALID_ACL;
+    size = SecdU16(p + 2);
+    if (size < SECD_ACE_HEADER_SIZE || size > avail)
+        return SECD_E_INVALID_ACL;
+
+    aceP->raw = p;
+    aceP->size = size;
+    aceP->type = p[0];
+    aceP->flags = p[1];
+    aceP->mask = 0;
+    aceP->object_type = NULL;
+    aceP->inherited_object_type = NULL;
+    aceP->sid = NULL;
+    aceP->sid_len = 0;
+
+    if (aceP->type > SECD_MAX_ACE_TYPE)
+        return 0;
+    if (size < 8)
+        return SECD_E_INVALID_ACL;
+    aceP->mask = SecdU32(p + 4);
+    off = 8;
+    if (SecdIsObjectAceType(aceP->type)) {
+        unsigned int objflags;
+        if (size < 12)
+            return SECD_E_INVALID_ACL;
+        objflags = SecdU32(p + 8);
+        off = 12;
+        if (objflags & 1) {
+            if (size - off < SECD_GUID_SIZE)
+                return SECD_E_INVALID_ACL;
+            aceP->object_type = p + off;
+            off += SECD_GUID_SIZE;
+        }
+        if (objflags & 2) {
+            if (size - off < SECD_GUID_SIZE)
+                return SECD_E_INVALID_ACL;
+            aceP->inherited_object_type = p + off;
+            off += SECD_GUID_SIZE;
+        }
+    } else if (aceP->type == SECD_ALLOW_COMPOUND) {
+        off = 12;               /* Server SID follows type and reserved */
+        if (size < off)
+            return SECD_E_INVALID_ACL;
+    }
+    aceP->sid_len = SecdSidLength(p + off, size - off);
+    if (aceP->sid_len == 0)
+        return SECD_E_INVALID_ACL;
+    aceP->sid = p + off;
+    return 0;
+}
+
+int SecdValidateAcl(const unsigned char *acl, size_t size)
+{
+    unsigned int aclsize, off;
+    int i, count;
+    SecdAce ace;
+
+    if (size < SECD_ACL_HEADER_SIZE || acl[0] < 2 || acl[0] > 4)
+        return SECD_E_INVALID_ACL;
+    aclsize = SecdU16(acl + 2);
+    if (aclsize < SECD_ACL_HEADER_SIZE || aclsize > size)
+        return SECD_E_INVALID_ACL;
+    count = SecdU16(acl + 4);
+    for (i = 0, off = SECD_ACL_HEADER_SIZE; i < count; ++i) {
+        if (SecdDecodeAce(acl + off, aclsize - off, &ace) != 0)
+            return SECD_E_INVALID_ACL;
+        off += ace.size;
+    }
+    return 0;
+}
+
+unsigned int SecdAclSize(const unsigned char *acl)
+{
+    return SecdU16(acl + 2);
+}
+
+int SecdAclCount(const unsigned char *acl)
+{
+    return SecdU16(acl + 4);
+}
+
+void SecdAclIterInit(SecdAclIter *iterP, const unsigned char *acl)
+{
+    iterP->acl = acl;
+    iterP->offset = SECD_ACL_HEADER_SIZE;
+    iterP->remaining = acl ? SecdAclCount(acl) : 0;
+}
+
+int SecdAclNext(SecdAclIter *iterP, SecdAce *aceP)
+{
+    if (iterP->remaining <= 0)
+        return 0;
+    /* ACL was validated so this cannot fail */
+    SecdDecodeAce(iterP->acl + iterP->offset,
+                  SecdAclSize(iterP->acl) - iterP->offset, aceP);
+    iterP->offset += aceP->size;
+    iterP->remaining--;
+    return 1;
+}
+
+int SecdParse(SecdView *viewP, const void *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    unsigned int off;
+    int ret;
+
+    if (size < SECD_HEADER_SIZE || p[0] != 1)
+        return SECD_E_INVALID;
+    viewP->base = p;
+    viewP->len = (unsigned int) size;
+    viewP->control = (unsigned short) SecdU16(p + 2);
+    if (! (viewP->control & SECD_SELF_RELATIVE))
+        return SECD_E_INVALID;
+
+    viewP->owner = viewP->group = viewP->dacl = viewP->sacl = NULL;
+    off = SecdU32(p + 4);
+    if (off) {
+        if (off < SECD_HEADER_SIZE || off >= size ||
+            SecdSidLength(p + off, size - off) == 0)
+            return SECD_E_INVALID_SID;
+        viewP->owner = p + off;
+    }
+    off = SecdU32(p + 8);
+    if (off) {
+        if (off < SECD_HEADER_SIZE || off >= size ||
+            SecdSidLength(p + off, size - off) == 0)
+            return SECD_E_INVALID_SID;
+        viewP->group = p + off;
+    }
+    off = SecdU32(p + 12);
+    if (off && (viewP->control & SECD_SACL_PRESENT)) {
+        if (off < SECD_HEADER_SIZE || off >= size)
+            return SECD_E_INVALID_ACL;
+        ret = SecdValidateAcl(p + off, size - off);
+        if (ret)
+            return ret;
+        viewP->sacl = p + off;
+    }
+    off = SecdU32(p + 16);
+    if (off && (viewP->control & SECD_DACL_PRESENT)) {
+        if (off < SECD_HEADER_SIZE || off >= size)
+            return SECD_E_INVALID_ACL;
+        ret = SecdValidateAcl(p + off, size - off);
+        if (ret)
+            return ret;
+        viewP->dacl = p + off;
+    }
+    return 0;
+}
+
+unsigned int SecdMapGeneric(unsigned int mask, const SecdGenericMapping *mapP)
+{
+    if (mapP == NULL || (mask & SECD_GENERIC_MASK) == 0)
+        return mask;
+    if (mask & SECD_GENERIC_READ)
+        mask |= mapP->read;
+    if (mask & SECD_GENERIC_WRITE)
+        mask |= mapP->write;
+    if (mask & SECD_GENERIC_EXECUTE)
+        mask |= mapP->execute;
+    if (mask & SECD_GENERIC_ALL)
+        mask |= mapP->all;
+    return mask & ~SECD_GENERIC_MASK;
+}
+
+SecdPrincipal *SecdPrincipalNew(void)
+{
+    SecdPrincipal *pP = (SecdPrincipal *) ckalloc(sizeof(*pP));
+    pP->nsids = 0;
+    pP->sids_size = 8;
+    pP->sids = (SecdPrincipalSid *)
+        ckalloc(pP->sids_size * sizeof(SecdPrincipalSid));
+    pP->table_mask = 15;
+    pP->table = (int *) ckalloc((pP->table_mask + 1) * sizeof(int));
+    memset(pP->table, 0, (pP->table_mask + 1) * sizeof(int));
+    return pP;
+}
+
+void SecdPrincipalFree(SecdPrincipal *pP)
+{
+    if (pP) {
+        ckfree(pP->sids);
+        ckfree(pP->table);
+        ckfree(pP);
+    }
+}
+
+/* Returns the slot for the SID, which is empty if the SID is not present */
+static unsigned int SecdPrincipalSlot(const SecdPrincipal *pP,
+                                      const unsigned char *sid,
+                                      unsigned int len, unsigned int hash)
+{
+    unsigned int slot = hash & pP->table_mask;
+    int i;
+
+    while ((i = pP->table[slot]) != 0) {
+        const SecdPrincipalSid *psP = &pP->sids[i - 1];
+        if (psP->hash == hash && psP->len == len &&
+            memcmp(psP->sid, sid, len) == 0)
+            break;
+        slot = (slot + 1) & pP->table_mask;
+    }
+    return slot;
+}
+
+static int SecdPrincipalMatch(const SecdPrincipal *pP,
+                              const unsigned char *sid, unsigned int len)
+{
+    int i;
+
+    if (sid == NULL)
+        return SECD_MATCH_NONE;
+    i = pP->table[SecdPrincipalSlot(pP, sid, len, SecdHash32(sid, len))];
+    if (i == 0)
+        return SECD_MATCH_NONE;
+    return pP->sids[i - 1].deny_only ? SECD_MATCH_DENY_ONLY : SECD_MATCH_ENABLED;
+}
+
+int SecdPrincipalAddSid(SecdPrincipal *pP, const void *sid, size_t size,
+                        int deny_only)
+{
+    unsigned int len, hash, slot;
+    SecdPrincipalSid *psP;
+
+    len = SecdSidLength(sid, size);
+    if (len == 0 || len != size)
+        return SECD_E_INVALID_SID;
+    hash = SecdHash32(sid, len);
+    slot = SecdPrincipalSlot(pP, sid, len, hash);
+    if (pP->table[slot]) {
+        /* Enabled wins if the same SID is added both ways */
+        psP = &pP->sids[pP->table[slot] - 1];
+        psP->deny_only = psP->deny_only && deny_only;
+        return 0;
+    }
+
+    if (pP->nsids == pP->sids_size) {
+        pP->sids_size *= 2;
+        pP->sids = (SecdPrincipalSid *)
+            ckrealloc(pP->sids, pP->sids_size * sizeof(SecdPrincipalSid));
+    }
+    psP = &pP->sids[pP->nsids++];
+    psP->hash = hash;
+    psP->len = len;
+    psP->deny_only = deny_only;
+    memcpy(psP->sid, sid, len);
+    pP->table[slot] = pP->nsids;
+
+    /* Keep the table at most half full */
+    if (2 * (unsigned int) pP->nsids > pP->table_mask) {
+        int i;
+        pP->table_mask = 2 * pP->table_mask + 1;
+        pP->table = (int *)
+            ckrealloc(pP->table, (pP->table_mask + 1) * sizeof(int));
+        memset(pP->table, 0, (pP->table_mask + 1) * sizeof(int));
+        for (i = 0; i < pP->nsids; ++i) {
+            psP = &pP->sids[i];
+            pP->table[SecdPrincipalSlot(pP, psP->sid, psP->len, psP->hash)] =
+                i + 1;
+        }
+    }
+    return 0;
+}
+
+unsigned int SecdEffectiveAccess(const SecdView *viewP,
+                                 const SecdPrincipal *pP,
+                                 const SecdGenericMapping *mapP,
+                                 const unsigned char *object_type)
+{
+    SecdAclIter iter;
+    SecdAce ace;
+    unsigned int granted, denied, mask;
+    int owner_match, match, allow;
+
+    if (viewP->dacl == NULL)
+        return mapP ? mapP->all : SECD_ALL_RIGHTS;
+
+    granted = denied = 0;
+    owner_match = SECD_MATCH_NONE;
+    if (viewP->owner) {
+        owner_match = SecdPrincipalMatch(pP, viewP->owner,
+                                         SecdSidLen(viewP->owner));
+        if (owner_match == SECD_MATCH_ENABLED) {
+            /* Implicit owner rights unless overridden by OWNER RIGHTS */
+            granted = SECD_READ_CONTROL | SECD_WRITE_DAC;
+            SecdAclIterInit(&iter, viewP->dacl);
+            while (SecdAclNext(&iter, &ace)) {
+                if (!(ace.flags & SECD_INHERIT_ONLY) &&
+                    SecdIsCreatorSid(ace.sid, ace.sid_len,
+                                     SECD_RID_OWNER_RIGHTS)) {
+                    granted = 0;
+                    break;
+                }
+            }
+        }
+    }
+
+    SecdAclIterInit(&iter, viewP->dacl);
+    while (SecdAclNext(&iter, &ace)) {
+        if (ace.flags & SECD_INHERIT_ONLY)
+            continue;
+        switch (ace.type) {
+        case SECD_ALLOW:
+        case SECD_ALLOW_OBJECT:
+            allow = 1;
+            break;
+        case SECD_DENY:
+        case SECD_DENY_OBJECT:
+        case SECD_DENY_CALLBACK:
+        case SECD_DENY_CALLBACK_OBJECT:
+            allow = 0;
+            break;
+        default:
+            continue;           /* Includes conditional allows */
+        }
+        if (ace.object_type &&
+            (object_type == NULL ||
+             memcmp(ace.object_type, object_type, SECD_GUID_SIZE) != 0))
+            continue;
+        if (SecdIsCreatorSid(ace.sid, ace.sid_len, SECD_RID_OWNER_RIGHTS))
+            match = owner_match;
+        else
+            match = SecdPrincipalMatch(pP, ace.sid, ace.sid_len);
+        if (match == SECD_MATCH_NONE ||
+            (allow && match == SECD_MATCH_DENY_ONLY))
+            continue;
+        mask = SecdMapGeneric(ace.mask, mapP);
+        if (allow)
+            granted |= mask & ~denied;
+        else
+            denied |= mask & ~granted;
+    }
+    return granted & ~(SECD_MAXIMUM_ALLOWED | SECD_ACCESS_SYSTEM_SECURITY);
+}
+
+int SecdEffectiveAccessBatch(int nsds, const unsigned char **sds,
+                             const size_t *lens, const SecdPrincipal *pP,
+                             const SecdGenericMapping *mapP,
+                             const unsigned char *object_type,
+                             unsigned int *granted, int *badP, int *uniqueP)
+{
+    struct {
+        Tcl_WideUInt hash;
+        int index;
+    } *slots;
+    unsigned int mask, slot;
+    Tcl_WideUInt hash;
+    SecdView view;
+    int i, j, unique, ret;
+
+    if (nsds > INT_MAX / 4)
+        return SECD_E_INVALID;
+    for (mask = 15; mask < 2 * (unsigned int) nsds; mask = 2 * mask + 1)
+        ;
+    slots = ckalloc((mask + 1) * sizeof(*slots));
+    for (slot = 0; slot <= mask; ++slot)
+        slots[slot].index = -1;
+
+    ret = 0;
+    unique = 0;
+    for (i = 0; i < nsds; ++i) {
+        hash = SecdHash64(sds[i], lens[i]);
+        slot = (unsigned int) hash & mask;
+        while ((j = slots[slot].index) >= 0) {
+            if (slots[slot].hash == hash && lens[j] == lens[i] &&
+                memcmp(sds[j], sds[i], lens[i]) == 0)
+                break;
+            slot = (slot + 1) & mask;
+        }
+        if (j >= 0) {
+            granted[i] = granted[j];
+            continue;
+        }
+        ret = SecdParse(&view, sds[i], lens[i]);
+        if (ret) {
+            *badP = i;
+            break;
+        }
+        granted[i] = SecdEffectiveAccess(&view, pP, mapP, object_type);
+        slots[slot].hash = hash;
+        slots[slot].index = i;
+        unique++;
+    }
+    ckfree(slots);
+    if (uniqueP)
+        *uniqueP = unique;
+    return ret;
+}
+
+typedef struct SecdBuf {
+    unsigned char *p;
+    size_t len;
+    size_t size;
+} SecdBuf;
+
+static unsigned char *SecdBufAppend(SecdBuf *bufP, const void *data,
+                                    size_t len)
+{
+    unsigned char *p;
+    if (bufP->len + len > bufP->size) {
+        while (bufP->len + len > bufP->size)
+            bufP->size *= 2;
+        bufP->p = (unsigned char *) ckrealloc(bufP->p, bufP->size);
+    }
+    p = bufP->p + bufP->len;
+    if (data)
+        memcpy(p, data, len);
+    bufP->len += len;
+    return p;
+}
+
+/*
+ * Appends a copy of an ACE with new flags and, for defined types, mask.
+ * If sid is not NULL it replaces the SID of the ACE.
+ */
+static void SecdAppendAce(SecdBuf *bufP, const SecdAce *aceP,
+                          unsigned int flags, unsigned int mask,
+                          const unsigned char *sid)
+{
+    unsigned char *p;
+    unsigned int head, tail, sid_len, size;
+
+    if (sid == NULL || aceP->sid == NULL) {
+        p = SecdBufAppend(bufP, aceP->raw, aceP->size);
+    } else {
+        sid_len = SecdSidLen(sid);
+        head = (unsigned int) (aceP->sid - aceP->raw);
+        tail = aceP->size - head - aceP->sid_len;
+        size = head + sid_len + tail;
+        p = SecdBufAppend(bufP, NULL, size);
+        memcpy(p, aceP->raw, head);
+        memcpy(p + head, sid, sid_len);
+        memcpy(p + head + sid_len, aceP->sid + aceP->sid_len, tail);
+        /* Caller checks the ACL size so a truncated value does not matter */
+        SecdPut16(p + 2, size);
+    }
+    p[1] = (unsigned char) flags;
+    if (aceP->sid)
+        SecdPut32(p + 4, mask);
+}
+
+int SecdInheritAcl(const unsigned char *parent_acl, int is_container,
+                   const unsigned char *owner, const unsigned char *group,
+                   const SecdGenericMapping *mapP,
+                   const unsigned char *child_type,
+                   unsigned char **aclP)
+{
+    SecdBuf buf;
+    SecdAclIter iter;
+    SecdAce ace;
+    const unsigned char *sid;
+    unsigned int flags, keep, count, inherit_flag;
+    int effective, propagate;
+
+    buf.size = 256;
+    buf.len = 0;
+    buf.p = (unsigned char *) ckalloc(buf.size);
+    SecdBufAppend(&buf, NULL, SECD_ACL_HEADER_SIZE);
+    count = 0;
+    inherit_flag = is_container ? SECD_CONTAINER_INHERIT : SECD_OBJECT_INHERIT;
+
+    SecdAclIterInit(&iter, parent_acl);
+    while (SecdAclNext(&iter, &ace)) {
+        flags = ace.flags;
+        if (! (flags & (SECD_OBJECT_INHERIT | SECD_CONTAINER_INHERIT)))
+            continue;
+        effective = (flags & inherit_flag) &&
+            (ace.inherited_object_type == NULL ||
+             (child_type != NULL &&
+              memcmp(ace.inherited_object_type, child_type,
+                     SECD_GUID_SIZE) == 0));
+        propagate = is_container && !(flags & SECD_NO_PROPAGATE);
+        /* Flags kept on ACEs that propagate further */
+        keep = SECD_INHERITED | (flags & (SECD_AUDIT_FLAGS |
+                                          SECD_OBJECT_INHERIT |
+                                          SECD_CONTAINER_INHERIT));
+
+        if (effective) {
+            sid = NULL;
+            if (owner && SecdIsCreatorSid(ace.sid, ace.sid_len,
+                                          SECD_RID_CREATOR_OWNER))
+                sid = owner;
+            else if (group && SecdIsCreatorSid(ace.sid, ace.sid_len,
+                                               SECD_RID_CREATOR_GROUP))
+                sid = group;
+            if (propagate && sid == NULL &&
+                (ace.sid == NULL || (ace.mask & SECD_GENERIC_MASK) == 0)) {
+                /* Same ACE applies to the child and its descendants */
+                SecdAppendAce(&buf, &ace, keep, ace.mask, NULL);
+                count++;
+                continue;
+            }
+            SecdAppendAce(&buf, &ace,
+                          SECD_INHERITED | (flags & SECD_AUDIT_FLAGS),
+                          SecdMapGeneric(ace.mask, mapP), sid);
+            count++;
+        }
+        if (propagate) {
+            SecdAppendAce(&buf, &ace, keep | SECD_INHERIT_ONLY, ace.mask, NULL);
+            count++;
+        }
+    }
+
+    if (buf.len > 0xFFFF || count > 0xFFFF) {
+        ckfree(buf.p);
+        return SECD_E_INVALID_ACL;
+    }
+    buf.p[0] = parent_acl ? parent_acl[0] : 2;
+    buf.p[1] = 0;
+    SecdPut16(buf.p + 2, (unsigned int) buf.len);
+    SecdPut16(buf.p + 4, count);
+    SecdPut16(buf.p + 6, 0);
+    *aclP = buf.p;
+    return 0;
+}
+
+int SecdSortAclOrder(const unsigned char *acl, unsigned int *order)
+{
+    SecdAclIter iter;
+    SecdAce ace;
+    unsigned char *keys;
+    int first[2 * (SECD_SORT_OTHER + 1)];
+    int count, i, k, n, sorted;
+
+    count = SecdAclCount(acl);
+    if (count == 0)
+        return 1;
+
+    keys = (unsigned char *) ckalloc(count);
+    memset(first, 0, sizeof(first));
+    sorted = 1;
+    i = 0;
+    SecdAclIterInit(&iter, acl);
+    while (SecdAclNext(&iter, &ace)) {
+        k = ace.type <= SECD_MAX_ACE_TYPE ?
+            secdSortRank[ace.type] : SECD_SORT_OTHER;
+        if (ace.flags & SECD_INHERITED)
+            k += SECD_SORT_OTHER + 1;
+        if (i && k < keys[i - 1])
+            sorted = 0;
+        keys[i] = (unsigned char) k;
+        first[k]++;
+        i++;
+    }
+
+    if (sorted) {
+        for (i = 0; i < count; ++i)
+            order[i] = i;
+    } else {
+        /* Counting sort, which is stable. first[k] is the position of
+           the first ACE with key k. */
+        for (k = 0, n = 0; k < 2 * (SECD_SORT_OTHER + 1); ++k) {
+            int nk = first[k];
+            first[k] = n;
+            n += nk;
+        }
+        for (i = 0; i < count; ++i)
+            order[first[keys[i]]++] = i;
+    }
+    ckfree(keys);
+    return sorted;
+}
+
+void SecdSortAcl(unsigned char *acl)
+{
+    SecdAclIter iter;
+    SecdAce ace;
+    unsigned int *offsets, *sizes, *order, total;
+    unsigned char *tmp, *p;
+    int count, i;
+
+    count = SecdAclCount(acl);
+    if (count < 2)
+        return;
+
+    offsets = (unsigned int *) ckalloc(count * 3 * sizeof(unsigned int));
+    sizes = offsets + count;
+    order = sizes + count;
+    if (! SecdSortAclOrder(acl, order)) {
+        i = 0;
+        SecdAclIterInit(&iter, acl);
+        while (SecdAclNext(&iter, &ace)) {
+            offsets[i] = (unsigned int) (ace.raw - acl);
+            sizes[i] = ace.size;
+            i++;
+        }
+        total = iter.offset - SECD_ACL_HEADER_SIZE;
+        tmp = (unsigned char *) ckalloc(total);
+        for (i = 0, p = tmp; i < count; ++i) {
+            memcpy(p, acl + offsets[order[i]], sizes[order[i]]);
+            p += sizes[order[i]];
+        }
+        memcpy(acl + SECD_ACL_HEADER_SIZE, tmp, total);
+        ckfree(tmp);
+    }
+    ckfree(offsets);
+}
+
+#ifdef SECDESC_TEST
+/*
+ * Standalone test. Build with
+ *   cc -DSECDESC_TEST secdesc.c -ltcl
+ *
+ * Descriptors are generated from the list form returned by twapi,
+ *   {CONTROL OWNER GROUP DACL SACL}
+ * where SIDs are strings, an ACL is {REVISION ACES}, "null" for a NULL
+ * ACL and empty if absent, and an ACE is {TYPE FLAGS MASK SID} or
+ * {TYPE FLAGS MASK OBJTYPE INHERITEDOBJTYPE SID} for object types. GUIDs
+ * are written as short names padded with zeroes to 16 bytes. The access
+ * commands use the file generic mapping.
+ */
+#include <stdio.h>
+
+static const SecdGenericMapping testFileMapping = {
+    0x120089, 0x120116, 0x1200A0, 0x1F01FF
+};
+
+static int TestSidFromObj(Tcl_Interp *interp, Tcl_Obj *objP,
+                          unsigned char *sid, unsigned int *lenP)
+{
+    const char *s = Tcl_GetString(objP);
+    Tcl_WideUInt auth;
+    unsigned long sub;
+    char *end;
+    int n;
+
+    if (strncmp(s, "S-1-", 4) != 0)
+        goto error;
+    auth = strtoull(s + 4, &end, 10);
+    sid[0] = 1;
+    for (n = 0; n < 6; ++n)
+        sid[2 + n] = (unsigned char) (auth >> (8 * (5 - n)));
+    for (n = 0; *end == '-' && n < SECD_SID_MAX_SUBAUTH; ++n) {
+        sub = strtoul(end + 1, &end, 10);
+        SecdPut32(sid + 8 + 4 * n, (unsigned int) sub);
+    }
+    if (*end)
+        goto error;
+    sid[1] = (unsigned char) n;
+    *lenP = 8 + 4 * n;
+    return TCL_OK;
+error:
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("bad SID %s", s));
+    return TCL_ERROR;
+}
+
+static Tcl_Obj *TestSidToObj(const unsigned char *sid)
+{
+    Tcl_WideUInt auth = 0;
+    char buf[256];
+    int i, n;
+
+    for (i = 0; i < 6; ++i)
+        auth = (auth << 8) | sid[2 + i];
+    n = snprintf(buf, sizeof(buf), "S-%d-%llu", sid[0], (unsigned long long) auth);
+    for (i = 0; i < sid[1]; ++i)
+        n += snprintf(buf + n, sizeof(buf) - n, "-%u", SecdU32(sid + 8 + 4 * i));
+    return Tcl_NewStringObj(buf, n);
+}
+
+static void TestGuidFromObj(Tcl_Obj *objP, unsigned char *guid)
+{
+    int len;
+    const char *s = Tcl_GetStringFromObj(objP, &len);
+    memset(guid, 0, SECD_GUID_SIZE);
+    memcpy(guid, s, len < SECD_GUID_SIZE ? len : SECD_GUID_SIZE);
+}
+
+static Tcl_Obj *TestGuidToObj(const unsigned char *guid)
+{
+    int len;
+    if (guid == NULL)
+        return Tcl_NewObj();
+    for (len = 0; len < SECD_GUID_SIZE && guid[len]; ++len)
+        ;
+    return Tcl_NewStringObj((const char *) guid, len);
+}
+
+static int TestAppendAcl(Tcl_Interp *interp, Tcl_Obj *aclObj,
+                         Tcl_Obj *bufObj)
+{
+    Tcl_Obj **elems, **aces, **f;
+    int nelems, naces, nf, i, rev, type, flags, start, off;
+    unsigned int objflags, sid_len;
+    Tcl_WideInt mask;
+    unsigned char ace[1024], *p;
+
+    if (Tcl_ListObjGetElements(interp, aclObj, &nelems, &elems) != TCL_OK ||
+        nelems != 2 || Tcl_GetIntFromObj(interp, elems[0], &rev) != TCL_OK ||
+        Tcl_ListObjGetElements(interp, elems[1], &naces, &aces) != TCL_OK)
+        return TCL_ERROR;
+    Tcl_GetByteArrayFromObj(bufObj, &start);
+    p = Tcl_SetByteArrayLength(bufObj, start + SECD_ACL_HEADER_SIZE);
+    p += start;
+    p[0] = (unsigned char) rev;
+    p[1] = 0;
+    SecdPut16(p + 4, naces);
+    SecdPut16(p + 6, 0);
+    for (i = 0; i < naces; ++i) {
+        if (Tcl_ListObjGetElements(interp, aces[i], &nf, &f) != TCL_OK ||
+            nf < 3 || Tcl_GetIntFromObj(interp, f[0], &type) != TCL_OK ||
+            Tcl_GetIntFromObj(interp, f[1], &flags) != TCL_OK)
+            return TCL_ERROR;
+        ace[0] = (unsigned char) type;
+        ace[1] = (unsigned char) flags;
+        if (type > SECD_MAX_ACE_TYPE) {
+            /* Opaque body */
+            int len;
+            const char *s = Tcl_GetStringFromObj(f[2], &len);
+            memcpy(ace + 4, s, len);
+            off = 4 + len;
+        } else {
+            if (Tcl_GetWideIntFromObj(interp, f[2], &mask) != TCL_OK)
+                return TCL_ERROR;
+            SecdPut32(ace + 4, (unsigned int) mask);
+            off = 8;
+            if (SecdIsObjectAceType(type)) {
+                if (nf != 6)
+                    goto bad_ace;
+                objflags = 0;
+                off = 12;
+                if (Tcl_GetCharLength(f[3])) {
+                    objflags |= 1;
+                    TestGuidFromObj(f[3], ace + off);
+                    off += SECD_GUID_SIZE;
+                }
+                if (Tcl_GetCharLength(f[4])) {
+                    objflags |= 2;
+                    TestGuidFromObj(f[4], ace + off);
+                    off += SECD_GUID_SIZE;
+                }
+                SecdPut32(ace + 8, objflags);
+            } else if (nf != 4)
+                goto bad_ace;
+            if (TestSidFromObj(interp, f[nf - 1], ace + off, &sid_len) != TCL_OK)
+                return TCL_ERROR;
+            off += sid_len;
+        }
+        SecdPut16(ace + 2, off);
+        Tcl_GetByteArrayFromObj(bufObj, &nelems);
+        p = Tcl_SetByteArrayLength(bufObj, nelems + off);
+        memcpy(p + nelems, ace, off);
+    }
+    p = Tcl_GetByteArrayFromObj(bufObj, &nelems);
+    SecdPut16(p + start + 2, nelems - start);
+    return TCL_OK;
+bad_ace:
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("bad ACE %s", Tcl_GetString(aces[i])));
+    return TCL_ERROR;
+}
+
+static Tcl_Obj *TestAclToObj(const unsigned char *acl)
+{
+    SecdAclIter iter;
+    SecdAce ace;
+    Tcl_Obj *acesObj, *objs[6];
+    int n;
+
+    if (acl == NULL)
+        return Tcl_NewObj();
+    acesObj = Tcl_NewListObj(0, NULL);
+    SecdAclIterInit(&iter, acl);
+    while (SecdAclNext(&iter, &ace)) {
+        objs[0] = Tcl_NewIntObj(ace.type);
+        objs[1] = Tcl_NewIntObj(ace.flags);
+        if (ace.sid == NULL) {
+            objs[2] = Tcl_NewStringObj((const char *) ace.raw + 4, ace.size - 4);
+            n = 3;
+        } else {
+            objs[2] = Tcl_ObjPrintf("0x%x", ace.mask);
+            n = 3;
+            if (SecdIsObjectAceType(ace.type)) {
+                objs[n++] = TestGuidToObj(ace.object_type);
+                objs[n++] = TestGuidToObj(ace.inherited_object_type);
+            }
+            objs[n++] = TestSidToObj(ace.sid);
+        }
+        Tcl_ListObjAppendElement(NULL, acesObj, Tcl_NewListObj(n, objs));
+    }
+    objs[0] = Tcl_NewIntObj(acl[0]);
+    objs[1] = acesObj;
+    return Tcl_NewListObj(2, objs);
+}
+
+/* Builds a binary descriptor from list form */
+static int TestSdFromObj(Tcl_Interp *interp, Tcl_Obj *sdObj, Tcl_Obj **resultP)
+{
+    Tcl_Obj **elems, *bufObj;
+    int nelems, control, i, off;
+    unsigned int sid_len;
+    unsigned char sid[SECD_SID_MAX_SIZE], *p;
+    static const int offsets[4] = {4, 8, 16, 12}; /* owner group dacl sacl */
+    static const int present[4] = {0, 0, SECD_DACL_PRESENT, SECD_SACL_PRESENT};
+
+    if (Tcl_ListObjGetElements(interp, sdObj, &nelems, &elems) != TCL_OK ||
+        nelems != 5 || Tcl_GetIntFromObj(interp, elems[0], &control) != TCL_OK)
+        return TCL_ERROR;
+    bufObj = Tcl_NewByteArrayObj(NULL, SECD_HEADER_SIZE);
+    Tcl_IncrRefCount(bufObj);
+    control |= SECD_SELF_RELATIVE;
+    for (i = 0; i < 4; ++i) {
+        p = Tcl_GetByteArrayFromObj(bufObj, &off);
+        SecdPut32(p + offsets[i], 0);
+        if (Tcl_GetCharLength(elems[i + 1]) == 0)
+            continue;
+        control |= present[i];
+        if (i < 2) {
+            if (TestSidFromObj(interp, elems[i + 1], sid, &sid_len) != TCL_OK)
+                goto error;
+            p = Tcl_SetByteArrayLength(bufObj, off + sid_len);
+            memcpy(p + off, sid, sid_len);
+        } else if (strcmp(Tcl_GetString(elems[i + 1]), "null") == 0) {
+            continue;
+        } else if (TestAppendAcl(interp, elems[i + 1], bufObj) != TCL_OK) {
+            goto error;
+        }
+        p = Tcl_GetByteArrayFromObj(bufObj, NULL);
+        SecdPut32(p + offsets[i], off);
+    }
+    p = Tcl_GetByteArrayFromObj(bufObj, NULL);
+    p[0] = 1;
+    p[1] = 0;
+    SecdPut16(p + 2, control);
+    *resultP = bufObj;          /* Caller must decrement */
+    return TCL_OK;
+error:
+    Tcl_DecrRefCount(bufObj);
+    return TCL_ERROR;
+}
+
+static int TestError(Tcl_Interp *interp, int code)
+{
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("error %d", code));
+    return TCL_ERROR;
+}
+
+static int TestPrincipalFromObjs(Tcl_Interp *interp, Tcl_Obj *sidsObj,
+                                 Tcl_Obj *denyObj, SecdPrincipal **pPP)
+{
+    SecdPrincipal *pP = SecdPrincipalNew();
+    Tcl_Obj **sids;
+    int nsids, i, deny_only;
+    unsigned int len;
+    unsigned char sid[SECD_SID_MAX_SIZE];
+
+    for (deny_only = 0; deny_only < 2; ++deny_only) {
+        Tcl_Obj *objP = deny_only ? denyObj : sidsObj;
+        if (objP == NULL)
+            continue;
+        if (Tcl_ListObjGetElements(interp, objP, &nsids, &sids) != TCL_OK)
+            goto error;
+        for (i = 0; i < nsids; ++i) {
+            if (TestSidFromObj(interp, sids[i], sid, &len) != TCL_OK)
+                goto error;
+            SecdPrincipalAddSid(pP, sid, len, deny_only);
+        }
+    }
+    *pPP = pP;
+    return TCL_OK;
+error:
+    SecdPrincipalFree(pP);
+    return TCL_ERROR;
+}
+
+static int TestSecdObjCmd(ClientData cd, Tcl_Interp *interp, int objc,
+                          Tcl_Obj *const objv[])
+{
+    const char *cmd;
+    Tcl_Obj *sdObj, *resultObj;
+    SecdView view;
+    SecdPrincipal *pP;
+    unsigned char *sd, guid[SECD_GUID_SIZE];
+    int len, ret;
+
+    (void) cd;
+    if (objc < 3)
+        goto usage;
+    cmd = Tcl_GetString(objv[1]);
+
+    if (strcmp(cmd, "sd") == 0) {
+        if (TestSdFromObj(interp, objv[2], &sdObj) != TCL_OK)
+            return TCL_ERROR;
+        Tcl_SetObjResult(interp, sdObj);
+        Tcl_DecrRefCount(sdObj);
+        return TCL_OK;
+    }
+
+    if (strcmp(cmd, "sortacl") == 0) {
+        /* Sorts an ACL in list form */
+        Tcl_Obj *bufObj = Tcl_NewByteArrayObj(NULL, 0);
+        Tcl_IncrRefCount(bufObj);
+        ret = TestAppendAcl(interp, objv[2], bufObj);
+        if (ret == TCL_OK) {
+            sd = Tcl_GetByteArrayFromObj(bufObj, &len);
+            if (SecdValidateAcl(sd, len) != 0) {
+                ret = TestError(interp, SecdValidateAcl(sd, len));
+            } else {
+                SecdSortAcl(sd);
+                Tcl_SetObjResult(interp, TestAclToObj(sd));
+            }
+        }
+        Tcl_DecrRefCount(bufObj);
+        return ret;
+    }
+
+    if (strcmp(cmd, "sortorder") == 0) {
+        /* Returns the sorted positions of the ACEs of an ACL in list form */
+        Tcl_Obj *bufObj = Tcl_NewByteArrayObj(NULL, 0);
+        Tcl_IncrRefCount(bufObj);
+        ret = TestAppendAcl(interp, objv[2], bufObj);
+        if (ret == TCL_OK) {
+            unsigned int *order;
+            int i, count;
+            sd = Tcl_GetByteArrayFromObj(bufObj, &len);
+            if (SecdValidateAcl(sd, len) != 0) {
+                ret = TestError(interp, SecdValidateAcl(sd, len));
+            } else {
+                Tcl_Obj *resultObj = Tcl_NewListObj(0, NULL);
+                count = SecdAclCount(sd);
+                order = (unsigned int *) ckalloc((count + 1) * sizeof(*order));
+                SecdSortAclOrder(sd, order);
+                for (i = 0; i < count; ++i)
+                    Tcl_ListObjAppendElement(NULL, resultObj,
+                                             Tcl_NewIntObj(order[i]));
+                ckfree(order);
+                Tcl_SetObjResult(interp, resultObj);
+            }
+        }
+        Tcl_DecrRefCount(bufObj);
+        return ret;
+    }
+
+    if (strcmp(cmd, "batch") == 0) {
+        /* secd batch SDS SIDS - returns {UNIQUE GRANTED} */
+        Tcl_Obj **sds, **objs;
+        const unsigned char **ptrs;
+        size_t *lens;
+        unsigned int *granted;
+        int nsds, i, bad, unique;
+        if (objc != 4 ||
+            Tcl_ListObjGetElements(interp, objv[2], &nsds, &sds) != TCL_OK ||
+            TestPrincipalFromObjs(interp, objv[3], NULL, &pP) != TCL_OK)
+            return TCL_ERROR;
+        ptrs = (const unsigned char **) ckalloc(nsds * sizeof(*ptrs) + 1);
+        lens = (size_t *) ckalloc(nsds * sizeof(*lens) + 1);
+        granted = (unsigned int *) ckalloc(nsds * sizeof(*granted) + 1);
+        for (i = 0; i < nsds; ++i) {
+            ptrs[i] = Tcl_GetByteArrayFromObj(sds[i], &len);
+            lens[i] = len;
+        }
+        ret = SecdEffectiveAccessBatch(nsds, ptrs, lens, pP, &testFileMapping,
+                                       NULL, granted, &bad, &unique);
+        if (ret) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("error %d at %d", ret, bad));
+        } else {
+            objs = (Tcl_Obj **) ckalloc(nsds * sizeof(*objs) + 1);
+            for (i = 0; i < nsds; ++i)
+                objs[i] = Tcl_NewWideIntObj(granted[i]);
+            resultObj = Tcl_NewListObj(0, NULL);
+            Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(unique));
+            Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewListObj(nsds, objs));
+            Tcl_SetObjResult(interp, resultObj);
+            ckfree(objs);
+        }
+        ckfree(granted);
+        ckfree(lens);
+        ckfree(ptrs);
+        SecdPrincipalFree(pP);
+        return ret ? TCL_ERROR : TCL_OK;
+    }
+
+    /* Remaining commands take a binary descriptor */
+    sd = Tcl_GetByteArrayFromObj(objv[2], &len);
+    ret = SecdParse(&view, sd, len);
+    if (ret)
+        return TestError(interp, ret);
+
+    if (strcmp(cmd, "parse") == 0) {
+        Tcl_Obj *objs[5];
+        objs[0] = Tcl_NewIntObj(view.control);
+        objs[1] = view.owner ? TestSidToObj(view.owner) : Tcl_NewObj();
+        objs[2] = view.group ? TestSidToObj(view.group) : Tcl_NewObj();
+        objs[3] = (view.control & SECD_DACL_PRESENT) && view.dacl == NULL ?
+            Tcl_NewStringObj("null", 4) : TestAclToObj(view.dacl);
+        objs[4] = (view.control & SECD_SACL_PRESENT) && view.sacl == NULL ?
+            Tcl_NewStringObj("null", 4) : TestAclToObj(view.sacl);
+        Tcl_SetObjResult(interp, Tcl_NewListObj(5, objs));
+        return TCL_OK;
+    }
+
+    if (strcmp(cmd, "access") == 0) {
+        /* secd access SD SIDS ?DENYONLY? ?OBJTYPE? */
+        if (objc < 4 || objc > 6 ||
+            TestPrincipalFromObjs(interp, objv[3], objc > 4 ? objv[4] : NULL,
+                                  &pP) != TCL_OK)
+            return TCL_ERROR;
+        if (objc > 5)
+            TestGuidFromObj(objv[5], guid);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                             "0x%x", SecdEffectiveAccess(
+                                 &view, pP, &testFileMapping,
+                                 objc > 5 ? guid : NULL)));
+        SecdPrincipalFree(pP);
+        return TCL_OK;
+    }
+
+    if (strcmp(cmd, "inherit") == 0) {
+        /* secd inherit SD dacl|sacl CONTAINER ?OWNER GROUP? ?CHILDTYPE? */
+        unsigned char owner[SECD_SID_MAX_SIZE], group[SECD_SID_MAX_SIZE];
+        unsigned char *acl;
+        unsigned int sid_len;
+        int container;
+        if (objc < 5 || objc == 6 || objc > 8 ||
+            Tcl_GetBooleanFromObj(interp, objv[4], &container) != TCL_OK)
+            goto usage;
+        if (objc > 6 &&
+            (TestSidFromObj(interp, objv[5], owner, &sid_len) != TCL_OK ||
+             TestSidFromObj(interp, objv[6], group, &sid_len) != TCL_OK))
+            return TCL_ERROR;
+        if (objc > 7)
+            TestGuidFromObj(objv[7], guid);
+        ret = SecdInheritAcl(strcmp(Tcl_GetString(objv[3]), "sacl") ?
+                             view.dacl : view.sacl, container,
+                             objc > 6 ? owner : NULL, objc > 6 ? group : NULL,
+                             &testFileMapping, objc > 7 ? guid : NULL, &acl);
+        if (ret)
+            return TestError(interp, ret);
+        if (SecdValidateAcl(acl, SecdAclSize(acl)) != 0) {
+            ckfree(acl);
+            Tcl_SetResult(interp, "inherited ACL not valid", TCL_STATIC);
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, TestAclToObj(acl));
+        ckfree(acl);
+        return TCL_OK;
+    }
+
+usage:
+    Tcl_SetResult(interp, "bad secd command", TCL_STATIC);
+    return TCL_ERROR;
+}
+
+static const char *testScript =
+    "proc check {script expected} {\n"
+    "    if {[catch {uplevel 1 $script} result]} {set result [list error $result]}\n"
+    "    if {$result ne $expected} {\n"
+    "        puts \"FAIL: $script\\n  expected: $expected\\n  got:      $result\"\n"
+    "        incr ::failures\n"
+    "    }\n"
+    "    incr ::checks\n"
+    "}\n"
+    "set failures 0; set checks 0\n"
+    "set alice S-1-5-21-1-2-3-1001\n"
+    "set bob S-1-5-21-1-2-3-1002\n"
+    "set users S-1-5-32-545\n"
+    "set admins S-1-5-32-544\n"
+    "set everyone S-1-1-0\n"
+    "set creator_owner S-1-3-0\n"
+    "set creator_group S-1-3-1\n"
+    "set owner_rights S-1-3-4\n"
+    /* Round trip */
+    "set acl [list 2 [list [list 1 0 0x2 $bob] [list 0 3 0x1f01ff $admins] [list 0 16 0x1200a9 $users]]]\n"
+    "set l [list 32772 $alice $users $acl {}]\n"
+    "check {secd parse [secd sd $l]} $l\n"
+    "check {secd parse [secd sd {0 {} {} null {}}]} {32772 {} {} null {}}\n"
+    "check {secd parse [secd sd {0 {} {} {} {}}]} {32768 {} {} {} {}}\n"
+    "set oacl [list 4 [list [list 5 0 0x100 ga gb $alice] [list 6 0 0x10 ga {} $bob] [list 7 192 0x20 {} gb $users] [list 99 0 opaque!]]]\n"
+    "check {secd parse [secd sd [list 0 {} {} {} $oacl]]} [list 32784 {} {} {} $oacl]\n"
+    /* Damaged descriptors are rejected */
+    "set sd [secd sd $l]\n"
+    "check {secd parse [string range $sd 0 18]} {error {error 1338}}\n"
+    "check {secd parse [string replace $sd 0 0 \\x02]} {error {error 1338}}\n"
+    "check {secd parse [string replace $sd 3 3 \\x00]} {error {error 1338}}\n"
+    "check {secd parse [string replace $sd 4 7 [binary format i 1000]]} {error {error 1337}}\n"
+    "check {secd parse [string replace $sd 4 7 [binary format i 4]]} {error {error 1337}}\n"
+    "check {secd parse [string range $sd 0 end-4]} {error {error 1336}}\n"
+    "set daclpos [binary scan $sd @16i off; set off]\n"
+    "check {secd parse [string replace $sd $daclpos+4 $daclpos+4 \\x04]} {error {error 1336}}\n"
+    "check {secd parse [string replace $sd $daclpos+10 $daclpos+11 [binary format s 200]]} {error {error 1336}}\n"
+    "check {secd parse [string replace $sd $daclpos+10 $daclpos+11 [binary format s 2]]} {error {error 1336}}\n"
+    "check {secd parse [string replace $sd $daclpos+17 $daclpos+17 \\x10]} {error {error 1336}}\n"
+    /* Access: deny then allow, generic mapping, groups */
+    "check {secd access $sd [list $alice $users]} 0x1600a9\n"
+    "check {secd access $sd [list $bob $users]} 0x1200a9\n"
+    "check {secd access $sd [list $bob $admins]} 0x1f01fd\n"
+    "check {secd access $sd [list $bob]} 0x0\n"
+    "check {secd access [secd sd [list 0 $alice {} [list 2 [list [list 0 0 0x80000000 $alice]]] {}]] $alice} 0x160089\n"
+    "check {secd access [secd sd [list 0 {} {} [list 2 [list [list 0 0 0x10000000 $everyone]]] {}]] [list $bob $everyone]} 0x1f01ff\n"
+    /* Order matters, earlier ACEs win */
+    "set sd2 [secd sd [list 0 {} {} [list 2 [list [list 0 0 0x3 $users] [list 1 0 0x2 $users]]] {}]]\n"
+    "check {secd access $sd2 $users} 0x3\n"
+    /* NULL and missing DACLs grant everything */
+    "check {secd access [secd sd {0 {} {} null {}}] $bob} 0x1f01ff\n"
+    "check {secd access [secd sd {0 {} {} {} {}}] $bob} 0x1f01ff\n"
+    "check {secd access [secd sd {0 {} {} {2 {}} {}}] $bob} 0x0\n"
+    /* Owner rights, implicit and overridden */
+    "check {secd access [secd sd [list 0 $alice {} {2 {}} {}]] $alice} 0x60000\n"
+    "check {secd access [secd sd [list 0 $alice {} [list 2 [list [list 0 0 0x1 $owner_rights]]] {}]] $alice} 0x1\n"
+    "check {secd access [secd sd [list 0 $alice {} [list 2 [list [list 0 0x8 0x1 $owner_rights]]] {}]] $alice} 0x60000\n"
+    "check {secd access [secd sd [list 0 $alice {} [list 2 [list [list 0 0 0x1 $owner_rights]]] {}]] $bob} 0x0\n"
+    "check {secd access [secd sd [list 0 $alice {} [list 2 [list [list 1 0 0x40000 $alice]]] {}]] $alice} 0x60000\n"
+    /* Inherit only ACEs do not apply, inherited ones do */
+    "check {secd access [secd sd [list 0 {} {} [list 2 [list [list 0 0xb 0x1 $bob] [list 0 0x10 0x2 $bob]]] {}]] $bob} 0x2\n"
+    /* Deny only SIDs only match deny ACEs */
+    "set sd3 [secd sd [list 0 {} {} [list 2 [list [list 1 0 0x1 $admins] [list 0 0 0x7 $admins] [list 0 0 0x10 $users]]] {}]]\n"
+    "check {secd access $sd3 $users $admins} 0x10\n"
+    "check {secd access $sd3 [list $users $admins] $admins} 0x16\n"
+    "check {secd access $sd3 $users} 0x10\n"
+    /* Object ACEs apply only to the matching object type */
+    "set sd4 [secd sd [list 0 {} {} [list 4 [list [list 6 0 0x1 prop1 {} $bob] [list 5 0 0x3 {} {} $bob] [list 5 0 0x4 prop2 {} $bob]]] {}]]\n"
+    "check {secd access $sd4 $bob} 0x3\n"
+    "check {secd access $sd4 $bob {} prop1} 0x2\n"
+    "check {secd access $sd4 $bob {} prop2} 0x7\n"
+    /* Conditional allows are skipped, conditional denies applied */
+    "check {secd access [secd sd [list 0 {} {} [list 2 [list [list 9 0 0x1 $bob] [list 10 0 0x2 $bob] [list 0 0 0x7 $bob]]] {}]] $bob} 0x5\n"
+    /* Audit and other ACE types do not affect access */
+    "check {secd access [secd sd [list 0 {} {} [list 2 [list [list 2 0 0x1 $bob] [list 17 0 0x1 S-1-16-8192] [list 99 0 xxxx] [list 0 0 0x4 $bob]]] {}]] $bob} 0x4\n"
+    /* MAXIMUM_ALLOWED and ACCESS_SYSTEM_SECURITY are never granted */
+    "check {secd access [secd sd [list 0 {} {} [list 2 [list [list 0 0 0x03000001 $bob]]] {}]] $bob} 0x1\n"
+    /* Batch */
+    "set sds [list $sd $sd2 $sd $sd3 $sd2 $sd]\n"
+    "check {secd batch $sds [list $users]} {3 {1179817 3 1179817 16 3 1179817}}\n"
+    "check {secd batch {} [list $users]} {0 {}}\n"
+    "check {secd batch [list $sd $sd2 junk $sd] [list $users]} {error {error 1338 at 2}}\n"
+    "check {secd batch [list $sd [string range $sd 0 end-1]] [list $users]} {error {error 1336 at 1}}\n"
+    /* Inheritance */
+    "set pacl [list 2 [list \\\n"
+    "    [list 0 0x1 0x1200a9 $users] \\\n"
+    "    [list 0 0x2 0x1200a9 $bob] \\\n"
+    "    [list 0 0x3 0x1f01ff $admins] \\\n"
+    "    [list 0 0xb 0x10000000 $creator_owner] \\\n"
+    "    [list 0 0x7 0x80000000 $creator_group] \\\n"
+    "    [list 1 0x0 0x2 $alice] \\\n"
+    "    [list 0 0x13 0x1 $everyone]]]\n"
+    "set psd [secd sd [list 0 $admins $admins $pacl {}]]\n"
+    "check {secd inherit $psd dacl 0 $alice $users} [list 2 [list [list 0 16 0x1200a9 $users] [list 0 16 0x1f01ff $admins] [list 0 16 0x1f01ff $alice] [list 0 16 0x120089 $users] [list 0 16 0x1 $everyone]]]\n"
+    "check {secd inherit $psd dacl 1 $alice $users} [list 2 [list [list 0 25 0x1200a9 $users] [list 0 18 0x1200a9 $bob] [list 0 19 0x1f01ff $admins] [list 0 16 0x1f01ff $alice] [list 0 27 0x10000000 $creator_owner] [list 0 16 0x120089 $users] [list 0 19 0x1 $everyone]]]\n"
+    "check {secd inherit $psd dacl 1} [list 2 [list [list 0 25 0x1200a9 $users] [list 0 18 0x1200a9 $bob] [list 0 19 0x1f01ff $admins] [list 0 16 0x1f01ff $creator_owner] [list 0 27 0x10000000 $creator_owner] [list 0 16 0x120089 $creator_group] [list 0 19 0x1 $everyone]]]\n"
+    "check {secd inherit [secd sd {0 {} {} {} {}}] dacl 1} {2 {}}\n"
+    /* Object type specific inheritance and audit flags */
+    "set psd [secd sd [list 0 {} {} [list 4 [list [list 5 0x2 0x1 {} user $bob] [list 5 0x1 0x2 {} {} $bob]]] [list 2 [list [list 2 0xc1 0x30000000 $everyone]]]]]\n"
+    "check {secd inherit $psd dacl 1} [list 4 [list [list 5 26 0x1 {} user $bob] [list 5 25 0x2 {} {} $bob]]]\n"
+    "check {secd inherit $psd dacl 1 $alice $users user} [list 4 [list [list 5 18 0x1 {} user $bob] [list 5 25 0x2 {} {} $bob]]]\n"
+    "check {secd inherit $psd dacl 0 $alice $users user} [list 4 [list [list 5 16 0x2 {} {} $bob]]]\n"
+    "check {secd inherit $psd sacl 0} [list 2 [list [list 2 208 0x1f01ff $everyone]]]\n"
+    "check {secd inherit $psd sacl 1} [list 2 [list [list 2 217 0x30000000 $everyone]]]\n"
+    /* Sorting follows sort_aces */
+    "check {secd sortacl [list 2 [list [list 0 16 0x1 $bob] [list 0 0 0x2 $bob] [list 2 0 0x3 $bob] [list 1 16 0x4 $bob] [list 1 0 0x5 $bob] [list 6 0 0x6 {} {} $bob] [list 0 0 0x7 $alice] [list 99 0 xx] [list 17 0 0x1 S-1-16-4096]]]} [list 2 [list [list 1 0 0x5 $bob] [list 6 0 0x6 {} {} $bob] [list 0 0 0x2 $bob] [list 0 0 0x7 $alice] [list 2 0 0x3 $bob] [list 17 0 0x1 S-1-16-4096] [list 99 0 xx] [list 1 16 0x4 $bob] [list 0 16 0x1 $bob]]]\n"
+    "check {secd sortacl [list 2 [list [list 1 0 0x1 $bob] [list 0 0 0x2 $bob]]]} [list 2 [list [list 1 0 0x1 $bob] [list 0 0 0x2 $bob]]]\n"
+    "check {secd sortacl {2 {}}} {2 {}}\n"
+    "check {secd sortorder [list 2 [list [list 0 16 0x1 $bob] [list 0 0 0x2 $bob] [list 2 0 0x3 $bob] [list 1 16 0x4 $bob] [list 1 0 0x5 $bob] [list 6 0 0x6 {} {} $bob] [list 0 0 0x7 $alice] [list 99 0 xx] [list 17 0 0x1 S-1-16-4096]]]} {4 5 1 6 2 8 7 3 0}\n"
+    "check {secd sortorder [list 2 [list [list 1 0 0x1 $bob] [list 0 0 0x2 $bob]]]} {0 1}\n"
+    "check {secd sortorder {2 {}}} {}\n"
+    "puts \"[set checks] checks, [set failures] failures\"\n"
+    "set failures\n";
+
+static const char *benchScript =
+    /*
+     * A file system where a few thousand distinct descriptors are shared
+     * by many files, as is typical since files mostly inherit from
+     * their directory.
+     */
+    "set users S-1-5-32-545\n"
+    "set sids [list S-1-5-21-1-2-3-1001 $users S-1-1-0 S-1-5-11 S-1-5-4]\n"
+    "expr {srand(1)}\n"
+    "proc randsid {} {return S-1-5-21-1-2-3-[expr {1000 + int(rand() * 50)}]}\n"
+    "set templates {}\n"
+    "for {set i 0} {$i < 2000} {incr i} {\n"
+    "    set aces [list [list 0 0x10 0x1f01ff S-1-5-18] [list 0 0x10 0x1f01ff S-1-5-32-544] [list 0 0x10 0x1200a9 $users]]\n"
+    "    for {set j 0} {$j < 1 + $i % 6} {incr j} {\n"
+    "        lappend aces [list [expr {rand() < 0.2}] 0 [expr {int(rand() * 0x1ff) | (rand() < 0.3 ? 0x80000000 : 0)}] [randsid]]\n"
+    "    }\n"
+    "    lappend templates [list 0x8004 [randsid] S-1-5-32-544 [list 2 [lsort -command {apply {{a b} {expr {[lindex $b 0] - [lindex $a 0]}}}} $aces]] {}]\n"
+    "}\n"
+    "set lsds {}; set bsds {}\n"
+    "for {set i 0} {$i < 200000} {incr i} {\n"
+    "    set t [lindex $templates [expr {int(pow(rand(), 3) * 2000)}]]\n"
+    "    lappend lsds $t\n"
+    "    lappend bsds [secd sd $t]\n"
+    "}\n"
+    /* What a script audit does with get_resource_security_descriptor output */
+    "proc script_access {secd sids} {\n"
+    "    lassign $secd control owner group dacl\n"
+    "    set granted 0; set denied 0\n"
+    "    if {$owner in $sids} {set granted 0x60000}\n"
+    "    foreach ace [lindex $dacl 1] {\n"
+    "        lassign $ace type flags mask sid\n"
+    "        if {$flags & 0x8} continue\n"
+    "        if {$sid ni $sids} continue\n"
+    "        if {$mask & 0x80000000} {set mask [expr {($mask | 0x120089) & 0x0fffffff}]}\n"
+    "        if {$type == 0} {\n"
+    "            set granted [expr {$granted | ($mask & ~$denied)}]\n"
+    "        } elseif {$type == 1} {\n"
+    "            set denied [expr {$denied | ($mask & ~$granted)}]\n"
+    "        }\n"
+    "    }\n"
+    "    return $granted\n"
+    "}\n"
+    "proc bench {label script} {\n"
+    "    set t [lindex [uplevel 1 [list time $script 1]] 0]\n"
+    "    puts [format {%-44s %10.1f ms %8.2f us/sd} $label [expr {$t / 1000.0}] [expr {$t / 200000.0}]]\n"
+    "}\n"
+    "bench {script: walk list form} {set sres [lmap s $lsds {script_access $s $sids}]}\n"
+    "bench {native: one call per descriptor} {set nres [lmap s $bsds {expr {[secd access $s $sids]}}]}\n"
+    "bench {native: batch} {lassign [secd batch $bsds $sids] unique bres}\n"
+    "puts \"$unique unique descriptors\"\n"
+    "set distinct [lmap t $templates {secd sd $t}]\n"
+    "set distinct [concat {*}[lrepeat 100 $distinct]]\n"
+    "set distinct [lmap s $distinct {string cat $s}]\n"
+    "bench {native: batch, 2000 distinct x 100 copies} {secd batch $distinct $sids}\n"
+    "set failures 0; set checks 0\n"
+    "proc check {script expected} {\n"
+    "    set result [uplevel 1 $script]\n"
+    "    if {$result ne $expected} {puts \"FAIL: $script\"; incr ::failures}\n"
+    "    incr ::checks\n"
+    "}\n"
+    "check {expr {$sres eq $nres}} 1\n"
+    "check {expr {$sres eq $bres}} 1\n"
+    "puts \"$checks checks, $failures failures\"\n"
+    "set failures\n";
+
+int main(int argc, char **argv)
+{
+    Tcl_Interp *interp;
+    int failures;
+
+    Tcl_FindExecutable(argv[0]);
+    interp = Tcl_CreateInterp();
+    Tcl_CreateObjCommand(interp, "secd", TestSecdObjCmd, NULL, NULL);
+
+    if (Tcl_Eval(interp, testScript) != TCL_OK ||
+        (argc > 1 && strcmp(argv[1], "bench") == 0 &&
+         Tcl_Eval(interp, benchScript) != TCL_OK)) {
+        fprintf(stderr, "%s\n", Tcl_GetStringResult(interp));
+        return 1;
+    }
+    failures = atoi(Tcl_GetStringResult(interp));
+    Tcl_DeleteInterp(interp);
+    return failures ? 1 : 0;
+}
+#endif /* SECDESC_TEST */
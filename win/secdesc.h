@@ -0,0 +1,205 @@
+#ifndef SECDESC_H
+#define SECDESC_H
+
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Parser and access evaluator for self-relative security descriptors in
+ * their binary form, as returned by GetFileSecurity, GetNamedSecurityInfo
+ * etc. Descriptors are validated once by SecdParse after which the SIDs,
+ * ACLs and ACEs are accessed in place. All accesses are bounds checked so
+ * damaged descriptors result in errors, never invalid accesses.
+ *
+ * The evaluator computes the maximum access a set of SIDs is granted by a
+ * DACL, the ACEs a child object inherits from its parent and the
+ * canonical ACE order. The module only depends on Tcl (for memory
+ * allocation) since the formats are the same on all platforms, so it can
+ * be tested with generated descriptors anywhere.
+ */
+
+#include <tcl.h>
+
+/* Error codes. Defaults match the corresponding Windows errors. */
+#ifndef SECD_E_INVALID_ACL
+#define SECD_E_INVALID_ACL 1336 /* ERROR_INVALID_ACL */
+#endif
+#ifndef SECD_E_INVALID_SID
+#define SECD_E_INVALID_SID 1337 /* ERROR_INVALID_SID */
+#endif
+#ifndef SECD_E_INVALID
+#define SECD_E_INVALID 1338     /* ERROR_INVALID_SECURITY_DESCR */
+#endif
+
+/* Security descriptor control bits */
+#define SECD_DACL_PRESENT    0x0004
+#define SECD_SACL_PRESENT    0x0010
+#define SECD_DACL_PROTECTED  0x1000
+#define SECD_SELF_RELATIVE   0x8000
+
+/* ACE flags */
+#define SECD_OBJECT_INHERIT      0x01
+#define SECD_CONTAINER_INHERIT   0x02
+#define SECD_NO_PROPAGATE        0x04
+#define SECD_INHERIT_ONLY        0x08
+#define SECD_INHERITED           0x10
+#define SECD_AUDIT_FLAGS         0xC0 /* SUCCESSFUL_ACCESS | FAILED_ACCESS */
+
+/* Access rights used by the evaluator */
+#define SECD_READ_CONTROL        0x00020000
+#define SECD_WRITE_DAC           0x00040000
+#define SECD_STANDARD_RIGHTS_ALL 0x001F0000
+#define SECD_ACCESS_SYSTEM_SECURITY 0x01000000
+#define SECD_MAXIMUM_ALLOWED     0x02000000
+#define SECD_GENERIC_ALL         0x10000000
+#define SECD_GENERIC_EXECUTE     0x20000000
+#define SECD_GENERIC_WRITE       0x40000000
+#define SECD_GENERIC_READ        0x80000000
+
+/* Same layout as GENERIC_MAPPING */
+typedef struct SecdGenericMapping {
+    unsigned int read;
+    unsigned int write;
+    unsigned int execute;
+    unsigned int all;
+} SecdGenericMapping;
+
+/*
+ * A parsed descriptor. Pointers point into the descriptor. The SIDs and
+ * ACLs are NULL if not present. Note a DACL may be marked present in
+ * control and still be NULL, which grants all access.
+ */
+typedef struct SecdView {
+    const unsigned char *base;
+    unsigned int len;
+    unsigned short control;
+    const unsigned char *owner;
+    const unsigned char *group;
+    const unsigned char *dacl;
+    const unsigned char *sacl;
+} SecdView;
+
+/* A decoded ACE */
+typedef struct SecdAce {
+    const unsigned char *raw;   /* Start of ACE */
+    unsigned int size;          /* AceSize */
+    unsigned char type;
+    unsigned char flags;
+    unsigned int mask;          /* 0 for types without a mask */
+    const unsigned char *object_type;     /* GUID or NULL */
+    const unsigned char *inherited_object_type; /* GUID or NULL */
+    const unsigned char *sid;   /* NULL for types without a SID */
+    unsigned int sid_len;
+} SecdAce;
+
+/* Validates the size bytes at data and fills in *viewP. Returns 0 or error. */
+int SecdParse(SecdView *viewP, const void *data, size_t size);
+
+/*
+ * Validates an ACL of at most size bytes. Returns 0 or SECD_E_INVALID_ACL.
+ * SecdParse validates the ACLs in a descriptor so this is only needed for
+ * ACLs from other sources.
+ */
+int SecdValidateAcl(const unsigned char *acl, size_t size);
+unsigned int SecdAclSize(const unsigned char *acl);
+int SecdAclCount(const unsigned char *acl);
+
+/* Iterates over the ACEs of a validated ACL */
+typedef struct SecdAclIter {
+    const unsigned char *acl;
+    unsigned int offset;
+    int remaining;
+} SecdAclIter;
+void SecdAclIterInit(SecdAclIter *iterP, const unsigned char *acl);
+/* Decodes the next ACE into *aceP. Returns 0 when there are no more. */
+int SecdAclNext(SecdAclIter *iterP, SecdAce *aceP);
+
+/* Returns the length of a SID, or 0 if it is not valid within size bytes */
+unsigned int SecdSidLength(const void *sid, size_t size);
+
+/* Replaces generic rights in mask with the specific rights they map to */
+unsigned int SecdMapGeneric(unsigned int mask, const SecdGenericMapping *mapP);
+
+/*
+ * The identity access is evaluated for, i.e. the user and group SIDs in a
+ * token. Deny only SIDs only match deny ACEs.
+ */
+typedef struct SecdPrincipal SecdPrincipal;
+SecdPrincipal *SecdPrincipalNew(void);
+void SecdPrincipalFree(SecdPrincipal *pP);
+/* Returns 0 or SECD_E_INVALID_SID */
+int SecdPrincipalAddSid(SecdPrincipal *pP, const void *sid, size_t size,
+                        int deny_only);
+
+/*
+ * Returns the maximum access granted to the principal by the DACL,
+ * following AccessCheck:
+ *   - No DACL or a NULL DACL grants all rights.
+ *   - The owner is implicitly granted READ_CONTROL and WRITE_DAC unless
+ *     the DACL contains an effective OWNER RIGHTS ACE.
+ *   - ACEs are evaluated in order, skipping inherit only ACEs. Rights
+ *     already denied are not granted by later ACEs and vice versa.
+ *   - Object ACEs with an object type only apply if object_type (a 16
+ *     byte GUID, may be NULL) matches.
+ *   - Conditional (callback) allow ACEs are not evaluated and are
+ *     skipped. Conditional deny ACEs are always applied.
+ * Privileges and mandatory labels are not considered.
+ */
+unsigned int SecdEffectiveAccess(const SecdView *viewP,
+                                 const SecdPrincipal *pP,
+                                 const SecdGenericMapping *mapP,
+                                 const unsigned char *object_type);
+
+/*
+ * Evaluates many descriptors. Identical descriptors, which are very common
+ * in file systems, are detected by hash and only evaluated once. Stores
+ * the granted access for each descriptor in granted[] and returns 0, or
+ * returns an error and stores the index of the bad descriptor in *badP.
+ * *uniqueP receives the number of distinct descriptors if not NULL.
+ */
+int SecdEffectiveAccessBatch(int nsds, const unsigned char **sds,
+                             const size_t *lens, const SecdPrincipal *pP,
+                             const SecdGenericMapping *mapP,
+                             const unsigned char *object_type,
+                             unsigned int *granted, int *badP, int *uniqueP);
+
+/*
+ * Computes the ACL a new child object inherits from the parent ACL
+ * (a DACL or SACL from a validated descriptor, may be NULL), as done by
+ * CreatePrivateObjectSecurity:
+ *   - OBJECT_INHERIT ACEs apply to objects and CONTAINER_INHERIT ACEs to
+ *     containers. Containers also receive OBJECT_INHERIT ACEs as inherit
+ *     only ACEs unless NO_PROPAGATE_INHERIT is set.
+ *   - In effective ACEs, generic rights are mapped and CREATOR OWNER and
+ *     CREATOR GROUP are replaced by owner and group if not NULL. If such
+ *     an ACE also propagates further, it is split into an effective ACE
+ *     and an inherit only ACE that keeps the original.
+ *   - Object ACEs with an inherited object type only take effect for
+ *     children of that type (child_type, may be NULL).
+ * Only inherited ACEs are returned; the caller combines them with the
+ * explicit ACEs of the child. Stores a ckalloc'ed ACL in *aclP.
+ */
+int SecdInheritAcl(const unsigned char *parent_acl, int is_container,
+                   const unsigned char *owner, const unsigned char *group,
+                   const SecdGenericMapping *mapP,
+                   const unsigned char *child_type,
+                   unsigned char **aclP);
+
+/*
+ * Sorts the ACEs of a validated ACL in place into the order used by
+ * sort_aces: explicit ACEs before inherited ones and within each, deny
+ * before allow before audit, alarm etc. The sort is stable.
+ */
+void SecdSortAcl(unsigned char *acl);
+
+/*
+ * Stores in order[] the positions of the ACEs of a validated ACL in the
+ * order SecdSortAcl would place them, so callers can reorder their own
+ * representation of the ACEs. order must have room for SecdAclCount(acl)
+ * entries. Returns 1 if the ACEs are already in order.
+ */
+int SecdSortAclOrder(const unsigned char *acl, unsigned int *order);
+
+#endif /* SECDESC_H */
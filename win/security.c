@@ -8,6 +8,7 @@
 /* Interface to Windows API related to security and access control functions */
 
 #include "twapi.h"
+#include "secdesc.h"
 
 #ifndef TWAPI_SINGLE_MODULE
 static HMODULE gModuleHandle;     /* DLL handle to ourselves */
@@ -628,11 +629,34 @@ int Twapi_InitializeSecurityDescriptor(Tcl_Interp *interp)
     return ObjSetResult(interp, resultObj);
 }
 
+/*
+ * Returns a security descriptor returned by GetNamedSecurityInfo and
+ * friends, either in list form or, if binary is true, in the self-relative
+ * binary form accepted by Twapi_SecdEffectiveAccess. Frees secdP.
+ */
+static TCL_RESULT TwapiReturnSecurityInfo(
+    Tcl_Interp *interp,
+    PSECURITY_DESCRIPTOR secdP,
+    int binary
+)
+{
+    Tcl_Obj *resultObj;
+
+    if (binary)
+        resultObj = ObjFromByteArray((unsigned char *) secdP,
+                                     GetSecurityDescriptorLength(secdP));
+    else
+        resultObj = ObjFromSECURITY_DESCRIPTOR(interp, secdP);
+    LocalFree(secdP);
+    return resultObj ? ObjSetResult(interp, resultObj) : TCL_ERROR;
+}
+
 int Twapi_GetNamedSecurityInfo (
     Tcl_Interp *interp,
     LPWSTR name,
     int type,
-    int wanted_fields
+    int wanted_fields,
+    int binary
 )
 {
     DWORD error;
@@ -641,26 +665,21 @@ int Twapi_GetNamedSecurityInfo (
     PACL daclP;
     PACL saclP;
     PSECURITY_DESCRIPTOR secdP;
-    Tcl_Obj *resultObj;
 
     error = GetNamedSecurityInfoW(name, type, wanted_fields,
                                   &ownerP, &groupP, &daclP, &saclP, &secdP);
     if (error)
         return Twapi_AppendSystemError(interp, error);
 
-    resultObj = ObjFromSECURITY_DESCRIPTOR(interp, secdP);
-    LocalFree(secdP);
-    if (resultObj)
-        ObjSetResult(interp, resultObj);
-    return TCL_OK;
-
+    return TwapiReturnSecurityInfo(interp, secdP, binary);
 }
 
 int Twapi_GetSecurityInfo (
     Tcl_Interp *interp,
     HANDLE h,
     int type,
-    int wanted_fields
+    int wanted_fields,
+    int binary
 )
 {
     DWORD error;
@@ -669,18 +688,13 @@ int Twapi_GetSecurityInfo (
     PACL daclP;
     PACL saclP;
     PSECURITY_DESCRIPTOR secdP;
-    Tcl_Obj *resultObj;
 
     error = GetSecurityInfo(h, type, wanted_fields,
                             &ownerP, &groupP, &daclP, &saclP, &secdP);
     if (error)
-        Twapi_AppendSystemError(interp, error);
+        return Twapi_AppendSystemError(interp, error);
 
-    resultObj = ObjFromSECURITY_DESCRIPTOR(interp, secdP);
-    LocalFree(secdP);
-    if (resultObj)
-        ObjSetResult(interp, resultObj);
-    return TCL_OK;
+    return TwapiReturnSecurityInfo(interp, secdP, binary);
 }
 
 // TBD - should this be in account.c ?
@@ -1038,7 +1052,9 @@ static TCL_RESULT Twapi_SecCallObjCmd(ClientData clientdata, Tcl_Interp *interp,
                 result.type = TRT_GETLASTERROR;
             break;
         case 502:
-            result.value.ival = Twapi_GetNamedSecurityInfo(interp, s, dw, dw2);
+        case 506:
+            result.value.ival = Twapi_GetNamedSecurityInfo(interp, s, dw, dw2,
+                                                           func == 506);
             result.type = TRT_TCL_RESULT;
             break;
         case 503: // CredEnumerate
@@ -1086,7 +1102,9 @@ static TCL_RESULT Twapi_SecCallObjCmd(ClientData clientdata, Tcl_Interp *interp,
 
         switch (func) {
         case 1003:
-            result.value.ival = Twapi_GetSecurityInfo(interp, h, dw, dw2);
+        case 1010:
+            result.value.ival = Twapi_GetSecurityInfo(interp, h, dw, dw2,
+                                                      func == 1010);
             result.type = TRT_TCL_RESULT;
             break;
         case 1004:
@@ -1526,6 +1544,218 @@ badargcount:
 }
 
 
+/*
+ * Parses a generic mapping {READ WRITE EXECUTE ALL}. An empty list means
+ * generic rights are not mapped and *mapPP is set to NULL.
+ */
+static TCL_RESULT ObjToSecdGenericMapping(Tcl_Interp *interp, Tcl_Obj *objP,
+                                          SecdGenericMapping *mapP,
+                                          SecdGenericMapping **mapPP)
+{
+    Tcl_Obj **objv;
+    Tcl_Size objc;
+
+    if (ObjGetElements(interp, objP, &objc, &objv) != TCL_OK)
+        return TCL_ERROR;
+    if (objc == 0) {
+        *mapPP = NULL;
+        return TCL_OK;
+    }
+    if (objc != 4)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
+                                   "Generic mapping must have 4 elements.");
+    if (ObjToUINT(interp, objv[0], &mapP->read) != TCL_OK ||
+        ObjToUINT(interp, objv[1], &mapP->write) != TCL_OK ||
+        ObjToUINT(interp, objv[2], &mapP->execute) != TCL_OK ||
+        ObjToUINT(interp, objv[3], &mapP->all) != TCL_OK)
+        return TCL_ERROR;
+    *mapPP = mapP;
+    return TCL_OK;
+}
+
+/* Adds a list of SIDs to a principal. Caller manages SWS. */
+static TCL_RESULT TwapiSecdAddSids(Tcl_Interp *interp, SecdPrincipal *pP,
+                                   Tcl_Obj *sidsObj, int deny_only)
+{
+    Tcl_Obj **sidObjs;
+    Tcl_Size i, nsids;
+    PSID sidP;
+
+    if (ObjGetElements(interp, sidsObj, &nsids, &sidObjs) != TCL_OK)
+        return TCL_ERROR;
+    for (i = 0; i < nsids; ++i) {
+        if (ObjToPSIDNonNullSWS(interp, sidObjs[i], &sidP) != TCL_OK)
+            return TCL_ERROR;
+        if (SecdPrincipalAddSid(pP, sidP, GetLengthSid(sidP), deny_only))
+            return TwapiReturnError(interp, TWAPI_INVALID_ARGS);
+    }
+    return TCL_OK;
+}
+
+/*
+ * Twapi_SecdEffectiveAccess SDS SIDS DENYONLYSIDS MAPPING OBJECTTYPE
+ * Returns the access granted to the SIDs by each of the binary security
+ * descriptors in SDS. See SecdEffectiveAccess.
+ */
+static int Twapi_SecdEffectiveAccessObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Tcl_Obj **sdObjs, *sidsObj, *denyObj, *mapObj, **resultObjs;
+    Tcl_Size i, nsds, len;
+    const unsigned char **sds;
+    size_t *lens;
+    unsigned int *granted;
+    SecdGenericMapping map, *mapP;
+    SecdPrincipal *pP;
+    GUID guid, *guidP = &guid;
+    int bad, error;
+    TCL_RESULT res;
+    SWSMark mark;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     ARGSKIP, GETOBJ(sidsObj), GETOBJ(denyObj), GETOBJ(mapObj),
+                     GETVAR(guidP, ObjToGUID_NULL), ARGEND) != TCL_OK ||
+        ObjToSecdGenericMapping(interp, mapObj, &map, &mapP) != TCL_OK ||
+        ObjGetElements(interp, objv[1], &nsds, &sdObjs) != TCL_OK)
+        return TCL_ERROR;
+    if (nsds > INT_MAX / 4)
+        return TwapiReturnError(interp, TWAPI_INVALID_ARGS);
+
+    mark = SWSPushMark();
+    pP = SecdPrincipalNew();
+    res = TwapiSecdAddSids(interp, pP, sidsObj, 0);
+    if (res == TCL_OK)
+        res = TwapiSecdAddSids(interp, pP, denyObj, 1);
+    if (res != TCL_OK)
+        goto vamoose;
+
+    sds = SWSAlloc(nsds * sizeof(*sds) + 1, NULL);
+    lens = SWSAlloc(nsds * sizeof(*lens) + 1, NULL);
+    granted = SWSAlloc(nsds * sizeof(*granted) + 1, NULL);
+    for (i = 0; i < nsds; ++i) {
+        sds[i] = ObjToByteArray(sdObjs[i], &len);
+        lens[i] = len;
+    }
+    error = SecdEffectiveAccessBatch((int) nsds, sds, lens, pP, mapP,
+                                     (unsigned char *) guidP, granted,
+                                     &bad, NULL);
+    if (error) {
+        ObjSetResult(interp, Tcl_ObjPrintf("Security descriptor at index %d:", bad));
+        res = Twapi_AppendSystemError(interp, error);
+        goto vamoose;
+    }
+    resultObjs = SWSAlloc(nsds * sizeof(*resultObjs) + 1, NULL);
+    for (i = 0; i < nsds; ++i)
+        resultObjs[i] = ObjFromDWORD(granted[i]);
+    res = ObjSetResult(interp, ObjNewList(nsds, resultObjs));
+
+vamoose:
+    SecdPrincipalFree(pP);
+    SWSPopMark(mark);
+    return res;
+}
+
+/*
+ * Twapi_SecdInheritedAces PARENTSD SACL ISCONTAINER OWNER GROUP MAPPING CHILDTYPE
+ * Returns the DACL (or SACL if SACL is true) inherited from the binary
+ * parent descriptor by a new child. See SecdInheritAcl.
+ */
+static int Twapi_SecdInheritedAcesObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Tcl_Obj *ownerObj, *groupObj, *mapObj, *resultObj;
+    unsigned char *bytes, *aclP;
+    Tcl_Size len;
+    SecdView view;
+    SecdGenericMapping map, *mapP;
+    PSID ownerP, groupP;
+    GUID guid, *guidP = &guid;
+    int sacl, is_container, error;
+    TCL_RESULT res;
+    SWSMark mark;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     ARGSKIP, GETBOOL(sacl), GETBOOL(is_container),
+                     GETOBJ(ownerObj), GETOBJ(groupObj), GETOBJ(mapObj),
+                     GETVAR(guidP, ObjToGUID_NULL), ARGEND) != TCL_OK ||
+        ObjToSecdGenericMapping(interp, mapObj, &map, &mapP) != TCL_OK)
+        return TCL_ERROR;
+
+    bytes = ObjToByteArray(objv[1], &len);
+    error = SecdParse(&view, bytes, len);
+    if (error)
+        return Twapi_AppendSystemError(interp, error);
+
+    mark = SWSPushMark();
+    res = ObjToPSIDSWS(interp, ownerObj, &ownerP);
+    if (res == TCL_OK)
+        res = ObjToPSIDSWS(interp, groupObj, &groupP);
+    if (res == TCL_OK) {
+        error = SecdInheritAcl(sacl ? view.sacl : view.dacl, is_container,
+                               ownerP, groupP, mapP, (unsigned char *) guidP,
+                               &aclP);
+        if (error)
+            res = Twapi_AppendSystemError(interp, error);
+        else {
+            resultObj = ObjFromACL(interp, (ACL *) aclP);
+            ckfree(aclP);
+            res = resultObj ? ObjSetResult(interp, resultObj) : TCL_ERROR;
+        }
+    }
+    SWSPopMark(mark);
+    return res;
+}
+
+/*
+ * Twapi_SortAces ACES - see SecdSortAcl. The ACEs are converted to an
+ * ACL only to validate them and compute the order. The result is made of
+ * the original list elements so ACEs are returned exactly as passed in,
+ * not in the normalized form ObjFromACL would produce.
+ */
+static int Twapi_SortAcesObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Tcl_Obj *objs[2], *aclObj;
+    Tcl_Obj **aceObjs, **sortedObjs;
+    Tcl_Size i, naces;
+    unsigned int *order;
+    ACL *aclP;
+    TCL_RESULT res;
+    SWSMark mark;
+
+    if (objc != 2)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+
+    /* ObjToPACLSWS computes the revision so the one passed does not matter */
+    objs[0] = ObjFromInt(ACL_REVISION);
+    objs[1] = objv[1];
+    aclObj = ObjNewList(2, objs);
+    ObjIncrRefs(aclObj);
+    mark = SWSPushMark();
+    res = ObjToPACLSWS(interp, aclObj, &aclP);
+    if (res == TCL_OK)
+        res = ObjGetElements(interp, objv[1], &naces, &aceObjs);
+    if (res == TCL_OK) {
+        /* ObjToPACLSWS adds one ACE per element, in order */
+        if (SecdValidateAcl((unsigned char *) aclP, aclP->AclSize) != 0 ||
+            SecdAclCount((unsigned char *) aclP) != naces)
+            res = Twapi_AppendSystemError(interp, ERROR_INVALID_ACL);
+        else if (naces < 2)
+            ObjSetResult(interp, objv[1]);
+        else {
+            order = SWSAlloc(naces * sizeof(*order), NULL);
+            if (SecdSortAclOrder((unsigned char *) aclP, order))
+                ObjSetResult(interp, objv[1]);
+            else {
+                sortedObjs = SWSAlloc(naces * sizeof(*sortedObjs), NULL);
+                for (i = 0; i < naces; ++i)
+                    sortedObjs[i] = aceObjs[order[i]];
+                ObjSetResult(interp, ObjNewList(naces, sortedObjs));
+            }
+        }
+    }
+    ObjDecrRefs(aclObj);
+    SWSPopMark(mark);
+    return res;
+}
+
 static int TwapiSecurityInitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
 {
     static struct fncode_dispatch_s SecCallDispatch[] = {
@@ -1548,6 +1778,7 @@ static int TwapiSecurityInitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
         DEFINE_FNCODE_CMD(CredEnumerate, 503),
         DEFINE_FNCODE_CMD(CredRead, 504),
         DEFINE_FNCODE_CMD(CredGetTargetInfo, 505),
+        DEFINE_FNCODE_CMD(GetNamedSecurityInfoBinary, 506),
 
         DEFINE_FNCODE_CMD(GetSecurityInfo, 1003),
         DEFINE_FNCODE_CMD(OpenThreadToken, 1004),
@@ -1556,6 +1787,7 @@ static int TwapiSecurityInitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
         DEFINE_FNCODE_CMD(Twapi_SetTokenVirtualizationEnabled, 1007),
         DEFINE_FNCODE_CMD(Twapi_SetTokenMandatoryPolicy, 1008),
         DEFINE_FNCODE_CMD(Twapi_SetTokenSessionId, 1009), // TBD - tcl
+        DEFINE_FNCODE_CMD(GetSecurityInfoBinary, 1010),
 
         DEFINE_FNCODE_CMD(SetThreadToken, 3002),
         DEFINE_FNCODE_CMD(Twapi_LsaEnumerateAccountsWithUserRight, 3003),
@@ -1589,7 +1821,14 @@ static int TwapiSecurityInitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
         DEFINE_FNCODE_CMD(Twapi_PrivilegeCheck, 10025),
     };
 
+    static struct tcl_dispatch_s SecTclDispatch[] = {
+        DEFINE_TCL_CMD(Twapi_SecdEffectiveAccess, Twapi_SecdEffectiveAccessObjCmd),
+        DEFINE_TCL_CMD(Twapi_SecdInheritedAces, Twapi_SecdInheritedAcesObjCmd),
+        DEFINE_TCL_CMD(Twapi_SortAces, Twapi_SortAcesObjCmd),
+    };
+
     TwapiDefineFncodeCmds(interp, ARRAYSIZE(SecCallDispatch), SecCallDispatch, Twapi_SecCallObjCmd);
+    TwapiDefineTclCmds(interp, ARRAYSIZE(SecTclDispatch), SecTclDispatch, ticP);
 
     return TCL_OK;
 }
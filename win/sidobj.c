@@ -0,0 +1,721 @@
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * SID Tcl object type and intern table. See sidobj.h.
+ *
+ * Build with -DSIDOBJ_TEST to get a standalone test and a benchmark
+ * against converting each SID afresh (see end of file).
+ *
+ * SID format: REVISION(1) NSUBAUTH(1) AUTHORITY(6, big endian)
+ * SUBAUTH(4, little endian)...
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "sidobj.h"
+
+typedef struct SidObjEntry {
+    unsigned int hash;
+    unsigned char len;          /* Length of binary SID */
+    unsigned char interned;     /* If 0, owned by a single Tcl_Obj */
+    unsigned short str_len;
+    char *str;                  /* Points into data after the SID */
+    unsigned char data[1];      /* SID followed by nul terminated string */
+} SidObjEntry;
+
+#define SIDOBJ_ENTRY_SIZE(len_, str_len_) \
+    (offsetof(SidObjEntry, data) + (len_) + (str_len_) + 1)
+
+/*
+ * The intern table. Open addressing with linear probing, kept at most
+ * half full. Entries are never removed so lookups need no tombstones.
+ */
+static struct {
+    Tcl_Mutex lock;
+    SidObjEntry **slots;
+    unsigned int nslots;        /* Power of 2 */
+    int count;
+} gSidTable;
+
+static void DupSidType(Tcl_Obj *srcP, Tcl_Obj *dstP);
+static void FreeSidType(Tcl_Obj *objP);
+static void UpdateSidTypeString(Tcl_Obj *objP);
+static const Tcl_ObjType gSidType = {
+    "TwapiSID",
+    FreeSidType,
+    DupSidType,
+    UpdateSidTypeString,
+    NULL,     /* Only converted through SidObjGet */
+};
+
+#define SIDOBJ_REP(objP_) ((SidObjEntry *)(objP_)->internalRep.twoPtrValue.ptr1)
+
+static unsigned int SidObjHash(const unsigned char *p, unsigned int len)
+{
+    unsigned int h = 2166136261U;
+    while (len--) {
+        h ^= *p++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+unsigned int SidObjLength(const void *sid, size_t size)
+{
+    const unsigned char *p = sid;
+    unsigned int len;
+
+    if (size < 8 || p[0] != 1 || p[1] > SIDOBJ_MAX_SUBAUTH)
+        return 0;
+    len = 8 + 4 * p[1];
+    return len <= size ? len : 0;
+}
+
+static char *SidObjAppendDecimal(char *s, unsigned int v)
+{
+    char digits[10];
+    int i = 0;
+    do {
+        digits[i++] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v);
+    while (i)
+        *s++ = digits[--i];
+    return s;
+}
+
+int SidObjFormat(const void *sid, unsigned int len, char *buf)
+{
+    static const char hexdigits[] = "0123456789ABCDEF";
+    const unsigned char *p = sid;
+    char *s = buf;
+    int i, n;
+
+    (void) len;                 /* Caller has validated */
+    memcpy(s, "S-1-", 4);
+    s += 4;
+
+    /* Authorities that do not fit in 32 bits are shown in hex */
+    if (p[2] || p[3]) {
+        *s++ = '0';
+        *s++ = 'x';
+        for (i = 2; i < 8; ++i) {
+            *s++ = hexdigits[p[i] >> 4];
+            *s++ = hexdigits[p[i] & 0xF];
+        }
+    } else {
+        s = SidObjAppendDecimal(s, ((unsigned int)p[4] << 24) |
+                                (p[5] << 16) | (p[6] << 8) | p[7]);
+    }
+
+    n = p[1];
+    for (p += 8; n > 0; --n, p += 4) {
+        *s++ = '-';
+        s = SidObjAppendDecimal(s, p[0] | (p[1] << 8) | (p[2] << 16) |
+                                ((unsigned int)p[3] << 24));
+    }
+    *s = '\0';
+    return (int) (s - buf);
+}
+
+/* Parses a decimal number at *sP no greater than max. Returns 0 on error */
+static int SidObjParseDecimal(const char **sP, const char *end,
+                              Tcl_WideUInt max, Tcl_WideUInt *valP)
+{
+    const char *s = *sP;
+    Tcl_WideUInt v = 0;
+
+    if (s == end || *s < '0' || *s > '9')
+        return 0;
+    while (s < end && *s >= '0' && *s <= '9') {
+        v = 10 * v + (*s++ - '0');
+        if (v > max)
+            return 0;
+    }
+    *sP = s;
+    *valP = v;
+    return 1;
+}
+
+unsigned int SidObjParse(const char *s, size_t len, unsigned char *sid)
+{
+    const char *end = s + len;
+    Tcl_WideUInt v;
+    int i, n, digit;
+
+    if (len < 4 || (s[0] != 'S' && s[0] != 's') || s[1] != '-' ||
+        s[2] != '1' || s[3] != '-')
+        return 0;
+    s += 4;
+
+    /* Authority, 48 bits, hex if prefixed by 0x */
+    if (end - s > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        s += 2;
+        v = 0;
+        for (i = 0; s < end && *s != '-'; ++i, ++s) {
+            if (*s >= '0' && *s <= '9')
+                digit = *s - '0';
+            else if (*s >= 'a' && *s <= 'f')
+                digit = *s - 'a' + 10;
+            else if (*s >= 'A' && *s <= 'F')
+                digit = *s - 'A' + 10;
+            else
+                return 0;
+            v = (v << 4) | digit;
+        }
+        if (i == 0 || i > 12)
+            return 0;
+    } else if (! SidObjParseDecimal(&s, end, 0xFFFFFFFFFFFFULL, &v))
+        return 0;
+
+    sid[0] = 1;
+    for (i = 7; i >= 2; --i) {
+        sid[i] = (unsigned char) v;
+        v >>= 8;
+    }
+
+    /*
+     * At least one subauthority is required. ConvertStringSidToSid is
+     * the arbiter for anything unusual so callers fall back to it.
+     */
+    for (n = 0; s < end; ++n) {
+        if (n == SIDOBJ_MAX_SUBAUTH || *s++ != '-' ||
+            ! SidObjParseDecimal(&s, end, 0xFFFFFFFFU, &v))
+            return 0;
+        sid[8 + 4*n] = (unsigned char) v;
+        sid[9 + 4*n] = (unsigned char) (v >> 8);
+        sid[10 + 4*n] = (unsigned char) (v >> 16);
+        sid[11 + 4*n] = (unsigned char) (v >> 24);
+    }
+    if (n == 0)
+        return 0;
+    sid[1] = (unsigned char) n;
+    return 8 + 4 * n;
+}
+
+static SidObjEntry *SidObjEntryNew(const unsigned char *sid, unsigned int len,
+                                   unsigned int hash)
+{
+    char buf[SIDOBJ_MAX_STRING];
+    int str_len;
+    SidObjEntry *entryP;
+
+    str_len = SidObjFormat(sid, len, buf);
+    entryP = (SidObjEntry *) ckalloc(SIDOBJ_ENTRY_SIZE(len, str_len));
+    entryP->hash = hash;
+    entryP->len = (unsigned char) len;
+    entryP->interned = 0;
+    entryP->str_len = (unsigned short) str_len;
+    memcpy(entryP->data, sid, len);
+    entryP->str = (char *) entryP->data + len;
+    memcpy(entryP->str, buf, str_len + 1);
+    return entryP;
+}
+
+/*
+ * Returns the entry for a valid SID, interning it if there is room.
+ * Otherwise returns a private entry that the caller owns.
+ */
+static SidObjEntry *SidObjIntern(const unsigned char *sid, unsigned int len)
+{
+    unsigned int hash, i, mask;
+    SidObjEntry *entryP, **slots;
+
+    hash = SidObjHash(sid, len);
+
+    Tcl_MutexLock(&gSidTable.lock);
+    if (gSidTable.nslots) {
+        mask = gSidTable.nslots - 1;
+        for (i = hash & mask; (entryP = gSidTable.slots[i]) != NULL;
+             i = (i + 1) & mask) {
+            if (entryP->hash == hash && entryP->len == len &&
+                memcmp(entryP->data, sid, len) == 0) {
+                Tcl_MutexUnlock(&gSidTable.lock);
+                return entryP;
+            }
+        }
+    }
+    if (gSidTable.count >= SIDOBJ_INTERN_MAX) {
+        Tcl_MutexUnlock(&gSidTable.lock);
+        return SidObjEntryNew(sid, len, hash);
+    }
+
+    if (2 * (gSidTable.count + 1) > (int) gSidTable.nslots) {
+        unsigned int j, nslots;
+        nslots = gSidTable.nslots ? 2 * gSidTable.nslots : 256;
+        slots = (SidObjEntry **) ckalloc(nslots * sizeof(*slots));
+        memset(slots, 0, nslots * sizeof(*slots));
+        for (j = 0; j < gSidTable.nslots; ++j) {
+            if (gSidTable.slots[j] == NULL)
+                continue;
+            for (i = gSidTable.slots[j]->hash & (nslots - 1);
+                 slots[i] != NULL;
+                 i = (i + 1) & (nslots - 1))
+                ;
+            slots[i] = gSidTable.slots[j];
+        }
+        if (gSidTable.slots)
+            ckfree((char *) gSidTable.slots);
+        gSidTable.slots = slots;
+        gSidTable.nslots = nslots;
+    }
+
+    entryP = SidObjEntryNew(sid, len, hash);
+    entryP->interned = 1;
+    mask = gSidTable.nslots - 1;
+    for (i = hash & mask; gSidTable.slots[i] != NULL; i = (i + 1) & mask)
+        ;
+    gSidTable.slots[i] = entryP;
+    gSidTable.count++;
+    Tcl_MutexUnlock(&gSidTable.lock);
+    return entryP;
+}
+
+static void FreeSidType(Tcl_Obj *objP)
+{
+    SidObjEntry *entryP = SIDOBJ_REP(objP);
+    if (! entryP->interned)
+        ckfree((char *) entryP);
+    objP->internalRep.twoPtrValue.ptr1 = NULL;
+    objP->typePtr = NULL;
+}
+
+static void DupSidType(Tcl_Obj *srcP, Tcl_Obj *dstP)
+{
+    SidObjEntry *entryP = SIDOBJ_REP(srcP);
+    if (! entryP->interned) {
+        size_t sz = SIDOBJ_ENTRY_SIZE(entryP->len, entryP->str_len);
+        SidObjEntry *copyP = (SidObjEntry *) ckalloc(sz);
+        memcpy(copyP, entryP, sz);
+        copyP->str = (char *) copyP->data + copyP->len;
+        entryP = copyP;
+    }
+    dstP->typePtr = &gSidType;
+    dstP->internalRep.twoPtrValue.ptr1 = entryP;
+    dstP->internalRep.twoPtrValue.ptr2 = NULL;
+}
+
+static void UpdateSidTypeString(Tcl_Obj *objP)
+{
+    SidObjEntry *entryP = SIDOBJ_REP(objP);
+    objP->bytes = ckalloc(entryP->str_len + 1);
+    memcpy(objP->bytes, entryP->str, entryP->str_len + 1);
+    objP->length = entryP->str_len;
+}
+
+Tcl_Obj *SidObjNew(const void *sid, size_t size)
+{
+    unsigned int len;
+    SidObjEntry *entryP;
+    Tcl_Obj *objP;
+
+    len = SidObjLength(sid, size);
+    if (len == 0)
+        return NULL;
+    entryP = SidObjIntern(sid, len);
+
+    /*
+     * Objects are not shared even for interned SIDs. Tcl_Objs cannot be
+     * shared between threads, and callers free objects returned by
+     * constructors on error paths without regard to other references.
+     * The conversion, which is the expensive part, is shared.
+     */
+    objP = Tcl_NewObj();
+    Tcl_InvalidateStringRep(objP);
+    objP->typePtr = &gSidType;
+    objP->internalRep.twoPtrValue.ptr1 = entryP;
+    objP->internalRep.twoPtrValue.ptr2 = NULL;
+    UpdateSidTypeString(objP);
+    return objP;
+}
+
+int SidObjGet(Tcl_Obj *objP, const unsigned char **sidP, unsigned int *lenP)
+{
+    unsigned char sid[SIDOBJ_MAX_SIZE];
+    unsigned int len;
+    const char *s;
+    int slen;
+    SidObjEntry *entryP;
+
+    if (objP->typePtr != &gSidType) {
+        s = Tcl_GetStringFromObj(objP, &slen);
+        len = SidObjParse(s, (size_t) slen, sid);
+        if (len == 0)
+            return SIDOBJ_E_INVALID;
+        entryP = SidObjIntern(sid, len);
+        if (objP->typePtr && objP->typePtr->freeIntRepProc)
+            objP->typePtr->freeIntRepProc(objP);
+        objP->typePtr = &gSidType;
+        objP->internalRep.twoPtrValue.ptr1 = entryP;
+        objP->internalRep.twoPtrValue.ptr2 = NULL;
+    }
+    entryP = SIDOBJ_REP(objP);
+    *sidP = entryP->data;
+    *lenP = entryP->len;
+    return 0;
+}
+
+int SidObjInternCount(void)
+{
+    int count;
+    Tcl_MutexLock(&gSidTable.lock);
+    count = gSidTable.count;
+    Tcl_MutexUnlock(&gSidTable.lock);
+    return count;
+}
+
+void SidObjFinalize(void)
+{
+    unsigned int i;
+
+    Tcl_MutexLock(&gSidTable.lock);
+    for (i = 0; i < gSidTable.nslots; ++i) {
+        if (gSidTable.slots[i])
+            ckfree((char *) gSidTable.slots[i]);
+    }
+    if (gSidTable.slots)
+        ckfree((char *) gSidTable.slots);
+    gSidTable.slots = NULL;
+    gSidTable.nslots = 0;
+    gSidTable.count = 0;
+    Tcl_MutexUnlock(&gSidTable.lock);
+}
+
+#ifdef SIDOBJ_TEST
+/*
+ * Standalone test. Build with
+ *   cc -DSIDOBJ_TEST sidobj.c -ltcl
+ *
+ * Binary SIDs are passed to and from the sid command in hex. The bench
+ * argument compares SidObjNew and SidObjGet against converting every SID
+ * afresh the way ConvertSidToStringSid/ConvertStringSidToSid followed by
+ * LocalFree and a copy do, emulated with malloc and stdio.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+static Tcl_Obj *TestHexObj(const unsigned char *p, unsigned int len)
+{
+    static const char hexdigits[] = "0123456789abcdef";
+    Tcl_Obj *objP = Tcl_NewObj();
+    unsigned int i;
+    char c[2];
+    for (i = 0; i < len; ++i) {
+        c[0] = hexdigits[p[i] >> 4];
+        c[1] = hexdigits[p[i] & 0xF];
+        Tcl_AppendToObj(objP, c, 2);
+    }
+    return objP;
+}
+
+static int TestHexToBin(Tcl_Obj *objP, unsigned char *buf, int max)
+{
+    int len, i;
+    unsigned int v;
+    const char *s = Tcl_GetStringFromObj(objP, &len);
+    if (len % 2 || len / 2 > max)
+        return -1;
+    for (i = 0; i < len / 2; ++i) {
+        if (sscanf(s + 2*i, "%2x", &v) != 1)
+            return -1;
+        buf[i] = (unsigned char) v;
+    }
+    return len / 2;
+}
+
+/* What ConvertSidToStringSid + ObjFromString + LocalFree amount to */
+static Tcl_Obj *TestFreshFormat(const unsigned char *sid)
+{
+    char *buf = malloc(SIDOBJ_MAX_STRING);
+    int n, i;
+    Tcl_Obj *objP;
+    n = sprintf(buf, "S-1-%u", ((unsigned int)sid[4] << 24) |
+                (sid[5] << 16) | (sid[6] << 8) | sid[7]);
+    for (i = 0; i < sid[1]; ++i) {
+        const unsigned char *p = sid + 8 + 4*i;
+        n += sprintf(buf + n, "-%u", p[0] | (p[1] << 8) | (p[2] << 16) |
+                     ((unsigned int)p[3] << 24));
+    }
+    objP = Tcl_NewStringObj(buf, n);
+    free(buf);
+    return objP;
+}
+
+/* What ConvertStringSidToSid + copy to SWS + LocalFree amount to */
+static int TestFreshParse(const char *s, unsigned char *out)
+{
+    unsigned char *sid = malloc(SIDOBJ_MAX_SIZE);
+    unsigned long v;
+    char *end;
+    int n = 0, len;
+    if (strncmp(s, "S-1-", 4)) {
+        free(sid);
+        return 0;
+    }
+    v = strtoul(s + 4, &end, 10);
+    memset(sid, 0, 8);
+    sid[0] = 1;
+    sid[4] = (unsigned char) (v >> 24); sid[5] = (unsigned char) (v >> 16);
+    sid[6] = (unsigned char) (v >> 8); sid[7] = (unsigned char) v;
+    while (*end == '-' && n < SIDOBJ_MAX_SUBAUTH) {
+        v = strtoul(end + 1, &end, 10);
+        memcpy(sid + 8 + 4*n, &v, 4);
+        ++n;
+    }
+    sid[1] = (unsigned char) n;
+    len = 8 + 4*n;
+    memcpy(out, sid, len);
+    free(sid);
+    return len;
+}
+
+static int TestSidObjCmd(ClientData cd, Tcl_Interp *interp,
+                         int objc, Tcl_Obj *const objv[])
+{
+    static const char *const cmds[] = {
+        "new", "parse", "get", "type", "count", "dup",
+        "bench_new", "bench_fresh_format", "bench_get", "bench_fresh_parse",
+        NULL
+    };
+    enum { NEW, PARSE, GET, TYPE, COUNT, DUP,
+           BENCH_NEW, BENCH_FRESH_FORMAT, BENCH_GET, BENCH_FRESH_PARSE };
+    unsigned char buf[256];
+    const unsigned char *sidP;
+    unsigned int len;
+    int cmd, n, i, j, reps;
+    Tcl_Obj **elems, *objP;
+    const char *s;
+
+    (void) cd;
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "subcommand ?arg ...?");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[1], cmds, "subcommand", 0, &cmd)
+        != TCL_OK)
+        return TCL_ERROR;
+
+    switch (cmd) {
+    case NEW:
+        /* sid new HEX - returns the object */
+        n = TestHexToBin(objv[2], buf, sizeof(buf));
+        if (n < 0 || (objP = SidObjNew(buf, n)) == NULL) {
+            Tcl_SetResult(interp, "invalid", TCL_STATIC);
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, objP);
+        return TCL_OK;
+    case PARSE:
+        /* sid parse STRING - returns hex or empty */
+        s = Tcl_GetStringFromObj(objv[2], &n);
+        len = SidObjParse(s, n, buf);
+        Tcl_SetObjResult(interp, TestHexObj(buf, len));
+        return TCL_OK;
+    case GET:
+        /* sid get OBJ - returns hex after converting OBJ */
+        if (SidObjGet(objv[2], &sidP, &len) != 0) {
+            Tcl_SetResult(interp, "invalid", TCL_STATIC);
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, TestHexObj(sidP, len));
+        return TCL_OK;
+    case TYPE:
+        Tcl_SetResult(interp, objv[2]->typePtr ?
+                      (char *) objv[2]->typePtr->name : "", TCL_VOLATILE);
+        return TCL_OK;
+    case COUNT:
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(SidObjInternCount()));
+        return TCL_OK;
+    case DUP:
+        /* sid dup OBJ - returns hex of a duplicate, then frees it */
+        objP = Tcl_DuplicateObj(objv[2]);
+        Tcl_IncrRefCount(objP);
+        Tcl_InvalidateStringRep(objP);
+        if (SidObjGet(objP, &sidP, &len) != 0) {
+            Tcl_DecrRefCount(objP);
+            Tcl_SetResult(interp, "invalid", TCL_STATIC);
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s %s", Tcl_GetString(objP),
+                                               Tcl_GetString(TestHexObj(sidP, len))));
+        Tcl_DecrRefCount(objP);
+        return TCL_OK;
+    }
+
+    /* Benchmarks: sid bench_* LIST REPS - returns usecs per conversion */
+    if (Tcl_ListObjGetElements(interp, objv[2], &n, &elems) != TCL_OK ||
+        Tcl_GetIntFromObj(interp, objv[3], &reps) != TCL_OK)
+        return TCL_ERROR;
+    {
+        unsigned char (*sids)[SIDOBJ_MAX_SIZE] = NULL;
+        Tcl_Time start, end;
+        double usecs;
+        size_t total = 0;
+
+        if (cmd == BENCH_NEW || cmd == BENCH_FRESH_FORMAT) {
+            sids = ckalloc(n * SIDOBJ_MAX_SIZE);
+            for (i = 0; i < n; ++i)
+                TestHexToBin(elems[i], sids[i], SIDOBJ_MAX_SIZE);
+        }
+        Tcl_GetTime(&start);
+        for (j = 0; j < reps; ++j) {
+            for (i = 0; i < n; ++i) {
+                switch (cmd) {
+                case BENCH_NEW:
+                    objP = SidObjNew(sids[i], SIDOBJ_MAX_SIZE);
+                    total += objP->length;
+                    Tcl_DecrRefCount(objP);
+                    break;
+                case BENCH_FRESH_FORMAT:
+                    objP = TestFreshFormat(sids[i]);
+                    total += objP->length;
+                    Tcl_DecrRefCount(objP);
+                    break;
+                case BENCH_GET:
+                    if (SidObjGet(elems[i], &sidP, &len) == 0) {
+                        memcpy(buf, sidP, len);
+                        total += len;
+                    }
+                    break;
+                case BENCH_FRESH_PARSE:
+                    total += TestFreshParse(Tcl_GetString(elems[i]), buf);
+                    break;
+                }
+            }
+        }
+        Tcl_GetTime(&end);
+        if (sids)
+            ckfree(sids);
+        usecs = (end.sec - start.sec) * 1e6 + (end.usec - start.usec);
+        Tcl_SetObjResult(interp, Tcl_NewDoubleObj(
+                             total ? usecs / ((double) n * reps) : -1));
+    }
+    return TCL_OK;
+}
+
+static const char *testScript =
+    "set failures 0; set checks 0\n"
+    "proc check {script expected} {\n"
+    "    set result [uplevel 1 $script]\n"
+    "    if {$result ne $expected} {\n"
+    "        puts \"FAIL: $script\\n  got: $result\\n  expected: $expected\"\n"
+    "        incr ::failures\n"
+    "    }\n"
+    "    incr ::checks\n"
+    "}\n"
+    /* Formatting */
+    "check {catch {sid new 010200000000000520000000200200000}} 1\n"
+    "check {catch {sid new 010200000000000520000000}} 1\n"
+    /* Trailing bytes are not part of the SID */
+    "check {sid new 0102000000000005200000002002000000} S-1-5-32-544\n"
+    "check {sid new 01020000000000052000000020020000} S-1-5-32-544\n"
+    "check {catch {sid new 0101000000000001000000000}} 1\n"
+    "check {sid new 010100000000000100000000} S-1-1-0\n"
+    "check {sid new 010000000000000500} S-1-5\n"
+    "check {catch {sid new 0201000000000001000000000}} 1\n"
+    "check {sid new 0101000000000001ffffffff} S-1-1-4294967295\n"
+    "check {sid new 0101ffffffffffff00000000} S-1-0xFFFFFFFFFFFF-0\n"
+    "check {sid new 010100010000000000000000} S-1-0x000100000000-0\n"
+    "check {sid new 0101000080000000ffffffff} S-1-2147483648-4294967295\n"
+    "check {sid new 0105000000000005150000000100000002000000030000004d040000}"
+    "  S-1-5-21-1-2-3-1101\n"
+    "check {sid type [sid new 010100000000000100000000]} TwapiSID\n"
+    /* Parsing */
+    "check {sid parse S-1-5-32-544} 01020000000000052000000020020000\n"
+    "check {sid parse s-1-5-32-544} 01020000000000052000000020020000\n"
+    "check {sid parse S-1-5} {}\n"
+    "check {sid parse S-2-5-32} {}\n"
+    "check {sid parse S-1-5-32-} {}\n"
+    "check {sid parse S-1--32} {}\n"
+    "check {sid parse S-1-5-4294967296} {}\n"
+    "check {sid parse S-1-5-4294967295} 0101000000000005ffffffff\n"
+    "check {sid parse S-1-281474976710656-1} {}\n"
+    "check {sid parse S-1-281474976710655-1} 0101ffffffffffff01000000\n"
+    "check {sid parse S-1-0xFFFFFFFFFFFF-0} 0101ffffffffffff00000000\n"
+    "check {sid parse S-1-0x1ffffffffffff-0} {}\n"
+    "check {sid parse S-1-0x-0} {}\n"
+    "check {sid parse S-1-0xg-0} {}\n"
+    "check {sid parse BA} {}\n"
+    "check {sid parse {}} {}\n"
+    "check {sid parse S-1-5-32-544x} {}\n"
+    "check {sid parse S-1-1-1-2-3-4-5-6-7-8-9-10-11-12-13-14-15} "
+    "  010f0000000000010100000002000000030000000400000005000000060000000700000008000000090000000a0000000b0000000c0000000d0000000e0000000f000000\n"
+    "check {sid parse S-1-1-1-2-3-4-5-6-7-8-9-10-11-12-13-14-15-16} {}\n"
+    /* Round trips through the object type */
+    "check {string length [sid new [sid parse S-1-1-1-2-3-4-5-6-7-8-9-10-11-12-13-14-15]]} "
+    "  [string length S-1-1-1-2-3-4-5-6-7-8-9-10-11-12-13-14-15]\n"
+    "set max S-1-0xFFFFFFFFFFFF[string repeat -4294967295 15]\n"
+    "check {sid new [sid parse $max]} $max\n"
+    "check {expr {[string length $max] < 184}} 1\n"
+    "set s [string cat S-1-5-21-7-8-9-500]\n"
+    "check {sid type $s} {}\n"
+    "check {sid get $s} 010500000000000515000000070000000800000009000000f4010000\n"
+    "check {sid type $s} TwapiSID\n"
+    "check {set s} S-1-5-21-7-8-9-500\n"
+    "check {sid get $s} 010500000000000515000000070000000800000009000000f4010000\n"
+    "check {sid dup $s} {S-1-5-21-7-8-9-500 010500000000000515000000070000000800000009000000f4010000}\n"
+    "check {catch {sid get [string cat BA]}} 1\n"
+    "set s [string cat s-1-5-18]\n"
+    "check {sid get $s} 010100000000000512000000\n"
+    "check {set s} s-1-5-18\n"
+    /* Interning */
+    "set n [sid count]\n"
+    "for {set i 0} {$i < 1000} {incr i} {sid new 010100000000000512000000}\n"
+    "check {expr {[sid count] - $n}} 0\n"
+    "for {set i 0} {$i < 1000} {incr i} {sid get [string cat S-1-5-21-1-2-3-$i]}\n"
+    "check {expr {[sid count] - $n}} 1000\n"
+    "for {set i 0} {$i < 1000} {incr i} {sid new [sid parse S-1-5-21-1-2-3-$i]}\n"
+    "check {expr {[sid count] - $n}} 1000\n"
+    /* Past the intern limit SIDs are private but behave the same */
+    "for {set i 0} {$i < 20000} {incr i} {sid get [string cat S-1-5-21-9-9-9-$i]}\n"
+    "check {sid count} 16384\n"
+    "set s [sid new [sid parse S-1-5-21-9-9-9-19999]]\n"
+    "check {list $s [sid get $s]} {S-1-5-21-9-9-9-19999 0105000000000005150000000900000009000000090000001f4e0000}\n"
+    "check {sid dup $s} {S-1-5-21-9-9-9-19999 0105000000000005150000000900000009000000090000001f4e0000}\n"
+    "unset s\n"
+    "puts \"$checks checks, $failures failures\"\n"
+    "set failures\n";
+
+static const char *benchScript =
+    "set sids {}\n"
+    "for {set i 0} {$i < 300} {incr i} {\n"
+    "    lappend sids [sid parse S-1-5-21-3623811015-3361044348-30300820-[expr {1000 + $i}]]\n"
+    "}\n"
+    "lappend sids [sid parse S-1-5-18] [sid parse S-1-5-32-544] [sid parse S-1-1-0]\n"
+    "set strs [lmap s $sids {sid new $s}]\n"
+    "set fresh [lmap s $strs {string cat $s}]\n"
+    "proc bench {label cmd list reps} {\n"
+    "    set us [sid $cmd $list $reps]\n"
+    "    puts [format {%-50s %8.3f us/SID} $label $us]\n"
+    "}\n"
+    "bench {binary->obj: convert afresh (emulated)} bench_fresh_format $sids 3000\n"
+    "bench {binary->obj: SidObjNew (interned)} bench_new $sids 3000\n"
+    "bench {obj->binary: parse afresh (emulated)} bench_fresh_parse $fresh 3000\n"
+    "bench {obj->binary: SidObjGet, first use parses} bench_get $fresh 1\n"
+    "bench {obj->binary: SidObjGet, internal rep} bench_get $fresh 3000\n"
+    "set failures 0\n";
+
+int main(int argc, char **argv)
+{
+    Tcl_Interp *interp;
+    int failures;
+
+    Tcl_FindExecutable(argv[0]);
+    interp = Tcl_CreateInterp();
+    Tcl_CreateObjCommand(interp, "sid", TestSidObjCmd, NULL, NULL);
+
+    if (Tcl_Eval(interp, testScript) != TCL_OK ||
+        (argc > 1 && strcmp(argv[1], "bench") == 0 &&
+         Tcl_Eval(interp, benchScript) != TCL_OK)) {
+        fprintf(stderr, "%s\n", Tcl_GetStringResult(interp));
+        return 1;
+    }
+    failures = atoi(Tcl_GetStringResult(interp));
+    Tcl_DeleteInterp(interp);
+    SidObjFinalize();
+    return failures ? 1 : 0;
+}
+#endif /* SIDOBJ_TEST */
@@ -0,0 +1,77 @@
+#ifndef SIDOBJ_H
+#define SIDOBJ_H
+
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Tcl object type for SIDs. The internal representation points to an
+ * entry holding the binary SID and its string form. Entries are interned
+ * in a process wide table so a SID that is seen repeatedly, as in event
+ * logs, tokens and ACLs, is converted and stored only once and converting
+ * an object back to a binary SID needs no parsing.
+ *
+ * Conversion to and from the S-R-I-S-S... string form is done here rather
+ * than through ConvertSidToStringSid and friends. The module only depends
+ * on Tcl so it can be tested and benchmarked on any platform.
+ */
+
+#include <tcl.h>
+
+/* Error code. Default matches the corresponding Windows error. */
+#ifndef SIDOBJ_E_INVALID
+#define SIDOBJ_E_INVALID 1337   /* ERROR_INVALID_SID */
+#endif
+
+#define SIDOBJ_MAX_SUBAUTH 15
+#define SIDOBJ_MAX_SIZE    (8 + 4 * SIDOBJ_MAX_SUBAUTH)
+/* "S-1-" + 0xXXXXXXXXXXXX + 15 * "-4294967295" + nul */
+#define SIDOBJ_MAX_STRING  (4 + 14 + 11 * SIDOBJ_MAX_SUBAUTH + 1)
+
+/* Maximum number of interned SIDs. Further SIDs are not shared. */
+#define SIDOBJ_INTERN_MAX  16384
+
+/* Returns the length of a SID, or 0 if it is not valid within size bytes */
+unsigned int SidObjLength(const void *sid, size_t size);
+
+/*
+ * Formats a valid SID of len bytes into buf, which must have room for
+ * SIDOBJ_MAX_STRING chars, in the same form as ConvertSidToStringSid.
+ * Returns the length of the string.
+ */
+int SidObjFormat(const void *sid, unsigned int len, char *buf);
+
+/*
+ * Parses the len chars at s as a string SID into sid, which must have
+ * room for SIDOBJ_MAX_SIZE bytes. Returns the length of the SID or 0 if
+ * s is not a SID in S-1-AUTHORITY-SUBAUTHORITY... form. Well known SID
+ * abbreviations like "BA" are not recognized.
+ */
+unsigned int SidObjParse(const char *s, size_t len, unsigned char *sid);
+
+/*
+ * Returns a new object for the SID at sid, or NULL if it is not valid
+ * within size bytes. The reference count of the object is 0.
+ */
+Tcl_Obj *SidObjNew(const void *sid, size_t size);
+
+/*
+ * Converts objP to a SID. Stores a pointer to the binary SID and its
+ * length in *sidP and *lenP and returns 0, or returns SIDOBJ_E_INVALID
+ * if the string rep is not a SID. The pointer is only valid as long as
+ * objP holds the SID internal rep so callers should copy it right away.
+ */
+int SidObjGet(Tcl_Obj *objP, const unsigned char **sidP, unsigned int *lenP);
+
+/* Returns the number of interned SIDs */
+int SidObjInternCount(void);
+
+/*
+ * Frees the intern table. Only for leak checkers, since objects in any
+ * thread may still point into it.
+ */
+void SidObjFinalize(void);
+
+#endif /* SIDOBJ_H */
@@ -7,6 +7,7 @@
 
 #include "twapi.h"
 #include "twapi_storage.h"
+#include "usnjrnl.h"
 
 #ifndef TWAPI_SINGLE_MODULE
 static HMODULE gModuleHandle;     /* DLL handle to ourselves */
@@ -196,6 +197,295 @@ int Twapi_GetDiskFreeSpaceEx(Tcl_Interp *interp, LPCWSTR dir)
     return TCL_OK;
 }
 
+/*
+ * USN change journal. A cursor holds an open volume handle, the position
+ * in the journal or the MFT and a buffer that is reused for each read so
+ * large batches of records are retrieved with a single FSCTL. Records are
+ * decoded by usnjrnl.c.
+ */
+
+/* READ_USN_JOURNAL_DATA_V1 and MFT_ENUM_DATA_V1, not in older SDKs */
+typedef struct TwapiReadUsnJournalData {
+    LONGLONG  StartUsn;
+    DWORD     ReasonMask;
+    DWORD     ReturnOnlyOnClose;
+    DWORDLONG Timeout;
+    DWORDLONG BytesToWaitFor;
+    DWORDLONG UsnJournalID;
+    WORD      MinMajorVersion;  /* V1 only */
+    WORD      MaxMajorVersion;
+} TwapiReadUsnJournalData;
+
+typedef struct TwapiMftEnumData {
+    DWORDLONG StartFileReferenceNumber;
+    LONGLONG  LowUsn;
+    LONGLONG  HighUsn;
+    WORD      MinMajorVersion;  /* V1 only */
+    WORD      MaxMajorVersion;
+} TwapiMftEnumData;
+
+typedef struct TwapiUsnCursor {
+    HANDLE    hvol;
+    int       enumerate;        /* FSCTL_ENUM_USN_DATA, not the journal */
+    int       v0;               /* System only takes V0 input structures */
+    int       eof;              /* Enumeration complete */
+    DWORDLONG journal_id;
+    LONGLONG  usn;              /* Journal: next USN to read.
+                                   Enumeration: journal position when
+                                   opened, the upper USN limit */
+    LONGLONG  low_usn;          /* Enumeration only */
+    DWORDLONG next_frn;         /* Enumeration only */
+    DWORD     reason_mask;
+    DWORD     only_on_close;
+    DWORD     bufsize;
+    void     *bufP;
+} TwapiUsnCursor;
+
+static void TwapiUsnCursorFree(TwapiUsnCursor *cursorP)
+{
+    if (cursorP->hvol != INVALID_HANDLE_VALUE)
+        CloseHandle(cursorP->hvol);
+    if (cursorP->bufP)
+        TwapiFree(cursorP->bufP);
+    TwapiFree(cursorP);
+}
+
+static DWORD TwapiUsnOpenVolume(LPCWSTR path, HANDLE *hP)
+{
+    *hP = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                      NULL, OPEN_EXISTING, 0, NULL);
+    return *hP == INVALID_HANDLE_VALUE ? GetLastError() : ERROR_SUCCESS;
+}
+
+static DWORD TwapiUsnQuery(HANDLE hvol, USN_JOURNAL_DATA_V0 *dataP)
+{
+    DWORD nbytes;
+    if (! DeviceIoControl(hvol, FSCTL_QUERY_USN_JOURNAL, NULL, 0,
+                          dataP, sizeof(*dataP), &nbytes, NULL))
+        return GetLastError();
+    return ERROR_SUCCESS;
+}
+
+/*
+ * Twapi_UsnJournalQuery VOLUME
+ * Returns the journal id, first USN, next USN, lowest valid USN,
+ * maximum USN, maximum size and allocation delta.
+ */
+static int Twapi_UsnJournalQueryObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    USN_JOURNAL_DATA_V0 data;
+    Tcl_Obj *objs[7];
+    LPWSTR path;
+    HANDLE hvol;
+    DWORD status;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1, GETWSTR(path), ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    status = TwapiUsnOpenVolume(path, &hvol);
+    if (status == ERROR_SUCCESS) {
+        status = TwapiUsnQuery(hvol, &data);
+        CloseHandle(hvol);
+    }
+    if (status != ERROR_SUCCESS)
+        return Twapi_AppendSystemError(interp, status);
+    objs[0] = ObjFromWideInt(data.UsnJournalID);
+    objs[1] = ObjFromWideInt(data.FirstUsn);
+    objs[2] = ObjFromWideInt(data.NextUsn);
+    objs[3] = ObjFromWideInt(data.LowestValidUsn);
+    objs[4] = ObjFromWideInt(data.MaxUsn);
+    objs[5] = ObjFromWideInt(data.MaximumSize);
+    objs[6] = ObjFromWideInt(data.AllocationDelta);
+    return ObjSetResult(interp, ObjNewList(ARRAYSIZE(objs), objs));
+}
+
+/*
+ * Twapi_UsnCursorOpen VOLUME ENUMERATE JOURNALID START REASONMASK ONLYONCLOSE BUFSIZE
+ * Opens a cursor over the journal starting at USN START, or the current
+ * end of the journal if START is negative. If JOURNALID is not 0, it must
+ * match the volume's journal, else the records since START are no longer
+ * available. If ENUMERATE is true, the cursor instead enumerates the MFT
+ * entries whose last USN is at least START and below the current end of
+ * the journal.
+ */
+static int Twapi_UsnCursorOpenObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiUsnCursor *cursorP;
+    USN_JOURNAL_DATA_V0 data;
+    LPWSTR path;
+    int enumerate, only_on_close;
+    Tcl_WideInt journal_id, start;
+    DWORD reason_mask, bufsize, status;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETWSTR(path), GETBOOL(enumerate), GETWIDE(journal_id),
+                     GETWIDE(start), GETDWORD(reason_mask),
+                     GETBOOL(only_on_close), GETDWORD(bufsize),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    /* Room for at least one record with the longest name */
+    if (bufsize < 8 + USNJ_V3_HEADER_SIZE + 2 * 32768)
+        bufsize = 8 + USNJ_V3_HEADER_SIZE + 2 * 32768;
+
+    cursorP = TwapiAllocZero(sizeof(*cursorP));
+    cursorP->hvol = INVALID_HANDLE_VALUE;
+    status = TwapiUsnOpenVolume(path, &cursorP->hvol);
+    if (status == ERROR_SUCCESS)
+        status = TwapiUsnQuery(cursorP->hvol, &data);
+    if (status == ERROR_SUCCESS && journal_id != 0 &&
+        (DWORDLONG) journal_id != data.UsnJournalID)
+        status = ERROR_JOURNAL_ENTRY_DELETED;
+    if (status != ERROR_SUCCESS) {
+        TwapiUsnCursorFree(cursorP);
+        return Twapi_AppendSystemError(interp, status);
+    }
+
+    cursorP->enumerate = enumerate;
+    cursorP->journal_id = data.UsnJournalID;
+    if (enumerate) {
+        cursorP->low_usn = start < 0 ? 0 : start;
+        cursorP->usn = data.NextUsn;
+    } else
+        cursorP->usn = start < 0 ? data.NextUsn : start;
+    cursorP->reason_mask = reason_mask;
+    cursorP->only_on_close = only_on_close;
+    cursorP->bufsize = bufsize;
+    cursorP->bufP = TwapiAlloc(bufsize);
+
+    if (TwapiRegisterPointerTic(ticP, cursorP, TwapiUsnCursorFree) != TCL_OK) {
+        TwapiUsnCursorFree(cursorP);
+        return TCL_ERROR;
+    }
+    return ObjSetResult(interp, ObjFromOpaque(cursorP, "TwapiUsnCursor*"));
+}
+
+/* Issues the next read for the cursor. Stores the bytes returned, 0 at end. */
+static DWORD TwapiUsnCursorFill(TwapiUsnCursor *cursorP, DWORD *nbytesP)
+{
+    TwapiReadUsnJournalData rd;
+    TwapiMftEnumData med;
+    DWORD ioctl, insize, status;
+    void *inP;
+
+    *nbytesP = 0;
+    if (cursorP->eof)
+        return ERROR_SUCCESS;
+    if (cursorP->enumerate) {
+        med.StartFileReferenceNumber = cursorP->next_frn;
+        med.LowUsn = cursorP->low_usn;
+        med.HighUsn = cursorP->usn;
+        med.MinMajorVersion = 2;
+        med.MaxMajorVersion = 3;
+        ioctl = FSCTL_ENUM_USN_DATA;
+        inP = &med;
+        insize = cursorP->v0 ? offsetof(TwapiMftEnumData, MinMajorVersion) : sizeof(med);
+    } else {
+        rd.StartUsn = cursorP->usn;
+        rd.ReasonMask = cursorP->reason_mask;
+        rd.ReturnOnlyOnClose = cursorP->only_on_close;
+        rd.Timeout = 0;
+        rd.BytesToWaitFor = 0;
+        rd.UsnJournalID = cursorP->journal_id;
+        rd.MinMajorVersion = 2;
+        rd.MaxMajorVersion = 3;
+        ioctl = FSCTL_READ_USN_JOURNAL;
+        inP = &rd;
+        insize = cursorP->v0 ? offsetof(TwapiReadUsnJournalData, MinMajorVersion) : sizeof(rd);
+    }
+    if (DeviceIoControl(cursorP->hvol, ioctl, inP, insize,
+                        cursorP->bufP, cursorP->bufsize, nbytesP, NULL))
+        return ERROR_SUCCESS;
+    status = GetLastError();
+    *nbytesP = 0;
+    if (status == ERROR_INVALID_PARAMETER && ! cursorP->v0) {
+        /* Systems before Windows 8 only know the V0 structures */
+        cursorP->v0 = 1;
+        return TwapiUsnCursorFill(cursorP, nbytesP);
+    }
+    if (status == ERROR_HANDLE_EOF && cursorP->enumerate) {
+        cursorP->eof = 1;
+        return ERROR_SUCCESS;
+    }
+    return status;
+}
+
+/*
+ * Twapi_UsnCursorRead CURSOR
+ * Returns a recordarray with the next batch of records and advances the
+ * cursor. The record list is empty when there are no more records.
+ */
+static int Twapi_UsnCursorReadObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiUsnCursor *cursorP;
+    Tcl_Obj *objs[2];
+    Tcl_WideUInt next;
+    DWORD nbytes, status;
+
+    if (TwapiGetArgsEx(ticP, objc-1, objv+1,
+                       GETVERIFIEDPTR(cursorP, TwapiUsnCursor*, TwapiUsnCursorFree),
+                       ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    status = TwapiUsnCursorFill(cursorP, &nbytes);
+    if (status != ERROR_SUCCESS)
+        return Twapi_AppendSystemError(interp, status);
+
+    objs[0] = UsnjFields();
+    objs[1] = ObjNewList(0, NULL);
+    if (nbytes) {
+        status = UsnjDecodeBuffer(cursorP->bufP, nbytes, &next, objs[1], NULL);
+        if (status != 0) {
+            ObjDecrRefs(objs[0]);
+            ObjDecrRefs(objs[1]);
+            return Twapi_AppendSystemError(interp, status);
+        }
+        if (cursorP->enumerate)
+            cursorP->next_frn = next;
+        else
+            cursorP->usn = (LONGLONG) next;
+    }
+    return ObjSetResult(interp, ObjNewList(2, objs));
+}
+
+/*
+ * Twapi_UsnCursorPosition CURSOR
+ * Returns the journal id and the USN from which to resume reading the
+ * journal. For enumerations, this is the end of the journal when the
+ * cursor was opened, so changes made during the enumeration are not lost.
+ */
+static int Twapi_UsnCursorPositionObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiUsnCursor *cursorP;
+    Tcl_Obj *objs[2];
+
+    if (TwapiGetArgsEx(ticP, objc-1, objv+1,
+                       GETVERIFIEDPTR(cursorP, TwapiUsnCursor*, TwapiUsnCursorFree),
+                       ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    objs[0] = ObjFromWideInt(cursorP->journal_id);
+    objs[1] = ObjFromWideInt(cursorP->usn);
+    return ObjSetResult(interp, ObjNewList(2, objs));
+}
+
+/* Twapi_UsnCursorClose CURSOR */
+static int Twapi_UsnCursorCloseObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiUsnCursor *cursorP;
+
+    if (TwapiGetArgsEx(ticP, objc-1, objv+1,
+                       GETVERIFIEDPTR(cursorP, TwapiUsnCursor*, TwapiUsnCursorFree),
+                       ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    if (TwapiUnregisterPointerTic(ticP, cursorP, TwapiUsnCursorFree) != TCL_OK)
+        return TCL_ERROR;
+    TwapiUsnCursorFree(cursorP);
+    return TCL_OK;
+}
+
 static int Twapi_StorageCallObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
     LPWSTR s, s2;
@@ -463,6 +753,14 @@ static int TwapiStorageInitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
     TwapiDefineFncodeCmds(interp, ARRAYSIZE(StorDispatch), StorDispatch, Twapi_StorageCallObjCmd);
     Tcl_CreateObjCommand(interp, "twapi::Twapi_RegisterDirectoryMonitor", Twapi_RegisterDirectoryMonitorObjCmd, ticP, NULL);
     Tcl_CreateObjCommand(interp, "twapi::Twapi_UnregisterDirectoryMonitor", Twapi_UnregisterDirectoryMonitorObjCmd, ticP, NULL);
+    Tcl_CreateObjCommand(interp, "twapi::Twapi_FileTreeScan", Twapi_FileTreeScanObjCmd, ticP, NULL);
+    Tcl_CreateObjCommand(interp, "twapi::Twapi_FileTreeScanAsync", Twapi_FileTreeScanAsyncObjCmd, ticP, NULL);
+    Tcl_CreateObjCommand(interp, "twapi::Twapi_FileTreeScanCancel", Twapi_FileTreeScanCancelObjCmd, ticP, NULL);
+    Tcl_CreateObjCommand(interp, "twapi::Twapi_UsnJournalQuery", Twapi_UsnJournalQueryObjCmd, ticP, NULL);
+    Tcl_CreateObjCommand(interp, "twapi::Twapi_UsnCursorOpen", Twapi_UsnCursorOpenObjCmd, ticP, NULL);
+    Tcl_CreateObjCommand(interp, "twapi::Twapi_UsnCursorRead", Twapi_UsnCursorReadObjCmd, ticP, NULL);
+    Tcl_CreateObjCommand(interp, "twapi::Twapi_UsnCursorPosition", Twapi_UsnCursorPositionObjCmd, ticP, NULL);
+    Tcl_CreateObjCommand(interp, "twapi::Twapi_UsnCursorClose", Twapi_UsnCursorCloseObjCmd, ticP, NULL);
 
     return TCL_OK;
 }
@@ -478,6 +776,9 @@ static void TwapiStorageCleanup(TwapiInterpContext *ticP)
             TwapiShutdownDirectoryMonitor(ZLIST_HEAD(&sicP->directory_monitors));
         }
 
+        /* Stop file tree scans. Their pending callbacks free them. */
+        TwapiShutdownFileScans(sicP);
+
         TwapiFree(ticP->module.data.pval);
         ticP->module.data.pval = NULL;
     }
@@ -521,6 +822,7 @@ int Twapi_storage_Init(Tcl_Interp *interp)
 
     sicP  = TwapiAlloc(sizeof(TwapiStorageInterpContext));
     ZLIST_INIT(&sicP->directory_monitors);
+    ZLIST_INIT(&sicP->file_scans);
     ticP->module.data.pval = sicP;
     return TCL_OK;
 }
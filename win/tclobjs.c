@@ -7,6 +7,8 @@
 
 #include "twapi.h"
 #include "twapi_base.h"
+#include "ipaddr.h"
+#include "sidobj.h"
 
 /* For older MinGW releases */
 #ifndef ERROR_IMPLEMENTATION_LIMIT
@@ -1392,19 +1394,18 @@ ObjToLSA_UNICODE_STRING(Tcl_Interp         *ip,
     return TCL_OK;
 }
 
-/* interp may be NULL */
+/*
+ * interp may be NULL. The returned object keeps the binary SID as its
+ * internal rep so passing it back to ObjToPSIDSWS needs no parsing.
+ */
 TWAPI_EXTERN TCL_RESULT ObjFromSID (Tcl_Interp *interp, SID *sidP, Tcl_Obj **objPP)
 {
-    char *strP;
-
-    if (ConvertSidToStringSidA(sidP, &strP) == 0) {
-        if (interp)
-            TwapiReturnSystemError(interp);
-        return TCL_ERROR;
+    /* Length of sidP is unknown. SidObjNew only reads what it needs. */
+    *objPP = SidObjNew(sidP, SIDOBJ_MAX_SIZE);
+    if (*objPP == NULL) {
+        SetLastError(ERROR_INVALID_SID);
+        return TwapiReturnSystemError(interp);
     }
-
-    *objPP = ObjFromString(strP);
-    LocalFree(strP);
     return TCL_OK;
 }
 
@@ -2504,17 +2505,29 @@ TWAPI_EXTERN Tcl_Obj *ObjFromULONGLONG(ULONGLONG ull)
 /* Given a IP address as a DWORD, returns a Tcl string */
 TWAPI_EXTERN Tcl_Obj *IPAddrObjFromDWORD(DWORD addr)
 {
-    struct in_addr inaddr;
-    inaddr.S_un.S_addr = addr;
-    /* Note inet_ntoa is thread safe on Windows */
-    return ObjFromString(inet_ntoa(inaddr));
+    IpAddr ipaddr;
+
+    /* Binary form is kept so the value can be matched without parsing */
+    TwapiZeroMemory(&ipaddr, sizeof(ipaddr));
+    ipaddr.family = 4;
+    CopyMemory(ipaddr.bytes, &addr, 4); /* Already network order */
+    return IpAddrNewObj(&ipaddr);
 }
 
 /* Given a string, return the IP address */
 TWAPI_EXTERN int IPAddrObjToDWORD(Tcl_Interp *interp, Tcl_Obj *objP, DWORD *addrP)
 {
     DWORD addr;
-    char *p = ObjToString(objP);
+    IpAddr ipaddr;
+    char *p;
+
+    if (IpAddrFromObj(NULL, objP, &ipaddr) == TCL_OK && ipaddr.family == 4) {
+        CopyMemory(addrP, ipaddr.bytes, 4);
+        return TCL_OK;
+    }
+
+    /* inet_addr also accepts forms like 10.1 */
+    p = ObjToString(objP);
     if ((addr = inet_addr(p)) == INADDR_NONE) {
         /* Bad format or 255.255.255.255 */
         if (! STREQ("255.255.255.255", p)) {
@@ -3819,6 +3832,11 @@ TWAPI_EXTERN PSID TwapiSidFromStringSWS(char *strP)
     PSID    local_sidP;
     int error;
 
+    /* Common S-1-... form is parsed directly without the Local* calls */
+    sidP = SWSAlloc(SIDOBJ_MAX_SIZE, NULL);
+    if (SidObjParse(strP, strlen(strP), sidP))
+        return sidP;
+
     local_sidP = NULL;
     sidP = NULL;
 
@@ -3862,6 +3880,15 @@ TWAPI_EXTERN TCL_RESULT ObjToPSIDNonNullSWS(Tcl_Interp *interp, Tcl_Obj *obj, PS
     DWORD dwLen;
     SID  *sidP;
     DWORD winerror;
+    const unsigned char *binP;
+    unsigned int binlen;
+
+    /* Objects from ObjFromSID or previous calls already hold the binary */
+    if (SidObjGet(obj, &binP, &binlen) == 0) {
+        *sidPP = SWSAlloc(binlen, NULL);
+        CopyMemory(*sidPP, binP, binlen);
+        return TCL_OK;
+    }
 
     *sidPP = TwapiSidFromStringSWS(ObjToString(obj));
     if (*sidPP)
@@ -0,0 +1,813 @@
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Persistent cache of dispatch prototypes extracted from a type library.
+ * The cache is written once from the script level after reading the
+ * ITypeLib and then memory mapped on later runs so that prototype
+ * lookups do not need ITypeInfo/ITypeComp at all.
+ *
+ * The first part of this file implements the file format (see tlbcache.h)
+ * using only the C library. The Tcl commands follow and are Windows only.
+ *
+ * Build with -DTLBCACHE_TEST to get a standalone test driver for the
+ * file format (see end of file).
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include "tlbcache.h"
+
+/* Offsets within the header */
+#define TLBC_H_MAGIC        0
+#define TLBC_H_VERSION      4
+#define TLBC_H_SIZE         8
+#define TLBC_H_LIBVERSION   12
+#define TLBC_H_LCID         16
+#define TLBC_H_NENTRIES     20
+#define TLBC_H_ENTRIES_OFF  24
+#define TLBC_H_STRINGS_OFF  28
+#define TLBC_H_STRINGS_SIZE 32
+#define TLBC_H_LIBGUID      36
+
+/* Offsets within an entry */
+#define TLBC_E_GUID         0
+#define TLBC_E_NAME         4
+#define TLBC_E_LCID         8
+#define TLBC_E_INVKIND      12
+#define TLBC_E_PROTO        16
+
+static tlbc_u32 TlbcGetU32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((tlbc_u32)p[3] << 24);
+}
+
+static void TlbcPutU32(unsigned char *p, tlbc_u32 v)
+{
+    p[0] = (unsigned char) v;
+    p[1] = (unsigned char) (v >> 8);
+    p[2] = (unsigned char) (v >> 16);
+    p[3] = (unsigned char) (v >> 24);
+}
+
+static int TlbcToUpper(int c)
+{
+    return (c >= 'a' && c <= 'z') ? c - ('a' - 'A') : c;
+}
+
+/* ASCII case-insensitive compare used for GUID strings */
+static int TlbcCompareNoCase(const char *a, tlbc_u32 alen,
+                             const char *b, tlbc_u32 blen)
+{
+    tlbc_u32 i, n = alen < blen ? alen : blen;
+    for (i = 0; i < n; ++i) {
+        int ca = TlbcToUpper((unsigned char) a[i]);
+        int cb = TlbcToUpper((unsigned char) b[i]);
+        if (ca != cb)
+            return ca - cb;
+    }
+    return alen == blen ? 0 : (alen < blen ? -1 : 1);
+}
+
+static int TlbcCompareExact(const char *a, tlbc_u32 alen,
+                            const char *b, tlbc_u32 blen)
+{
+    int cmp = memcmp(a, b, alen < blen ? alen : blen);
+    if (cmp)
+        return cmp;
+    return alen == blen ? 0 : (alen < blen ? -1 : 1);
+}
+
+static int TlbcCompareKey(const TlbcEntry *a, const TlbcEntry *b)
+{
+    int cmp;
+    cmp = TlbcCompareNoCase(a->guid.s, a->guid.len, b->guid.s, b->guid.len);
+    if (cmp)
+        return cmp;
+    cmp = TlbcCompareExact(a->name.s, a->name.len, b->name.s, b->name.len);
+    if (cmp)
+        return cmp;
+    if (a->lcid != b->lcid)
+        return a->lcid < b->lcid ? -1 : 1;
+    if (a->invkind != b->invkind)
+        return a->invkind < b->invkind ? -1 : 1;
+    return 0;
+}
+
+static int TlbcQsortCompare(const void *a, const void *b)
+{
+    return TlbcCompareKey((const TlbcEntry *)a, (const TlbcEntry *)b);
+}
+
+void TlbcSortEntries(TlbcEntry *entries, tlbc_u32 n)
+{
+    qsort(entries, n, sizeof(*entries), TlbcQsortCompare);
+}
+
+static size_t TlbcStringSize(tlbc_u32 len)
+{
+    return 4 + len + 1;
+}
+
+/*
+ * Returns the size of the image for the given header and entries.
+ * Entries must already have been sorted with TlbcSortEntries.
+ */
+size_t TlbcImageSize(const TlbcHeader *hdrP, const TlbcEntry *entries,
+                     tlbc_u32 n)
+{
+    size_t sz;
+    tlbc_u32 i;
+
+    sz = TLBC_HEADER_SIZE + (size_t) n * TLBC_ENTRY_SIZE;
+    sz += TlbcStringSize(hdrP->libguid.len);
+    for (i = 0; i < n; ++i) {
+        if (i == 0 ||
+            TlbcCompareNoCase(entries[i].guid.s, entries[i].guid.len,
+                              entries[i-1].guid.s, entries[i-1].guid.len)) {
+            sz += TlbcStringSize(entries[i].guid.len);
+        }
+        if (i == 0 ||
+            TlbcCompareExact(entries[i].name.s, entries[i].name.len,
+                             entries[i-1].name.s, entries[i-1].name.len)) {
+            sz += TlbcStringSize(entries[i].name.len);
+        }
+        sz += TlbcStringSize(entries[i].proto.len);
+    }
+    return sz;
+}
+
+/* Appends a string to the string table, returning its offset in the image */
+static tlbc_u32 TlbcPutString(unsigned char *buf, size_t *posP,
+                              const char *s, tlbc_u32 len, int upper)
+{
+    tlbc_u32 off = (tlbc_u32) *posP;
+    unsigned char *p = buf + off;
+    tlbc_u32 i;
+
+    TlbcPutU32(p, len);
+    p += 4;
+    if (upper) {
+        for (i = 0; i < len; ++i)
+            p[i] = (unsigned char) TlbcToUpper((unsigned char) s[i]);
+    } else {
+        memcpy(p, s, len);
+    }
+    p[len] = 0;
+    *posP += TlbcStringSize(len);
+    return off;
+}
+
+/*
+ * Writes the image into buf which must be at least TlbcImageSize bytes.
+ * Entries must already have been sorted with TlbcSortEntries.
+ */
+int TlbcWriteImage(const TlbcHeader *hdrP, const TlbcEntry *entries,
+                   tlbc_u32 n, unsigned char *buf, size_t bufsize)
+{
+    size_t total, pos;
+    tlbc_u32 i, guid_off, name_off, strings_off;
+    unsigned char *entP;
+
+    total = TlbcImageSize(hdrP, entries, n);
+    if (bufsize < total || total > 0xffffffffu)
+        return TLBC_E_SPACE;
+
+    strings_off = TLBC_HEADER_SIZE + n * TLBC_ENTRY_SIZE;
+    pos = strings_off;
+
+    TlbcPutU32(buf + TLBC_H_MAGIC, TLBC_MAGIC);
+    TlbcPutU32(buf + TLBC_H_VERSION, TLBC_FORMAT_VERSION);
+    TlbcPutU32(buf + TLBC_H_SIZE, (tlbc_u32) total);
+    TlbcPutU32(buf + TLBC_H_LIBVERSION,
+               (hdrP->major & 0xffff) | (hdrP->minor << 16));
+    TlbcPutU32(buf + TLBC_H_LCID, hdrP->lcid);
+    TlbcPutU32(buf + TLBC_H_NENTRIES, n);
+    TlbcPutU32(buf + TLBC_H_ENTRIES_OFF, TLBC_HEADER_SIZE);
+    TlbcPutU32(buf + TLBC_H_STRINGS_OFF, strings_off);
+    TlbcPutU32(buf + TLBC_H_STRINGS_SIZE, (tlbc_u32) (total - strings_off));
+    TlbcPutU32(buf + TLBC_H_LIBGUID,
+               TlbcPutString(buf, &pos, hdrP->libguid.s, hdrP->libguid.len, 1));
+
+    guid_off = name_off = 0;
+    entP = buf + TLBC_HEADER_SIZE;
+    for (i = 0; i < n; ++i, entP += TLBC_ENTRY_SIZE) {
+        const TlbcEntry *e = &entries[i];
+        if (i == 0 ||
+            TlbcCompareNoCase(e->guid.s, e->guid.len,
+                              entries[i-1].guid.s, entries[i-1].guid.len)) {
+            guid_off = TlbcPutString(buf, &pos, e->guid.s, e->guid.len, 1);
+        }
+        if (i == 0 ||
+            TlbcCompareExact(e->name.s, e->name.len,
+                             entries[i-1].name.s, entries[i-1].name.len)) {
+            name_off = TlbcPutString(buf, &pos, e->name.s, e->name.len, 0);
+        }
+        TlbcPutU32(entP + TLBC_E_GUID, guid_off);
+        TlbcPutU32(entP + TLBC_E_NAME, name_off);
+        TlbcPutU32(entP + TLBC_E_LCID, e->lcid);
+        TlbcPutU32(entP + TLBC_E_INVKIND, e->invkind);
+        TlbcPutU32(entP + TLBC_E_PROTO,
+                   TlbcPutString(buf, &pos, e->proto.s, e->proto.len, 0));
+    }
+
+    return pos == total ? TLBC_OK : TLBC_E_CORRUPT;
+}
+
+/* Validates and returns the string at image offset off */
+static int TlbcGetString(const TlbcReader *rdrP, tlbc_u32 off, TlbcString *strP)
+{
+    size_t len;
+    size_t end = (size_t) rdrP->strings_off + rdrP->strings_size;
+
+    /* Arithmetic in size_t so a string at the very end cannot wrap. */
+    if (off < rdrP->strings_off || off > end || end - off < 4)
+        return TLBC_E_CORRUPT;
+    len = TlbcGetU32(rdrP->base + off);
+    /* Length plus terminating NUL must fit after the length word */
+    if (len >= end - off - 4)
+        return TLBC_E_CORRUPT;
+    strP->s = (const char *) rdrP->base + off + 4;
+    strP->len = (tlbc_u32) len;
+    return TLBC_OK;
+}
+
+/*
+ * Initializes a reader over a cache image. Only the header is
+ * validated here. Strings are bounds checked as they are accessed so
+ * opening a large mapped file does not touch every page.
+ */
+int TlbcOpen(TlbcReader *rdrP, const void *data, size_t size)
+{
+    const unsigned char *p = data;
+    tlbc_u32 libver;
+
+    if (size < TLBC_HEADER_SIZE || TlbcGetU32(p + TLBC_H_MAGIC) != TLBC_MAGIC)
+        return TLBC_E_FORMAT;
+    if (TlbcGetU32(p + TLBC_H_VERSION) != TLBC_FORMAT_VERSION)
+        return TLBC_E_VERSION;
+    if (TlbcGetU32(p + TLBC_H_SIZE) != size)
+        return TLBC_E_FORMAT;
+
+    rdrP->base = p;
+    rdrP->size = (tlbc_u32) size;
+    rdrP->nentries = TlbcGetU32(p + TLBC_H_NENTRIES);
+    rdrP->entries_off = TlbcGetU32(p + TLBC_H_ENTRIES_OFF);
+    rdrP->strings_off = TlbcGetU32(p + TLBC_H_STRINGS_OFF);
+    rdrP->strings_size = TlbcGetU32(p + TLBC_H_STRINGS_SIZE);
+
+    if (rdrP->entries_off < TLBC_HEADER_SIZE ||
+        rdrP->entries_off > rdrP->size ||
+        rdrP->nentries > (rdrP->size - rdrP->entries_off) / TLBC_ENTRY_SIZE ||
+        rdrP->strings_off < rdrP->entries_off + rdrP->nentries * TLBC_ENTRY_SIZE ||
+        rdrP->strings_off > rdrP->size ||
+        rdrP->strings_size > rdrP->size - rdrP->strings_off)
+        return TLBC_E_CORRUPT;
+
+    libver = TlbcGetU32(p + TLBC_H_LIBVERSION);
+    rdrP->hdr.major = libver & 0xffff;
+    rdrP->hdr.minor = libver >> 16;
+    rdrP->hdr.lcid = TlbcGetU32(p + TLBC_H_LCID);
+    return TlbcGetString(rdrP, TlbcGetU32(p + TLBC_H_LIBGUID),
+                         &rdrP->hdr.libguid);
+}
+
+int TlbcGetEntry(const TlbcReader *rdrP, tlbc_u32 index, TlbcEntry *entP)
+{
+    const unsigned char *p;
+    int status;
+
+    if (index >= rdrP->nentries)
+        return TLBC_E_CORRUPT;
+    p = rdrP->base + rdrP->entries_off + index * TLBC_ENTRY_SIZE;
+    entP->lcid = TlbcGetU32(p + TLBC_E_LCID);
+    entP->invkind = TlbcGetU32(p + TLBC_E_INVKIND);
+    status = TlbcGetString(rdrP, TlbcGetU32(p + TLBC_E_GUID), &entP->guid);
+    if (status == TLBC_OK)
+        status = TlbcGetString(rdrP, TlbcGetU32(p + TLBC_E_NAME), &entP->name);
+    if (status == TLBC_OK)
+        status = TlbcGetString(rdrP, TlbcGetU32(p + TLBC_E_PROTO), &entP->proto);
+    return status;
+}
+
+/*
+ * Binary search for a prototype. Returns 1 and fills *protoP if found,
+ * 0 if not found and -1 if the image is corrupt.
+ */
+int TlbcLookup(const TlbcReader *rdrP,
+               const char *guid, tlbc_u32 guidlen,
+               const char *name, tlbc_u32 namelen,
+               tlbc_u32 lcid, tlbc_u32 invkind, TlbcString *protoP)
+{
+    TlbcEntry key, ent;
+    tlbc_u32 lo, hi, mid;
+    int cmp;
+
+    key.guid.s = guid;
+    key.guid.len = guidlen;
+    key.name.s = name;
+    key.name.len = namelen;
+    key.lcid = lcid;
+    key.invkind = invkind;
+
+    lo = 0;
+    hi = rdrP->nentries;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (TlbcGetEntry(rdrP, mid, &ent) != TLBC_OK)
+            return -1;
+        cmp = TlbcCompareKey(&key, &ent);
+        if (cmp == 0) {
+            *protoP = ent.proto;
+            return 1;
+        }
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return 0;
+}
+
+#ifdef _WIN32
+
+#include "twapi.h"
+#include "twapi_com.h"
+
+/* A mapped cache file */
+typedef struct TwapiTypeLibCache {
+    HANDLE     mapping;
+    void      *viewP;
+    TlbcReader rdr;
+} TwapiTypeLibCache;
+
+static void TwapiTypeLibCacheFree(TwapiTypeLibCache *tlcP)
+{
+    if (tlcP->viewP)
+        UnmapViewOfFile(tlcP->viewP);
+    if (tlcP->mapping)
+        CloseHandle(tlcP->mapping);
+    TwapiFree(tlcP);
+}
+
+static TCL_RESULT TwapiTlbcReturnError(Tcl_Interp *interp, int status)
+{
+    const char *msg;
+    switch (status) {
+    case TLBC_E_VERSION: msg = "Unsupported type library cache version."; break;
+    case TLBC_E_FORMAT: msg = "File is not a type library cache."; break;
+    default: msg = "Type library cache is corrupt."; break;
+    }
+    return TwapiReturnErrorMsg(interp, TWAPI_INVALID_DATA, msg);
+}
+
+static void TwapiTlbcStringFromObj(Tcl_Obj *objP, TlbcString *strP)
+{
+    Tcl_Size len;
+    strP->s = Tcl_GetStringFromObj(objP, &len);
+    strP->len = (tlbc_u32) len;
+}
+
+/*
+ * Twapi_TypeLibCacheWrite PATH {LIBGUID MAJOR MINOR LCID} ENTRIES
+ * ENTRIES is a flat list of GUID NAME LCID INVKIND PROTO. The file is
+ * written under a temporary name and then renamed so concurrent
+ * readers never see a partial file.
+ */
+int Twapi_TypeLibCacheWriteObjCmd(
+    ClientData clientdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    Tcl_Obj **hdrObjs, **objs;
+    Tcl_Size nhdr, nobjs;
+    TlbcHeader hdr;
+    TlbcEntry *entries;
+    unsigned char *buf = NULL;
+    size_t bufsize;
+    tlbc_u32 i, n;
+    WCHAR *pathP, *tempP;
+    Tcl_Size pathlen;
+    HANDLE h;
+    DWORD written, winerr;
+    TCL_RESULT res;
+    int status;
+
+    if (objc != 4)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    if (ObjGetElements(interp, objv[2], &nhdr, &hdrObjs) != TCL_OK ||
+        ObjGetElements(interp, objv[3], &nobjs, &objs) != TCL_OK)
+        return TCL_ERROR;
+    if (nhdr != 4 || (nobjs % 5) != 0)
+        return TwapiReturnError(interp, TWAPI_INVALID_ARGS);
+
+    TwapiTlbcStringFromObj(hdrObjs[0], &hdr.libguid);
+    if (ObjToUINT(interp, hdrObjs[1], &hdr.major) != TCL_OK ||
+        ObjToUINT(interp, hdrObjs[2], &hdr.minor) != TCL_OK ||
+        ObjToUINT(interp, hdrObjs[3], &hdr.lcid) != TCL_OK)
+        return TCL_ERROR;
+
+    n = (tlbc_u32) (nobjs / 5);
+    entries = MemLifoPushFrame(ticP->memlifoP, (n ? n : 1) * sizeof(*entries),
+                               NULL);
+    for (i = 0; i < n; ++i, objs += 5) {
+        TwapiTlbcStringFromObj(objs[0], &entries[i].guid);
+        TwapiTlbcStringFromObj(objs[1], &entries[i].name);
+        if (ObjToUINT(interp, objs[2], &entries[i].lcid) != TCL_OK ||
+            ObjToUINT(interp, objs[3], &entries[i].invkind) != TCL_OK) {
+            res = TCL_ERROR;
+            goto vamoose;
+        }
+        TwapiTlbcStringFromObj(objs[4], &entries[i].proto);
+    }
+
+    TlbcSortEntries(entries, n);
+    bufsize = TlbcImageSize(&hdr, entries, n);
+    buf = TwapiAlloc(bufsize);
+    status = TlbcWriteImage(&hdr, entries, n, buf, bufsize);
+    if (status != TLBC_OK) {
+        res = TwapiTlbcReturnError(interp, status);
+        goto vamoose;
+    }
+
+    pathP = ObjToWinCharsN(objv[1], &pathlen);
+    tempP = MemLifoAlloc(ticP->memlifoP, (pathlen + 5) * sizeof(WCHAR), NULL);
+    CopyMemory(tempP, pathP, pathlen * sizeof(WCHAR));
+    CopyMemory(tempP + pathlen, L".tmp", 5 * sizeof(WCHAR));
+
+    h = CreateFileW(tempP, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                    FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        res = TwapiReturnSystemError(interp);
+        goto vamoose;
+    }
+    if (! WriteFile(h, buf, (DWORD) bufsize, &written, NULL)) {
+        winerr = GetLastError();
+        CloseHandle(h);
+        DeleteFileW(tempP);
+        res = Twapi_AppendSystemError(interp, winerr);
+        goto vamoose;
+    }
+    CloseHandle(h);
+    if (! MoveFileExW(tempP, pathP, MOVEFILE_REPLACE_EXISTING)) {
+        winerr = GetLastError();
+        DeleteFileW(tempP);
+        res = Twapi_AppendSystemError(interp, winerr);
+        goto vamoose;
+    }
+    res = TCL_OK;
+
+vamoose:
+    if (buf)
+        TwapiFree(buf);
+    MemLifoPopFrame(ticP->memlifoP);
+    return res;
+}
+
+/*
+ * Twapi_TypeLibCacheOpen PATH
+ * Maps the cache file and returns {HANDLE LIBGUID MAJOR MINOR LCID}
+ */
+int Twapi_TypeLibCacheOpenObjCmd(
+    ClientData clientdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiTypeLibCache *tlcP;
+    LPWSTR pathP;
+    HANDLE h;
+    LARGE_INTEGER size;
+    DWORD winerr;
+    Tcl_Obj *objs[5];
+    int status;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1, GETWSTR(pathP), ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    h = CreateFileW(pathP, GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_DELETE,
+                    NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+        return TwapiReturnSystemError(interp);
+    if (! GetFileSizeEx(h, &size)) {
+        winerr = GetLastError();
+        CloseHandle(h);
+        return Twapi_AppendSystemError(interp, winerr);
+    }
+    if (size.QuadPart < TLBC_HEADER_SIZE || size.HighPart != 0) {
+        CloseHandle(h);
+        return TwapiTlbcReturnError(interp, TLBC_E_FORMAT);
+    }
+
+    tlcP = TwapiAllocZero(sizeof(*tlcP));
+    tlcP->mapping = CreateFileMappingW(h, NULL, PAGE_READONLY, 0, 0, NULL);
+    winerr = GetLastError();
+    /* The mapping holds its own reference to the file */
+    CloseHandle(h);
+    if (tlcP->mapping == NULL) {
+        TwapiTypeLibCacheFree(tlcP);
+        return Twapi_AppendSystemError(interp, winerr);
+    }
+    tlcP->viewP = MapViewOfFile(tlcP->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (tlcP->viewP == NULL) {
+        winerr = GetLastError();
+        TwapiTypeLibCacheFree(tlcP);
+        return Twapi_AppendSystemError(interp, winerr);
+    }
+
+    status = TlbcOpen(&tlcP->rdr, tlcP->viewP, size.LowPart);
+    if (status != TLBC_OK) {
+        TwapiTypeLibCacheFree(tlcP);
+        return TwapiTlbcReturnError(interp, status);
+    }
+
+    if (TwapiRegisterPointerTic(ticP, tlcP, TwapiTypeLibCacheFree) != TCL_OK) {
+        TwapiTypeLibCacheFree(tlcP);
+        return TCL_ERROR;
+    }
+
+    objs[0] = ObjFromOpaque(tlcP, "TwapiTypeLibCache*");
+    objs[1] = ObjFromStringN(tlcP->rdr.hdr.libguid.s, tlcP->rdr.hdr.libguid.len);
+    objs[2] = ObjFromDWORD(tlcP->rdr.hdr.major);
+    objs[3] = ObjFromDWORD(tlcP->rdr.hdr.minor);
+    objs[4] = ObjFromDWORD(tlcP->rdr.hdr.lcid);
+    return ObjSetResult(interp, ObjNewList(5, objs));
+}
+
+/*
+ * Twapi_TypeLibCacheLookup HANDLE GUID NAME LCID INVKIND
+ * Returns an empty list if there is no entry or a single element
+ * list containing the prototype. Note the prototype itself may be
+ * empty indicating a cached negative result.
+ */
+int Twapi_TypeLibCacheLookupObjCmd(
+    ClientData clientdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiTypeLibCache *tlcP;
+    TlbcString guid, name, proto;
+    DWORD lcid, invkind;
+    Tcl_Obj *protoObj;
+    int found;
+
+    if (TwapiGetArgsEx(ticP, objc-1, objv+1,
+                       GETVERIFIEDPTR(tlcP, TwapiTypeLibCache*, TwapiTypeLibCacheFree),
+                       ARGSKIP, ARGSKIP, GETDWORD(lcid), GETDWORD(invkind),
+                       ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    TwapiTlbcStringFromObj(objv[2], &guid);
+    TwapiTlbcStringFromObj(objv[3], &name);
+    found = TlbcLookup(&tlcP->rdr, guid.s, guid.len, name.s, name.len,
+                       lcid, invkind, &proto);
+    if (found < 0)
+        return TwapiTlbcReturnError(interp, TLBC_E_CORRUPT);
+    if (found) {
+        protoObj = ObjFromStringN(proto.s, proto.len);
+        ObjSetResult(interp, ObjNewList(1, &protoObj));
+    }
+    return TCL_OK;
+}
+
+int Twapi_TypeLibCacheCloseObjCmd(
+    ClientData clientdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiTypeLibCache *tlcP;
+
+    if (TwapiGetArgsEx(ticP, objc-1, objv+1,
+                       GETVERIFIEDPTR(tlcP, TwapiTypeLibCache*, TwapiTypeLibCacheFree),
+                       ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    if (TwapiUnregisterPointerTic(ticP, tlcP, TwapiTypeLibCacheFree) != TCL_OK)
+        return TCL_ERROR;
+    TwapiTypeLibCacheFree(tlcP);
+    return TCL_OK;
+}
+
+#endif /* _WIN32 */
+
+#ifdef TLBCACHE_TEST
+/*
+ * Test driver for the file format.
+ *   cc -O2 -DTLBCACHE_TEST tlbcache.c -o tlbcache_test
+ */
+#include <stdio.h>
+
+static int tlbcFailures;
+
+static void TlbcCheck(int ok, const char *what)
+{
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        ++tlbcFailures;
+    }
+}
+
+static TlbcString TlbcStr(const char *s)
+{
+    TlbcString str;
+    str.s = s;
+    str.len = (tlbc_u32) strlen(s);
+    return str;
+}
+
+static int TlbcStrEq(TlbcString str, const char *s)
+{
+    return str.len == strlen(s) && memcmp(str.s, s, str.len) == 0
+        && str.s[str.len] == 0;
+}
+
+#define TLBC_GUID1 "{00020970-0000-0000-c000-000000000046}"
+#define TLBC_GUID2 "{000209FF-0000-0000-C000-000000000046}"
+
+int main(void)
+{
+    static const struct {
+        const char *guid, *name;
+        tlbc_u32 lcid, invkind;
+        const char *proto;
+    } data[] = {
+        {TLBC_GUID2, "Visible", 0, 2, "p2"},
+        {TLBC_GUID1, "Quit", 0, 1, "p1"},
+        {TLBC_GUID2, "Visible", 0, 4, "p4"},
+        {TLBC_GUID2, "Documents", 0, 2, "p5"},
+        {TLBC_GUID1, "Quit", 9, 1, "p3"},
+        {TLBC_GUID2, "visible", 0, 2, "p6"},
+    };
+    static const char *sorted_protos[] = {"p1", "p3", "p5", "p2", "p4", "p6"};
+    TlbcEntry entries[sizeof(data)/sizeof(data[0])], ent, prev;
+    tlbc_u32 n = (tlbc_u32) (sizeof(data)/sizeof(data[0]));
+    tlbc_u32 i, guid_off, name_off, str_end;
+    TlbcHeader hdr;
+    TlbcReader rdr;
+    TlbcString proto;
+    unsigned char *img, *bad;
+    size_t size;
+
+    for (i = 0; i < n; ++i) {
+        entries[i].guid = TlbcStr(data[i].guid);
+        entries[i].name = TlbcStr(data[i].name);
+        entries[i].lcid = data[i].lcid;
+        entries[i].invkind = data[i].invkind;
+        entries[i].proto = TlbcStr(data[i].proto);
+    }
+    hdr.libguid = TlbcStr("{00020905-0000-0000-c000-000000000046}");
+    hdr.major = 8;
+    hdr.minor = 7;
+    hdr.lcid = 1033;
+
+    TlbcSortEntries(entries, n);
+    size = TlbcImageSize(&hdr, entries, n);
+    /* 2 guids, 4 distinct names (Quit, Documents, Visible, visible) */
+    TlbcCheck(size == TLBC_HEADER_SIZE + n * TLBC_ENTRY_SIZE
+              + (4 + 38 + 1) * 3
+              + (4 + 4 + 1) + (4 + 9 + 1) + (4 + 7 + 1) * 2
+              + (4 + 2 + 1) * n, "image size");
+
+    img = malloc(size);
+    bad = malloc(size);
+    TlbcCheck(TlbcWriteImage(&hdr, entries, n, img, size - 1) == TLBC_E_SPACE,
+              "write into undersized buffer");
+    TlbcCheck(TlbcWriteImage(&hdr, entries, n, img, size) == TLBC_OK,
+              "write image");
+
+    /* Round trip */
+    TlbcCheck(TlbcOpen(&rdr, img, size) == TLBC_OK, "open image");
+    TlbcCheck(TlbcStrEq(rdr.hdr.libguid,
+                        "{00020905-0000-0000-C000-000000000046}"),
+              "library guid upper cased");
+    TlbcCheck(rdr.hdr.major == 8 && rdr.hdr.minor == 7 && rdr.hdr.lcid == 1033,
+              "library version and lcid");
+    TlbcCheck(rdr.nentries == n, "entry count");
+    for (i = 0; i < n; ++i) {
+        if (TlbcGetEntry(&rdr, i, &ent) != TLBC_OK) {
+            TlbcCheck(0, "get entry");
+            continue;
+        }
+        TlbcCheck(TlbcStrEq(ent.proto, sorted_protos[i]), "sorted order");
+        if (i > 0) {
+            TlbcCheck(TlbcCompareKey(&prev, &ent) < 0, "strictly ascending");
+            if (TlbcCompareNoCase(prev.guid.s, prev.guid.len,
+                                  ent.guid.s, ent.guid.len) == 0)
+                TlbcCheck(prev.guid.s == ent.guid.s, "shared guid string");
+            if (TlbcCompareExact(prev.name.s, prev.name.len,
+                                 ent.name.s, ent.name.len) == 0)
+                TlbcCheck(prev.name.s == ent.name.s, "shared name string");
+        }
+        prev = ent;
+    }
+    TlbcCheck(TlbcGetEntry(&rdr, n, &ent) == TLBC_E_CORRUPT,
+              "entry index out of range");
+
+    /* Lookups */
+    TlbcCheck(TlbcLookup(&rdr, TLBC_GUID1, 38, "Quit", 4, 9, 1, &proto) == 1
+              && TlbcStrEq(proto, "p3"), "lookup");
+    TlbcCheck(TlbcLookup(&rdr, "{000209ff-0000-0000-c000-000000000046}", 38,
+                         "Visible", 7, 0, 4, &proto) == 1
+              && TlbcStrEq(proto, "p4"), "lookup lower case guid");
+    TlbcCheck(TlbcLookup(&rdr, TLBC_GUID2, 38, "visible", 7, 0, 2, &proto) == 1
+              && TlbcStrEq(proto, "p6"), "lookup name is case sensitive");
+    TlbcCheck(TlbcLookup(&rdr, TLBC_GUID2, 38, "VISIBLE", 7, 0, 2, &proto) == 0,
+              "lookup missing name");
+    TlbcCheck(TlbcLookup(&rdr, TLBC_GUID1, 38, "Quit", 4, 7, 1, &proto) == 0,
+              "lookup wrong lcid");
+    TlbcCheck(TlbcLookup(&rdr, TLBC_GUID1, 38, "Quit", 4, 0, 2, &proto) == 0,
+              "lookup wrong invkind");
+    TlbcCheck(TlbcLookup(&rdr, TLBC_GUID1, 37, "Quit", 4, 0, 1, &proto) == 0,
+              "lookup guid prefix");
+
+    /* Damaged images */
+    TlbcCheck(TlbcOpen(&rdr, img, TLBC_HEADER_SIZE - 1) == TLBC_E_FORMAT,
+              "image smaller than header");
+    TlbcCheck(TlbcOpen(&rdr, img, size - 1) == TLBC_E_FORMAT,
+              "truncated image");
+
+    memcpy(bad, img, size);
+    bad[TLBC_H_MAGIC] ^= 1;
+    TlbcCheck(TlbcOpen(&rdr, bad, size) == TLBC_E_FORMAT, "bad magic");
+
+    memcpy(bad, img, size);
+    TlbcPutU32(bad + TLBC_H_VERSION, TLBC_FORMAT_VERSION + 1);
+    TlbcCheck(TlbcOpen(&rdr, bad, size) == TLBC_E_VERSION, "wrong version");
+
+    memcpy(bad, img, size);
+    TlbcPutU32(bad + TLBC_H_ENTRIES_OFF, (tlbc_u32) size);
+    TlbcCheck(TlbcOpen(&rdr, bad, size) == TLBC_E_CORRUPT,
+              "entry table out of bounds");
+
+    memcpy(bad, img, size);
+    TlbcPutU32(bad + TLBC_H_NENTRIES, n + 1000);
+    TlbcCheck(TlbcOpen(&rdr, bad, size) == TLBC_E_CORRUPT,
+              "entry count out of bounds");
+
+    memcpy(bad, img, size);
+    TlbcPutU32(bad + TLBC_H_STRINGS_SIZE, (tlbc_u32) size);
+    TlbcCheck(TlbcOpen(&rdr, bad, size) == TLBC_E_CORRUPT,
+              "string table out of bounds");
+
+    memcpy(bad, img, size);
+    TlbcPutU32(bad + TLBC_H_LIBGUID, 0xfffffff0u);
+    TlbcCheck(TlbcOpen(&rdr, bad, size) == TLBC_E_CORRUPT,
+              "library guid offset out of bounds");
+
+    /* Entry strings are only checked on access */
+    memcpy(bad, img, size);
+    guid_off = TlbcGetU32(bad + TLBC_HEADER_SIZE + TLBC_E_GUID);
+    TlbcPutU32(bad + guid_off, 0xffffu);
+    TlbcCheck(TlbcOpen(&rdr, bad, size) == TLBC_OK, "open with bad string");
+    TlbcCheck(TlbcGetEntry(&rdr, 0, &ent) == TLBC_E_CORRUPT,
+              "string length out of bounds");
+    TlbcPutU32(bad + guid_off, 38);
+    TlbcPutU32(bad + TLBC_HEADER_SIZE + (n/2) * TLBC_ENTRY_SIZE + TLBC_E_PROTO,
+               (tlbc_u32) size);
+    TlbcCheck(TlbcLookup(&rdr, TLBC_GUID1, 38, "Quit", 4, 0, 1, &proto) == -1,
+              "lookup in corrupt image");
+
+    /* Strings at the very end of the string table */
+    memcpy(bad, img, size);
+    str_end = TlbcGetU32(bad + TLBC_H_STRINGS_OFF)
+        + TlbcGetU32(bad + TLBC_H_STRINGS_SIZE);
+    name_off = TLBC_HEADER_SIZE + TLBC_E_NAME;
+    TlbcPutU32(bad + str_end - 4, 0x7fffffffu);
+    TlbcPutU32(bad + name_off, str_end - 4);
+    TlbcCheck(TlbcOpen(&rdr, bad, size) == TLBC_OK, "open with end string");
+    TlbcCheck(TlbcGetEntry(&rdr, 0, &ent) == TLBC_E_CORRUPT,
+              "huge string length at end of table");
+    TlbcPutU32(bad + str_end - 4, 0);
+    TlbcCheck(TlbcGetEntry(&rdr, 0, &ent) == TLBC_E_CORRUPT,
+              "no room for terminator at end of table");
+    TlbcPutU32(bad + name_off, str_end - 3);
+    TlbcCheck(TlbcGetEntry(&rdr, 0, &ent) == TLBC_E_CORRUPT,
+              "length word straddles end of table");
+    TlbcPutU32(bad + name_off, str_end);
+    TlbcCheck(TlbcGetEntry(&rdr, 0, &ent) == TLBC_E_CORRUPT,
+              "string offset at end of table");
+    TlbcPutU32(bad + name_off, 0xffffffffu);
+    TlbcCheck(TlbcGetEntry(&rdr, 0, &ent) == TLBC_E_CORRUPT,
+              "string offset wraps");
+    TlbcPutU32(bad + str_end - 8, 4);
+    TlbcPutU32(bad + name_off, str_end - 8);
+    TlbcCheck(TlbcGetEntry(&rdr, 0, &ent) == TLBC_E_CORRUPT,
+              "string runs past end of table");
+    TlbcPutU32(bad + str_end - 8, 3);
+    TlbcCheck(TlbcGetEntry(&rdr, 0, &ent) == TLBC_OK && ent.name.len == 3,
+              "string ending exactly at end of table");
+
+    free(bad);
+    free(img);
+    printf("%s\n", tlbcFailures ? "FAILED" : "All tests OK");
+    return tlbcFailures ? 1 : 0;
+}
+#endif /* TLBCACHE_TEST */
@@ -0,0 +1,96 @@
+#ifndef TLBCACHE_H
+#define TLBCACHE_H
+
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * On-disk format for the dispatch prototype cache built from a type
+ * library. This header and the format routines in tlbcache.c only
+ * depend on the C library so they can be built and tested on any
+ * platform.
+ *
+ * All integers are 32-bit little endian.
+ *
+ *   Header (TLBC_HEADER_SIZE bytes)
+ *     magic, format version, total file size,
+ *     typelib major | (minor << 16), typelib lcid,
+ *     number of entries, offset of entry table,
+ *     offset and size of string table, offset of typelib guid string
+ *   Entry table - nentries fixed size entries sorted by
+ *     (guid, name, lcid, invkind), each containing
+ *     guid string offset, name string offset, lcid, invkind,
+ *     prototype string offset
+ *   String table - each string is a 32-bit length followed by
+ *     the bytes and a terminating nul. Adjacent entries share
+ *     guid and name strings.
+ *
+ * GUIDs are stored in upper case and compared case-insensitively.
+ * Names are compared exactly as the script level prototype cache does.
+ */
+
+#include <stddef.h>
+
+typedef unsigned int tlbc_u32;
+
+#define TLBC_MAGIC          0x4c545754 /* "TWTL" */
+#define TLBC_FORMAT_VERSION 1
+#define TLBC_HEADER_SIZE    40
+#define TLBC_ENTRY_SIZE     20
+
+/* Return codes */
+#define TLBC_OK             0
+#define TLBC_E_FORMAT       1   /* Not a cache file or truncated */
+#define TLBC_E_VERSION      2   /* Unsupported format version */
+#define TLBC_E_CORRUPT      3   /* Offsets out of bounds */
+#define TLBC_E_SPACE        4   /* Output buffer too small */
+
+typedef struct TlbcString {
+    const char *s;
+    tlbc_u32    len;            /* Not including terminating nul */
+} TlbcString;
+
+typedef struct TlbcEntry {
+    TlbcString guid;            /* Dispatch interface GUID */
+    TlbcString name;            /* Method or property name */
+    tlbc_u32   lcid;
+    tlbc_u32   invkind;
+    TlbcString proto;           /* Prototype as a Tcl list string */
+} TlbcEntry;
+
+typedef struct TlbcHeader {
+    TlbcString libguid;
+    tlbc_u32   major;
+    tlbc_u32   minor;
+    tlbc_u32   lcid;
+} TlbcHeader;
+
+/* Reader over a cache image. Does not own the memory. */
+typedef struct TlbcReader {
+    const unsigned char *base;
+    tlbc_u32   size;
+    tlbc_u32   nentries;
+    tlbc_u32   entries_off;
+    tlbc_u32   strings_off;
+    tlbc_u32   strings_size;
+    TlbcHeader hdr;
+} TlbcReader;
+
+/* Writer side */
+void   TlbcSortEntries(TlbcEntry *entries, tlbc_u32 n);
+size_t TlbcImageSize(const TlbcHeader *hdrP, const TlbcEntry *entries,
+                     tlbc_u32 n);
+int    TlbcWriteImage(const TlbcHeader *hdrP, const TlbcEntry *entries,
+                      tlbc_u32 n, unsigned char *buf, size_t bufsize);
+
+/* Reader side */
+int    TlbcOpen(TlbcReader *rdrP, const void *data, size_t size);
+int    TlbcGetEntry(const TlbcReader *rdrP, tlbc_u32 index, TlbcEntry *entP);
+int    TlbcLookup(const TlbcReader *rdrP,
+                  const char *guid, tlbc_u32 guidlen,
+                  const char *name, tlbc_u32 namelen,
+                  tlbc_u32 lcid, tlbc_u32 invkind, TlbcString *protoP);
+
+#endif
@@ -145,6 +145,8 @@ static void TwapiTlsUnref()
             if (tlsP->nrefs == 0) {
                 MemLifoClose(&tlsP->memlifo);
                 ObjDecrRefs(tlsP->ffiObj);
+                TwapiParseargsCacheFree(tlsP);
+                TwapiKeylistCacheFree(tlsP);
                 TwapiFree(tlsP);
                 TlsSetValue(gTlsIndex, NULL);
             }
@@ -317,6 +319,8 @@ int Twapi_base_Init(Tcl_Interp *interp)
     Tcl_InitHashTable(&BASE_CONTEXT(ticP)->atoms, TCL_STRING_KEYS);
     /* Pointer registration table */
     Tcl_InitHashTable(&BASE_CONTEXT(ticP)->pointers, TCL_ONE_WORD_KEYS);
+    /* FFI callbacks */
+    Tcl_InitHashTable(&BASE_CONTEXT(ticP)->ffi_callbacks, TCL_ONE_WORD_KEYS);
     /* Trap stack */
     BASE_CONTEXT(ticP)->trapstack = ObjNewList(0, NULL);
     ObjIncrRefs(BASE_CONTEXT(ticP)->trapstack);
@@ -581,6 +585,7 @@ static void Twapi_Cleanup(ClientData clientdata)
 
     WSACleanup();
     TwapiWinPathFree(&gExePath);
+    TwapiCsRegistryCleanup();
 }
 
 static void Twapi_InterpCleanup(ClientData unused, Tcl_Interp *interp)
@@ -1107,6 +1112,8 @@ static void TwapiBaseModuleCleanup(TwapiInterpContext *ticP)
             ckfree((char *)rP);
         }
         Tcl_DeleteHashTable(&(BASE_CONTEXT(ticP)->pointers));
+
+        TwapiFfiCallbacksCleanup(ticP);
     }
 }
 
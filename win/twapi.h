@@ -1090,6 +1090,18 @@ typedef struct _TwapiTls {
      */
     Tcl_Obj *ffiObj;
 
+    /*
+     * Compiled parseargs option lists keyed by their string. Allocated
+     * on first use. See parseargs.c
+     */
+    Tcl_HashTable *parseargs_cache;
+
+    /*
+     * Field indexes of recently used large keyed lists. Allocated on
+     * first use. See keylist.c
+     */
+    struct TwapiKeylistCache *keylist_cache;
+
     int nrefs;                  /* Reference count */
 
 #define TWAPI_TLS_SLOTS 8
@@ -30,6 +30,14 @@ typedef struct _TwapiBaseSpecificContext {
      */
     Tcl_HashTable pointers;
 
+    /*
+     * FFI callbacks allocated in the interp. Maps the function pointer
+     * to the FfiThunk.
+     *
+     * Should be accessed only from the Tcl interp thread.
+     */
+    Tcl_HashTable ffi_callbacks;
+
     Tcl_Obj *trapstack;         /* ListObj containing stack used by trap
                                    command */
 
@@ -43,10 +51,17 @@ Tcl_Obj *Twapi_GetAtomStats(TwapiInterpContext *ticP) ;
 Tcl_Obj *Twapi_GetAtoms(TwapiInterpContext *ticP) ;
 TCL_RESULT TwapiCStructDefDump(Tcl_Interp *interp, Tcl_Obj *csObj);
 void TwapiFfiInit(Tcl_Interp *interp);
+void TwapiFfiCallbacksCleanup(TwapiInterpContext *ticP);
+void TwapiCsRegistryCleanup(void);
+void TwapiParseargsCacheFree(TwapiTls *tlsP);
+void TwapiKeylistCacheFree(TwapiTls *tlsP);
 
 TwapiTclObjCmd Twapi_ParseargsObjCmd;
 TwapiTclObjCmd Twapi_TrapObjCmd;
 TwapiTclObjCmd Twapi_KlGetObjCmd;
+TwapiTclObjCmd Twapi_KlSetObjCmd;
+TwapiTclObjCmd Twapi_KlFieldsObjCmd;
+TwapiTclObjCmd Twapi_KlFlattenObjCmd;
 TwapiTclObjCmd Twapi_TwineObjCmd;
 TwapiTclObjCmd Twapi_RecordArrayHelperObjCmd;
 TwapiTclObjCmd Twapi_RecordObjCmd;
@@ -54,7 +69,13 @@ TwapiTclObjCmd Twapi_GetTwapiBuildInfo;
 TwapiTclObjCmd Twapi_InternalCastObjCmd;
 TwapiTclObjCmd Twapi_GetTclTypeObjCmd;
 TwapiTclObjCmd Twapi_EnumPrintersLevel4ObjCmd;
+TwapiTclObjCmd Twapi_AccountResolveObjCmd;
+TwapiTclObjCmd Twapi_AccountResolveAsyncObjCmd;
+TwapiTclObjCmd Twapi_AccountResolverForgetObjCmd;
+TwapiTclObjCmd Twapi_AccountResolverFlushObjCmd;
+TwapiTclObjCmd Twapi_AccountResolverStatsObjCmd;
 TwapiTclObjCmd Twapi_FfiCallObjCmd;
+TwapiTclObjCmd Twapi_FfiCallableObjCmd;
 #ifdef OBSOLETE
 TwapiTclObjCmd Twapi_FfiLoadObjCmd;
 TwapiTclObjCmd Twapi_Ffi0ObjCmd;
@@ -84,6 +84,13 @@ interface IVixHandle
 
 TwapiTclObjCmd Twapi_ComServerObjCmd;
 TwapiTclObjCmd Twapi_ClassFactoryObjCmd;
+TwapiTclObjCmd Twapi_ComEnumOpenObjCmd;
+TwapiTclObjCmd Twapi_ComEnumNextObjCmd;
+TwapiTclObjCmd Twapi_ComEnumCloseObjCmd;
+TwapiTclObjCmd Twapi_TypeLibCacheWriteObjCmd;
+TwapiTclObjCmd Twapi_TypeLibCacheOpenObjCmd;
+TwapiTclObjCmd Twapi_TypeLibCacheLookupObjCmd;
+TwapiTclObjCmd Twapi_TypeLibCacheCloseObjCmd;
 
 
 #endif
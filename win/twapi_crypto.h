@@ -30,6 +30,10 @@ int TwapiSspiInitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP);
 # define CRYPT_OID_DISABLE_SEARCH_DS_FLAG            0x80000000
 #endif
 
+#ifndef CERT_CHAIN_REVOCATION_ACCUMULATIVE_TIMEOUT
+# define CERT_CHAIN_REVOCATION_ACCUMULATIVE_TIMEOUT  0x08000000
+#endif
+
 /* 
  * The following set of defines needed for building with newer versions
  * of VC++ because they define these symbols only if NTDDI_VERSION us
@@ -103,5 +107,6 @@ void TwapiRegisterPCCERT_CONTEXTTic(TwapiInterpContext *, PCCERT_CONTEXT );
 TCL_RESULT TwapiUnregisterPCCERT_CONTEXT(Tcl_Interp *, PCCERT_CONTEXT);
 TCL_RESULT TwapiUnregisterPCCERT_CONTEXTTic(TwapiInterpContext *, PCCERT_CONTEXT);
 Tcl_Obj *ObjFromCERT_NAME_BLOB(CERT_NAME_BLOB *blobP, DWORD flags);
+TwapiTclObjCmd Twapi_CertStoreRecordsObjCmd;
 
 #endif
@@ -3,6 +3,16 @@
 
 #include <winsvc.h>
 
+typedef struct _TwapiServiceNotifier TwapiServiceNotifier;
+ZLINK_CREATE_TYPEDEFS(TwapiServiceNotifier);
+ZLIST_CREATE_TYPEDEFS(TwapiServiceNotifier);
+
+/* We hang this off TwapiInterpContext to hold this module's data */
+typedef struct _TwapiServiceInterpContext {
+    /* Service status notifiers. Only accessed from the interp thread. */
+    ZLIST_DECL(TwapiServiceNotifier) notifiers;
+} TwapiServiceInterpContext;
+
 int Twapi_BecomeAService(TwapiInterpContext *, int objc, Tcl_Obj *CONST objv[]);
 
 int Twapi_SetServiceStatus(TwapiInterpContext *, int objc, Tcl_Obj *CONST objv[]);
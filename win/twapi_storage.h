@@ -4,6 +4,9 @@
 typedef struct _TwapiDirectoryMonitorContext TwapiDirectoryMonitorContext;
 ZLINK_CREATE_TYPEDEFS(TwapiDirectoryMonitorContext); 
 ZLIST_CREATE_TYPEDEFS(TwapiDirectoryMonitorContext);
+typedef struct _TwapiFileScan TwapiFileScan;
+ZLINK_CREATE_TYPEDEFS(TwapiFileScan);
+ZLIST_CREATE_TYPEDEFS(TwapiFileScan);
 
 /* We hang this off TwapiInterpContext to hold this module's data */
 typedef struct _TwapiStorageInterpContext {
@@ -12,6 +15,8 @@ typedef struct _TwapiStorageInterpContext {
      * FROM Tcl THREAD SO ACCESSED WITHOUT A LOCK.
      */
     ZLIST_DECL(TwapiDirectoryMonitorContext) directory_monitors;
+    /* Asynchronous file tree scans (ftscan.c). Also only interp thread. */
+    ZLIST_DECL(TwapiFileScan) file_scans;
 } TwapiStorageInterpContext;
 
 typedef struct _TwapiDirectoryMonitorBuffer {
@@ -96,5 +101,9 @@ typedef struct _TwapiDirectoryMonitorContext {
 TwapiTclObjCmd Twapi_RegisterDirectoryMonitorObjCmd;
 TwapiTclObjCmd Twapi_UnregisterDirectoryMonitorObjCmd;
 int TwapiShutdownDirectoryMonitor(TwapiDirectoryMonitorContext *);
+TwapiTclObjCmd Twapi_FileTreeScanObjCmd;
+TwapiTclObjCmd Twapi_FileTreeScanAsyncObjCmd;
+TwapiTclObjCmd Twapi_FileTreeScanCancelObjCmd;
+void TwapiShutdownFileScans(TwapiStorageInterpContext *);
 
 #endif
@@ -0,0 +1,466 @@
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * USN change journal record decoder. See usnjrnl.h.
+ *
+ * Build with -DUSNJRNL_TEST to get a standalone test against generated
+ * buffers and a benchmark against decoding in script
+ * (see end of file).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "usnjrnl.h"
+
+static unsigned int UsnjGetU16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned int UsnjGetU32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+static Tcl_WideUInt UsnjGetU64(const unsigned char *p)
+{
+    return UsnjGetU32(p) | ((Tcl_WideUInt) UsnjGetU32(p + 4) << 32);
+}
+
+int UsnjDecodeRecord(const unsigned char *p, size_t avail, UsnjRecord *recP,
+                     unsigned int *lenP)
+{
+    unsigned int len, header, off;
+    const unsigned char *q;
+
+    if (avail < 8)
+        return USNJ_E_INVALID;
+    len = UsnjGetU32(p);
+    /* Records are 8 byte aligned, which also rules out zero lengths */
+    if (len < 8 || len > avail || (len & 7))
+        return USNJ_E_INVALID;
+    *lenP = len;
+    recP->major_version = UsnjGetU16(p + 4);
+    recP->minor_version = UsnjGetU16(p + 6);
+
+    switch (recP->major_version) {
+    case 2:
+        header = USNJ_V2_HEADER_SIZE;
+        if (len < header)
+            return USNJ_E_INVALID;
+        recP->file_id[0] = UsnjGetU64(p + 8);
+        recP->file_id[1] = 0;
+        recP->parent_id[0] = UsnjGetU64(p + 16);
+        recP->parent_id[1] = 0;
+        q = p + 24;
+        break;
+    case 3:
+        header = USNJ_V3_HEADER_SIZE;
+        if (len < header)
+            return USNJ_E_INVALID;
+        recP->file_id[0] = UsnjGetU64(p + 8);
+        recP->file_id[1] = UsnjGetU64(p + 16);
+        recP->parent_id[0] = UsnjGetU64(p + 24);
+        recP->parent_id[1] = UsnjGetU64(p + 32);
+        q = p + 40;
+        break;
+    default:
+        return -1;
+    }
+
+    /* Fields following the file ids have the same layout in V2 and V3 */
+    recP->usn = (Tcl_WideInt) UsnjGetU64(q);
+    recP->timestamp = (Tcl_WideInt) UsnjGetU64(q + 8);
+    recP->reason = UsnjGetU32(q + 16);
+    recP->source_info = UsnjGetU32(q + 20);
+    recP->security_id = UsnjGetU32(q + 24);
+    recP->attrs = UsnjGetU32(q + 28);
+    recP->namelen = UsnjGetU16(q + 32);
+    off = UsnjGetU16(q + 34);
+    if (off < header || off + (unsigned int) recP->namelen > len)
+        return USNJ_E_INVALID;
+    recP->name = p + off;
+    return 0;
+}
+
+Tcl_Obj *UsnjFields(void)
+{
+    static const char *names[] = {
+        "usn", "fileid", "parentid", "timestamp", "reason", "sourceinfo",
+        "securityid", "attrs", "name", "version"
+    };
+    Tcl_Obj *objs[sizeof(names) / sizeof(names[0])];
+    int i;
+
+    for (i = 0; i < (int) (sizeof(names) / sizeof(names[0])); ++i)
+        objs[i] = Tcl_NewStringObj(names[i], -1);
+    return Tcl_NewListObj(i, objs);
+}
+
+static Tcl_Obj *UsnjIdObj(const Tcl_WideUInt id[2])
+{
+    char buf[40];
+
+    if (id[1] == 0 && id[0] <= (Tcl_WideUInt) 0x7fffffffffffffff)
+        return Tcl_NewWideIntObj((Tcl_WideInt) id[0]);
+    /* Tcl parses both forms as integers */
+    if (id[1] == 0)
+        sprintf(buf, "%" TCL_LL_MODIFIER "u", id[0]);
+    else
+        sprintf(buf, "0x%016" TCL_LL_MODIFIER "x%016" TCL_LL_MODIFIER "x",
+                id[1], id[0]);
+    return Tcl_NewStringObj(buf, -1);
+}
+
+static void UsnjAppendUtf8(Tcl_DString *dsP, unsigned int ch)
+{
+    char buf[4];
+    int n;
+
+    if (ch == 0) {
+        /* Tcl's internal form of NUL */
+        buf[0] = (char) 0xC0;
+        buf[1] = (char) 0x80;
+        n = 2;
+    } else if (ch < 0x80) {
+        buf[0] = (char) ch;
+        n = 1;
+    } else if (ch < 0x800) {
+        buf[0] = (char) (0xC0 | (ch >> 6));
+        buf[1] = (char) (0x80 | (ch & 0x3F));
+        n = 2;
+    } else if (ch < 0x10000) {
+        buf[0] = (char) (0xE0 | (ch >> 12));
+        buf[1] = (char) (0x80 | ((ch >> 6) & 0x3F));
+        buf[2] = (char) (0x80 | (ch & 0x3F));
+        n = 3;
+    } else {
+        buf[0] = (char) (0xF0 | (ch >> 18));
+        buf[1] = (char) (0x80 | ((ch >> 12) & 0x3F));
+        buf[2] = (char) (0x80 | ((ch >> 6) & 0x3F));
+        buf[3] = (char) (0x80 | (ch & 0x3F));
+        n = 4;
+    }
+    Tcl_DStringAppend(dsP, buf, n);
+}
+
+static Tcl_Obj *UsnjNameObj(const unsigned char *p, int len)
+{
+    Tcl_DString ds;
+    Tcl_Obj *objP;
+    int i;
+
+    /* Most names are ASCII and are copied directly */
+    for (i = 0; i + 1 < len; i += 2) {
+        if (p[i + 1] || p[i] == 0 || p[i] >= 0x80)
+            break;
+    }
+    Tcl_DStringInit(&ds);
+    Tcl_DStringSetLength(&ds, i / 2);
+    for (i = 0; i + 1 < len; i += 2) {
+        if (p[i + 1] || p[i] == 0 || p[i] >= 0x80)
+            break;
+        Tcl_DStringValue(&ds)[i / 2] = (char) p[i];
+    }
+    for (; i + 1 < len; i += 2) {
+        unsigned int ch = UsnjGetU16(p + i);
+#if TCL_MAJOR_VERSION > 8
+        /* Tcl 8 keeps surrogates as separate characters as Windows does */
+        if (ch >= 0xD800 && ch < 0xDC00 && i + 3 < len) {
+            unsigned int lo = UsnjGetU16(p + i + 2);
+            if (lo >= 0xDC00 && lo < 0xE000) {
+                ch = 0x10000 + ((ch - 0xD800) << 10) + (lo - 0xDC00);
+                i += 2;
+            }
+        }
+#endif
+        UsnjAppendUtf8(&ds, ch);
+    }
+    objP = Tcl_NewStringObj(Tcl_DStringValue(&ds), Tcl_DStringLength(&ds));
+    Tcl_DStringFree(&ds);
+    return objP;
+}
+
+/*
+ * Objects for the last value of the integer fields. Consecutive records
+ * mostly refer to the same file or directory with the same attributes so
+ * objects are shared between records, saving memory and allocations.
+ */
+enum {
+    USNJ_CACHE_FILEID, USNJ_CACHE_PARENTID, USNJ_CACHE_REASON,
+    USNJ_CACHE_SOURCEINFO, USNJ_CACHE_SECURITYID, USNJ_CACHE_ATTRS,
+    USNJ_CACHE_VERSION, USNJ_CACHE_SIZE
+};
+typedef struct UsnjCache {
+    Tcl_WideUInt keys[USNJ_CACHE_SIZE][2];
+    Tcl_Obj *objs[USNJ_CACHE_SIZE];
+} UsnjCache;
+
+static Tcl_Obj *UsnjCachedObj(UsnjCache *cacheP, int field,
+                              Tcl_WideUInt lo, Tcl_WideUInt hi)
+{
+    Tcl_WideUInt id[2];
+    Tcl_Obj *objP;
+
+    if (cacheP && cacheP->objs[field] &&
+        cacheP->keys[field][0] == lo && cacheP->keys[field][1] == hi)
+        return cacheP->objs[field];
+    id[0] = lo;
+    id[1] = hi;
+    objP = UsnjIdObj(id);
+    if (cacheP) {
+        if (cacheP->objs[field])
+            Tcl_DecrRefCount(cacheP->objs[field]);
+        Tcl_IncrRefCount(objP);
+        cacheP->objs[field] = objP;
+        cacheP->keys[field][0] = lo;
+        cacheP->keys[field][1] = hi;
+    }
+    return objP;
+}
+
+static Tcl_Obj *UsnjRecordObjCached(const UsnjRecord *recP, UsnjCache *cacheP)
+{
+    Tcl_Obj *objs[10];
+
+    objs[0] = Tcl_NewWideIntObj(recP->usn);
+    objs[1] = UsnjCachedObj(cacheP, USNJ_CACHE_FILEID,
+                            recP->file_id[0], recP->file_id[1]);
+    objs[2] = UsnjCachedObj(cacheP, USNJ_CACHE_PARENTID,
+                            recP->parent_id[0], recP->parent_id[1]);
+    objs[3] = Tcl_NewWideIntObj(recP->timestamp);
+    objs[4] = UsnjCachedObj(cacheP, USNJ_CACHE_REASON, recP->reason, 0);
+    objs[5] = UsnjCachedObj(cacheP, USNJ_CACHE_SOURCEINFO,
+                            recP->source_info, 0);
+    objs[6] = UsnjCachedObj(cacheP, USNJ_CACHE_SECURITYID,
+                            recP->security_id, 0);
+    objs[7] = UsnjCachedObj(cacheP, USNJ_CACHE_ATTRS, recP->attrs, 0);
+    objs[8] = UsnjNameObj(recP->name, recP->namelen);
+    objs[9] = UsnjCachedObj(cacheP, USNJ_CACHE_VERSION,
+                            recP->major_version, 0);
+    return Tcl_NewListObj(10, objs);
+}
+
+Tcl_Obj *UsnjRecordObj(const UsnjRecord *recP)
+{
+    return UsnjRecordObjCached(recP, NULL);
+}
+
+int UsnjDecodeBuffer(const unsigned char *buf, size_t len,
+                     Tcl_WideUInt *nextP, Tcl_Obj *recsObj, int *nskippedP)
+{
+    UsnjCache cache;
+    size_t pos;
+    int i, status = 0;
+
+    if (len < 8)
+        return USNJ_E_INVALID;
+    *nextP = UsnjGetU64(buf);
+    memset(&cache, 0, sizeof(cache));
+    for (pos = 8; pos < len; ) {
+        UsnjRecord rec;
+        unsigned int reclen;
+        status = UsnjDecodeRecord(buf + pos, len - pos, &rec, &reclen);
+        if (status == 0)
+            Tcl_ListObjAppendElement(NULL, recsObj,
+                                     UsnjRecordObjCached(&rec, &cache));
+        else if (status < 0) {
+            if (nskippedP)
+                ++*nskippedP;
+            status = 0;
+        } else
+            break;
+        pos += reclen;
+    }
+    for (i = 0; i < USNJ_CACHE_SIZE; ++i) {
+        if (cache.objs[i])
+            Tcl_DecrRefCount(cache.objs[i]);
+    }
+    return status;
+}
+
+#ifdef USNJRNL_TEST
+#include <stdlib.h>
+
+/*
+ * Standalone test. Build with
+ *   cc -DUSNJRNL_TEST usnjrnl.c -ltcl
+ *
+ * "usnj decode BYTES" returns {NEXT RECORDARRAY SKIPPED}. Buffers are
+ * built in script with binary format to match the Windows SDK layouts.
+ */
+
+static int TestUsnjObjCmd(ClientData clientdata, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[])
+{
+    const unsigned char *buf;
+    Tcl_Obj *objs[3];
+    Tcl_WideUInt next;
+    int len, status, nskipped = 0;
+
+    (void) clientdata;
+    if (objc != 3 || strcmp(Tcl_GetString(objv[1]), "decode")) {
+        Tcl_WrongNumArgs(interp, 1, objv, "decode BYTES");
+        return TCL_ERROR;
+    }
+    buf = Tcl_GetByteArrayFromObj(objv[2], &len);
+    objs[0] = UsnjFields();
+    objs[1] = Tcl_NewListObj(0, NULL);
+    status = UsnjDecodeBuffer(buf, len, &next, objs[1], &nskipped);
+    if (status) {
+        Tcl_DecrRefCount(objs[0]);
+        Tcl_DecrRefCount(objs[1]);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("usnj error %d", status));
+        return TCL_ERROR;
+    }
+    objs[1] = Tcl_NewListObj(2, objs);
+    objs[0] = Tcl_NewWideIntObj((Tcl_WideInt) next);
+    objs[2] = Tcl_NewIntObj(nskipped);
+    Tcl_SetObjResult(interp, Tcl_NewListObj(3, objs));
+    return TCL_OK;
+}
+
+static const char *testScript =
+    "proc check {script expected} {\n"
+    "    set code [catch {uplevel 1 $script} result]\n"
+    "    if {$code} {set result [list error $result]}\n"
+    "    if {$result ne $expected} {\n"
+    "        puts \"FAIL: $script\\n  got:      $result\\n  expected: $expected\"\n"
+    "        incr ::failures\n"
+    "    }\n"
+    "    incr ::checks\n"
+    "}\n"
+    "set failures 0; set checks 0\n"
+    "proc utf16 {s} {\n"
+    "    encoding convertto unicode $s\n"
+    "}\n"
+    /* Pads to a multiple of 8 as the file system does */
+    "proc pad {bytes} {\n"
+    "    set n [expr {(8 - [string length $bytes] % 8) % 8}]\n"
+    "    return $bytes[string repeat \\0 $n]\n"
+    "}\n"
+    /* Sets the length of a record and pads it to a multiple of 8 */
+    "proc finish {rec} {\n"
+    "    set n [expr {(8 - [string length $rec] % 8) % 8}]\n"
+    "    append rec [string repeat \\0 $n]\n"
+    "    return [string replace $rec 0 3 [binary format i [string length $rec]]]\n"
+    "}\n"
+    "proc v2 {frn parent usn ts reason name {src 0} {secid 0} {attrs 0x20}} {\n"
+    "    set name [utf16 $name]\n"
+    "    finish [binary format isswwwwiiiiss 0 2 0 $frn $parent $usn $ts $reason $src $secid $attrs [string length $name] 60]$name\n"
+    "}\n"
+    "proc v3 {frnhi frnlo parenthi parentlo usn ts reason name} {\n"
+    "    set name [utf16 $name]\n"
+    "    finish [binary format isswwwwwwiiiiss 0 3 0 $frnlo $frnhi $parentlo $parenthi $usn $ts $reason 0 0 0x20 [string length $name] 76]$name\n"
+    "}\n"
+    /* Range record with one extent */
+    "proc v4 {} {\n"
+    "    finish [binary format isswwwwwiiissww 0 4 0 1 0 2 0 100 0x2 0 0 1 16 0 4096]\n"
+    "}\n"
+    "proc buf {next args} {\n"
+    "    set bytes [binary format w $next]\n"
+    "    foreach rec $args {append bytes $rec}\n"
+    "    return $bytes\n"
+    "}\n"
+    "proc decode {bytes} {\n"
+    "    lassign [usnj decode $bytes] next ra skipped\n"
+    "    return [list $next $skipped [lindex $ra 1]]\n"
+    "}\n"
+    "check {lindex [usnj decode [buf 5]] 1} {{usn fileid parentid timestamp reason sourceinfo securityid attrs name version} {}}\n"
+    "check {decode [buf 5]} {5 0 {}}\n"
+    "check {decode [binary format i 5]} {error {usnj error 13}}\n"
+    "check {decode [buf 300 [v2 0x1000000000001 5 100 200 0x100 a.txt]]} {300 0 {{100 281474976710657 5 200 256 0 0 32 a.txt 2}}}\n"
+    "check {decode [buf 300 [v2 7 5 100 200 0x80000100 caf\\u00e9 1 263 0x10]]} [list 300 0 [list [list 100 7 5 200 2147483904 1 263 16 caf\\u00e9 2]]]\n"
+    "check {decode [buf 1 [v2 -1 -2 100 200 0x2 x]]} {1 0 {{100 18446744073709551615 18446744073709551614 200 2 0 0 32 x 2}}}\n"
+    "check {decode [buf 1 [v3 0 42 0 5 9 8 0x1 b] [v3 0x12 0x34 1 2 10 8 0x2 c]]} {1 0 {{9 42 5 8 1 0 0 32 b 3} {10 0x00000000000000120000000000000034 0x00000000000000010000000000000002 8 2 0 0 32 c 3}}}\n"
+    "check {decode [buf 1 [v2 1 2 3 4 5 {}] [v4] [v2 6 7 8 9 10 \\u4e2d\\u6587]]} [list 1 1 [list {3 1 2 4 5 0 0 32 {} 2} [list 8 6 7 9 10 0 0 32 \\u4e2d\\u6587 2]]]\n"
+    "check {decode [buf 1 [v2 1 2 3 4 5 [string repeat x 255]]]} [list 1 0 [list [list 3 1 2 4 5 0 0 32 [string repeat x 255] 2]]]\n"
+    /* Damaged buffers: truncated, bad lengths, name past the record */
+    "set good [v2 1 2 3 4 5 abc]\n"
+    "check {decode [string range [buf 1 $good] 0 end-1]} {error {usnj error 13}}\n"
+    "check {decode [buf 1 [string range $good 0 end-8]]} {error {usnj error 13}}\n"
+    "check {decode [buf 1 [binary format i 0][string range $good 4 end]]} {error {usnj error 13}}\n"
+    "check {decode [buf 1 [binary format i 40][string range $good 4 39]]} {error {usnj error 13}}\n"
+    "check {decode [buf 1 [binary format i 66][string range $good 4 end]]} {error {usnj error 13}}\n"
+    "check {decode [buf 1 [string replace $good 56 57 [binary format s 40]]]} {error {usnj error 13}}\n"
+    "check {decode [buf 1 [string replace $good 58 59 [binary format s 40]]]} {error {usnj error 13}}\n"
+    "check {decode [buf 1 [string replace $good 56 59 [binary format ss 4 62]]]} {1 0 {{3 1 2 4 5 0 0 32 bc 2}}}\n"
+    "check {decode [buf 1 [string replace [v3 0 1 0 2 3 4 5 x] 72 73 [binary format s 200]]]} {error {usnj error 13}}\n"
+    "check {decode [buf 1 [binary format iss 8 3 0]]} {error {usnj error 13}}\n"
+    "check {decode [buf 1 [binary format iss 8 9 0]]} {1 1 {}}\n"
+    /*
+     * A read as returned by FSCTL_READ_USN_JOURNAL: t.txt created,
+     * extended and closed, then renamed to x.log.
+     */
+    "set captured [binary decode hex [join {\n"
+    "    20f5e22a01000000 4800000002000000 5d1a000000000500 0513000000000100\n"
+    "    00f4e22a01000000 1e3e2b1c5c7dda01 0001000000000000 0000000020000000\n"
+    "    0a003c0074002e00 7400780074000000 4800000002000000 5d1a000000000500\n"
+    "    0513000000000100 48f4e22a01000000 2a3e2b1c5c7dda01 0201000000000000\n"
+    "    0000000020000000 0a003c0074002e00 7400780074000000 4800000002000000\n"
+    "    5d1a000000000500 0513000000000100 90f4e22a01000000 2d3e2b1c5c7dda01\n"
+    "    0201008000000000 0000000020000000 0a003c0074002e00 7400780074000000\n"
+    "    4800000002000000 5d1a000000000500 0513000000000100 d8f4e22a01000000\n"
+    "    b6da48205c7dda01 0010000000000000 0000000020000000 0a003c0078002e00\n"
+    "    6c006f0067000000\n"
+    "} {}]]\n"
+    "check {decode $captured} {5014484256 0 {{5014483968 1407374883560029 281474976715525 133556973523910174 256 0 0 32 t.txt 2} {5014484040 1407374883560029 281474976715525 133556973523910186 258 0 0 32 t.txt 2} {5014484112 1407374883560029 281474976715525 133556973523910189 2147483906 0 0 32 t.txt 2} {5014484184 1407374883560029 281474976715525 133556973592959670 4096 0 0 32 x.log 2}}}\n"
+    "puts \"$checks checks, $failures failures\"\n"
+    "set failures\n";
+
+static const char *benchScript =
+    /* A full 1MB read of typical records */
+    "set recs {}\n"
+    "set len 8\n"
+    "for {set i 0} {1} {incr i} {\n"
+    "    set rec [v2 [expr {0x1000000000000 + $i}] 5 [expr {1000 + 96 * $i}] 133335347386990110 0x100 file$i.txt]\n"
+    "    if {[incr len [string length $rec]] > 1048576} break\n"
+    "    lappend recs $rec\n"
+    "}\n"
+    "set bytes [buf 1 {*}$recs]\n"
+    "puts \"$i records, [string length $bytes] bytes\"\n"
+    "proc script_decode {bytes} {\n"
+    "    binary scan $bytes w next\n"
+    "    set pos 8\n"
+    "    set result {}\n"
+    "    set len [string length $bytes]\n"
+    "    while {$pos < $len} {\n"
+    "        binary scan $bytes @${pos}iususuwuwuwwiuiuiuiusus reclen major minor frn parent usn ts reason src secid attrs namelen nameoff\n"
+    "        binary scan $bytes @[expr {$pos + $nameoff}]a$namelen name\n"
+    "        lappend result [list $usn $frn $parent $ts $reason $src $secid $attrs [encoding convertfrom unicode $name] $major]\n"
+    "        incr pos $reclen\n"
+    "    }\n"
+    "    return [list $next $result]\n"
+    "}\n"
+    "proc bench {label script {n 1}} {\n"
+    "    set t [lindex [uplevel 1 [list time $script $n]] 0]\n"
+    "    puts [format {%-44s %12.1f ms} $label [expr {$t / 1000.0}]]\n"
+    "}\n"
+    "check {lindex [script_decode $bytes] 1} [lindex [decode $bytes] 2]\n"
+    "bench {script decode with binary scan} {script_decode $bytes} 3\n"
+    "bench {native decode} {usnj decode $bytes} 10\n"
+    "set failures\n";
+
+int main(int argc, char **argv)
+{
+    Tcl_Interp *interp;
+    int failures;
+
+    Tcl_FindExecutable(argv[0]);
+    interp = Tcl_CreateInterp();
+    Tcl_CreateObjCommand(interp, "usnj", TestUsnjObjCmd, NULL, NULL);
+
+    if (Tcl_Eval(interp, testScript) != TCL_OK ||
+        (argc > 1 && strcmp(argv[1], "bench") == 0 &&
+         Tcl_Eval(interp, benchScript) != TCL_OK)) {
+        fprintf(stderr, "%s\n", Tcl_GetStringResult(interp));
+        return 1;
+    }
+    failures = atoi(Tcl_GetStringResult(interp));
+    Tcl_DeleteInterp(interp);
+    return failures ? 1 : 0;
+}
+#endif /* USNJRNL_TEST */
@@ -0,0 +1,77 @@
+#ifndef USNJRNL_H
+#define USNJRNL_H
+
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Decoder for the output of FSCTL_READ_USN_JOURNAL and FSCTL_ENUM_USN_DATA.
+ * Both return an 8 byte value, the next USN or file reference number to
+ * pass in the following call, followed by a sequence of variable length
+ * USN_RECORD_V2 or USN_RECORD_V3 records. Records are bounds checked so a
+ * truncated or damaged buffer results in an error, never an invalid
+ * access. USN_RECORD_V4 range records, which are only returned when
+ * explicitly requested, are skipped.
+ *
+ * The module only depends on Tcl so it can be tested against captured
+ * buffers on any platform.
+ */
+
+#include <tcl.h>
+
+/* Error code. Default matches the corresponding Windows error. */
+#ifndef USNJ_E_INVALID
+#define USNJ_E_INVALID 13       /* ERROR_INVALID_DATA */
+#endif
+
+#define USNJ_V2_HEADER_SIZE 60  /* Offset of FileName in USN_RECORD_V2 */
+#define USNJ_V3_HEADER_SIZE 76  /* Offset of FileName in USN_RECORD_V3 */
+
+/*
+ * A decoded record. File ids of version 2 records are 64 bits, stored in
+ * the low half. name points into the buffer.
+ */
+typedef struct UsnjRecord {
+    Tcl_WideUInt file_id[2];    /* Low, high */
+    Tcl_WideUInt parent_id[2];
+    Tcl_WideInt usn;
+    Tcl_WideInt timestamp;      /* FILETIME */
+    unsigned int reason;
+    unsigned int source_info;
+    unsigned int security_id;
+    unsigned int attrs;
+    int major_version;
+    int minor_version;
+    const unsigned char *name;  /* UTF-16LE, not terminated */
+    int namelen;                /* Bytes */
+} UsnjRecord;
+
+/*
+ * Decodes the record at p, with avail bytes in the buffer, and stores its
+ * length in *lenP. Returns 0, -1 if the record has an unsupported version
+ * and should be skipped, or USNJ_E_INVALID.
+ */
+int UsnjDecodeRecord(const unsigned char *p, size_t avail, UsnjRecord *recP,
+                     unsigned int *lenP);
+
+/*
+ * Returns the record array field names for UsnjRecordObj:
+ * usn fileid parentid timestamp reason sourceinfo securityid attrs name
+ * version. File ids that do not fit in 64 bits are returned as hex.
+ */
+Tcl_Obj *UsnjFields(void);
+Tcl_Obj *UsnjRecordObj(const UsnjRecord *recP);
+
+/*
+ * Decodes a buffer of len bytes returned by one of the FSCTLs. Stores the
+ * leading next USN or file reference number in *nextP and appends a list
+ * for each record to recsObj. Returns 0 or USNJ_E_INVALID, in which case
+ * the records before the invalid one have been appended. If nskippedP is
+ * not NULL the number of skipped records is added to it.
+ */
+int UsnjDecodeBuffer(const unsigned char *buf, size_t len,
+                     Tcl_WideUInt *nextP, Tcl_Obj *recsObj, int *nskippedP);
+
+#endif /* USNJRNL_H */
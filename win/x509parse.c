@@ -0,0 +1,1229 @@
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Zero-allocation DER/X.509 certificate parser used for bulk decoding
+ * of certificate stores (see x509parse.h). Only the fields needed for
+ * inventory style listings are decoded. Anything else is skipped over
+ * after bounds checking.
+ *
+ * Build with -DX509PARSE_TEST for a standalone driver that parses,
+ * benchmarks and fuzzes a PEM corpus, or with -DX509PARSE_FUZZER for a
+ * libFuzzer entry point. The Tcl command built on this is in the
+ * _WIN32 section at the end.
+ */
+
+#include <string.h>
+#include "x509parse.h"
+
+#define DER_BOOLEAN     0x01
+#define DER_INTEGER     0x02
+#define DER_BITSTRING   0x03
+#define DER_OCTETSTRING 0x04
+#define DER_OID         0x06
+#define DER_UTF8STRING  0x0c
+#define DER_NUMERICSTRING 0x12
+#define DER_PRINTABLESTRING 0x13
+#define DER_T61STRING   0x14
+#define DER_IA5STRING   0x16
+#define DER_UTCTIME     0x17
+#define DER_GENTIME     0x18
+#define DER_VISIBLESTRING 0x1a
+#define DER_UNIVERSALSTRING 0x1c
+#define DER_BMPSTRING   0x1e
+#define DER_SEQUENCE    0x30
+#define DER_SET         0x31
+
+/* Output buffer that counts the full length even when truncating */
+typedef struct X509Out {
+    char  *buf;
+    size_t size;
+    size_t len;
+} X509Out;
+
+static void X509OutInit(X509Out *outP, char *buf, size_t size)
+{
+    outP->buf = buf;
+    outP->size = size;
+    outP->len = 0;
+}
+
+static void X509OutChar(X509Out *outP, char c)
+{
+    if (outP->len + 1 < outP->size)
+        outP->buf[outP->len] = c;
+    outP->len++;
+}
+
+static void X509OutStr(X509Out *outP, const char *s)
+{
+    while (*s)
+        X509OutChar(outP, *s++);
+}
+
+static void X509OutDecimal(X509Out *outP, unsigned long long v)
+{
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = (char) ('0' + (v % 10));
+        v /= 10;
+    } while (v);
+    while (n--)
+        X509OutChar(outP, digits[n]);
+}
+
+static void X509OutHexByte(X509Out *outP, unsigned char b)
+{
+    static const char hexdigits[] = "0123456789abcdef";
+    X509OutChar(outP, hexdigits[b >> 4]);
+    X509OutChar(outP, hexdigits[b & 0xf]);
+}
+
+static void X509OutUtf8(X509Out *outP, unsigned long cp)
+{
+    if (cp < 0x80) {
+        X509OutChar(outP, (char) cp);
+    } else if (cp < 0x800) {
+        X509OutChar(outP, (char) (0xc0 | (cp >> 6)));
+        X509OutChar(outP, (char) (0x80 | (cp & 0x3f)));
+    } else if (cp < 0x10000) {
+        X509OutChar(outP, (char) (0xe0 | (cp >> 12)));
+        X509OutChar(outP, (char) (0x80 | ((cp >> 6) & 0x3f)));
+        X509OutChar(outP, (char) (0x80 | (cp & 0x3f)));
+    } else {
+        X509OutChar(outP, (char) (0xf0 | (cp >> 18)));
+        X509OutChar(outP, (char) (0x80 | ((cp >> 12) & 0x3f)));
+        X509OutChar(outP, (char) (0x80 | ((cp >> 6) & 0x3f)));
+        X509OutChar(outP, (char) (0x80 | (cp & 0x3f)));
+    }
+}
+
+static size_t X509OutFinish(X509Out *outP)
+{
+    if (outP->size)
+        outP->buf[outP->len < outP->size ? outP->len : outP->size - 1] = 0;
+    return outP->len;
+}
+
+/*
+ * Reads one TLV at *pp. On success *pp is advanced past the value.
+ * Only single byte tags and definite lengths up to 2^32-1 are accepted,
+ * which is all DER certificates use.
+ */
+static int DerGet(const unsigned char **pp, const unsigned char *end,
+                  int *tagP, X509Span *contentP)
+{
+    const unsigned char *p = *pp;
+    size_t len, n;
+
+    if (p >= end)
+        return X509_E_TRUNCATED;
+    *tagP = *p++;
+    if ((*tagP & 0x1f) == 0x1f)
+        return X509_E_TAG;
+    if (p >= end)
+        return X509_E_TRUNCATED;
+    len = *p++;
+    if (len & 0x80) {
+        n = len & 0x7f;
+        if (n == 0 || n > 4)
+            return X509_E_LENGTH;
+        if ((size_t) (end - p) < n)
+            return X509_E_TRUNCATED;
+        len = 0;
+        while (n--)
+            len = (len << 8) | *p++;
+    }
+    if (len > (size_t) (end - p))
+        return X509_E_TRUNCATED;
+    contentP->p = p;
+    contentP->len = len;
+    *pp = p + len;
+    return X509_OK;
+}
+
+static int DerExpect(const unsigned char **pp, const unsigned char *end,
+                     int tag, X509Span *contentP)
+{
+    int actual, status;
+    const unsigned char *p = *pp;
+    status = DerGet(&p, end, &actual, contentP);
+    if (status != X509_OK)
+        return status;
+    if (actual != tag)
+        return X509_E_TAG;
+    *pp = p;
+    return X509_OK;
+}
+
+/* Returns the tag of the next element without consuming it, -1 at end */
+static int DerPeekTag(const unsigned char *p, const unsigned char *end)
+{
+    return p < end ? *p : -1;
+}
+
+static int SpanEquals(X509Span span, const unsigned char *bytes, size_t len)
+{
+    return span.len == len && memcmp(span.p, bytes, len) == 0;
+}
+
+static int ParseDigits(const unsigned char *p, int n, int *valueP)
+{
+    int v = 0;
+    while (n--) {
+        if (*p < '0' || *p > '9')
+            return 0;
+        v = v * 10 + (*p++ - '0');
+    }
+    *valueP = v;
+    return 1;
+}
+
+static int ParseTime(int tag, X509Span span, X509Time *timeP)
+{
+    const unsigned char *p = span.p;
+    size_t len = span.len;
+    int yy;
+
+    if (tag == DER_UTCTIME) {
+        if (len < 11 || !ParseDigits(p, 2, &yy))
+            return X509_E_VALUE;
+        timeP->year = yy < 50 ? 2000 + yy : 1900 + yy;
+        p += 2;
+        len -= 2;
+    } else if (tag == DER_GENTIME) {
+        if (len < 13 || !ParseDigits(p, 4, &timeP->year))
+            return X509_E_VALUE;
+        p += 4;
+        len -= 4;
+    } else {
+        return X509_E_TAG;
+    }
+
+    /* MMDDHHMM[SS]Z - fractional seconds are ignored */
+    if (!ParseDigits(p, 2, &timeP->month) ||
+        !ParseDigits(p + 2, 2, &timeP->day) ||
+        !ParseDigits(p + 4, 2, &timeP->hour) ||
+        !ParseDigits(p + 6, 2, &timeP->minute))
+        return X509_E_VALUE;
+    p += 8;
+    len -= 8;
+    timeP->second = 0;
+    if (len >= 3 && p[0] != 'Z') {
+        if (!ParseDigits(p, 2, &timeP->second))
+            return X509_E_VALUE;
+        p += 2;
+        len -= 2;
+        if (len && *p == '.') {
+            while (len && *p != 'Z') {
+                ++p;
+                --len;
+            }
+        }
+    }
+    if (len != 1 || *p != 'Z')
+        return X509_E_VALUE;
+    if (timeP->month < 1 || timeP->month > 12 ||
+        timeP->day < 1 || timeP->day > 31 ||
+        timeP->hour > 23 || timeP->minute > 59 || timeP->second > 60)
+        return X509_E_VALUE;
+    return X509_OK;
+}
+
+/* Returns the OID contents of the first element of an AlgorithmIdentifier */
+static int ParseAlgorithmId(X509Span algid, X509Span *oidP)
+{
+    const unsigned char *p = algid.p;
+    return DerExpect(&p, algid.p + algid.len, DER_OID, oidP);
+}
+
+static void ParseExtensions(X509Cert *certP)
+{
+    static const unsigned char oid_altnames[] = {0x55, 0x1d, 0x11};
+    static const unsigned char oid_enhkeyusage[] = {0x55, 0x1d, 0x25};
+    static const unsigned char oid_basicconstraints[] = {0x55, 0x1d, 0x13};
+    const unsigned char *p = certP->extensions.p;
+    const unsigned char *end = p + certP->extensions.len;
+    X509Span ext, oid, value, inner;
+    const unsigned char *q, *qend;
+    int tag;
+
+    /* Malformed extensions are skipped rather than failing the certificate */
+    while (p < end) {
+        if (DerExpect(&p, end, DER_SEQUENCE, &ext) != X509_OK)
+            return;
+        q = ext.p;
+        qend = ext.p + ext.len;
+        if (DerExpect(&q, qend, DER_OID, &oid) != X509_OK)
+            continue;
+        if (DerPeekTag(q, qend) == DER_BOOLEAN &&
+            DerGet(&q, qend, &tag, &value) != X509_OK)
+            continue;
+        if (DerExpect(&q, qend, DER_OCTETSTRING, &value) != X509_OK)
+            continue;
+
+        q = value.p;
+        qend = value.p + value.len;
+        if (SpanEquals(oid, oid_altnames, sizeof(oid_altnames))) {
+            if (DerExpect(&q, qend, DER_SEQUENCE, &inner) == X509_OK) {
+                certP->altnames = inner;
+                certP->has_altnames = 1;
+            }
+        } else if (SpanEquals(oid, oid_enhkeyusage, sizeof(oid_enhkeyusage))) {
+            if (DerExpect(&q, qend, DER_SEQUENCE, &inner) == X509_OK) {
+                certP->enhkeyusage = inner;
+                certP->has_enhkeyusage = 1;
+            }
+        } else if (SpanEquals(oid, oid_basicconstraints,
+                              sizeof(oid_basicconstraints))) {
+            if (DerExpect(&q, qend, DER_SEQUENCE, &inner) == X509_OK) {
+                q = inner.p;
+                qend = inner.p + inner.len;
+                certP->ca = 0;
+                if (DerPeekTag(q, qend) == DER_BOOLEAN &&
+                    DerGet(&q, qend, &tag, &value) == X509_OK &&
+                    value.len == 1 && value.p[0])
+                    certP->ca = 1;
+            }
+        }
+    }
+}
+
+int X509Parse(const unsigned char *der, size_t len, X509Cert *certP)
+{
+    const unsigned char *p, *end;
+    X509Span cert, tbs, span, version;
+    int tag, status;
+
+    memset(certP, 0, sizeof(*certP));
+    certP->ca = -1;
+    certP->version = 1;
+
+    p = der;
+    end = der + len;
+    if ((status = DerExpect(&p, end, DER_SEQUENCE, &cert)) != X509_OK)
+        return status;
+
+    p = cert.p;
+    end = cert.p + cert.len;
+    if ((status = DerExpect(&p, end, DER_SEQUENCE, &tbs)) != X509_OK)
+        return status;
+    /* Outer signature algorithm and signature - validated for structure only */
+    if ((status = DerExpect(&p, end, DER_SEQUENCE, &span)) != X509_OK ||
+        (status = DerExpect(&p, end, DER_BITSTRING, &span)) != X509_OK)
+        return status;
+
+    p = tbs.p;
+    end = tbs.p + tbs.len;
+    if (DerPeekTag(p, end) == 0xa0) {
+        const unsigned char *q;
+        if ((status = DerGet(&p, end, &tag, &version)) != X509_OK)
+            return status;
+        q = version.p;
+        if ((status = DerExpect(&q, version.p + version.len, DER_INTEGER,
+                                &span)) != X509_OK)
+            return status;
+        if (span.len != 1 || span.p[0] > 2)
+            return X509_E_VALUE;
+        certP->version = span.p[0] + 1;
+    }
+
+    if ((status = DerExpect(&p, end, DER_INTEGER, &certP->serial)) != X509_OK)
+        return status;
+    if (certP->serial.len == 0)
+        return X509_E_VALUE;
+
+    if ((status = DerExpect(&p, end, DER_SEQUENCE, &span)) != X509_OK ||
+        (status = ParseAlgorithmId(span, &certP->sigalg)) != X509_OK)
+        return status;
+
+    if ((status = DerExpect(&p, end, DER_SEQUENCE, &certP->issuer)) != X509_OK)
+        return status;
+
+    if ((status = DerExpect(&p, end, DER_SEQUENCE, &span)) != X509_OK)
+        return status;
+    {
+        const unsigned char *q = span.p;
+        const unsigned char *qend = span.p + span.len;
+        X509Span t;
+        if ((status = DerGet(&q, qend, &tag, &t)) != X509_OK ||
+            (status = ParseTime(tag, t, &certP->notbefore)) != X509_OK ||
+            (status = DerGet(&q, qend, &tag, &t)) != X509_OK ||
+            (status = ParseTime(tag, t, &certP->notafter)) != X509_OK)
+            return status;
+    }
+
+    if ((status = DerExpect(&p, end, DER_SEQUENCE, &certP->subject)) != X509_OK)
+        return status;
+
+    if ((status = DerExpect(&p, end, DER_SEQUENCE, &span)) != X509_OK)
+        return status;
+    {
+        const unsigned char *q = span.p;
+        X509Span algid;
+        if ((status = DerExpect(&q, span.p + span.len, DER_SEQUENCE,
+                                &algid)) != X509_OK ||
+            (status = ParseAlgorithmId(algid, &certP->keyalg)) != X509_OK)
+            return status;
+    }
+
+    /* Optional issuerUniqueID, subjectUniqueID and extensions */
+    while (p < end) {
+        if ((status = DerGet(&p, end, &tag, &span)) != X509_OK)
+            return status;
+        if (tag == 0xa3) {
+            const unsigned char *q = span.p;
+            if ((status = DerExpect(&q, span.p + span.len, DER_SEQUENCE,
+                                    &certP->extensions)) != X509_OK)
+                return status;
+            ParseExtensions(certP);
+        }
+    }
+
+    return X509_OK;
+}
+
+void X509IterInit(X509Iter *iterP, X509Span span)
+{
+    iterP->p = span.p;
+    iterP->end = span.p + span.len;
+}
+
+/* Returns 1 if an element was retrieved, 0 at end and -1 on error */
+int X509NextGeneralName(X509Iter *iterP, int *typeP, X509Span *valueP)
+{
+    int tag;
+    if (iterP->p >= iterP->end)
+        return 0;
+    if (DerGet(&iterP->p, iterP->end, &tag, valueP) != X509_OK ||
+        (tag & 0x80) == 0) {
+        iterP->p = iterP->end;
+        return -1;
+    }
+    *typeP = tag & 0x1f;
+    return 1;
+}
+
+int X509NextOid(X509Iter *iterP, X509Span *oidP)
+{
+    if (iterP->p >= iterP->end)
+        return 0;
+    if (DerExpect(&iterP->p, iterP->end, DER_OID, oidP) != X509_OK) {
+        iterP->p = iterP->end;
+        return -1;
+    }
+    return 1;
+}
+
+size_t X509FormatHex(X509Span span, char *buf, size_t size)
+{
+    X509Out out;
+    size_t i;
+    X509OutInit(&out, buf, size);
+    for (i = 0; i < span.len; ++i)
+        X509OutHexByte(&out, span.p[i]);
+    return X509OutFinish(&out);
+}
+
+static void X509OutOid(X509Out *outP, X509Span oid)
+{
+    unsigned long long arc = 0;
+    size_t i, start = outP->len;
+    int nbytes = 0, first = 1;
+
+    for (i = 0; i < oid.len; ++i) {
+        if (nbytes == 0 && oid.p[i] == 0x80)
+            break;              /* Non-minimal encoding */
+        arc = (arc << 7) | (oid.p[i] & 0x7f);
+        if (++nbytes > 9)
+            break;              /* Arc too large to format */
+        if (oid.p[i] & 0x80)
+            continue;
+        if (first) {
+            if (arc < 40) {
+                X509OutChar(outP, '0');
+            } else if (arc < 80) {
+                X509OutChar(outP, '1');
+                arc -= 40;
+            } else {
+                X509OutChar(outP, '2');
+                arc -= 80;
+            }
+            first = 0;
+        }
+        X509OutChar(outP, '.');
+        X509OutDecimal(outP, arc);
+        arc = 0;
+        nbytes = 0;
+    }
+    if (i != oid.len || nbytes || oid.len == 0) {
+        /* Not a valid OID encoding. Show raw bytes instead. */
+        outP->len = start;
+        X509OutChar(outP, '#');
+        for (i = 0; i < oid.len; ++i)
+            X509OutHexByte(outP, oid.p[i]);
+    }
+}
+
+size_t X509FormatOid(X509Span oid, char *buf, size_t size)
+{
+    X509Out out;
+    X509OutInit(&out, buf, size);
+    X509OutOid(&out, oid);
+    return X509OutFinish(&out);
+}
+
+/*
+ * Returns the next code point from a string of the given ASN.1 type.
+ * Bytes that are not valid UTF-8 in a UTF8String are treated as Latin-1.
+ * Returns 0 at end.
+ */
+static int NextCodePoint(int tag, const unsigned char **pp,
+                         const unsigned char *end, unsigned long *cpP)
+{
+    const unsigned char *p = *pp;
+    unsigned long cp;
+    int n, i;
+
+    if (p >= end)
+        return 0;
+
+    switch (tag) {
+    case DER_BMPSTRING:
+        if (end - p < 2) {
+            cp = *p++;
+            break;
+        }
+        cp = (p[0] << 8) | p[1];
+        p += 2;
+        if (cp >= 0xd800 && cp < 0xdc00 && end - p >= 2) {
+            unsigned long lo = (p[0] << 8) | p[1];
+            if (lo >= 0xdc00 && lo < 0xe000) {
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                p += 2;
+            }
+        }
+        break;
+    case DER_UNIVERSALSTRING:
+        if (end - p < 4) {
+            cp = *p++;
+            break;
+        }
+        cp = ((unsigned long) p[0] << 24) | ((unsigned long) p[1] << 16)
+            | (p[2] << 8) | p[3];
+        p += 4;
+        break;
+    case DER_UTF8STRING:
+        cp = *p;
+        n = cp >= 0xf0 && cp < 0xf5 ? 3 : cp >= 0xe0 ? (cp < 0xf0 ? 2 : 0)
+            : cp >= 0xc2 ? 1 : 0;
+        if (n && end - p > n) {
+            unsigned long v = cp & (0x3f >> n);
+            for (i = 1; i <= n; ++i) {
+                if ((p[i] & 0xc0) != 0x80)
+                    break;
+                v = (v << 6) | (p[i] & 0x3f);
+            }
+            if (i > n && v >= (n == 1 ? 0x80ul : n == 2 ? 0x800ul : 0x10000ul)
+                && v <= 0x10ffff && (v < 0xd800 || v > 0xdfff)) {
+                cp = v;
+                p += n + 1;
+                break;
+            }
+        }
+        ++p;
+        break;
+    default:
+        /* Single byte strings. T61 is treated as Latin-1. */
+        cp = *p++;
+        break;
+    }
+
+    /* Surrogates and out of range values cannot be represented */
+    if ((cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff || cp == 0)
+        cp = 0xfffd;
+    *pp = p;
+    *cpP = cp;
+    return 1;
+}
+
+static int IsStringTag(int tag)
+{
+    switch (tag) {
+    case DER_UTF8STRING: case DER_NUMERICSTRING: case DER_PRINTABLESTRING:
+    case DER_T61STRING: case DER_IA5STRING: case DER_VISIBLESTRING:
+    case DER_UNIVERSALSTRING: case DER_BMPSTRING:
+        return 1;
+    }
+    return 0;
+}
+
+static void X509OutString(X509Out *outP, int tag, X509Span value, int quote)
+{
+    const unsigned char *p = value.p;
+    const unsigned char *end = value.p + value.len;
+    unsigned long cp;
+    int needquote = 0, first = 1;
+
+    if (quote) {
+        if (value.len == 0)
+            needquote = 1;
+        while (!needquote && NextCodePoint(tag, &p, end, &cp)) {
+            if ((first || p == end) && cp == ' ')
+                needquote = 1;
+            else if (cp < 0x80 && strchr(",+=\"\n<>#;", (int) cp))
+                needquote = 1;
+            first = 0;
+        }
+        p = value.p;
+    }
+
+    if (needquote)
+        X509OutChar(outP, '"');
+    while (NextCodePoint(tag, &p, end, &cp)) {
+        if (needquote && cp == '"')
+            X509OutChar(outP, '"');
+        X509OutUtf8(outP, cp);
+    }
+    if (needquote)
+        X509OutChar(outP, '"');
+}
+
+/* Attribute type names as used by CertNameToStr */
+static const char *X509AttrName(X509Span oid)
+{
+    static const unsigned char oid_email[] =
+        {0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x09, 0x01};
+    static const unsigned char oid_dc[] =
+        {0x09, 0x92, 0x26, 0x89, 0x93, 0xf2, 0x2c, 0x64, 0x01, 0x19};
+
+    if (oid.len == 3 && oid.p[0] == 0x55 && oid.p[1] == 0x04) {
+        switch (oid.p[2]) {
+        case 3: return "CN";
+        case 4: return "SN";
+        case 5: return "SERIALNUMBER";
+        case 6: return "C";
+        case 7: return "L";
+        case 8: return "S";
+        case 9: return "STREET";
+        case 10: return "O";
+        case 11: return "OU";
+        case 12: return "T";
+        case 13: return "Description";
+        case 17: return "PostalCode";
+        case 42: return "G";
+        case 43: return "I";
+        }
+    } else if (SpanEquals(oid, oid_email, sizeof(oid_email))) {
+        return "E";
+    } else if (SpanEquals(oid, oid_dc, sizeof(oid_dc))) {
+        return "DC";
+    }
+    return NULL;
+}
+
+static void X509OutName(X509Out *outP, X509Span name)
+{
+    const unsigned char *p = name.p;
+    const unsigned char *end = name.p + name.len;
+    const unsigned char *q, *r;
+    X509Span rdn, atv, oid, value;
+    const char *attrname;
+    int tag, first_rdn = 1, first_atv;
+    size_t i;
+
+    while (p < end) {
+        if (DerExpect(&p, end, DER_SET, &rdn) != X509_OK)
+            return;
+        q = rdn.p;
+        first_atv = 1;
+        while (q < rdn.p + rdn.len) {
+            if (DerExpect(&q, rdn.p + rdn.len, DER_SEQUENCE, &atv) != X509_OK)
+                return;
+            r = atv.p;
+            if (DerExpect(&r, atv.p + atv.len, DER_OID, &oid) != X509_OK ||
+                DerGet(&r, atv.p + atv.len, &tag, &value) != X509_OK)
+                return;
+            if (!first_atv)
+                X509OutStr(outP, " + ");
+            else if (!first_rdn)
+                X509OutStr(outP, ", ");
+            first_atv = first_rdn = 0;
+
+            attrname = X509AttrName(oid);
+            if (attrname) {
+                X509OutStr(outP, attrname);
+            } else {
+                X509OutStr(outP, "OID.");
+                X509OutOid(outP, oid);
+            }
+            X509OutChar(outP, '=');
+            if (IsStringTag(tag)) {
+                X509OutString(outP, tag, value, 1);
+            } else {
+                X509OutChar(outP, '#');
+                for (i = 0; i < value.len; ++i)
+                    X509OutHexByte(outP, value.p[i]);
+            }
+        }
+    }
+}
+
+size_t X509FormatName(X509Span name, char *buf, size_t size)
+{
+    X509Out out;
+    X509OutInit(&out, buf, size);
+    X509OutName(&out, name);
+    return X509OutFinish(&out);
+}
+
+size_t X509FormatTime(const X509Time *timeP, char *buf, size_t size)
+{
+    X509Out out;
+    int fields[6], i;
+
+    fields[0] = timeP->year;
+    fields[1] = timeP->month;
+    fields[2] = timeP->day;
+    fields[3] = timeP->hour;
+    fields[4] = timeP->minute;
+    fields[5] = timeP->second;
+
+    X509OutInit(&out, buf, size);
+    X509OutChar(&out, (char) ('0' + (fields[0] / 1000) % 10));
+    X509OutChar(&out, (char) ('0' + (fields[0] / 100) % 10));
+    X509OutChar(&out, (char) ('0' + (fields[0] / 10) % 10));
+    X509OutChar(&out, (char) ('0' + fields[0] % 10));
+    for (i = 1; i < 6; ++i) {
+        X509OutChar(&out, " -- ::"[i]);
+        X509OutChar(&out, (char) ('0' + (fields[i] / 10) % 10));
+        X509OutChar(&out, (char) ('0' + fields[i] % 10));
+    }
+    return X509OutFinish(&out);
+}
+
+static void X509OutIPv6(X509Out *outP, const unsigned char *p)
+{
+    unsigned int words[8];
+    int i, best = -1, bestlen = 0, run = -1, runlen = 0;
+
+    for (i = 0; i < 8; ++i)
+        words[i] = (p[2*i] << 8) | p[2*i+1];
+
+    /* Longest run of two or more zero words is compressed (RFC 5952) */
+    for (i = 0; i < 8; ++i) {
+        if (words[i] == 0) {
+            if (run < 0) {
+                run = i;
+                runlen = 0;
+            }
+            if (++runlen > bestlen && runlen > 1) {
+                best = run;
+                bestlen = runlen;
+            }
+        } else {
+            run = -1;
+        }
+    }
+
+    for (i = 0; i < 8; ++i) {
+        if (i == best) {
+            X509OutStr(outP, "::");
+            i += bestlen - 1;
+            continue;
+        }
+        if (i && i != best + bestlen)
+            X509OutChar(outP, ':');
+        {
+            static const char hexdigits[] = "0123456789abcdef";
+            int shift, started = 0;
+            for (shift = 12; shift >= 0; shift -= 4) {
+                unsigned int nibble = (words[i] >> shift) & 0xf;
+                if (nibble || started || shift == 0) {
+                    X509OutChar(outP, hexdigits[nibble]);
+                    started = 1;
+                }
+            }
+        }
+    }
+}
+
+size_t X509FormatGeneralName(int type, X509Span value, char *buf, size_t size)
+{
+    X509Out out;
+    X509Span inner, oid;
+    const unsigned char *p;
+    int tag;
+    size_t i;
+
+    X509OutInit(&out, buf, size);
+    switch (type) {
+    case X509_GN_EMAIL:
+    case X509_GN_DNS:
+    case X509_GN_URL:
+        X509OutString(&out, DER_IA5STRING, value, 0);
+        break;
+    case X509_GN_IP:
+        if (value.len == 4) {
+            for (i = 0; i < 4; ++i) {
+                if (i)
+                    X509OutChar(&out, '.');
+                X509OutDecimal(&out, value.p[i]);
+            }
+        } else if (value.len == 16) {
+            X509OutIPv6(&out, value.p);
+        } else {
+            goto hex;
+        }
+        break;
+    case X509_GN_DIRECTORY:
+        /* Explicitly tagged Name */
+        p = value.p;
+        if (DerExpect(&p, value.p + value.len, DER_SEQUENCE, &inner) != X509_OK)
+            goto hex;
+        X509OutName(&out, inner);
+        break;
+    case X509_GN_REGISTERED:
+        X509OutOid(&out, value);
+        break;
+    case X509_GN_OTHER:
+        /* type-id OID followed by [0] EXPLICIT value */
+        p = value.p;
+        if (DerExpect(&p, value.p + value.len, DER_OID, &oid) != X509_OK ||
+            DerExpect(&p, value.p + value.len, 0xa0, &inner) != X509_OK)
+            goto hex;
+        X509OutOid(&out, oid);
+        X509OutChar(&out, '=');
+        p = inner.p;
+        if (DerGet(&p, inner.p + inner.len, &tag, &inner) == X509_OK &&
+            IsStringTag(tag)) {
+            X509OutString(&out, tag, inner, 0);
+        } else {
+            X509OutChar(&out, '#');
+            for (i = 0; i < inner.len; ++i)
+                X509OutHexByte(&out, inner.p[i]);
+        }
+        break;
+    default:
+    hex:
+        out.len = 0;
+        X509OutChar(&out, '#');
+        for (i = 0; i < value.len; ++i)
+            X509OutHexByte(&out, value.p[i]);
+        break;
+    }
+    return X509OutFinish(&out);
+}
+
+const char *X509GeneralNameType(int type)
+{
+    static const char *names[] = {
+        "other", "email", "dns", "x400", "directory", "ediparty",
+        "url", "ip", "registered"
+    };
+    return (type >= 0 && type <= 8) ? names[type] : "unknown";
+}
+
+/* Names match the twapi oid_pkix_kp_* mnemonics without the prefix */
+const char *X509EnhKeyUsageName(X509Span oid)
+{
+    static const unsigned char prefix[] =
+        {0x2b, 0x06, 0x01, 0x05, 0x05, 0x07, 0x03};
+    static const char *names[] = {
+        "server_auth", "client_auth", "code_signing", "email_protection",
+        "ipsec_end_system", "ipsec_tunnel", "ipsec_user",
+        "timestamp_signing", "ocsp_signing"
+    };
+    if (oid.len == sizeof(prefix) + 1 &&
+        memcmp(oid.p, prefix, sizeof(prefix)) == 0 &&
+        oid.p[sizeof(prefix)] >= 1 && oid.p[sizeof(prefix)] <= 9)
+        return names[oid.p[sizeof(prefix)] - 1];
+    return NULL;
+}
+
+#ifdef _WIN32
+
+#include "twapi.h"
+#include "twapi_crypto.h"
+#include "hmacsha.h"
+
+/*
+ * Formats a name (type -1) or general name into a stack buffer, falling back to
+ * the memlifo for unusually long values.
+ */
+static Tcl_Obj *TwapiObjFromX509Name(TwapiInterpContext *ticP,
+                                     int type, X509Span span)
+{
+    char buf[512];
+    char *p = buf;
+    size_t len;
+    Tcl_Obj *objP;
+
+    len = type < 0 ? X509FormatName(span, buf, sizeof(buf))
+        : X509FormatGeneralName(type, span, buf, sizeof(buf));
+    if (len >= sizeof(buf)) {
+        p = MemLifoPushFrame(ticP->memlifoP, len + 1, NULL);
+        if (type < 0)
+            X509FormatName(span, p, len + 1);
+        else
+            X509FormatGeneralName(type, span, p, len + 1);
+    }
+    objP = ObjFromStringN(p, (Tcl_Size) len);
+    if (p != buf)
+        MemLifoPopFrame(ticP->memlifoP);
+    return objP;
+}
+
+/*
+ * Formats bytes as hex. Digests fit in the stack buffer, serial numbers
+ * have no upper bound so may need the memlifo.
+ */
+static Tcl_Obj *TwapiObjFromX509Hex(TwapiInterpContext *ticP,
+                                    const unsigned char *p, size_t len)
+{
+    char buf[2 * HMACSHA_MAX_DIGEST + 1];
+    char *hex = buf;
+    X509Span span;
+    Tcl_Obj *objP;
+
+    span.p = p;
+    span.len = len;
+    len = X509FormatHex(span, buf, sizeof(buf));
+    if (len >= sizeof(buf)) {
+        hex = MemLifoPushFrame(ticP->memlifoP, len + 1, NULL);
+        X509FormatHex(span, hex, len + 1);
+    }
+    objP = ObjFromStringN(hex, (Tcl_Size) len);
+    if (hex != buf)
+        MemLifoPopFrame(ticP->memlifoP);
+    return objP;
+}
+
+/*
+ * Twapi_CertStoreRecords HSTORE
+ * Returns a recordarray with one record per certificate in the store.
+ * Certificates are decoded directly from their DER encoding instead of
+ * through CryptDecodeObjectEx field by field. Certificates that cannot
+ * be parsed only have their thumbprint fields filled in.
+ */
+int Twapi_CertStoreRecordsObjCmd(
+    ClientData clientdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    HCERTSTORE hstore;
+    PCCERT_CONTEXT certP = NULL;
+    X509Cert cert;
+    X509Iter iter;
+    X509Span span;
+    Tcl_Obj *recsObj, *listObj, *objs[9];
+    unsigned char digest[HMACSHA_MAX_DIGEST];
+    char timebuf[32];
+    const char *ekuname;
+    DWORD winerr;
+    int i, type;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETVERIFIEDPTR(hstore, HCERTSTORE, CertCloseStore),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    recsObj = ObjNewList(0, NULL);
+    /* Contexts are not registered as they never leave this loop */
+    while ((certP = CertEnumCertificatesInStore(hstore, certP)) != NULL) {
+        if (X509Parse(certP->pbCertEncoded, certP->cbCertEncoded, &cert)
+            != X509_OK) {
+            for (i = 0; i < 7; ++i)
+                objs[i] = ObjFromEmptyString();
+        } else {
+            objs[0] = TwapiObjFromX509Name(ticP, -1, cert.subject);
+            objs[1] = TwapiObjFromX509Name(ticP, -1, cert.issuer);
+            objs[2] = TwapiObjFromX509Hex(ticP, cert.serial.p, cert.serial.len);
+            X509FormatTime(&cert.notbefore, timebuf, sizeof(timebuf));
+            objs[3] = ObjFromString(timebuf);
+            X509FormatTime(&cert.notafter, timebuf, sizeof(timebuf));
+            objs[4] = ObjFromString(timebuf);
+
+            listObj = objs[5] = ObjNewList(0, NULL);
+            X509IterInit(&iter, cert.altnames);
+            while (X509NextGeneralName(&iter, &type, &span) > 0) {
+                Tcl_Obj *pair[2];
+                pair[0] = ObjFromString(X509GeneralNameType(type));
+                pair[1] = TwapiObjFromX509Name(ticP, type, span);
+                ObjAppendElement(NULL, listObj, ObjNewList(2, pair));
+            }
+
+            listObj = objs[6] = ObjNewList(0, NULL);
+            X509IterInit(&iter, cert.enhkeyusage);
+            while (X509NextOid(&iter, &span) > 0) {
+                ekuname = X509EnhKeyUsageName(span);
+                ObjAppendElement(NULL, listObj,
+                                 ekuname ? ObjFromString(ekuname) :
+                                 TwapiObjFromX509Name(ticP, X509_GN_REGISTERED,
+                                                      span));
+            }
+        }
+
+        HmacShaDigest(HMACSHA_SHA1, certP->pbCertEncoded,
+                      certP->cbCertEncoded, digest);
+        objs[7] = TwapiObjFromX509Hex(ticP, digest, 20);
+        HmacShaDigest(HMACSHA_SHA256, certP->pbCertEncoded,
+                      certP->cbCertEncoded, digest);
+        objs[8] = TwapiObjFromX509Hex(ticP, digest, 32);
+
+        ObjAppendElement(NULL, recsObj, ObjNewList(9, objs));
+    }
+    winerr = GetLastError();
+    if (winerr != CRYPT_E_NOT_FOUND && winerr != ERROR_NO_MORE_FILES) {
+        Twapi_FreeNewTclObj(recsObj);
+        return Twapi_AppendSystemError(interp, winerr);
+    }
+
+    objs[0] = STRING_LITERAL_OBJ("subject");
+    objs[1] = STRING_LITERAL_OBJ("issuer");
+    objs[2] = STRING_LITERAL_OBJ("serialnumber");
+    objs[3] = STRING_LITERAL_OBJ("start");
+    objs[4] = STRING_LITERAL_OBJ("end");
+    objs[5] = STRING_LITERAL_OBJ("altnames");
+    objs[6] = STRING_LITERAL_OBJ("enhkeyusage");
+    objs[7] = STRING_LITERAL_OBJ("sha1");
+    objs[8] = STRING_LITERAL_OBJ("sha256");
+    objs[0] = ObjNewList(9, objs);
+    objs[1] = recsObj;
+    return ObjSetResult(interp, ObjNewList(2, objs));
+}
+
+#endif /* _WIN32 */
+
+#if defined(X509PARSE_TEST) || defined(X509PARSE_FUZZER)
+#include <stdio.h>
+/*
+ * Formats every field of a certificate the way the Tcl command does.
+ * Used by the test driver and the fuzzer. Returns total output length.
+ */
+static size_t X509ExerciseCert(const unsigned char *der, size_t len, int print)
+{
+    X509Cert cert;
+    X509Iter iter;
+    X509Span span;
+    char buf[512];
+    size_t total = 0;
+    int type, status;
+
+    status = X509Parse(der, len, &cert);
+    if (status != X509_OK) {
+        if (print)
+            printf("  parse error %d\n", status);
+        return 0;
+    }
+    total += X509FormatName(cert.subject, buf, sizeof(buf));
+    if (print) printf("  subject: %s\n", buf);
+    total += X509FormatName(cert.issuer, buf, sizeof(buf));
+    if (print) printf("  issuer: %s\n", buf);
+    total += X509FormatHex(cert.serial, buf, sizeof(buf));
+    total += X509FormatOid(cert.sigalg, buf, sizeof(buf));
+    total += X509FormatOid(cert.keyalg, buf, sizeof(buf));
+    total += X509FormatTime(&cert.notbefore, buf, sizeof(buf));
+    if (print) printf("  valid: %s", buf);
+    total += X509FormatTime(&cert.notafter, buf, sizeof(buf));
+    if (print) printf(" - %s\n", buf);
+    X509IterInit(&iter, cert.altnames);
+    while (X509NextGeneralName(&iter, &type, &span) > 0) {
+        total += X509FormatGeneralName(type, span, buf, sizeof(buf));
+        if (print) printf("  altname %s: %s\n", X509GeneralNameType(type), buf);
+    }
+    X509IterInit(&iter, cert.enhkeyusage);
+    while (X509NextOid(&iter, &span) > 0) {
+        total += X509FormatOid(span, buf, sizeof(buf));
+        if (print) printf("  eku: %s\n", X509EnhKeyUsageName(span) ? X509EnhKeyUsageName(span) : buf);
+    }
+    /* Exercise truncation paths too */
+    total += X509FormatName(cert.subject, buf, 7);
+    total += X509FormatName(cert.subject, NULL, 0);
+    return total;
+}
+#endif
+
+#ifdef X509PARSE_FUZZER
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+    X509ExerciseCert(data, size, 0);
+    return 0;
+}
+#endif
+
+#ifdef X509PARSE_TEST
+/*
+ * Standalone driver.
+ *   cc -O2 -DX509PARSE_TEST x509parse.c -o x509parse_test
+ *   ./x509parse_test print FILE.pem...   - print decoded fields
+ *   ./x509parse_test bench N FILE.pem... - parse and format corpus N times
+ *   ./x509parse_test fuzz N FILE.pem...  - N random mutations per cert
+ * Run fuzz under -fsanitize=address,undefined.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static int Base64Value(int c)
+{
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+/* Appends DER certificates from a PEM file. Each is prefixed by its length */
+static size_t LoadPem(const char *path, unsigned char **corpusP, size_t *sizeP,
+                      size_t *ncertsP)
+{
+    FILE *f = fopen(path, "rb");
+    char line[1024];
+    unsigned char *der = NULL;
+    size_t derlen = 0, dercap = 0;
+    int in_cert = 0, v;
+    unsigned long acc = 0;
+    int bits = 0;
+    char *s;
+
+    if (f == NULL) {
+        perror(path);
+        exit(2);
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "-----BEGIN CERTIFICATE-----", 27) == 0) {
+            in_cert = 1;
+            derlen = 0;
+            acc = 0;
+            bits = 0;
+            continue;
+        }
+        if (strncmp(line, "-----END CERTIFICATE-----", 25) == 0) {
+            if (in_cert) {
+                *corpusP = realloc(*corpusP, *sizeP + sizeof(size_t) + derlen);
+                memcpy(*corpusP + *sizeP, &derlen, sizeof(size_t));
+                memcpy(*corpusP + *sizeP + sizeof(size_t), der, derlen);
+                *sizeP += sizeof(size_t) + derlen;
+                ++*ncertsP;
+            }
+            in_cert = 0;
+            continue;
+        }
+        if (!in_cert)
+            continue;
+        for (s = line; *s; ++s) {
+            if ((v = Base64Value((unsigned char) *s)) < 0)
+                continue;
+            acc = (acc << 6) | v;
+            bits += 6;
+            if (bits >= 8) {
+                bits -= 8;
+                if (derlen == dercap) {
+                    dercap = dercap ? 2 * dercap : 4096;
+                    der = realloc(der, dercap);
+                }
+                der[derlen++] = (unsigned char) (acc >> bits);
+            }
+        }
+    }
+    fclose(f);
+    free(der);
+    return *ncertsP;
+}
+
+static unsigned long long fuzzState = 0x9e3779b97f4a7c15ull;
+static unsigned long FuzzRand(void)
+{
+    fuzzState ^= fuzzState << 13;
+    fuzzState ^= fuzzState >> 7;
+    fuzzState ^= fuzzState << 17;
+    return (unsigned long) (fuzzState >> 16);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned char *corpus = NULL, *p, *end, *copy;
+    size_t size = 0, ncerts = 0, len, sink = 0;
+    long rounds = 1, r, m;
+    int i, first = 2, failures = 0;
+    const char *mode;
+    clock_t start;
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s print|bench N|fuzz N FILE.pem...\n", argv[0]);
+        return 2;
+    }
+    mode = argv[1];
+    if (strcmp(mode, "print")) {
+        rounds = atol(argv[2]);
+        first = 3;
+    }
+    for (i = first; i < argc; ++i)
+        LoadPem(argv[i], &corpus, &size, &ncerts);
+    end = corpus + size;
+
+    start = clock();
+    for (r = 0; r < rounds; ++r) {
+        for (p = corpus; p < end; p += len) {
+            X509Cert cert;
+            memcpy(&len, p, sizeof(size_t));
+            p += sizeof(size_t);
+            if (!strcmp(mode, "fuzz")) {
+                copy = malloc(len);
+                for (m = 0; m < 8; ++m) {
+                    size_t cut = len, k;
+                    memcpy(copy, p, len);
+                    switch (FuzzRand() % 4) {
+                    case 0:     /* Flip some bits */
+                        for (k = 0; k < 1 + FuzzRand() % 4; ++k)
+                            copy[FuzzRand() % len] ^= (unsigned char) (1 << (FuzzRand() % 8));
+                        break;
+                    case 1:     /* Truncate */
+                        cut = FuzzRand() % len;
+                        break;
+                    case 2:     /* Random byte, often hits length fields */
+                        copy[FuzzRand() % len] = (unsigned char) FuzzRand();
+                        break;
+                    case 3:     /* Maximize a length byte */
+                        k = FuzzRand() % len;
+                        copy[k] = (copy[k] & 0x80) ? 0x84 : 0x7f;
+                        break;
+                    }
+                    /* Exact size allocation so ASan catches overreads */
+                    {
+                        unsigned char *exact = malloc(cut ? cut : 1);
+                        memcpy(exact, copy, cut);
+                        sink += X509ExerciseCert(exact, cut, 0);
+                        free(exact);
+                    }
+                }
+                free(copy);
+            } else if (!strcmp(mode, "print")) {
+                printf("Certificate (%lu bytes)\n", (unsigned long) len);
+                X509ExerciseCert(p, len, 1);
+            } else {
+                sink += X509ExerciseCert(p, len, 0);
+            }
+            if (r == 0 && X509Parse(p, len, &cert) != X509_OK)
+                ++failures;
+        }
+    }
+    if (strcmp(mode, "print")) {
+        double secs = (double) (clock() - start) / CLOCKS_PER_SEC;
+        printf("%s: %lu certificates x %ld rounds in %.3f s (%.0f certs/s) [%lu]\n",
+               mode, (unsigned long) ncerts, rounds, secs,
+               secs > 0 ? ncerts * rounds / secs : 0.0, (unsigned long) sink);
+    }
+    printf("%d of %lu certificates failed to parse\n",
+           failures, (unsigned long) ncerts);
+    free(corpus);
+    return failures ? 1 : 0;
+}
+#endif
@@ -0,0 +1,87 @@
+#ifndef X509PARSE_H
+#define X509PARSE_H
+
+/*
+ * Copyright (c) 2024, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ *
+ * Minimal DER/X.509 certificate parser. Parsing does not allocate memory.
+ * Parsed fields are spans pointing into the caller's DER buffer and the
+ * formatting routines write into caller supplied buffers. Only the C
+ * library is needed so this can be built and fuzzed on any platform.
+ *
+ * All X509Format* functions return the length of the full formatted
+ * string excluding the terminating nul. If that is not less than the
+ * buffer size, the output has been truncated (but is always nul
+ * terminated if the buffer size is non-zero) and the call should be
+ * repeated with a larger buffer.
+ */
+
+#include <stddef.h>
+
+#define X509_OK             0
+#define X509_E_TRUNCATED    1   /* Length runs past end of data */
+#define X509_E_TAG          2   /* Unexpected or unsupported tag */
+#define X509_E_LENGTH       3   /* Unsupported length encoding */
+#define X509_E_VALUE        4   /* Invalid field contents */
+
+typedef struct X509Span {
+    const unsigned char *p;
+    size_t len;
+} X509Span;
+
+typedef struct X509Time {
+    int year, month, day, hour, minute, second;
+} X509Time;
+
+typedef struct X509Cert {
+    int      version;           /* 1, 2 or 3 */
+    X509Span serial;            /* INTEGER contents */
+    X509Span sigalg;            /* Signature algorithm OID contents */
+    X509Span issuer;            /* Name SEQUENCE contents */
+    X509Span subject;           /* Name SEQUENCE contents */
+    X509Time notbefore;
+    X509Time notafter;
+    X509Span keyalg;            /* Public key algorithm OID contents */
+    X509Span extensions;        /* Extensions SEQUENCE contents */
+    X509Span altnames;          /* SubjectAltName GeneralNames contents */
+    X509Span enhkeyusage;       /* ExtKeyUsage SEQUENCE OF OID contents */
+    int      has_altnames;
+    int      has_enhkeyusage;
+    int      ca;                /* BasicConstraints cA, -1 if absent */
+} X509Cert;
+
+/* Iterator over the elements of a constructed value */
+typedef struct X509Iter {
+    const unsigned char *p;
+    const unsigned char *end;
+} X509Iter;
+
+/* GeneralName context tags */
+#define X509_GN_OTHER       0
+#define X509_GN_EMAIL       1
+#define X509_GN_DNS         2
+#define X509_GN_X400        3
+#define X509_GN_DIRECTORY   4
+#define X509_GN_EDIPARTY    5
+#define X509_GN_URL         6
+#define X509_GN_IP          7
+#define X509_GN_REGISTERED  8
+
+int    X509Parse(const unsigned char *der, size_t len, X509Cert *certP);
+
+void   X509IterInit(X509Iter *iterP, X509Span span);
+int    X509NextGeneralName(X509Iter *iterP, int *typeP, X509Span *valueP);
+int    X509NextOid(X509Iter *iterP, X509Span *oidP);
+
+size_t X509FormatOid(X509Span oid, char *buf, size_t size);
+size_t X509FormatName(X509Span name, char *buf, size_t size);
+size_t X509FormatHex(X509Span span, char *buf, size_t size);
+size_t X509FormatTime(const X509Time *timeP, char *buf, size_t size);
+size_t X509FormatGeneralName(int type, X509Span value, char *buf, size_t size);
+const char *X509GeneralNameType(int type);
+const char *X509EnhKeyUsageName(X509Span oid);
+
+#endif